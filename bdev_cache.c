@@ -0,0 +1,380 @@
+/*
+ * Shared read cache of block devices
+ *
+ * The cache is split into shards by the hash of the (image id, block) key,
+ * each with its own lock, hash table and CLOCK approximation of LRU for
+ * eviction.  Lookups take the shard lock shared and only set the referenced
+ * bit of the block they hit, so that the request queues reading the same
+ * hot blocks don't serialize on it.
+ */
+
+#include <pthread.h>
+#include <string.h>
+
+#include "bdev_cache.h"
+#include "catomic.h"
+#include "logging.h"
+#include "platform.h"
+#include "queue.h"
+
+#define CACHE_BLOCK_SECTORS (VHD_BDEV_CACHE_BLOCK_SIZE / VHD_SECTOR_SIZE)
+#define CACHE_NUM_SHARDS    16
+#define CACHE_NUM_GENS      64
+
+struct cache_block {
+    char data[VHD_BDEV_CACHE_BLOCK_SIZE];
+    uint64_t image_id;
+    uint64_t block;
+    /* set on hits, cleared as the clock hand passes it */
+    atomic_bool referenced;
+    LIST_ENTRY(cache_block) hash_link;
+    TAILQ_ENTRY(cache_block) clock_link;
+};
+
+struct cache_shard {
+    pthread_rwlock_t lock;
+    LIST_HEAD(, cache_block) *buckets;
+    size_t bucket_mask;
+    /* the head is where the clock hand points */
+    TAILQ_HEAD(, cache_block) clock;
+    size_t num_blocks;
+    size_t max_blocks;
+} __attribute__((aligned(VHD_CACHELINE_SIZE)));
+
+struct vhd_bdev_cache {
+    struct cache_shard shards[CACHE_NUM_SHARDS];
+
+    /* bumped on every invalidation of the images hashing to them */
+    atomic_ulong gens[CACHE_NUM_GENS];
+
+    atomic_ulong hits;
+    atomic_ulong misses;
+};
+
+static uint64_t hash_key(uint64_t image_id, uint64_t block)
+{
+    /* the finalizer of MurmurHash3 */
+    uint64_t h = image_id * 0x9e3779b97f4a7c15ull ^ block;
+
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ull;
+    h ^= h >> 33;
+    return h;
+}
+
+static struct cache_shard *get_shard(struct vhd_bdev_cache *cache,
+                                     uint64_t hash)
+{
+    return &cache->shards[(hash >> 32) % CACHE_NUM_SHARDS];
+}
+
+static struct cache_block *shard_lookup(struct cache_shard *shard,
+                                        uint64_t hash, uint64_t image_id,
+                                        uint64_t block)
+{
+    struct cache_block *cb;
+
+    LIST_FOREACH(cb, &shard->buckets[hash & shard->bucket_mask], hash_link) {
+        if (cb->image_id == image_id && cb->block == block) {
+            return cb;
+        }
+    }
+
+    return NULL;
+}
+
+static void shard_remove(struct cache_shard *shard, struct cache_block *cb)
+{
+    LIST_REMOVE(cb, hash_link);
+    TAILQ_REMOVE(&shard->clock, cb, clock_link);
+    shard->num_blocks--;
+}
+
+/* Get a block to fill, evicting the least recently used one if full */
+static struct cache_block *shard_get_free(struct cache_shard *shard)
+{
+    struct cache_block *cb;
+
+    if (shard->num_blocks < shard->max_blocks) {
+        return vhd_alloc(sizeof(*cb));
+    }
+
+    for (;;) {
+        cb = TAILQ_FIRST(&shard->clock);
+        if (!atomic_read(&cb->referenced)) {
+            break;
+        }
+        atomic_set(&cb->referenced, false);
+        TAILQ_REMOVE(&shard->clock, cb, clock_link);
+        TAILQ_INSERT_TAIL(&shard->clock, cb, clock_link);
+    }
+
+    shard_remove(shard, cb);
+    return cb;
+}
+
+/* Position in the data of a request */
+struct sg_cursor {
+    const struct vhd_buffer *buf;
+    size_t offset;
+};
+
+/* Copy @len bytes from @data to the buffers at @cur, or back if !@to_bufs */
+static void sg_copy(struct sg_cursor *cur, void *data, size_t len,
+                    bool to_bufs)
+{
+    char *p = data;
+
+    while (len) {
+        size_t chunk = MIN(len, cur->buf->len - cur->offset);
+        char *base = (char *)cur->buf->base + cur->offset;
+
+        if (to_bufs) {
+            memcpy(base, p, chunk);
+        } else {
+            memcpy(p, base, chunk);
+        }
+        p += chunk;
+        len -= chunk;
+        cur->offset += chunk;
+        if (cur->offset == cur->buf->len) {
+            cur->buf++;
+            cur->offset = 0;
+        }
+    }
+}
+
+static void sg_skip(struct sg_cursor *cur, size_t len)
+{
+    while (len) {
+        size_t chunk = MIN(len, cur->buf->len - cur->offset);
+
+        len -= chunk;
+        cur->offset += chunk;
+        if (cur->offset == cur->buf->len) {
+            cur->buf++;
+            cur->offset = 0;
+        }
+    }
+}
+
+struct vhd_bdev_cache *vhd_bdev_cache_new(size_t max_bytes)
+{
+    struct vhd_bdev_cache *cache;
+    size_t max_blocks = max_bytes / VHD_BDEV_CACHE_BLOCK_SIZE /
+                        CACHE_NUM_SHARDS;
+    size_t num_buckets = 1;
+    unsigned i;
+
+    if (!max_blocks) {
+        VHD_LOG_ERROR("cache size %zu is less than %u blocks", max_bytes,
+                      CACHE_NUM_SHARDS);
+        return NULL;
+    }
+
+    while (num_buckets < max_blocks) {
+        num_buckets <<= 1;
+    }
+
+    cache = vhd_zalloc(sizeof(*cache));
+    for (i = 0; i < CACHE_NUM_SHARDS; i++) {
+        struct cache_shard *shard = &cache->shards[i];
+
+        pthread_rwlock_init(&shard->lock, NULL);
+        shard->buckets = vhd_calloc(num_buckets, sizeof(shard->buckets[0]));
+        shard->bucket_mask = num_buckets - 1;
+        TAILQ_INIT(&shard->clock);
+        shard->max_blocks = max_blocks;
+    }
+
+    return cache;
+}
+
+void vhd_bdev_cache_free(struct vhd_bdev_cache *cache)
+{
+    unsigned i;
+
+    for (i = 0; i < CACHE_NUM_SHARDS; i++) {
+        struct cache_shard *shard = &cache->shards[i];
+
+        while (!TAILQ_EMPTY(&shard->clock)) {
+            struct cache_block *cb = TAILQ_FIRST(&shard->clock);
+            shard_remove(shard, cb);
+            vhd_free(cb);
+        }
+        vhd_free(shard->buckets);
+        pthread_rwlock_destroy(&shard->lock);
+    }
+
+    vhd_free(cache);
+}
+
+void vhd_bdev_cache_get_stat(struct vhd_bdev_cache *cache,
+                             struct vhd_bdev_cache_stat *stat)
+{
+    unsigned i;
+
+    *stat = (struct vhd_bdev_cache_stat) {
+        .hits = atomic_read(&cache->hits),
+        .misses = atomic_read(&cache->misses),
+    };
+
+    for (i = 0; i < CACHE_NUM_SHARDS; i++) {
+        struct cache_shard *shard = &cache->shards[i];
+
+        pthread_rwlock_rdlock(&shard->lock);
+        stat->bytes += shard->num_blocks * VHD_BDEV_CACHE_BLOCK_SIZE;
+        pthread_rwlock_unlock(&shard->lock);
+    }
+}
+
+bool vhd_bdev_cache_read(struct vhd_bdev_cache *cache, uint64_t image_id,
+                         const struct vhd_bdev_io *bdev_io)
+{
+    struct sg_cursor cur = { .buf = bdev_io->sglist.buffers };
+    uint64_t sector = bdev_io->first_sector;
+    uint64_t end = sector + bdev_io->total_sectors;
+
+    while (sector < end) {
+        uint64_t block = sector / CACHE_BLOCK_SECTORS;
+        uint64_t skip = sector % CACHE_BLOCK_SECTORS;
+        uint64_t len = MIN(end - sector, CACHE_BLOCK_SECTORS - skip);
+        uint64_t hash = hash_key(image_id, block);
+        struct cache_shard *shard = get_shard(cache, hash);
+        struct cache_block *cb;
+
+        pthread_rwlock_rdlock(&shard->lock);
+        cb = shard_lookup(shard, hash, image_id, block);
+        if (!cb) {
+            pthread_rwlock_unlock(&shard->lock);
+            atomic_inc(&cache->misses);
+            return false;
+        }
+        if (!atomic_read(&cb->referenced)) {
+            atomic_set(&cb->referenced, true);
+        }
+        sg_copy(&cur, cb->data + skip * VHD_SECTOR_SIZE,
+                len * VHD_SECTOR_SIZE, true);
+        pthread_rwlock_unlock(&shard->lock);
+
+        sector += len;
+    }
+
+    atomic_inc(&cache->hits);
+    return true;
+}
+
+static atomic_ulong *image_gen(struct vhd_bdev_cache *cache,
+                               uint64_t image_id)
+{
+    return &cache->gens[hash_key(image_id, 0) % CACHE_NUM_GENS];
+}
+
+uint64_t vhd_bdev_cache_gen(struct vhd_bdev_cache *cache, uint64_t image_id)
+{
+    return atomic_load_acquire(image_gen(cache, image_id));
+}
+
+void vhd_bdev_cache_fill(struct vhd_bdev_cache *cache, uint64_t image_id,
+                         const struct vhd_bdev_io *bdev_io, uint64_t gen)
+{
+    struct sg_cursor cur = { .buf = bdev_io->sglist.buffers };
+    uint64_t sector = bdev_io->first_sector;
+    uint64_t end = sector + bdev_io->total_sectors;
+
+    while (sector < end) {
+        uint64_t block = sector / CACHE_BLOCK_SECTORS;
+        uint64_t skip = sector % CACHE_BLOCK_SECTORS;
+        uint64_t len = MIN(end - sector, CACHE_BLOCK_SECTORS - skip);
+        uint64_t hash = hash_key(image_id, block);
+        struct cache_shard *shard = get_shard(cache, hash);
+        struct cache_block *cb;
+
+        sector += len;
+
+        if (len != CACHE_BLOCK_SECTORS) {
+            sg_skip(&cur, len * VHD_SECTOR_SIZE);
+            continue;
+        }
+
+        pthread_rwlock_wrlock(&shard->lock);
+        /*
+         * An invalidation bumps the generation before taking the shard lock,
+         * so either it's seen here or it drops the block once inserted
+         */
+        if (atomic_load_acquire(image_gen(cache, image_id)) != gen) {
+            pthread_rwlock_unlock(&shard->lock);
+            return;
+        }
+        if (shard_lookup(shard, hash, image_id, block)) {
+            pthread_rwlock_unlock(&shard->lock);
+            sg_skip(&cur, VHD_BDEV_CACHE_BLOCK_SIZE);
+            continue;
+        }
+
+        cb = shard_get_free(shard);
+        sg_copy(&cur, cb->data, VHD_BDEV_CACHE_BLOCK_SIZE, false);
+        cb->image_id = image_id;
+        cb->block = block;
+        atomic_set(&cb->referenced, false);
+        LIST_INSERT_HEAD(&shard->buckets[hash & shard->bucket_mask], cb,
+                         hash_link);
+        TAILQ_INSERT_TAIL(&shard->clock, cb, clock_link);
+        shard->num_blocks++;
+        pthread_rwlock_unlock(&shard->lock);
+    }
+}
+
+void vhd_bdev_cache_invalidate(struct vhd_bdev_cache *cache,
+                               uint64_t image_id, uint64_t first_sector,
+                               uint64_t total_sectors)
+{
+    uint64_t first_block = first_sector / CACHE_BLOCK_SECTORS;
+    uint64_t end_block = (first_sector + total_sectors + CACHE_BLOCK_SECTORS -
+                          1) / CACHE_BLOCK_SECTORS;
+    uint64_t block;
+    unsigned i;
+
+    if (!total_sectors) {
+        return;
+    }
+
+    atomic_fetch_add(image_gen(cache, image_id), 1);
+
+    /* look the blocks up one by one unless there are more than cached */
+    if (end_block - first_block <=
+        cache->shards[0].max_blocks * CACHE_NUM_SHARDS) {
+        for (block = first_block; block < end_block; block++) {
+            uint64_t hash = hash_key(image_id, block);
+            struct cache_shard *shard = get_shard(cache, hash);
+            struct cache_block *cb;
+
+            pthread_rwlock_wrlock(&shard->lock);
+            cb = shard_lookup(shard, hash, image_id, block);
+            if (cb) {
+                shard_remove(shard, cb);
+            }
+            pthread_rwlock_unlock(&shard->lock);
+            vhd_free(cb);
+        }
+        return;
+    }
+
+    for (i = 0; i < CACHE_NUM_SHARDS; i++) {
+        struct cache_shard *shard = &cache->shards[i];
+        struct cache_block *cb, *next;
+
+        pthread_rwlock_wrlock(&shard->lock);
+        for (cb = TAILQ_FIRST(&shard->clock); cb; cb = next) {
+            next = TAILQ_NEXT(cb, clock_link);
+            if (cb->image_id == image_id && cb->block >= first_block &&
+                cb->block < end_block) {
+                shard_remove(shard, cb);
+                vhd_free(cb);
+            }
+        }
+        pthread_rwlock_unlock(&shard->lock);
+    }
+}
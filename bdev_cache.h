@@ -0,0 +1,51 @@
+/*
+ * Shared read cache of block devices, see struct vhd_bdev_cache in
+ * vhost/blockdev.h.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "vhost/blockdev.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Fill the buffers of VHD_BDEV_READ @bdev_io from the cached blocks of
+ * @image_id.  Returns true if all of the data was found in the cache, false
+ * if the request has to go to the backend (in which case the buffers may
+ * have been partially filled).
+ */
+bool vhd_bdev_cache_read(struct vhd_bdev_cache *cache, uint64_t image_id,
+                         const struct vhd_bdev_io *bdev_io);
+
+/*
+ * Generation of the cached contents of @image_id, to be taken before
+ * submitting a read to the backend and passed to vhd_bdev_cache_fill() once
+ * it completes: the data read is only cached if no blocks of the image have
+ * been invalidated meanwhile, as it may be stale then.
+ */
+uint64_t vhd_bdev_cache_gen(struct vhd_bdev_cache *cache, uint64_t image_id);
+
+/*
+ * Cache the blocks of @image_id completely covered by the data of the
+ * successfully completed VHD_BDEV_READ @bdev_io
+ */
+void vhd_bdev_cache_fill(struct vhd_bdev_cache *cache, uint64_t image_id,
+                         const struct vhd_bdev_io *bdev_io, uint64_t gen);
+
+/*
+ * Drop the cached blocks of @image_id overlapping the sector range, to be
+ * called both on submission and on completion of requests modifying it
+ */
+void vhd_bdev_cache_invalidate(struct vhd_bdev_cache *cache,
+                               uint64_t image_id, uint64_t first_sector,
+                               uint64_t total_sectors);
+
+#ifdef __cplusplus
+}
+#endif
@@ -22,6 +22,12 @@ struct vhd_bio {
 
     void (*completion_handler)(struct vhd_bio *bio);
 
+    /* descriptor chain head, for tracing */
+    uint16_t head;
+
+    /* start time of each processing phase, for latency accounting */
+    uint64_t phase_start_ns[VHD_REQ_PHASE_COUNT];
+
     TAILQ_ENTRY(vhd_bio) submission_link;
     SLIST_ENTRY(vhd_bio) completion_link;
 };
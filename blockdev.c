@@ -7,6 +7,7 @@
 #include "logging.h"
 
 #include "bio.h"
+#include "io_stat.h"
 #include "virtio/virtio_blk.h"
 
 struct vhd_bdev {
@@ -18,12 +19,8 @@ struct vhd_bdev {
 
     /* VM-facing interface type */
     struct virtio_blk_dev vblk;
-
-    LIST_ENTRY(vhd_bdev) blockdevs;
 };
 
-static LIST_HEAD(, vhd_bdev) g_bdev_list = LIST_HEAD_INITIALIZER(g_bdev_list);
-
 #define VHD_BLOCKDEV_FROM_VDEV(ptr) containerof(ptr, struct vhd_bdev, vdev)
 #define VHD_VRING_FROM_VQ(ptr) containerof(ptr, struct vhd_vring, vq)
 
@@ -31,10 +28,8 @@ static LIST_HEAD(, vhd_bdev) g_bdev_list = LIST_HEAD_INITIALIZER(g_bdev_list);
 
 static uint64_t vblk_get_features(struct vhd_vdev *vdev)
 {
-    struct vhd_bdev_info *bdev = VHD_BLOCKDEV_FROM_VDEV(vdev)->bdev;
-
-    return VIRTIO_BLK_DEFAULT_FEATURES |
-        (bdev->readonly ? (1U << VIRTIO_BLK_F_RO) : 0);
+    struct vhd_bdev *dev = VHD_BLOCKDEV_FROM_VDEV(vdev);
+    return virtio_blk_get_features(&dev->vblk);
 }
 
 static int vblk_set_features(struct vhd_vdev *vdev, uint64_t features)
@@ -72,7 +67,6 @@ static void vblk_free(struct vhd_vdev *vdev)
 {
     struct vhd_bdev *bdev = VHD_BLOCKDEV_FROM_VDEV(vdev);
 
-    LIST_REMOVE(bdev, blockdevs);
     vhd_free(bdev);
 }
 
@@ -85,17 +79,55 @@ static const struct vhd_vdev_type g_virtio_blk_vdev_type = {
     .free               = vblk_free,
 };
 
+/*
+ * Give the read continuing the sequential read stream on the vring the range
+ * to read ahead, as large as the @run_sectors read in a row so far
+ */
+static void readahead_hint(struct vhd_bdev *dev, uint64_t run_sectors,
+                           struct vhd_bdev_io *bdev_io)
+{
+    uint64_t capacity = dev->bdev->total_blocks * dev->bdev->block_size /
+        VHD_SECTOR_SIZE;
+    uint64_t end = bdev_io->first_sector + bdev_io->total_sectors;
+
+    if (run_sectors == bdev_io->total_sectors || end >= capacity) {
+        return;
+    }
+
+    bdev_io->readahead_sectors = MIN(MIN(run_sectors,
+                                         dev->bdev->max_readahead_sectors),
+                                     capacity - end);
+}
+
+/* Called on each guest read or write before it's split */
+static void vblk_track_request(struct virtio_virtq *vq,
+                               struct vhd_bdev_io *bdev_io)
+{
+    struct vhd_vring *vring = VHD_VRING_FROM_VQ(vq);
+    struct vhd_bdev *dev = VHD_BLOCKDEV_FROM_VDEV(vring->vdev);
+    uint64_t run_sectors = vhd_io_stat_account_stream(vring->io_stat,
+                                                      bdev_io);
+
+    if (bdev_io->type == VHD_BDEV_READ && dev->bdev->max_readahead_sectors) {
+        readahead_hint(dev, run_sectors, bdev_io);
+    }
+}
+
 static int vblk_handle_request(struct virtio_virtq *vq, struct vhd_bio *bio)
 {
-    bio->vring = VHD_VRING_FROM_VQ(vq);
-    return vhd_enqueue_block_request(bio->vring->vdev->rq, bio);
+    struct vhd_vring *vring = VHD_VRING_FROM_VQ(vq);
+
+    bio->vring = vring;
+    if (bio->bdev_io.type == VHD_BDEV_READ ||
+        bio->bdev_io.type == VHD_BDEV_WRITE) {
+        vhd_io_stat_account_submit(vring->io_stat, &bio->bdev_io);
+    }
+    return vhd_enqueue_block_request(vring->rq, bio);
 }
 
-struct vhd_vdev *vhd_register_blockdev(struct vhd_bdev_info *bdev,
-                                       struct vhd_request_queue *rq,
-                                       void *priv)
+static struct vhd_bdev *blockdev_new(struct vhd_bdev_info *bdev)
 {
-    int res;
+    struct vhd_bdev *dev;
 
     if (!bdev->total_blocks || !bdev->block_size) {
         VHD_LOG_ERROR("Zero blockdev capacity %" PRIu64 " * %" PRIu32,
@@ -111,28 +143,151 @@ struct vhd_vdev *vhd_register_blockdev(struct vhd_bdev_info *bdev,
         return NULL;
     }
 
-    struct vhd_bdev *dev = vhd_zalloc(sizeof(*dev));
+    if (bdev->min_io_size % bdev->block_size ||
+        bdev->opt_io_size % bdev->block_size ||
+        bdev->min_io_size >> VHD_SECTOR_SHIFT > UINT16_MAX) {
+        VHD_LOG_ERROR("Bad I/O size hints (min %" PRIu32 ", opt %" PRIu32 ")"
+                      " for block size %" PRIu32, bdev->min_io_size,
+                      bdev->opt_io_size, bdev->block_size);
+        return NULL;
+    }
 
-    res = virtio_blk_init_dev(&dev->vblk, bdev, vblk_handle_request);
-    if (res != 0) {
-        goto error_out;
+    if (bdev->alignment_offset % VHD_SECTOR_SIZE ||
+        bdev->alignment_offset >= bdev->block_size ||
+        bdev->alignment_offset >> VHD_SECTOR_SHIFT > UINT8_MAX) {
+        VHD_LOG_ERROR("Bad alignment offset %" PRIu32 " for block size %"
+                      PRIu32, bdev->alignment_offset, bdev->block_size);
+        return NULL;
     }
 
-    res = vhd_vdev_init_server(&dev->vdev, bdev->socket_path, &g_virtio_blk_vdev_type,
-                               bdev->num_queues, rq, priv, bdev->map_cb,
-                               bdev->unmap_cb);
-    if (res != 0) {
-        goto error_out;
+    dev = vhd_zalloc(sizeof(*dev));
+    if (virtio_blk_init_dev(&dev->vblk, bdev, vblk_handle_request) != 0) {
+        vhd_free(dev);
+        return NULL;
     }
+    dev->vblk.track = vblk_track_request;
 
     dev->bdev = bdev;
+    return dev;
+}
+
+/*
+ * Prepare the device to be started listening on its socket with
+ * vhd_vdev_start_servers()
+ */
+static struct vhd_vdev *prepare_blockdev(struct vhd_bdev_info *bdev,
+                                         struct vhd_request_queue **rqs,
+                                         int num_rqs, void *priv)
+{
+    struct vhd_bdev *dev = blockdev_new(bdev);
+    if (!dev) {
+        return NULL;
+    }
+
+    if (vhd_vdev_prepare_server(&dev->vdev, bdev->socket_path,
+                                &g_virtio_blk_vdev_type, bdev->num_queues,
+                                rqs, num_rqs, priv, bdev->map_cb,
+                                bdev->unmap_cb, &bdev->mem_policy) != 0) {
+        vhd_free(dev);
+        return NULL;
+    }
+
+    if (bdev->postcopy) {
+        vhd_vdev_enable_postcopy(&dev->vdev);
+    }
 
-    LIST_INSERT_HEAD(&g_bdev_list, dev, blockdevs);
     return &dev->vdev;
+}
+
+/* Register the device handed over via @handover_sock */
+static struct vhd_vdev *register_blockdev(struct vhd_bdev_info *bdev,
+                                          struct vhd_request_queue **rqs,
+                                          int num_rqs, void *priv,
+                                          int handover_sock)
+{
+    int res;
+    struct vhd_bdev *dev = blockdev_new(bdev);
+    if (!dev) {
+        return NULL;
+    }
+
+    res = vhd_vdev_init_handover(&dev->vdev, bdev->socket_path,
+                                 &g_virtio_blk_vdev_type,
+                                 bdev->num_queues, rqs, num_rqs, priv,
+                                 bdev->map_cb, bdev->unmap_cb,
+                                 &bdev->mem_policy, handover_sock);
+    if (res != 0) {
+        vhd_free(dev);
+        return NULL;
+    }
 
-error_out:
-    vhd_free(dev);
-    return NULL;
+    return &dev->vdev;
+}
+
+struct vhd_vdev *vhd_register_blockdev_mq(struct vhd_bdev_info *bdev,
+                                          struct vhd_request_queue **rqs,
+                                          int num_rqs,
+                                          void *priv)
+{
+    struct vhd_bdev_registration reg = {
+        .bdev = bdev,
+        .rqs = rqs,
+        .num_rqs = num_rqs,
+        .priv = priv,
+    };
+
+    vhd_register_blockdevs(&reg, 1);
+    return reg.vdev;
+}
+
+int vhd_register_blockdevs(struct vhd_bdev_registration *regs, int num)
+{
+    struct vhd_vdev **vdevs = vhd_calloc(num, sizeof(vdevs[0]));
+    int *results = vhd_calloc(num, sizeof(results[0]));
+    int num_prepared = 0;
+    int num_started;
+    int i, j;
+
+    for (i = 0; i < num; i++) {
+        regs[i].vdev = prepare_blockdev(regs[i].bdev, regs[i].rqs,
+                                        regs[i].num_rqs, regs[i].priv);
+        if (regs[i].vdev) {
+            vdevs[num_prepared++] = regs[i].vdev;
+        }
+    }
+
+    num_started = vhd_vdev_start_servers(vdevs, results, num_prepared);
+
+    /* the devices failing to start have been released */
+    for (i = 0, j = 0; i < num; i++) {
+        if (regs[i].vdev && results[j++] != 0) {
+            regs[i].vdev = NULL;
+        }
+    }
+
+    vhd_free(results);
+    vhd_free(vdevs);
+    return num_started;
+}
+
+struct vhd_vdev *vhd_register_blockdev_handover(struct vhd_bdev_info *bdev,
+                                                struct vhd_request_queue **rqs,
+                                                int num_rqs,
+                                                void *priv,
+                                                int sock)
+{
+    if (sock < 0) {
+        return NULL;
+    }
+
+    return register_blockdev(bdev, rqs, num_rqs, priv, sock);
+}
+
+struct vhd_vdev *vhd_register_blockdev(struct vhd_bdev_info *bdev,
+                                       struct vhd_request_queue *rq,
+                                       void *priv)
+{
+    return vhd_register_blockdev_mq(bdev, &rq, 1, priv);
 }
 
 void vhd_unregister_blockdev(struct vhd_vdev *vdev,
@@ -140,3 +295,9 @@ void vhd_unregister_blockdev(struct vhd_vdev *vdev,
 {
     vhd_vdev_stop_server(vdev, unregister_complete, arg);
 }
+
+int vhd_handover_blockdev(struct vhd_vdev *vdev, int sock,
+                          void (*unregister_complete)(void *), void *arg)
+{
+    return vhd_vdev_handover(vdev, sock, unregister_complete, arg);
+}
@@ -0,0 +1,162 @@
+/*
+ * Aligned bounce buffers of block devices
+ *
+ * The pool is a single mapping split into buffers of the same size, backed
+ * by hugetlb pages if there are any to spare and transparent huge pages
+ * otherwise, for the backend not to walk (or pin) many small pages doing
+ * direct I/O to them.  The free buffers are kept on a stack under a lock:
+ * a buffer is only taken per bounced request, so it's not worth sharding.
+ */
+
+#include <pthread.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "bounce_pool.h"
+#include "catomic.h"
+#include "logging.h"
+#include "platform.h"
+
+struct vhd_bounce_pool {
+    pthread_mutex_t lock;
+    char *area;
+    size_t area_size;
+    size_t buf_size;
+    uint32_t align;
+
+    /* indices of the free buffers */
+    unsigned *free;
+    unsigned num_free;
+    unsigned num_bufs;
+
+    atomic_ulong bounced;
+    atomic_ulong allocated;
+};
+
+static void *map_area(size_t size, size_t *mapped_size)
+{
+    size_t huge_size = VHD_ALIGN_UP(size, 2ul << 20);
+    void *area;
+
+    area = mmap(NULL, huge_size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (area != MAP_FAILED) {
+        *mapped_size = huge_size;
+        return area;
+    }
+
+    area = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (area == MAP_FAILED) {
+        VHD_LOG_ERROR("mmap(%zu): %s", size, strerror(errno));
+        return NULL;
+    }
+
+    if (madvise(area, size, MADV_HUGEPAGE) < 0) {
+        VHD_LOG_WARN("madvise(%p-%p, MADV_HUGEPAGE): %s", area,
+                     (char *)area + size, strerror(errno));
+    }
+
+    *mapped_size = size;
+    return area;
+}
+
+struct vhd_bounce_pool *vhd_bounce_pool_new(uint32_t align, size_t buf_size,
+                                            unsigned num_bufs)
+{
+    struct vhd_bounce_pool *pool;
+    unsigned i;
+
+    if (!align || (align & (align - 1)) ||
+        align > (uint32_t)sysconf(_SC_PAGESIZE)) {
+        VHD_LOG_ERROR("bad bounce buffer alignment %u", align);
+        return NULL;
+    }
+
+    if (!buf_size || !num_bufs) {
+        VHD_LOG_ERROR("empty bounce buffer pool");
+        return NULL;
+    }
+
+    pool = vhd_zalloc(sizeof(*pool));
+    pool->align = align;
+    pool->buf_size = VHD_ALIGN_UP(buf_size, align);
+    pool->area = map_area(pool->buf_size * num_bufs, &pool->area_size);
+    if (!pool->area) {
+        vhd_free(pool);
+        return NULL;
+    }
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pool->free = vhd_calloc(num_bufs, sizeof(pool->free[0]));
+    for (i = 0; i < num_bufs; i++) {
+        pool->free[i] = num_bufs - 1 - i;
+    }
+    pool->num_free = pool->num_bufs = num_bufs;
+
+    return pool;
+}
+
+void vhd_bounce_pool_free(struct vhd_bounce_pool *pool)
+{
+    VHD_ASSERT(pool->num_free == pool->num_bufs);
+
+    munmap(pool->area, pool->area_size);
+    pthread_mutex_destroy(&pool->lock);
+    vhd_free(pool->free);
+    vhd_free(pool);
+}
+
+void vhd_bounce_pool_get_stat(struct vhd_bounce_pool *pool,
+                              struct vhd_bounce_pool_stat *stat)
+{
+    *stat = (struct vhd_bounce_pool_stat) {
+        .bounced = atomic_read(&pool->bounced),
+        .allocated = atomic_read(&pool->allocated),
+    };
+
+    pthread_mutex_lock(&pool->lock);
+    stat->bufs_in_use = pool->num_bufs - pool->num_free;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+uint32_t vhd_bounce_pool_align(struct vhd_bounce_pool *pool)
+{
+    return pool->align;
+}
+
+void *vhd_bounce_pool_get(struct vhd_bounce_pool *pool, size_t len)
+{
+    unsigned idx = pool->num_bufs;
+
+    atomic_inc(&pool->bounced);
+
+    if (len <= pool->buf_size) {
+        pthread_mutex_lock(&pool->lock);
+        if (pool->num_free) {
+            idx = pool->free[--pool->num_free];
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    if (idx == pool->num_bufs) {
+        atomic_inc(&pool->allocated);
+        return vhd_aligned_alloc(pool->align, VHD_ALIGN_UP(len, pool->align));
+    }
+
+    return pool->area + (size_t)idx * pool->buf_size;
+}
+
+void vhd_bounce_pool_put(struct vhd_bounce_pool *pool, void *buf)
+{
+    char *p = buf;
+
+    if (p < pool->area || p >= pool->area + pool->buf_size * pool->num_bufs) {
+        vhd_free(buf);
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->free[pool->num_free++] = (p - pool->area) / pool->buf_size;
+    pthread_mutex_unlock(&pool->lock);
+}
@@ -0,0 +1,31 @@
+/*
+ * Aligned bounce buffers of block devices, see struct vhd_bounce_pool in
+ * vhost/blockdev.h.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "vhost/blockdev.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Alignment of the buffers the pool hands out */
+uint32_t vhd_bounce_pool_align(struct vhd_bounce_pool *pool);
+
+/*
+ * Get an aligned buffer of at least @len bytes: from the pool if it fits and
+ * the pool isn't exhausted, from the heap otherwise.  Never fails.
+ */
+void *vhd_bounce_pool_get(struct vhd_bounce_pool *pool, size_t len);
+
+/* Return the buffer obtained with vhd_bounce_pool_get() */
+void vhd_bounce_pool_put(struct vhd_bounce_pool *pool, void *buf);
+
+#ifdef __cplusplus
+}
+#endif
@@ -28,12 +28,21 @@ compiler-flag = $(shell \
 	echo "$(3)")
 cc-flag = $(call compiler-flag,$(CC),c,$(1))
 
+cc-has-header = $(shell \
+	$(CC) $(CPPFLAGS) -E -x c -include $(1) /dev/null >/dev/null 2>&1 && \
+	echo 1)
+
 CFLAGS += \
 	$(call cc-flag,-Wmissing-prototypes) \
 	$(call cc-flag,-Wmissing-variable-declarations) \
 	$(call cc-flag,-Wzero-length-array) \
 	$(call cc-flag,-Wzero-length-bounds)
 
+# the io_uring backend needs liburing; WITH_URING=0/1 overrides detection
+ifeq ($(origin WITH_URING),undefined)
+WITH_URING := $(call cc-has-header,liburing.h)
+endif
+
 # FIXME: build agents have ancient clang which needs explicit C++ version
 CXX += -std=c++11
 
@@ -42,11 +51,16 @@ CFLAGS += -fsanitize=address
 LDFLAGS += -fsanitize=address
 endif
 
+ifeq ($(WITH_TRACE),1)
+DEFINES += -DVHD_TRACE
+endif
+
 ifeq ($(WITH_VALGRIND),1)
 TEST_RUNNER = valgrind --leak-check=full --error-exitcode=1 -v
 endif
 
 VHD_LIB = $(SRCROOT)/libvhost-server.a
+VHD_URING_LIB = $(SRCROOT)/uring/libvhost-uring.a
 
 DEPS = $(patsubst %.o,%.d,$(OBJS))
 CHECK_RUNS = $(patsubst %,%-check,$(TESTS))
@@ -1,5 +1,7 @@
 #include <errno.h>
+#include <pthread.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <sys/epoll.h>
 #include <sys/eventfd.h>
@@ -48,6 +50,13 @@ struct vhd_event_loop {
     int notifyfd;
     atomic_bool notified;
 
+    /*
+     * The home thread is between a blocking vhd_run_event_loop() and the
+     * next one, which checks for bhs before blocking, so scheduling one needn't
+     * kick the eventfd; see evloop_notify()
+     */
+    atomic_bool awake;
+
     /* vhd_terminate_event_loop has been completed */
     bool is_terminated;
 
@@ -63,10 +72,23 @@ struct vhd_event_loop {
     atomic_bool has_home_thread;
 
     SLIST_HEAD(, vhd_io_handler) deleted_handlers;
+
+    /* time of the latest return from epoll_wait, see vhd_time_ns() */
+    uint64_t now_ns;
 };
 
 static void evloop_notify(struct vhd_event_loop *evloop)
 {
+    /*
+     * Paired with the barrier in vhd_run_event_loop() before it blocks:
+     * either the home thread sees the bh just enqueued or this one sees it
+     * going to sleep
+     */
+    smp_mb();
+    if (atomic_read(&evloop->awake)) {
+        return;
+    }
+
     if (!atomic_xchg(&evloop->notified, true)) {
         vhd_set_eventfd(evloop->notifyfd);
     }
@@ -177,6 +199,11 @@ static bool bh_poll(struct vhd_event_loop *ctx)
     unsigned flags;
     bool ret = false;
 
+    /* cheap check first, as this is done on every iteration */
+    if (!SLIST_FIRST_RCU(&ctx->bh_list)) {
+        return false;
+    }
+
     SLIST_INIT(&bh_list);
     /* swap bh list from ctx for a fresh one */
     SLIST_MOVE_ATOMIC(&bh_list, &ctx->bh_list);
@@ -224,6 +251,8 @@ struct vhd_io_handler {
     /* FIXME: must really include write handler as well */
     void *opaque;
 
+    /* monitored edge-triggered */
+    bool edge;
     bool attached;
     SLIST_ENTRY(vhd_io_handler) deleted_entry;
 };
@@ -271,11 +300,31 @@ static int handle_events(struct vhd_event_loop *evloop, int nevents)
     return nerr;
 }
 
+static uint64_t clock_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* reference point for measuring the rate of vhd_cycles() */
+static pthread_once_t cycles_base_once = PTHREAD_ONCE_INIT;
+static uint64_t cycles_base;
+static uint64_t cycles_base_ns;
+
+static void cycles_base_init(void)
+{
+    cycles_base_ns = clock_now_ns();
+    cycles_base = vhd_cycles();
+}
+
 struct vhd_event_loop *vhd_create_event_loop(size_t max_events)
 {
     int notifyfd;
     int epollfd;
 
+    pthread_once(&cycles_base_once, cycles_base_init);
+
     epollfd = epoll_create1(EPOLL_CLOEXEC);
     if (epollfd < 0) {
         VHD_LOG_ERROR("epoll_create1: %s", strerror(errno));
@@ -320,6 +369,45 @@ close_epoll:
 
 static __thread struct vhd_event_loop *home_evloop;
 
+uint64_t vhd_time_ns(void)
+{
+    /* not set until the first iteration */
+    if (home_evloop) {
+        return home_evloop->now_ns;
+    }
+    return clock_now_ns();
+}
+
+uint64_t vhd_clock_ns(void)
+{
+    return clock_now_ns();
+}
+
+uint64_t vhd_cycles_to_ns(uint64_t cycles)
+{
+    uint64_t elapsed_cycles, elapsed_ns;
+
+    pthread_once(&cycles_base_once, cycles_base_init);
+    elapsed_ns = clock_now_ns() - cycles_base_ns;
+    elapsed_cycles = vhd_cycles() - cycles_base;
+    /* too early to tell the rate */
+    if (!elapsed_cycles || !elapsed_ns) {
+        return cycles;
+    }
+
+    return (unsigned __int128)cycles * elapsed_ns / elapsed_cycles;
+}
+
+bool vhd_in_event_loop(struct vhd_event_loop *evloop)
+{
+    return evloop == home_evloop;
+}
+
+int vhd_event_loop_fd(struct vhd_event_loop *evloop)
+{
+    return evloop->epollfd;
+}
+
 int vhd_run_event_loop(struct vhd_event_loop *evloop, int timeout_ms)
 {
     if (!home_evloop) {
@@ -333,22 +421,36 @@ int vhd_run_event_loop(struct vhd_event_loop *evloop, int timeout_ms)
         return 0;
     }
 
+    /*
+     * The bhs scheduled while the thread is awake don't kick the eventfd, so
+     * look for them before blocking.  Non-blocking callers are assumed to
+     * wait for vhd_event_loop_fd() elsewhere and keep the eventfd kicked.
+     */
+    bool block = timeout_ms != 0;
+    atomic_set(&evloop->awake, false);
+    smp_mb(); /* paired with evloop_notify() */
+    if (block && SLIST_FIRST_RCU(&evloop->bh_list)) {
+        timeout_ms = 0;
+    }
+
     int nev = epoll_wait(evloop->epollfd, evloop->events, evloop->max_events,
                          timeout_ms);
-    if (!nev) {
-        return -EAGAIN;
-    } else if (nev < 0) {
+    evloop->now_ns = clock_now_ns();
+    if (nev < 0) {
         int ret = -errno;
-        if (ret == -EINTR) {
-            return -EAGAIN;
+        if (ret != -EINTR) {
+            VHD_LOG_ERROR("epoll_wait internal error: %s", strerror(-ret));
+            return ret;
         }
-
-        VHD_LOG_ERROR("epoll_wait internal error: %s", strerror(-ret));
-        return ret;
+        nev = 0;
     }
 
+    atomic_set(&evloop->awake, block);
     notify_accept(evloop);
     bh_poll(evloop);
+    if (!nev) {
+        return -EAGAIN;
+    }
 
     int nerr = handle_events(evloop, nev);
     if (nerr) {
@@ -404,7 +506,8 @@ int vhd_attach_io_handler(struct vhd_io_handler *handler)
     int fd = handler->fd;
 
     struct epoll_event ev = {
-        .events = EPOLLIN | EPOLLHUP | EPOLLRDHUP,
+        .events = EPOLLIN | EPOLLHUP | EPOLLRDHUP |
+            (handler->edge ? EPOLLET : 0),
         .data.ptr = handler
     };
 
@@ -425,9 +528,10 @@ int vhd_attach_io_handler(struct vhd_io_handler *handler)
     return 0;
 }
 
-struct vhd_io_handler *vhd_add_io_handler(struct vhd_event_loop *evloop,
-                                          int fd, int (*read)(void *opaque),
-                                          void *opaque)
+static struct vhd_io_handler *add_io_handler(struct vhd_event_loop *evloop,
+                                             int fd,
+                                             int (*read)(void *opaque),
+                                             void *opaque, bool edge)
 {
     struct vhd_io_handler *handler;
 
@@ -436,7 +540,8 @@ struct vhd_io_handler *vhd_add_io_handler(struct vhd_event_loop *evloop,
             .evloop = evloop,
             .fd = fd,
             .read = read,
-            .opaque = opaque
+            .opaque = opaque,
+            .edge = edge,
     };
 
     if (vhd_attach_io_handler(handler) < 0) {
@@ -450,6 +555,21 @@ fail:
     return NULL;
 }
 
+struct vhd_io_handler *vhd_add_io_handler(struct vhd_event_loop *evloop,
+                                          int fd, int (*read)(void *opaque),
+                                          void *opaque)
+{
+    return add_io_handler(evloop, fd, read, opaque, false);
+}
+
+struct vhd_io_handler *vhd_add_edge_io_handler(struct vhd_event_loop *evloop,
+                                               int fd,
+                                               int (*read)(void *opaque),
+                                               void *opaque)
+{
+    return add_io_handler(evloop, fd, read, opaque, true);
+}
+
 int vhd_detach_io_handler(struct vhd_io_handler *handler)
 {
     struct vhd_event_loop *evloop = handler->evloop;
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stdint.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -39,6 +40,11 @@ void vhd_free_event_loop(struct vhd_event_loop *evloop);
  * @timeout     0 to return immediately, -1 to block indefinitely, milliseconds
  *              value otherwise.
  *
+ * Between a blocking call and the next one the event loop fd isn't signaled
+ * for the bottom halves scheduled meanwhile, as the next call runs them
+ * before blocking anyway; it only is after non-blocking calls, for the thread
+ * to wait for it outside of the event loop.
+ *
  * @return      0 if the event loop is terminated upon request
  *              -EAGAIN if the event loop should keep going
  *              another negative code on error
@@ -50,6 +56,42 @@ int vhd_run_event_loop(struct vhd_event_loop *evloop, int timeout_ms);
  */
 void vhd_terminate_event_loop(struct vhd_event_loop *evloop);
 
+/**
+ * CLOCK_MONOTONIC time in nanoseconds as of the latest wakeup of the event
+ * loop run by the calling thread, or the current time if the thread doesn't
+ * run an event loop.
+ *
+ * The clock is read once per event loop iteration; this makes timestamping
+ * every event and request handled in the iteration nearly free, at the cost of
+ * ignoring the time spent handling the preceding ones in the same iteration.
+ */
+uint64_t vhd_time_ns(void);
+
+/**
+ * CLOCK_MONOTONIC time in nanoseconds read on the call, for where the time
+ * spent in the current iteration matters, e.g. to decide how long to sleep.
+ */
+uint64_t vhd_clock_ns(void);
+
+/*
+ * Convert a vhd_cycles() interval to nanoseconds, at the counter rate
+ * measured against CLOCK_MONOTONIC since the first event loop was created.
+ * Meant for the statistics paths: it reads both clocks on every call.
+ */
+uint64_t vhd_cycles_to_ns(uint64_t cycles);
+
+/*
+ * Whether the calling thread is the one running @evloop.
+ */
+bool vhd_in_event_loop(struct vhd_event_loop *evloop);
+
+/*
+ * File descriptor which becomes readable whenever vhd_run_event_loop() has
+ * something to do, for monitoring @evloop from another event loop (which has
+ * to run it non-blocking for that).
+ */
+int vhd_event_loop_fd(struct vhd_event_loop *evloop);
+
 /* I/O handling to be associated with a file descriptor */
 struct vhd_io_handler;
 
@@ -61,6 +103,15 @@ struct vhd_io_handler *vhd_add_io_handler(struct vhd_event_loop *evloop,
                                           int fd, int (*read)(void *),
                                           void *opaque);
 
+/*
+ * Same as vhd_add_io_handler() but monitor @fd edge-triggered: @read is only
+ * called when @fd gets new data, and needn't drain it.  With an eventfd that
+ * means once per write, even if its counter is never reset.
+ */
+struct vhd_io_handler *vhd_add_edge_io_handler(struct vhd_event_loop *evloop,
+                                               int fd, int (*read)(void *),
+                                               void *opaque);
+
 /*
  * Stop monitoring io handler @handler's file descriptor and calling its
  * handler functions.
@@ -1,3 +1,5 @@
+#include <inttypes.h>
+
 #include "vhost/fs.h"
 #include "virtio/virtio_fs.h"
 
@@ -15,14 +17,13 @@ struct vhd_fsdev {
     /* Client backend */
     struct vhd_fsdev_info *fsdev;
 
+    /* DAX cache window size, 0 if none */
+    uint64_t cache_size;
+
     /* VM-facing interface type */
     struct virtio_fs_dev vfs;
-
-    LIST_ENTRY(vhd_fsdev) fsdevs;
 };
 
-static LIST_HEAD(, vhd_fsdev) g_fsdev_list = LIST_HEAD_INITIALIZER(g_fsdev_list);
-
 #define VHD_FSDEV_FROM_VDEV(ptr) containerof(ptr, struct vhd_fsdev, vdev)
 #define VHD_VRING_FROM_VQ(ptr) containerof(ptr, struct vhd_vring, vq)
 
@@ -65,19 +66,20 @@ static int vfs_dispatch_requests(struct vhd_vdev *vdev,
 static int vfs_handle_request(struct virtio_virtq *vq, struct vhd_bio *bio)
 {
     bio->vring = VHD_VRING_FROM_VQ(vq);
-    return vhd_enqueue_block_request(bio->vring->vdev->rq, bio);
+    return vhd_enqueue_block_request(bio->vring->rq, bio);
 }
 
 static void vfs_free(struct vhd_vdev *vdev)
 {
     struct vhd_fsdev *dev = VHD_FSDEV_FROM_VDEV(vdev);
 
-    LIST_REMOVE(dev, fsdevs);
     vhd_free(dev);
 }
 
 static const struct vhd_vdev_type g_virtio_fs_vdev_type = {
     .desc               = "virtio-fs",
+    .protocol_features  = 1UL << VHOST_USER_PROTOCOL_F_SLAVE_REQ,
+    .priority_vrings    = 1UL << VIRTIO_FS_HIPRIO_QUEUE,
     .get_features       = vfs_get_features,
     .set_features       = vfs_set_features,
     .get_config         = vfs_get_config,
@@ -90,29 +92,63 @@ static const struct vhd_vdev_type g_virtio_fs_vdev_type = {
 struct vhd_vdev *vhd_register_fs(struct vhd_fsdev_info *fsdev,
                                  struct vhd_request_queue *rq,
                                  void *priv)
+{
+    return vhd_register_fs_mq(fsdev, &rq, 1, priv);
+}
+
+struct vhd_vdev *vhd_register_fs_mq(struct vhd_fsdev_info *fsdev,
+                                    struct vhd_request_queue **rqs,
+                                    int num_rqs,
+                                    void *priv)
 {
     VHD_VERIFY(fsdev);
-    VHD_VERIFY(rq);
+    VHD_VERIFY(rqs);
+    VHD_VERIFY(num_rqs > 0);
+
+    if (!fsdev->num_queues) {
+        VHD_LOG_ERROR("%s: no queues, not even the hiprio one",
+                      fsdev->socket_path);
+        return NULL;
+    }
 
     struct vhd_fsdev *dev = vhd_zalloc(sizeof(*dev));
+    struct vhd_request_queue **vring_rqs = NULL;
+    uint32_t i;
+
+    dev->cache_size = fsdev->cache_size;
 
     int res = virtio_fs_init_dev(&dev->vfs, fsdev, vfs_handle_request);
     if (res != 0) {
         goto error_out;
     }
 
+    /*
+     * The hiprio queue gets the first rq to itself if there are more, the
+     * request queues are spread over the rest
+     */
+    vring_rqs = vhd_calloc(fsdev->num_queues, sizeof(vring_rqs[0]));
+    for (i = 0; i < fsdev->num_queues; i++) {
+        if (i == VIRTIO_FS_HIPRIO_QUEUE || num_rqs == 1) {
+            vring_rqs[i] = rqs[0];
+        } else {
+            vring_rqs[i] = rqs[1 + (i - 1) % (num_rqs - 1)];
+        }
+    }
+
     res = vhd_vdev_init_server(&dev->vdev, fsdev->socket_path, &g_virtio_fs_vdev_type,
-                               fsdev->num_queues, rq, priv, NULL, NULL);
+                               fsdev->num_queues, vring_rqs,
+                               fsdev->num_queues, priv, NULL, NULL,
+                               NULL);
     if (res != 0) {
         goto error_out;
     }
 
+    vhd_free(vring_rqs);
     dev->fsdev = fsdev;
-
-    LIST_INSERT_HEAD(&g_fsdev_list, dev, fsdevs);
     return &dev->vdev;
 
 error_out:
+    vhd_free(vring_rqs);
     vhd_free(dev);
     return NULL;
 }
@@ -123,3 +159,74 @@ void vhd_unregister_fs(struct vhd_vdev *vdev,
 {
     vhd_vdev_stop_server(vdev, unregister_complete, arg);
 }
+
+/******************************************************************************/
+
+static int vfs_map_request(struct vhd_vdev *vdev, uint32_t req, int fd,
+                           const struct vhd_fs_map_extent *extents,
+                           size_t count)
+{
+    struct vhd_fsdev *dev = VHD_FSDEV_FROM_VDEV(vdev);
+    size_t i, j;
+    int ret;
+
+    if (!dev->cache_size) {
+        VHD_OBJ_ERROR(vdev, "no DAX cache window");
+        return -EOPNOTSUPP;
+    }
+
+    for (i = 0; i < count; i++) {
+        const struct vhd_fs_map_extent *ext = &extents[i];
+
+        if (!ext->len || ext->cache_offset > dev->cache_size ||
+            ext->len > dev->cache_size - ext->cache_offset) {
+            VHD_OBJ_ERROR(vdev, "extent 0x%" PRIx64 "+0x%" PRIx64
+                          " is outside of the DAX cache window 0x%" PRIx64,
+                          ext->cache_offset, ext->len, dev->cache_size);
+            return -EINVAL;
+        }
+    }
+
+    for (i = 0; i < count; i += VHOST_USER_FS_SLAVE_ENTRIES) {
+        struct vhost_user_fs_slave_msg msg = {};
+        size_t n = MIN(count - i, VHOST_USER_FS_SLAVE_ENTRIES);
+
+        for (j = 0; j < n; j++) {
+            const struct vhd_fs_map_extent *ext = &extents[i + j];
+
+            msg.c_offset[j] = ext->cache_offset;
+            msg.len[j] = ext->len;
+            if (fd >= 0) {
+                msg.fd_offset[j] = ext->fd_offset;
+                msg.flags[j] =
+                    (ext->flags & VHD_FS_MAP_READ ?
+                     VHOST_USER_FS_FLAG_MAP_R : 0) |
+                    (ext->flags & VHD_FS_MAP_WRITE ?
+                     VHOST_USER_FS_FLAG_MAP_W : 0);
+            }
+        }
+
+        ret = vhd_vdev_slave_request(vdev, req, &msg, sizeof(msg),
+                                     fd >= 0 ? &fd : NULL, fd >= 0);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    return 0;
+}
+
+int vhd_fs_map(struct vhd_vdev *vdev, int fd,
+               const struct vhd_fs_map_extent *extents, size_t count)
+{
+    VHD_VERIFY(fd >= 0);
+
+    return vfs_map_request(vdev, VHOST_USER_SLAVE_FS_MAP, fd, extents, count);
+}
+
+int vhd_fs_unmap(struct vhd_vdev *vdev,
+                 const struct vhd_fs_map_extent *extents, size_t count)
+{
+    return vfs_map_request(vdev, VHOST_USER_SLAVE_FS_UNMAP, -1, extents,
+                           count);
+}
@@ -9,7 +9,10 @@ extern "C" {
 #endif
 
 struct vhd_request_queue;
+struct vhd_request;
 struct vhd_vdev;
+struct vhd_bdev_cache;
+struct vhd_bounce_pool;
 
 #define VHD_SECTOR_SHIFT    (9)
 #define VHD_SECTOR_SIZE     (1ull << VHD_SECTOR_SHIFT)
@@ -35,11 +38,143 @@ struct vhd_bdev_info {
 
     bool readonly;
 
-    /* Gets called after mapping guest memory region */
+    /*
+     * The device has a volatile write cache, so the guest issues
+     * VHD_BDEV_FLUSH requests to make the data it wrote persistent.
+     */
+    bool writeback_cache;
+
+    /*
+     * Maximum number of sectors in a single range of VHD_BDEV_DISCARD and
+     * VHD_BDEV_WRITE_ZEROES requests; 0 if the request type isn't supported.
+     */
+    uint32_t max_discard_sectors;
+    uint32_t max_write_zeroes_sectors;
+
+    /*
+     * Maximum number of ranges in a single VHD_BDEV_DISCARD and
+     * VHD_BDEV_WRITE_ZEROES request; 0 means 1.
+     */
+    uint32_t max_discard_segments;
+    uint32_t max_write_zeroes_segments;
+
+    /*
+     * Request shape hints for the guest block layer, to make it issue
+     * requests the backend can process without splitting them.  The largest
+     * request the guest may issue is max_segments * max_segment_size bytes.
+     */
+
+    /*
+     * Maximum size in bytes of a single data buffer in a request; 0 means no
+     * limit.  Guests may round it up to their page size.
+     */
+    uint32_t max_segment_size;
+
+    /*
+     * Maximum number of data buffers in a request; 0 means 126.  Guests
+     * clamp it to the virtqueue size minus 2 when not using indirect
+     * descriptors.
+     */
+    uint32_t max_segments;
+
+    /*
+     * Minimum and optimal (suggested maximum) I/O size in bytes; must be
+     * multiples of block_size, 0 means no preference.
+     */
+    uint32_t min_io_size;
+    uint32_t opt_io_size;
+
+    /*
+     * Offset in bytes of the first sector aligned to block_size; must be a
+     * multiple of the sector size smaller than block_size.
+     */
+    uint32_t alignment_offset;
+
+    /*
+     * Merge the data buffers of VHD_BDEV_READ and VHD_BDEV_WRITE requests
+     * adjacent in the process address space (e.g. guest pages contiguous in
+     * guest memory) into a single buffer, up to max_segment_size bytes if
+     * set, so that the backend gets fewer and larger buffers.
+     */
+    bool merge_buffers;
+
+    /*
+     * Merge the VHD_BDEV_READ or VHD_BDEV_WRITE requests to contiguous
+     * sectors fetched from a virtqueue together into a single backend request
+     * of up to this many sectors (and max_segments data buffers, if set), so
+     * that the backend gets fewer and larger requests; 0 disables merging.
+     * The requests merged are completed together, and count as one against
+     * the in-flight limits, see vhd_set_queue_max_in_flight().
+     */
+    uint32_t max_merged_sectors;
+
+    /*
+     * Split the VHD_BDEV_READ and VHD_BDEV_WRITE requests spanning several
+     * multiples of this many sectors (e.g. the chunks of a distributed
+     * backend) into one backend request per part, each with the part of the
+     * guest data buffers it covers; the guest request is completed once all
+     * of its parts are, failed if any of them fails.  Each part counts
+     * against the in-flight limits, see vhd_set_queue_max_in_flight().
+     * 0 disables splitting.
+     */
+    uint64_t split_boundary_sectors;
+
+    /*
+     * Detect sequential VHD_BDEV_READ streams on each virtqueue and pass the
+     * backend a readahead hint of up to this many sectors along with the
+     * reads continuing them, see vhd_bdev_io.readahead_sectors; the hint grows
+     * with the stream, from the size of the read, starting with the second
+     * read in a row.  The stream is made of the guest reads, of which the
+     * ones split at split_boundary_sectors carry the hint in the last part.
+     * 0 disables.
+     */
+    uint32_t max_readahead_sectors;
+
+    /*
+     * Turn the VHD_BDEV_WRITE requests whose data is all zeroes (e.g. from
+     * the guest formatting or zeroing the disk) into single-range
+     * VHD_BDEV_WRITE_ZEROES ones, for a thin-provisioned backend not to store
+     * them as data.  The range may be deallocated if detect_zeroes_unmap is
+     * set too.  Only done for the requests within max_write_zeroes_sectors.
+     */
+    bool detect_zeroes;
+    bool detect_zeroes_unmap;
+
+    /*
+     * Shared read cache to serve VHD_BDEV_READ requests from (NULL if none),
+     * and the id of the device contents in it, see vhd_bdev_cache_new()
+     */
+    struct vhd_bdev_cache *cache;
+    uint64_t cache_image_id;
+
+    /*
+     * Pool of aligned buffers to bounce the misaligned data buffers of
+     * VHD_BDEV_READ and VHD_BDEV_WRITE requests through (NULL if none), see
+     * vhd_bounce_pool_new()
+     */
+    struct vhd_bounce_pool *bounce_pool;
+
+    /*
+     * Gets called after mapping guest memory region.  Returns negative error
+     * code, or the id to tag the data buffers in the region with, see
+     * vhd_buffer.region_id.
+     */
     int (*map_cb)(void *addr, size_t len, void *priv);
 
     /* Gets called before unmapping guest memory region */
     int (*unmap_cb)(void *addr, size_t len, void *priv);
+
+    /* How to map guest memory regions */
+    struct vhd_mem_policy mem_policy;
+
+    /*
+     * Let the guest be live migrated in postcopy mode
+     * (VHOST_USER_PROTOCOL_F_PAGEFAULT): the guest memory is then registered
+     * with a userfaultfd, and the threads touching the pages not migrated yet,
+     * the request queue ones and the backend's own, block until the master
+     * gets them over.  Requires userfaultfd to be usable by the process.
+     */
+    bool postcopy;
 };
 
 /**
@@ -56,12 +191,212 @@ struct vhd_vdev *vhd_register_blockdev(struct vhd_bdev_info *bdev,
                                        struct vhd_request_queue *rq,
                                        void *priv);
 
+/**
+ * Register vhost block device with its queues spread across several request
+ * queues.
+ *
+ * Same as vhd_register_blockdev(), but virtio queue i of the device is
+ * permanently attached to request queue @rqs[i % @num_rqs], so that the I/O
+ * of a single multi-queue device can be processed by several threads.
+ *
+ * @bdev        Caller block device info.
+ * @rqs         Request queues to dispatch device I/O requests to.
+ * @num_rqs     Number of elements in @rqs.
+ * @priv        Caller private data to associate with resulting vdev.
+ */
+struct vhd_vdev *vhd_register_blockdev_mq(struct vhd_bdev_info *bdev,
+                                          struct vhd_request_queue **rqs,
+                                          int num_rqs,
+                                          void *priv);
+
+/**
+ * Block device to register with vhd_register_blockdevs()
+ */
+struct vhd_bdev_registration {
+    /* Same as the arguments of vhd_register_blockdev_mq() */
+    struct vhd_bdev_info *bdev;
+    struct vhd_request_queue **rqs;
+    int num_rqs;
+    void *priv;
+
+    /* Set to the registered device, or NULL if it failed to register */
+    struct vhd_vdev *vdev;
+};
+
+/**
+ * Register several vhost block devices at once.
+ *
+ * Same as vhd_register_blockdev_mq() for each of @regs, except that all the
+ * devices are started with a single round trip to each control thread rather
+ * than one per device, so that daemons serving many devices start quickly.
+ * The devices failing to register don't affect the others.
+ *
+ * Returns the number of devices registered.
+ */
+int vhd_register_blockdevs(struct vhd_bdev_registration *regs, int num);
+
 /**
  * Unregister vhost block device.
  */
 void vhd_unregister_blockdev(struct vhd_vdev *vdev,
                              void (*unregister_complete)(void *), void *arg);
 
+/**
+ * Live handover of block devices to another process, e.g. to upgrade the
+ * backend without the clients noticing more than a short I/O pause.
+ *
+ * vhd_handover_blockdev() waits for the requests in flight to complete,
+ * sends the device state along with its file descriptors over the connected
+ * blocking unix socket @sock, and unregisters the device in this process,
+ * leaving the client connected.  Returns 0 on success; -EBUSY if the device
+ * is in the middle of a control message exchange or migration, in which case
+ * it's left intact and the handover may be retried; -ENOTCONN if there's no
+ * client, in which case the device may just be unregistered and registered
+ * anew in the other process; other errors mean the state couldn't be sent
+ * and the client got disconnected to start over.
+ *
+ * vhd_register_blockdev_handover() registers the device in the receiving
+ * process from the state read from @sock; @bdev must describe the same
+ * device, except for the callbacks.  The client resumes where it left off;
+ * if the state can't be resumed, it's disconnected to start over.
+ *
+ * Both are blocking and should be called for each device in turn, in the
+ * same order on both ends of @sock.
+ */
+int vhd_handover_blockdev(struct vhd_vdev *vdev, int sock,
+                          void (*unregister_complete)(void *), void *arg);
+
+struct vhd_vdev *vhd_register_blockdev_handover(struct vhd_bdev_info *bdev,
+                                                struct vhd_request_queue **rqs,
+                                                int num_rqs,
+                                                void *priv,
+                                                int sock);
+
+/**
+ * Shared read cache
+ *
+ * Keeps the data read by the VHD_BDEV_READ requests of the devices using it
+ * in VHD_BDEV_CACHE_BLOCK_SIZE blocks keyed by the cache_image_id of the
+ * device and the block number, so that reads of the same blocks through any
+ * of those devices are then completed from memory right in the request
+ * queue, without reaching the backend; e.g. the reads of many VMs booting
+ * from the same image.  The least recently used blocks are evicted as the
+ * cache fills up.
+ *
+ * Devices may only share an image id if their contents are the same, e.g.
+ * read-only devices of the same image; the blocks written, discarded or
+ * zeroed through a device are dropped from the cache for its image id.
+ */
+#define VHD_BDEV_CACHE_BLOCK_SIZE   4096
+
+/**
+ * Create a cache of up to @max_bytes of data.
+ * Returns NULL if @max_bytes is too small to be split across the cache
+ * shards.
+ */
+struct vhd_bdev_cache *vhd_bdev_cache_new(size_t max_bytes);
+
+/**
+ * Destroy the cache, once no registered devices use it.
+ */
+void vhd_bdev_cache_free(struct vhd_bdev_cache *cache);
+
+struct vhd_bdev_cache_stat {
+    /* VHD_BDEV_READ requests completed from the cache and passed through */
+    uint64_t hits;
+    uint64_t misses;
+
+    /* amount of data cached */
+    uint64_t bytes;
+};
+
+/**
+ * Get the cache statistics.  May be called in any thread.
+ */
+void vhd_bdev_cache_get_stat(struct vhd_bdev_cache *cache,
+                             struct vhd_bdev_cache_stat *stat);
+
+/**
+ * Aligned bounce buffers
+ *
+ * Backends doing direct I/O (e.g. to files opened with O_DIRECT) need the
+ * data buffers aligned to the logical block size of the storage, which the
+ * guest doesn't guarantee.  The runs of data buffers of VHD_BDEV_READ and
+ * VHD_BDEV_WRITE requests that aren't aligned (in address or length) are
+ * passed to the backend in a buffer from the pool of the device instead:
+ * the data is copied into it on submission of writes and out of it on
+ * completion of reads.  The aligned data buffers are passed as is.
+ *
+ * The bounce buffers aren't in guest memory, their region_id is 0.
+ */
+
+/**
+ * Create a pool of @num_bufs buffers of @buf_size bytes aligned to @align,
+ * a power of two up to the page size, which may be shared by devices.  The
+ * requests whose misaligned data doesn't fit, or find the pool exhausted,
+ * get a buffer allocated on the heap.
+ * Returns NULL on invalid arguments or if the memory can't be mapped.
+ */
+struct vhd_bounce_pool *vhd_bounce_pool_new(uint32_t align, size_t buf_size,
+                                            unsigned num_bufs);
+
+/**
+ * Destroy the pool, once no registered devices use it.
+ */
+void vhd_bounce_pool_free(struct vhd_bounce_pool *pool);
+
+struct vhd_bounce_pool_stat {
+    /* requests bounced, and those of them that got a heap buffer */
+    uint64_t bounced;
+    uint64_t allocated;
+
+    /* pool buffers currently taken */
+    uint64_t bufs_in_use;
+};
+
+/**
+ * Get the pool statistics.  May be called in any thread.
+ */
+void vhd_bounce_pool_get_stat(struct vhd_bounce_pool *pool,
+                              struct vhd_bounce_pool_stat *stat);
+
+/**
+ * Null block backend
+ *
+ * Completes the requests submitted to it successfully without doing any I/O,
+ * either inline in the submitting thread or from a completion thread of its
+ * own, the way backends completing asynchronous I/O do.  Serving a device
+ * with it measures the overhead of the library itself, e.g. the request rate
+ * a single request queue thread can sustain.
+ */
+struct vhd_null_bdev;
+
+enum {
+    /* fill the buffers of VHD_BDEV_READ requests with zeroes */
+    VHD_NULL_BDEV_ZERO_READS = 1 << 0,
+    /* complete requests in a dedicated thread rather than inline */
+    VHD_NULL_BDEV_COMPLETION_THREAD = 1 << 1,
+};
+
+/**
+ * Create a null backend with VHD_NULL_BDEV_* @flags.
+ * Returns NULL if the completion thread can't be started.
+ */
+struct vhd_null_bdev *vhd_null_bdev_new(unsigned flags);
+
+/**
+ * Destroy the null backend, once all the requests submitted to it have been
+ * completed.  No requests may be submitted concurrently.
+ */
+void vhd_null_bdev_free(struct vhd_null_bdev *nb);
+
+/**
+ * Complete @n requests @reqs, as returned by vhd_dequeue_requests().
+ * May be called from several request queue threads at once.
+ */
+void vhd_null_bdev_submit(struct vhd_null_bdev *nb,
+                          const struct vhd_request *reqs, unsigned n);
+
 #ifdef __cplusplus
 }
 #endif
@@ -8,6 +8,24 @@ extern "C" {
 
 struct vhd_vdev;
 struct vhd_request_queue;
+struct vhd_fs_io;
+
+/**
+ * Handler of a FUSE opcode run synchronously in the request queue thread
+ * right when the request is fetched from the virtqueue, for one-way requests
+ * (FUSE_FORGET, FUSE_BATCH_FORGET) and other cheap ones.  The request is
+ * neither queued nor seen by vhd_dequeue_request(); once the handler returns
+ * it's put on the used ring with the reply the handler has filled in, if any.
+ * The handler must not block, and @fs_io is only valid until it returns.
+ */
+struct vhd_fs_inline_op {
+    uint32_t opcode;
+    void (*handler)(struct vhd_fs_io *fs_io, void *opaque);
+    void *opaque;
+};
+
+/* Maximum FUSE opcode (exclusive) that can be handled inline */
+#define VHD_FS_MAX_INLINE_OPCODE 64
 
 /**
  * Client-supplied file system definition.
@@ -19,10 +37,67 @@ struct vhd_fsdev_info {
     /* Device tag (file system name visible to the guest) */
     const char *tag;
 
-    /* Total number of backend queues this device supports */
+    /*
+     * Total number of backend queues this device supports, the hiprio one
+     * included, so at least 1
+     */
     uint32_t num_queues;
+
+    /*
+     * Size of the DAX cache window the client exposes to the guest as the
+     * virtio-fs shared memory region (e.g. QEMU vhost-user-fs-pci cache-size),
+     * or 0 if there's none.  File extents are mapped into the window with
+     * vhd_fs_map().
+     */
+    uint64_t cache_size;
+
+    /*
+     * Opcodes to handle inline, see struct vhd_fs_inline_op; copied on
+     * registration, may be NULL
+     */
+    const struct vhd_fs_inline_op *inline_ops;
+    uint32_t num_inline_ops;
+};
+
+/**
+ * In-flight virtio-fs request, split into the FUSE headers and arguments
+ *
+ * All the buffers point to guest memory: @in_hdr and @in_args are
+ * device-readable, @out_hdr and @out_args are device-writable.  The backend
+ * fills in @out_hdr (and the reply arguments) before completing the request
+ * with vhd_complete_bio(); its len field is the number of bytes written.
+ */
+struct vhd_fs_io {
+    /* Fields of the FUSE request header */
+    uint32_t opcode;
+    uint64_t unique;
+    uint64_t nodeid;
+
+    /* struct fuse_in_header */
+    const void *in_hdr;
+
+    /* Request arguments past the in header */
+    struct vhd_sglist in_args;
+
+    /* struct fuse_out_header, NULL for one-way requests (e.g. FUSE_FORGET) */
+    void *out_hdr;
+
+    /* Space for the reply arguments past the out header */
+    struct vhd_sglist out_args;
+
+    /*
+     * FUSE_WRITE: the data past struct fuse_write_in in @in_args;
+     * FUSE_READ: same as @out_args, to read the data into;
+     * empty otherwise
+     */
+    struct vhd_sglist data;
 };
 
+/**
+ * Get the FUSE request of the virtio-fs request @bio (vhd_request->bio).
+ */
+struct vhd_fs_io *vhd_get_fs_io(struct vhd_bdev_io *bio);
+
 /**
  * Register vhost file system.
  *
@@ -37,6 +112,27 @@ struct vhd_vdev *vhd_register_fs(struct vhd_fsdev_info *fsdev,
                                  struct vhd_request_queue *rq,
                                  void *priv);
 
+/**
+ * Register vhost file system with its queues spread across several request
+ * queues.
+ *
+ * Same as vhd_register_fs(), but the hiprio queue (queue 0) is served by
+ * @rqs[0], and the request queues by the rest of @rqs round robin, so that
+ * FUSE_INTERRUPT and FUSE_FORGET don't wait behind bulk data requests and the
+ * data requests of a single device can be processed by several threads.
+ * With a single request queue the hiprio requests are dequeued ahead of the
+ * others.
+ *
+ * @fsdev       Caller file system device info.
+ * @rqs         Request queues to dispatch device I/O requests to.
+ * @num_rqs     Number of elements in @rqs.
+ * @priv        Caller private data to associate with resulting vdev.
+ */
+struct vhd_vdev *vhd_register_fs_mq(struct vhd_fsdev_info *fsdev,
+                                    struct vhd_request_queue **rqs,
+                                    int num_rqs,
+                                    void *priv);
+
 /**
  * Unregister vhost file system.
  */
@@ -44,6 +140,52 @@ void vhd_unregister_fs(struct vhd_vdev *vdev,
                        void (*unregister_complete)(void *),
                        void *arg);
 
+/*
+ * DAX cache window mapping flags
+ */
+#define VHD_FS_MAP_READ     (1u << 0)
+#define VHD_FS_MAP_WRITE    (1u << 1)
+
+/**
+ * File extent mapped into the DAX cache window.
+ */
+struct vhd_fs_map_extent {
+    /* Offset in the file; ignored on unmap */
+    uint64_t fd_offset;
+
+    /* Offset in the cache window */
+    uint64_t cache_offset;
+
+    uint64_t len;
+
+    /* VHD_FS_MAP_* flags; ignored on unmap */
+    uint32_t flags;
+};
+
+/**
+ * Map extents of the file @fd into the DAX cache window of the device, so that
+ * the guest accesses them directly rather than via FUSE_READ/FUSE_WRITE.
+ *
+ * The mappings are set up by the client over the vhost-user slave channel;
+ * the call blocks until the client confirms them, so it should be made from
+ * the thread handling the FUSE request (e.g. FUSE_SETUPMAPPING) rather than
+ * the request queue thread.
+ *
+ * Returns 0 on success, -EOPNOTSUPP if the device has no cache window,
+ * -EINVAL if an extent is outside of it, -ENOTCONN if the client hasn't set
+ * up the slave channel, or another negative error code if the client failed
+ * to do the mapping.
+ */
+int vhd_fs_map(struct vhd_vdev *vdev, int fd,
+               const struct vhd_fs_map_extent *extents, size_t count);
+
+/**
+ * Unmap extents of the DAX cache window, e.g. on FUSE_REMOVEMAPPING.
+ * Same as vhd_fs_map() otherwise.
+ */
+int vhd_fs_unmap(struct vhd_vdev *vdev,
+                 const struct vhd_fs_map_extent *extents, size_t count);
+
 #ifdef __cplusplus
 }
 #endif
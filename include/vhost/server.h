@@ -10,6 +10,7 @@ extern "C" {
 
 struct vhd_vdev;
 struct vhd_bdev_io;
+struct vhd_io_handler;
 
 /**
  * Logging support
@@ -35,10 +36,60 @@ typedef void (*log_function)(enum LogLevel level, const char *format, ...);
  */
 int vhd_start_vhost_server(log_function log_fn);
 
+/**
+ * Start vhost server with @num_threads control threads
+ *
+ * Same as vhd_start_vhost_server(), but the devices are spread across
+ * @num_threads threads by their socket paths, so that a slow control message
+ * (e.g. a memory table change mapping lots of guest memory) only delays the
+ * devices sharing the thread with the one it's addressed to.
+ *
+ * Return 0 on success or negative error code.
+ */
+int vhd_start_vhost_server_threads(log_function log_fn, unsigned num_threads);
+
+/**
+ * Vhost control thread options
+ */
+struct vhd_server_opts {
+    /* number of control threads, see vhd_start_vhost_server_threads(); 0 is 1 */
+    unsigned num_threads;
+
+    /* CPUs to run the control threads on; any CPU if @num_cpus is 0 */
+    const unsigned *cpus;
+    unsigned num_cpus;
+
+    /*
+     * Scheduling policy (SCHED_*) and priority of the control threads;
+     * SCHED_OTHER with priority 0 (the default) means inheriting those of the
+     * calling thread.
+     */
+    int sched_policy;
+    int sched_priority;
+
+    /*
+     * Name of the control threads, with the thread number appended if there
+     * are several, truncated to 15 characters; "vhd-ctl" if NULL.
+     */
+    const char *thread_name;
+};
+
+/**
+ * Start vhost server with control threads set up as per @opts
+ *
+ * Same as vhd_start_vhost_server_threads(), but also lets place the control
+ * threads, e.g. away from the isolated CPUs running the request queues.
+ *
+ * Return 0 on success or negative error code, e.g. -EINVAL for a CPU out of
+ * range or -EPERM for a scheduling policy the caller may not set.
+ */
+int vhd_start_vhost_server_opts(log_function log_fn,
+                                const struct vhd_server_opts *opts);
+
 /**
  * Stop vhost server
  *
- * Stop vhost event thread which means no new vhost connections are possible
+ * Stop vhost event threads which means no new vhost connections are possible
  */
 void vhd_stop_vhost_server(void);
 
@@ -83,6 +134,96 @@ void vhd_release_request_queue(struct vhd_request_queue *rq);
  */
 int vhd_run_queue(struct vhd_request_queue *rq);
 
+/**
+ * Run queue in calling thread without blocking.
+ *
+ * Same as vhd_run_queue(), except that it only handles the events already
+ * pending, for driving the queue from an external event loop (epoll,
+ * io_uring, ...) which monitors the queue's file descriptor.  The calling
+ * thread becomes the one running the queue, and may not run any other.
+ *
+ * Returns the same as vhd_run_queue().
+ */
+int vhd_poll_queue(struct vhd_request_queue *rq);
+
+/**
+ * File descriptor of the request queue for external event loops.
+ *
+ * It becomes readable (POLLIN) when vhd_poll_queue() has events to handle,
+ * and stays so until they are.  It may only be used for monitoring, and is
+ * owned by the queue.
+ */
+int vhd_get_queue_fd(struct vhd_request_queue *rq);
+
+/**
+ * How long an external event loop may wait for the request queue's file
+ * descriptor before calling vhd_poll_queue() again, in milliseconds; -1 if
+ * indefinitely.
+ *
+ * This is 0 when the queue is busy polling, or has work outstanding that
+ * doesn't signal the file descriptor: requests completed in the queue thread
+ * since the previous call, or virtqueues to check again.  Must be called in
+ * the thread running the queue, after vhd_poll_queue() and after dequeueing
+ * and completing the requests.
+ */
+int vhd_get_queue_timeout_ms(struct vhd_request_queue *rq);
+
+/**
+ * Enable or disable busy polling on the request queue.
+ *
+ * In polling mode, once woken up, vhd_run_queue() stops blocking and instead
+ * checks the virtio queues attached to the request queue for new requests on
+ * every call, with guest notifications suppressed.  Once no new requests have
+ * been found for @idle_budget_us microseconds, guest notifications are
+ * re-enabled and vhd_run_queue() goes back to blocking.
+ *
+ * This trades CPU time for lower request submission latency.
+ *
+ * @idle_budget_us  Polling idle budget; 0 disables polling (the default).
+ *
+ * Must be called either before the queue is run or in the thread running it.
+ */
+void vhd_set_queue_polling(struct vhd_request_queue *rq,
+                           uint32_t idle_budget_us);
+
+/**
+ * Enable or disable edge-triggered guest notifications on the request queue.
+ *
+ * By default, the kick eventfd of a virtio queue is monitored level-triggered
+ * and read on every wakeup.  In edge-triggered mode the read is skipped, and
+ * the virtio queues kicked in a vhd_run_queue() call are checked for new
+ * requests again at its end, and, as long as they keep producing them, in the
+ * following calls without blocking.  This saves up to two syscalls per kick.
+ *
+ * Only affects virtio queues started afterwards.
+ *
+ * Must be called either before the queue is run or in the thread running it.
+ */
+void vhd_set_queue_edge_kicks(struct vhd_request_queue *rq, bool enable);
+
+/**
+ * Limit the number of requests in flight, i.e. submitted to the backend but
+ * not completed yet, to @max_in_flight for the whole request queue and to
+ * @max_vring_in_flight for each virtqueue attached to it; 0 means no limit
+ * (the default).
+ *
+ * The limits count backend requests rather than guest ones: the guest
+ * requests merged together (see vhd_bdev_info.max_merged_sectors) take a
+ * single slot, and the parts of a guest request split at
+ * vhd_bdev_info.split_boundary_sectors take one each.
+ *
+ * Once a limit is reached, new requests are left in the guest's avail rings,
+ * which eventually throttles the guest, and picked up as completions free up
+ * in-flight slots.  As the free slots are taken one per guest request fetched,
+ * the limits may be exceeded by the extra parts of the requests split, as
+ * well as by requests resubmitted after a reconnect.
+ *
+ * Must be called either before the queue is run or in the thread running it.
+ */
+void vhd_set_queue_max_in_flight(struct vhd_request_queue *rq,
+                                 uint32_t max_in_flight,
+                                 uint16_t max_vring_in_flight);
+
 /**
  * Unblock running request queue.
  * After calling this vhd_run_queue will eventually return and can the be
@@ -90,12 +231,91 @@ int vhd_run_queue(struct vhd_request_queue *rq);
  */
 void vhd_stop_queue(struct vhd_request_queue *rq);
 
+/**
+ * Monitor file descriptor @fd in the event loop of request queue @rq and call
+ * @read with @opaque whenever it becomes readable, from within vhd_run_queue().
+ *
+ * This allows backends to handle their own completion events (e.g. an
+ * io_uring eventfd) in the request queue thread.
+ *
+ * Must be called either before the queue is run or in the thread running it.
+ */
+struct vhd_io_handler *vhd_add_rq_io_handler(struct vhd_request_queue *rq,
+                                             int fd, int (*read)(void *),
+                                             void *opaque);
+
+/**
+ * Stop monitoring the file descriptor and delete the handler.
+ * Must be called in the thread running the request queue.
+ */
+void vhd_del_rq_io_handler(struct vhd_io_handler *handler);
+
 /**
  * Dequeue next request.
  */
 bool vhd_dequeue_request(struct vhd_request_queue *rq,
                          struct vhd_request *out_req);
 
+/**
+ * Dequeue up to @max requests into @out_reqs.
+ *
+ * This allows the backend to build a single submission batch out of all the
+ * requests available on a wakeup.
+ *
+ * @more        If not NULL, set to whether there are requests left in the
+ *              queue after this call.
+ *
+ * Returns the number of requests dequeued.
+ */
+unsigned vhd_dequeue_requests(struct vhd_request_queue *rq,
+                              struct vhd_request *out_reqs, unsigned max,
+                              bool *more);
+
+/**
+ * Request queue group.
+ *
+ * The threads running the request queues of a group share the load with
+ * vhd_dequeue_group_requests(): a queue with requests left over after a
+ * dequeue hands a batch of them over to the idle queues of the group.  This
+ * evens out skewed load without re-sharding the devices over the queues, but
+ * the backend of every thread running a queue in the group must be able to
+ * serve requests of any device attached to any of the queues.  The requests
+ * are still completed with vhd_complete_bio() in any thread, and handed over
+ * to the queue they came from.
+ */
+struct vhd_rq_group;
+
+/**
+ * Create a request queue group of @num_rqs request queues @rqs, none of
+ * which may be in another group.
+ * Must be called before the queues are run.  Returns NULL on failure.
+ */
+struct vhd_rq_group *vhd_create_rq_group(struct vhd_request_queue **rqs,
+                                         unsigned num_rqs);
+
+/**
+ * Destroy request queue group.
+ * Must be called once none of the queues is run any more, and before they
+ * are released.
+ */
+void vhd_release_rq_group(struct vhd_rq_group *group);
+
+/**
+ * Dequeue up to @max requests into @out_reqs, same as vhd_dequeue_requests(),
+ * from request queue @rq first and then from the requests shared by the
+ * other queues of its group.
+ *
+ * Once no requests are found, the busy queues of the group share theirs on
+ * their next call, and the thread running @rq is woken up (vhd_run_queue()
+ * returns) to take them.  The requests may thus be dequeued in the thread
+ * running another queue of the group.
+ *
+ * Behaves like vhd_dequeue_requests() if @rq is not in a group.
+ */
+unsigned vhd_dequeue_group_requests(struct vhd_request_queue *rq,
+                                    struct vhd_request *out_reqs, unsigned max,
+                                    bool *more);
+
 /**
  * Block io request result
  */
@@ -109,9 +329,24 @@ enum vhd_bdev_io_result {
  * Complete the processing of the request.  The backend calls this to indicate
  * that it's done with the request and the library may signal completion to the
  * guest driver and dispose of the request.
+ *
+ * May be called in any thread.  When called in the thread running the request
+ * queue of the request, the request is completed right away rather than
+ * handed over to the request queue event loop, and the guest is signaled
+ * once for all the requests completed so by the time vhd_run_queue() is
+ * called or returns.
  */
 void vhd_complete_bio(struct vhd_bdev_io *bio, enum vhd_bdev_io_result status);
 
+/*
+ * Complete @n requests at once, with @statuses[i] being the result of
+ * @bios[i].  Equivalent to calling vhd_complete_bio() for each of them in
+ * order, but cheaper: the bios are handed over to their request queue with a
+ * single atomic operation per run of bios belonging to the same queue.
+ */
+void vhd_complete_bios(struct vhd_bdev_io **bios,
+                       const enum vhd_bdev_io_result *statuses, unsigned n);
+
 /**
  * Get private data associated with vdev.
  */
@@ -123,6 +358,229 @@ void *vhd_vdev_get_priv(struct vhd_vdev *vdev);
 int vhd_vdev_get_queue_stat(struct vhd_vdev *vdev, uint32_t queue_num,
                             struct vhd_vq_metrics *metrics);
 
+/**
+ * Get I/O statistics and latency histograms for device's queue.
+ * May be called in any thread; the counters are read one by one, so the
+ * result may be slightly inconsistent while requests are being completed.
+ *
+ * The statistics are allocated when the queue is first started and, unlike
+ * the rest of the per-queue dataplane state, kept until the device is
+ * unregistered rather than freed on disconnect: they may be read from any
+ * thread at any time, and keep accumulating across reconnects.  A queue
+ * never started reads as all zeroes.
+ */
+int vhd_vdev_get_queue_io_stat(struct vhd_vdev *vdev, uint32_t queue_num,
+                               struct vhd_vq_io_stat *stat);
+
+/**
+ * Snapshot of the statistics of a device queue
+ */
+struct vhd_vq_snapshot {
+    /* whether the queue is started */
+    bool started;
+    /* requests fetched from the queue and not completed yet */
+    uint16_t num_in_flight;
+
+    struct vhd_vq_metrics metrics;
+    struct vhd_vq_io_stat io_stat;
+};
+
+/**
+ * Called by vhd_get_vdevs_stat() with the snapshot of the @num_queues queues
+ * of @vdev in @vqs, valid until it returns.
+ */
+typedef void (*vhd_vdev_stat_cb)(struct vhd_vdev *vdev,
+                                 const struct vhd_vq_snapshot *vqs,
+                                 uint16_t num_queues, void *opaque);
+
+/**
+ * Take a snapshot of the statistics of every queue of every registered
+ * device and pass them to @cb(@opaque) device by device, e.g. for a metrics
+ * exporter to handle many devices per scrape with a single call.
+ *
+ * The dataplane is never stopped or slowed down: the I/O statistics of each
+ * queue are copied consistently, retrying if the queue updates them
+ * concurrently, the rest are read as is.
+ *
+ * May be called in any thread.  @cb may call vhd_vdev_get_priv() on @vdev,
+ * but must not register or unregister devices.
+ * Returns the number of devices.
+ */
+int vhd_get_vdevs_stat(vhd_vdev_stat_cb cb, void *opaque);
+
+/**
+ * Request scheduling parameters of a device
+ */
+struct vhd_vdev_qos {
+    /*
+     * Share of the request queue bandwidth of each virtqueue of the device
+     * relative to the other virtqueues attached to the same request queue;
+     * 0 is the same as 1 (the default).
+     */
+    uint32_t weight;
+
+    /*
+     * Limits on the requests per second and bytes per second dequeued from
+     * all the virtqueues of the device, and the bursts allowed over them;
+     * 0 limit means unlimited, 0 burst means a tenth of a second worth of
+     * the limit.
+     */
+    uint32_t iops_limit;
+    uint32_t iops_burst;
+    uint64_t bps_limit;
+    uint64_t bps_burst;
+};
+
+/**
+ * Set request scheduling parameters of the device.
+ *
+ * Requests of the virtqueues attached to a request queue are handed out by
+ * vhd_dequeue_request() in deficit round robin in proportion to the weights
+ * of their devices, and requests over the device limits are held back in the
+ * request queue (and, once the in-flight limits are reached, in the guest's
+ * avail rings) until the limits allow them.
+ *
+ * May be called in any thread.
+ * Returns 0 on success, -EINVAL if a burst is set without the limit.
+ */
+int vhd_vdev_set_qos(struct vhd_vdev *vdev, const struct vhd_vdev_qos *qos);
+
+/**
+ * Coalesce the guest notifications of the device virtqueues.
+ *
+ * Once the guest asks to be notified of completions on a virtqueue, the
+ * notification is held back until @max_completions more requests complete
+ * (if non-zero) or @max_delay_us pass, whichever comes first.  0
+ * @max_delay_us (the default) notifies right away.
+ *
+ * Takes effect on each virtqueue as it is dispatched next.
+ * May be called in any thread.
+ * Returns 0 on success, -EINVAL if @max_completions is set without
+ * @max_delay_us.
+ */
+int vhd_vdev_set_notify_coalescing(struct vhd_vdev *vdev,
+                                   uint32_t max_completions,
+                                   uint32_t max_delay_us);
+
+/**
+ * Stop the device virtqueues without draining them, to cut the migration
+ * downtime short of the slowest backend request.
+ *
+ * By default VHOST_USER_GET_VRING_BASE is only replied to once all the
+ * requests in flight on the virtqueue complete.  If enabled, the virtqueue
+ * instead stops fetching requests, cancels those not handed to the backend
+ * yet, and reports the vring base rewound by the requests in flight, for the
+ * next user of the inflight region (VHOST_USER_PROTOCOL_F_INFLIGHT_SHMFD) to
+ * resubmit them.  The completions of those requests are no longer published
+ * to the guest; the backend is to fence off the ones it still has outstanding,
+ * so that they don't hit the storage after the requests are resubmitted, see
+ * vhd_vdev_set_fence_cb().  The virtqueue can't be restarted until they
+ * complete.  Virtqueues without the inflight region or with
+ * packed layout are still drained.
+ *
+ * Takes effect on the next stop of each virtqueue.
+ * May be called in any thread.
+ */
+void vhd_vdev_set_stop_undrained(struct vhd_vdev *vdev, bool enable);
+
+/**
+ * Set the callback to notify the backend of the virtqueues stopped without
+ * draining, see vhd_vdev_set_stop_undrained().
+ *
+ * @fence_cb is called with the index of the virtqueue, in the thread running
+ * its request queue, once the virtqueue is fenced: the requests queued are
+ * canceled, and the completions of those still outstanding in the backend,
+ * if any, are no longer published to the guest.  The latter are stale from
+ * then on, as the next user of the inflight region resubmits them, and the
+ * backend must cancel them or hold them back from the storage before
+ * completing them; vhd_bdev_io_fenced() tells them apart.
+ *
+ * Must be called before stopping undrained is enabled.
+ */
+void vhd_vdev_set_fence_cb(struct vhd_vdev *vdev,
+                           void (*fence_cb)(struct vhd_vdev *vdev,
+                                            uint32_t queue_num, void *opaque),
+                           void *opaque);
+
+/**
+ * Tell if the request @bio outstanding in the backend is stale, its
+ * virtqueue having been stopped without draining, see
+ * vhd_vdev_set_fence_cb().  May be called in any thread.
+ */
+bool vhd_bdev_io_fenced(struct vhd_bdev_io *bio);
+
+/**
+ * Guest memory region of a device
+ */
+struct vhd_mem_region_info {
+    /* start of the region in guest physical space and its size */
+    uint64_t gpa;
+    uint64_t size;
+
+    /*
+     * NUMA node most of the sampled resident pages of the region are on, or
+     * -1 if unknown
+     */
+    int numa_node;
+};
+
+/**
+ * Get the guest memory regions of the device along with the NUMA nodes
+ * backing them, e.g. to run the request queues serving the device on the
+ * CPUs close to its memory.
+ *
+ * Fills up to @max elements of @regions in ascending order of gpa.
+ * May be called in any thread.
+ * Returns the number of regions, which may be more than @max, or negative
+ * error code.
+ */
+int vhd_vdev_get_mem_regions(struct vhd_vdev *vdev,
+                             struct vhd_mem_region_info *regions,
+                             unsigned max);
+
+/**
+ * Placement-related parameters of a device queue
+ */
+struct vhd_vq_placement {
+    /* whether the queue is started */
+    bool started;
+
+    /*
+     * Eventfds the guest kicks the queue with, and the queue signals the
+     * guest with (usually bound to an irqfd of a guest vCPU), or -1 if not
+     * set; owned by the device and only valid until the queue is reset
+     */
+    int kickfd;
+    int callfd;
+
+    /* NUMA node of the guest memory region with the rings, or -1 if unknown */
+    int numa_node;
+};
+
+/**
+ * Get the placement-related parameters of device's queue, for orchestration
+ * to co-locate the request queue serving it with the guest memory and vCPUs.
+ *
+ * May be called in any thread.
+ * Returns 0 on success or negative error code.
+ */
+int vhd_vdev_get_queue_placement(struct vhd_vdev *vdev, uint32_t queue_num,
+                                 struct vhd_vq_placement *placement);
+
+/**
+ * Get the lower bound in nanoseconds of the latencies counted in @bucket
+ * of struct vhd_latency_hist.
+ */
+uint64_t vhd_latency_hist_bucket_ns(unsigned bucket);
+
+/**
+ * Estimate the @pct percentile (e.g. 99.9) of the latencies counted in @hist,
+ * with the precision of the bucket width.
+ * Returns 0 if the histogram is empty.
+ */
+uint64_t vhd_latency_hist_percentile(const struct vhd_latency_hist *hist,
+                                     double pct);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Request trace points
+ *
+ * Only available if the library is built with WITH_TRACE=1 (VHD_TRACE
+ * defined).  Every thread passing a trace point records the point, the
+ * virtqueue, the descriptor chain head and a timestamp into its own ring
+ * buffer of the last VHD_TRACE_RING_ENTRIES events, with no locking or
+ * formatting; scripts/vhd_trace.py decodes the dumps.
+ */
+
+/* events kept per thread */
+#define VHD_TRACE_RING_ENTRIES  (1u << 16)
+
+enum vhd_trace_point {
+    /* guest kick handled; head is the next avail index to fetch */
+    VHD_TRACE_KICK,
+    /* descriptor chain fetched from the virtqueue */
+    VHD_TRACE_VQ_DEQUEUE,
+    /* request queued in the request queue */
+    VHD_TRACE_RQ_ENQUEUE,
+    /* request handed to the backend by vhd_dequeue_request() */
+    VHD_TRACE_BACKEND_DEQUEUE,
+    /* request completed by the backend (in the backend thread) */
+    VHD_TRACE_COMPLETE,
+    /* completion handled in the request queue */
+    VHD_TRACE_COMPLETION,
+    /* descriptor chain put on the used ring */
+    VHD_TRACE_USED_PUSH,
+    /* guest notified; head is the used index of the virtqueue */
+    VHD_TRACE_NOTIFY,
+
+    VHD_TRACE_POINT_COUNT
+};
+
+/**
+ * Start or stop recording trace events (stopped initially).
+ * May be called in any thread.  Returns -ENOTSUP if built without tracing.
+ */
+int vhd_trace_set_enabled(bool enabled);
+
+/**
+ * Write the trace events of all threads to @fd, along with the names of the
+ * virtqueues they refer to.  The events recorded concurrently with the dump
+ * may be torn, so stop the recording first for a consistent dump.
+ * May be called in any thread.  Returns 0 on success or negative error code,
+ * -ENOTSUP if built without tracing.
+ */
+int vhd_trace_dump(int fd);
+
+#ifdef __cplusplus
+}
+#endif
@@ -18,6 +18,15 @@ struct vhd_buffer {
 
     /* Buffer is write-only if true and read-only if false */
     bool write_only;
+
+    /*
+     * Guest memory region the buffer is in: the id map_cb tagged the region
+     * with (see vhd_bdev_info), and the offset of @base from the start of the
+     * region as passed to map_cb, e.g. to look up the backend's registration
+     * of the region by index rather than by address
+     */
+    uint32_t region_id;
+    uint64_t region_offset;
 };
 
 struct vhd_sglist {
@@ -30,20 +39,57 @@ struct vhd_sglist {
  */
 enum vhd_bdev_io_type {
     VHD_BDEV_READ,
-    VHD_BDEV_WRITE
+    VHD_BDEV_WRITE,
+
+    /* Persist the data written so far; no sectors or buffers */
+    VHD_BDEV_FLUSH,
+
+    /* Deallocate / zero out sectors in @ranges; no buffers */
+    VHD_BDEV_DISCARD,
+    VHD_BDEV_WRITE_ZEROES,
+};
+
+/**
+ * Range of sectors of a discard or write zeroes request
+ */
+struct vhd_bdev_range {
+    uint64_t first_sector;
+    uint32_t total_sectors;
+
+    /* Write zeroes only: the range may be deallocated instead */
+    bool unmap;
 };
 
 /**
  * In-flight blockdev io request
  *
- * TODO: virtio-fs uses this struct too, that's why we need it in common types
+ * TODO: virtio-fs uses this struct too, that's why we need it in common types;
+ * there @sglist has all the request buffers, and vhd_get_fs_io() gives the
+ * split into the FUSE headers and arguments
  */
 struct vhd_bdev_io {
     enum vhd_bdev_io_type type;
 
+    /*
+     * For discard and write zeroes requests, the first of @ranges, which is
+     * the only one unless the device allows for more.
+     */
     uint64_t first_sector;
     uint64_t total_sectors;
     struct vhd_sglist sglist;
+
+    /* Discard and write zeroes requests only */
+    struct vhd_bdev_range *ranges;
+    uint32_t nranges;
+
+    /*
+     * Read requests only: if the read continues a sequential stream on its
+     * virtqueue, the number of sectors right past it the guest is predicted
+     * to read next, for the backend to prefetch (e.g. from remote storage)
+     * before it's asked to; 0 otherwise.
+     * See vhd_bdev_info.max_readahead_sectors.
+     */
+    uint32_t readahead_sectors;
 };
 
 /**
@@ -64,6 +110,134 @@ struct vhd_vq_metrics {
 
     /* max queue len was processed during 60s period */
     uint16_t queue_len_max_60s;
+
+    /* number of guest kicks handled and guest notifications sent */
+    uint64_t kicks;
+    uint64_t notifies;
+
+    /* number of kick eventfd reads (edge-triggered kicks need none) */
+    uint64_t kick_reads;
+
+    /*
+     * CPU time of the request queue thread spent on the virtqueue, in ns:
+     * handling kicks and fetching and dispatching requests, and completing
+     * requests and notifying the guest, respectively
+     */
+    uint64_t dispatch_ns;
+    uint64_t completion_ns;
+};
+
+/**
+ * Request latency histogram
+ *
+ * Bucket 0 counts latencies below 256ns, bucket 1 those in [256ns, 512ns);
+ * every following power-of-two range is split into two buckets of equal
+ * width, the last bucket also counting everything beyond it (~14 min).
+ * See vhd_latency_hist_bucket_ns() and vhd_latency_hist_percentile().
+ */
+#define VHD_LATENCY_HIST_BUCKETS 64
+
+struct vhd_latency_hist {
+    uint64_t buckets[VHD_LATENCY_HIST_BUCKETS];
+
+    /* sum of all the latencies counted */
+    uint64_t total_ns;
+};
+
+/**
+ * Phases of request processing that latency is accounted for
+ */
+enum vhd_req_phase {
+    /* from fetching off the virtqueue to vhd_dequeue_request() */
+    VHD_REQ_PHASE_QUEUED,
+    /* from vhd_dequeue_request() to vhd_complete_bio() */
+    VHD_REQ_PHASE_BACKEND,
+    /* from vhd_complete_bio() to putting on the used ring */
+    VHD_REQ_PHASE_COMPLETION,
+
+    VHD_REQ_PHASE_COUNT
+};
+
+/**
+ * Request kinds accounted separately; virtio-fs requests count as reads
+ */
+enum vhd_req_op {
+    VHD_REQ_OP_READ,
+    VHD_REQ_OP_WRITE,
+    /* flush, discard, write zeroes */
+    VHD_REQ_OP_OTHER,
+
+    VHD_REQ_OP_COUNT
+};
+
+/**
+ * Request shape histogram
+ *
+ * Bucket i counts the values in [2^i, 2^(i+1)) (alignments of 2^i sectors,
+ * see struct vhd_vq_op_stat), the last bucket also counting everything
+ * beyond it.
+ */
+#define VHD_SHAPE_HIST_BUCKETS 24
+
+/**
+ * virtqueue I/O statistics, accumulated over the device lifetime; canceled
+ * requests are not accounted
+ */
+struct vhd_vq_io_stat {
+    struct vhd_vq_op_stat {
+        /* requests completed */
+        uint64_t requests;
+        /* bytes transferred (read and write only) */
+        uint64_t bytes;
+
+        struct vhd_latency_hist latency[VHD_REQ_PHASE_COUNT];
+
+        /*
+         * Shape of the read and write requests as submitted to the backend,
+         * i.e. after merging and splitting: their size in sectors, number of
+         * data buffers, and alignment of the first sector (bucket i counting
+         * the ones on a multiple of 2^i sectors but not of 2^(i+1)).  Counted
+         * on submission, including the requests canceled later.
+         */
+        uint64_t size_hist[VHD_SHAPE_HIST_BUCKETS];
+        uint64_t segments_hist[VHD_SHAPE_HIST_BUCKETS];
+        uint64_t align_hist[VHD_SHAPE_HIST_BUCKETS];
+
+        /*
+         * Read and write requests starting at the sector the previous one on
+         * the virtqueue ended at, counted as the guest submitted them: the
+         * merged ones as one, the split ones once rather than per part
+         */
+        uint64_t sequential;
+    } ops[VHD_REQ_OP_COUNT];
+};
+
+/**
+ * Guest memory mapping policy flags
+ */
+enum {
+    /* ask for transparent huge pages (not applicable to hugetlbfs) */
+    VHD_MEM_HUGEPAGE = 1 << 0,
+    /* exclude guest memory from the core dumps of this process */
+    VHD_MEM_DONTDUMP = 1 << 1,
+    /* prefault the whole guest memory when it's mapped */
+    VHD_MEM_POPULATE = 1 << 2,
+};
+
+/**
+ * How to map guest memory regions; all the policies are best effort and
+ * failing to apply them doesn't fail the mapping
+ */
+struct vhd_mem_policy {
+    /* VHD_MEM_* flags */
+    uint32_t flags;
+
+    /*
+     * Bitmask of NUMA nodes to prefer for the guest memory pages not
+     * allocated yet; 0 means no preference.  Note that the preference is
+     * shared with the other users of the memory, the guest included.
+     */
+    uint64_t numa_nodes;
 };
 
 #ifdef __cplusplus
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <stddef.h>
+#include "vhost/types.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct vhd_request_queue;
+
+/**
+ * io_uring block backend
+ *
+ * An io_uring instance bound to a request queue.  Requests are queued onto the
+ * submission ring as they are dequeued from the request queue and submitted
+ * to the kernel in one go by vhd_uring_submit(); completions are reaped and
+ * signaled to the guest by the request queue event loop itself, so no extra
+ * threads are involved.
+ *
+ * Everything except buffer (un)registration must be done in the thread
+ * running the request queue.  Link with libvhost-uring.a and -luring.
+ */
+struct vhd_uring;
+
+/**
+ * Create an io_uring instance with @entries submission ring entries and attach
+ * its completion events to @rq.
+ * Must be called either before the queue is run or in the thread running it.
+ */
+struct vhd_uring *vhd_uring_new(struct vhd_request_queue *rq,
+                                unsigned entries);
+
+/**
+ * Destroy the io_uring instance.  All submitted requests must have completed.
+ * Must be called in the thread running the request queue.
+ */
+void vhd_uring_free(struct vhd_uring *ur);
+
+/**
+ * Register guest memory region [@addr, @addr + @len) as io_uring fixed buffers
+ * and unregister it.  Intended to be called from map_cb/unmap_cb in
+ * vhd_bdev_info; may be called in any thread.
+ *
+ * Failing to register the buffers is not fatal: I/O to unregistered memory
+ * just doesn't use fixed buffers.
+ *
+ * vhd_uring_register_buffer() returns the id to tag the region with from
+ * map_cb, for the fixed buffers of the data buffers in it to be found without
+ * searching the fixed buffer table; 0 if there's none.
+ */
+int vhd_uring_register_buffer(struct vhd_uring *ur, void *addr, size_t len);
+int vhd_uring_unregister_buffer(struct vhd_uring *ur, void *addr, size_t len);
+
+/**
+ * Queue @bio for I/O on file descriptor @fd.  The I/O is actually started by
+ * the next vhd_uring_submit(), and the bio is completed with
+ * vhd_complete_bio() once it's done.
+ */
+void vhd_uring_queue_bio(struct vhd_uring *ur, int fd, struct vhd_bdev_io *bio);
+
+/**
+ * Submit all queued I/O to the kernel with a single system call.
+ * Typically called once per vhd_run_queue() iteration, after dequeueing all
+ * pending requests.
+ */
+void vhd_uring_submit(struct vhd_uring *ur);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,92 @@
+#include "io_stat.h"
+#include "vhost/server.h"
+
+uint64_t vhd_latency_hist_bucket_ns(unsigned bucket)
+{
+    unsigned exp = bucket / 2;
+
+    if (bucket < 2) {
+        return bucket << VHD_LATENCY_HIST_SHIFT;
+    }
+
+    return (2ull + (bucket & 1)) << (exp - 1) << VHD_LATENCY_HIST_SHIFT;
+}
+
+uint64_t vhd_latency_hist_percentile(const struct vhd_latency_hist *hist,
+                                     double pct)
+{
+    uint64_t total = 0, target, sum = 0;
+    unsigned i;
+
+    for (i = 0; i < VHD_LATENCY_HIST_BUCKETS; i++) {
+        total += hist->buckets[i];
+    }
+    if (!total) {
+        return 0;
+    }
+
+    /* the smallest count that makes at least @pct percent of the total */
+    target = total * pct / 100;
+    if (target < total * pct / 100 || !target) {
+        target++;
+    }
+
+    for (i = 0; i < VHD_LATENCY_HIST_BUCKETS - 1; i++) {
+        sum += hist->buckets[i];
+        if (sum >= target) {
+            break;
+        }
+    }
+
+    /* report the upper bound of the bucket, but nothing is above the last */
+    return vhd_latency_hist_bucket_ns(MIN(i + 1, VHD_LATENCY_HIST_BUCKETS - 1));
+}
+
+static void io_stat_copy(const struct vhd_io_stat *stat,
+                         struct vhd_vq_io_stat *out)
+{
+    unsigned op, phase, i;
+
+    for (op = 0; op < VHD_REQ_OP_COUNT; op++) {
+        out->ops[op].requests = atomic_read(&stat->ops[op].requests);
+        out->ops[op].bytes = atomic_read(&stat->ops[op].bytes);
+
+        for (phase = 0; phase < VHD_REQ_PHASE_COUNT; phase++) {
+            struct vhd_latency_hist *hist = &out->ops[op].latency[phase];
+
+            for (i = 0; i < VHD_LATENCY_HIST_BUCKETS; i++) {
+                hist->buckets[i] =
+                    atomic_read(&stat->ops[op].latency[phase].buckets[i]);
+            }
+            hist->total_ns = atomic_read(&stat->ops[op].latency[phase].total_ns);
+        }
+
+        for (i = 0; i < VHD_SHAPE_HIST_BUCKETS; i++) {
+            out->ops[op].size_hist[i] =
+                atomic_read(&stat->ops[op].size_hist[i]);
+            out->ops[op].segments_hist[i] =
+                atomic_read(&stat->ops[op].segments_hist[i]);
+            out->ops[op].align_hist[i] =
+                atomic_read(&stat->ops[op].align_hist[i]);
+        }
+        out->ops[op].sequential = atomic_read(&stat->ops[op].sequential);
+    }
+}
+
+void vhd_io_stat_get(const struct vhd_io_stat *stat,
+                     struct vhd_vq_io_stat *out)
+{
+    unsigned seq;
+
+    /* not allocated until the vring is first started */
+    if (!stat) {
+        memset(out, 0, sizeof(*out));
+        return;
+    }
+
+    do {
+        seq = atomic_load_acquire(&stat->seq);
+        io_stat_copy(stat, out);
+        smp_rmb();
+    } while ((seq & 1) || atomic_read(&stat->seq) != seq);
+}
@@ -0,0 +1,168 @@
+/*
+ * Per-vring request accounting: request and byte counters, latency and
+ * request shape histograms, see struct vhd_vq_io_stat.
+ */
+
+#pragma once
+
+#include <stdatomic.h>
+
+#include "catomic.h"
+#include "platform.h"
+#include "vhost/types.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Counters are only updated by the thread serving the vring, so plain
+ * relaxed loads and stores suffice; they are atomic only to let other threads
+ * read them without tearing.  @seq is odd while an update is in progress, for
+ * the readers to retry and get a consistent copy without ever blocking the
+ * writer.
+ */
+struct vhd_io_stat {
+    atomic_uint seq;
+    struct {
+        atomic_ulong requests;
+        atomic_ulong bytes;
+        struct {
+            atomic_ulong buckets[VHD_LATENCY_HIST_BUCKETS];
+            atomic_ulong total_ns;
+        } latency[VHD_REQ_PHASE_COUNT];
+        atomic_ulong size_hist[VHD_SHAPE_HIST_BUCKETS];
+        atomic_ulong segments_hist[VHD_SHAPE_HIST_BUCKETS];
+        atomic_ulong align_hist[VHD_SHAPE_HIST_BUCKETS];
+        atomic_ulong sequential;
+    } ops[VHD_REQ_OP_COUNT];
+
+    /*
+     * stream of the reads and writes as the guest submitted them, before
+     * splitting: the sector the last one ended at, and the number of sectors
+     * read in a row up to there; writer only
+     */
+    uint64_t next_sector;
+    uint64_t read_run_sectors;
+};
+
+#define VHD_LATENCY_HIST_SHIFT 8
+
+static inline unsigned vhd_latency_hist_bucket(uint64_t ns)
+{
+    uint64_t v = ns >> VHD_LATENCY_HIST_SHIFT;
+    unsigned exp, bucket;
+
+    if (v < 2) {
+        return v;
+    }
+
+    exp = 63 - __builtin_clzll(v);
+    bucket = exp * 2 + ((v >> (exp - 1)) & 1);
+    return MIN(bucket, VHD_LATENCY_HIST_BUCKETS - 1);
+}
+
+static inline void vhd_stat_inc(atomic_ulong *counter, uint64_t n)
+{
+    atomic_set(counter, atomic_read(counter) + n);
+}
+
+static inline unsigned vhd_shape_hist_bucket(uint64_t v)
+{
+    if (!v) {
+        return 0;
+    }
+    return MIN(63 - __builtin_clzll(v), VHD_SHAPE_HIST_BUCKETS - 1);
+}
+
+/*
+ * Account the shape of a read or write request being submitted.
+ */
+static inline void vhd_io_stat_account_submit(struct vhd_io_stat *stat,
+                                              const struct vhd_bdev_io *bdev_io)
+{
+    enum vhd_req_op op = bdev_io->type == VHD_BDEV_READ ?
+        VHD_REQ_OP_READ : VHD_REQ_OP_WRITE;
+    uint64_t sector = bdev_io->first_sector;
+    unsigned seq = atomic_read(&stat->seq);
+    unsigned align = sector ? (unsigned)__builtin_ctzll(sector) :
+        VHD_SHAPE_HIST_BUCKETS - 1;
+
+    atomic_set(&stat->seq, seq + 1);
+    smp_wmb();
+
+    vhd_stat_inc(&stat->ops[op].size_hist[
+                     vhd_shape_hist_bucket(bdev_io->total_sectors)], 1);
+    vhd_stat_inc(&stat->ops[op].segments_hist[
+                     vhd_shape_hist_bucket(bdev_io->sglist.nbuffers)], 1);
+    vhd_stat_inc(&stat->ops[op].align_hist[
+                     MIN(align, VHD_SHAPE_HIST_BUCKETS - 1)], 1);
+
+    atomic_store_release(&stat->seq, seq + 2);
+}
+
+/*
+ * Account a read or write request as the guest submitted it, i.e. before it's
+ * split into the requests submitted: count it as sequential if it starts where
+ * the previous one ended.  Returns the number of sectors read in a row up to
+ * its end, including it if it's a read, 0 for a write.
+ */
+static inline uint64_t vhd_io_stat_account_stream(
+    struct vhd_io_stat *stat, const struct vhd_bdev_io *bdev_io)
+{
+    bool sequential = bdev_io->first_sector == stat->next_sector;
+
+    if (sequential) {
+        enum vhd_req_op op = bdev_io->type == VHD_BDEV_READ ?
+            VHD_REQ_OP_READ : VHD_REQ_OP_WRITE;
+        unsigned seq = atomic_read(&stat->seq);
+
+        atomic_set(&stat->seq, seq + 1);
+        smp_wmb();
+        vhd_stat_inc(&stat->ops[op].sequential, 1);
+        atomic_store_release(&stat->seq, seq + 2);
+    }
+
+    stat->next_sector = bdev_io->first_sector + bdev_io->total_sectors;
+
+    if (bdev_io->type != VHD_BDEV_READ) {
+        stat->read_run_sectors = 0;
+    } else if (sequential) {
+        stat->read_run_sectors += bdev_io->total_sectors;
+    } else {
+        stat->read_run_sectors = bdev_io->total_sectors;
+    }
+    return stat->read_run_sectors;
+}
+
+/*
+ * Account a completed request; @lat_ns[i] is the time it spent in phase i.
+ */
+static inline void vhd_io_stat_account(struct vhd_io_stat *stat,
+                                       enum vhd_req_op op, uint64_t bytes,
+                                       const uint64_t *lat_ns)
+{
+    unsigned i;
+    unsigned seq = atomic_read(&stat->seq);
+
+    atomic_set(&stat->seq, seq + 1);
+    smp_wmb();
+
+    vhd_stat_inc(&stat->ops[op].requests, 1);
+    vhd_stat_inc(&stat->ops[op].bytes, bytes);
+
+    for (i = 0; i < VHD_REQ_PHASE_COUNT; i++) {
+        unsigned bucket = vhd_latency_hist_bucket(lat_ns[i]);
+        vhd_stat_inc(&stat->ops[op].latency[i].buckets[bucket], 1);
+        vhd_stat_inc(&stat->ops[op].latency[i].total_ns, lat_ns[i]);
+    }
+
+    atomic_store_release(&stat->seq, seq + 2);
+}
+
+void vhd_io_stat_get(const struct vhd_io_stat *stat,
+                     struct vhd_vq_io_stat *out);
+
+#ifdef __cplusplus
+}
+#endif
@@ -39,52 +39,142 @@ void vhd_memlog_free(struct vhd_memory_log *log)
 
 #define VHOST_LOG_PAGE 0x1000
 
-void vhd_mark_gpa_range_dirty(struct vhd_memory_log *log, uint64_t gpa,
-                              size_t len)
+/* bits @lo to @hi of a log word, inclusive */
+static uint64_t log_word_mask(unsigned lo, unsigned hi)
 {
-    atomic_ulong *log_addr = log->base;
-    if (!log_addr) {
-        VHD_LOG_WARN("No logging addr set");
-        return;
-    }
+    return (~0ULL >> (63 - hi)) & (~0ULL << lo);
+}
 
-    uint64_t log_size = log->size;
+static void log_word_or(atomic_ulong *log_addr, uint64_t chunk, uint64_t mask)
+{
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    mask = __builtin_bswap64(mask);
+#endif
+    atomic_or(&log_addr[chunk], mask);
+}
 
-    uint64_t page = gpa / VHOST_LOG_PAGE;
-    uint64_t last_page = (gpa + len - 1) / VHOST_LOG_PAGE;
+/*
+ * Mark pages @page to @last_page dirty, accumulating the bits of log word
+ * @*chunk in @*mask, so that the ORs of consecutive ranges sharing a word
+ * are combined.  The caller ORs in the final @*mask.
+ */
+static void log_pages(struct vhd_memory_log *log, uint64_t page,
+                      uint64_t last_page, uint64_t *chunk, uint64_t *mask)
+{
+    uint64_t log_pages = log->size * 8;
 
-    if (last_page >= log_size * 8) {
+    if (last_page >= log_pages) {
         VHD_LOG_ERROR(
-            "Write beyond log buffer: gpa = 0x%lx, len = 0x%lx, log_size %zu",
-            gpa, len, log_size);
-        if (page >= log_size * 8) {
+            "Write beyond log buffer: pages 0x%lx-0x%lx, log_size %zu",
+            page, last_page, log->size);
+        if (page >= log_pages) {
             return;
         }
-        last_page = log_size * 8 - 1;
+        last_page = log_pages - 1;
     }
 
     /*
      * log is always page aligned so we can be sure that its start is aligned
      * to sizeof(long) and also that atomic operations never cross cacheline
      */
-    do {
-        uint64_t mask = 0UL;
-        uint64_t chunk = page / 64;
-        for (; page <= last_page && page / 64 == chunk; ++page) {
-            mask |= 1LU << (page % 64);
+    while (page <= last_page) {
+        uint64_t word = page / 64;
+        uint64_t end = MIN(last_page, word * 64 + 63);
+
+        if (word != *chunk) {
+            if (*mask) {
+                log_word_or(log->base, *chunk, *mask);
+            }
+            *chunk = word;
+            *mask = 0;
         }
-#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
-        mask = __builtin_bswap64(mask);
-#endif
-        atomic_or(&log_addr[chunk], mask);
-    } while (page <= last_page);
+        *mask |= log_word_mask(page % 64, end % 64);
+        page = end + 1;
+    }
+}
+
+void vhd_mark_gpa_range_dirty(struct vhd_memory_log *log, uint64_t gpa,
+                              size_t len)
+{
+    uint64_t chunk = 0, mask = 0;
+
+    if (!log->base) {
+        VHD_LOG_WARN("No logging addr set");
+        return;
+    }
+
+    log_pages(log, gpa / VHOST_LOG_PAGE, (gpa + len - 1) / VHOST_LOG_PAGE,
+              &chunk, &mask);
+    if (mask) {
+        log_word_or(log->base, chunk, mask);
+    }
 }
 
-void vhd_mark_range_dirty(struct vhd_memory_log *log,
-                          struct vhd_memory_map *mm, void *ptr, size_t len)
+void vhd_dirty_cache_flush(struct vhd_dirty_cache *dc,
+                           struct vhd_memory_log *log)
 {
-    uint64_t gpa = ptr_to_gpa(mm, ptr);
-    if (gpa != TRANSLATION_FAILED) {
-        vhd_mark_gpa_range_dirty(log, gpa, len);
+    uint64_t chunk = 0, mask = 0;
+    unsigned i, j;
+
+    if (!dc->num) {
+        return;
+    }
+
+    if (!log->base) {
+        VHD_LOG_WARN("No logging addr set");
+        dc->num = 0;
+        return;
+    }
+
+    /* sort the ranges so that those sharing log words go in a row */
+    for (i = 1; i < dc->num; i++) {
+        struct vhd_dirty_range r = dc->ranges[i];
+        for (j = i; j > 0 && dc->ranges[j - 1].first > r.first; j--) {
+            dc->ranges[j] = dc->ranges[j - 1];
+        }
+        dc->ranges[j] = r;
+    }
+
+    for (i = 0; i < dc->num; i++) {
+        log_pages(log, dc->ranges[i].first, dc->ranges[i].last, &chunk, &mask);
+    }
+    if (mask) {
+        log_word_or(log->base, chunk, mask);
+    }
+
+    dc->num = 0;
+}
+
+void vhd_dirty_cache_add(struct vhd_dirty_cache *dc,
+                         struct vhd_memory_log *log, uint64_t gpa, size_t len)
+{
+    uint64_t first = gpa / VHOST_LOG_PAGE;
+    uint64_t last = (gpa + len - 1) / VHOST_LOG_PAGE;
+    unsigned i = 0;
+
+    if (!len) {
+        return;
     }
+
+    /* absorb all the ranges the new one overlaps or adjoins */
+    while (i < dc->num) {
+        struct vhd_dirty_range *r = &dc->ranges[i];
+        if (r->first <= last + 1 && first <= r->last + 1) {
+            first = MIN(first, r->first);
+            last = MAX(last, r->last);
+            *r = dc->ranges[--dc->num];
+            i = 0;
+            continue;
+        }
+        i++;
+    }
+
+    if (dc->num == VHD_DIRTY_CACHE_RANGES) {
+        vhd_dirty_cache_flush(dc, log);
+    }
+
+    dc->ranges[dc->num++] = (struct vhd_dirty_range) {
+        .first = first,
+        .last = last,
+    };
 }
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <stddef.h>
+#include <stdint.h>
 
 #include "memmap.h"
 
@@ -13,11 +14,32 @@ struct vhd_memory_log;
 struct vhd_memory_log *vhd_memlog_new(size_t size, int fd, off_t offset);
 void vhd_memlog_free(struct vhd_memory_log *log);
 
-void vhd_mark_range_dirty(struct vhd_memory_log *log,
-                          struct vhd_memory_map *mm, void *ptr, size_t len);
 void vhd_mark_gpa_range_dirty(struct vhd_memory_log *log, uint64_t gpa,
                               size_t len);
 
+/*
+ * Accumulator of the guest pages dirtied by a batch of completions, to set
+ * their bits in the log at once, with one atomic OR per log word rather than
+ * per word per buffer.  Adjacent and overlapping ranges are merged as they
+ * are added; once there's no room for a new range the accumulated ones are
+ * flushed.
+ */
+#define VHD_DIRTY_CACHE_RANGES 16
+
+struct vhd_dirty_cache {
+    unsigned num;
+    /* page numbers, inclusive */
+    struct vhd_dirty_range {
+        uint64_t first;
+        uint64_t last;
+    } ranges[VHD_DIRTY_CACHE_RANGES];
+};
+
+void vhd_dirty_cache_add(struct vhd_dirty_cache *dc,
+                         struct vhd_memory_log *log, uint64_t gpa, size_t len);
+void vhd_dirty_cache_flush(struct vhd_dirty_cache *dc,
+                           struct vhd_memory_log *log);
+
 #ifdef __cplusplus
 }
 #endif
@@ -1,10 +1,51 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/vfs.h>
+#include <linux/magic.h>
+#include <linux/userfaultfd.h>
 
 #include "memmap.h"
 #include "platform.h"
 #include "logging.h"
 #include "objref.h"
 
+/* mbind(2) modes, not to depend on libnuma headers */
+#define VHD_MPOL_PREFERRED      1
+#define VHD_MPOL_PREFERRED_MANY 5
+
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE     23
+#endif
+
+/* number of pages sampled to find out the NUMA node of a region */
+#define VHD_NUMA_SAMPLES        64
+
+/*
+ * The mapping of a guest memory region into this process, shared by all the
+ * memory maps containing the region, so that incremental memory table updates
+ * don't need to remap the regions that stay.
+ */
+struct vhd_memory_mapping {
+    struct objref ref;
+
+    void *ptr;
+    size_t size;
+    /* file the region is mapped from and the offset in it */
+    int fd;
+    off_t offset;
+    /* userfaultfd the mapping is registered with, -1 if none */
+    int uffd;
+
+    /* gets called before unmapping */
+    int (*unmap_cb)(void *addr, size_t len, void *opaque);
+    void *opaque;
+};
+
 struct vhd_memory_region {
     /* start of the region in guest physical space */
     uint64_t gpa;
@@ -14,15 +55,11 @@ struct vhd_memory_region {
     void *ptr;
     /* region size */
     size_t size;
-};
+    /* id returned by map_cb */
+    uint32_t id;
 
-/*
- * This should be no less than VHOST_USER_MEM_REGIONS_MAX, to accept any
- * allowed VHOST_USER_SET_MEM_TABLE message.  The master may use more via
- * VHOST_USER_ADD_MEM_REG message if VHOST_USER_PROTOCOL_F_CONFIGURE_MEM_SLOTS
- * is negotiated.
- */
-#define VHD_RAM_SLOTS_MAX 32
+    struct vhd_memory_mapping *mapping;
+};
 
 struct vhd_memory_map {
     struct objref ref;
@@ -33,30 +70,130 @@ struct vhd_memory_map {
     int (*unmap_cb)(void *addr, size_t len, void *opaque);
     void *opaque;
 
+    struct vhd_mem_policy policy;
+
+    /* userfaultfd to register the regions with, -1 if none */
+    int uffd;
+
     /* actual number of slots used */
     unsigned num;
+    /* sorted in ascending order of gpa */
     struct vhd_memory_region regions[VHD_RAM_SLOTS_MAX];
+
+    /* indices in @regions sorted in ascending order of uva and ptr */
+    uint8_t by_uva[VHD_RAM_SLOTS_MAX];
+    uint8_t by_ptr[VHD_RAM_SLOTS_MAX];
 };
 
+VHD_STATIC_ASSERT(VHD_RAM_SLOTS_MAX <= UINT8_MAX);
+
+static uint64_t region_gpa(const struct vhd_memory_region *reg)
+{
+    return reg->gpa;
+}
+
+static uint64_t region_uva(const struct vhd_memory_region *reg)
+{
+    return reg->uva;
+}
+
+static uint64_t region_ptr(const struct vhd_memory_region *reg)
+{
+    return (uintptr_t)reg->ptr;
+}
+
+static inline bool region_contains(const struct vhd_memory_region *reg,
+                                   uint64_t (*start)(const struct vhd_memory_region *),
+                                   uint64_t addr)
+{
+    return addr >= start(reg) && addr - start(reg) < reg->size;
+}
+
+/*
+ * Find the region containing @addr in the address space given by @start.
+ * @order lists region indices sorted in that address space, or is NULL if the
+ * regions array itself is sorted so (which is the case for gpa).
+ *
+ * @hint, if not NULL, is the index of the region to try first; it's updated
+ * when a different region is found.
+ */
+static struct vhd_memory_region *memmap_lookup(
+    struct vhd_memory_map *mm, const uint8_t *order,
+    uint64_t (*start)(const struct vhd_memory_region *),
+    uint64_t addr, unsigned *hint)
+{
+    unsigned lo = 0, hi = mm->num;
+    unsigned idx;
+
+    if (hint && *hint < mm->num &&
+        region_contains(&mm->regions[*hint], start, addr)) {
+        return &mm->regions[*hint];
+    }
+
+    /* find the last region starting at or below addr */
+    while (lo < hi) {
+        unsigned mid = lo + (hi - lo) / 2;
+        idx = order ? order[mid] : mid;
+        if (start(&mm->regions[idx]) <= addr) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    if (!lo) {
+        return NULL;
+    }
+
+    idx = order ? order[lo - 1] : lo - 1;
+    if (!region_contains(&mm->regions[idx], start, addr)) {
+        return NULL;
+    }
+
+    if (hint) {
+        *hint = idx;
+    }
+    return &mm->regions[idx];
+}
+
+/* Rebuild the uva and ptr indices after the set of regions changes */
+static void memmap_reindex(struct vhd_memory_map *mm)
+{
+    unsigned i, j;
+
+    for (i = 0; i < mm->num; i++) {
+        for (j = i; j > 0 &&
+             mm->regions[mm->by_uva[j - 1]].uva > mm->regions[i].uva; j--) {
+            mm->by_uva[j] = mm->by_uva[j - 1];
+        }
+        mm->by_uva[j] = i;
+
+        for (j = i; j > 0 &&
+             mm->regions[mm->by_ptr[j - 1]].ptr > mm->regions[i].ptr; j--) {
+            mm->by_ptr[j] = mm->by_ptr[j - 1];
+        }
+        mm->by_ptr[j] = i;
+    }
+}
+
 /*
  * Returns actual pointer where uva points to
  * or NULL in case of mapping absence
  */
 void *uva_to_ptr(struct vhd_memory_map *mm, uint64_t uva)
 {
-    unsigned i;
+    struct vhd_memory_region *reg =
+        memmap_lookup(mm, mm->by_uva, region_uva, uva, NULL);
 
-    for (i = 0; i < mm->num; i++) {
-        struct vhd_memory_region *reg = &mm->regions[i];
-        if (uva >= reg->uva && uva - reg->uva < reg->size) {
-            return reg->ptr + (uva - reg->uva);
-        }
+    if (!reg) {
+        return NULL;
     }
 
-    return NULL;
+    return reg->ptr + (uva - reg->uva);
 }
 
-static void *map_memory(void *addr, size_t len, int fd, off_t offset)
+static void *map_memory(void *addr, size_t len, int fd, off_t offset,
+                        int extra_flags)
 {
     size_t aligned_len = VHD_ALIGN_PTR_UP(len, HUGE_PAGE_SIZE);
     size_t map_len = aligned_len + HUGE_PAGE_SIZE + PAGE_SIZE;
@@ -70,7 +207,7 @@ static void *map_memory(void *addr, size_t len, int fd, off_t offset)
 
     char *aligned_addr = VHD_ALIGN_PTR_UP(map + PAGE_SIZE, HUGE_PAGE_SIZE);
     addr = mmap(aligned_addr, len, PROT_READ | PROT_WRITE,
-                MAP_SHARED | MAP_FIXED, fd, offset);
+                MAP_SHARED | MAP_FIXED | extra_flags, fd, offset);
     if (addr == MAP_FAILED) {
         VHD_LOG_ERROR("unable to remap memory region %p-%p: %s", aligned_addr,
                       aligned_addr + len, strerror(errno));
@@ -107,64 +244,233 @@ static int unmap_memory(void *addr, size_t len)
     return munmap(map, map_len);
 }
 
+static void mapping_release(struct objref *objref)
+{
+    struct vhd_memory_mapping *mapping =
+        containerof(objref, struct vhd_memory_mapping, ref);
+    void *ptr = mapping->ptr;
+
+    if (mapping->unmap_cb) {
+        size_t len = VHD_ALIGN_PTR_UP(mapping->size, HUGE_PAGE_SIZE);
+        int ret = mapping->unmap_cb(ptr, len, mapping->opaque);
+        if (ret < 0) {
+            VHD_LOG_ERROR("unmap callback failed for region %p-%p: %s",
+                          ptr, ptr + mapping->size, strerror(-ret));
+        }
+    }
+
+    if (unmap_memory(ptr, mapping->size) < 0) {
+        VHD_LOG_ERROR("failed to unmap region at %p", ptr);
+    }
+
+    close(mapping->fd);
+    vhd_free(mapping);
+}
+
+static bool is_hugetlbfs(int fd)
+{
+    struct statfs fs;
+    return fstatfs(fd, &fs) == 0 && fs.f_type == HUGETLBFS_MAGIC;
+}
+
+static void set_numa_preference(void *ptr, size_t size, uint64_t nodes)
+{
+    unsigned long mask = nodes;
+    /* the kernel takes the number of bits plus one */
+    unsigned long maxnode = sizeof(mask) * 8 + 1;
+    long ret;
+
+    if (nodes & (nodes - 1)) {
+        ret = syscall(SYS_mbind, ptr, size, VHD_MPOL_PREFERRED_MANY, &mask,
+                      maxnode, 0);
+        if (ret == 0 || errno != EINVAL) {
+            goto out;
+        }
+        /* MPOL_PREFERRED_MANY is only there since Linux 5.15 */
+        mask = nodes & -nodes;
+    }
+
+    ret = syscall(SYS_mbind, ptr, size, VHD_MPOL_PREFERRED, &mask, maxnode, 0);
+out:
+    if (ret < 0) {
+        VHD_LOG_WARN("mbind(%p-%p, 0x%" PRIx64 "): %s", ptr, ptr + size,
+                     nodes, strerror(errno));
+    }
+}
+
+/*
+ * Apply @policy to a freshly mapped region.  Prefaulting has to follow the
+ * NUMA preference to be of any use, so it's done here rather than with
+ * MAP_POPULATE in that case.
+ */
+static void apply_mem_policy(void *ptr, size_t size, int fd,
+                             const struct vhd_mem_policy *policy)
+{
+    if ((policy->flags & VHD_MEM_HUGEPAGE) && !is_hugetlbfs(fd)) {
+        if (madvise(ptr, size, MADV_HUGEPAGE) < 0) {
+            VHD_LOG_WARN("madvise(%p-%p, MADV_HUGEPAGE): %s", ptr, ptr + size,
+                         strerror(errno));
+        }
+    }
+
+    if (policy->flags & VHD_MEM_DONTDUMP) {
+        if (madvise(ptr, size, MADV_DONTDUMP) < 0) {
+            VHD_LOG_WARN("madvise(%p-%p, MADV_DONTDUMP): %s", ptr, ptr + size,
+                         strerror(errno));
+        }
+    }
+
+    if (policy->numa_nodes) {
+        set_numa_preference(ptr, size, policy->numa_nodes);
+
+        if (policy->flags & VHD_MEM_POPULATE) {
+            if (madvise(ptr, size, MADV_POPULATE_WRITE) < 0) {
+                VHD_LOG_WARN("madvise(%p-%p, MADV_POPULATE_WRITE): %s",
+                             ptr, ptr + size, strerror(errno));
+            }
+        }
+    }
+}
+
+/*
+ * Register a freshly mapped region with @uffd for the missing page faults on
+ * it to be reported there
+ */
+static int uffd_register(void *ptr, size_t size, int fd, int uffd)
+{
+    struct uffdio_register reg = {
+        .range = {
+            .start = (uintptr_t)ptr,
+            .len = VHD_ALIGN_PTR_UP(size, PAGE_SIZE),
+        },
+        .mode = UFFDIO_REGISTER_MODE_MISSING,
+    };
+
+    /* the faults are resolved page by page, don't let THP span several */
+    if (!is_hugetlbfs(fd) && madvise(ptr, size, MADV_NOHUGEPAGE) < 0) {
+        VHD_LOG_WARN("madvise(%p-%p, MADV_NOHUGEPAGE): %s", ptr, ptr + size,
+                     strerror(errno));
+    }
+
+    if (ioctl(uffd, UFFDIO_REGISTER, &reg) < 0) {
+        int ret = -errno;
+        VHD_LOG_ERROR("UFFDIO_REGISTER(%p-%p): %s", ptr, ptr + size,
+                      strerror(-ret));
+        return ret;
+    }
+
+    if (!(reg.ioctls & (1ull << _UFFDIO_COPY))) {
+        VHD_LOG_ERROR("UFFDIO_COPY not supported for region %p-%p", ptr,
+                      ptr + size);
+        return -ENOTSUP;
+    }
+
+    return 0;
+}
+
+/* Stop reporting the missing page faults on @mapping to its userfaultfd */
+static void uffd_unregister(struct vhd_memory_mapping *mapping)
+{
+    struct uffdio_range range = {
+        .start = (uintptr_t)mapping->ptr,
+        .len = VHD_ALIGN_PTR_UP(mapping->size, PAGE_SIZE),
+    };
+
+    if (ioctl(mapping->uffd, UFFDIO_UNREGISTER, &range) < 0) {
+        VHD_LOG_WARN("UFFDIO_UNREGISTER(%p-%p): %s", mapping->ptr,
+                     mapping->ptr + mapping->size, strerror(errno));
+    }
+    mapping->uffd = -1;
+}
+
 static int map_region(struct vhd_memory_region *region, uint64_t gpa,
                       uint64_t uva, size_t size, int fd, off_t offset,
-                      int (*map_cb)(void *, size_t, void *), void *opaque)
+                      struct vhd_memory_map *mm)
 {
+    struct vhd_memory_mapping *mapping;
+    struct vhd_mem_policy policy = mm->policy;
+    uint32_t id = 0;
     void *ptr;
 
-    ptr = map_memory(NULL, size, fd, offset);
+    /*
+     * prefaulting would fill the pages not migrated yet in with zeroes, and
+     * the faults are resolved page by page anyway
+     */
+    if (mm->uffd >= 0) {
+        policy.flags &= ~(VHD_MEM_POPULATE | VHD_MEM_HUGEPAGE);
+    }
+
+    /* keep the file to be able to hand the mapping over to another process */
+    fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    if (fd < 0) {
+        int ret = -errno;
+        VHD_LOG_ERROR("fcntl(F_DUPFD_CLOEXEC): %s", strerror(-ret));
+        return ret;
+    }
+
+    ptr = map_memory(NULL, size, fd, offset,
+                     (policy.flags & VHD_MEM_POPULATE) &&
+                     !policy.numa_nodes ? MAP_POPULATE : 0);
     if (ptr == MAP_FAILED) {
         int ret = -errno;
         VHD_LOG_ERROR("can't mmap memory: %s", strerror(-ret));
+        close(fd);
         return ret;
     }
 
-    if (map_cb) {
+    apply_mem_policy(ptr, size, fd, &policy);
+
+    if (mm->uffd >= 0) {
+        int ret = uffd_register(ptr, size, fd, mm->uffd);
+        if (ret < 0) {
+            unmap_memory(ptr, size);
+            close(fd);
+            return ret;
+        }
+    }
+
+    if (mm->map_cb) {
         size_t len = VHD_ALIGN_PTR_UP(size, HUGE_PAGE_SIZE);
-        int ret = map_cb(ptr, len, opaque);
+        int ret = mm->map_cb(ptr, len, mm->opaque);
         if (ret < 0) {
             VHD_LOG_ERROR("map callback failed for region %p-%p: %s",
                           ptr, ptr + len, strerror(-ret));
-            munmap(ptr, size);
+            unmap_memory(ptr, size);
+            close(fd);
             return ret;
         }
+        id = ret;
     }
 
     /* Mark memory as defined explicitly */
     VHD_MEMCHECK_DEFINED(ptr, size);
 
+    mapping = vhd_alloc(sizeof(*mapping));
+    *mapping = (struct vhd_memory_mapping) {
+        .ptr = ptr,
+        .size = size,
+        .fd = fd,
+        .offset = offset,
+        .uffd = mm->uffd,
+        .unmap_cb = mm->unmap_cb,
+        .opaque = mm->opaque,
+    };
+    objref_init(&mapping->ref, mapping_release);
+
     *region = (struct vhd_memory_region) {
         .ptr = ptr,
         .gpa = gpa,
         .uva = uva,
         .size = size,
+        .id = id,
+        .mapping = mapping,
     };
     return 0;
 }
 
-static int unmap_region(struct vhd_memory_region *reg,
-                        int (*unmap_cb)(void *, size_t, void *), void *opaque)
+static void unmap_region(struct vhd_memory_region *reg)
 {
-    int ret;
-
-    if (unmap_cb) {
-        size_t len = VHD_ALIGN_PTR_UP(reg->size, HUGE_PAGE_SIZE);
-        ret = unmap_cb(reg->ptr, len, opaque);
-        if (ret < 0) {
-            VHD_LOG_ERROR("unmap callback failed for region %p-%p: %s",
-                          reg->ptr, reg->ptr + reg->size, strerror(-ret));
-            return ret;
-        }
-    }
-
-    ret = unmap_memory(reg->ptr, reg->size);
-    if (ret < 0) {
-        VHD_LOG_ERROR("failed to unmap region at %p", reg->ptr);
-        return ret;
-    }
-
-    return 0;
+    objref_put(&reg->mapping->ref);
 }
 
 static void memmap_release(struct objref *objref)
@@ -174,7 +480,7 @@ static void memmap_release(struct objref *objref)
     unsigned i;
 
     for (i = 0; i < mm->num; i++) {
-        unmap_region(&mm->regions[i], mm->unmap_cb, mm->opaque);
+        unmap_region(&mm->regions[i]);
     }
 
     vhd_free(mm);
@@ -192,62 +498,147 @@ void vhd_memmap_unref(struct vhd_memory_map *mm)
     objref_put(&mm->ref);
 }
 
-uint64_t ptr_to_gpa(struct vhd_memory_map *mm, void *ptr)
+uint64_t ptr_to_gpa(struct vhd_memory_map *mm, void *ptr, unsigned *hint)
 {
-    unsigned i;
-    for (i = 0; i < mm->num; ++i) {
-        struct vhd_memory_region *reg = &mm->regions[i];
-        if (ptr >= reg->ptr && ptr < reg->ptr + reg->size) {
-            return (ptr - reg->ptr) + reg->gpa;
-        }
+    struct vhd_memory_region *reg =
+        memmap_lookup(mm, mm->by_ptr, region_ptr, (uintptr_t)ptr, hint);
+
+    if (!reg) {
+        VHD_LOG_WARN("Failed to translate ptr %p to gpa", ptr);
+        return TRANSLATION_FAILED;
     }
 
-    VHD_LOG_WARN("Failed to translate ptr %p to gpa", ptr);
-    return TRANSLATION_FAILED;
+    return (ptr - reg->ptr) + reg->gpa;
 }
 
-void *gpa_range_to_ptr(struct vhd_memory_map *mm,
-                       uint64_t gpa, size_t len) __attribute__ ((weak));
-void *gpa_range_to_ptr(struct vhd_memory_map *mm, uint64_t gpa, size_t len)
+void *gpa_range_to_ptr(struct vhd_memory_map *mm, uint64_t gpa, size_t len,
+                       unsigned *hint) __attribute__ ((weak));
+void *gpa_range_to_ptr(struct vhd_memory_map *mm, uint64_t gpa, size_t len,
+                       unsigned *hint)
 {
-    unsigned i;
+    struct vhd_memory_region *reg =
+        memmap_lookup(mm, NULL, region_gpa, gpa, hint);
 
-    for (i = 0; i < mm->num; i++) {
-        struct vhd_memory_region *reg = &mm->regions[i];
-        if (gpa >= reg->gpa && gpa - reg->gpa < reg->size) {
-            /*
-             * Check (overflow-safe) that length fits in a single region.
-             *
-             * TODO: should we handle gpa areas that cross region boundaries
-             *       but are otherwise valid?
-             */
-            if (len > reg->size || gpa - reg->gpa + len > reg->size) {
-                return NULL;
-            }
+    if (!reg) {
+        return NULL;
+    }
 
-            return reg->ptr + (gpa - reg->gpa);
-        }
+    /* Check (overflow-safe) that length fits in a single region */
+    if (len > reg->size || gpa - reg->gpa + len > reg->size) {
+        return NULL;
     }
 
-    return NULL;
+    return reg->ptr + (gpa - reg->gpa);
 }
 
+void *gpa_to_ptr_partial(struct vhd_memory_map *mm, uint64_t gpa, size_t *len,
+                         unsigned *hint, uint32_t *region_id,
+                         uint64_t *region_offset) __attribute__ ((weak));
+void *gpa_to_ptr_partial(struct vhd_memory_map *mm, uint64_t gpa, size_t *len,
+                         unsigned *hint, uint32_t *region_id,
+                         uint64_t *region_offset)
+{
+    struct vhd_memory_region *reg =
+        memmap_lookup(mm, NULL, region_gpa, gpa, hint);
+
+    if (!reg) {
+        return NULL;
+    }
+
+    *len = MIN(*len, reg->size - (gpa - reg->gpa));
+    *region_id = reg->id;
+    *region_offset = gpa - reg->gpa;
+    return reg->ptr + (gpa - reg->gpa);
+}
 
 struct vhd_memory_map *vhd_memmap_new(int (*map_cb)(void *, size_t, void *),
                                       int (*unmap_cb)(void *, size_t, void *),
-                                      void *opaque)
+                                      void *opaque,
+                                      const struct vhd_mem_policy *policy)
 {
     struct vhd_memory_map *mm = vhd_alloc(sizeof(*mm));
     *mm = (struct vhd_memory_map) {
         .map_cb = map_cb,
         .unmap_cb = unmap_cb,
         .opaque = opaque,
+        .uffd = -1,
     };
+    if (policy) {
+        mm->policy = *policy;
+    }
 
     objref_init(&mm->ref, memmap_release);
     return mm;
 }
 
+int vhd_memmap_get_numa_node(struct vhd_memory_map *mm, unsigned idx)
+{
+    struct vhd_memory_region *reg;
+    void *pages[VHD_NUMA_SAMPLES];
+    int status[VHD_NUMA_SAMPLES];
+    int nodes[VHD_NUMA_SAMPLES];
+    unsigned counts[VHD_NUMA_SAMPLES];
+    unsigned num_pages, num_nodes = 0, best = 0;
+    size_t stride;
+    unsigned i, j;
+
+    if (idx >= mm->num) {
+        return -ENXIO;
+    }
+
+    reg = &mm->regions[idx];
+    num_pages = MIN(reg->size / PAGE_SIZE, VHD_NUMA_SAMPLES);
+    if (!num_pages) {
+        return -ENOENT;
+    }
+
+    stride = reg->size / num_pages / PAGE_SIZE * PAGE_SIZE;
+    for (i = 0; i < num_pages; i++) {
+        pages[i] = reg->ptr + stride * i;
+    }
+
+    /* with no target nodes this only queries where the pages are */
+    if (syscall(SYS_move_pages, 0, num_pages, pages, NULL, status, 0) < 0) {
+        int ret = -errno;
+        VHD_LOG_ERROR("move_pages(%p-%p): %s", reg->ptr, reg->ptr + reg->size,
+                      strerror(-ret));
+        return ret;
+    }
+
+    for (i = 0; i < num_pages; i++) {
+        if (status[i] < 0) {
+            continue;
+        }
+        for (j = 0; j < num_nodes && nodes[j] != status[i]; j++) {
+            ;
+        }
+        if (j == num_nodes) {
+            nodes[j] = status[i];
+            counts[j] = 0;
+            num_nodes++;
+        }
+        if (++counts[j] > counts[best]) {
+            best = j;
+        }
+    }
+
+    return num_nodes ? nodes[best] : -ENOENT;
+}
+
+struct vhd_memory_map *vhd_memmap_dup(struct vhd_memory_map *mm)
+{
+    struct vhd_memory_map *new_mm = vhd_alloc(sizeof(*new_mm));
+    unsigned i;
+
+    *new_mm = *mm;
+    for (i = 0; i < new_mm->num; i++) {
+        objref_get(&new_mm->regions[i].mapping->ref);
+    }
+
+    objref_init(&new_mm->ref, memmap_release);
+    return new_mm;
+}
+
 int vhd_memmap_add_slot(struct vhd_memory_map *mm, uint64_t gpa, uint64_t uva,
                         size_t size, int fd, off_t offset)
 {
@@ -263,11 +654,14 @@ int vhd_memmap_add_slot(struct vhd_memory_map *mm, uint64_t gpa, uint64_t uva,
     if (mm->num == VHD_RAM_SLOTS_MAX) {
         return -ENOBUFS;
     }
-    /* check for intersection with existing slots */
+    /*
+     * check for intersection with existing slots; neither gpa nor uva ranges
+     * may overlap at all for lookups by either to remain unambiguous
+     */
     for (i = 0; i < mm->num; i++) {
         struct vhd_memory_region *reg = &mm->regions[i];
-        if (reg->gpa + reg->size <= gpa || gpa + size <= reg->gpa ||
-            reg->uva + reg->size <= uva || uva + size <= reg->uva) {
+        if ((reg->gpa + reg->size <= gpa || gpa + size <= reg->gpa) &&
+            (reg->uva + reg->size <= uva || uva + size <= reg->uva)) {
             continue;
         }
         return -EINVAL;
@@ -281,8 +675,7 @@ int vhd_memmap_add_slot(struct vhd_memory_map *mm, uint64_t gpa, uint64_t uva,
         }
     }
 
-    ret = map_region(&region, gpa, uva, size, fd, offset,
-                     mm->map_cb, mm->opaque);
+    ret = map_region(&region, gpa, uva, size, fd, offset, mm);
     if (ret < 0) {
         return ret;
     }
@@ -293,6 +686,7 @@ int vhd_memmap_add_slot(struct vhd_memory_map *mm, uint64_t gpa, uint64_t uva,
     }
     mm->regions[i] = region;
     mm->num++;
+    memmap_reindex(mm);
 
     return 0;
 }
@@ -300,7 +694,6 @@ int vhd_memmap_add_slot(struct vhd_memory_map *mm, uint64_t gpa, uint64_t uva,
 int vhd_memmap_del_slot(struct vhd_memory_map *mm, uint64_t gpa, uint64_t uva,
                         size_t size)
 {
-    int ret;
     unsigned i;
 
     for (i = 0; i < mm->num; i++) {
@@ -314,16 +707,107 @@ int vhd_memmap_del_slot(struct vhd_memory_map *mm, uint64_t gpa, uint64_t uva,
         return -ENXIO;
     }
 
-    ret = unmap_region(&mm->regions[i], mm->unmap_cb, mm->opaque);
-    if (ret < 0) {
-        return ret;
-    }
+    unmap_region(&mm->regions[i]);
 
     mm->num--;
     if (i < mm->num) {
         memmove(&mm->regions[i], &mm->regions[i + 1],
                 sizeof(mm->regions[0]) * (mm->num - i));
     }
+    memmap_reindex(mm);
+
+    return 0;
+}
+
+int vhd_memmap_uffd_open(void)
+{
+    struct uffdio_api api = { .api = UFFD_API };
+    int uffd, ret;
+
+    uffd = syscall(SYS_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+    if (uffd < 0) {
+        ret = -errno;
+        VHD_LOG_ERROR("userfaultfd: %s", strerror(-ret));
+        return ret;
+    }
+
+    if (ioctl(uffd, UFFDIO_API, &api) < 0) {
+        ret = -errno;
+        VHD_LOG_ERROR("UFFDIO_API: %s", strerror(-ret));
+        close(uffd);
+        return ret;
+    }
+
+    return uffd;
+}
+
+int vhd_memmap_set_uffd(struct vhd_memory_map *mm, int uffd)
+{
+    bool registered[VHD_RAM_SLOTS_MAX] = {};
+    unsigned i;
+    int ret;
+
+    if (uffd < 0) {
+        for (i = 0; i < mm->num; i++) {
+            struct vhd_memory_mapping *mapping = mm->regions[i].mapping;
+
+            if (mapping->uffd >= 0) {
+                uffd_unregister(mapping);
+            }
+        }
+        mm->uffd = -1;
+        return 0;
+    }
+
+    /* those shared with other memory maps may be registered already */
+    for (i = 0; i < mm->num; i++) {
+        struct vhd_memory_mapping *mapping = mm->regions[i].mapping;
+
+        if (mapping->uffd == uffd) {
+            continue;
+        }
+
+        ret = uffd_register(mapping->ptr, mapping->size, mapping->fd, uffd);
+        if (ret < 0) {
+            goto fail;
+        }
+        mapping->uffd = uffd;
+        registered[i] = true;
+    }
+
+    mm->uffd = uffd;
+    return 0;
+
+fail:
+    /* leave alone those registered before, other memory maps rely on them */
+    while (i--) {
+        if (registered[i]) {
+            uffd_unregister(mm->regions[i].mapping);
+        }
+    }
+    return ret;
+}
+
+unsigned vhd_memmap_num_slots(struct vhd_memory_map *mm)
+{
+    return mm->num;
+}
+
+int vhd_memmap_get_slot(struct vhd_memory_map *mm, unsigned idx,
+                        uint64_t *gpa, uint64_t *uva, size_t *size, int *fd,
+                        off_t *offset)
+{
+    struct vhd_memory_region *reg;
+
+    if (idx >= mm->num) {
+        return -ENOENT;
+    }
 
+    reg = &mm->regions[idx];
+    *gpa = reg->gpa;
+    *uva = reg->uva;
+    *size = reg->size;
+    *fd = reg->mapping->fd;
+    *offset = reg->mapping->offset;
     return 0;
 }
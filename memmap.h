@@ -4,28 +4,95 @@
 #include <stdint.h>
 #include <sys/mman.h>
 
+#include "vhost/types.h"
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 struct vhd_memory_map;
 
+/*
+ * This should be no less than VHOST_USER_MEM_REGIONS_MAX, to accept any
+ * allowed VHOST_USER_SET_MEM_TABLE message.  The master may use more via
+ * VHOST_USER_ADD_MEM_REG message if VHOST_USER_PROTOCOL_F_CONFIGURE_MEM_SLOTS
+ * is negotiated.
+ */
+#define VHD_RAM_SLOTS_MAX 32
+
+/*
+ * @policy, if not NULL, is applied to every region mapped into the memory map
+ * and the ones derived from it with vhd_memmap_dup().
+ */
 struct vhd_memory_map *vhd_memmap_new(int (*map_cb)(void *, size_t, void *),
                                       int (*unmap_cb)(void *, size_t, void *),
-                                      void *opaque);
+                                      void *opaque,
+                                      const struct vhd_mem_policy *policy);
+
+/*
+ * Create a copy of @mm sharing the mappings of its regions, to be updated
+ * with vhd_memmap_add_slot()/vhd_memmap_del_slot() while @mm remains in use.
+ * A region is only unmapped once no memory map contains it.
+ */
+struct vhd_memory_map *vhd_memmap_dup(struct vhd_memory_map *mm);
 
 int vhd_memmap_add_slot(struct vhd_memory_map *mm, uint64_t gpa, uint64_t uva,
                         size_t size, int fd, off_t offset);
 int vhd_memmap_del_slot(struct vhd_memory_map *mm, uint64_t gpa, uint64_t uva,
                         size_t size);
 
+/*
+ * Postcopy migration support.  vhd_memmap_uffd_open() creates a userfaultfd
+ * for the master to resolve the faults on the guest pages not migrated yet
+ * through.  Once vhd_memmap_set_uffd() is called with it, all the regions of
+ * @mm, current and mapped later, are registered with it for missing page
+ * faults, without prefaulting them; if that fails for some, the regions are
+ * left registered as they were.  -1 unregisters them all, including those
+ * shared with other memory maps.  Both return negative error code on failure.
+ */
+int vhd_memmap_uffd_open(void);
+int vhd_memmap_set_uffd(struct vhd_memory_map *mm, int uffd);
+
+/*
+ * Get the number of slots and the parameters of slot @idx as passed to
+ * vhd_memmap_add_slot(), e.g. to hand the memory map over to another process.
+ * @fd is a duplicate owned by the memory map and valid as long as it is.
+ */
+unsigned vhd_memmap_num_slots(struct vhd_memory_map *mm);
+int vhd_memmap_get_slot(struct vhd_memory_map *mm, unsigned idx,
+                        uint64_t *gpa, uint64_t *uva, size_t *size, int *fd,
+                        off_t *offset);
+
+/*
+ * Get the NUMA node most of the resident pages of slot @idx are on, judging
+ * by a sample of them.  Returns -ENOENT if none of the sampled pages is
+ * resident.
+ */
+int vhd_memmap_get_numa_node(struct vhd_memory_map *mm, unsigned idx);
+
 void vhd_memmap_ref(struct vhd_memory_map *mm);
 void vhd_memmap_unref(struct vhd_memory_map *mm);
 
-void *gpa_range_to_ptr(struct vhd_memory_map *mm, uint64_t gpa, size_t len);
+/*
+ * Address translation.  @hint, if not NULL, points to the caller-owned index
+ * of the region where the previous lookup succeeded; it's checked first and
+ * updated on a miss.  Any value is safe, so it may be left over from lookups
+ * in another memory map.
+ */
+void *gpa_range_to_ptr(struct vhd_memory_map *mm, uint64_t gpa, size_t len,
+                       unsigned *hint);
+/*
+ * Same as gpa_range_to_ptr() but the range may cross region boundaries: @len
+ * is trimmed to the part contained in the region @gpa belongs to.  The id the
+ * region was tagged with by map_cb and the offset from its start are stored
+ * in @region_id and @region_offset.
+ */
+void *gpa_to_ptr_partial(struct vhd_memory_map *mm, uint64_t gpa, size_t *len,
+                         unsigned *hint, uint32_t *region_id,
+                         uint64_t *region_offset);
 void *uva_to_ptr(struct vhd_memory_map *mm, uint64_t uva);
 #define TRANSLATION_FAILED ((uint64_t)-1)
-uint64_t ptr_to_gpa(struct vhd_memory_map *mm, void *ptr);
+uint64_t ptr_to_gpa(struct vhd_memory_map *mm, void *ptr, unsigned *hint);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,180 @@
+/*
+ * Null block backend: completes requests without doing any I/O
+ */
+
+#include <pthread.h>
+#include <string.h>
+
+#include "vhost/blockdev.h"
+#include "vhost/server.h"
+#include "logging.h"
+#include "platform.h"
+
+/* bios completed with a single vhd_complete_bios() */
+#define NULL_BDEV_BATCH 64u
+
+struct vhd_null_bdev {
+    unsigned flags;
+
+    /* completion thread mode only */
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool stopping;
+
+    /* bios submitted but not picked up by the completion thread yet */
+    struct vhd_bdev_io **pending;
+    unsigned num_pending;
+    unsigned max_pending;
+};
+
+/* all VHD_BDEV_SUCCESS */
+static const enum vhd_bdev_io_result g_success[NULL_BDEV_BATCH];
+
+static void complete_bios(struct vhd_null_bdev *nb, struct vhd_bdev_io **bios,
+                          unsigned n)
+{
+    unsigned i, j;
+
+    for (i = 0; i < n; i += NULL_BDEV_BATCH) {
+        unsigned batch = MIN(n - i, NULL_BDEV_BATCH);
+
+        if (nb->flags & VHD_NULL_BDEV_ZERO_READS) {
+            for (j = i; j < i + batch; j++) {
+                struct vhd_bdev_io *bio = bios[j];
+                size_t k;
+
+                if (bio->type != VHD_BDEV_READ) {
+                    continue;
+                }
+                for (k = 0; k < bio->sglist.nbuffers; k++) {
+                    memset(bio->sglist.buffers[k].base, 0,
+                           bio->sglist.buffers[k].len);
+                }
+            }
+        }
+
+        vhd_complete_bios(bios + i, g_success, batch);
+    }
+}
+
+static void *null_bdev_thread(void *opaque)
+{
+    struct vhd_null_bdev *nb = opaque;
+    struct vhd_bdev_io **batch = NULL;
+    unsigned max_batch = 0;
+
+    pthread_mutex_lock(&nb->lock);
+    for (;;) {
+        struct vhd_bdev_io **tmp;
+        unsigned n, max_tmp;
+
+        while (!nb->num_pending && !nb->stopping) {
+            pthread_cond_wait(&nb->cond, &nb->lock);
+        }
+        if (!nb->num_pending) {
+            break;
+        }
+
+        /* take over the whole pending array, leaving ours for submitters */
+        tmp = batch;
+        batch = nb->pending;
+        nb->pending = tmp;
+        n = nb->num_pending;
+        nb->num_pending = 0;
+        max_tmp = max_batch;
+        max_batch = nb->max_pending;
+        nb->max_pending = max_tmp;
+        pthread_mutex_unlock(&nb->lock);
+
+        complete_bios(nb, batch, n);
+
+        pthread_mutex_lock(&nb->lock);
+    }
+    pthread_mutex_unlock(&nb->lock);
+
+    vhd_free(batch);
+    return NULL;
+}
+
+struct vhd_null_bdev *vhd_null_bdev_new(unsigned flags)
+{
+    struct vhd_null_bdev *nb = vhd_zalloc(sizeof(*nb));
+    int ret;
+
+    nb->flags = flags;
+
+    if (flags & VHD_NULL_BDEV_COMPLETION_THREAD) {
+        pthread_mutex_init(&nb->lock, NULL);
+        pthread_cond_init(&nb->cond, NULL);
+
+        ret = pthread_create(&nb->thread, NULL, null_bdev_thread, nb);
+        if (ret) {
+            VHD_LOG_ERROR("can't create completion thread: %s",
+                          strerror(ret));
+            pthread_cond_destroy(&nb->cond);
+            pthread_mutex_destroy(&nb->lock);
+            vhd_free(nb);
+            return NULL;
+        }
+    }
+
+    return nb;
+}
+
+void vhd_null_bdev_free(struct vhd_null_bdev *nb)
+{
+    if (nb->flags & VHD_NULL_BDEV_COMPLETION_THREAD) {
+        pthread_mutex_lock(&nb->lock);
+        nb->stopping = true;
+        pthread_cond_signal(&nb->cond);
+        pthread_mutex_unlock(&nb->lock);
+
+        pthread_join(nb->thread, NULL);
+        pthread_cond_destroy(&nb->cond);
+        pthread_mutex_destroy(&nb->lock);
+        vhd_free(nb->pending);
+    }
+
+    vhd_free(nb);
+}
+
+void vhd_null_bdev_submit(struct vhd_null_bdev *nb,
+                          const struct vhd_request *reqs, unsigned n)
+{
+    unsigned i;
+
+    if (!n) {
+        return;
+    }
+
+    if (!(nb->flags & VHD_NULL_BDEV_COMPLETION_THREAD)) {
+        struct vhd_bdev_io *bios[NULL_BDEV_BATCH];
+
+        while (n) {
+            unsigned batch = MIN(n, NULL_BDEV_BATCH);
+
+            for (i = 0; i < batch; i++) {
+                bios[i] = reqs[i].bio;
+            }
+            complete_bios(nb, bios, batch);
+            reqs += batch;
+            n -= batch;
+        }
+        return;
+    }
+
+    pthread_mutex_lock(&nb->lock);
+    if (nb->num_pending + n > nb->max_pending) {
+        nb->max_pending = MAX(nb->max_pending * 2, nb->num_pending + n);
+        nb->pending = vhd_realloc(nb->pending,
+                                  nb->max_pending * sizeof(nb->pending[0]));
+    }
+    for (i = 0; i < n; i++) {
+        nb->pending[nb->num_pending++] = reqs[i].bio;
+    }
+    if (nb->num_pending == n) {
+        pthread_cond_signal(&nb->cond);
+    }
+    pthread_mutex_unlock(&nb->lock);
+}
@@ -10,12 +10,15 @@
 #include <errno.h>
 #include <unistd.h>
 #include <stdarg.h>
+#include <time.h>
 
 #define PAGE_SHIFT  12
 #define PAGE_SIZE   (1ul << PAGE_SHIFT)
 
 #define HUGE_PAGE_SIZE 0x200000
 
+#define VHD_CACHELINE_SIZE 64
+
 /*////////////////////////////////////////////////////////////////////////////*/
 
 #if !defined(NDEBUG)
@@ -46,6 +49,26 @@
 #   error Implement me
 #endif
 
+/*
+ * Cheap monotonic counter of CPU time stamp cycles, for accounting the time
+ * spent in short code sections; see vhd_cycles_to_ns() for the conversion.
+ * Falls back to CLOCK_MONOTONIC nanoseconds where there's no usable counter.
+ */
+static inline uint64_t vhd_cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#elif defined(__aarch64__)
+    uint64_t val;
+    __asm__ volatile("mrs %0, cntvct_el0" : "=r"(val));
+    return val;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+#endif
+}
+
 /* TODO: compiler-specifics for non-gcc? */
 #ifdef __GNUC__
 #   define __STRINGIFY(x)           #x
@@ -162,7 +185,25 @@ static inline void *vhd_calloc(size_t nmemb, size_t size)
     return p;
 }
 
-/* TODO: aligned alloc */
+static inline void *vhd_realloc(void *p, size_t bytes)
+{
+    VHD_ASSERT(bytes != 0);
+
+    p = realloc(p, bytes);
+    VHD_VERIFY(p != NULL);
+    return p;
+}
+
+static inline void *vhd_aligned_alloc(size_t align, size_t bytes)
+{
+    void *p;
+
+    VHD_ASSERT(bytes != 0);
+
+    int ret = posix_memalign(&p, align, bytes);
+    VHD_VERIFY(ret == 0);
+    return p;
+}
 
 static inline void vhd_free(void *p)
 {
@@ -0,0 +1,101 @@
+/*
+ * Lock-free rate limiter, a token bucket implemented as the generic cell rate
+ * algorithm: instead of a token count, it keeps the time the bucket gets
+ * refilled up to the level corresponding to the admitted work, so that
+ * consumers on any thread just need to advance a single timestamp.
+ */
+
+#pragma once
+
+#include <stdatomic.h>
+#include <stdbool.h>
+
+#include "catomic.h"
+#include "platform.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define VHD_NSEC_PER_SEC 1000000000ull
+
+struct vhd_rate_limit {
+    /* units per second, 0 if unlimited */
+    atomic_ulong rate;
+    /* how far the admitted work may run ahead of the rate */
+    atomic_ulong burst_ns;
+    /* "theoretical arrival time": when the admitted work is paid off */
+    atomic_ulong tat_ns;
+};
+
+static inline uint64_t vhd_rate_units_to_ns(uint64_t units, uint64_t rate)
+{
+    return (unsigned __int128)units * VHD_NSEC_PER_SEC / rate;
+}
+
+/*
+ * Set @rate units per second with bursts of up to @burst units; 0 @rate
+ * means no limit, 0 @burst means a tenth of a second worth of @rate.
+ */
+static inline void vhd_rate_limit_set(struct vhd_rate_limit *rl,
+                                      uint64_t rate, uint64_t burst)
+{
+    uint64_t burst_ns = 0;
+
+    if (rate) {
+        burst_ns = burst ? vhd_rate_units_to_ns(burst, rate) :
+                           VHD_NSEC_PER_SEC / 10;
+    }
+
+    atomic_set(&rl->burst_ns, burst_ns);
+    atomic_set(&rl->tat_ns, 0);
+    atomic_set(&rl->rate, rate);
+}
+
+/*
+ * Check if there's room for more work at time @now; if not, return false and
+ * set @wake_ns to when there will be.  A single unit of work of any size is
+ * admitted if there's any room at all, so the limiter may go into debt.
+ */
+static inline bool vhd_rate_limit_check(struct vhd_rate_limit *rl,
+                                        uint64_t now, uint64_t *wake_ns)
+{
+    uint64_t tat, burst_ns;
+
+    if (!atomic_read(&rl->rate)) {
+        return true;
+    }
+
+    tat = atomic_read(&rl->tat_ns);
+    burst_ns = atomic_read(&rl->burst_ns);
+    if (tat <= now + burst_ns) {
+        return true;
+    }
+
+    *wake_ns = tat - burst_ns;
+    return false;
+}
+
+/*
+ * Account @units of work admitted at time @now.
+ */
+static inline void vhd_rate_limit_charge(struct vhd_rate_limit *rl,
+                                         uint64_t units, uint64_t now)
+{
+    uint64_t rate = atomic_read(&rl->rate);
+    uint64_t cost_ns, tat, new_tat;
+
+    if (!rate) {
+        return;
+    }
+
+    cost_ns = vhd_rate_units_to_ns(units, rate);
+    tat = atomic_read(&rl->tat_ns);
+    do {
+        new_tat = MAX(tat, now) + cost_ns;
+    } while (!atomic_compare_exchange_weak(&rl->tat_ns, &tat, new_tat));
+}
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,151 @@
+#!/usr/bin/env python3
+"""
+Decode a libvhost request trace dump (see include/vhost/trace.h)
+
+  vhd_trace.py events TRACE     replay the events of all threads in time order
+  vhd_trace.py latency TRACE    per-stage latency percentiles and the slowest
+                                requests with their timelines
+
+A request is followed by its virtqueue and descriptor chain head from the
+fetch from the virtqueue to the push to the used ring.
+"""
+
+import argparse
+import collections
+import struct
+import sys
+
+POINTS = ('kick', 'vq_dequeue', 'rq_enqueue', 'backend_dequeue', 'complete',
+          'completion', 'used_push', 'notify')
+# the stages of a request, in the order they are passed
+REQUEST_POINTS = POINTS[1:7]
+
+HEADER = struct.Struct('=8sIIII')
+VQ = struct.Struct('=II')
+THREAD = struct.Struct('=IIQ')
+EVENT = struct.Struct('=QIHBB')
+
+Event = collections.namedtuple('Event', 'ts tid vq head point')
+
+
+def parse(path):
+    with open(path, 'rb') as f:
+        data = f.read()
+
+    magic, version, event_size, num_vqs, num_threads = \
+        HEADER.unpack_from(data, 0)
+    if magic != b'VHDTRACE' or version != 1 or event_size != EVENT.size:
+        raise ValueError('{}: not a supported trace dump'.format(path))
+    off = HEADER.size
+
+    vqs = {0: '-'}
+    for _ in range(num_vqs):
+        vq_id, name_len = VQ.unpack_from(data, off)
+        off += VQ.size
+        vqs[vq_id] = data[off:off + name_len].decode(errors='replace')
+        off += name_len
+
+    events = []
+    for _ in range(num_threads):
+        tid, _, num_events = THREAD.unpack_from(data, off)
+        off += THREAD.size
+        for ts, vq_id, head, point, _ in EVENT.iter_unpack(
+                data[off:off + num_events * EVENT.size]):
+            events.append(Event(ts, tid, vq_id, head, point))
+        off += num_events * EVENT.size
+
+    events.sort(key=lambda e: e.ts)
+    return vqs, events
+
+
+def point_name(point):
+    return POINTS[point] if point < len(POINTS) else str(point)
+
+
+def cmd_events(args, vqs, events):
+    start = events[0].ts if events else 0
+    for e in events:
+        print('{:14.3f} {:7} {:16} {:5} {}'.format(
+            (e.ts - start) / 1000, e.tid, point_name(e.point), e.head,
+            vqs.get(e.vq, e.vq)))
+
+
+def requests(events):
+    """ Yield the timelines of complete requests: [(point, ts, tid)] """
+    pending = {}
+    for e in events:
+        if e.point >= len(POINTS) or POINTS[e.point] not in REQUEST_POINTS:
+            continue
+        key = (e.vq, e.head)
+        if POINTS[e.point] == 'vq_dequeue':
+            pending[key] = []
+        timeline = pending.get(key)
+        if timeline is None:
+            # started before the oldest event kept
+            continue
+        timeline.append((POINTS[e.point], e.ts, e.tid))
+        if POINTS[e.point] == 'used_push':
+            del pending[key]
+            yield key, timeline
+
+
+def percentile(values, pct):
+    return values[min(len(values) - 1, int(len(values) * pct / 100))]
+
+
+def cmd_latency(args, vqs, events):
+    stages = collections.defaultdict(list)
+    totals = []
+    for key, timeline in requests(events):
+        for (p0, t0, _), (p1, t1, _) in zip(timeline, timeline[1:]):
+            stages[(p0, p1)].append(t1 - t0)
+        totals.append((timeline[-1][1] - timeline[0][1], key, timeline))
+
+    if not totals:
+        print('no complete requests in the trace')
+        return
+
+    print('{:34} {:>8} {:>10} {:>10} {:>10} {:>10}'.format(
+        'stage', 'count', 'p50 us', 'p99 us', 'p99.9 us', 'max us'))
+    order = {p: i for i, p in enumerate(REQUEST_POINTS)}
+    for (p0, p1), lat in sorted(stages.items(),
+                                key=lambda s: (order[s[0][0]],
+                                               order[s[0][1]])):
+        lat.sort()
+        print('{:34} {:8} {:10.1f} {:10.1f} {:10.1f} {:10.1f}'.format(
+            '{} -> {}'.format(p0, p1), len(lat),
+            percentile(lat, 50) / 1000, percentile(lat, 99) / 1000,
+            percentile(lat, 99.9) / 1000, lat[-1] / 1000))
+
+    totals.sort(key=lambda t: t[0], reverse=True)
+    print('\nslowest requests:')
+    for total, (vq, head), timeline in totals[:args.top]:
+        print('{:10.1f} us  {} head {}'.format(total / 1000,
+                                               vqs.get(vq, vq), head))
+        for point, ts, tid in timeline:
+            print('    {:+10.1f} us  {:16} tid {}'.format(
+                (ts - timeline[0][1]) / 1000, point, tid))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+        formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('command', choices=('events', 'latency'))
+    parser.add_argument('trace', help='file written by vhd_trace_dump()')
+    parser.add_argument('--top', type=int, default=10,
+                        help='number of slowest requests to show')
+    args = parser.parse_args()
+
+    try:
+        vqs, events = parse(args.trace)
+    except (OSError, ValueError, struct.error) as e:
+        sys.exit(str(e))
+
+    if args.command == 'events':
+        cmd_events(args, vqs, events)
+    else:
+        cmd_latency(args, vqs, events)
+
+
+if __name__ == '__main__':
+    main()
@@ -1,4 +1,7 @@
+#include <limits.h>
 #include <pthread.h>
+#include <sched.h>
+#include <sys/timerfd.h>
 
 #include "platform.h"
 #include "server_internal.h"
@@ -6,25 +9,32 @@
 #include "vhost/blockdev.h"
 #include "bio.h"
 #include "logging.h"
+#include "trace.h"
 #include "vdev.h"
 
 #define VHOST_EVENT_LOOP_EVENTS 128
 
-static struct vhd_event_loop *g_vhost_evloop;
-static pthread_t g_vhost_thread;
+#define VHOST_CTL_THREAD_NAME "vhd-ctl"
 
-static inline void free_vhost_event_loop(void)
-{
-    vhd_free_event_loop(g_vhost_evloop);
-    g_vhost_evloop = NULL;
-}
+/*
+ * Vhost control event loops, each run by its own thread; devices are spread
+ * across them by hashing their socket paths
+ */
+struct vhd_ctl_loop {
+    struct vhd_event_loop *evloop;
+    pthread_t thread;
+};
+
+static struct vhd_ctl_loop *g_ctl_loops;
+static unsigned g_num_ctl_loops;
 
 static void *vhost_evloop_func(void *arg)
 {
+    struct vhd_event_loop *evloop = arg;
     int res;
 
     do {
-        res = vhd_run_event_loop(g_vhost_evloop, -1);
+        res = vhd_run_event_loop(evloop, -1);
     } while (res == -EAGAIN);
 
     if (res < 0) {
@@ -34,57 +44,214 @@ static void *vhost_evloop_func(void *arg)
     return NULL;
 }
 
-int vhd_start_vhost_server(log_function log_fn)
+static void stop_ctl_loops(unsigned num)
+{
+    unsigned i;
+
+    for (i = 0; i < num; i++) {
+        vhd_terminate_event_loop(g_ctl_loops[i].evloop);
+    }
+    for (i = 0; i < num; i++) {
+        pthread_join(g_ctl_loops[i].thread, NULL);
+        vhd_free_event_loop(g_ctl_loops[i].evloop);
+    }
+
+    vhd_free(g_ctl_loops);
+    g_ctl_loops = NULL;
+}
+
+static int ctl_thread_attr_init(pthread_attr_t *attr,
+                                const struct vhd_server_opts *opts)
+{
+    unsigned i;
+    int res;
+
+    res = pthread_attr_init(attr);
+    if (res) {
+        return -res;
+    }
+
+    if (opts->num_cpus) {
+        cpu_set_t cpuset;
+
+        CPU_ZERO(&cpuset);
+        for (i = 0; i < opts->num_cpus; i++) {
+            if (opts->cpus[i] >= CPU_SETSIZE) {
+                VHD_LOG_ERROR("CPU %u is out of range", opts->cpus[i]);
+                res = EINVAL;
+                goto fail;
+            }
+            CPU_SET(opts->cpus[i], &cpuset);
+        }
+
+        res = pthread_attr_setaffinity_np(attr, sizeof(cpuset), &cpuset);
+        if (res) {
+            goto fail;
+        }
+    }
+
+    if (opts->sched_policy != SCHED_OTHER || opts->sched_priority) {
+        struct sched_param param = {
+            .sched_priority = opts->sched_priority,
+        };
+
+        res = pthread_attr_setinheritsched(attr, PTHREAD_EXPLICIT_SCHED);
+        if (!res) {
+            res = pthread_attr_setschedpolicy(attr, opts->sched_policy);
+        }
+        if (!res) {
+            res = pthread_attr_setschedparam(attr, &param);
+        }
+        if (res) {
+            VHD_LOG_ERROR("invalid scheduling policy %d priority %d",
+                          opts->sched_policy, opts->sched_priority);
+            goto fail;
+        }
+    }
+
+    return 0;
+
+fail:
+    pthread_attr_destroy(attr);
+    return -res;
+}
+
+static void ctl_thread_set_name(pthread_t thread,
+                                const struct vhd_server_opts *opts,
+                                unsigned idx, unsigned num_threads)
+{
+    const char *base = opts->thread_name ?
+        opts->thread_name : VHOST_CTL_THREAD_NAME;
+    /* pthread_setname_np() limit */
+    char name[16];
+    int res;
+
+    if (num_threads > 1) {
+        int suffix_len = snprintf(NULL, 0, "-%u", idx);
+        snprintf(name, sizeof(name), "%.*s-%u",
+                 (int)sizeof(name) - 1 - suffix_len, base, idx);
+    } else {
+        snprintf(name, sizeof(name), "%s", base);
+    }
+
+    res = pthread_setname_np(thread, name);
+    if (res) {
+        VHD_LOG_WARN("failed to set thread name %s: %s", name, strerror(res));
+    }
+}
+
+int vhd_start_vhost_server_opts(log_function log_fn,
+                                const struct vhd_server_opts *opts)
 {
-    if (g_vhost_evloop != NULL) {
+    unsigned num_threads = opts->num_threads ? opts->num_threads : 1;
+    pthread_attr_t attr;
+    unsigned i;
+    int res;
+
+    if (g_num_ctl_loops) {
         return 0;
     }
 
     g_log_fn = log_fn;
 
-    g_vhost_evloop = vhd_create_event_loop(VHOST_EVENT_LOOP_EVENTS);
-    if (!g_vhost_evloop) {
-        VHD_LOG_ERROR("failed to create vhost event loop");
-        return -EIO;
+    res = ctl_thread_attr_init(&attr, opts);
+    if (res < 0) {
+        return res;
     }
 
-    int res = pthread_create(&g_vhost_thread, NULL, vhost_evloop_func, NULL);
-    if (res != 0) {
-        VHD_LOG_ERROR("failed to start vhost event loop thread: %d", res);
-        free_vhost_event_loop();
-        return -res;
+    g_ctl_loops = vhd_calloc(num_threads, sizeof(g_ctl_loops[0]));
+    for (i = 0; i < num_threads; i++) {
+        struct vhd_ctl_loop *ctl = &g_ctl_loops[i];
+
+        ctl->evloop = vhd_create_event_loop(VHOST_EVENT_LOOP_EVENTS);
+        if (!ctl->evloop) {
+            VHD_LOG_ERROR("failed to create vhost event loop");
+            res = -EIO;
+            goto fail;
+        }
+
+        res = pthread_create(&ctl->thread, &attr, vhost_evloop_func,
+                             ctl->evloop);
+        if (res != 0) {
+            VHD_LOG_ERROR("failed to start vhost event loop thread: %s",
+                          strerror(res));
+            vhd_free_event_loop(ctl->evloop);
+            res = -res;
+            goto fail;
+        }
+
+        ctl_thread_set_name(ctl->thread, opts, i, num_threads);
     }
 
+    pthread_attr_destroy(&attr);
+    g_num_ctl_loops = num_threads;
     return 0;
+
+fail:
+    pthread_attr_destroy(&attr);
+    stop_ctl_loops(i);
+    return res;
+}
+
+int vhd_start_vhost_server_threads(log_function log_fn, unsigned num_threads)
+{
+    struct vhd_server_opts opts = {
+        .num_threads = num_threads,
+    };
+
+    if (!num_threads) {
+        return -EINVAL;
+    }
+
+    return vhd_start_vhost_server_opts(log_fn, &opts);
+}
+
+int vhd_start_vhost_server(log_function log_fn)
+{
+    return vhd_start_vhost_server_threads(log_fn, 1);
 }
 
 void vhd_stop_vhost_server(void)
 {
-    if (!g_vhost_evloop) {
+    if (!g_num_ctl_loops) {
         return;
     }
 
-    vhd_terminate_event_loop(g_vhost_evloop);
-    pthread_join(g_vhost_thread, NULL);
-    free_vhost_event_loop();
+    stop_ctl_loops(g_num_ctl_loops);
+    g_num_ctl_loops = 0;
+}
+
+struct vhd_event_loop *vhd_pick_ctl_evloop(const char *key)
+{
+    /* FNV-1a */
+    uint32_t hash = 2166136261u;
+
+    VHD_VERIFY(g_num_ctl_loops);
+
+    for (; *key; key++) {
+        hash = (hash ^ (uint8_t)*key) * 16777619u;
+    }
+
+    return g_ctl_loops[hash % g_num_ctl_loops].evloop;
 }
 
-struct vhd_io_handler *vhd_add_vhost_io_handler(int fd,
+struct vhd_io_handler *vhd_add_vhost_io_handler(struct vhd_vdev *vdev, int fd,
                                                 int (*read)(void *opaque),
                                                 void *opaque)
 {
-    return vhd_add_io_handler(g_vhost_evloop, fd, read, opaque);
+    return vhd_add_io_handler(vdev->ctl_evloop, fd, read, opaque);
 }
 
-void vhd_run_in_ctl(void (*cb)(void *), void *opaque)
+void vhd_run_in_ctl(struct vhd_vdev *vdev, void (*cb)(void *), void *opaque)
 {
-    vhd_bh_schedule_oneshot(g_vhost_evloop, cb, opaque);
+    vhd_bh_schedule_oneshot(vdev->ctl_evloop, cb, opaque);
 }
 
-int vhd_submit_ctl_work_and_wait(void (*func)(struct vhd_work *, void *),
+int vhd_submit_ctl_work_and_wait(struct vhd_vdev *vdev,
+                                 void (*func)(struct vhd_work *, void *),
                                  void *opaque)
 {
-    return vhd_submit_work_and_wait(g_vhost_evloop, func, opaque);
+    return vhd_submit_work_and_wait(vdev->ctl_evloop, func, opaque);
 }
 
 /*////////////////////////////////////////////////////////////////////////////*/
@@ -93,16 +260,122 @@ int vhd_submit_ctl_work_and_wait(void (*func)(struct vhd_work *, void *),
  * Request queues
  */
 
-typedef SLIST_HEAD_ATOMIC(, vhd_bio) vhd_bio_list;
+/*
+ * Completions are handled in batches: the used ring elements of all requests
+ * completed in a batch are published and the guest is notified once per
+ * vring; the vrings are only released from the in-flight accounting after
+ * that, as the vring may be torn down as soon as it has no requests in flight.
+ */
+typedef SLIST_HEAD(, vhd_vring) vhd_vring_batch;
+
+/* entries in the steal ring of a request queue, a power of 2 */
+#define VHD_RQ_STEAL_RING_SIZE  256
+/* max requests a request queue shares with the idle ones of the group at once */
+#define VHD_RQ_STEAL_BATCH      32
+
+/*
+ * Requests scheduled by a request queue for any queue of its group to take:
+ * only the owner adds them at @tail, and whoever takes one, the owner
+ * included, advances @head with a compare-and-swap.  The indexes are never
+ * reused, so a taker that got preempted between reading the slot and the CAS
+ * can't take a stale entry.
+ */
+struct vhd_rq_steal_ring {
+    atomic_ulong head __attribute__((aligned(VHD_CACHELINE_SIZE)));
+    atomic_ulong tail __attribute__((aligned(VHD_CACHELINE_SIZE)));
+    _Atomic(struct vhd_bio *) slots[VHD_RQ_STEAL_RING_SIZE];
+};
+
+struct vhd_rq_group {
+    unsigned num_rqs;
+    struct vhd_request_queue *rqs[];
+};
 
-/* TODO: bounded queue */
 struct vhd_request_queue {
     struct vhd_event_loop *evloop;
 
-    TAILQ_HEAD(, vhd_bio) submission;
+    /*
+     * Deficit round robin of the vrings with requests waiting in their
+     * submission lists, and the vrings held back by their device rate limits
+     * until limited_wake_ns at the earliest
+     */
+    TAILQ_HEAD(, vhd_vring) active;
+    TAILQ_HEAD(, vhd_vring) limited;
+    uint64_t limited_wake_ns;
 
-    vhd_bio_list completion;
+    /*
+     * Requests completed in other threads, in a multi-producer single-consumer
+     * FIFO: pushed to by swapping @completion_tail for the new tail and
+     * linking the old one to it, popped from @completion_head by the
+     * completion bh alone.  @completion_stub keeps it from going empty, so
+     * that a bio is only popped once followed by another one, and isn't
+     * written to by the producers any more.
+     */
+    struct vhd_bio *completion_head;
+    struct vhd_bio *completion_tail;
+    struct vhd_bio completion_stub;
     struct vhd_bh *completion_bh;
+
+    /*
+     * Requests completed in the request queue thread itself, which skip the
+     * completion list and bh; committed once per vhd_run_queue() call
+     */
+    vhd_vring_batch inline_batch;
+
+    /* started vrings attached to this queue */
+    LIST_HEAD(, vhd_vring) vrings;
+
+    /*
+     * Busy polling: how long to keep polling without finding new requests
+     * (0 if polling is disabled), whether the queue is polling right now and
+     * when new requests were last found
+     */
+    uint64_t poll_idle_ns;
+    bool polling;
+    uint64_t poll_last_work_ns;
+
+    /*
+     * In-flight request limits (0 if unlimited), the number of requests in
+     * flight, and the vrings with requests left in their avail rings due to
+     * the limits, to be dispatched again once completions free up slots.
+     * The requests are counted as submitted to the backend, i.e. the guest
+     * requests merged together count once, and the parts of a split one each.
+     */
+    uint32_t max_in_flight;
+    uint16_t max_vring_in_flight;
+    uint32_t num_in_flight;
+    TAILQ_HEAD(, vhd_vring) throttled;
+
+    /*
+     * Whether kick handlers are edge-triggered, and the vrings kicked (or
+     * still producing requests) in the current pass, see rq_recheck_kicked()
+     */
+    bool edge_kicks;
+    TAILQ_HEAD(, vhd_vring) kicked;
+
+    /*
+     * The vrings with coalesced guest notifications held back, and the timer
+     * to send them by their deadlines, armed for notify_timer_ns (0 if
+     * disarmed).  The event loop timeout is too coarse for the microsecond
+     * delays, hence the timerfd; it's only set up while vrings are attached.
+     */
+    TAILQ_HEAD(, vhd_vring) notify_pending;
+    int notify_timerfd;
+    struct vhd_io_handler *notify_timer_handler;
+    uint64_t notify_timer_ns;
+
+    /*
+     * Work stealing within the request queue group, if any, see
+     * vhd_dequeue_group_requests(): the requests scheduled by this queue for
+     * the group to take, whether the thread running it found no requests
+     * anywhere in the group last time it looked, and the bh to wake it up
+     * with once the siblings share some
+     */
+    struct vhd_rq_group *group;
+    unsigned group_idx;
+    struct vhd_rq_steal_ring *steal_ring;
+    atomic_bool steal_idle;
+    struct vhd_bh *steal_bh;
 };
 
 void vhd_run_in_rq(struct vhd_request_queue *rq, void (*cb)(void *),
@@ -111,47 +384,212 @@ void vhd_run_in_rq(struct vhd_request_queue *rq, void (*cb)(void *),
     vhd_bh_schedule_oneshot(rq->evloop, cb, opaque);
 }
 
-static void req_complete(struct vhd_bio *bio)
+static void req_account(struct vhd_bio *bio, uint64_t now)
+{
+    struct vhd_bdev_io *bdev_io = &bio->bdev_io;
+    uint64_t lat_ns[VHD_REQ_PHASE_COUNT];
+    enum vhd_req_op op;
+    uint64_t bytes = 0;
+    unsigned i;
+
+    /* bare vrings not started by a device (e.g. in benchmarks) have none */
+    if (!bio->vring->io_stat) {
+        return;
+    }
+
+    switch (bdev_io->type) {
+    case VHD_BDEV_READ:
+        op = VHD_REQ_OP_READ;
+        bytes = bdev_io->total_sectors * VHD_SECTOR_SIZE;
+        break;
+    case VHD_BDEV_WRITE:
+        op = VHD_REQ_OP_WRITE;
+        bytes = bdev_io->total_sectors * VHD_SECTOR_SIZE;
+        break;
+    default:
+        op = VHD_REQ_OP_OTHER;
+    }
+
+    /*
+     * The timestamps come from the cached clocks of different threads (see
+     * vhd_time_ns()), so a later one may turn out smaller than an earlier one
+     * by the duration of an event loop iteration
+     */
+    for (i = 0; i < VHD_REQ_PHASE_COUNT; i++) {
+        uint64_t start = bio->phase_start_ns[i];
+        uint64_t end = i + 1 < VHD_REQ_PHASE_COUNT ?
+            bio->phase_start_ns[i + 1] : now;
+        lat_ns[i] = end > start ? end - start : 0;
+    }
+
+    vhd_io_stat_account(bio->vring->io_stat, op, bytes, lat_ns);
+}
+
+static void req_complete(vhd_vring_batch *batch, struct vhd_bio *bio,
+                         uint64_t now)
 {
     /* completion_handler destroys bio. save vring for unref */
     struct vhd_vring *vring = bio->vring;
+    struct vhd_cpu_section cpu;
+
+    vhd_cpu_section_start(&cpu);
+    vhd_trace(VHD_TRACE_COMPLETION, vring->vq.trace_id, bio->head);
+
+    if (likely(bio->status != VHD_BDEV_CANCELED)) {
+        req_account(bio, now);
+    }
+
+    if (!vring->num_batched++) {
+        virtq_begin_batch(&vring->vq);
+        SLIST_INSERT_HEAD(batch, vring, batch_link);
+    }
+
     bio->completion_handler(bio);
-    vhd_vring_dec_in_flight(vring);
+    vring->vq.stat.completion_cycles += vhd_cpu_section_end(&cpu);
 }
 
-static void rq_complete_bh(void *opaque)
+/*
+ * Give every vring throttled at this point a chance to dispatch requests
+ * within the in-flight slots freed up; those still limited get throttled again
+ * and go to the back of the list.
+ */
+static void rq_resume_throttled(struct vhd_request_queue *rq)
 {
-    struct vhd_request_queue *rq = opaque;
-    vhd_bio_list bio_list, bio_list_reverse;
+    TAILQ_HEAD(, vhd_vring) throttled = TAILQ_HEAD_INITIALIZER(throttled);
 
-    SLIST_INIT(&bio_list);
-    SLIST_INIT(&bio_list_reverse);
-    /* steal completion list from rq, swap for a fresh one */
-    SLIST_MOVE_ATOMIC(&bio_list_reverse, &rq->completion);
+    TAILQ_CONCAT(&throttled, &rq->throttled, throttled_link);
 
-    /* the list was filled LIFO, we want the completions FIFO */
     for (;;) {
-        struct vhd_bio *bio = SLIST_FIRST(&bio_list_reverse);
-        if (!bio) {
+        struct vhd_vring *vring = TAILQ_FIRST(&throttled);
+        if (!vring) {
             break;
         }
-        SLIST_REMOVE_HEAD(&bio_list_reverse, completion_link);
-        SLIST_INSERT_HEAD(&bio_list, bio, completion_link);
+        TAILQ_REMOVE(&throttled, vring, throttled_link);
+        vring->throttled = false;
+
+        vhd_vring_poll(vring);
     }
+}
+
+static void req_commit_batch(struct vhd_request_queue *rq,
+                             vhd_vring_batch *batch)
+{
+    bool freed = false;
 
     for (;;) {
-        struct vhd_bio *bio = SLIST_FIRST(&bio_list);
-        if (!bio) {
+        struct vhd_vring *vring = SLIST_FIRST(batch);
+        if (!vring) {
+            break;
+        }
+        SLIST_REMOVE_HEAD(batch, batch_link);
+
+        struct vhd_cpu_section cpu;
+        vhd_cpu_section_start(&cpu);
+
+        uint16_t num_completed = vring->num_batched;
+        vring->num_batched = 0;
+        virtq_commit_batch(&vring->vq);
+        vhd_rq_vring_notify_pending(rq, vring);
+        vhd_vring_dec_in_flight(vring, num_completed);
+        vring->vq.stat.completion_cycles += vhd_cpu_section_end(&cpu);
+
+        rq->num_in_flight -= num_completed;
+        freed = true;
+    }
+
+    if (freed && !TAILQ_EMPTY(&rq->throttled)) {
+        rq_resume_throttled(rq);
+    }
+}
+
+/*
+ * Append the chain of bios linked from @first to @last to the completion
+ * FIFO of @rq.  Return true if there was nothing but the stub in it, i.e.
+ * the completion bh has to be scheduled.
+ */
+static bool rq_completion_push(struct vhd_request_queue *rq,
+                               struct vhd_bio *first, struct vhd_bio *last)
+{
+    struct vhd_bio *prev;
+
+    last->completion_link.sle_next = NULL;
+    prev = atomic_xchg(&rq->completion_tail, last);
+    atomic_store_release(&prev->completion_link.sle_next, first);
+    return prev == &rq->completion_stub;
+}
+
+/*
+ * Pop the oldest bio off the completion FIFO of @rq.  Return NULL if there's
+ * none, setting @busy if one is still being pushed by a producer which won't
+ * schedule the completion bh.
+ */
+static struct vhd_bio *rq_completion_pop(struct vhd_request_queue *rq,
+                                         bool *busy)
+{
+    struct vhd_bio *stub = &rq->completion_stub;
+    struct vhd_bio *bio = rq->completion_head;
+    struct vhd_bio *next = atomic_load_acquire(&bio->completion_link.sle_next);
+
+    if (bio == stub) {
+        /* the producer pushing after the stub schedules the bh */
+        if (!next) {
+            return NULL;
+        }
+        rq->completion_head = bio = next;
+        next = atomic_load_acquire(&bio->completion_link.sle_next);
+    }
+
+    if (next) {
+        rq->completion_head = next;
+        return bio;
+    }
+
+    /* the last one is only popped once the stub is pushed after it */
+    if (atomic_load_acquire(&rq->completion_tail) == bio) {
+        rq_completion_push(rq, stub, stub);
+        next = atomic_load_acquire(&bio->completion_link.sle_next);
+        if (next) {
+            rq->completion_head = next;
+            return bio;
+        }
+    }
+
+    *busy = true;
+    return NULL;
+}
+
+static void rq_complete_bh(void *opaque)
+{
+    struct vhd_request_queue *rq = opaque;
+    vhd_vring_batch batch = SLIST_HEAD_INITIALIZER(batch);
+    /* those pushed meanwhile are left for the next run */
+    struct vhd_bio *end = atomic_load_acquire(&rq->completion_tail);
+    struct vhd_bio *bio;
+    uint64_t now = vhd_time_ns();
+    bool busy = false;
+
+    while ((bio = rq_completion_pop(rq, &busy))) {
+        bool last = bio == end;
+
+        req_complete(&batch, bio, now);
+        if (last) {
+            busy = rq->completion_head != &rq->completion_stub ||
+                atomic_load_acquire(&rq->completion_tail) !=
+                &rq->completion_stub;
             break;
         }
-        SLIST_REMOVE_HEAD(&bio_list, completion_link);
-        req_complete(bio);
+    }
+
+    req_commit_batch(rq, &batch);
+
+    if (busy) {
+        vhd_bh_schedule(rq->completion_bh);
     }
 }
 
 struct vhd_request_queue *vhd_create_request_queue(void)
 {
-    struct vhd_request_queue *rq = vhd_alloc(sizeof(*rq));
+    struct vhd_request_queue *rq = vhd_zalloc(sizeof(*rq));
 
     rq->evloop = vhd_create_event_loop(VHD_EVENT_LOOP_DEFAULT_MAX_EVENTS);
     if (!rq->evloop) {
@@ -159,17 +597,33 @@ struct vhd_request_queue *vhd_create_request_queue(void)
         return NULL;
     }
 
-    TAILQ_INIT(&rq->submission);
+    TAILQ_INIT(&rq->active);
+    TAILQ_INIT(&rq->limited);
+    LIST_INIT(&rq->vrings);
+    TAILQ_INIT(&rq->throttled);
+    TAILQ_INIT(&rq->kicked);
+    TAILQ_INIT(&rq->notify_pending);
+    rq->notify_timerfd = -1;
 
-    SLIST_INIT(&rq->completion);
+    rq->completion_head = rq->completion_tail = &rq->completion_stub;
     rq->completion_bh = vhd_bh_new(rq->evloop, rq_complete_bh, rq);
+    SLIST_INIT(&rq->inline_batch);
     return rq;
 }
 
 void vhd_release_request_queue(struct vhd_request_queue *rq)
 {
-    assert(TAILQ_EMPTY(&rq->submission));
-    assert(SLIST_EMPTY(&rq->completion));
+    assert(!rq->group);
+    assert(TAILQ_EMPTY(&rq->active));
+    assert(TAILQ_EMPTY(&rq->limited));
+    assert(rq->completion_head == &rq->completion_stub &&
+           rq->completion_tail == &rq->completion_stub);
+    assert(SLIST_EMPTY(&rq->inline_batch));
+    assert(LIST_EMPTY(&rq->vrings));
+    assert(TAILQ_EMPTY(&rq->throttled));
+    assert(TAILQ_EMPTY(&rq->kicked));
+    assert(TAILQ_EMPTY(&rq->notify_pending));
+    assert(rq->notify_timerfd == -1);
     vhd_bh_delete(rq->completion_bh);
     vhd_free_event_loop(rq->evloop);
     vhd_free(rq);
@@ -182,74 +636,990 @@ struct vhd_io_handler *vhd_add_rq_io_handler(struct vhd_request_queue *rq,
     return vhd_add_io_handler(rq->evloop, fd, read, opaque);
 }
 
-int vhd_run_queue(struct vhd_request_queue *rq)
+void vhd_del_rq_io_handler(struct vhd_io_handler *handler)
 {
-    return vhd_run_event_loop(rq->evloop, -1);
+    vhd_del_io_handler(handler);
 }
 
-void vhd_stop_queue(struct vhd_request_queue *rq)
+struct vhd_io_handler *vhd_rq_add_kick_handler(struct vhd_request_queue *rq,
+                                               struct vhd_vring *vring,
+                                               int (*kick)(void *opaque))
 {
-    vhd_terminate_event_loop(rq->evloop);
+    vring->kick_edge = rq->edge_kicks;
+    if (vring->kick_edge) {
+        return vhd_add_edge_io_handler(rq->evloop, vring->kickfd, kick, vring);
+    }
+    return vhd_add_io_handler(rq->evloop, vring->kickfd, kick, vring);
 }
 
-bool vhd_dequeue_request(struct vhd_request_queue *rq,
-                         struct vhd_request *out_req)
+void vhd_rq_vring_kicked(struct vhd_request_queue *rq,
+                         struct vhd_vring *vring)
 {
-    struct vhd_bio *bio = TAILQ_FIRST(&rq->submission);
+    /* polled anyway */
+    if (vring->kicked || !vring->attached_to_rq || rq->polling) {
+        return;
+    }
 
-    if (!bio) {
-        return false;
+    TAILQ_INSERT_TAIL(&rq->kicked, vring, kicked_link);
+    vring->kicked = true;
+}
+
+/*
+ * The guest may have published more requests on the kicked vrings while they
+ * were being dispatched; with edge-triggered kicks that's cheaper to find out
+ * by looking at the avail rings than by another epoll_wait and a kick.  The
+ * vrings that turn out to have them are checked again in the next pass, which
+ * doesn't block then.
+ */
+static void rq_recheck_kicked(struct vhd_request_queue *rq)
+{
+    TAILQ_HEAD(, vhd_vring) kicked = TAILQ_HEAD_INITIALIZER(kicked);
+
+    TAILQ_CONCAT(&kicked, &rq->kicked, kicked_link);
+
+    while (!TAILQ_EMPTY(&kicked)) {
+        struct vhd_vring *vring = TAILQ_FIRST(&kicked);
+
+        TAILQ_REMOVE(&kicked, vring, kicked_link);
+        vring->kicked = false;
+
+        if (vhd_vring_poll(vring)) {
+            vhd_rq_vring_kicked(rq, vring);
+        }
     }
+}
 
-    TAILQ_REMOVE(&rq->submission, bio, submission_link);
+void vhd_rq_attach_vring(struct vhd_request_queue *rq, struct vhd_vring *vring)
+{
+    VHD_ASSERT(!vring->attached_to_rq);
+    LIST_INSERT_HEAD(&rq->vrings, vring, rq_link);
+    vring->attached_to_rq = true;
 
-    out_req->vdev = bio->vring->vdev;
-    out_req->bio = &bio->bdev_io;
+    /*
+     * Explicitly (re-)enable notifications when not polling, in case they've
+     * been left disabled by a previous user of the vring
+     */
+    virtq_set_notification(&vring->vq, !rq->polling);
+}
 
-    return true;
+static void rq_arm_notify_timer(struct vhd_request_queue *rq,
+                                uint64_t deadline_ns)
+{
+    struct itimerspec its = {
+        .it_value = {
+            .tv_sec = deadline_ns / 1000000000,
+            .tv_nsec = deadline_ns % 1000000000,
+        },
+    };
+
+    if (timerfd_settime(rq->notify_timerfd, TFD_TIMER_ABSTIME, &its,
+                        NULL) < 0) {
+        VHD_LOG_ERROR("timerfd_settime: %s, notifying right away",
+                      strerror(errno));
+        deadline_ns = 0;
+    }
+    rq->notify_timer_ns = deadline_ns;
 }
 
+/*
+ * Send the notifications that are due (or @all of them) and re-arm the timer
+ * for the earliest deadline of the rest.  If the timer can't be armed, the
+ * rest are sent right away too.
+ */
+static void rq_flush_notify(struct vhd_request_queue *rq, bool all)
+{
+    struct vhd_vring *vring, *next;
+    uint64_t now = vhd_time_ns();
+    uint64_t next_ns = 0;
+
+    for (vring = TAILQ_FIRST(&rq->notify_pending); vring; vring = next) {
+        uint64_t deadline_ns = vring->vq.notify_deadline_ns;
 
-int vhd_enqueue_block_request(struct vhd_request_queue *rq, struct vhd_bio *bio)
+        next = TAILQ_NEXT(vring, notify_link);
+        if (!all && vring->vq.notify_pending && deadline_ns > now) {
+            if (!next_ns || deadline_ns < next_ns) {
+                next_ns = deadline_ns;
+            }
+            continue;
+        }
+
+        virtq_flush_notify(&vring->vq);
+        TAILQ_REMOVE(&rq->notify_pending, vring, notify_link);
+        vring->notify_queued = false;
+    }
+
+    rq->notify_timer_ns = 0;
+    if (next_ns) {
+        rq_arm_notify_timer(rq, next_ns);
+        if (!rq->notify_timer_ns) {
+            rq_flush_notify(rq, true);
+        }
+    }
+}
+
+static int rq_notify_timer(void *opaque)
 {
-    vhd_vring_inc_in_flight(bio->vring);
+    struct vhd_request_queue *rq = opaque;
+    uint64_t expirations;
+
+    if (read(rq->notify_timerfd, &expirations, sizeof(expirations)) < 0 &&
+        errno != EAGAIN) {
+        VHD_LOG_ERROR("timerfd read: %s", strerror(errno));
+    }
 
-    TAILQ_INSERT_TAIL(&rq->submission, bio, submission_link);
+    rq_flush_notify(rq, false);
     return 0;
 }
 
-void vhd_cancel_queued_requests(struct vhd_request_queue *rq,
-                                const struct vhd_vring *vring)
+static int rq_init_notify_timer(struct vhd_request_queue *rq)
 {
-    struct vhd_bio *bio;
+    int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (fd < 0) {
+        int ret = -errno;
+        VHD_LOG_ERROR("timerfd_create: %s", strerror(-ret));
+        return ret;
+    }
 
-    TAILQ_FOREACH(bio, &rq->submission, submission_link) {
-        if (unlikely(bio->vring == vring)) {
-            struct vhd_bio *next = TAILQ_NEXT(bio, submission_link);
-            TAILQ_REMOVE(&rq->submission, bio, submission_link);
-            bio->status = VHD_BDEV_CANCELED;
-            req_complete(bio);
-            bio = next;
-        }
+    rq->notify_timer_handler = vhd_add_io_handler(rq->evloop, fd,
+                                                  rq_notify_timer, rq);
+    if (!rq->notify_timer_handler) {
+        close(fd);
+        return -EIO;
     }
+
+    rq->notify_timerfd = fd;
+    rq->notify_timer_ns = 0;
+    return 0;
 }
 
-/*
- * can be called from arbitrary thread; will schedule completion on the rq
- * event loop
- */
-void vhd_complete_bio(struct vhd_bdev_io *bdev_io,
-                      enum vhd_bdev_io_result status)
+static void rq_fini_notify_timer(struct vhd_request_queue *rq)
 {
-    struct vhd_bio *bio = containerof(bdev_io, struct vhd_bio, bdev_io);
-    struct vhd_request_queue *rq = bio->vring->vdev->rq;
-    bio->status = status;
+    if (rq->notify_timerfd == -1) {
+        return;
+    }
 
-    /*
-     * if this is not the first completion on the list scheduling the bh can be
-     * skipped because the first one must have done so
-     */
-    if (!SLIST_INSERT_HEAD_ATOMIC(&rq->completion, bio, completion_link)) {
-        vhd_bh_schedule(rq->completion_bh);
+    vhd_del_io_handler(rq->notify_timer_handler);
+    rq->notify_timer_handler = NULL;
+    close(rq->notify_timerfd);
+    rq->notify_timerfd = -1;
+}
+
+void vhd_rq_vring_notify_pending(struct vhd_request_queue *rq,
+                                 struct vhd_vring *vring)
+{
+    uint64_t deadline_ns = vring->vq.notify_deadline_ns;
+
+    if (!vring->vq.notify_pending || vring->notify_queued) {
+        return;
+    }
+
+    /* no timer once detached, the vring is going away */
+    if (!vring->attached_to_rq ||
+        (rq->notify_timerfd == -1 && rq_init_notify_timer(rq) < 0)) {
+        virtq_flush_notify(&vring->vq);
+        return;
+    }
+
+    TAILQ_INSERT_TAIL(&rq->notify_pending, vring, notify_link);
+    vring->notify_queued = true;
+
+    if (!rq->notify_timer_ns || deadline_ns < rq->notify_timer_ns) {
+        rq_arm_notify_timer(rq, deadline_ns);
+        if (!rq->notify_timer_ns) {
+            rq_flush_notify(rq, true);
+        }
+    }
+}
+
+void vhd_rq_detach_vring(struct vhd_request_queue *rq, struct vhd_vring *vring)
+{
+    if (!vring->attached_to_rq) {
+        return;
+    }
+
+    LIST_REMOVE(vring, rq_link);
+    vring->attached_to_rq = false;
+    vhd_rq_set_vring_throttled(rq, vring, false);
+    if (vring->kicked) {
+        TAILQ_REMOVE(&rq->kicked, vring, kicked_link);
+        vring->kicked = false;
+    }
+    if (vring->notify_queued) {
+        TAILQ_REMOVE(&rq->notify_pending, vring, notify_link);
+        vring->notify_queued = false;
+    }
+    virtq_flush_notify(&vring->vq);
+    if (LIST_EMPTY(&rq->vrings)) {
+        assert(TAILQ_EMPTY(&rq->notify_pending));
+        rq_fini_notify_timer(rq);
+    }
+
+    if (rq->polling) {
+        virtq_set_notification(&vring->vq, true);
+    }
+}
+
+static void rq_set_polling(struct vhd_request_queue *rq, bool polling)
+{
+    struct vhd_vring *vring;
+
+    rq->polling = polling;
+    LIST_FOREACH(vring, &rq->vrings, rq_link) {
+        virtq_set_notification(&vring->vq, !polling);
+    }
+}
+
+static bool rq_poll_vrings(struct vhd_request_queue *rq)
+{
+    struct vhd_vring *vring, *next;
+    bool found = false;
+
+    /* the vring may detach itself from the queue if it turns out broken */
+    for (vring = LIST_FIRST(&rq->vrings); vring; vring = next) {
+        next = LIST_NEXT(vring, rq_link);
+        found |= vhd_vring_poll(vring);
+    }
+
+    return found;
+}
+
+/*
+ * How long the event loop may sleep without leaving vrings held back by the
+ * rate limits past their wakeup time: -1 if there are none, rounded up to
+ * make sure the limits allow more requests once it wakes up.
+ */
+static int rq_sched_timeout_ms(struct vhd_request_queue *rq)
+{
+    uint64_t now;
+
+    /* the kicked vrings will be checked right away */
+    if (!TAILQ_EMPTY(&rq->kicked)) {
+        return 0;
+    }
+
+    if (TAILQ_EMPTY(&rq->limited)) {
+        return -1;
+    }
+
+    /* the cached time may be well behind after handling a busy iteration */
+    now = vhd_clock_ns();
+    if (rq->limited_wake_ns <= now) {
+        return 0;
+    }
+
+    return MIN((rq->limited_wake_ns - now + 999999) / 1000000, INT_MAX);
+}
+
+/*
+ * In polling mode the queue alternates between two states:
+ * - sleeping: guest notifications are enabled and the event loop blocks
+ *   waiting for them (or for anything else, e.g. completions);
+ * - polling: guest notifications are disabled and the avail rings of all
+ *   attached vrings are checked on every iteration, with the event loop only
+ *   polled for other events.
+ * Any wakeup from sleep switches to polling; not finding new requests for
+ * longer than the idle budget switches back to sleeping.
+ */
+static int rq_run_polling(struct vhd_request_queue *rq, bool block)
+{
+    int res;
+    uint64_t now;
+
+    res = vhd_run_event_loop(rq->evloop,
+                             rq->polling || !block ?
+                             0 : rq_sched_timeout_ms(rq));
+    if (res != -EAGAIN) {
+        return res;
+    }
+
+    now = vhd_time_ns();
+
+    if (!rq->polling) {
+        rq_set_polling(rq, true);
+        rq->poll_last_work_ns = now;
+        return -EAGAIN;
+    }
+
+    if (rq_poll_vrings(rq)) {
+        rq->poll_last_work_ns = now;
+        return -EAGAIN;
+    }
+
+    if (now - rq->poll_last_work_ns < rq->poll_idle_ns) {
+        return -EAGAIN;
+    }
+
+    /*
+     * Idle for too long, go back to sleeping.  Re-check the rings once
+     * notifications are enabled, as the guest may have published new requests
+     * without notifying us just before that.
+     */
+    rq_set_polling(rq, false);
+    if (rq_poll_vrings(rq)) {
+        rq_set_polling(rq, true);
+        rq->poll_last_work_ns = now;
+    }
+
+    return -EAGAIN;
+}
+
+static void rq_commit_inline(struct vhd_request_queue *rq)
+{
+    if (!SLIST_EMPTY(&rq->inline_batch)) {
+        req_commit_batch(rq, &rq->inline_batch);
+    }
+}
+
+static int rq_run(struct vhd_request_queue *rq, bool block)
+{
+    bool had_requests = !TAILQ_EMPTY(&rq->active);
+    int ret;
+
+    /*
+     * Publish the requests completed inline since the previous call before
+     * going to sleep, and those completed by the handlers run in this one
+     * before returning.  The in-flight slots freed up may let throttled
+     * vrings queue new requests, which must not wait for the next wakeup.
+     */
+    rq_commit_inline(rq);
+    if (!had_requests && !TAILQ_EMPTY(&rq->active)) {
+        return -EAGAIN;
+    }
+
+    if (rq->poll_idle_ns) {
+        ret = rq_run_polling(rq, block);
+    } else {
+        ret = vhd_run_event_loop(rq->evloop,
+                                 block ? rq_sched_timeout_ms(rq) : 0);
+    }
+
+    rq_recheck_kicked(rq);
+    rq_commit_inline(rq);
+    return ret;
+}
+
+int vhd_run_queue(struct vhd_request_queue *rq)
+{
+    return rq_run(rq, true);
+}
+
+int vhd_poll_queue(struct vhd_request_queue *rq)
+{
+    return rq_run(rq, false);
+}
+
+int vhd_get_queue_fd(struct vhd_request_queue *rq)
+{
+    return vhd_event_loop_fd(rq->evloop);
+}
+
+int vhd_get_queue_timeout_ms(struct vhd_request_queue *rq)
+{
+    if (rq->polling || !SLIST_EMPTY(&rq->inline_batch)) {
+        return 0;
+    }
+
+    return rq_sched_timeout_ms(rq);
+}
+
+void vhd_set_queue_polling(struct vhd_request_queue *rq,
+                           uint32_t idle_budget_us)
+{
+    rq->poll_idle_ns = idle_budget_us * 1000ull;
+
+    if (!rq->poll_idle_ns && rq->polling) {
+        rq_set_polling(rq, false);
+        rq_poll_vrings(rq);
+    }
+}
+
+uint32_t vhd_rq_vring_budget(struct vhd_request_queue *rq,
+                             struct vhd_vring *vring)
+{
+    uint32_t budget = UINT32_MAX;
+
+    if (rq->max_in_flight) {
+        budget = rq->max_in_flight > rq->num_in_flight ?
+            rq->max_in_flight - rq->num_in_flight : 0;
+    }
+
+    if (rq->max_vring_in_flight) {
+        uint32_t vring_budget =
+            rq->max_vring_in_flight > vring->num_in_flight ?
+            rq->max_vring_in_flight - vring->num_in_flight : 0;
+        budget = MIN(budget, vring_budget);
+    }
+
+    return budget;
+}
+
+void vhd_rq_set_vring_throttled(struct vhd_request_queue *rq,
+                                struct vhd_vring *vring, bool throttled)
+{
+    if (vring->throttled == throttled ||
+        (throttled && !vring->attached_to_rq)) {
+        return;
+    }
+
+    if (throttled) {
+        TAILQ_INSERT_TAIL(&rq->throttled, vring, throttled_link);
+    } else {
+        TAILQ_REMOVE(&rq->throttled, vring, throttled_link);
+    }
+    vring->throttled = throttled;
+}
+
+void vhd_set_queue_edge_kicks(struct vhd_request_queue *rq, bool enable)
+{
+    rq->edge_kicks = enable;
+}
+
+void vhd_set_queue_max_in_flight(struct vhd_request_queue *rq,
+                                 uint32_t max_in_flight,
+                                 uint16_t max_vring_in_flight)
+{
+    rq->max_in_flight = max_in_flight;
+    rq->max_vring_in_flight = max_vring_in_flight;
+
+    /* the limits may have been raised */
+    rq_resume_throttled(rq);
+}
+
+void vhd_stop_queue(struct vhd_request_queue *rq)
+{
+    vhd_terminate_event_loop(rq->evloop);
+}
+
+/*
+ * Requests of all sizes below this are charged the same in the round robin,
+ * as their cost is dominated by the per-request overhead
+ */
+#define VHD_SCHED_MIN_COST      4096
+/* bytes added to the deficit of a vring of unit weight per round */
+#define VHD_SCHED_QUANTUM       (64 * 1024)
+
+static uint64_t bio_bytes(const struct vhd_bio *bio)
+{
+    switch (bio->bdev_io.type) {
+    case VHD_BDEV_READ:
+    case VHD_BDEV_WRITE:
+        return bio->bdev_io.total_sectors << VHD_SECTOR_SHIFT;
+    default:
+        return 0;
+    }
+}
+
+static int64_t vring_sched_quantum(struct vhd_vring *vring)
+{
+    uint32_t weight = atomic_read(&vring->vdev->qos_weight);
+
+    return (int64_t) MAX(weight, 1) * VHD_SCHED_QUANTUM;
+}
+
+/*
+ * Have @vring with requests in its submission queue join the round.  A
+ * priority one joins at the head with its quantum already added, so that
+ * it's served first.
+ */
+static void rq_sched_add(struct vhd_request_queue *rq, struct vhd_vring *vring)
+{
+    if (vring->sched_queued) {
+        return;
+    }
+
+    if (vring->sched_priority) {
+        vring->sched_deficit = vring_sched_quantum(vring);
+        TAILQ_INSERT_HEAD(&rq->active, vring, sched_link);
+    } else {
+        TAILQ_INSERT_TAIL(&rq->active, vring, sched_link);
+    }
+    vring->sched_queued = true;
+}
+
+static void rq_sched_remove(struct vhd_request_queue *rq,
+                            struct vhd_vring *vring)
+{
+    if (!vring->sched_queued) {
+        return;
+    }
+
+    if (vring->sched_limited) {
+        TAILQ_REMOVE(&rq->limited, vring, sched_link);
+    } else {
+        TAILQ_REMOVE(&rq->active, vring, sched_link);
+    }
+    vring->sched_queued = false;
+    vring->sched_limited = false;
+    vring->sched_deficit = 0;
+}
+
+static void rq_sched_limit(struct vhd_request_queue *rq,
+                           struct vhd_vring *vring, uint64_t wake_ns)
+{
+    if (TAILQ_EMPTY(&rq->limited) || wake_ns < rq->limited_wake_ns) {
+        rq->limited_wake_ns = wake_ns;
+    }
+
+    TAILQ_REMOVE(&rq->active, vring, sched_link);
+    TAILQ_INSERT_TAIL(&rq->limited, vring, sched_link);
+    vring->sched_limited = true;
+}
+
+static void rq_sched_unlimit(struct vhd_request_queue *rq, uint64_t now)
+{
+    struct vhd_vring *vring;
+
+    if (TAILQ_EMPTY(&rq->limited) || now < rq->limited_wake_ns) {
+        return;
+    }
+
+    /* those still over the limits are put back with the new wakeup time */
+    TAILQ_FOREACH(vring, &rq->limited, sched_link) {
+        vring->sched_limited = false;
+    }
+    TAILQ_CONCAT(&rq->active, &rq->limited, sched_link);
+}
+
+/*
+ * Check both device limits before charging either, so that a request held
+ * back by one doesn't consume the other
+ */
+static bool vdev_qos_admit(struct vhd_vdev *vdev, uint64_t bytes,
+                           uint64_t now, uint64_t *wake_ns)
+{
+    if (!vhd_rate_limit_check(&vdev->iops_limit, now, wake_ns) ||
+        !vhd_rate_limit_check(&vdev->bps_limit, now, wake_ns)) {
+        return false;
+    }
+
+    vhd_rate_limit_charge(&vdev->iops_limit, 1, now);
+    if (bytes) {
+        vhd_rate_limit_charge(&vdev->bps_limit, bytes, now);
+    }
+    return true;
+}
+
+/*
+ * Pick the next request in deficit round robin: a vring at the head of the
+ * round is served while its deficit covers the requests, and otherwise gets
+ * its quantum added and goes to the tail.  Priority vrings join the round at
+ * the head, get a quantum worth of requests served ahead of the rest, and
+ * take their turns like the others after that, so that a flood of them
+ * doesn't starve the rest.
+ */
+static struct vhd_bio *rq_sched_next(struct vhd_request_queue *rq,
+                                     uint64_t now)
+{
+    struct vhd_vring *vring;
+
+    rq_sched_unlimit(rq, now);
+
+    while ((vring = TAILQ_FIRST(&rq->active))) {
+        struct vhd_bio *bio = TAILQ_FIRST(&vring->submission);
+        uint64_t bytes = bio_bytes(bio);
+        int64_t cost = MAX(bytes, VHD_SCHED_MIN_COST);
+        uint64_t wake_ns;
+
+        if (vring->sched_deficit < cost) {
+            vring->sched_deficit += vring_sched_quantum(vring);
+            TAILQ_REMOVE(&rq->active, vring, sched_link);
+            TAILQ_INSERT_TAIL(&rq->active, vring, sched_link);
+            continue;
+        }
+
+        if (!vdev_qos_admit(vring->vdev, bytes, now, &wake_ns)) {
+            rq_sched_limit(rq, vring, wake_ns);
+            continue;
+        }
+
+        vring->sched_deficit -= cost;
+        TAILQ_REMOVE(&vring->submission, bio, submission_link);
+        if (TAILQ_EMPTY(&vring->submission)) {
+            rq_sched_remove(rq, vring);
+        }
+        return bio;
+    }
+
+    return NULL;
+}
+
+static void bio_hand_out(struct vhd_bio *bio, struct vhd_request *out_req,
+                         uint64_t now)
+{
+    bio->phase_start_ns[VHD_REQ_PHASE_BACKEND] = now;
+    vhd_trace(VHD_TRACE_BACKEND_DEQUEUE, bio->vring->vq.trace_id, bio->head);
+
+    out_req->vdev = bio->vring->vdev;
+    out_req->bio = &bio->bdev_io;
+}
+
+static bool rq_dequeue_one(struct vhd_request_queue *rq,
+                           struct vhd_request *out_req, uint64_t now)
+{
+    struct vhd_bio *bio = rq_sched_next(rq, now);
+
+    if (!bio) {
+        return false;
+    }
+
+    bio_hand_out(bio, out_req, now);
+    return true;
+}
+
+bool vhd_dequeue_request(struct vhd_request_queue *rq,
+                         struct vhd_request *out_req)
+{
+    return rq_dequeue_one(rq, out_req, vhd_time_ns());
+}
+
+unsigned vhd_dequeue_requests(struct vhd_request_queue *rq,
+                              struct vhd_request *out_reqs, unsigned max,
+                              bool *more)
+{
+    uint64_t now = vhd_time_ns();
+    unsigned n;
+
+    for (n = 0; n < max; n++) {
+        if (!rq_dequeue_one(rq, &out_reqs[n], now)) {
+            break;
+        }
+    }
+
+    if (more) {
+        *more = !TAILQ_EMPTY(&rq->active);
+    }
+
+    return n;
+}
+
+/*
+ * Request queue groups
+ */
+
+static void rq_steal_bh(void *opaque)
+{
+    /*
+     * Nothing to do: the wakeup makes vhd_run_queue() return, for the thread
+     * running the queue to take the requests shared by its siblings
+     */
+}
+
+struct vhd_rq_group *vhd_create_rq_group(struct vhd_request_queue **rqs,
+                                         unsigned num_rqs)
+{
+    struct vhd_rq_group *group;
+    unsigned i;
+
+    for (i = 0; i < num_rqs; i++) {
+        if (rqs[i]->group) {
+            VHD_LOG_ERROR("request queue %p is already in a group", rqs[i]);
+            return NULL;
+        }
+    }
+
+    group = vhd_zalloc(sizeof(*group) + num_rqs * sizeof(group->rqs[0]));
+    group->num_rqs = num_rqs;
+
+    for (i = 0; i < num_rqs; i++) {
+        struct vhd_request_queue *rq = rqs[i];
+
+        group->rqs[i] = rq;
+        rq->group = group;
+        rq->group_idx = i;
+        rq->steal_ring = vhd_aligned_alloc(VHD_CACHELINE_SIZE,
+                                           sizeof(*rq->steal_ring));
+        memset(rq->steal_ring, 0, sizeof(*rq->steal_ring));
+        atomic_set(&rq->steal_idle, false);
+        rq->steal_bh = vhd_bh_new(rq->evloop, rq_steal_bh, rq);
+    }
+
+    return group;
+}
+
+void vhd_release_rq_group(struct vhd_rq_group *group)
+{
+    unsigned i;
+
+    for (i = 0; i < group->num_rqs; i++) {
+        struct vhd_request_queue *rq = group->rqs[i];
+
+        assert(atomic_read(&rq->steal_ring->head) ==
+               atomic_read(&rq->steal_ring->tail));
+        vhd_bh_delete(rq->steal_bh);
+        vhd_free(rq->steal_ring);
+        rq->steal_bh = NULL;
+        rq->steal_ring = NULL;
+        rq->group = NULL;
+    }
+
+    vhd_free(group);
+}
+
+static unsigned steal_ring_room(struct vhd_rq_steal_ring *ring)
+{
+    return VHD_RQ_STEAL_RING_SIZE -
+        (atomic_read(&ring->tail) - atomic_load_acquire(&ring->head));
+}
+
+/* owner only, with steal_ring_room() checked */
+static void steal_ring_push(struct vhd_rq_steal_ring *ring, struct vhd_bio *bio)
+{
+    unsigned long tail = atomic_read(&ring->tail);
+
+    atomic_set(&ring->slots[tail % VHD_RQ_STEAL_RING_SIZE], bio);
+    atomic_store_release(&ring->tail, tail + 1);
+}
+
+static struct vhd_bio *steal_ring_take(struct vhd_rq_steal_ring *ring)
+{
+    unsigned long head = atomic_load_acquire(&ring->head);
+
+    while (head != atomic_load_acquire(&ring->tail)) {
+        struct vhd_bio *bio =
+            atomic_read(&ring->slots[head % VHD_RQ_STEAL_RING_SIZE]);
+        unsigned long old = atomic_cmpxchg(&ring->head, head, head + 1);
+
+        if (old == head) {
+            return bio;
+        }
+        head = old;
+    }
+
+    return NULL;
+}
+
+/*
+ * Move a batch of the requests left in the round robin to the steal ring if
+ * there are idle queues in the group, and wake them up to take them
+ */
+static void rq_share_requests(struct vhd_request_queue *rq, uint64_t now)
+{
+    struct vhd_rq_group *group = rq->group;
+    unsigned room = MIN(steal_ring_room(rq->steal_ring), VHD_RQ_STEAL_BATCH);
+    bool idle = false;
+    unsigned i, n;
+
+    for (i = 0; i < group->num_rqs; i++) {
+        if (group->rqs[i] != rq && atomic_read(&group->rqs[i]->steal_idle)) {
+            idle = true;
+            break;
+        }
+    }
+    if (!idle) {
+        return;
+    }
+
+    for (n = 0; n < room; n++) {
+        struct vhd_bio *bio = rq_sched_next(rq, now);
+        if (!bio) {
+            break;
+        }
+        steal_ring_push(rq->steal_ring, bio);
+    }
+    if (!n) {
+        return;
+    }
+
+    for (i = 0; i < group->num_rqs; i++) {
+        struct vhd_request_queue *sibling = group->rqs[i];
+
+        if (sibling != rq && atomic_xchg(&sibling->steal_idle, false)) {
+            vhd_bh_schedule(sibling->steal_bh);
+        }
+    }
+}
+
+unsigned vhd_dequeue_group_requests(struct vhd_request_queue *rq,
+                                    struct vhd_request *out_reqs, unsigned max,
+                                    bool *more)
+{
+    struct vhd_rq_group *group = rq->group;
+    uint64_t now = vhd_time_ns();
+    struct vhd_bio *bio;
+    unsigned i, n = 0;
+
+    if (!group) {
+        return vhd_dequeue_requests(rq, out_reqs, max, more);
+    }
+
+    /* the requests shared earlier but not taken by anyone come first */
+    while (n < max && (bio = steal_ring_take(rq->steal_ring))) {
+        bio_hand_out(bio, &out_reqs[n++], now);
+    }
+
+    while (n < max && rq_dequeue_one(rq, &out_reqs[n], now)) {
+        n++;
+    }
+
+    if (!TAILQ_EMPTY(&rq->active)) {
+        rq_share_requests(rq, now);
+    }
+
+    for (i = 1; i < group->num_rqs && n < max; i++) {
+        struct vhd_request_queue *sibling =
+            group->rqs[(rq->group_idx + i) % group->num_rqs];
+
+        while (n < max && (bio = steal_ring_take(sibling->steal_ring))) {
+            bio_hand_out(bio, &out_reqs[n++], now);
+        }
+    }
+
+    /* have the busy siblings share their requests next time they look */
+    atomic_set(&rq->steal_idle, n == 0);
+
+    if (more) {
+        *more = !TAILQ_EMPTY(&rq->active) ||
+            atomic_read(&rq->steal_ring->head) !=
+            atomic_read(&rq->steal_ring->tail);
+    }
+
+    return n;
+}
+
+int vhd_enqueue_block_request(struct vhd_request_queue *rq, struct vhd_bio *bio)
+{
+    vhd_vring_inc_in_flight(bio->vring);
+    rq->num_in_flight++;
+
+    bio->phase_start_ns[VHD_REQ_PHASE_QUEUED] = vhd_time_ns();
+    vhd_trace(VHD_TRACE_RQ_ENQUEUE, bio->vring->vq.trace_id, bio->head);
+    TAILQ_INSERT_TAIL(&bio->vring->submission, bio, submission_link);
+    rq_sched_add(rq, bio->vring);
+    return 0;
+}
+
+/*
+ * Take back the requests shared in the steal ring of @rq and not taken yet:
+ * those of @vring are canceled into @batch, the others go back to the head
+ * of their vrings in the original order.  The ones already taken by the
+ * siblings are in the hands of their backends, as if dequeued by @rq.
+ */
+static void rq_unshare_requests(struct vhd_request_queue *rq,
+                                struct vhd_vring *vring,
+                                vhd_vring_batch *batch)
+{
+    struct vhd_bio *bios[VHD_RQ_STEAL_RING_SIZE];
+    unsigned n = 0;
+
+    if (!rq->steal_ring) {
+        return;
+    }
+
+    while (n < VHD_RQ_STEAL_RING_SIZE &&
+           (bios[n] = steal_ring_take(rq->steal_ring))) {
+        n++;
+    }
+
+    while (n--) {
+        struct vhd_bio *bio = bios[n];
+
+        if (bio->vring == vring) {
+            bio->status = VHD_BDEV_CANCELED;
+            req_complete(batch, bio, 0);
+            continue;
+        }
+
+        TAILQ_INSERT_HEAD(&bio->vring->submission, bio, submission_link);
+        rq_sched_add(rq, bio->vring);
+    }
+}
+
+void vhd_cancel_queued_requests(struct vhd_request_queue *rq,
+                                struct vhd_vring *vring)
+{
+    struct vhd_bio *bio;
+    vhd_vring_batch batch = SLIST_HEAD_INITIALIZER(batch);
+
+    rq_unshare_requests(rq, vring, &batch);
+
+    while ((bio = TAILQ_FIRST(&vring->submission))) {
+        TAILQ_REMOVE(&vring->submission, bio, submission_link);
+        bio->status = VHD_BDEV_CANCELED;
+        req_complete(&batch, bio, 0);
+    }
+    rq_sched_remove(rq, vring);
+
+    req_commit_batch(rq, &batch);
+}
+
+bool vhd_bdev_io_fenced(struct vhd_bdev_io *bdev_io)
+{
+    struct vhd_bio *bio = containerof(bdev_io, struct vhd_bio, bdev_io);
+
+    return atomic_load_acquire(&bio->vring->fenced);
+}
+
+/*
+ * Hand a chain of bios of one request queue over to its completion bh.  If
+ * it's not the first on the FIFO scheduling the bh can be skipped because the
+ * first one must have done so.
+ */
+static void rq_complete_chain(struct vhd_request_queue *rq,
+                              struct vhd_bio *first, struct vhd_bio *last)
+{
+    if (rq_completion_push(rq, first, last)) {
+        vhd_bh_schedule(rq->completion_bh);
+    }
+}
+
+/*
+ * can be called from arbitrary thread; will schedule completion on the rq
+ * event loop, or complete the request right away if called in it
+ */
+void vhd_complete_bio(struct vhd_bdev_io *bdev_io,
+                      enum vhd_bdev_io_result status)
+{
+    struct vhd_bio *bio = containerof(bdev_io, struct vhd_bio, bdev_io);
+    struct vhd_request_queue *rq = bio->vring->rq;
+    uint64_t now = vhd_time_ns();
+    bio->status = status;
+    bio->phase_start_ns[VHD_REQ_PHASE_COMPLETION] = now;
+    vhd_trace(VHD_TRACE_COMPLETE, bio->vring->vq.trace_id, bio->head);
+
+    if (vhd_in_event_loop(rq->evloop)) {
+        req_complete(&rq->inline_batch, bio, now);
+        return;
+    }
+
+    rq_complete_chain(rq, bio, bio);
+}
+
+void vhd_complete_bios(struct vhd_bdev_io **bdev_ios,
+                       const enum vhd_bdev_io_result *statuses, unsigned n)
+{
+    struct vhd_request_queue *rq = NULL;
+    struct vhd_bio *first = NULL, *last = NULL;
+    uint64_t now = vhd_time_ns();
+    unsigned i;
+
+    for (i = 0; i < n; i++) {
+        struct vhd_bio *bio = containerof(bdev_ios[i], struct vhd_bio, bdev_io);
+        bio->status = statuses[i];
+        bio->phase_start_ns[VHD_REQ_PHASE_COMPLETION] = now;
+        vhd_trace(VHD_TRACE_COMPLETE, bio->vring->vq.trace_id, bio->head);
+
+        if (bio->vring->rq != rq) {
+            if (first) {
+                rq_complete_chain(rq, first, last);
+            }
+            rq = bio->vring->rq;
+            first = last = NULL;
+        }
+
+        if (vhd_in_event_loop(rq->evloop)) {
+            req_complete(&rq->inline_batch, bio, now);
+            continue;
+        }
+
+        if (last) {
+            last->completion_link.sle_next = bio;
+        } else {
+            first = bio;
+        }
+        last = bio;
+    }
+
+    if (first) {
+        rq_complete_chain(rq, first, last);
     }
 }
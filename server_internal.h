@@ -3,17 +3,21 @@
 #include "vhost/server.h"
 
 struct vhd_io_handler;
-/* Add io handler to vhost control event loop */
-struct vhd_io_handler *vhd_add_vhost_io_handler(int fd, int (*read)(void *),
-                                                void *opaque);
-
+struct vhd_event_loop;
 struct vhd_request_queue;
-/* Add io handler to request queue event loop */
-struct vhd_io_handler *vhd_add_rq_io_handler(struct vhd_request_queue *rq,
-                                             int fd, int (*read)(void *),
-                                             void *opaque);
 
 struct vhd_vdev;
+
+/*
+ * Pick the vhost control event loop to serve the device identified by @key;
+ * the same key always maps to the same loop
+ */
+struct vhd_event_loop *vhd_pick_ctl_evloop(const char *key);
+
+/* Add io handler to the vhost control event loop of @vdev */
+struct vhd_io_handler *vhd_add_vhost_io_handler(struct vhd_vdev *vdev, int fd,
+                                                int (*read)(void *),
+                                                void *opaque);
 struct vhd_bio;
 struct vhd_vring;
 
@@ -23,8 +27,59 @@ struct vhd_vring;
 int vhd_enqueue_block_request(struct vhd_request_queue *rq,
                               struct vhd_bio *bio);
 
+/**
+ * Cancel the requests of @vring not yet handed to the backend, including
+ * those shared with the request queue group and not taken yet, and take the
+ * vring off the @rq scheduler; O(queued requests of @vring + shared ones)
+ */
 void vhd_cancel_queued_requests(struct vhd_request_queue *rq,
-                                const struct vhd_vring *vring);
+                                struct vhd_vring *vring);
+
+/*
+ * Add started @vring to (remove stopped @vring from) the set of vrings served
+ * by @rq.  Must be called in @rq.
+ */
+void vhd_rq_attach_vring(struct vhd_request_queue *rq, struct vhd_vring *vring);
+void vhd_rq_detach_vring(struct vhd_request_queue *rq, struct vhd_vring *vring);
+
+/*
+ * Add the handler @kick of the kick eventfd of @vring to @rq, edge-triggered
+ * if so configured with vhd_set_queue_edge_kicks(), which is recorded in
+ * @vring->kick_edge.  Must be called in @rq.
+ */
+struct vhd_io_handler *vhd_rq_add_kick_handler(struct vhd_request_queue *rq,
+                                               struct vhd_vring *vring,
+                                               int (*kick)(void *opaque));
+
+/*
+ * Note that @vring has just been dispatched on an edge-triggered kick, so
+ * that it's checked for new requests again at the end of the current
+ * vhd_run_queue() pass.  Must be called in @rq.
+ */
+void vhd_rq_vring_kicked(struct vhd_request_queue *rq,
+                         struct vhd_vring *vring);
+
+/*
+ * Make sure the guest notification of @vring held back by coalescing, if
+ * any, is sent by its deadline.  Must be called in @rq.
+ */
+void vhd_rq_vring_notify_pending(struct vhd_request_queue *rq,
+                                 struct vhd_vring *vring);
+
+/*
+ * Number of requests @vring may put in flight before hitting the in-flight
+ * limits of @rq; UINT32_MAX if unlimited.  Must be called in @rq.
+ */
+uint32_t vhd_rq_vring_budget(struct vhd_request_queue *rq,
+                             struct vhd_vring *vring);
+
+/*
+ * Mark @vring as having requests left in its avail ring due to the in-flight
+ * limits, so that it's dispatched again once completions free up slots, or
+ * clear the mark.  Must be called in @rq.
+ */
+void vhd_rq_set_vring_throttled(struct vhd_request_queue *rq,
+                                struct vhd_vring *vring, bool throttled);
 
 /**
  * Run callback in request queue
@@ -33,14 +88,15 @@ void vhd_run_in_rq(struct vhd_request_queue *rq, void (*cb)(void *),
                    void *opaque);
 
 /*
- * Run callback in vhost control event loop
+ * Run callback in the vhost control event loop of @vdev
  */
-void vhd_run_in_ctl(void (*cb)(void *), void *opaque);
+void vhd_run_in_ctl(struct vhd_vdev *vdev, void (*cb)(void *), void *opaque);
 
 /*
- * Submit a work item onto vhost control event loop and wait till it's
- * finished.
+ * Submit a work item onto the vhost control event loop of @vdev and wait till
+ * it's finished.
  */
 struct vhd_work;
-int vhd_submit_ctl_work_and_wait(void (*func)(struct vhd_work *, void *),
+int vhd_submit_ctl_work_and_wait(struct vhd_vdev *vdev,
+                                 void (*func)(struct vhd_work *, void *),
                                  void *opaque);
@@ -21,6 +21,8 @@
 
 #define MAX_AIO_QUEUE_LEN 32
 #define MAX_AIO_EVENTS 32
+/* enough for the largest requests Linux guests issue by default */
+#define BOUNCE_BUF_SIZE (1 << 20)
 
 #define DIE(fmt, ...)                              \
 do {                                               \
@@ -42,6 +44,13 @@ struct backend_config {
     const char *blk_file;
     unsigned long delay;
     bool readonly;
+
+    /* use vhd_null_bdev with VHD_NULL_BDEV_* flags instead of the file */
+    uint64_t null_size;
+    unsigned null_flags;
+
+    /* number of aligned buffers to bounce misaligned guest buffers through */
+    unsigned bounce_bufs;
 };
 
 /*
@@ -53,6 +62,7 @@ struct backend {
     unsigned long delay;
     int fd;
     io_context_t io_ctx;
+    struct vhd_null_bdev *null_bdev;
 };
 
 /*
@@ -142,8 +152,11 @@ static struct iocb *prepare_io_operation(struct vhd_request *lib_req)
     return &req->ios;
 }
 
-static void complete_request(struct request *req,
-                             enum vhd_bdev_io_result status)
+/*
+ * Release the resources of the request except the bio itself, which is to be
+ * completed by the caller.
+ */
+static void finish_request(struct request *req, enum vhd_bdev_io_result status)
 {
     if (req->bounce_buf && req->bio->type == VHD_BDEV_READ) {
         if (status == VHD_BDEV_SUCCESS) {
@@ -157,6 +170,12 @@ static void complete_request(struct request *req,
         }
         free(req->iov[0].iov_base);
     }
+}
+
+static void complete_request(struct request *req,
+                             enum vhd_bdev_io_result status)
+{
+    finish_request(req, status);
     vhd_complete_bio(req->bio, status);
 }
 
@@ -168,7 +187,7 @@ static void *io_handle(void *opaque)
     struct queue *qdev = (struct queue *) opaque;
 
     while (true) {
-        struct vhd_request req;
+        bool more;
 
         int ret = vhd_run_queue(qdev->rq);
         if (ret != -EAGAIN) {
@@ -178,21 +197,42 @@ static void *io_handle(void *opaque)
             break;
         }
 
-        while (vhd_dequeue_request(qdev->rq, &req)) {
-            struct backend *bdev = vhd_vdev_get_priv(req.vdev);
-            struct iocb *ios = prepare_io_operation(&req);
-            int ret;
+        do {
+            struct vhd_request reqs[MAX_AIO_QUEUE_LEN];
+            struct iocb *ios[MAX_AIO_QUEUE_LEN];
+            unsigned i, n;
+            int submitted = 0;
 
-            /* ret can be: 1 (success), 0 (some error), < 0 (errno) */
-            do {
-                ret = io_submit(bdev->io_ctx, 1, &ios);
-            } while (ret == -EAGAIN);
+            n = vhd_dequeue_requests(qdev->rq, reqs, MAX_AIO_QUEUE_LEN, &more);
+            if (qdev->bdev->null_bdev) {
+                vhd_null_bdev_submit(qdev->bdev->null_bdev, reqs, n);
+                continue;
+            }
+            for (i = 0; i < n; i++) {
+                ios[i] = prepare_io_operation(&reqs[i]);
+            }
 
-            if (ret != 1) {
-                PERROR("io_submit", -ret);
-                complete_request(ios->data, VHD_BDEV_IOERR);
+            /*
+             * all requests of a queue go to the same backend; ret can be:
+             * >= 0 (number of iocbs submitted), < 0 (errno)
+             */
+            while (submitted < (int)n) {
+                ret = io_submit(qdev->bdev->io_ctx, n - submitted,
+                                &ios[submitted]);
+                if (ret == -EAGAIN) {
+                    continue;
+                }
+                if (ret <= 0) {
+                    PERROR("io_submit", ret ? -ret : EIO);
+                    for (i = submitted; i < n; i++) {
+                        complete_request(ios[i]->data, VHD_BDEV_IOERR);
+                        free(ios[i]->data);
+                    }
+                    break;
+                }
+                submitted += ret;
             }
-        }
+        } while (more);
     }
 
     return NULL;
@@ -230,6 +270,9 @@ static void *io_completion(void *thread_data)
             break;
         }
 
+        struct vhd_bdev_io *bios[MAX_AIO_EVENTS];
+        enum vhd_bdev_io_result statuses[MAX_AIO_EVENTS];
+
         for (int i = 0; i < ret; i++) {
             struct request *req = events[i].data;
             vhd_log_stderr(LOG_DEBUG,
@@ -237,17 +280,24 @@ static void *io_completion(void *thread_data)
 
             if ((events[i].res2 != 0) ||
                 (events[i].res != req->bio->total_sectors * VHD_SECTOR_SIZE)) {
-                complete_request(req, VHD_BDEV_IOERR);
+                statuses[i] = VHD_BDEV_IOERR;
                 PERROR("IO request", -events[i].res);
             } else {
                 if (bdev->delay) {
                     usleep(bdev->delay);
                 }
-                complete_request(req, VHD_BDEV_SUCCESS);
+                statuses[i] = VHD_BDEV_SUCCESS;
                 vhd_log_stderr(LOG_DEBUG, "IO request completed successfully");
             }
+            finish_request(req, statuses[i]);
+            bios[i] = req->bio;
             free(req);
         }
+
+        /* complete the whole batch of requests at once */
+        if (ret > 0) {
+            vhd_complete_bios(bios, statuses, ret);
+        }
     }
 
     return NULL;
@@ -262,6 +312,19 @@ static int init_backend(struct backend *bdev, const struct backend_config *conf)
     int ret = 0;
     int flags = (conf->readonly ? O_RDONLY : O_RDWR) | O_DIRECT;
 
+    bdev->info.socket_path = conf->socket_path;
+    bdev->info.serial = conf->serial;
+    bdev->info.block_size = VHD_SECTOR_SIZE;
+    bdev->info.num_queues = 256; /* Max count of virtio queues */
+    bdev->info.readonly = conf->readonly;
+
+    if (conf->null_size) {
+        bdev->fd = -1;
+        bdev->info.total_blocks = conf->null_size / VHD_SECTOR_SIZE;
+        bdev->null_bdev = vhd_null_bdev_new(conf->null_flags);
+        return bdev->null_bdev ? 0 : -ENOMEM;
+    }
+
     bdev->fd = open(conf->blk_file, flags);
     if (bdev->fd < 0) {
         ret = errno;
@@ -278,14 +341,19 @@ static int init_backend(struct backend *bdev, const struct backend_config *conf)
                        file_len % VHD_SECTOR_SIZE);
     }
 
-    bdev->info.socket_path = conf->socket_path;
-    bdev->info.serial = conf->serial;
-    bdev->info.block_size = VHD_SECTOR_SIZE;
-    bdev->info.num_queues = 256; /* Max count of virtio queues */
     bdev->info.total_blocks = file_len / VHD_SECTOR_SIZE;
     bdev->info.map_cb = NULL;
+    if (conf->bounce_bufs) {
+        /* page alignment satisfies O_DIRECT regardless of the storage */
+        bdev->info.bounce_pool = vhd_bounce_pool_new(sysconf(_SC_PAGESIZE),
+                                                     BOUNCE_BUF_SIZE,
+                                                     conf->bounce_bufs);
+        if (!bdev->info.bounce_pool) {
+            ret = ENOMEM;
+            goto fail;
+        }
+    }
     bdev->info.unmap_cb = NULL;
-    bdev->info.readonly = conf->readonly;
     bdev->delay = conf->delay;
 
     ret = -io_setup(MAX_AIO_QUEUE_LEN, &bdev->io_ctx);
@@ -297,6 +365,9 @@ static int init_backend(struct backend *bdev, const struct backend_config *conf)
     return 0;
 
 fail:
+    if (bdev->info.bounce_pool) {
+        vhd_bounce_pool_free(bdev->info.bounce_pool);
+    }
     close(bdev->fd);
     return -ret;
 }
@@ -323,7 +394,7 @@ static int append_backend(struct queue *qdev, struct backend *bdev)
  */
 static void usage(const char *cmd)
 {
-    printf("Usage: %s -s SOCKPATH -b FILEPATH -i SERIAL\n", cmd);
+    printf("Usage: %s -s SOCKPATH {-b FILEPATH | -n SIZE} -i SERIAL\n", cmd);
     printf("Start vhost daemon.\n");
     printf("\n");
     printf("Mandatory arguments to long options "
@@ -333,6 +404,13 @@ static void usage(const char *cmd)
     printf("  -b, --blk-file=PATH     block device or file path\n");
     printf("  -r, --readonly          readonly block device\n");
     printf("  -d msec, --delay=msec, delay of each completion request in microseconds\n");
+    printf("  -n, --null=SIZE         null device of SIZE bytes, doing no I/O\n");
+    printf("  -c, --completion-thread complete null device requests in a"
+           " separate thread\n");
+    printf("  -z, --zero-reads        fill null device read buffers with"
+           " zeroes\n");
+    printf("  -B, --bounce-bufs=COUNT bounce misaligned guest buffers through"
+           " COUNT aligned ones\n");
 }
 
 /*
@@ -348,10 +426,14 @@ static void parse_opts(int argc, char **argv, struct backend_config *conf)
             {"blk-file",       1, NULL, 'b'},
             {"delay",          1, NULL, 'd'},
             {"readonly",       0, NULL, 'r'},
+            {"null",           1, NULL, 'n'},
+            {"completion-thread", 0, NULL, 'c'},
+            {"zero-reads",     0, NULL, 'z'},
+            {"bounce-bufs",    1, NULL, 'B'},
             {0, 0, 0, 0}
         };
 
-        opt = getopt_long(argc, argv, "s:i:b:d:r:", long_options, NULL);
+        opt = getopt_long(argc, argv, "s:i:b:d:r:n:czB:", long_options, NULL);
 
         switch (opt) {
         case -1:
@@ -371,6 +453,18 @@ static void parse_opts(int argc, char **argv, struct backend_config *conf)
         case 'r':
             conf->readonly = true;
             break;
+        case 'n':
+            conf->null_size = strtoull(optarg, NULL, 0);
+            break;
+        case 'c':
+            conf->null_flags |= VHD_NULL_BDEV_COMPLETION_THREAD;
+            break;
+        case 'z':
+            conf->null_flags |= VHD_NULL_BDEV_ZERO_READS;
+            break;
+        case 'B':
+            conf->bounce_bufs = atoi(optarg);
+            break;
         default:
             usage(argv[0]);
             exit(2);
@@ -410,7 +504,8 @@ int main(int argc, char **argv)
 
     parse_opts(argc, argv, &conf);
 
-    if (!conf.socket_path || !conf.blk_file || !conf.serial) {
+    if (!conf.socket_path || !conf.serial ||
+        !conf.blk_file == !conf.null_size) {
         usage(argv[0]);
         DIE("Invalid command line options");
     }
@@ -440,7 +535,9 @@ int main(int argc, char **argv)
     vhd_log_stderr(LOG_INFO, "Test server started");
 
     /* start the worker thread(s) */
-    pthread_create(&io_completion_thread, NULL, io_completion, &bdev);
+    if (!bdev.null_bdev) {
+        pthread_create(&io_completion_thread, NULL, io_completion, &bdev);
+    }
 
     /* start libvhost request queue runner thread */
     pthread_create(&rq_thread, NULL, io_handle, &qdev);
@@ -472,16 +569,25 @@ int main(int argc, char **argv)
     pthread_join(rq_thread, NULL);
 
     /* 3. Stop the worker thread(s) */
-    pthread_kill(io_completion_thread, SIGUSR1);
-    pthread_join(io_completion_thread, NULL);
+    if (!bdev.null_bdev) {
+        pthread_kill(io_completion_thread, SIGUSR1);
+        pthread_join(io_completion_thread, NULL);
+    }
 
     /* 4. Release request queues and stop the vhost server in any order */
     vhd_release_request_queue(qdev.rq);
     vhd_stop_vhost_server();
 
     /* 5. Release related resources */
-    io_destroy(bdev.io_ctx);
-    close(bdev.fd);
+    if (bdev.null_bdev) {
+        vhd_null_bdev_free(bdev.null_bdev);
+    } else {
+        io_destroy(bdev.io_ctx);
+        close(bdev.fd);
+        if (bdev.info.bounce_pool) {
+            vhd_bounce_pool_free(bdev.info.bounce_pool);
+        }
+    }
 
     vhd_log_stderr(LOG_INFO, "Server has been stopped.");
 
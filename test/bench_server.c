@@ -0,0 +1,618 @@
+/*
+ * Scaling benchmark server
+ *
+ * Serves @devices vhost-user-blk devices, with their virtqueues spread over
+ * @request-queues request queues run by one thread each, on a backend that
+ * does no real I/O: "null" completes requests right away with
+ * vhd_null_bdev, "ram" copies the data to or from memory.  Requests are
+ * completed inline in the request queue thread, so library overhead isn't
+ * diluted with backend latency, unless the null backend is told to use a
+ * completion thread.  With --work-stealing the request queues form a group,
+ * for the idle ones to take over requests queued on the busy ones.
+ *
+ * On SIGUSR1 a line of JSON with the statistics accumulated since the
+ * previous report is printed on stdout: completed requests and bytes, CPU
+ * time and cycles (if perf events are available) spent in the request queue
+ * threads, and per-phase latency percentiles from the library histograms.
+ * The last report is printed on SIGINT/SIGTERM before exiting, and, with
+ * --trace and the library built with WITH_TRACE=1, the request trace is
+ * dumped for scripts/vhd_trace.py.
+ *
+ * test/pytest/scale_bench.py drives it from QEMU guests running fio.
+ */
+
+#define _GNU_SOURCE 1
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <limits.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "vhost/server.h"
+#include "vhost/blockdev.h"
+#include "vhost/trace.h"
+#include "test_utils.h"
+#include "platform.h"
+
+#define DIE(fmt, ...)                              \
+do {                                               \
+    vhd_log_stderr(LOG_ERROR, fmt, ##__VA_ARGS__); \
+    exit(EXIT_FAILURE);                            \
+} while (0)
+
+#define BENCH_DEQUEUE_BATCH 64
+
+enum bench_backend {
+    BENCH_BACKEND_NULL,
+    BENCH_BACKEND_RAM,
+};
+
+struct bench_config {
+    const char *socket_dir;
+    unsigned num_devices;
+    unsigned num_rqs;
+    unsigned num_queues;
+    uint64_t size;
+    enum bench_backend backend;
+    /* VHD_NULL_BDEV_* */
+    unsigned null_flags;
+    bool edge_kicks;
+    bool work_stealing;
+    bool postcopy;
+    const char *trace_file;
+};
+
+struct bench_dev {
+    struct vhd_bdev_info info;
+    struct vhd_vdev *vdev;
+    char serial[32];
+    char socket_path[PATH_MAX];
+    void *ram;
+};
+
+struct bench_rq {
+    struct vhd_request_queue *rq;
+    pthread_t thread;
+
+    /* set up by the thread itself before it starts running the queue */
+    clockid_t cpu_clock;
+    int cycles_fd;
+    int cycles_err;
+    int ready_fd;
+};
+
+/* counters a report is the difference of */
+struct bench_snapshot {
+    uint64_t requests;
+    uint64_t bytes;
+    uint64_t cpu_ns;
+    uint64_t cycles;
+    struct vhd_latency_hist latency[VHD_REQ_PHASE_COUNT];
+};
+
+static struct bench_config g_conf = {
+    .num_devices = 1,
+    .num_rqs = 1,
+    .num_queues = 1,
+    .size = 1ull << 30,
+    .backend = BENCH_BACKEND_NULL,
+};
+
+static struct bench_dev *g_devs;
+static struct bench_rq *g_rqs;
+static struct vhd_null_bdev *g_null_bdev;
+
+static const char *const phase_names[VHD_REQ_PHASE_COUNT] = {
+    [VHD_REQ_PHASE_QUEUED] = "queued",
+    [VHD_REQ_PHASE_BACKEND] = "backend",
+    [VHD_REQ_PHASE_COMPLETION] = "completion",
+};
+
+static int open_cycles_counter(void)
+{
+    struct perf_event_attr attr = {
+        .type = PERF_TYPE_HARDWARE,
+        .size = sizeof(attr),
+        .config = PERF_COUNT_HW_CPU_CYCLES,
+        .exclude_hv = 1,
+    };
+
+    /* count the calling thread on any CPU */
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static void handle_request(struct vhd_bdev_io *bio, struct bench_dev *dev)
+{
+    uint64_t off = bio->first_sector * VHD_SECTOR_SIZE;
+    size_t i;
+
+    if (bio->type != VHD_BDEV_READ && bio->type != VHD_BDEV_WRITE) {
+        return;
+    }
+
+    for (i = 0; i < bio->sglist.nbuffers; i++) {
+        struct vhd_buffer *buf = &bio->sglist.buffers[i];
+
+        if (bio->type == VHD_BDEV_READ) {
+            memcpy(buf->base, (char *)dev->ram + off, buf->len);
+        } else {
+            memcpy((char *)dev->ram + off, buf->base, buf->len);
+        }
+        off += buf->len;
+    }
+}
+
+static void *rq_thread(void *opaque)
+{
+    struct bench_rq *brq = opaque;
+    struct vhd_request reqs[BENCH_DEQUEUE_BATCH];
+
+    pthread_getcpuclockid(pthread_self(), &brq->cpu_clock);
+    brq->cycles_fd = open_cycles_counter();
+    brq->cycles_err = errno;
+    eventfd_write(brq->ready_fd, 1);
+
+    for (;;) {
+        unsigned i, n;
+        bool more;
+        int res = vhd_run_queue(brq->rq);
+
+        if (res != -EAGAIN) {
+            if (res < 0) {
+                vhd_log_stderr(LOG_ERROR, "vhd_run_queue error: %d", res);
+            }
+            break;
+        }
+
+        do {
+            n = vhd_dequeue_group_requests(brq->rq, reqs,
+                                           BENCH_DEQUEUE_BATCH, &more);
+            if (g_null_bdev) {
+                vhd_null_bdev_submit(g_null_bdev, reqs, n);
+                continue;
+            }
+            for (i = 0; i < n; i++) {
+                handle_request(reqs[i].bio, vhd_vdev_get_priv(reqs[i].vdev));
+                vhd_complete_bio(reqs[i].bio, VHD_BDEV_SUCCESS);
+            }
+        } while (more);
+    }
+
+    return NULL;
+}
+
+static void take_snapshot(struct bench_snapshot *snap)
+{
+    unsigned d, q, i, p, b;
+
+    *snap = (struct bench_snapshot) {};
+
+    for (d = 0; d < g_conf.num_devices; d++) {
+        for (q = 0; q < g_conf.num_queues; q++) {
+            struct vhd_vq_io_stat stat;
+
+            if (vhd_vdev_get_queue_io_stat(g_devs[d].vdev, q, &stat)) {
+                continue;
+            }
+
+            for (i = 0; i < VHD_REQ_OP_COUNT; i++) {
+                struct vhd_vq_op_stat *op = &stat.ops[i];
+
+                snap->requests += op->requests;
+                snap->bytes += op->bytes;
+                for (p = 0; p < VHD_REQ_PHASE_COUNT; p++) {
+                    for (b = 0; b < VHD_LATENCY_HIST_BUCKETS; b++) {
+                        snap->latency[p].buckets[b] +=
+                            op->latency[p].buckets[b];
+                    }
+                    snap->latency[p].total_ns += op->latency[p].total_ns;
+                }
+            }
+        }
+    }
+
+    for (i = 0; i < g_conf.num_rqs; i++) {
+        struct timespec ts;
+        uint64_t cycles;
+
+        if (!clock_gettime(g_rqs[i].cpu_clock, &ts)) {
+            snap->cpu_ns += ts.tv_sec * 1000000000ull + ts.tv_nsec;
+        }
+        if (g_rqs[i].cycles_fd >= 0 &&
+            read(g_rqs[i].cycles_fd, &cycles, sizeof(cycles)) ==
+            sizeof(cycles)) {
+            snap->cycles += cycles;
+        }
+    }
+}
+
+/* Print the statistics accumulated since @prev and make it current */
+static void report(struct bench_snapshot *prev)
+{
+    struct bench_snapshot cur, delta;
+    unsigned p, b;
+
+    take_snapshot(&cur);
+
+    delta.requests = cur.requests - prev->requests;
+    delta.bytes = cur.bytes - prev->bytes;
+    delta.cpu_ns = cur.cpu_ns - prev->cpu_ns;
+    delta.cycles = cur.cycles - prev->cycles;
+    for (p = 0; p < VHD_REQ_PHASE_COUNT; p++) {
+        for (b = 0; b < VHD_LATENCY_HIST_BUCKETS; b++) {
+            delta.latency[p].buckets[b] = cur.latency[p].buckets[b] -
+                prev->latency[p].buckets[b];
+        }
+        delta.latency[p].total_ns = cur.latency[p].total_ns -
+            prev->latency[p].total_ns;
+    }
+
+    printf("{\"requests\": %" PRIu64 ", \"bytes\": %" PRIu64
+           ", \"cpu_ns\": %" PRIu64, delta.requests, delta.bytes,
+           delta.cpu_ns);
+    if (g_rqs[0].cycles_fd >= 0) {
+        printf(", \"cycles\": %" PRIu64, delta.cycles);
+    } else {
+        printf(", \"cycles\": null");
+    }
+    printf(", \"latency_ns\": {");
+    for (p = 0; p < VHD_REQ_PHASE_COUNT; p++) {
+        const struct vhd_latency_hist *hist = &delta.latency[p];
+
+        printf("%s\"%s\": {\"mean\": %" PRIu64 ", \"p50\": %" PRIu64
+               ", \"p99\": %" PRIu64 ", \"p99.9\": %" PRIu64 "}",
+               p ? ", " : "", phase_names[p],
+               delta.requests ? hist->total_ns / delta.requests : 0,
+               vhd_latency_hist_percentile(hist, 50),
+               vhd_latency_hist_percentile(hist, 99),
+               vhd_latency_hist_percentile(hist, 99.9));
+    }
+    printf("}}\n");
+    fflush(stdout);
+
+    *prev = cur;
+}
+
+static void usage(const char *cmd)
+{
+    printf("Usage: %s -s SOCKDIR [OPTION]...\n", cmd);
+    printf("Start vhost benchmark daemon.\n");
+    printf("\n");
+    printf("Mandatory arguments to long options "
+           "are mandatory for short options too.\n");
+    printf("  -s, --socket-dir=PATH      directory to create bench-N.sock"
+           " device sockets in\n");
+    printf("  -n, --devices=N            number of devices (default 1)\n");
+    printf("  -r, --request-queues=N     number of request queues"
+           " (default 1)\n");
+    printf("  -q, --num-queues=N         virtqueues per device (default 1)\n");
+    printf("  -S, --size=BYTES           device size (default 1G)\n");
+    printf("  -b, --backend=null|ram     backend (default null)\n");
+    printf("  -c, --completion-thread    complete null backend requests in"
+           " a separate thread\n");
+    printf("  -z, --zero-reads           make null backend fill read buffers"
+           " with zeroes\n");
+    printf("  -e, --edge-kicks           edge-triggered guest notifications\n");
+    printf("  -w, --work-stealing        put all request queues in a group"
+           " to share the load\n");
+    printf("  -t, --trace=FILE           record request trace, dump it to FILE"
+           " on exit\n");
+    printf("  -P, --postcopy             allow postcopy migration of the"
+           " guests\n");
+}
+
+static void parse_opts(int argc, char **argv)
+{
+    int opt;
+    do {
+        static struct option long_options[] = {
+            {"socket-dir",     1, NULL, 's'},
+            {"devices",        1, NULL, 'n'},
+            {"request-queues", 1, NULL, 'r'},
+            {"num-queues",     1, NULL, 'q'},
+            {"size",           1, NULL, 'S'},
+            {"backend",        1, NULL, 'b'},
+            {"completion-thread", 0, NULL, 'c'},
+            {"zero-reads",     0, NULL, 'z'},
+            {"edge-kicks",     0, NULL, 'e'},
+            {"work-stealing",  0, NULL, 'w'},
+            {"trace",          1, NULL, 't'},
+            {"postcopy",       0, NULL, 'P'},
+            {0, 0, 0, 0}
+        };
+
+        opt = getopt_long(argc, argv, "s:n:r:q:S:b:czewt:P", long_options,
+                          NULL);
+
+        switch (opt) {
+        case -1:
+            break;
+        case 's':
+            g_conf.socket_dir = optarg;
+            break;
+        case 'n':
+            g_conf.num_devices = atoi(optarg);
+            break;
+        case 'r':
+            g_conf.num_rqs = atoi(optarg);
+            break;
+        case 'q':
+            g_conf.num_queues = atoi(optarg);
+            break;
+        case 'S':
+            g_conf.size = strtoull(optarg, NULL, 0);
+            break;
+        case 'b':
+            if (!strcmp(optarg, "null")) {
+                g_conf.backend = BENCH_BACKEND_NULL;
+            } else if (!strcmp(optarg, "ram")) {
+                g_conf.backend = BENCH_BACKEND_RAM;
+            } else {
+                usage(argv[0]);
+                exit(2);
+            }
+            break;
+        case 'c':
+            g_conf.null_flags |= VHD_NULL_BDEV_COMPLETION_THREAD;
+            break;
+        case 'z':
+            g_conf.null_flags |= VHD_NULL_BDEV_ZERO_READS;
+            break;
+        case 'e':
+            g_conf.edge_kicks = true;
+            break;
+        case 'w':
+            g_conf.work_stealing = true;
+            break;
+        case 't':
+            g_conf.trace_file = optarg;
+            break;
+        case 'P':
+            g_conf.postcopy = true;
+            break;
+        default:
+            usage(argv[0]);
+            exit(2);
+        }
+    } while (opt != -1);
+}
+
+static void notify_event(void *opaque)
+{
+    int *fd = (int *) opaque;
+
+    while (eventfd_write(*fd, 1) && errno == EINTR) {
+        ;
+    }
+}
+
+static void wait_event(int fd)
+{
+    eventfd_t unused;
+
+    while (eventfd_read(fd, &unused) && errno == EINTR) {
+        ;
+    }
+}
+
+static void init_devices(struct vhd_request_queue **rqs)
+{
+    struct vhd_bdev_registration *regs;
+    struct vhd_request_queue **dev_rqs;
+    unsigned i;
+
+    g_devs = vhd_calloc(g_conf.num_devices, sizeof(g_devs[0]));
+    regs = vhd_calloc(g_conf.num_devices, sizeof(regs[0]));
+    dev_rqs = vhd_calloc(g_conf.num_devices * g_conf.num_rqs,
+                         sizeof(dev_rqs[0]));
+
+    for (i = 0; i < g_conf.num_devices; i++) {
+        struct bench_dev *dev = &g_devs[i];
+
+        snprintf(dev->serial, sizeof(dev->serial), "bench-%u", i);
+        snprintf(dev->socket_path, sizeof(dev->socket_path), "%s/%s.sock",
+                 g_conf.socket_dir, dev->serial);
+
+        if (g_conf.backend == BENCH_BACKEND_RAM) {
+            dev->ram = mmap(NULL, g_conf.size, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                            -1, 0);
+            if (dev->ram == MAP_FAILED) {
+                DIE("can't allocate %" PRIu64 " bytes of ram", g_conf.size);
+            }
+        }
+
+        dev->info = (struct vhd_bdev_info) {
+            .serial = dev->serial,
+            .socket_path = dev->socket_path,
+            .block_size = 4096,
+            .num_queues = g_conf.num_queues,
+            .total_blocks = g_conf.size / 4096,
+            .writeback_cache = false,
+            .postcopy = g_conf.postcopy,
+        };
+
+        /*
+         * Spread the devices' virtqueues over all request queues, starting
+         * from a different one for each device
+         */
+        unsigned j;
+        for (j = 0; j < g_conf.num_rqs; j++) {
+            dev_rqs[i * g_conf.num_rqs + j] = rqs[(i + j) % g_conf.num_rqs];
+        }
+
+        unlink(dev->socket_path);
+        regs[i] = (struct vhd_bdev_registration) {
+            .bdev = &dev->info,
+            .rqs = &dev_rqs[i * g_conf.num_rqs],
+            .num_rqs = g_conf.num_rqs,
+            .priv = dev,
+        };
+    }
+
+    vhd_register_blockdevs(regs, g_conf.num_devices);
+    for (i = 0; i < g_conf.num_devices; i++) {
+        g_devs[i].vdev = regs[i].vdev;
+        if (!g_devs[i].vdev) {
+            DIE("can't register device %s", g_devs[i].socket_path);
+        }
+    }
+
+    vhd_free(dev_rqs);
+    vhd_free(regs);
+}
+
+int main(int argc, char **argv)
+{
+    struct vhd_request_queue **rqs;
+    struct vhd_rq_group *group = NULL;
+    struct bench_snapshot prev;
+    sigset_t sigset;
+    int sig, unreg_done_fd;
+    unsigned i;
+
+    parse_opts(argc, argv);
+
+    if (!g_conf.socket_dir || !g_conf.num_devices || !g_conf.num_rqs ||
+        !g_conf.num_queues || g_conf.size < 4096) {
+        usage(argv[0]);
+        DIE("Invalid command line options");
+    }
+
+    if (vhd_start_vhost_server(vhd_log_stderr) < 0) {
+        DIE("vhd_start_vhost_server failed");
+    }
+
+    if (g_conf.trace_file && vhd_trace_set_enabled(true) < 0) {
+        DIE("tracing is not available, build with WITH_TRACE=1");
+    }
+
+    if (g_conf.backend == BENCH_BACKEND_NULL) {
+        g_null_bdev = vhd_null_bdev_new(g_conf.null_flags);
+        if (!g_null_bdev) {
+            DIE("vhd_null_bdev_new failed");
+        }
+    }
+
+    /* the threads inherit the signal mask */
+    sigemptyset(&sigset);
+    sigaddset(&sigset, SIGINT);
+    sigaddset(&sigset, SIGTERM);
+    sigaddset(&sigset, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &sigset, NULL);
+
+    g_rqs = vhd_calloc(g_conf.num_rqs, sizeof(g_rqs[0]));
+    rqs = vhd_calloc(g_conf.num_rqs, sizeof(rqs[0]));
+    for (i = 0; i < g_conf.num_rqs; i++) {
+        rqs[i] = g_rqs[i].rq = vhd_create_request_queue();
+        if (!rqs[i]) {
+            DIE("vhd_create_request_queue failed");
+        }
+        vhd_set_queue_edge_kicks(rqs[i], g_conf.edge_kicks);
+    }
+
+    if (g_conf.work_stealing) {
+        group = vhd_create_rq_group(rqs, g_conf.num_rqs);
+        if (!group) {
+            DIE("vhd_create_rq_group failed");
+        }
+    }
+
+    for (i = 0; i < g_conf.num_rqs; i++) {
+        struct bench_rq *brq = &g_rqs[i];
+
+        brq->ready_fd = eventfd(0, 0);
+        if (brq->ready_fd == -1) {
+            DIE("eventfd creation failed");
+        }
+        pthread_create(&brq->thread, NULL, rq_thread, brq);
+        wait_event(brq->ready_fd);
+        close(brq->ready_fd);
+    }
+
+    if (g_rqs[0].cycles_fd < 0) {
+        vhd_log_stderr(LOG_WARNING, "CPU cycles are not available: %s",
+                       strerror(g_rqs[0].cycles_err));
+    }
+
+    init_devices(rqs);
+
+    vhd_log_stderr(LOG_INFO, "Benchmark server started: %u devices, "
+                   "%u request queues", g_conf.num_devices, g_conf.num_rqs);
+
+    take_snapshot(&prev);
+    for (;;) {
+        sigwait(&sigset, &sig);
+        report(&prev);
+        if (sig != SIGUSR1) {
+            break;
+        }
+    }
+
+    vhd_log_stderr(LOG_INFO, "Stopping the server");
+
+    if (g_conf.trace_file) {
+        int fd = open(g_conf.trace_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            DIE("can't open %s: %s", g_conf.trace_file, strerror(errno));
+        }
+        vhd_trace_set_enabled(false);
+        if (vhd_trace_dump(fd) < 0) {
+            DIE("failed to dump trace to %s", g_conf.trace_file);
+        }
+        close(fd);
+    }
+
+    unreg_done_fd = eventfd(0, 0);
+    if (unreg_done_fd == -1) {
+        DIE("eventfd creation failed");
+    }
+    for (i = 0; i < g_conf.num_devices; i++) {
+        vhd_unregister_blockdev(g_devs[i].vdev, notify_event, &unreg_done_fd);
+        wait_event(unreg_done_fd);
+        if (g_devs[i].ram) {
+            munmap(g_devs[i].ram, g_conf.size);
+        }
+    }
+    close(unreg_done_fd);
+
+    /* all requests have been completed once the devices are unregistered */
+    if (g_null_bdev) {
+        vhd_null_bdev_free(g_null_bdev);
+    }
+
+    for (i = 0; i < g_conf.num_rqs; i++) {
+        vhd_stop_queue(g_rqs[i].rq);
+        pthread_join(g_rqs[i].thread, NULL);
+    }
+    if (group) {
+        vhd_release_rq_group(group);
+    }
+    for (i = 0; i < g_conf.num_rqs; i++) {
+        vhd_release_request_queue(g_rqs[i].rq);
+        if (g_rqs[i].cycles_fd >= 0) {
+            close(g_rqs[i].cycles_fd);
+        }
+    }
+    vhd_stop_vhost_server();
+
+    vhd_free(rqs);
+    vhd_free(g_rqs);
+    vhd_free(g_devs);
+
+    vhd_log_stderr(LOG_INFO, "Server has been stopped.");
+
+    return 0;
+}
@@ -2,7 +2,10 @@
 #include <stdio.h>
 #include <string.h>
 #include <assert.h>
+#include <poll.h>
+#include <sys/eventfd.h>
 #include <sys/time.h>
+#include <unistd.h>
 
 #include <thread>
 
@@ -83,6 +86,227 @@ static void bh_oneshot(void)
     });
 }
 
+struct time_sample {
+    uint64_t start;
+    uint64_t end;
+};
+
+static void time_sample_bh(void *opaque)
+{
+    time_sample *sample = (time_sample *)opaque;
+
+    sample->start = vhd_time_ns();
+    usleep(2000);
+    sample->end = vhd_time_ns();
+}
+
+static void cached_time(void)
+{
+    run_with_timeout(30, []() {
+        vhd_event_loop *evloop =
+            vhd_create_event_loop(VHD_EVENT_LOOP_DEFAULT_MAX_EVENTS);
+        CU_ASSERT(evloop != NULL);
+
+        std::thread runner([&]() {
+            time_sample first, second;
+
+            /* not running an event loop yet: the clock is read every time */
+            uint64_t t = vhd_time_ns();
+            usleep(2000);
+            CU_ASSERT(vhd_time_ns() >= t + 2000000);
+
+            /* cached within one iteration, updated in the next one */
+            vhd_bh_schedule_oneshot(evloop, time_sample_bh, &first);
+            CU_ASSERT(vhd_run_event_loop(evloop, -1) == -EAGAIN);
+            vhd_bh_schedule_oneshot(evloop, time_sample_bh, &second);
+            CU_ASSERT(vhd_run_event_loop(evloop, -1) == -EAGAIN);
+
+            CU_ASSERT(first.start >= t + 2000000);
+            CU_ASSERT(first.end == first.start);
+            CU_ASSERT(second.start >= first.start + 2000000);
+            CU_ASSERT(second.end == second.start);
+
+            vhd_terminate_event_loop(evloop);
+            CU_ASSERT(vhd_run_event_loop(evloop, -1) == -EAGAIN);
+            CU_ASSERT(vhd_run_event_loop(evloop, -1) == 0);
+        });
+
+        runner.join();
+        vhd_free_event_loop(evloop);
+    });
+}
+
+static void cycles_to_ns(void)
+{
+    /* the rate is measured from the first use */
+    vhd_cycles_to_ns(0);
+    usleep(20000);
+
+    uint64_t start = vhd_cycles();
+    usleep(20000);
+    uint64_t ns = vhd_cycles_to_ns(vhd_cycles() - start);
+
+    /* loose bounds to tolerate a loaded machine */
+    CU_ASSERT(ns >= 15000000);
+    CU_ASSERT(ns < 1000000000);
+}
+
+static void nop_bh(void *opaque)
+{
+}
+
+static void home_thread(void)
+{
+    run_with_timeout(30, []() {
+        vhd_event_loop *evloop =
+            vhd_create_event_loop(VHD_EVENT_LOOP_DEFAULT_MAX_EVENTS);
+        CU_ASSERT(evloop != NULL);
+
+        std::thread runner([&]() {
+            /* the thread becomes the home one once it runs the event loop */
+            CU_ASSERT(!vhd_in_event_loop(evloop));
+            vhd_bh_schedule_oneshot(evloop, nop_bh, NULL);
+            CU_ASSERT(vhd_run_event_loop(evloop, -1) == -EAGAIN);
+            CU_ASSERT(vhd_in_event_loop(evloop));
+
+            vhd_terminate_event_loop(evloop);
+            CU_ASSERT(vhd_run_event_loop(evloop, -1) == -EAGAIN);
+            CU_ASSERT(vhd_run_event_loop(evloop, -1) == 0);
+        });
+
+        runner.join();
+        CU_ASSERT(!vhd_in_event_loop(evloop));
+        vhd_free_event_loop(evloop);
+    });
+}
+
+static int count_read(void *opaque)
+{
+    int *count = (int *)opaque;
+    (*count)++;
+    return 0;
+}
+
+static void edge_handler(void)
+{
+    run_with_timeout(30, []() {
+        vhd_event_loop *evloop =
+            vhd_create_event_loop(VHD_EVENT_LOOP_DEFAULT_MAX_EVENTS);
+        CU_ASSERT(evloop != NULL);
+        int efd = eventfd(0, EFD_NONBLOCK);
+        CU_ASSERT_FATAL(efd >= 0);
+
+        std::thread runner([&]() {
+            int count = 0;
+
+            vhd_bh_schedule_oneshot(evloop, nop_bh, NULL);
+            CU_ASSERT(vhd_run_event_loop(evloop, -1) == -EAGAIN);
+            vhd_io_handler *handler =
+                vhd_add_edge_io_handler(evloop, efd, count_read, &count);
+            CU_ASSERT_FATAL(handler != NULL);
+
+            /* called once per signal although the eventfd is never cleared */
+            for (int i = 1; i <= 3; i++) {
+                vhd_set_eventfd(efd);
+                CU_ASSERT(vhd_run_event_loop(evloop, -1) == -EAGAIN);
+                CU_ASSERT(count == i);
+                CU_ASSERT(vhd_run_event_loop(evloop, 0) == -EAGAIN);
+                CU_ASSERT(count == i);
+            }
+
+            CU_ASSERT(vhd_del_io_handler(handler) == 0);
+            vhd_terminate_event_loop(evloop);
+            CU_ASSERT(vhd_run_event_loop(evloop, -1) == -EAGAIN);
+            CU_ASSERT(vhd_run_event_loop(evloop, -1) == 0);
+        });
+
+        runner.join();
+        close(efd);
+        vhd_free_event_loop(evloop);
+    });
+}
+
+static bool fd_readable(int fd)
+{
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    return poll(&pfd, 1, 0) == 1 && (pfd.revents & POLLIN);
+}
+
+static void external_poll(void)
+{
+    run_with_timeout(30, []() {
+        vhd_event_loop *evloop =
+            vhd_create_event_loop(VHD_EVENT_LOOP_DEFAULT_MAX_EVENTS);
+        CU_ASSERT(evloop != NULL);
+        int fd = vhd_event_loop_fd(evloop);
+        int bh_count = 0;
+
+        /* readable while there's a bh pending, whoever scheduled it */
+        CU_ASSERT(!fd_readable(fd));
+        vhd_bh_schedule_oneshot(evloop, bh_counter_bh, &bh_count);
+        CU_ASSERT(fd_readable(fd));
+
+        std::thread runner([&]() {
+            CU_ASSERT(vhd_run_event_loop(evloop, 0) == -EAGAIN);
+            CU_ASSERT(bh_count == 1);
+            CU_ASSERT(!fd_readable(fd));
+
+            vhd_terminate_event_loop(evloop);
+            CU_ASSERT(fd_readable(fd));
+            CU_ASSERT(vhd_run_event_loop(evloop, 0) == -EAGAIN);
+            CU_ASSERT(vhd_run_event_loop(evloop, 0) == 0);
+        });
+
+        runner.join();
+        vhd_free_event_loop(evloop);
+    });
+}
+
+/*
+ * Scheduling a bh from another thread doesn't signal the event loop while
+ * its thread is awake, i.e. between two blocking iterations, as the next one
+ * runs it without blocking anyway.
+ */
+static void awake_notify(void)
+{
+    run_with_timeout(30, []() {
+        vhd_event_loop *evloop =
+            vhd_create_event_loop(VHD_EVENT_LOOP_DEFAULT_MAX_EVENTS);
+        CU_ASSERT(evloop != NULL);
+        int fd = vhd_event_loop_fd(evloop);
+        int bh_count = 0;
+
+        std::thread runner([&]() {
+            vhd_bh_schedule_oneshot(evloop, nop_bh, NULL);
+            CU_ASSERT(vhd_run_event_loop(evloop, -1) == -EAGAIN);
+
+            std::thread([&]() {
+                vhd_bh_schedule_oneshot(evloop, bh_counter_bh, &bh_count);
+            }).join();
+            CU_ASSERT(!fd_readable(fd));
+
+            CU_ASSERT(vhd_run_event_loop(evloop, -1) == -EAGAIN);
+            CU_ASSERT(bh_count == 1);
+
+            /* signaled again once the thread is about to block */
+            std::thread notifier([&]() {
+                usleep(10000);
+                vhd_bh_schedule_oneshot(evloop, bh_counter_bh, &bh_count);
+            });
+            CU_ASSERT(vhd_run_event_loop(evloop, -1) == -EAGAIN);
+            CU_ASSERT(bh_count == 2);
+            notifier.join();
+
+            vhd_terminate_event_loop(evloop);
+            CU_ASSERT(vhd_run_event_loop(evloop, -1) == -EAGAIN);
+            CU_ASSERT(vhd_run_event_loop(evloop, -1) == 0);
+        });
+
+        runner.join();
+        vhd_free_event_loop(evloop);
+    });
+}
+
 int main(void)
 {
     int res = 0;
@@ -99,6 +323,12 @@ int main(void)
     }
 
     CU_ADD_TEST(suite, bh_oneshot);
+    CU_ADD_TEST(suite, cached_time);
+    CU_ADD_TEST(suite, cycles_to_ns);
+    CU_ADD_TEST(suite, home_thread);
+    CU_ADD_TEST(suite, edge_handler);
+    CU_ADD_TEST(suite, external_poll);
+    CU_ADD_TEST(suite, awake_notify);
 
     CU_basic_set_mode(CU_BRM_VERBOSE);
     CU_basic_run_tests();
@@ -0,0 +1,297 @@
+#!/usr/bin/env python3
+"""
+Scaling benchmark of libvhost
+
+Runs test/bench-server with N vhost-user-blk devices over M request queues
+on a null (or ram) backend, spreads the devices over QEMU guests, and loads
+them with fio at various queue depths.  For each configuration reports:
+
+- IOPS and completion latency percentiles as seen by fio in the guests;
+- CPU time and cycles the server's request queue threads spent per I/O,
+  and the server-side per-phase latencies, over the same time window.
+
+Uses the same image, QEMU binary and ssh key as the functional tests:
+  python scale_bench.py --devices 1,4,16 --rqs 1,4 --iodepth 1,32,128
+"""
+
+import argparse
+import itertools
+import json
+import logging
+import os
+import signal
+import subprocess
+import tempfile
+import time
+
+from common import get_abs_path, get_qemu_bin, get_ssh_key
+from qemu import VM, VirtioDisk, FileBackend, VhostUserDisk
+from qemu.disks import VhostUserDiskBackend
+from utils import ImageManager
+
+logger = logging.getLogger(__name__)
+
+# the boot disk takes one of the 16 PCIe root ports of a VM
+MAX_DISKS_PER_VM = 15
+
+FIO_PERCENTILES = ("50.000000", "99.000000", "99.900000")
+
+
+def get_bench_server_binary():
+    return get_abs_path('../bench-server')
+
+
+class BenchServer:
+    """ test/bench-server process serving all the devices """
+
+    def __init__(self, work_dir, devices, rqs, num_queues, backend,
+                 extra_args=()):
+        self.sock_paths = [os.path.join(work_dir, 'bench-{}.sock'.format(i))
+                           for i in range(devices)]
+        self.cmd = [get_bench_server_binary(),
+                    '--socket-dir', work_dir,
+                    '--devices', str(devices),
+                    '--request-queues', str(rqs),
+                    '--num-queues', str(num_queues),
+                    '--backend', backend] + list(extra_args)
+        self._log = open(os.path.join(work_dir, 'bench-server.log'), 'w')
+        self.proc = None
+
+    def start(self):
+        logger.debug('Run bench server: %s', ' '.join(self.cmd))
+        self.proc = subprocess.Popen(self.cmd, stdout=subprocess.PIPE,
+                                     stderr=self._log, text=True)
+        for _ in range(50):
+            if all(os.path.exists(p) for p in self.sock_paths):
+                return
+            if self.proc.poll() is not None:
+                break
+            time.sleep(0.1)
+        raise Exception('bench server failed to start')
+
+    def report(self, sig=signal.SIGUSR1):
+        """ Get the statistics accumulated since the previous report """
+        self.proc.send_signal(sig)
+        return json.loads(self.proc.stdout.readline())
+
+    def stop(self):
+        stats = self.report(signal.SIGINT)
+        self.proc.wait(timeout=30)
+        self.proc = None
+        return stats
+
+
+class BenchDiskBackend(VhostUserDiskBackend):
+    """ A device of the bench server, which is started separately """
+
+    def __init__(self, index, work_dir):
+        super().__init__(binary=None, work_dir=work_dir,
+                         disk_id='bench-{}'.format(index), image=None)
+
+    def start(self):
+        pass
+
+    def check(self):
+        pass
+
+    def stop(self, hard):
+        pass
+
+
+class BenchVM(VM):
+    def __init__(self, index, work_dir, disks):
+        vm_dir = os.path.join(work_dir, 'vm{}'.format(index))
+        os.makedirs(vm_dir, exist_ok=True)
+        super().__init__(get_qemu_bin(), vm_dir, get_ssh_key())
+
+        boot_image = os.path.join(vm_dir, 'boot.qcow2')
+        if not os.path.exists(boot_image):
+            ImageManager().mkimg(boot_image, ImageManager.FEDORA33_IMAGE_ID)
+        self.disk_add(VirtioDisk(FileBackend(disk_id='boot',
+                                             image=boot_image,
+                                             image_type='qcow2'),
+                                 bootable=True, with_iothread=True))
+        self.bench_disks = disks
+        for disk in disks:
+            self.disk_add(disk)
+
+    def start_fio(self, args, iodepth):
+        job = ['[global]',
+               'ioengine=libaio',
+               'direct=1',
+               'rw={}'.format(args.rw),
+               'bs={}'.format(args.bs),
+               'iodepth={}'.format(iodepth),
+               'ramp_time={}'.format(args.ramp),
+               'runtime={}'.format(args.runtime),
+               'time_based=1',
+               'group_reporting=1',
+               'percentile_list={}'.format(
+                   ':'.join(p.rstrip('0').rstrip('.') for p in
+                            FIO_PERCENTILES))]
+        for disk in self.bench_disks:
+            job += ['[{}]'.format(disk.disk_id),
+                    'filename={}'.format(disk.get_guest_path()),
+                    'numjobs={}'.format(args.jobs)]
+
+        self.guest_exec(["echo '{}' > /bench.job".format('\n'.join(job))]) \
+            .check_returncode()
+        self.guest_exec(['fio --output-format=json --output=/bench.json '
+                         '/bench.job >/bench.log 2>&1 &']).check_returncode()
+
+    def wait_fio(self):
+        while self.guest_exec(['pgrep -x fio']).returncode == 0:
+            time.sleep(1)
+        res = self.guest_exec(['cat', '/bench.json'])
+        res.check_returncode()
+        return json.loads(res.stdout)
+
+
+def parse_fio(results):
+    """ Sum up IOPS, take the worst latency percentiles over the VMs """
+    iops = 0.
+    lat = {p: 0 for p in FIO_PERCENTILES}
+    for res in results:
+        for job in res['jobs']:
+            for op in ('read', 'write'):
+                stat = job[op]
+                if not stat['total_ios']:
+                    continue
+                iops += stat['iops']
+                pct = stat['clat_ns'].get('percentile', {})
+                for p in FIO_PERCENTILES:
+                    lat[p] = max(lat[p], pct.get(p, 0))
+    return iops, lat
+
+
+def run_config(args, work_dir, devices, rqs):
+    vms_count = max(args.vms, -(-devices // MAX_DISKS_PER_VM))
+    disks = [VhostUserDisk(BenchDiskBackend(i, work_dir))
+             for i in range(devices)]
+    vms = [BenchVM(i, work_dir, disks[i::vms_count])
+           for i in range(min(vms_count, devices))]
+
+    # QEMU asks for a virtqueue per guest CPU
+    extra_args = []
+    if args.completion_thread:
+        extra_args.append('--completion-thread')
+    if args.zero_reads:
+        extra_args.append('--zero-reads')
+    if args.edge_kicks:
+        extra_args.append('--edge-kicks')
+    server = BenchServer(work_dir, devices, rqs,
+                         int(max(vm.cpu_count for vm in vms)), args.backend,
+                         extra_args)
+    server.start()
+    results = []
+    try:
+        for vm in vms:
+            vm.start()
+
+        for iodepth in args.iodepth:
+            for vm in vms:
+                vm.start_fio(args, iodepth)
+
+            time.sleep(args.ramp + 1)
+            server.report()
+            time.sleep(args.runtime - 2)
+            stats = server.report()
+
+            iops, lat = parse_fio([vm.wait_fio() for vm in vms])
+            reqs = max(stats['requests'], 1)
+            results.append({
+                'devices': devices,
+                'rqs': rqs,
+                'vms': len(vms),
+                'iodepth': iodepth,
+                'iops': iops,
+                'lat_ns': {p.rstrip('0').rstrip('.'): lat[p]
+                           for p in FIO_PERCENTILES},
+                'server_iops': stats['requests'] / (args.runtime - 2),
+                'cpu_ns_per_io': stats['cpu_ns'] / reqs,
+                'cycles_per_io': (stats['cycles'] / reqs
+                                  if stats['cycles'] is not None else None),
+                'server_lat_ns': stats['latency_ns'],
+            })
+            print_result(results[-1])
+    finally:
+        for vm in vms:
+            if vm.proc is not None:
+                vm.kill(hard=True)
+        server.stop()
+
+    return results
+
+
+def print_header():
+    print('{:>7} {:>4} {:>4} {:>7} {:>10} {:>9} {:>9} {:>9} {:>9} {:>9}'
+          .format('devices', 'rqs', 'vms', 'iodepth', 'IOPS', 'p50 us',
+                  'p99 us', 'p99.9 us', 'cpu ns/io', 'cycles/io'))
+
+
+def print_result(r):
+    cycles = ('{:9.0f}'.format(r['cycles_per_io'])
+              if r['cycles_per_io'] is not None else '{:>9}'.format('n/a'))
+    print('{:7} {:4} {:4} {:7} {:10.0f} {:9.1f} {:9.1f} {:9.1f} {:9.0f} {}'
+          .format(r['devices'], r['rqs'], r['vms'], r['iodepth'], r['iops'],
+                  r['lat_ns']['50'] / 1000, r['lat_ns']['99'] / 1000,
+                  r['lat_ns']['99.9'] / 1000, r['cpu_ns_per_io'], cycles),
+          flush=True)
+
+
+def int_list(s):
+    return [int(x) for x in s.split(',')]
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+        formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('--devices', type=int_list, default=[1, 4],
+                        help='comma-separated numbers of devices')
+    parser.add_argument('--rqs', type=int_list, default=[1, 2],
+                        help='comma-separated numbers of request queues')
+    parser.add_argument('--iodepth', type=int_list, default=[1, 32, 128],
+                        help='comma-separated fio queue depths')
+    parser.add_argument('--vms', type=int, default=1,
+                        help='number of guests to spread the devices over')
+    parser.add_argument('--jobs', type=int, default=1,
+                        help='fio jobs per device')
+    parser.add_argument('--rw', default='randread', help='fio rw mode')
+    parser.add_argument('--bs', default='4k', help='fio block size')
+    parser.add_argument('--runtime', type=int, default=30,
+                        help='seconds to measure each configuration')
+    parser.add_argument('--ramp', type=int, default=5,
+                        help='seconds to warm up before measuring')
+    parser.add_argument('--backend', choices=('null', 'ram'), default='null')
+    parser.add_argument('--completion-thread', action='store_true',
+                        help='complete null backend requests in a separate '
+                        'thread rather than inline')
+    parser.add_argument('--zero-reads', action='store_true',
+                        help='make the null backend zero the read buffers')
+    parser.add_argument('--edge-kicks', action='store_true',
+                        help='use edge-triggered guest notifications')
+    parser.add_argument('--work-dir', help='directory for the sockets, '
+                        'images and logs (short, for unix socket paths)')
+    parser.add_argument('--json', help='file to write the results to')
+    parser.add_argument('--verbose', action='store_true')
+    args = parser.parse_args()
+    if args.runtime < 3:
+        parser.error('--runtime must be at least 3 seconds')
+
+    logging.basicConfig(level=logging.DEBUG if args.verbose else
+                        logging.WARNING)
+
+    work_dir = args.work_dir or tempfile.mkdtemp(prefix='vhost-scale-')
+    results = []
+
+    print_header()
+    for devices, rqs in itertools.product(args.devices, args.rqs):
+        results += run_config(args, work_dir, devices, rqs)
+
+    if args.json:
+        with open(args.json, 'w') as f:
+            json.dump(results, f, indent=2)
+
+
+if __name__ == '__main__':
+    main()
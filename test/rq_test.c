@@ -0,0 +1,689 @@
+/*
+ * Request queue tests: the queues are driven directly with bare vrings, the
+ * test playing both the virtqueue side and the backend
+ */
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <CUnit/Basic.h>
+
+#include "bio.h"
+#include "catomic.h"
+#include "platform.h"
+#include "rate_limit.h"
+#include "server_internal.h"
+#include "vdev.h"
+
+struct test_vring {
+    struct vhd_vdev vdev;
+    struct vhd_vring vring;
+    /* only the index is looked at when committing completions */
+    char used[4096];
+};
+
+struct test_bio {
+    struct vhd_bio bio;
+    /* number of cancellations of the vring before the bio was queued */
+    unsigned epoch;
+    atomic_uint handed_out;
+    bool completed;
+    enum vhd_bdev_io_result status;
+    /* position in the order of all completions */
+    unsigned completion_seq;
+};
+
+static unsigned g_completion_seq;
+
+static void test_vring_init(struct test_vring *tv, struct vhd_request_queue *rq)
+{
+    memset(tv, 0, sizeof(*tv));
+    tv->vring.vdev = &tv->vdev;
+    tv->vring.rq = rq;
+    tv->vring.log_tag = "test_vring";
+    tv->vring.started_in_rq = true;
+    tv->vring.vq.used = (void *)tv->used;
+    TAILQ_INIT(&tv->vring.submission);
+}
+
+static void test_bio_complete(struct vhd_bio *bio)
+{
+    struct test_bio *tb = containerof(bio, struct test_bio, bio);
+
+    CU_ASSERT(!tb->completed);
+    tb->completed = true;
+    tb->status = bio->status;
+    tb->completion_seq = g_completion_seq++;
+}
+
+static void test_bio_queue_sectors(struct test_bio *tb, struct test_vring *tv,
+                                   unsigned epoch, uint64_t sectors)
+{
+    memset(tb, 0, sizeof(*tb));
+    tb->epoch = epoch;
+    tb->bio.vring = &tv->vring;
+    tb->bio.completion_handler = test_bio_complete;
+    tb->bio.bdev_io.type = VHD_BDEV_READ;
+    tb->bio.bdev_io.total_sectors = sectors;
+    CU_ASSERT(vhd_enqueue_block_request(tv->vring.rq, &tb->bio) == 0);
+}
+
+static void test_bio_queue(struct test_bio *tb, struct test_vring *tv,
+                           unsigned epoch)
+{
+    test_bio_queue_sectors(tb, tv, epoch, 8);
+}
+
+static struct test_bio *req_to_test_bio(const struct vhd_request *req)
+{
+    struct vhd_bio *bio = containerof(req->bio, struct vhd_bio, bdev_io);
+    return containerof(bio, struct test_bio, bio);
+}
+
+static void nop_bh(void *opaque)
+{
+}
+
+/* Run the queue in the calling thread for one pass, without blocking */
+static void rq_run_once(struct vhd_request_queue *rq)
+{
+    vhd_run_in_rq(rq, nop_bh, NULL);
+    CU_ASSERT(vhd_run_queue(rq) == -EAGAIN);
+}
+
+static void *rq_stop_thread(void *opaque)
+{
+    struct vhd_request_queue *rq = opaque;
+
+    vhd_stop_queue(rq);
+    while (vhd_run_queue(rq) == -EAGAIN) {
+        ;
+    }
+    return NULL;
+}
+
+/* Stop the queue run in another thread, or never run */
+static void rq_stop_elsewhere(struct vhd_request_queue *rq)
+{
+    pthread_t thread;
+
+    pthread_create(&thread, NULL, rq_stop_thread, rq);
+    pthread_join(thread, NULL);
+}
+
+static void *test_thread(void *opaque)
+{
+    void (*test)(void) = opaque;
+
+    test();
+    return NULL;
+}
+
+/*
+ * A thread can only be home to one event loop, so each test runs its request
+ * queues in a thread of its own
+ */
+static void run_in_thread(void (*test)(void))
+{
+    pthread_t thread;
+
+    pthread_create(&thread, NULL, test_thread, test);
+    pthread_join(thread, NULL);
+}
+
+#define SCHED_BIOS 32
+/* the scheduling quantum worth of sectors */
+#define SCHED_BIO_SECTORS 128
+
+/* Dequeue up to @max requests and complete them right away */
+static unsigned dequeue_complete(struct vhd_request_queue *rq,
+                                 struct test_bio **out, unsigned max)
+{
+    struct vhd_request reqs[SCHED_BIOS * 2];
+    unsigned i, n;
+
+    CU_ASSERT_FATAL(max <= SCHED_BIOS * 2);
+    n = vhd_dequeue_requests(rq, reqs, max, NULL);
+    for (i = 0; i < n; i++) {
+        out[i] = req_to_test_bio(&reqs[i]);
+        vhd_complete_bio(reqs[i].bio, VHD_BDEV_SUCCESS);
+    }
+
+    return n;
+}
+
+/*
+ * Deficit round robin serves the vrings in proportion to the weights of
+ * their devices, and the small requests of the priority ones ahead of
+ * everything else
+ */
+static void do_sched_weight_test(void)
+{
+    struct vhd_request_queue *rq = vhd_create_request_queue();
+    struct test_vring tva, tvb, tvp;
+    struct test_bio bios_a[SCHED_BIOS], bios_b[SCHED_BIOS], bios_p[4];
+    struct test_bio *out[SCHED_BIOS * 2];
+    unsigned i, n, num_a = 0, num_b = 0;
+
+    rq_run_once(rq);
+
+    test_vring_init(&tva, rq);
+    test_vring_init(&tvb, rq);
+    test_vring_init(&tvp, rq);
+    atomic_set(&tva.vdev.qos_weight, 1);
+    atomic_set(&tvb.vdev.qos_weight, 3);
+    tvp.vring.sched_priority = true;
+
+    for (i = 0; i < SCHED_BIOS; i++) {
+        test_bio_queue_sectors(&bios_a[i], &tva, 0, SCHED_BIO_SECTORS);
+        test_bio_queue_sectors(&bios_b[i], &tvb, 0, SCHED_BIO_SECTORS);
+    }
+
+    /* one quantum a round for A, three for B */
+    n = dequeue_complete(rq, out, 16);
+    CU_ASSERT_FATAL(n == 16);
+    for (i = 0; i < n; i++) {
+        num_a += out[i]->bio.vring == &tva.vring;
+        num_b += out[i]->bio.vring == &tvb.vring;
+    }
+    CU_ASSERT(num_a == 4);
+    CU_ASSERT(num_b == 12);
+
+    /* a priority vring joining the round is drained first */
+    for (i = 0; i < 4; i++) {
+        test_bio_queue(&bios_p[i], &tvp, 0);
+    }
+    n = dequeue_complete(rq, out, 5);
+    CU_ASSERT_FATAL(n == 5);
+    for (i = 0; i < 4; i++) {
+        CU_ASSERT(out[i] == &bios_p[i]);
+    }
+    CU_ASSERT(out[4]->bio.vring != &tvp.vring);
+
+    /* the rest comes out in order within each vring */
+    n = dequeue_complete(rq, out, SCHED_BIOS * 2);
+    CU_ASSERT(n == SCHED_BIOS * 2 - 17);
+    rq_run_once(rq);
+
+    for (i = 0; i < SCHED_BIOS; i++) {
+        CU_ASSERT(bios_a[i].completed);
+        CU_ASSERT(bios_b[i].completed);
+    }
+    CU_ASSERT(tva.vring.num_in_flight == 0);
+    CU_ASSERT(tvb.vring.num_in_flight == 0);
+    CU_ASSERT(tvp.vring.num_in_flight == 0);
+
+    vhd_stop_queue(rq);
+    while (vhd_run_queue(rq) == -EAGAIN) {
+        ;
+    }
+    vhd_release_request_queue(rq);
+}
+
+/*
+ * A priority vring gets a quantum worth of requests served as it joins the
+ * round, but a flood of them doesn't starve the other vrings
+ */
+static void do_sched_priority_flood_test(void)
+{
+    struct vhd_request_queue *rq = vhd_create_request_queue();
+    struct test_vring tva, tvp;
+    struct test_bio bios_a[SCHED_BIOS], bios_p[SCHED_BIOS];
+    struct test_bio *out[SCHED_BIOS * 2];
+    unsigned i, n, num_a = 0;
+
+    rq_run_once(rq);
+
+    test_vring_init(&tva, rq);
+    test_vring_init(&tvp, rq);
+    tvp.vring.sched_priority = true;
+
+    for (i = 0; i < SCHED_BIOS; i++) {
+        test_bio_queue_sectors(&bios_a[i], &tva, 0, SCHED_BIO_SECTORS);
+    }
+    for (i = 0; i < SCHED_BIOS; i++) {
+        test_bio_queue_sectors(&bios_p[i], &tvp, 0, SCHED_BIO_SECTORS);
+    }
+
+    /*
+     * The priority vring goes first, and then has its turn ahead of the
+     * other one, after which they alternate
+     */
+    n = dequeue_complete(rq, out, 8);
+    CU_ASSERT_FATAL(n == 8);
+    CU_ASSERT(out[0]->bio.vring == &tvp.vring);
+    for (i = 0; i < n; i++) {
+        num_a += out[i]->bio.vring == &tva.vring;
+    }
+    CU_ASSERT(num_a == 3);
+
+    n = dequeue_complete(rq, out, SCHED_BIOS * 2);
+    CU_ASSERT(n == SCHED_BIOS * 2 - 8);
+    rq_run_once(rq);
+
+    for (i = 0; i < SCHED_BIOS; i++) {
+        CU_ASSERT(bios_a[i].completed);
+        CU_ASSERT(bios_p[i].completed);
+    }
+
+    vhd_stop_queue(rq);
+    while (vhd_run_queue(rq) == -EAGAIN) {
+        ;
+    }
+    vhd_release_request_queue(rq);
+}
+
+/*
+ * A device over its rate limit has its vrings held back until the limiter
+ * admits more, without holding back the others, and the queue sleeps no
+ * longer than that
+ */
+static void do_sched_rate_limit_test(void)
+{
+    struct vhd_request_queue *rq = vhd_create_request_queue();
+    struct test_vring tva, tvb;
+    struct test_bio bios_a[SCHED_BIOS], bios_b[SCHED_BIOS];
+    struct test_bio *out[SCHED_BIOS * 2];
+    unsigned i, n, num_a = 0, num_b = 0;
+    int timeout_ms;
+
+    rq_run_once(rq);
+
+    test_vring_init(&tva, rq);
+    test_vring_init(&tvb, rq);
+    /* 1000 IOPS with a burst of 10: one more every millisecond after that */
+    vhd_rate_limit_set(&tva.vdev.iops_limit, 1000, 10);
+
+    for (i = 0; i < SCHED_BIOS; i++) {
+        test_bio_queue(&bios_a[i], &tva, 0);
+        test_bio_queue(&bios_b[i], &tvb, 0);
+    }
+
+    /* the iteration time doesn't move while dequeueing */
+    n = dequeue_complete(rq, out, SCHED_BIOS * 2);
+    for (i = 0; i < n; i++) {
+        num_a += out[i]->bio.vring == &tva.vring;
+        num_b += out[i]->bio.vring == &tvb.vring;
+    }
+    CU_ASSERT(num_a == 11);
+    CU_ASSERT(num_b == SCHED_BIOS);
+    CU_ASSERT(!bios_a[11].completed);
+
+    timeout_ms = vhd_get_queue_timeout_ms(rq);
+    CU_ASSERT(timeout_ms >= 0 && timeout_ms <= 1);
+
+    /* the queue wakes up by itself once the limiter has room */
+    CU_ASSERT(vhd_run_queue(rq) == -EAGAIN);
+    n = dequeue_complete(rq, out, SCHED_BIOS * 2);
+    CU_ASSERT(n >= 1);
+    for (i = 0; i < n; i++) {
+        CU_ASSERT(out[i]->bio.vring == &tva.vring);
+    }
+    num_a += n;
+
+    /* lifting the limit lets the rest through at the next wakeup */
+    vhd_rate_limit_set(&tva.vdev.iops_limit, 0, 0);
+    CU_ASSERT(vhd_run_queue(rq) == -EAGAIN);
+    num_a += dequeue_complete(rq, out, SCHED_BIOS * 2);
+    CU_ASSERT(num_a == SCHED_BIOS);
+    rq_run_once(rq);
+
+    for (i = 0; i < SCHED_BIOS; i++) {
+        CU_ASSERT(bios_a[i].completed);
+    }
+    CU_ASSERT(tva.vring.num_in_flight == 0);
+    CU_ASSERT(vhd_get_queue_timeout_ms(rq) == -1);
+
+    vhd_stop_queue(rq);
+    while (vhd_run_queue(rq) == -EAGAIN) {
+        ;
+    }
+    vhd_release_request_queue(rq);
+}
+
+/*
+ * The requests shared in the steal ring are canceled along with the queued
+ * ones of their vring; those of the other vrings stay queued, in order
+ */
+static void do_steal_cancel_test(void)
+{
+    struct vhd_request_queue *rqs[2] = {
+        vhd_create_request_queue(),
+        vhd_create_request_queue(),
+    };
+    struct vhd_rq_group *group = vhd_create_rq_group(rqs, 2);
+    struct test_vring tva, tvb;
+    struct test_bio bios_a[4], bios_b[4];
+    struct vhd_request reqs[8];
+    unsigned i, n, num_canceled = 0;
+
+    CU_ASSERT_FATAL(group != NULL);
+    rq_run_once(rqs[0]);
+
+    test_vring_init(&tva, rqs[0]);
+    test_vring_init(&tvb, rqs[0]);
+    for (i = 0; i < 4; i++) {
+        test_bio_queue(&bios_a[i], &tva, 0);
+        test_bio_queue(&bios_b[i], &tvb, 0);
+    }
+
+    /* an idle sibling makes the busy queue share what it leaves over */
+    CU_ASSERT(vhd_dequeue_group_requests(rqs[1], reqs, 1, NULL) == 0);
+    CU_ASSERT(vhd_dequeue_group_requests(rqs[0], reqs, 1, NULL) == 1);
+    CU_ASSERT(req_to_test_bio(&reqs[0]) == &bios_a[0]);
+
+    vhd_cancel_queued_requests(rqs[0], &tva.vring);
+    for (i = 1; i < 4; i++) {
+        CU_ASSERT(bios_a[i].completed);
+        CU_ASSERT(bios_a[i].status == VHD_BDEV_CANCELED);
+        num_canceled += bios_a[i].completed;
+    }
+    CU_ASSERT(num_canceled == 3);
+    CU_ASSERT(tva.vring.num_in_flight == 1);
+
+    /* nothing is left for the sibling to take */
+    CU_ASSERT(vhd_dequeue_group_requests(rqs[1], reqs, 8, NULL) == 0);
+    n = vhd_dequeue_group_requests(rqs[0], reqs, 8, NULL);
+    CU_ASSERT_FATAL(n == 4);
+    for (i = 0; i < n; i++) {
+        CU_ASSERT(req_to_test_bio(&reqs[i]) == &bios_b[i]);
+        vhd_complete_bio(reqs[i].bio, VHD_BDEV_SUCCESS);
+    }
+    vhd_complete_bio(&bios_a[0].bio.bdev_io, VHD_BDEV_SUCCESS);
+    rq_run_once(rqs[0]);
+
+    CU_ASSERT(bios_a[0].completed && bios_a[0].status == VHD_BDEV_SUCCESS);
+    CU_ASSERT(tva.vring.num_in_flight == 0);
+    CU_ASSERT(tvb.vring.num_in_flight == 0);
+
+    vhd_release_rq_group(group);
+    vhd_stop_queue(rqs[0]);
+    while (vhd_run_queue(rqs[0]) == -EAGAIN) {
+        ;
+    }
+    rq_stop_elsewhere(rqs[1]);
+    vhd_release_request_queue(rqs[0]);
+    vhd_release_request_queue(rqs[1]);
+}
+
+#define STEAL_ROUNDS        2000
+#define STEAL_BIOS_PER_ROUND 8
+
+struct steal_ctx {
+    struct vhd_request_queue *rq;
+    /* number of cancellations of vring A completed */
+    atomic_uint cancel_gen;
+    atomic_bool started;
+    atomic_bool stop;
+
+    pthread_mutex_t lock;
+    struct test_bio **taken;
+    unsigned num_taken;
+    unsigned num_late;
+};
+
+static void *steal_thread(void *opaque)
+{
+    struct steal_ctx *ctx = opaque;
+    struct vhd_request reqs[4];
+    unsigned i, n;
+
+    while (!atomic_load_acquire(&ctx->stop)) {
+        /* taken from the ring after this, a request can't be that old */
+        unsigned gen = atomic_load_acquire(&ctx->cancel_gen);
+
+        n = vhd_dequeue_group_requests(ctx->rq, reqs, 4, NULL);
+
+        pthread_mutex_lock(&ctx->lock);
+        for (i = 0; i < n; i++) {
+            struct test_bio *tb = req_to_test_bio(&reqs[i]);
+
+            atomic_inc(&tb->handed_out);
+            if (tb->bio.vring->log_tag[0] == 'A' && tb->epoch < gen) {
+                ctx->num_late++;
+            }
+            ctx->taken[ctx->num_taken++] = tb;
+        }
+        pthread_mutex_unlock(&ctx->lock);
+
+        atomic_store_release(&ctx->started, true);
+        if (!n) {
+            sched_yield();
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * A sibling taking the shared requests concurrently never gets those of a
+ * vring whose queued requests have been canceled, and every request is
+ * either handed out or canceled exactly once
+ */
+static void do_steal_concurrent_test(void)
+{
+    const unsigned num_bios = STEAL_ROUNDS * STEAL_BIOS_PER_ROUND;
+    struct vhd_request_queue *rqs[2] = {
+        vhd_create_request_queue(),
+        vhd_create_request_queue(),
+    };
+    struct vhd_rq_group *group = vhd_create_rq_group(rqs, 2);
+    struct test_vring tva, tvb;
+    struct test_bio *bios = vhd_calloc(num_bios, sizeof(bios[0]));
+    struct test_bio **own = vhd_calloc(num_bios, sizeof(own[0]));
+    struct steal_ctx ctx = {
+        .rq = rqs[1],
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .taken = vhd_calloc(num_bios, sizeof(ctx.taken[0])),
+    };
+    struct vhd_request reqs[2];
+    unsigned round, i, n, num_own = 0;
+    pthread_t thread;
+
+    CU_ASSERT_FATAL(group != NULL);
+    rq_run_once(rqs[0]);
+
+    test_vring_init(&tva, rqs[0]);
+    test_vring_init(&tvb, rqs[0]);
+    tva.vring.log_tag = "A";
+    tvb.vring.log_tag = "B";
+
+    pthread_create(&thread, NULL, steal_thread, &ctx);
+    while (!atomic_load_acquire(&ctx.started)) {
+        sched_yield();
+    }
+
+    for (round = 0; round < STEAL_ROUNDS; round++) {
+        unsigned gen = atomic_read(&ctx.cancel_gen);
+
+        for (i = 0; i < STEAL_BIOS_PER_ROUND; i++) {
+            struct test_bio *tb = &bios[round * STEAL_BIOS_PER_ROUND + i];
+            test_bio_queue(tb, i % 2 ? &tvb : &tva, gen);
+        }
+
+        n = vhd_dequeue_group_requests(rqs[0], reqs, 2, NULL);
+        for (i = 0; i < n; i++) {
+            own[num_own] = req_to_test_bio(&reqs[i]);
+            atomic_inc(&own[num_own++]->handed_out);
+        }
+
+        if (round % 3 == 2) {
+            vhd_cancel_queued_requests(rqs[0], &tva.vring);
+            atomic_store_release(&ctx.cancel_gen, gen + 1);
+        }
+
+        /* give the sibling a chance on a single cpu, too */
+        sched_yield();
+    }
+
+    /* leave the rest for whoever gets them */
+    vhd_cancel_queued_requests(rqs[0], &tva.vring);
+    atomic_store_release(&ctx.cancel_gen, atomic_read(&ctx.cancel_gen) + 1);
+    do {
+        n = vhd_dequeue_group_requests(rqs[0], reqs, 2, NULL);
+        for (i = 0; i < n; i++) {
+            own[num_own] = req_to_test_bio(&reqs[i]);
+            atomic_inc(&own[num_own++]->handed_out);
+        }
+    } while (n);
+
+    atomic_store_release(&ctx.stop, true);
+    pthread_join(thread, NULL);
+
+    CU_ASSERT(ctx.num_late == 0);
+    for (i = 0; i < num_bios; i++) {
+        CU_ASSERT(atomic_read(&bios[i].handed_out) + bios[i].completed == 1);
+    }
+
+    for (i = 0; i < num_own; i++) {
+        vhd_complete_bio(&own[i]->bio.bdev_io, VHD_BDEV_SUCCESS);
+    }
+    for (i = 0; i < ctx.num_taken; i++) {
+        vhd_complete_bio(&ctx.taken[i]->bio.bdev_io, VHD_BDEV_SUCCESS);
+    }
+    rq_run_once(rqs[0]);
+
+    CU_ASSERT(num_own + ctx.num_taken < num_bios);
+    CU_ASSERT(ctx.num_taken > 0);
+    CU_ASSERT(tva.vring.num_in_flight == 0);
+    CU_ASSERT(tvb.vring.num_in_flight == 0);
+    for (i = 0; i < num_bios; i++) {
+        CU_ASSERT(bios[i].completed);
+    }
+
+    vhd_release_rq_group(group);
+    vhd_stop_queue(rqs[0]);
+    while (vhd_run_queue(rqs[0]) == -EAGAIN) {
+        ;
+    }
+    rq_stop_elsewhere(rqs[1]);
+    vhd_release_request_queue(rqs[0]);
+    vhd_release_request_queue(rqs[1]);
+    vhd_free(ctx.taken);
+    vhd_free(own);
+    vhd_free(bios);
+}
+
+#define ORDER_BIOS 8
+
+static void *complete_order_thread(void *opaque)
+{
+    struct test_bio *bios = opaque;
+    struct vhd_bdev_io *bdev_ios[ORDER_BIOS];
+    enum vhd_bdev_io_result statuses[ORDER_BIOS] = {};
+    unsigned i;
+
+    for (i = 0; i < ORDER_BIOS; i++) {
+        bdev_ios[i] = &bios[i].bio.bdev_io;
+    }
+
+    vhd_complete_bio(bdev_ios[0], VHD_BDEV_SUCCESS);
+    vhd_complete_bios(&bdev_ios[1], statuses, 3);
+    vhd_complete_bio(bdev_ios[4], VHD_BDEV_SUCCESS);
+    vhd_complete_bios(&bdev_ios[5], statuses, 2);
+    vhd_complete_bio(bdev_ios[7], VHD_BDEV_SUCCESS);
+    return NULL;
+}
+
+/*
+ * The requests completed in another thread are handed over to the request
+ * queue in the order they complete in, whether one by one or in batches
+ */
+static void do_completion_order_test(void)
+{
+    struct vhd_request_queue *rq = vhd_create_request_queue();
+    struct test_vring tv;
+    struct test_bio bios[ORDER_BIOS];
+    struct vhd_request reqs[ORDER_BIOS];
+    pthread_t thread;
+    unsigned i, first_seq;
+
+    rq_run_once(rq);
+    test_vring_init(&tv, rq);
+
+    for (i = 0; i < ORDER_BIOS; i++) {
+        test_bio_queue(&bios[i], &tv, 0);
+    }
+    CU_ASSERT_FATAL(vhd_dequeue_requests(rq, reqs, ORDER_BIOS, NULL) ==
+                    ORDER_BIOS);
+
+    pthread_create(&thread, NULL, complete_order_thread, bios);
+    pthread_join(thread, NULL);
+    rq_run_once(rq);
+
+    first_seq = bios[0].completion_seq;
+    for (i = 0; i < ORDER_BIOS; i++) {
+        CU_ASSERT(bios[i].completed);
+        CU_ASSERT(bios[i].completion_seq == first_seq + i);
+    }
+    CU_ASSERT(tv.vring.num_in_flight == 0);
+
+    vhd_stop_queue(rq);
+    while (vhd_run_queue(rq) == -EAGAIN) {
+        ;
+    }
+    vhd_release_request_queue(rq);
+}
+
+static void sched_weight_test(void)
+{
+    run_in_thread(do_sched_weight_test);
+}
+
+static void sched_priority_flood_test(void)
+{
+    run_in_thread(do_sched_priority_flood_test);
+}
+
+static void completion_order_test(void)
+{
+    run_in_thread(do_completion_order_test);
+}
+
+static void sched_rate_limit_test(void)
+{
+    run_in_thread(do_sched_rate_limit_test);
+}
+
+static void steal_cancel_test(void)
+{
+    run_in_thread(do_steal_cancel_test);
+}
+
+static void steal_concurrent_test(void)
+{
+    run_in_thread(do_steal_concurrent_test);
+}
+
+int main(void)
+{
+    int res = 0;
+    CU_pSuite suite = NULL;
+
+    if (CUE_SUCCESS != CU_initialize_registry()) {
+        return CU_get_error();
+    }
+
+    suite = CU_add_suite("rq_test", NULL, NULL);
+    if (NULL == suite) {
+        CU_cleanup_registry();
+        return CU_get_error();
+    }
+
+    CU_ADD_TEST(suite, completion_order_test);
+    CU_ADD_TEST(suite, sched_weight_test);
+    CU_ADD_TEST(suite, sched_priority_flood_test);
+    CU_ADD_TEST(suite, sched_rate_limit_test);
+    CU_ADD_TEST(suite, steal_cancel_test);
+    CU_ADD_TEST(suite, steal_concurrent_test);
+
+    CU_basic_set_mode(CU_BRM_VERBOSE);
+    CU_basic_run_tests();
+
+    res = CU_get_error() || CU_get_number_of_tests_failed();
+    CU_cleanup_registry();
+
+    return res;
+}
@@ -0,0 +1,286 @@
+#define _GNU_SOURCE 1
+
+#include <stdio.h>
+#include <errno.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <signal.h>
+
+#include "vhost/server.h"
+#include "vhost/blockdev.h"
+#include "vhost/uring.h"
+#include "test_utils.h"
+#include "platform.h"
+
+#define URING_QUEUE_LEN 128
+
+#define DIE(fmt, ...)                              \
+do {                                               \
+    vhd_log_stderr(LOG_ERROR, fmt, ##__VA_ARGS__); \
+    exit(EXIT_FAILURE);                            \
+} while (0)
+
+/*
+ * Configuration used for backend initialization.
+ */
+struct backend_config {
+    const char *socket_path;
+    const char *serial;
+    const char *blk_file;
+    bool readonly;
+};
+
+/*
+ * File block backend running on top of io_uring.
+ */
+struct backend {
+    struct vhd_vdev *handler;
+    struct vhd_bdev_info info;
+    struct vhd_request_queue *rq;
+    struct vhd_uring *ur;
+    int fd;
+};
+
+static int map_cb(void *addr, size_t len, void *priv)
+{
+    struct backend *bdev = priv;
+    return vhd_uring_register_buffer(bdev->ur, addr, len);
+}
+
+static int unmap_cb(void *addr, size_t len, void *priv)
+{
+    struct backend *bdev = priv;
+    return vhd_uring_unregister_buffer(bdev->ur, addr, len);
+}
+
+/*
+ * Request queue thread: dequeue everything the devices have enqueued, post it
+ * to io_uring in a single submission, and reap io_uring completions in the
+ * request queue event loop.
+ */
+static void *io_handle(void *opaque)
+{
+    struct backend *bdev = opaque;
+
+    while (true) {
+        struct vhd_request req;
+
+        int ret = vhd_run_queue(bdev->rq);
+        if (ret != -EAGAIN) {
+            if (ret < 0) {
+                vhd_log_stderr(LOG_ERROR, "vhd_run_queue error: %d", ret);
+            }
+            break;
+        }
+
+        while (vhd_dequeue_request(bdev->rq, &req)) {
+            vhd_uring_queue_bio(bdev->ur, bdev->fd, req.bio);
+        }
+        vhd_uring_submit(bdev->ur);
+    }
+
+    return NULL;
+}
+
+/*
+ * Prepare backend before server starts.
+ */
+static int init_backend(struct backend *bdev, const struct backend_config *conf)
+{
+    off64_t file_len;
+    int flags = (conf->readonly ? O_RDONLY : O_RDWR) | O_DIRECT;
+
+    bdev->fd = open(conf->blk_file, flags);
+    if (bdev->fd < 0) {
+        int ret = errno;
+        vhd_log_stderr(LOG_ERROR, "open: %s", strerror(ret));
+        return -ret;
+    }
+
+    file_len = lseek(bdev->fd, 0, SEEK_END);
+    if (file_len % VHD_SECTOR_SIZE != 0) {
+        vhd_log_stderr(LOG_WARNING,
+                       "File size is not a multiple of the block size");
+        vhd_log_stderr(LOG_WARNING,
+                       "Last %d bytes will not be accessible",
+                       file_len % VHD_SECTOR_SIZE);
+    }
+
+    bdev->info.socket_path = conf->socket_path;
+    bdev->info.serial = conf->serial;
+    bdev->info.block_size = VHD_SECTOR_SIZE;
+    bdev->info.num_queues = 256; /* Max count of virtio queues */
+    bdev->info.total_blocks = file_len / VHD_SECTOR_SIZE;
+    bdev->info.map_cb = map_cb;
+    bdev->info.unmap_cb = unmap_cb;
+    bdev->info.readonly = conf->readonly;
+    /* vhd_uring only does single-range discard and write zeroes */
+    bdev->info.writeback_cache = true;
+    bdev->info.max_discard_sectors = UINT32_MAX;
+    bdev->info.max_write_zeroes_sectors = UINT32_MAX;
+
+    return 0;
+}
+
+/*
+ * Show usage message.
+ */
+static void usage(const char *cmd)
+{
+    printf("Usage: %s -s SOCKPATH -b FILEPATH -i SERIAL\n", cmd);
+    printf("Start vhost daemon with io_uring backend.\n");
+    printf("\n");
+    printf("Mandatory arguments to long options "
+           "are mandatory for short options too.\n");
+    printf("  -s, --socket-path=PATH  vhost-user Unix domain socket path\n");
+    printf("  -i, --serial=STRING     disk serial\n");
+    printf("  -b, --blk-file=PATH     block device or file path\n");
+    printf("  -r, --readonly          readonly block device\n");
+}
+
+/*
+ * Parse command line options.
+ */
+static void parse_opts(int argc, char **argv, struct backend_config *conf)
+{
+    int opt;
+    do {
+        static struct option long_options[] = {
+            {"socket-path",    1, NULL, 's'},
+            {"serial",         1, NULL, 'i'},
+            {"blk-file",       1, NULL, 'b'},
+            {"readonly",       0, NULL, 'r'},
+            {0, 0, 0, 0}
+        };
+
+        opt = getopt_long(argc, argv, "s:i:b:r", long_options, NULL);
+
+        switch (opt) {
+        case -1:
+            break;
+        case 's':
+            conf->socket_path = optarg;
+            break;
+        case 'i':
+            conf->serial = optarg;
+            break;
+        case 'b':
+            conf->blk_file = optarg;
+            break;
+        case 'r':
+            conf->readonly = true;
+            break;
+        default:
+            usage(argv[0]);
+            exit(2);
+        }
+    } while (opt != -1);
+}
+
+static void notify_event(void *opaque)
+{
+    int *fd = (int *) opaque;
+
+    while (eventfd_write(*fd, 1) && errno == EINTR) {
+        ;
+    }
+}
+
+static void wait_event(int fd)
+{
+    eventfd_t unused;
+
+    while (eventfd_read(fd, &unused) && errno == EINTR) {
+        ;
+    }
+}
+
+/*
+ * Main execution thread. Used for initializing and common management.
+ */
+int main(int argc, char **argv)
+{
+    struct backend bdev = {};
+    pthread_t rq_thread;
+    struct backend_config conf = {};
+    sigset_t sigset;
+    int sig, unreg_done_fd;
+
+    parse_opts(argc, argv, &conf);
+
+    if (!conf.socket_path || !conf.blk_file || !conf.serial) {
+        usage(argv[0]);
+        DIE("Invalid command line options");
+    }
+
+    if (init_backend(&bdev, &conf) < 0) {
+        DIE("init_backend failed");
+    }
+
+    bdev.rq = vhd_create_request_queue();
+    if (!bdev.rq) {
+        DIE("vhd_create_request_queue failed");
+    }
+
+    bdev.ur = vhd_uring_new(bdev.rq, URING_QUEUE_LEN);
+    if (!bdev.ur) {
+        DIE("vhd_uring_new failed");
+    }
+
+    if (vhd_start_vhost_server(vhd_log_stderr) < 0) {
+        DIE("vhd_start_vhost_server failed");
+    }
+
+    bdev.handler = vhd_register_blockdev(&bdev.info, bdev.rq, &bdev);
+    if (!bdev.handler) {
+        DIE("vhd_register_blockdev: Can't register device");
+    }
+
+    /* tune the signal to block on waiting for "stop server" command */
+    sigemptyset(&sigset);
+    sigaddset(&sigset, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &sigset, NULL);
+
+    vhd_log_stderr(LOG_INFO, "Test server started");
+
+    /* start libvhost request queue runner thread */
+    pthread_create(&rq_thread, NULL, io_handle, &bdev);
+
+    /* wait for signal to stop the server (Ctrl+C) */
+    sigwait(&sigset, &sig);
+
+    vhd_log_stderr(LOG_INFO, "Stopping the server");
+
+    /* 1. Unregister the blockdev and wait until it's done */
+    unreg_done_fd = eventfd(0, 0);
+    if (unreg_done_fd == -1) {
+        DIE("eventfd creation failed");
+    }
+    vhd_unregister_blockdev(bdev.handler, notify_event, &unreg_done_fd);
+    wait_event(unreg_done_fd);
+
+    /* 2. Stop the request queue and wait for its thread to join */
+    vhd_stop_queue(bdev.rq);
+    pthread_join(rq_thread, NULL);
+
+    /*
+     * 3. Release io_uring, the request queue and stop the vhost server; no
+     * requests are in flight once the device is unregistered
+     */
+    vhd_uring_free(bdev.ur);
+    vhd_release_request_queue(bdev.rq);
+    vhd_stop_vhost_server();
+
+    close(bdev.fd);
+
+    vhd_log_stderr(LOG_INFO, "Server has been stopped.");
+
+    return 0;
+}
@@ -0,0 +1,1525 @@
+/*
+ * vhost-user device tests: the devices are registered with the library in
+ * this process, and driven over their sockets by a minimal in-process master
+ * acting as QEMU and the guest driver at once, with a single split virtqueue
+ * of virtio-blk reads in a memfd for the guest memory.
+ */
+
+#define _GNU_SOURCE 1
+
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <linux/userfaultfd.h>
+
+#include <CUnit/Basic.h>
+
+#include "vhost/blockdev.h"
+#include "vhost/fs.h"
+#include "vhost/server.h"
+#include "vhost_spec.h"
+#include "virtio/virtio_spec.h"
+#include "virtio/virtio_blk_spec.h"
+#include "catomic.h"
+#include "memmap.h"
+#include "platform.h"
+#include "test_utils.h"
+#include "vdev.h"
+
+#define TEST_QSZ            64
+#define TEST_DEPTH          16
+#define TEST_BLOCK_SIZE     4096
+#define TEST_DESCS_PER_REQ  3
+#define TEST_TIMEOUT_MS     5000
+
+static char g_socket_dir[32];
+
+/*
+ * Master side
+ */
+
+struct test_master {
+    int sock;
+    uint64_t protocol_features;
+
+    void *mem;
+    size_t mem_size;
+    int mem_fd;
+
+    struct virtq_desc *desc;
+    struct virtq_avail *avail;
+    struct virtq_used *used;
+    uint64_t desc_gpa;
+    uint64_t avail_gpa;
+    uint64_t used_gpa;
+    uint64_t hdr_gpa;
+    uint64_t status_gpa;
+    uint64_t data_gpa;
+
+    int kickfd;
+    int callfd;
+
+    uint16_t avail_idx;
+    uint16_t used_idx;
+};
+
+static void *master_gpa_ptr(struct test_master *m, uint64_t gpa)
+{
+    return (char *)m->mem + gpa;
+}
+
+static void master_send(struct test_master *m, uint32_t req, bool need_ack,
+                        const void *payload, uint32_t size,
+                        const int *fds, size_t num_fds)
+{
+    struct vhost_user_msg_hdr hdr = {
+        .req = req,
+        .flags = VHOST_USER_MSG_VERSION |
+            (need_ack ? VHOST_USER_MSG_FLAGS_REPLY_ACK : 0),
+        .size = size,
+    };
+    struct iovec iov[2] = {
+        { .iov_base = &hdr, .iov_len = sizeof(hdr) },
+        { .iov_base = (void *)payload, .iov_len = size },
+    };
+    char control[CMSG_SPACE(sizeof(int) * VHOST_USER_MAX_FDS)] = {};
+    struct msghdr msgh = {
+        .msg_iov = iov,
+        .msg_iovlen = size ? 2 : 1,
+    };
+    ssize_t ret;
+
+    if (num_fds) {
+        struct cmsghdr *cmsg;
+
+        msgh.msg_control = control;
+        msgh.msg_controllen = CMSG_SPACE(sizeof(int) * num_fds);
+        cmsg = CMSG_FIRSTHDR(&msgh);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * num_fds);
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * num_fds);
+    }
+
+    ret = sendmsg(m->sock, &msgh, MSG_NOSIGNAL);
+    CU_ASSERT_FATAL(ret == (ssize_t)(sizeof(hdr) + size));
+}
+
+/* Receive the reply to @req, along with the fd passed, or -1, if @fd is set */
+static void master_recv_fd(struct test_master *m, uint32_t req, void *payload,
+                           uint32_t size, int *fd)
+{
+    struct vhost_user_msg_hdr hdr;
+    union vhost_user_msg_payload buf;
+    struct iovec iov = { .iov_base = &hdr, .iov_len = sizeof(hdr) };
+    char control[CMSG_SPACE(sizeof(int))] = {};
+    struct msghdr msgh = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control,
+        .msg_controllen = sizeof(control),
+    };
+    struct cmsghdr *cmsg;
+
+    CU_ASSERT_FATAL(recvmsg(m->sock, &msgh, MSG_WAITALL | MSG_CMSG_CLOEXEC) ==
+                    sizeof(hdr));
+    CU_ASSERT_FATAL(hdr.req == req);
+    CU_ASSERT_FATAL(hdr.flags & VHOST_USER_MSG_FLAGS_REPLY);
+    CU_ASSERT_FATAL(hdr.size >= size && hdr.size <= sizeof(buf));
+    /* an empty read would wait for more data */
+    CU_ASSERT_FATAL(!hdr.size ||
+                    recv(m->sock, &buf, hdr.size, MSG_WAITALL) == hdr.size);
+    memcpy(payload, &buf, size);
+
+    cmsg = CMSG_FIRSTHDR(&msgh);
+    if (fd) {
+        *fd = -1;
+        if (cmsg && cmsg->cmsg_type == SCM_RIGHTS) {
+            memcpy(fd, CMSG_DATA(cmsg), sizeof(*fd));
+        }
+    } else {
+        CU_ASSERT_FATAL(!cmsg);
+    }
+}
+
+static void master_recv(struct test_master *m, uint32_t req, void *payload,
+                        uint32_t size)
+{
+    master_recv_fd(m, req, payload, size, NULL);
+}
+
+static uint64_t master_get_u64(struct test_master *m, uint32_t req)
+{
+    uint64_t val;
+
+    master_send(m, req, false, NULL, 0, NULL, 0);
+    master_recv(m, req, &val, sizeof(val));
+    return val;
+}
+
+/* Send a message and return the device's acknowledgement of it */
+static uint64_t master_set(struct test_master *m, uint32_t req,
+                           const void *payload, uint32_t size,
+                           const int *fds, size_t num_fds)
+{
+    uint64_t ack;
+
+    master_send(m, req, true, payload, size, fds, num_fds);
+    master_recv(m, req, &ack, sizeof(ack));
+    return ack;
+}
+
+static uint64_t master_set_u64(struct test_master *m, uint32_t req,
+                               uint64_t val, int fd)
+{
+    return master_set(m, req, &val, sizeof(val), &fd, fd >= 0);
+}
+
+static void test_socket_path(char *path, size_t size, const char *name)
+{
+    snprintf(path, size, "%s/%s.sock", g_socket_dir, name);
+}
+
+/*
+ * Connect and negotiate the features up to the memory table: VERSION_1 and
+ * the protocol features in @protocol_features on top of REPLY_ACK, which the
+ * master relies on
+ */
+static void master_connect(struct test_master *m, const char *path,
+                           uint64_t protocol_features)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    uint64_t features;
+
+    memset(m, 0, sizeof(*m));
+    m->kickfd = -1;
+    m->callfd = -1;
+    m->mem_fd = -1;
+
+    strcpy(addr.sun_path, path);
+    m->sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    CU_ASSERT_FATAL(m->sock >= 0);
+    CU_ASSERT_FATAL(connect(m->sock, (struct sockaddr *)&addr,
+                            sizeof(addr)) == 0);
+
+    features = master_get_u64(m, VHOST_USER_GET_FEATURES);
+    CU_ASSERT_FATAL(features & (1ull << VHOST_USER_F_PROTOCOL_FEATURES));
+
+    protocol_features |= 1ull << VHOST_USER_PROTOCOL_F_REPLY_ACK;
+    CU_ASSERT_FATAL((master_get_u64(m, VHOST_USER_GET_PROTOCOL_FEATURES) &
+                     protocol_features) == protocol_features);
+    master_send(m, VHOST_USER_SET_PROTOCOL_FEATURES, false,
+                &protocol_features, sizeof(protocol_features), NULL, 0);
+    m->protocol_features = protocol_features;
+
+    CU_ASSERT_FATAL(master_set(m, VHOST_USER_SET_OWNER, NULL, 0,
+                               NULL, 0) == 0);
+    CU_ASSERT_FATAL(master_set_u64(m, VHOST_USER_SET_FEATURES,
+                                   1ull << VIRTIO_F_VERSION_1, -1) == 0);
+}
+
+/* Lay out the virtqueue and TEST_DEPTH request slots in the guest memory */
+static void master_alloc_memory(struct test_master *m)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    uint64_t off = 0;
+    unsigned r;
+
+    m->desc_gpa = off;
+    off += sizeof(struct virtq_desc) * TEST_QSZ;
+    m->avail_gpa = off;
+    off += sizeof(struct virtq_avail) + sizeof(uint16_t) * (TEST_QSZ + 1);
+    off = VHD_ALIGN_UP(off, 4);
+    m->used_gpa = off;
+    off += sizeof(struct virtq_used) +
+        sizeof(struct virtq_used_elem) * TEST_QSZ + sizeof(uint16_t);
+    off = VHD_ALIGN_UP(off, 16);
+    m->hdr_gpa = off;
+    off += sizeof(struct virtio_blk_req_hdr) * TEST_DEPTH;
+    m->status_gpa = off;
+    off += TEST_DEPTH;
+    off = VHD_ALIGN_UP(off, page);
+    m->data_gpa = off;
+    off += TEST_BLOCK_SIZE * TEST_DEPTH;
+    m->mem_size = VHD_ALIGN_UP(off, page);
+
+    m->mem_fd = memfd_create("vdev_test", MFD_CLOEXEC);
+    CU_ASSERT_FATAL(m->mem_fd >= 0);
+    CU_ASSERT_FATAL(ftruncate(m->mem_fd, m->mem_size) == 0);
+    m->mem = mmap(NULL, m->mem_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                  m->mem_fd, 0);
+    CU_ASSERT_FATAL(m->mem != MAP_FAILED);
+
+    m->desc = master_gpa_ptr(m, m->desc_gpa);
+    m->avail = master_gpa_ptr(m, m->avail_gpa);
+    m->used = master_gpa_ptr(m, m->used_gpa);
+
+    for (r = 0; r < TEST_DEPTH; r++) {
+        struct virtq_desc *chain = m->desc + r * TEST_DESCS_PER_REQ;
+        uint16_t head = r * TEST_DESCS_PER_REQ;
+
+        chain[0] = (struct virtq_desc) {
+            .addr = m->hdr_gpa + sizeof(struct virtio_blk_req_hdr) * r,
+            .len = sizeof(struct virtio_blk_req_hdr),
+            .flags = VIRTQ_DESC_F_NEXT,
+            .next = head + 1,
+        };
+        chain[1] = (struct virtq_desc) {
+            .addr = m->data_gpa + TEST_BLOCK_SIZE * r,
+            .len = TEST_BLOCK_SIZE,
+            .flags = VIRTQ_DESC_F_NEXT | VIRTQ_DESC_F_WRITE,
+            .next = head + 2,
+        };
+        chain[2] = (struct virtq_desc) {
+            .addr = m->status_gpa + r,
+            .len = 1,
+            .flags = VIRTQ_DESC_F_WRITE,
+        };
+    }
+}
+
+static struct vhost_user_mem_desc master_mem_desc(struct test_master *m)
+{
+    struct vhost_user_mem_desc desc = { .nregions = 1 };
+
+    desc.regions[0] = (struct vhost_user_mem_region) {
+        .guest_addr = 0,
+        .size = m->mem_size,
+        .user_addr = (uintptr_t)m->mem,
+        .mmap_offset = 0,
+    };
+    return desc;
+}
+
+#define MEM_DESC_SIZE \
+    (offsetof(struct vhost_user_mem_desc, regions) + \
+     sizeof(struct vhost_user_mem_region))
+
+static void master_setup_memory(struct test_master *m)
+{
+    struct vhost_user_mem_desc desc;
+
+    master_alloc_memory(m);
+    desc = master_mem_desc(m);
+    CU_ASSERT_FATAL(master_set(m, VHOST_USER_SET_MEM_TABLE, &desc,
+                               MEM_DESC_SIZE, &m->mem_fd, 1) == 0);
+}
+
+static void master_start_queue(struct test_master *m)
+{
+    struct vhost_user_vring_state num = { .index = 0, .num = TEST_QSZ };
+    struct vhost_user_vring_state base = { .index = 0, .num = 0 };
+    struct vhost_user_vring_addr addr = {
+        .index = 0,
+        .desc_addr = (uintptr_t)m->desc,
+        .used_addr = (uintptr_t)m->used,
+        .avail_addr = (uintptr_t)m->avail,
+        .used_gpa_base = m->used_gpa,
+    };
+
+    m->kickfd = eventfd(0, EFD_CLOEXEC);
+    m->callfd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    CU_ASSERT_FATAL(m->kickfd >= 0 && m->callfd >= 0);
+
+    CU_ASSERT_FATAL(master_set(m, VHOST_USER_SET_VRING_NUM, &num,
+                               sizeof(num), NULL, 0) == 0);
+    CU_ASSERT_FATAL(master_set(m, VHOST_USER_SET_VRING_BASE, &base,
+                               sizeof(base), NULL, 0) == 0);
+    CU_ASSERT_FATAL(master_set(m, VHOST_USER_SET_VRING_ADDR, &addr,
+                               sizeof(addr), NULL, 0) == 0);
+    CU_ASSERT_FATAL(master_set_u64(m, VHOST_USER_SET_VRING_CALL, 0,
+                                   m->callfd) == 0);
+    CU_ASSERT_FATAL(master_set_u64(m, VHOST_USER_SET_VRING_KICK, 0,
+                                   m->kickfd) == 0);
+}
+
+/* Stop the virtqueue and return where the device stopped in the avail ring */
+static uint16_t master_stop_queue(struct test_master *m)
+{
+    struct vhost_user_vring_state state = { .index = 0 };
+
+    master_send(m, VHOST_USER_GET_VRING_BASE, false, &state, sizeof(state),
+                NULL, 0);
+    master_recv(m, VHOST_USER_GET_VRING_BASE, &state, sizeof(state));
+    return state.num;
+}
+
+/* Put a read of @len bytes at @sector on the avail ring, not published yet */
+static void master_queue_read(struct test_master *m, uint64_t sector,
+                              uint32_t len)
+{
+    unsigned slot = m->avail_idx % TEST_DEPTH;
+    struct virtio_blk_req_hdr *hdr = master_gpa_ptr(m, m->hdr_gpa) +
+        sizeof(*hdr) * slot;
+    uint8_t *status = master_gpa_ptr(m, m->status_gpa + slot);
+
+    CU_ASSERT_FATAL((uint16_t)(m->avail_idx - m->used_idx) < TEST_DEPTH);
+    CU_ASSERT_FATAL(len <= TEST_BLOCK_SIZE);
+
+    *hdr = (struct virtio_blk_req_hdr) {
+        .type = VIRTIO_BLK_T_IN,
+        .sector = sector,
+    };
+    *status = 0xff;
+    m->desc[slot * TEST_DESCS_PER_REQ + 1].len = len;
+    m->avail->ring[m->avail_idx % TEST_QSZ] = slot * TEST_DESCS_PER_REQ;
+    m->avail_idx++;
+}
+
+/* Publish the requests put on the avail ring and kick the device */
+static void master_kick(struct test_master *m)
+{
+    atomic_store_release(&m->avail->idx, m->avail_idx);
+    eventfd_write(m->kickfd, 1);
+}
+
+/* Submit @n reads, all of them in flight at once, and kick the device */
+static void master_submit(struct test_master *m, unsigned n)
+{
+    unsigned i;
+
+    CU_ASSERT_FATAL((uint16_t)(m->avail_idx - m->used_idx) + n <= TEST_DEPTH);
+
+    for (i = 0; i < n; i++) {
+        master_queue_read(m, m->avail_idx, TEST_BLOCK_SIZE);
+    }
+    master_kick(m);
+}
+
+static uint16_t master_used_idx(struct test_master *m)
+{
+    return atomic_load_acquire(&m->used->idx);
+}
+
+/* Wait for @n more requests to be completed successfully */
+static bool master_wait_used(struct test_master *m, unsigned n)
+{
+    unsigned i;
+
+    for (i = 0; i < TEST_TIMEOUT_MS; i++) {
+        if ((uint16_t)(master_used_idx(m) - m->used_idx) >= n) {
+            break;
+        }
+        usleep(1000);
+    }
+    if ((uint16_t)(master_used_idx(m) - m->used_idx) != n) {
+        return false;
+    }
+
+    for (i = 0; i < n; i++) {
+        struct virtq_used_elem *elem = &m->used->ring[m->used_idx % TEST_QSZ];
+        unsigned slot = elem->id / TEST_DESCS_PER_REQ;
+
+        CU_ASSERT(*(uint8_t *)master_gpa_ptr(m, m->status_gpa + slot) ==
+                  VIRTIO_BLK_S_OK);
+        m->used_idx++;
+    }
+    return true;
+}
+
+static void master_close(struct test_master *m)
+{
+    close(m->sock);
+    if (m->kickfd >= 0) {
+        close(m->kickfd);
+    }
+    if (m->callfd >= 0) {
+        close(m->callfd);
+    }
+    if (m->mem) {
+        munmap(m->mem, m->mem_size);
+    }
+    if (m->mem_fd >= 0) {
+        close(m->mem_fd);
+    }
+}
+
+/*
+ * Device side: a request queue thread completing the requests right away,
+ * unless told to hold them for the test to complete
+ */
+
+struct test_backend {
+    struct vhd_request_queue *rq;
+    pthread_t thread;
+
+    pthread_mutex_t lock;
+    bool hold;
+    struct vhd_request held[TEST_DEPTH * 2];
+    unsigned num_held;
+};
+
+struct test_dev {
+    struct vhd_bdev_info info;
+    char socket_path[PATH_MAX];
+    struct vhd_vdev *vdev;
+    atomic_uint num_requests;
+};
+
+static void *backend_thread(void *opaque)
+{
+    struct test_backend *be = opaque;
+    struct vhd_request req;
+
+    while (vhd_run_queue(be->rq) == -EAGAIN) {
+        while (vhd_dequeue_request(be->rq, &req)) {
+            struct test_dev *dev = vhd_vdev_get_priv(req.vdev);
+
+            atomic_inc(&dev->num_requests);
+
+            pthread_mutex_lock(&be->lock);
+            if (be->hold) {
+                be->held[be->num_held++] = req;
+                req.bio = NULL;
+            }
+            pthread_mutex_unlock(&be->lock);
+
+            if (req.bio) {
+                vhd_complete_bio(req.bio, VHD_BDEV_SUCCESS);
+            }
+        }
+    }
+
+    return NULL;
+}
+
+static void backend_start(struct test_backend *be)
+{
+    memset(be, 0, sizeof(*be));
+    pthread_mutex_init(&be->lock, NULL);
+    be->rq = vhd_create_request_queue();
+    CU_ASSERT_FATAL(be->rq != NULL);
+    pthread_create(&be->thread, NULL, backend_thread, be);
+}
+
+static void backend_stop(struct test_backend *be)
+{
+    CU_ASSERT(be->num_held == 0);
+    vhd_stop_queue(be->rq);
+    pthread_join(be->thread, NULL);
+    vhd_release_request_queue(be->rq);
+    pthread_mutex_destroy(&be->lock);
+}
+
+static void backend_set_hold(struct test_backend *be, bool hold)
+{
+    pthread_mutex_lock(&be->lock);
+    be->hold = hold;
+    pthread_mutex_unlock(&be->lock);
+}
+
+static unsigned backend_num_held(struct test_backend *be)
+{
+    unsigned n;
+
+    pthread_mutex_lock(&be->lock);
+    n = be->num_held;
+    pthread_mutex_unlock(&be->lock);
+    return n;
+}
+
+static bool backend_wait_held(struct test_backend *be, unsigned n)
+{
+    unsigned i;
+
+    for (i = 0; i < TEST_TIMEOUT_MS && backend_num_held(be) < n; i++) {
+        usleep(1000);
+    }
+    return backend_num_held(be) == n;
+}
+
+static void backend_complete_held(struct test_backend *be)
+{
+    unsigned i;
+
+    pthread_mutex_lock(&be->lock);
+    for (i = 0; i < be->num_held; i++) {
+        vhd_complete_bio(be->held[i].bio, VHD_BDEV_SUCCESS);
+    }
+    be->num_held = 0;
+    pthread_mutex_unlock(&be->lock);
+}
+
+static void test_dev_init(struct test_dev *dev, const char *name)
+{
+    memset(dev, 0, sizeof(*dev));
+    test_socket_path(dev->socket_path, sizeof(dev->socket_path), name);
+    dev->info = (struct vhd_bdev_info) {
+        .serial = name,
+        .socket_path = dev->socket_path,
+        .block_size = VHD_SECTOR_SIZE,
+        .num_queues = 1,
+        .total_blocks = 1 << 20,
+    };
+}
+
+static void notify_done(void *opaque)
+{
+    eventfd_write(*(int *)opaque, 1);
+}
+
+static void test_dev_unregister(struct test_dev *dev)
+{
+    int done_fd = eventfd(0, EFD_CLOEXEC);
+    eventfd_t val;
+
+    vhd_unregister_blockdev(dev->vdev, notify_done, &done_fd);
+    eventfd_read(done_fd, &val);
+    close(done_fd);
+    dev->vdev = NULL;
+    unlink(dev->socket_path);
+}
+
+/*
+ * Live handover
+ */
+
+struct handover_ctx {
+    struct test_dev *dev;
+    int sock;
+    int done_fd;
+    int ret;
+    atomic_bool sent;
+};
+
+static void *handover_send_thread(void *opaque)
+{
+    struct handover_ctx *ctx = opaque;
+
+    ctx->ret = vhd_handover_blockdev(ctx->dev->vdev, ctx->sock, notify_done,
+                                     &ctx->done_fd);
+    atomic_store_release(&ctx->sent, true);
+    return NULL;
+}
+
+/*
+ * A started device handed over with requests in flight waits for them to
+ * complete, and resumes in the receiving end where it left off: the client
+ * connection and the negotiated state are kept, the requests published
+ * meanwhile are picked up, and the avail ring position carries over
+ */
+static void handover_test(void)
+{
+    struct test_backend be;
+    struct test_dev dev_old, dev_new;
+    struct test_master m;
+    struct handover_ctx ctx;
+    struct vhd_request_queue *rqs[1];
+    pthread_t send_thread;
+    uint64_t features, protocol_features;
+    int sv[2];
+    eventfd_t val;
+
+    backend_start(&be);
+    rqs[0] = be.rq;
+
+    test_dev_init(&dev_old, "handover");
+    dev_old.vdev = vhd_register_blockdev(&dev_old.info, be.rq, &dev_old);
+    CU_ASSERT_FATAL(dev_old.vdev != NULL);
+
+    master_connect(&m, dev_old.socket_path,
+                   1ull << VHOST_USER_PROTOCOL_F_CONFIG);
+    master_setup_memory(&m);
+    master_start_queue(&m);
+
+    backend_set_hold(&be, true);
+    master_submit(&m, 4);
+    CU_ASSERT_FATAL(backend_wait_held(&be, 4));
+    features = dev_old.vdev->negotiated_features;
+    protocol_features = dev_old.vdev->negotiated_protocol_features;
+
+    CU_ASSERT_FATAL(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0,
+                               sv) == 0);
+    ctx = (struct handover_ctx) {
+        .dev = &dev_old,
+        .sock = sv[0],
+        .done_fd = eventfd(0, EFD_CLOEXEC),
+    };
+    pthread_create(&send_thread, NULL, handover_send_thread, &ctx);
+
+    /*
+     * The state isn't sent while requests are in flight; those published
+     * meanwhile are left for the receiving end
+     */
+    usleep(50000);
+    CU_ASSERT(!atomic_load_acquire(&ctx.sent));
+    master_submit(&m, 2);
+    usleep(10000);
+    CU_ASSERT(backend_num_held(&be) == 4);
+    backend_set_hold(&be, false);
+    backend_complete_held(&be);
+
+    /* the receiving end reads the state as it's sent */
+    dev_new = dev_old;
+    dev_new.info.socket_path = dev_new.socket_path;
+    atomic_set(&dev_new.num_requests, 0);
+    dev_new.vdev = vhd_register_blockdev_handover(&dev_new.info, rqs, 1,
+                                                  &dev_new, sv[1]);
+    pthread_join(send_thread, NULL);
+    CU_ASSERT(ctx.ret == 0);
+    CU_ASSERT_FATAL(dev_new.vdev != NULL);
+    eventfd_read(ctx.done_fd, &val);
+    close(ctx.done_fd);
+    close(sv[0]);
+    close(sv[1]);
+
+    CU_ASSERT(master_wait_used(&m, 6));
+    CU_ASSERT(dev_new.vdev->negotiated_features == features);
+    CU_ASSERT(dev_new.vdev->negotiated_protocol_features ==
+              protocol_features);
+
+    /* the new process serves the requests over the same connection */
+    master_submit(&m, 4);
+    CU_ASSERT(master_wait_used(&m, 4));
+    CU_ASSERT(atomic_read(&dev_old.num_requests) == 4);
+    CU_ASSERT(atomic_read(&dev_new.num_requests) == 6);
+    CU_ASSERT(master_stop_queue(&m) == 10);
+
+    test_dev_unregister(&dev_new);
+    master_close(&m);
+    backend_stop(&be);
+}
+
+/*
+ * Stopping undrained
+ */
+
+struct fence_ctx {
+    struct test_backend *be;
+    atomic_uint num_calls;
+    uint32_t queue_num;
+    unsigned num_fenced;
+};
+
+static void fence_cb(struct vhd_vdev *vdev, uint32_t queue_num, void *opaque)
+{
+    struct fence_ctx *ctx = opaque;
+    unsigned i;
+
+    ctx->queue_num = queue_num;
+    pthread_mutex_lock(&ctx->be->lock);
+    for (i = 0; i < ctx->be->num_held; i++) {
+        ctx->num_fenced += vhd_bdev_io_fenced(ctx->be->held[i].bio);
+    }
+    pthread_mutex_unlock(&ctx->be->lock);
+    atomic_inc(&ctx->num_calls);
+}
+
+/* Share an inflight region for the virtqueue with the device */
+static void master_setup_inflight(struct test_master *m)
+{
+    struct vhost_user_inflight_desc idesc = {
+        .num_queues = 1,
+        .queue_size = TEST_QSZ,
+    };
+    int fd;
+
+    master_send(m, VHOST_USER_GET_INFLIGHT_FD, false, &idesc, sizeof(idesc),
+                NULL, 0);
+    master_recv_fd(m, VHOST_USER_GET_INFLIGHT_FD, &idesc, sizeof(idesc), &fd);
+    CU_ASSERT_FATAL(fd >= 0);
+    idesc.num_queues = 1;
+    idesc.queue_size = TEST_QSZ;
+    CU_ASSERT_FATAL(master_set(m, VHOST_USER_SET_INFLIGHT_FD, &idesc,
+                               sizeof(idesc), &fd, 1) == 0);
+    close(fd);
+}
+
+/*
+ * A virtqueue stopped undrained reports the base rewound by the requests
+ * outstanding in the backend, and has the backend notified to fence them off:
+ * they are told stale, and their completions don't reach the guest
+ */
+static void undrained_stop_test(void)
+{
+    struct test_backend be;
+    struct test_dev dev;
+    struct test_master m;
+    struct fence_ctx ctx = {};
+    unsigned i;
+
+    backend_start(&be);
+    ctx.be = &be;
+    test_dev_init(&dev, "undrained");
+    dev.vdev = vhd_register_blockdev(&dev.info, be.rq, &dev);
+    CU_ASSERT_FATAL(dev.vdev != NULL);
+    vhd_vdev_set_fence_cb(dev.vdev, fence_cb, &ctx);
+    vhd_vdev_set_stop_undrained(dev.vdev, true);
+
+    master_connect(&m, dev.socket_path,
+                   1ull << VHOST_USER_PROTOCOL_F_INFLIGHT_SHMFD);
+    master_setup_inflight(&m);
+    master_setup_memory(&m);
+    master_start_queue(&m);
+
+    backend_set_hold(&be, true);
+    master_submit(&m, 4);
+    CU_ASSERT_FATAL(backend_wait_held(&be, 4));
+    for (i = 0; i < 4; i++) {
+        CU_ASSERT(!vhd_bdev_io_fenced(be.held[i].bio));
+    }
+
+    /* replied to with the requests still held */
+    CU_ASSERT(master_stop_queue(&m) == 0);
+    CU_ASSERT(atomic_load_acquire(&ctx.num_calls) == 1);
+    CU_ASSERT(ctx.queue_num == 0);
+    CU_ASSERT(ctx.num_fenced == 4);
+
+    /* the backend holds them back and fails them instead */
+    backend_set_hold(&be, false);
+    pthread_mutex_lock(&be.lock);
+    for (i = 0; i < be.num_held; i++) {
+        CU_ASSERT(vhd_bdev_io_fenced(be.held[i].bio));
+        vhd_complete_bio(be.held[i].bio, VHD_BDEV_IOERR);
+    }
+    be.num_held = 0;
+    pthread_mutex_unlock(&be.lock);
+    usleep(10000);
+    CU_ASSERT(master_used_idx(&m) == 0);
+
+    master_close(&m);
+    test_dev_unregister(&dev);
+    backend_stop(&be);
+}
+
+/*
+ * I/O statistics
+ */
+
+/*
+ * The request shapes are accounted per request submitted to the backend, the
+ * split parts separately, while a request is counted as sequential as the
+ * guest submitted it, the split ones once
+ */
+static void io_stat_test(void)
+{
+    struct test_backend be;
+    struct test_dev dev;
+    struct test_master m;
+    struct vhd_vq_io_stat stat;
+    struct vhd_vq_op_stat *rd = &stat.ops[VHD_REQ_OP_READ];
+
+    backend_start(&be);
+    test_dev_init(&dev, "iostat");
+    dev.info.split_boundary_sectors = 8;
+    dev.vdev = vhd_register_blockdev(&dev.info, be.rq, &dev);
+    CU_ASSERT_FATAL(dev.vdev != NULL);
+
+    master_connect(&m, dev.socket_path, 0);
+    master_setup_memory(&m);
+    master_start_queue(&m);
+
+    /* sector 0 is where the stream starts, keep off it */
+    master_queue_read(&m, 64, 8 * VHD_SECTOR_SIZE);
+    master_queue_read(&m, 72, 8 * VHD_SECTOR_SIZE);
+    /* split into 84-88 and 88-92 */
+    master_queue_read(&m, 84, 8 * VHD_SECTOR_SIZE);
+    master_queue_read(&m, 92, 4 * VHD_SECTOR_SIZE);
+    master_kick(&m);
+    CU_ASSERT_FATAL(master_wait_used(&m, 4));
+    CU_ASSERT(atomic_read(&dev.num_requests) == 5);
+
+    CU_ASSERT_FATAL(vhd_vdev_get_queue_io_stat(dev.vdev, 0, &stat) == 0);
+    CU_ASSERT(rd->sequential == 2);
+    CU_ASSERT(rd->size_hist[3] == 2);
+    CU_ASSERT(rd->size_hist[2] == 3);
+    CU_ASSERT(rd->segments_hist[0] == 5);
+    CU_ASSERT(rd->align_hist[6] == 1);
+    CU_ASSERT(rd->align_hist[3] == 2);
+    CU_ASSERT(rd->align_hist[2] == 2);
+    CU_ASSERT(stat.ops[VHD_REQ_OP_WRITE].sequential == 0);
+
+    master_stop_queue(&m);
+    test_dev_unregister(&dev);
+    master_close(&m);
+    backend_stop(&be);
+}
+
+/*
+ * Memory slots
+ */
+
+/* Region at @gpa of the master's guest memory, @size bytes long */
+static struct vhost_user_mem_reg master_mem_reg(struct test_master *m,
+                                                uint64_t gpa, uint64_t size)
+{
+    return (struct vhost_user_mem_reg) {
+        .region = {
+            .guest_addr = gpa,
+            .size = size,
+            .user_addr = (uintptr_t)master_gpa_ptr(m, gpa),
+            .mmap_offset = gpa,
+        },
+    };
+}
+
+static uint64_t master_mem_reg_msg(struct test_master *m, uint32_t req,
+                                   const struct vhost_user_mem_reg *mem_reg,
+                                   int fd)
+{
+    return master_set(m, req, mem_reg, sizeof(*mem_reg), &fd, fd >= 0);
+}
+
+/*
+ * The device fails the message by dropping the connection, rather than
+ * replying to it
+ */
+static bool master_mem_reg_rejected(struct test_master *m, uint32_t req,
+                                    const struct vhost_user_mem_reg *mem_reg,
+                                    int fd)
+{
+    struct vhost_user_msg_hdr hdr;
+
+    master_send(m, req, true, mem_reg, sizeof(*mem_reg), &fd, fd >= 0);
+    return recv(m->sock, &hdr, sizeof(hdr), MSG_WAITALL) == 0;
+}
+
+static void mem_slots_connect(struct test_master *m, const char *path)
+{
+    master_connect(m, path,
+                   1ull << VHOST_USER_PROTOCOL_F_CONFIGURE_MEM_SLOTS);
+    master_alloc_memory(m);
+}
+
+/*
+ * The guest memory is added one region at a time, the rings and the request
+ * headers in one, the data buffers in the other.  A removed region is only
+ * unmapped once the requests in flight to it are completed.
+ */
+static void mem_reg_test(void)
+{
+    struct test_backend be;
+    struct test_dev dev;
+    struct test_master m;
+    struct vhost_user_mem_reg rings, data;
+    char *buf;
+    size_t page = sysconf(_SC_PAGESIZE);
+    unsigned i;
+
+    backend_start(&be);
+    test_dev_init(&dev, "memreg");
+    dev.vdev = vhd_register_blockdev(&dev.info, be.rq, &dev);
+    CU_ASSERT_FATAL(dev.vdev != NULL);
+
+    mem_slots_connect(&m, dev.socket_path);
+    CU_ASSERT(master_get_u64(&m, VHOST_USER_GET_MAX_MEM_SLOTS) ==
+              VHD_RAM_SLOTS_MAX);
+
+    rings = master_mem_reg(&m, 0, m.data_gpa);
+    data = master_mem_reg(&m, m.data_gpa, m.mem_size - m.data_gpa);
+    CU_ASSERT_FATAL(master_mem_reg_msg(&m, VHOST_USER_ADD_MEM_REG, &rings,
+                                       m.mem_fd) == 0);
+    CU_ASSERT_FATAL(master_mem_reg_msg(&m, VHOST_USER_ADD_MEM_REG, &data,
+                                       m.mem_fd) == 0);
+    master_start_queue(&m);
+
+    master_submit(&m, 2);
+    CU_ASSERT_FATAL(master_wait_used(&m, 2));
+
+    backend_set_hold(&be, true);
+    master_submit(&m, 1);
+    CU_ASSERT_FATAL(backend_wait_held(&be, 1));
+    buf = be.held[0].bio->sglist.buffers[0].base;
+
+    /* removed from under the request in flight, the fd isn't needed */
+    CU_ASSERT(master_mem_reg_msg(&m, VHOST_USER_REM_MEM_REG, &data, -1) == 0);
+
+    /* still mapped to the guest memory */
+    memset(buf, 0x5a, TEST_BLOCK_SIZE);
+    CU_ASSERT(*(char *)master_gpa_ptr(&m, m.data_gpa + TEST_BLOCK_SIZE * 2) ==
+              0x5a);
+
+    backend_set_hold(&be, false);
+    backend_complete_held(&be);
+    CU_ASSERT(master_wait_used(&m, 1));
+
+    /* and unmapped once the request is completed */
+    buf = (char *)((uintptr_t)buf & ~(page - 1));
+    for (i = 0; i < TEST_TIMEOUT_MS; i++) {
+        if (msync(buf, page, MS_ASYNC) < 0 && errno == ENOMEM) {
+            break;
+        }
+        usleep(1000);
+    }
+    CU_ASSERT(i < TEST_TIMEOUT_MS);
+
+    master_stop_queue(&m);
+    master_close(&m);
+    test_dev_unregister(&dev);
+    backend_stop(&be);
+}
+
+/*
+ * Regions that can't be added or removed fail the message: ones never added,
+ * overlapping the existing ones, or past the slot limit
+ */
+static void mem_reg_reject_test(void)
+{
+    struct test_backend be;
+    struct test_dev dev;
+    struct test_master m;
+    struct vhost_user_mem_reg rings, data, reg;
+    size_t page = sysconf(_SC_PAGESIZE);
+    unsigned i;
+
+    backend_start(&be);
+    test_dev_init(&dev, "memregrej");
+    dev.vdev = vhd_register_blockdev(&dev.info, be.rq, &dev);
+    CU_ASSERT_FATAL(dev.vdev != NULL);
+
+    /* nothing to remove from */
+    mem_slots_connect(&m, dev.socket_path);
+    rings = master_mem_reg(&m, 0, m.data_gpa);
+    data = master_mem_reg(&m, m.data_gpa, m.mem_size - m.data_gpa);
+    CU_ASSERT(master_mem_reg_rejected(&m, VHOST_USER_REM_MEM_REG, &rings, -1));
+    master_close(&m);
+
+    /* removing a region that was never added */
+    mem_slots_connect(&m, dev.socket_path);
+    CU_ASSERT_FATAL(master_mem_reg_msg(&m, VHOST_USER_ADD_MEM_REG, &rings,
+                                       m.mem_fd) == 0);
+    CU_ASSERT(master_mem_reg_rejected(&m, VHOST_USER_REM_MEM_REG, &data, -1));
+    master_close(&m);
+
+    /* overlapping in guest physical addresses, and in master's addresses */
+    mem_slots_connect(&m, dev.socket_path);
+    CU_ASSERT_FATAL(master_mem_reg_msg(&m, VHOST_USER_ADD_MEM_REG, &rings,
+                                       m.mem_fd) == 0);
+    reg = data;
+    reg.region.guest_addr -= page;
+    CU_ASSERT(master_mem_reg_rejected(&m, VHOST_USER_ADD_MEM_REG, &reg,
+                                      m.mem_fd));
+    master_close(&m);
+
+    mem_slots_connect(&m, dev.socket_path);
+    CU_ASSERT_FATAL(master_mem_reg_msg(&m, VHOST_USER_ADD_MEM_REG, &rings,
+                                       m.mem_fd) == 0);
+    reg = data;
+    reg.region.user_addr -= page;
+    CU_ASSERT(master_mem_reg_rejected(&m, VHOST_USER_ADD_MEM_REG, &reg,
+                                      m.mem_fd));
+    master_close(&m);
+
+    /* a page per slot, all of them backed by the same one */
+    mem_slots_connect(&m, dev.socket_path);
+    reg = master_mem_reg(&m, 0, page);
+    reg.region.mmap_offset = 0;
+    for (i = 0; i < VHD_RAM_SLOTS_MAX; i++) {
+        CU_ASSERT_FATAL(master_mem_reg_msg(&m, VHOST_USER_ADD_MEM_REG, &reg,
+                                           m.mem_fd) == 0);
+        reg.region.guest_addr += page;
+        reg.region.user_addr += page;
+    }
+    CU_ASSERT(master_mem_reg_rejected(&m, VHOST_USER_ADD_MEM_REG, &reg,
+                                      m.mem_fd));
+    master_close(&m);
+
+    /* the slots are freed by removing regions */
+    mem_slots_connect(&m, dev.socket_path);
+    reg = master_mem_reg(&m, 0, page);
+    reg.region.mmap_offset = 0;
+    for (i = 0; i < VHD_RAM_SLOTS_MAX; i++) {
+        CU_ASSERT_FATAL(master_mem_reg_msg(&m, VHOST_USER_ADD_MEM_REG, &reg,
+                                           m.mem_fd) == 0);
+        reg.region.guest_addr += page;
+        reg.region.user_addr += page;
+    }
+    reg = master_mem_reg(&m, 0, page);
+    reg.region.mmap_offset = 0;
+    CU_ASSERT(master_mem_reg_msg(&m, VHOST_USER_REM_MEM_REG, &reg, -1) == 0);
+    reg.region.guest_addr = VHD_RAM_SLOTS_MAX * page;
+    reg.region.user_addr += VHD_RAM_SLOTS_MAX * page;
+    CU_ASSERT(master_mem_reg_msg(&m, VHOST_USER_ADD_MEM_REG, &reg,
+                                 m.mem_fd) == 0);
+    master_close(&m);
+
+    test_dev_unregister(&dev);
+    backend_stop(&be);
+}
+
+/*
+ * Slave channel
+ */
+
+/* Receive a slave request with the fd passed along, if any */
+static int slave_recv(int sock, struct vhost_user_msg_hdr *hdr,
+                      struct vhost_user_fs_slave_msg *msg, int *fd)
+{
+    struct iovec iov = { .iov_base = hdr, .iov_len = sizeof(*hdr) };
+    char control[CMSG_SPACE(sizeof(int))] = {};
+    struct msghdr msgh = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control,
+        .msg_controllen = sizeof(control),
+    };
+    struct cmsghdr *cmsg;
+
+    *fd = -1;
+    if (recvmsg(sock, &msgh, MSG_CMSG_CLOEXEC) != sizeof(*hdr) ||
+        hdr->size != sizeof(*msg) ||
+        recv(sock, msg, sizeof(*msg), MSG_WAITALL) != sizeof(*msg)) {
+        return -1;
+    }
+
+    cmsg = CMSG_FIRSTHDR(&msgh);
+    if (cmsg && cmsg->cmsg_type == SCM_RIGHTS) {
+        memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+    }
+    return 0;
+}
+
+static void slave_reply(int sock, const struct vhost_user_msg_hdr *req,
+                        uint64_t val)
+{
+    struct vhost_user_msg_hdr hdr = {
+        .req = req->req,
+        .flags = VHOST_USER_MSG_FLAGS_REPLY,
+        .size = sizeof(val),
+    };
+
+    CU_ASSERT(send(sock, &hdr, sizeof(hdr), MSG_NOSIGNAL) == sizeof(hdr));
+    CU_ASSERT(send(sock, &val, sizeof(val), MSG_NOSIGNAL) == sizeof(val));
+}
+
+#define FS_CACHE_SIZE   (1ull << 20)
+#define FS_NUM_EXTENTS  (VHOST_USER_FS_SLAVE_ENTRIES + 2)
+
+struct fs_map_ctx {
+    struct vhd_vdev *vdev;
+    int fd;
+    const struct vhd_fs_map_extent *extents;
+    size_t count;
+    int ret;
+};
+
+static void *fs_map_thread(void *opaque)
+{
+    struct fs_map_ctx *ctx = opaque;
+
+    ctx->ret = ctx->fd >= 0 ?
+        vhd_fs_map(ctx->vdev, ctx->fd, ctx->extents, ctx->count) :
+        vhd_fs_unmap(ctx->vdev, ctx->extents, ctx->count);
+    return NULL;
+}
+
+static bool join_timeout(pthread_t thread)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += TEST_TIMEOUT_MS / 1000;
+    return pthread_timedjoin_np(thread, NULL, &ts) == 0;
+}
+
+/*
+ * vhd_fs_map() and vhd_fs_unmap() go over the slave channel in batches of
+ * the message capacity, with the client's acknowledgement or failure passed
+ * back, and the ones waiting for replies on a disconnected client fail rather
+ * than hold up the control thread
+ */
+static void fs_map_test(void)
+{
+    struct test_backend be;
+    struct vhd_fsdev_info info;
+    char socket_path[PATH_MAX];
+    struct vhd_vdev *vdev;
+    struct test_master m;
+    struct vhd_fs_map_extent extents[FS_NUM_EXTENTS];
+    struct vhost_user_msg_hdr hdr;
+    struct vhost_user_fs_slave_msg msg;
+    struct fs_map_ctx ctx;
+    pthread_t thread;
+    int file_fd, sv[2], fd, done_fd;
+    eventfd_t val;
+    unsigned i, j;
+
+    backend_start(&be);
+    test_socket_path(socket_path, sizeof(socket_path), "fs");
+    info = (struct vhd_fsdev_info) {
+        .socket_path = socket_path,
+        .tag = "fs",
+        .num_queues = 2,
+        .cache_size = FS_CACHE_SIZE,
+    };
+    vdev = vhd_register_fs(&info, be.rq, NULL);
+    CU_ASSERT_FATAL(vdev != NULL);
+
+    file_fd = memfd_create("fs_map_test", MFD_CLOEXEC);
+    CU_ASSERT_FATAL(file_fd >= 0);
+    for (i = 0; i < FS_NUM_EXTENTS; i++) {
+        extents[i] = (struct vhd_fs_map_extent) {
+            .fd_offset = i * 8192,
+            .cache_offset = i * 4096,
+            .len = 4096,
+            .flags = i % 2 ? VHD_FS_MAP_READ :
+                VHD_FS_MAP_READ | VHD_FS_MAP_WRITE,
+        };
+    }
+
+    CU_ASSERT(vhd_fs_map(vdev, file_fd, extents, 1) == -ENOTCONN);
+
+    master_connect(&m, socket_path, 1ull << VHOST_USER_PROTOCOL_F_SLAVE_REQ);
+    CU_ASSERT_FATAL(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0,
+                               sv) == 0);
+    CU_ASSERT_FATAL(master_set(&m, VHOST_USER_SET_SLAVE_REQ_FD, NULL, 0,
+                               &sv[1], 1) == 0);
+    close(sv[1]);
+
+    /* nothing is sent if any of the extents is outside of the window */
+    extents[1].cache_offset = FS_CACHE_SIZE - 2048;
+    CU_ASSERT(vhd_fs_map(vdev, file_fd, extents, 2) == -EINVAL);
+    extents[1].cache_offset = 4096;
+
+    ctx = (struct fs_map_ctx) {
+        .vdev = vdev,
+        .fd = file_fd,
+        .extents = extents,
+        .count = FS_NUM_EXTENTS,
+    };
+    pthread_create(&thread, NULL, fs_map_thread, &ctx);
+    for (i = 0; i < FS_NUM_EXTENTS; i += VHOST_USER_FS_SLAVE_ENTRIES) {
+        CU_ASSERT_FATAL(slave_recv(sv[0], &hdr, &msg, &fd) == 0);
+        CU_ASSERT(hdr.req == VHOST_USER_SLAVE_FS_MAP);
+        CU_ASSERT(hdr.flags & VHOST_USER_MSG_FLAGS_REPLY_ACK);
+        CU_ASSERT(fd >= 0);
+        for (j = 0; j < VHOST_USER_FS_SLAVE_ENTRIES; j++) {
+            const struct vhd_fs_map_extent *ext = &extents[i + j];
+
+            if (i + j >= FS_NUM_EXTENTS) {
+                CU_ASSERT(msg.len[j] == 0);
+                continue;
+            }
+            CU_ASSERT(msg.fd_offset[j] == ext->fd_offset);
+            CU_ASSERT(msg.c_offset[j] == ext->cache_offset);
+            CU_ASSERT(msg.len[j] == ext->len);
+            CU_ASSERT(msg.flags[j] == (j % 2 ? VHOST_USER_FS_FLAG_MAP_R :
+                                       VHOST_USER_FS_FLAG_MAP_R |
+                                       VHOST_USER_FS_FLAG_MAP_W));
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+        slave_reply(sv[0], &hdr, 0);
+    }
+    pthread_join(thread, NULL);
+    CU_ASSERT(ctx.ret == 0);
+
+    /* the client failing the request */
+    ctx.fd = -1;
+    ctx.count = 1;
+    pthread_create(&thread, NULL, fs_map_thread, &ctx);
+    CU_ASSERT_FATAL(slave_recv(sv[0], &hdr, &msg, &fd) == 0);
+    CU_ASSERT(hdr.req == VHOST_USER_SLAVE_FS_UNMAP);
+    CU_ASSERT(fd < 0);
+    CU_ASSERT(msg.c_offset[0] == 0 && msg.len[0] == 4096);
+    slave_reply(sv[0], &hdr, 1);
+    pthread_join(thread, NULL);
+    CU_ASSERT(ctx.ret == -EIO);
+
+    /* the client going away without replying */
+    ctx.fd = file_fd;
+    pthread_create(&thread, NULL, fs_map_thread, &ctx);
+    CU_ASSERT_FATAL(slave_recv(sv[0], &hdr, &msg, &fd) == 0);
+    if (fd >= 0) {
+        close(fd);
+    }
+    master_close(&m);
+    if (!join_timeout(thread)) {
+        CU_ASSERT(!"vhd_fs_map() stuck after disconnect");
+        close(sv[0]);
+        sv[0] = -1;
+        pthread_join(thread, NULL);
+    }
+    CU_ASSERT(ctx.ret < 0);
+
+    /* the control thread is still there for the next client */
+    master_connect(&m, socket_path, 0);
+    master_close(&m);
+
+    done_fd = eventfd(0, EFD_CLOEXEC);
+    vhd_unregister_fs(vdev, notify_done, &done_fd);
+    eventfd_read(done_fd, &val);
+    close(done_fd);
+    unlink(socket_path);
+
+    if (sv[0] >= 0) {
+        close(sv[0]);
+    }
+    close(file_fd);
+    backend_stop(&be);
+}
+
+/*
+ * The hiprio queue is a priority vring with the first request queue to itself,
+ * the request queues are spread over the rest; a device without even the
+ * hiprio queue is refused
+ */
+static void fs_placement_test(void)
+{
+    struct test_backend be[3];
+    struct vhd_request_queue *rqs[3];
+    struct vhd_fsdev_info info;
+    char socket_path[PATH_MAX];
+    struct vhd_vdev *vdev;
+    int done_fd;
+    eventfd_t val;
+    unsigned i;
+
+    for (i = 0; i < 3; i++) {
+        backend_start(&be[i]);
+        rqs[i] = be[i].rq;
+    }
+    test_socket_path(socket_path, sizeof(socket_path), "fsmq");
+    info = (struct vhd_fsdev_info) {
+        .socket_path = socket_path,
+        .tag = "fsmq",
+        .num_queues = 0,
+    };
+    CU_ASSERT(vhd_register_fs_mq(&info, rqs, 3, NULL) == NULL);
+
+    info.num_queues = 5;
+    vdev = vhd_register_fs_mq(&info, rqs, 3, NULL);
+    CU_ASSERT_FATAL(vdev != NULL);
+    CU_ASSERT(vdev->vrings[0].rq == rqs[0]);
+    CU_ASSERT(vdev->vrings[0].sched_priority);
+    for (i = 1; i < 5; i++) {
+        CU_ASSERT(vdev->vrings[i].rq == rqs[1 + (i - 1) % 2]);
+        CU_ASSERT(!vdev->vrings[i].sched_priority);
+    }
+
+    done_fd = eventfd(0, EFD_CLOEXEC);
+    vhd_unregister_fs(vdev, notify_done, &done_fd);
+    eventfd_read(done_fd, &val);
+    close(done_fd);
+    unlink(socket_path);
+
+    for (i = 0; i < 3; i++) {
+        backend_stop(&be[i]);
+    }
+}
+
+/*
+ * Postcopy migration
+ */
+
+/* Tell if the mapping containing @ptr is registered for missing page faults */
+static bool uffd_registered(const void *ptr)
+{
+    FILE *f = fopen("/proc/self/smaps", "r");
+    char line[256];
+    bool in_mapping = false;
+    bool ret = false;
+
+    CU_ASSERT_FATAL(f != NULL);
+    while (fgets(line, sizeof(line), f)) {
+        unsigned long start, end;
+
+        if (sscanf(line, "%lx-%lx ", &start, &end) == 2) {
+            in_mapping = (uintptr_t)ptr >= start && (uintptr_t)ptr < end;
+        } else if (in_mapping && !strncmp(line, "VmFlags:", 8)) {
+            ret = strstr(line, " um") != NULL;
+            break;
+        }
+    }
+    fclose(f);
+    return ret;
+}
+
+struct touch_ctx {
+    const volatile char *ptr;
+    char val;
+    atomic_bool done;
+};
+
+static void *touch_thread(void *opaque)
+{
+    struct touch_ctx *ctx = opaque;
+
+    ctx->val = *ctx->ptr;
+    atomic_store_release(&ctx->done, true);
+    return NULL;
+}
+
+/* Send a postcopy message, which the device always replies to */
+static uint64_t master_postcopy(struct test_master *m, uint32_t req, int *fd)
+{
+    uint64_t ret = 0;
+
+    master_send(m, req, false, NULL, 0, NULL, 0);
+    if (req == VHOST_USER_POSTCOPY_ADVISE) {
+        master_recv_fd(m, req, NULL, 0, fd);
+    } else {
+        master_recv(m, req, &ret, sizeof(ret));
+    }
+    return ret;
+}
+
+/*
+ * Postcopy is only offered by the devices opting in.  Once listening, the
+ * memory table set is sent back with the device's addresses, the guest memory
+ * is registered with the userfaultfd given to the master, so that touching
+ * the pages not migrated yet waits for the master to bring them in, and
+ * unregistered again on the end of postcopy
+ */
+static void postcopy_test(void)
+{
+    struct test_backend be;
+    struct test_dev dev;
+    struct test_master m;
+    struct vhost_user_mem_desc desc, reply;
+    struct touch_ctx touch = {};
+    struct uffd_msg msg;
+    struct uffdio_copy copy;
+    struct pollfd pfd;
+    pthread_t thread;
+    size_t page = sysconf(_SC_PAGESIZE);
+    char *dev_mem, *buf;
+    uint64_t ack;
+    int ufd, sv[2];
+
+    backend_start(&be);
+
+    test_dev_init(&dev, "nopostcopy");
+    dev.vdev = vhd_register_blockdev(&dev.info, be.rq, &dev);
+    CU_ASSERT_FATAL(dev.vdev != NULL);
+    master_connect(&m, dev.socket_path, 0);
+    CU_ASSERT(!(master_get_u64(&m, VHOST_USER_GET_PROTOCOL_FEATURES) &
+                (1ull << VHOST_USER_PROTOCOL_F_PAGEFAULT)));
+    master_postcopy(&m, VHOST_USER_POSTCOPY_ADVISE, &ufd);
+    CU_ASSERT(ufd < 0);
+    master_close(&m);
+    test_dev_unregister(&dev);
+
+    test_dev_init(&dev, "postcopy");
+    dev.info.postcopy = true;
+    dev.vdev = vhd_register_blockdev(&dev.info, be.rq, &dev);
+    CU_ASSERT_FATAL(dev.vdev != NULL);
+    master_connect(&m, dev.socket_path,
+                   1ull << VHOST_USER_PROTOCOL_F_PAGEFAULT);
+
+    master_postcopy(&m, VHOST_USER_POSTCOPY_ADVISE, &ufd);
+    CU_ASSERT_FATAL(ufd >= 0);
+    CU_ASSERT_FATAL(master_postcopy(&m, VHOST_USER_POSTCOPY_LISTEN,
+                                    NULL) == 0);
+
+    /* the userfaultfd registration can't be handed over */
+    CU_ASSERT_FATAL(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0,
+                               sv) == 0);
+    CU_ASSERT(vhd_handover_blockdev(dev.vdev, sv[0], NULL, NULL) == -EBUSY);
+    close(sv[0]);
+    close(sv[1]);
+
+    master_alloc_memory(&m);
+    desc = master_mem_desc(&m);
+    master_send(&m, VHOST_USER_SET_MEM_TABLE, true, &desc, MEM_DESC_SIZE,
+                &m.mem_fd, 1);
+    master_recv(&m, VHOST_USER_SET_MEM_TABLE, &reply, MEM_DESC_SIZE);
+    CU_ASSERT_FATAL(reply.nregions == 1);
+    CU_ASSERT(reply.regions[0].guest_addr == 0);
+    CU_ASSERT(reply.regions[0].size == m.mem_size);
+    dev_mem = (char *)(uintptr_t)reply.regions[0].user_addr;
+    CU_ASSERT_FATAL(dev_mem != NULL && dev_mem != m.mem);
+    CU_ASSERT_FATAL(uffd_registered(dev_mem));
+
+    /* the table sent back is acknowledged by the master in turn */
+    ack = 0;
+    master_send(&m, VHOST_USER_SET_MEM_TABLE, false, &ack, sizeof(ack),
+                NULL, 0);
+    ack = 1;
+    master_recv(&m, VHOST_USER_SET_MEM_TABLE, &ack, sizeof(ack));
+    CU_ASSERT(ack == 0);
+
+    /* the master hasn't touched the data buffers */
+    touch.ptr = dev_mem + m.data_gpa + 100;
+    pthread_create(&thread, NULL, touch_thread, &touch);
+    pfd = (struct pollfd) { .fd = ufd, .events = POLLIN };
+    CU_ASSERT_FATAL(poll(&pfd, 1, TEST_TIMEOUT_MS) == 1);
+    CU_ASSERT_FATAL(read(ufd, &msg, sizeof(msg)) == sizeof(msg));
+    CU_ASSERT(msg.event == UFFD_EVENT_PAGEFAULT);
+    CU_ASSERT(msg.arg.pagefault.address / page ==
+              (uintptr_t)(dev_mem + m.data_gpa) / page);
+    usleep(10000);
+    CU_ASSERT(!atomic_load_acquire(&touch.done));
+
+    buf = aligned_alloc(page, page);
+    memset(buf, 0x5a, page);
+    copy = (struct uffdio_copy) {
+        .dst = (uintptr_t)(dev_mem + m.data_gpa),
+        .src = (uintptr_t)buf,
+        .len = page,
+    };
+    CU_ASSERT(ioctl(ufd, UFFDIO_COPY, &copy) == 0);
+    pthread_join(thread, NULL);
+    CU_ASSERT(touch.val == 0x5a);
+    CU_ASSERT(*(char *)master_gpa_ptr(&m, m.data_gpa) == 0x5a);
+    free(buf);
+
+    CU_ASSERT(master_postcopy(&m, VHOST_USER_POSTCOPY_END, NULL) == 0);
+    CU_ASSERT(!uffd_registered(dev_mem));
+    /* with the master's fd still open, this would block if still registered */
+    if (!uffd_registered(dev_mem)) {
+        CU_ASSERT(dev_mem[m.data_gpa + page] == 0);
+    }
+
+    close(ufd);
+    master_close(&m);
+    test_dev_unregister(&dev);
+    backend_stop(&be);
+}
+
+int main(void)
+{
+    int res = 0;
+    CU_pSuite suite = NULL;
+
+    strcpy(g_socket_dir, "/tmp/vdev_test.XXXXXX");
+    if (!mkdtemp(g_socket_dir)) {
+        perror("mkdtemp");
+        return EXIT_FAILURE;
+    }
+    if (vhd_start_vhost_server(vhd_log_stderr) < 0) {
+        return EXIT_FAILURE;
+    }
+
+    if (CUE_SUCCESS != CU_initialize_registry()) {
+        return CU_get_error();
+    }
+
+    suite = CU_add_suite("vdev_test", NULL, NULL);
+    if (NULL == suite) {
+        CU_cleanup_registry();
+        return CU_get_error();
+    }
+
+    CU_ADD_TEST(suite, handover_test);
+    CU_ADD_TEST(suite, undrained_stop_test);
+    CU_ADD_TEST(suite, io_stat_test);
+    CU_ADD_TEST(suite, mem_reg_test);
+    CU_ADD_TEST(suite, mem_reg_reject_test);
+    CU_ADD_TEST(suite, fs_map_test);
+    CU_ADD_TEST(suite, fs_placement_test);
+    CU_ADD_TEST(suite, postcopy_test);
+
+    CU_basic_set_mode(CU_BRM_VERBOSE);
+    CU_basic_run_tests();
+
+    res = CU_get_error() || CU_get_number_of_tests_failed();
+    CU_cleanup_registry();
+
+    vhd_stop_vhost_server();
+    rmdir(g_socket_dir);
+
+    return res;
+}
@@ -0,0 +1,1121 @@
+/*
+ * vhost-user master emulator
+ *
+ * Connects to a vhost-user-blk device socket the way QEMU would, shares a
+ * memfd as the "guest memory", sets up the virtqueues in it, and loads the
+ * device with virtio-blk reads and/or writes, one thread per virtqueue acting
+ * as the guest driver.  No VM is involved, so it works without KVM and can
+ * generate request rates well beyond what a guest kernel would, to profile
+ * the library dataplane.
+ *
+ * Each thread keeps @depth requests in flight on its virtqueue (optionally
+ * paced to an overall @rate), kicks the device through the kick eventfd and
+ * waits for completions on the call eventfd, or busy polls the used ring with
+ * interrupts suppressed.  At the end IOPS, bandwidth, notifications per
+ * request and completion latency percentiles are reported.
+ *
+ * With --postcopy the run goes the way an incoming postcopy migration does:
+ * the master takes the userfaultfd the device registers the guest memory
+ * with, gets the memory table back with the device's addresses, and resolves
+ * the faults on the pages not touched yet with zeroes until the end of the
+ * run (the device has to be registered with vhd_bdev_info.postcopy, e.g.
+ * bench-server -P).
+ *
+ * E.g. against test/bench-server:
+ *   bench-server -s /tmp/bench -q 4 -r 2
+ *   vhost-master -s /tmp/bench/bench-0.sock -q 4 -d 32 -t 10
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <sys/un.h>
+#include <linux/userfaultfd.h>
+
+#include "vhost/blockdev.h"
+#include "vhost/server.h"
+#include "vhost_spec.h"
+#include "virtio/virtio_spec.h"
+#include "virtio/virtio_blk_spec.h"
+#include "io_stat.h"
+#include "platform.h"
+#include "test_utils.h"
+
+#define DIE(fmt, ...)                              \
+do {                                               \
+    vhd_log_stderr(LOG_ERROR, fmt, ##__VA_ARGS__); \
+    exit(EXIT_FAILURE);                            \
+} while (0)
+
+#define ALIGN_UP(x, a) (((x) + (a) - 1) & ~((uint64_t)(a) - 1))
+
+struct master_config {
+    const char *socket_path;
+    unsigned num_queues;
+    unsigned depth;
+    unsigned block_size;
+    unsigned segments;
+    unsigned write_pct;
+    uint64_t rate;
+    unsigned duration;
+    bool event_idx;
+    bool indirect;
+    bool poll;
+    bool json;
+    bool postcopy;
+};
+
+static struct master_config g_conf = {
+    .num_queues = 1,
+    .depth = 32,
+    .block_size = 4096,
+    .segments = 1,
+    .duration = 10,
+};
+
+/* Driver side of a virtqueue and the requests it keeps in flight */
+struct master_queue {
+    unsigned index;
+    pthread_t thread;
+
+    uint16_t qsz;
+    unsigned descs_per_req;
+    struct virtq_desc *desc;
+    struct virtq_avail *avail;
+    struct virtq_used *used;
+    uint64_t desc_gpa;
+    uint64_t avail_gpa;
+    uint64_t used_gpa;
+
+    /* per-request headers, status bytes and data buffers */
+    uint64_t table_gpa;
+    uint64_t hdr_gpa;
+    uint64_t status_gpa;
+    uint64_t data_gpa;
+
+    int kickfd;
+    int callfd;
+
+    uint16_t avail_idx;
+    uint16_t used_idx;
+
+    /* free request slots, and the submission time of the ones in flight */
+    unsigned *free_slots;
+    unsigned num_free;
+    uint64_t *submit_ns;
+    unsigned seed;
+
+    /* results */
+    uint64_t requests;
+    uint64_t bytes;
+    uint64_t errors;
+    uint64_t kicks;
+    uint64_t calls;
+    struct vhd_latency_hist latency;
+};
+
+struct master {
+    int sock;
+    uint64_t features;
+    uint64_t protocol_features;
+
+    void *mem;
+    size_t mem_size;
+    int mem_fd;
+
+    uint64_t capacity;
+    struct master_queue *queues;
+    uint64_t deadline_ns;
+
+    /* postcopy userfaultfd, and the thread resolving the faults on it */
+    int ufd;
+    int ufd_stop_fd;
+    pthread_t ufd_thread;
+    uint64_t faults;
+};
+
+static struct master g_master;
+
+static uint64_t clock_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void *gpa_ptr(uint64_t gpa)
+{
+    return (char *)g_master.mem + gpa;
+}
+
+/*
+ * vhost-user messaging
+ */
+
+static const char *const g_req_names[] = {
+#define VHOST_REQ(r) [VHOST_USER_ ## r] = #r
+    VHOST_REQ(GET_FEATURES),
+    VHOST_REQ(SET_FEATURES),
+    VHOST_REQ(SET_OWNER),
+    VHOST_REQ(SET_MEM_TABLE),
+    VHOST_REQ(SET_VRING_NUM),
+    VHOST_REQ(SET_VRING_ADDR),
+    VHOST_REQ(SET_VRING_BASE),
+    VHOST_REQ(GET_VRING_BASE),
+    VHOST_REQ(SET_VRING_KICK),
+    VHOST_REQ(SET_VRING_CALL),
+    VHOST_REQ(GET_PROTOCOL_FEATURES),
+    VHOST_REQ(SET_PROTOCOL_FEATURES),
+    VHOST_REQ(GET_QUEUE_NUM),
+    VHOST_REQ(GET_CONFIG),
+    VHOST_REQ(POSTCOPY_ADVISE),
+    VHOST_REQ(POSTCOPY_LISTEN),
+    VHOST_REQ(POSTCOPY_END),
+#undef VHOST_REQ
+};
+
+static bool has_protocol_feature(unsigned bit)
+{
+    return g_master.protocol_features & (1ull << bit);
+}
+
+static void send_msg(uint32_t req, bool need_ack, const void *payload,
+                     uint32_t size, const int *fds, size_t num_fds)
+{
+    struct vhost_user_msg_hdr hdr = {
+        .req = req,
+        .flags = VHOST_USER_MSG_VERSION |
+            (need_ack ? VHOST_USER_MSG_FLAGS_REPLY_ACK : 0),
+        .size = size,
+    };
+    struct iovec iov[2] = {
+        { .iov_base = &hdr, .iov_len = sizeof(hdr) },
+        { .iov_base = (void *)payload, .iov_len = size },
+    };
+    char control[CMSG_SPACE(sizeof(int) * VHOST_USER_MAX_FDS)] = {};
+    struct msghdr msgh = {
+        .msg_iov = iov,
+        .msg_iovlen = size ? 2 : 1,
+    };
+    ssize_t ret;
+
+    if (num_fds) {
+        struct cmsghdr *cmsg;
+
+        msgh.msg_control = control;
+        msgh.msg_controllen = CMSG_SPACE(sizeof(int) * num_fds);
+        cmsg = CMSG_FIRSTHDR(&msgh);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * num_fds);
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * num_fds);
+    }
+
+    do {
+        ret = sendmsg(g_master.sock, &msgh, MSG_NOSIGNAL);
+    } while (ret < 0 && errno == EINTR);
+
+    if (ret != (ssize_t)(sizeof(hdr) + size)) {
+        DIE("sending %s: %s", g_req_names[req],
+            ret < 0 ? strerror(errno) : "short write");
+    }
+}
+
+/* Receive the reply to @req, along with the fd passed if @fd is not NULL */
+static void recv_reply_fd(uint32_t req, void *payload, uint32_t size, int *fd)
+{
+    struct vhost_user_msg_hdr hdr;
+    union vhost_user_msg_payload buf;
+    struct iovec iov = { .iov_base = &hdr, .iov_len = sizeof(hdr) };
+    char control[CMSG_SPACE(sizeof(int))] = {};
+    struct msghdr msgh = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = fd ? control : NULL,
+        .msg_controllen = fd ? sizeof(control) : 0,
+    };
+    struct cmsghdr *cmsg;
+    ssize_t ret;
+
+    ret = recvmsg(g_master.sock, &msgh, MSG_WAITALL | MSG_CMSG_CLOEXEC);
+    if (ret != sizeof(hdr)) {
+        DIE("receiving reply to %s: %s", g_req_names[req],
+            ret < 0 ? strerror(errno) : "connection closed");
+    }
+    if (hdr.req != req ||
+        (hdr.flags & VHOST_USER_MSG_FLAGS_REPLY) != VHOST_USER_MSG_FLAGS_REPLY ||
+        hdr.size > sizeof(buf)) {
+        DIE("unexpected reply req=%u flags=0x%x size=%u to %s", hdr.req,
+            hdr.flags, hdr.size, g_req_names[req]);
+    }
+
+    if (fd) {
+        cmsg = CMSG_FIRSTHDR(&msgh);
+        if (!cmsg || cmsg->cmsg_type != SCM_RIGHTS) {
+            DIE("no fd in reply to %s", g_req_names[req]);
+        }
+        memcpy(fd, CMSG_DATA(cmsg), sizeof(*fd));
+    }
+
+    /* an empty read would wait for more data */
+    ret = hdr.size ? recv(g_master.sock, &buf, hdr.size, MSG_WAITALL) : 0;
+    if (ret != hdr.size) {
+        DIE("receiving reply to %s: %s", g_req_names[req],
+            ret < 0 ? strerror(errno) : "connection closed");
+    }
+    if (hdr.size < size) {
+        DIE("reply to %s is too short: %u (expected %u)", g_req_names[req],
+            hdr.size, size);
+    }
+
+    memcpy(payload, &buf, size);
+}
+
+static void recv_reply(uint32_t req, void *payload, uint32_t size)
+{
+    recv_reply_fd(req, payload, size, NULL);
+}
+
+static uint64_t get_u64(uint32_t req)
+{
+    uint64_t val;
+
+    send_msg(req, false, NULL, 0, NULL, 0);
+    recv_reply(req, &val, sizeof(val));
+    return val;
+}
+
+/*
+ * Send a message not expecting a reply; with REPLY_ACK negotiated, wait for
+ * the device to acknowledge it so that errors are caught right away.
+ */
+static void set_msg(uint32_t req, const void *payload, uint32_t size,
+                    const int *fds, size_t num_fds)
+{
+    bool need_ack = has_protocol_feature(VHOST_USER_PROTOCOL_F_REPLY_ACK);
+    uint64_t ack;
+
+    send_msg(req, need_ack, payload, size, fds, num_fds);
+    if (!need_ack) {
+        return;
+    }
+
+    recv_reply(req, &ack, sizeof(ack));
+    if (ack) {
+        DIE("%s failed: %" PRId64, g_req_names[req], (int64_t)ack);
+    }
+}
+
+static void set_u64(uint32_t req, uint64_t val, int fd)
+{
+    set_msg(req, &val, sizeof(val), &fd, fd >= 0);
+}
+
+/*
+ * Guest memory layout: the rings and requests of each queue in turn
+ */
+
+static uint16_t ring_size(unsigned descs_per_req)
+{
+    unsigned qsz = 128;
+
+    while (qsz < g_conf.depth * descs_per_req) {
+        qsz <<= 1;
+    }
+    if (qsz > 32768) {
+        DIE("%u requests of %u descriptors don't fit in a virtqueue",
+            g_conf.depth, descs_per_req);
+    }
+    return qsz;
+}
+
+static uint64_t layout_queue(struct master_queue *q, uint64_t off)
+{
+    unsigned nsegs = g_conf.segments + 2;
+    size_t page = sysconf(_SC_PAGESIZE);
+
+    q->descs_per_req = g_conf.indirect ? 1 : nsegs;
+    q->qsz = ring_size(q->descs_per_req);
+
+    q->desc_gpa = off;
+    off += sizeof(struct virtq_desc) * q->qsz;
+    q->avail_gpa = off;
+    off += sizeof(struct virtq_avail) + sizeof(uint16_t) * (q->qsz + 1);
+    off = ALIGN_UP(off, 4);
+    q->used_gpa = off;
+    off += sizeof(struct virtq_used) +
+        sizeof(struct virtq_used_elem) * q->qsz + sizeof(uint16_t);
+    off = ALIGN_UP(off, 16);
+    q->table_gpa = off;
+    if (g_conf.indirect) {
+        off += sizeof(struct virtq_desc) * nsegs * g_conf.depth;
+    }
+    q->hdr_gpa = off;
+    off += sizeof(struct virtio_blk_req_hdr) * g_conf.depth;
+    q->status_gpa = off;
+    off += g_conf.depth;
+    off = ALIGN_UP(off, page);
+    q->data_gpa = off;
+    off += (uint64_t)g_conf.block_size * g_conf.segments * g_conf.depth;
+    return ALIGN_UP(off, page);
+}
+
+/* Build the descriptor chain of each request slot once and for all */
+static void build_queue(struct master_queue *q)
+{
+    unsigned nsegs = g_conf.segments + 2;
+    unsigned r, i;
+
+    q->desc = gpa_ptr(q->desc_gpa);
+    q->avail = gpa_ptr(q->avail_gpa);
+    q->used = gpa_ptr(q->used_gpa);
+
+    for (r = 0; r < g_conf.depth; r++) {
+        struct virtq_desc *chain;
+        uint16_t head = r * q->descs_per_req;
+
+        if (g_conf.indirect) {
+            uint64_t table_gpa = q->table_gpa +
+                sizeof(struct virtq_desc) * nsegs * r;
+
+            chain = gpa_ptr(table_gpa);
+            q->desc[head] = (struct virtq_desc) {
+                .addr = table_gpa,
+                .len = sizeof(struct virtq_desc) * nsegs,
+                .flags = VIRTQ_DESC_F_INDIRECT,
+            };
+        } else {
+            chain = q->desc + head;
+        }
+
+        for (i = 0; i < nsegs; i++) {
+            if (i == 0) {
+                chain[i].addr = q->hdr_gpa +
+                    sizeof(struct virtio_blk_req_hdr) * r;
+                chain[i].len = sizeof(struct virtio_blk_req_hdr);
+                chain[i].flags = 0;
+            } else if (i == nsegs - 1) {
+                chain[i].addr = q->status_gpa + r;
+                chain[i].len = 1;
+                chain[i].flags = VIRTQ_DESC_F_WRITE;
+            } else {
+                chain[i].addr = q->data_gpa + (uint64_t)g_conf.block_size *
+                    (g_conf.segments * r + i - 1);
+                chain[i].len = g_conf.block_size;
+                chain[i].flags = 0;
+            }
+
+            if (i != nsegs - 1) {
+                chain[i].flags |= VIRTQ_DESC_F_NEXT;
+                chain[i].next = (g_conf.indirect ? 0 : head) + i + 1;
+            }
+        }
+    }
+
+    q->free_slots = calloc(g_conf.depth, sizeof(q->free_slots[0]));
+    q->submit_ns = calloc(g_conf.depth, sizeof(q->submit_ns[0]));
+    for (r = 0; r < g_conf.depth; r++) {
+        q->free_slots[r] = g_conf.depth - 1 - r;
+    }
+    q->num_free = g_conf.depth;
+    q->seed = q->index + 1;
+
+    q->kickfd = eventfd(0, EFD_CLOEXEC);
+    q->callfd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (q->kickfd < 0 || q->callfd < 0) {
+        DIE("eventfd: %s", strerror(errno));
+    }
+}
+
+/*
+ * Postcopy: the device only has the memory table set while listening, and
+ * sends it back with its own addresses of the regions, which the faults are
+ * reported at
+ */
+
+static void postcopy_set_mem_table(const struct vhost_user_mem_desc *desc)
+{
+    bool need_ack = has_protocol_feature(VHOST_USER_PROTOCOL_F_REPLY_ACK);
+    uint32_t size = offsetof(struct vhost_user_mem_desc, regions) +
+        sizeof(desc->regions[0]);
+    struct vhost_user_mem_desc reply;
+    uint64_t ack = 0;
+
+    send_msg(VHOST_USER_SET_MEM_TABLE, need_ack, desc, size,
+             &g_master.mem_fd, 1);
+    recv_reply(VHOST_USER_SET_MEM_TABLE, &reply, size);
+    if (reply.nregions != 1 || reply.regions[0].size != desc->regions[0].size ||
+        !reply.regions[0].user_addr) {
+        DIE("bad memory table sent back in postcopy");
+    }
+
+    /* tell the device we're ready to handle the faults */
+    send_msg(VHOST_USER_SET_MEM_TABLE, false, &ack, sizeof(ack), NULL, 0);
+    if (need_ack) {
+        recv_reply(VHOST_USER_SET_MEM_TABLE, &ack, sizeof(ack));
+        if (ack) {
+            DIE("SET_MEM_TABLE failed: %" PRId64, (int64_t)ack);
+        }
+    }
+}
+
+/* Fill the pages the device faults on with zeroes, as if they came over */
+static void *ufd_thread(void *opaque)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    void *zeroes = mmap(NULL, page, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS,
+                        -1, 0);
+    struct pollfd pfd[2] = {
+        { .fd = g_master.ufd, .events = POLLIN },
+        { .fd = g_master.ufd_stop_fd, .events = POLLIN },
+    };
+
+    if (zeroes == MAP_FAILED) {
+        DIE("can't allocate zero page: %s", strerror(errno));
+    }
+
+    while (!pfd[1].revents) {
+        struct uffd_msg msg;
+        struct uffdio_copy copy;
+
+        if (poll(pfd, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            DIE("poll: %s", strerror(errno));
+        }
+        if (!pfd[0].revents ||
+            read(g_master.ufd, &msg, sizeof(msg)) != sizeof(msg)) {
+            continue;
+        }
+        if (msg.event != UFFD_EVENT_PAGEFAULT) {
+            continue;
+        }
+
+        copy = (struct uffdio_copy) {
+            .dst = msg.arg.pagefault.address & ~((uint64_t)page - 1),
+            .src = (uintptr_t)zeroes,
+            .len = page,
+        };
+        /* another thread may have faulted on the same page */
+        if (ioctl(g_master.ufd, UFFDIO_COPY, &copy) < 0 && errno != EEXIST) {
+            DIE("UFFDIO_COPY(0x%llx): %s", copy.dst, strerror(errno));
+        }
+        g_master.faults++;
+    }
+
+    munmap(zeroes, page);
+    return NULL;
+}
+
+static void postcopy_start(void)
+{
+    uint64_t ret;
+
+    send_msg(VHOST_USER_POSTCOPY_ADVISE, false, NULL, 0, NULL, 0);
+    recv_reply_fd(VHOST_USER_POSTCOPY_ADVISE, NULL, 0, &g_master.ufd);
+
+    send_msg(VHOST_USER_POSTCOPY_LISTEN, false, NULL, 0, NULL, 0);
+    recv_reply(VHOST_USER_POSTCOPY_LISTEN, &ret, sizeof(ret));
+    if (ret) {
+        DIE("POSTCOPY_LISTEN failed: %" PRId64, (int64_t)ret);
+    }
+
+    g_master.ufd_stop_fd = eventfd(0, EFD_CLOEXEC);
+    if (g_master.ufd_stop_fd < 0 ||
+        pthread_create(&g_master.ufd_thread, NULL, ufd_thread, NULL)) {
+        DIE("can't start postcopy fault thread");
+    }
+}
+
+static void postcopy_end(void)
+{
+    uint64_t ret;
+
+    eventfd_write(g_master.ufd_stop_fd, 1);
+    pthread_join(g_master.ufd_thread, NULL);
+    close(g_master.ufd_stop_fd);
+
+    send_msg(VHOST_USER_POSTCOPY_END, false, NULL, 0, NULL, 0);
+    recv_reply(VHOST_USER_POSTCOPY_END, &ret, sizeof(ret));
+    if (ret) {
+        DIE("POSTCOPY_END failed: %" PRId64, (int64_t)ret);
+    }
+    close(g_master.ufd);
+}
+
+static void setup_memory(void)
+{
+    struct vhost_user_mem_desc desc = { .nregions = 1 };
+    uint64_t off = 0;
+    unsigned i;
+
+    for (i = 0; i < g_conf.num_queues; i++) {
+        g_master.queues[i].index = i;
+        off = layout_queue(&g_master.queues[i], off);
+    }
+    g_master.mem_size = off;
+
+    g_master.mem_fd = memfd_create("vhost_master", MFD_CLOEXEC);
+    if (g_master.mem_fd < 0 ||
+        ftruncate(g_master.mem_fd, g_master.mem_size) < 0) {
+        DIE("can't create guest memory: %s", strerror(errno));
+    }
+    g_master.mem = mmap(NULL, g_master.mem_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED, g_master.mem_fd, 0);
+    if (g_master.mem == MAP_FAILED) {
+        DIE("can't map guest memory: %s", strerror(errno));
+    }
+
+    for (i = 0; i < g_conf.num_queues; i++) {
+        build_queue(&g_master.queues[i]);
+    }
+
+    desc.regions[0] = (struct vhost_user_mem_region) {
+        .guest_addr = 0,
+        .size = g_master.mem_size,
+        .user_addr = (uintptr_t)g_master.mem,
+        .mmap_offset = 0,
+    };
+    if (g_conf.postcopy) {
+        postcopy_set_mem_table(&desc);
+        return;
+    }
+    set_msg(VHOST_USER_SET_MEM_TABLE, &desc,
+            offsetof(struct vhost_user_mem_desc, regions) +
+            sizeof(desc.regions[0]), &g_master.mem_fd, 1);
+}
+
+static void start_queue(struct master_queue *q)
+{
+    struct vhost_user_vring_state num = { .index = q->index, .num = q->qsz };
+    struct vhost_user_vring_state base = { .index = q->index, .num = 0 };
+    struct vhost_user_vring_addr addr = {
+        .index = q->index,
+        .desc_addr = (uintptr_t)q->desc,
+        .used_addr = (uintptr_t)q->used,
+        .avail_addr = (uintptr_t)q->avail,
+        .used_gpa_base = q->used_gpa,
+    };
+
+    set_msg(VHOST_USER_SET_VRING_NUM, &num, sizeof(num), NULL, 0);
+    set_msg(VHOST_USER_SET_VRING_BASE, &base, sizeof(base), NULL, 0);
+    set_msg(VHOST_USER_SET_VRING_ADDR, &addr, sizeof(addr), NULL, 0);
+    set_u64(VHOST_USER_SET_VRING_CALL, q->index, q->callfd);
+    set_u64(VHOST_USER_SET_VRING_KICK, q->index, q->kickfd);
+}
+
+static void stop_queue(struct master_queue *q)
+{
+    struct vhost_user_vring_state state = { .index = q->index };
+
+    send_msg(VHOST_USER_GET_VRING_BASE, false, &state, sizeof(state),
+             NULL, 0);
+    recv_reply(VHOST_USER_GET_VRING_BASE, &state, sizeof(state));
+    if (state.num != q->avail_idx) {
+        DIE("queue %u stopped at %u, expected %u", q->index, state.num,
+            q->avail_idx);
+    }
+}
+
+static void connect_device(void)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    struct virtio_blk_config blk_config;
+    struct vhost_user_config_space config = {
+        .size = sizeof(blk_config),
+    };
+    uint64_t wanted_protocol_features =
+        (1ull << VHOST_USER_PROTOCOL_F_MQ) |
+        (1ull << VHOST_USER_PROTOCOL_F_REPLY_ACK) |
+        (1ull << VHOST_USER_PROTOCOL_F_CONFIG);
+    uint64_t wanted_features = 1ull << VIRTIO_F_VERSION_1;
+    uint64_t protocol_features;
+    uint64_t queue_num;
+
+    if (g_conf.postcopy) {
+        wanted_protocol_features |= 1ull << VHOST_USER_PROTOCOL_F_PAGEFAULT;
+    }
+
+    if (strlen(g_conf.socket_path) >= sizeof(addr.sun_path)) {
+        DIE("socket path %s is too long", g_conf.socket_path);
+    }
+    strcpy(addr.sun_path, g_conf.socket_path);
+
+    g_master.sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (g_master.sock < 0 ||
+        connect(g_master.sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        DIE("can't connect to %s: %s", g_conf.socket_path, strerror(errno));
+    }
+
+    g_master.features = get_u64(VHOST_USER_GET_FEATURES);
+    if (!(g_master.features & (1ull << VHOST_USER_F_PROTOCOL_FEATURES))) {
+        DIE("device doesn't support protocol features");
+    }
+
+    protocol_features = get_u64(VHOST_USER_GET_PROTOCOL_FEATURES);
+    if ((protocol_features & wanted_protocol_features) !=
+        wanted_protocol_features) {
+        DIE("device doesn't support protocol features 0x%" PRIx64,
+            wanted_protocol_features & ~protocol_features);
+    }
+    /* REPLY_ACK only applies to the messages after this one */
+    set_u64(VHOST_USER_SET_PROTOCOL_FEATURES, wanted_protocol_features, -1);
+    g_master.protocol_features = wanted_protocol_features;
+
+    queue_num = get_u64(VHOST_USER_GET_QUEUE_NUM);
+    if (g_conf.num_queues > queue_num) {
+        DIE("device has only %" PRIu64 " queues", queue_num);
+    }
+
+    set_msg(VHOST_USER_SET_OWNER, NULL, 0, NULL, 0);
+
+    if (g_conf.event_idx) {
+        wanted_features |= 1ull << VIRTIO_F_RING_EVENT_IDX;
+    }
+    if (g_conf.indirect) {
+        wanted_features |= 1ull << VIRTIO_F_RING_INDIRECT_DESC;
+    }
+    if ((g_master.features & wanted_features) != wanted_features) {
+        DIE("device doesn't support features 0x%" PRIx64,
+            wanted_features & ~g_master.features);
+    }
+    if (g_conf.write_pct && (g_master.features & (1ull << VIRTIO_BLK_F_RO))) {
+        DIE("device is read-only");
+    }
+    g_master.features = wanted_features;
+    set_u64(VHOST_USER_SET_FEATURES, g_master.features, -1);
+
+    send_msg(VHOST_USER_GET_CONFIG, false, &config,
+             VHOST_CONFIG_HDR_SIZE + sizeof(blk_config), NULL, 0);
+    recv_reply(VHOST_USER_GET_CONFIG, &config,
+               VHOST_CONFIG_HDR_SIZE + sizeof(blk_config));
+    memcpy(&blk_config, config.payload, sizeof(blk_config));
+    g_master.capacity = blk_config.capacity << VHD_SECTOR_SHIFT;
+    if (g_master.capacity < (uint64_t)g_conf.block_size * g_conf.segments) {
+        DIE("device is too small: %" PRIu64 " bytes", g_master.capacity);
+    }
+}
+
+/*
+ * Driver threads
+ */
+
+/* Pick a random request-aligned offset on the device */
+static uint64_t random_sector(struct master_queue *q)
+{
+    uint64_t req_size = (uint64_t)g_conf.block_size * g_conf.segments;
+    uint64_t nr = g_master.capacity / req_size;
+    uint64_t r = ((uint64_t)rand_r(&q->seed) << 31) | rand_r(&q->seed);
+
+    return r % nr * (req_size >> VHD_SECTOR_SHIFT);
+}
+
+static void prepare_request(struct master_queue *q, unsigned slot)
+{
+    struct virtio_blk_req_hdr *hdr =
+        gpa_ptr(q->hdr_gpa + sizeof(*hdr) * slot);
+    struct virtq_desc *chain = g_conf.indirect ?
+        gpa_ptr(q->table_gpa +
+                sizeof(struct virtq_desc) * (g_conf.segments + 2) * slot) :
+        q->desc + slot * q->descs_per_req;
+    bool write = (unsigned)rand_r(&q->seed) % 100 < g_conf.write_pct;
+    unsigned i;
+
+    *hdr = (struct virtio_blk_req_hdr) {
+        .type = write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN,
+        .sector = random_sector(q),
+    };
+    *(uint8_t *)gpa_ptr(q->status_gpa + slot) = 0xff;
+
+    for (i = 1; i <= g_conf.segments; i++) {
+        if (write) {
+            chain[i].flags &= ~VIRTQ_DESC_F_WRITE;
+        } else {
+            chain[i].flags |= VIRTQ_DESC_F_WRITE;
+        }
+    }
+}
+
+static bool need_event(uint16_t event_idx, uint16_t new_idx, uint16_t old_idx)
+{
+    return (uint16_t)(new_idx - event_idx - 1) < (uint16_t)(new_idx - old_idx);
+}
+
+static void kick(struct master_queue *q, uint16_t old_idx)
+{
+    bool notify;
+
+    __atomic_store_n(&q->avail->idx, q->avail_idx, __ATOMIC_RELEASE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    if (g_conf.event_idx) {
+        uint16_t avail_event = __atomic_load_n(
+            (uint16_t *)&q->used->ring[q->qsz], __ATOMIC_RELAXED);
+        notify = need_event(avail_event, q->avail_idx, old_idx);
+    } else {
+        notify = !(__atomic_load_n(&q->used->flags, __ATOMIC_RELAXED) &
+                   VIRTQ_USED_F_NO_NOTIFY);
+    }
+
+    if (notify) {
+        eventfd_write(q->kickfd, 1);
+        q->kicks++;
+    }
+}
+
+/*
+ * Submit as many requests as there are free slots, or as the rate allows;
+ * returns when the next one is due if it's held back by the rate.
+ */
+static uint64_t submit(struct master_queue *q, uint64_t now,
+                       uint64_t *next_ns, uint64_t interval_ns)
+{
+    uint16_t old_idx = q->avail_idx;
+
+    while (q->num_free && now < g_master.deadline_ns) {
+        unsigned slot;
+
+        if (interval_ns) {
+            if (now < *next_ns) {
+                break;
+            }
+            /* don't make up for more than a queue worth of lag */
+            *next_ns = MAX(*next_ns, now - interval_ns * g_conf.depth) +
+                interval_ns;
+        }
+
+        slot = q->free_slots[--q->num_free];
+        prepare_request(q, slot);
+        q->submit_ns[slot] = now;
+        q->avail->ring[q->avail_idx++ % q->qsz] = slot * q->descs_per_req;
+    }
+
+    if (q->avail_idx != old_idx) {
+        kick(q, old_idx);
+    }
+
+    return interval_ns && q->num_free ? *next_ns : 0;
+}
+
+static unsigned reap(struct master_queue *q)
+{
+    uint16_t used_idx = __atomic_load_n(&q->used->idx, __ATOMIC_ACQUIRE);
+    uint64_t now = clock_ns();
+    unsigned n = 0;
+
+    for (; q->used_idx != used_idx; q->used_idx++, n++) {
+        struct virtq_used_elem *elem = &q->used->ring[q->used_idx % q->qsz];
+        unsigned slot = elem->id / q->descs_per_req;
+        uint8_t status;
+
+        if (elem->id % q->descs_per_req || slot >= g_conf.depth) {
+            DIE("queue %u: bogus used id %u", q->index, elem->id);
+        }
+
+        status = *(uint8_t *)gpa_ptr(q->status_gpa + slot);
+        if (status != VIRTIO_BLK_S_OK) {
+            q->errors++;
+        }
+
+        q->requests++;
+        q->bytes += (uint64_t)g_conf.block_size * g_conf.segments;
+        q->latency.buckets[vhd_latency_hist_bucket(now - q->submit_ns[slot])]++;
+        q->latency.total_ns += now - q->submit_ns[slot];
+        q->free_slots[q->num_free++] = slot;
+    }
+
+    return n;
+}
+
+/* Wait for the used ring to move, or until @until_ns if not 0 */
+static void wait_used(struct master_queue *q, uint64_t until_ns)
+{
+    struct pollfd pfd = { .fd = q->callfd, .events = POLLIN };
+    struct timespec ts, *timeout = NULL;
+    eventfd_t cnt;
+
+    if (g_conf.poll) {
+        return;
+    }
+
+    if (g_conf.event_idx) {
+        /* used_event follows the avail ring */
+        __atomic_store_n(&q->avail->ring[q->qsz], q->used_idx,
+                         __ATOMIC_RELAXED);
+    }
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&q->used->idx, __ATOMIC_ACQUIRE) != q->used_idx) {
+        return;
+    }
+
+    if (until_ns) {
+        uint64_t now = clock_ns();
+        uint64_t left = until_ns > now ? until_ns - now : 0;
+
+        ts.tv_sec = left / 1000000000ull;
+        ts.tv_nsec = left % 1000000000ull;
+        timeout = &ts;
+    }
+
+    if (ppoll(&pfd, 1, timeout, NULL) < 0 && errno != EINTR) {
+        DIE("ppoll: %s", strerror(errno));
+    }
+    if (eventfd_read(q->callfd, &cnt) == 0) {
+        q->calls++;
+    }
+}
+
+static void *queue_thread(void *opaque)
+{
+    struct master_queue *q = opaque;
+    uint64_t interval_ns = g_conf.rate ?
+        MAX(1000000000ull * g_conf.num_queues / g_conf.rate, 1) : 0;
+    uint64_t next_ns = clock_ns();
+
+    if (g_conf.poll) {
+        q->avail->flags = VIRTQ_AVAIL_F_NO_INTERRUPT;
+    }
+
+    for (;;) {
+        uint64_t now = clock_ns();
+        uint64_t until_ns = submit(q, now, &next_ns, interval_ns);
+
+        if (now >= g_master.deadline_ns && q->num_free == g_conf.depth) {
+            break;
+        }
+        if (now < g_master.deadline_ns) {
+            until_ns = until_ns ? MIN(until_ns, g_master.deadline_ns) :
+                g_master.deadline_ns;
+        }
+        if (!reap(q)) {
+            wait_used(q, until_ns);
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Reporting
+ */
+
+static void report(uint64_t elapsed_ns)
+{
+    struct master_queue total = {};
+    double secs = elapsed_ns / 1e9;
+    unsigned i, b;
+
+    for (i = 0; i < g_conf.num_queues; i++) {
+        struct master_queue *q = &g_master.queues[i];
+
+        total.requests += q->requests;
+        total.bytes += q->bytes;
+        total.errors += q->errors;
+        total.kicks += q->kicks;
+        total.calls += q->calls;
+        for (b = 0; b < VHD_LATENCY_HIST_BUCKETS; b++) {
+            total.latency.buckets[b] += q->latency.buckets[b];
+        }
+        total.latency.total_ns += q->latency.total_ns;
+    }
+
+    if (g_conf.json) {
+        printf("{\"requests\": %" PRIu64 ", \"errors\": %" PRIu64
+               ", \"iops\": %.0f, \"bps\": %.0f, \"kicks\": %" PRIu64
+               ", \"calls\": %" PRIu64 ", \"latency_ns\": {\"mean\": %" PRIu64
+               ", \"p50\": %" PRIu64 ", \"p99\": %" PRIu64
+               ", \"p99.9\": %" PRIu64 "}, \"faults\": %" PRIu64 "}\n",
+               total.requests, total.errors, total.requests / secs,
+               total.bytes / secs, total.kicks, total.calls,
+               total.requests ? total.latency.total_ns / total.requests : 0,
+               vhd_latency_hist_percentile(&total.latency, 50),
+               vhd_latency_hist_percentile(&total.latency, 99),
+               vhd_latency_hist_percentile(&total.latency, 99.9),
+               g_master.faults);
+        return;
+    }
+
+    printf("requests:  %" PRIu64 " (%" PRIu64 " errors) in %.2f s\n",
+           total.requests, total.errors, secs);
+    printf("IOPS:      %.0f\n", total.requests / secs);
+    printf("bandwidth: %.1f MiB/s\n", total.bytes / secs / (1 << 20));
+    printf("kicks/req: %.3f\n",
+           total.requests ? (double)total.kicks / total.requests : 0.);
+    printf("calls/req: %.3f\n",
+           total.requests ? (double)total.calls / total.requests : 0.);
+    if (g_conf.postcopy) {
+        printf("faults:    %" PRIu64 "\n", g_master.faults);
+    }
+    printf("latency:   mean %.1f us, p50 %.1f us, p99 %.1f us, "
+           "p99.9 %.1f us\n",
+           total.requests ?
+           total.latency.total_ns / total.requests / 1000. : 0.,
+           vhd_latency_hist_percentile(&total.latency, 50) / 1000.,
+           vhd_latency_hist_percentile(&total.latency, 99) / 1000.,
+           vhd_latency_hist_percentile(&total.latency, 99.9) / 1000.);
+}
+
+static void usage(const char *cmd)
+{
+    printf("Usage: %s -s SOCKET [OPTION]...\n", cmd);
+    printf("Load a vhost-user-blk device with requests without a VM.\n");
+    printf("\n");
+    printf("Mandatory arguments to long options "
+           "are mandatory for short options too.\n");
+    printf("  -s, --socket-path=PATH     vhost-user socket of the device\n");
+    printf("  -q, --num-queues=N         virtqueues to drive, one thread"
+           " each (default 1)\n");
+    printf("  -d, --depth=N              requests in flight per virtqueue"
+           " (default 32)\n");
+    printf("  -b, --block-size=BYTES     size of a data buffer"
+           " (default 4096)\n");
+    printf("  -n, --segments=N           data buffers per request"
+           " (default 1)\n");
+    printf("  -w, --write-pct=N          percentage of writes (default 0)\n");
+    printf("  -r, --rate=IOPS            overall request rate limit"
+           " (default unlimited)\n");
+    printf("  -t, --time=SECONDS         duration of the run (default 10)\n");
+    printf("  -e, --event-idx            negotiate VIRTIO_F_EVENT_IDX\n");
+    printf("  -i, --indirect             use indirect descriptors\n");
+    printf("  -p, --poll                 busy poll the used rings with"
+           " interrupts suppressed\n");
+    printf("  -j, --json                 print the results as JSON\n");
+    printf("  -P, --postcopy             run as an incoming postcopy"
+           " migration, resolving\n"
+           "                             the device faults with zeroes\n");
+}
+
+static void parse_opts(int argc, char **argv)
+{
+    int opt;
+    do {
+        static struct option long_options[] = {
+            {"socket-path", 1, NULL, 's'},
+            {"num-queues",  1, NULL, 'q'},
+            {"depth",       1, NULL, 'd'},
+            {"block-size",  1, NULL, 'b'},
+            {"segments",    1, NULL, 'n'},
+            {"write-pct",   1, NULL, 'w'},
+            {"rate",        1, NULL, 'r'},
+            {"time",        1, NULL, 't'},
+            {"event-idx",   0, NULL, 'e'},
+            {"indirect",    0, NULL, 'i'},
+            {"poll",        0, NULL, 'p'},
+            {"json",        0, NULL, 'j'},
+            {"postcopy",    0, NULL, 'P'},
+            {0, 0, 0, 0}
+        };
+
+        opt = getopt_long(argc, argv, "s:q:d:b:n:w:r:t:eipjP", long_options,
+                          NULL);
+
+        switch (opt) {
+        case -1:
+            break;
+        case 's':
+            g_conf.socket_path = optarg;
+            break;
+        case 'q':
+            g_conf.num_queues = atoi(optarg);
+            break;
+        case 'd':
+            g_conf.depth = atoi(optarg);
+            break;
+        case 'b':
+            g_conf.block_size = atoi(optarg);
+            break;
+        case 'n':
+            g_conf.segments = atoi(optarg);
+            break;
+        case 'w':
+            g_conf.write_pct = atoi(optarg);
+            break;
+        case 'r':
+            g_conf.rate = strtoull(optarg, NULL, 0);
+            break;
+        case 't':
+            g_conf.duration = atoi(optarg);
+            break;
+        case 'e':
+            g_conf.event_idx = true;
+            break;
+        case 'i':
+            g_conf.indirect = true;
+            break;
+        case 'p':
+            g_conf.poll = true;
+            break;
+        case 'j':
+            g_conf.json = true;
+            break;
+        case 'P':
+            g_conf.postcopy = true;
+            break;
+        default:
+            usage(argv[0]);
+            exit(2);
+        }
+    } while (opt != -1);
+
+    if (!g_conf.socket_path || !g_conf.num_queues || !g_conf.depth ||
+        !g_conf.segments || g_conf.write_pct > 100 ||
+        !g_conf.block_size || g_conf.block_size % VHD_SECTOR_SIZE) {
+        usage(argv[0]);
+        exit(2);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    uint64_t start_ns;
+    unsigned i;
+
+    parse_opts(argc, argv);
+
+    g_master.queues = calloc(g_conf.num_queues, sizeof(g_master.queues[0]));
+
+    connect_device();
+    if (g_conf.postcopy) {
+        postcopy_start();
+    }
+    setup_memory();
+    for (i = 0; i < g_conf.num_queues; i++) {
+        start_queue(&g_master.queues[i]);
+    }
+
+    start_ns = clock_ns();
+    g_master.deadline_ns = start_ns + g_conf.duration * 1000000000ull;
+    for (i = 0; i < g_conf.num_queues; i++) {
+        if (pthread_create(&g_master.queues[i].thread, NULL, queue_thread,
+                           &g_master.queues[i])) {
+            DIE("can't create queue thread");
+        }
+    }
+    for (i = 0; i < g_conf.num_queues; i++) {
+        pthread_join(g_master.queues[i].thread, NULL);
+    }
+    if (g_conf.postcopy) {
+        postcopy_end();
+    }
+
+    report(clock_ns() - start_ns);
+
+    for (i = 0; i < g_conf.num_queues; i++) {
+        stop_queue(&g_master.queues[i]);
+    }
+    close(g_master.sock);
+
+    return 0;
+}
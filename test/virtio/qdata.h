@@ -225,6 +225,191 @@ struct queue_data {
     }
 };
 
+/* Driver side of a packed virtqueue */
+struct packed_queue_data {
+    uint16_t qsz;
+    std::vector<struct pvirtq_desc> ring;
+    struct pvirtq_event_suppress driver_event = {};
+    struct pvirtq_event_suppress device_event = {};
+    struct inflight_packed_region *inflight_region = nullptr;
+
+    uint16_t avail_idx = 0;
+    bool avail_wrap_counter = true;
+    uint16_t used_idx = 0;
+    bool used_wrap_counter = true;
+
+    /* Ring descriptors taken by each buffer id in flight */
+    std::vector<uint16_t> chain_descs;
+    uint16_t next_id = 0;
+
+    explicit packed_queue_data(uint16_t num_desc = default_queue_size) :
+        qsz(num_desc),
+        ring(qsz),
+        chain_descs(qsz)
+    {
+        for (pvirtq_desc &d : ring) {
+            memset(&d, 0, sizeof(d));
+        }
+
+        size_t inflight_size = sizeof(struct inflight_packed_region) +
+            sizeof(struct inflight_packed_desc) * qsz;
+        inflight_region =
+            (struct inflight_packed_region *) ::operator new(inflight_size);
+        memset(inflight_region, 0, inflight_size);
+        inflight_region->version = 0x1;
+        inflight_region->desc_num = num_desc;
+        inflight_region->used_wrap_counter = 1;
+        inflight_region->old_used_wrap_counter = 1;
+        for (uint16_t i = 0; i < num_desc; i++) {
+            inflight_region->desc[i].next = i + 1;
+        }
+    }
+
+    ~packed_queue_data()
+    {
+        ::operator delete(inflight_region);
+    }
+
+    packed_queue_data(const packed_queue_data &) = delete;
+    packed_queue_data &operator= (const packed_queue_data &) = delete;
+
+    /*
+     * Attach the ring to @vq with the vring base the master would send: the
+     * position of the driver's next available descriptor by default.
+     */
+    void attach_virtq(virtio_virtq *vq)
+    {
+        attach_virtq(vq, avail_idx | (uint32_t)avail_wrap_counter << 15);
+    }
+
+    void attach_virtq(virtio_virtq *vq, uint32_t base)
+    {
+        *vq = (struct virtio_virtq) {
+            .log_tag = "test_vq",
+            .desc = (virtq_desc *) ring.data(),
+            .avail = (virtq_avail *) &driver_event,
+            .used = (virtq_used *) &device_event,
+            .used_gpa_base = 0x1, /* to pass virtio_virtq_init check */
+            .qsz = qsz,
+            .packed = true,
+            .notify_fd = -1,
+            .inflight_packed = inflight_region,
+        };
+
+        virtq_set_base(vq, base);
+        virtio_virtq_init(vq);
+    }
+
+    uint16_t avail_flags()
+    {
+        return avail_wrap_counter ? VIRTQ_DESC_F_AVAIL : VIRTQ_DESC_F_USED;
+    }
+
+    void advance_avail()
+    {
+        if (++avail_idx == qsz) {
+            avail_idx = 0;
+            avail_wrap_counter = !avail_wrap_counter;
+        }
+    }
+
+    /* Make a descriptor chain available, return its buffer id */
+    uint16_t publish_chain(const std::vector<q_iovec> &chain)
+    {
+        uint16_t id = next_id++ % qsz;
+        uint16_t head = avail_idx;
+        uint16_t head_flags = 0;
+
+        for (size_t i = 0; i < chain.size(); i++) {
+            pvirtq_desc *pdesc = &ring[avail_idx];
+            uint16_t flags = avail_flags() |
+                (chain[i].dir == iodir::device_write ? VIRTQ_DESC_F_WRITE : 0) |
+                (i + 1 < chain.size() ? VIRTQ_DESC_F_NEXT : 0);
+
+            pdesc->addr = (uintptr_t)chain[i].addr;
+            pdesc->len = chain[i].len;
+            pdesc->id = id;
+            /* the head is made available last */
+            if (i == 0) {
+                head_flags = flags;
+            } else {
+                pdesc->flags = flags;
+            }
+            advance_avail();
+        }
+
+        ring[head].flags = head_flags;
+        chain_descs[id] = chain.size();
+        return id;
+    }
+
+    uint16_t publish_indirect_chain(const std::vector<q_iovec> &chain,
+                                    std::vector<pvirtq_desc> &out_table)
+    {
+        uint16_t id = next_id++ % qsz;
+
+        out_table.resize(chain.size());
+        for (size_t i = 0; i < chain.size(); ++i) {
+            out_table[i] = (pvirtq_desc) {
+                .addr = (uintptr_t)chain[i].addr,
+                .len = (uint32_t)chain[i].len,
+                .flags = (uint16_t)(chain[i].dir == iodir::device_write ?
+                                    VIRTQ_DESC_F_WRITE : 0),
+            };
+        }
+
+        pvirtq_desc *pdesc = &ring[avail_idx];
+        pdesc->addr = (uintptr_t)out_table.data();
+        pdesc->len = out_table.size() * sizeof(pvirtq_desc);
+        pdesc->id = id;
+        pdesc->flags = avail_flags() | VIRTQ_DESC_F_INDIRECT;
+        advance_avail();
+
+        chain_descs[id] = 1;
+        return id;
+    }
+
+    typedef std::function<void(virtio_iov *)> buffers_handler_func;
+
+    static void buffers_handler_cb(void *arg, virtio_virtq *vq, virtio_iov *iov)
+    {
+        buffers_handler_func *fptr = (buffers_handler_func *) arg;
+        (*fptr)(iov);
+    }
+
+    int kick_virtq(virtio_virtq *vq, buffers_handler_func func)
+    {
+        return virtq_dequeue_many(vq, buffers_handler_cb, &func);
+    }
+
+    void commit_buffers(virtio_virtq *vq, virtio_iov *iov, uint32_t len)
+    {
+        virtq_push(vq, iov, len);
+        virtio_free_iov(iov);
+    }
+
+    std::vector<pvirtq_desc> collect_used()
+    {
+        std::vector<pvirtq_desc> used;
+        while (true) {
+            pvirtq_desc desc = ring[used_idx];
+            if (!!(desc.flags & VIRTQ_DESC_F_AVAIL) != used_wrap_counter ||
+                !!(desc.flags & VIRTQ_DESC_F_USED) != used_wrap_counter) {
+                break;
+            }
+
+            used.push_back(desc);
+            used_idx += chain_descs[desc.id];
+            if (used_idx >= qsz) {
+                used_idx -= qsz;
+                used_wrap_counter = !used_wrap_counter;
+            }
+        }
+
+        return used;
+    }
+};
+
 struct desc_chain {
     bool is_indirect;
     std::vector<q_iovec> buffers;
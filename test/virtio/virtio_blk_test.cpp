@@ -26,11 +26,21 @@ using namespace virtio_test;
 
 // virtio memory mapper mock
 extern "C" {
-void *gpa_range_to_ptr(struct vhd_memory_map *mm, uint64_t gpa, size_t len)
+void *gpa_range_to_ptr(struct vhd_memory_map *mm, uint64_t gpa, size_t len,
+                       unsigned *hint)
 {
     return (void *)gpa;
 }
 
+void *gpa_to_ptr_partial(struct vhd_memory_map *mm, uint64_t gpa, size_t *len,
+                         unsigned *hint, uint32_t *region_id,
+                         uint64_t *region_offset)
+{
+    *region_id = 0;
+    *region_offset = gpa;
+    return (void *)gpa;
+}
+
 void vhd_memmap_ref(struct vhd_memory_map *mm)
 {
 }
@@ -47,6 +57,7 @@ static const char *default_disk_id = "01234567899876543210"; // Make sure it is
 struct bdev_request {
     virtio_blk_req_hdr hdr;
     std::vector<std::vector<uint8_t> *> buffers;
+    std::vector<virtio_blk_discard_write_zeroes> ranges;
     uint8_t status;
 
     std::vector<q_iovec> iovecs;
@@ -82,18 +93,53 @@ struct bdev_request {
         return req;
     }
 
+    static std::shared_ptr<bdev_request> make_flush()
+    {
+        auto req = std::make_shared<bdev_request>(
+            std::vector<std::vector<uint8_t> *>{}, iodir::device_read);
+        req->hdr.type = VIRTIO_BLK_T_FLUSH;
+        req->hdr.sector = 0;
+        return req;
+    }
+
+    static std::shared_ptr<bdev_request> make_discard_write_zeroes(
+        uint32_t type,
+        const std::vector<virtio_blk_discard_write_zeroes> &ranges)
+    {
+        auto req = std::make_shared<bdev_request>(
+            std::vector<std::vector<uint8_t> *>{}, iodir::device_read);
+        req->hdr.type = type;
+        req->hdr.sector = 0;
+        req->ranges = ranges;
+        req->iovecs.insert(req->iovecs.begin() + 1,
+                           {req->ranges.data(),
+                            req->ranges.size() * sizeof(ranges[0]),
+                            iodir::device_read});
+        return req;
+    }
+
     bool is_io() const
     {
-        return hdr.type == VIRTIO_BLK_T_IN || hdr.type == VIRTIO_BLK_T_OUT;
+        return hdr.type == VIRTIO_BLK_T_IN || hdr.type == VIRTIO_BLK_T_OUT ||
+            hdr.type == VIRTIO_BLK_T_FLUSH ||
+            hdr.type == VIRTIO_BLK_T_DISCARD ||
+            hdr.type == VIRTIO_BLK_T_WRITE_ZEROES;
     }
 
     uint64_t sector() const
     {
+        if (!ranges.empty()) {
+            return ranges[0].sector;
+        }
         return hdr.sector;
     }
 
     uint64_t total_sectors() const
     {
+        if (!ranges.empty()) {
+            return ranges[0].num_sectors;
+        }
+
         uint64_t total = 0;
         for (const auto *buf : buffers) {
             total += buf->size() / 512;
@@ -108,7 +154,7 @@ struct test_bdev {
     virtio_blk_dev vdev;
     virtio_blk_io_dispatch dispatch;
 
-    vhd_bdev_info bdev;
+    vhd_bdev_info bdev = {};
 
     queue_data qdata;
     virtio_virtq vq;
@@ -119,8 +165,15 @@ struct test_bdev {
     std::queue<std::shared_ptr<bdev_request>> completed_requests;
 
     std::vector<uint8_t> blocks;
+    unsigned num_flushes = 0;
+    size_t last_nbuffers = 0;
+
+    /* what the track hook has seen, and the readahead hints passed on */
+    std::vector<std::pair<uint64_t, uint64_t>> tracked;
+    std::vector<uint32_t> readahead_hints;
 
-    test_bdev(uint64_t block_size, uint64_t total_blocks, const char *id) :
+    test_bdev(uint64_t block_size, uint64_t total_blocks, const char *id,
+              bool merge_buffers = false) :
         disk_id(id), blocks(block_size * total_blocks, 0xAA)
     {
         qdata.attach_virtq(&vq);
@@ -130,6 +183,12 @@ struct test_bdev {
         bdev.total_blocks = total_blocks;
         bdev.readonly = false;
         bdev.num_queues = 1;
+        bdev.writeback_cache = true;
+        bdev.max_discard_sectors = 64;
+        bdev.max_write_zeroes_sectors = 64;
+        bdev.max_discard_segments = 2;
+        bdev.max_write_zeroes_segments = 8;
+        bdev.merge_buffers = merge_buffers;
 
         int res = virtio_blk_init_dev(&vdev, &bdev, dispatch_io);
 
@@ -190,18 +249,17 @@ struct test_bdev {
         return blocks.data() + (block * bdev.block_size);
     }
 
-    void handle_io(vhd_bdev_io *bdev_io)
+    void handle_rw(vhd_bdev_io *bdev_io)
     {
-        struct vhd_bio *bio = containerof(bdev_io, struct vhd_bio, bdev_io);
-        std::shared_ptr<bdev_request> req = requests.front();
-
-        CU_ASSERT(req->sector() == bdev_io->first_sector);
-        CU_ASSERT(req->total_sectors() == bdev_io->total_sectors);
-
         vhd_buffer *pbuf = bdev_io->sglist.buffers;
         uint64_t block = sectors_to_blocks(bdev_io->first_sector);
         uint64_t rem_blocks = sectors_to_blocks(bdev_io->total_sectors);
 
+        last_nbuffers = bdev_io->sglist.nbuffers;
+        if (bdev_io->type == VHD_BDEV_READ) {
+            readahead_hints.push_back(bdev_io->readahead_sectors);
+        }
+
         for (size_t i = 0; i < bdev_io->sglist.nbuffers; ++i) {
             CU_ASSERT(pbuf->len != 0 &&
                       ((pbuf->len & (bdev.block_size - 1)) == 0));
@@ -211,10 +269,8 @@ struct test_bdev {
 
             if (bdev_io->type == VHD_BDEV_READ) {
                 memcpy(pbuf->base, get_block(block), pbuf->len);
-            } else if (bdev_io->type == VHD_BDEV_WRITE) {
-                memcpy(get_block(block), pbuf->base, pbuf->len);
             } else {
-                CU_ASSERT(0);
+                memcpy(get_block(block), pbuf->base, pbuf->len);
             }
 
             block += blocks;
@@ -223,6 +279,51 @@ struct test_bdev {
         }
 
         CU_ASSERT(rem_blocks == 0);
+    }
+
+    void handle_ranges(vhd_bdev_io *bdev_io,
+                       const std::shared_ptr<bdev_request> &req)
+    {
+        CU_ASSERT(bdev_io->sglist.nbuffers == 0);
+        CU_ASSERT_FATAL(bdev_io->nranges == req->ranges.size());
+
+        for (size_t i = 0; i < req->ranges.size(); ++i) {
+            const vhd_bdev_range &range = bdev_io->ranges[i];
+            CU_ASSERT(range.first_sector == req->ranges[i].sector);
+            CU_ASSERT(range.total_sectors == req->ranges[i].num_sectors);
+            CU_ASSERT(range.unmap ==
+                      !!(req->ranges[i].flags & VIRTIO_BLK_WZ_F_UNMAP));
+
+            memset(blocks.data() + range.first_sector * VHD_SECTOR_SIZE, 0,
+                   range.total_sectors * VHD_SECTOR_SIZE);
+        }
+    }
+
+    void handle_io(vhd_bdev_io *bdev_io)
+    {
+        struct vhd_bio *bio = containerof(bdev_io, struct vhd_bio, bdev_io);
+        std::shared_ptr<bdev_request> req = requests.front();
+
+        CU_ASSERT(req->sector() == bdev_io->first_sector);
+        CU_ASSERT(req->total_sectors() == bdev_io->total_sectors);
+
+        switch (bdev_io->type) {
+        case VHD_BDEV_READ:
+        case VHD_BDEV_WRITE:
+            handle_rw(bdev_io);
+            break;
+        case VHD_BDEV_FLUSH:
+            CU_ASSERT(bdev_io->sglist.nbuffers == 0);
+            num_flushes++;
+            break;
+        case VHD_BDEV_DISCARD:
+        case VHD_BDEV_WRITE_ZEROES:
+            handle_ranges(bdev_io, req);
+            break;
+        default:
+            CU_ASSERT(0);
+        }
+
         bio->status = VHD_BDEV_SUCCESS;
         bio->completion_handler(bio);
 
@@ -237,6 +338,17 @@ struct test_bdev {
         return 0;
     }
 
+    /* records the requests and asks to read ahead as much as each read */
+    static void track_io(struct virtio_virtq *vq, struct vhd_bdev_io *bdev_io)
+    {
+        test_bdev *self = containerof(vq, test_bdev, vq);
+        self->tracked.emplace_back(bdev_io->first_sector,
+                                   bdev_io->total_sectors);
+        if (bdev_io->type == VHD_BDEV_READ) {
+            bdev_io->readahead_sectors = bdev_io->total_sectors;
+        }
+    }
+
     void execute_request(const std::vector<q_iovec> &iovecs)
     {
         uint16_t head = qdata.build_descriptor_chain(iovecs);
@@ -442,6 +554,321 @@ static void multibuffer_io_test(void)
     }
 }
 
+static void merge_buffers_test(void)
+{
+    uint8_t status;
+    test_bdev bdev(default_block_size, default_block_count, default_disk_id,
+                   true);
+    const size_t bs = bdev.block_size();
+
+    for (uint64_t block = 0; block < bdev.total_blocks(); ++block) {
+        bdev.set_block(block, (uint8_t)block);
+    }
+
+    /*
+     * Carve the data buffers out of a single area, with a gap after every
+     * 4th one, so that they merge into 4 buffers
+     */
+    std::vector<uint8_t> area(bs * 20);
+    std::vector<std::vector<uint8_t> *> buffers;
+    for (size_t i = 0; i < 16; ++i) {
+        buffers.push_back(new std::vector<uint8_t>(bs));
+    }
+
+    auto req = bdev_request::make_io(iodir::req_read, 0, buffers);
+    for (size_t i = 0; i < 16; ++i) {
+        req->iovecs[i + 1].addr = area.data() + (i + i / 4) * bs;
+    }
+
+    status = bdev.execute_request(req);
+    CU_ASSERT(status == VIRTIO_BLK_S_OK);
+    CU_ASSERT(bdev.last_nbuffers == 4);
+    for (size_t i = 0; i < 16; ++i) {
+        validate_buffer(area.data() + (i + i / 4) * bs, bs / 512, (uint8_t)i);
+    }
+
+    /* Merged buffers are limited to max_segment_size */
+    bdev.bdev.max_segment_size = 3 * bs;
+    status = bdev.execute_request(req);
+    CU_ASSERT(status == VIRTIO_BLK_S_OK);
+    CU_ASSERT(bdev.last_nbuffers == 8);
+
+    /* A couple of merged buffers are stored inline */
+    bdev.bdev.max_segment_size = 0;
+    for (size_t i = 0; i < 16; ++i) {
+        req->iovecs[i + 1].addr = area.data() + (i + i / 8) * bs;
+    }
+    status = bdev.execute_request(req);
+    CU_ASSERT(status == VIRTIO_BLK_S_OK);
+    CU_ASSERT(bdev.last_nbuffers == 2);
+
+    for (std::vector<uint8_t> *buf : buffers) {
+        delete buf;
+    }
+}
+
+/*
+ * Requests to contiguous sectors fetched together reach the backend merged
+ */
+static void merge_requests_test(void)
+{
+    test_bdev bdev;
+    const size_t bs = bdev.block_size();
+
+    bdev.bdev.max_merged_sectors = bdev.blocks_to_sectors(3);
+
+    /* 4 contiguous writes, the 4th over the limit, then a separate one */
+    std::vector<std::vector<uint8_t>> bufs;
+    for (unsigned i = 0; i < 5; i++) {
+        bufs.emplace_back(bs, 0x10 + i);
+    }
+    const uint64_t blocks[] = {0, 1, 2, 3, 10};
+    std::vector<std::shared_ptr<bdev_request>> reqs;
+    for (unsigned i = 0; i < 5; i++) {
+        auto req = bdev_request::make_io(
+            iodir::req_write, bdev.blocks_to_sectors(blocks[i]),
+            std::vector<std::vector<uint8_t> *>{&bufs[i]});
+        reqs.push_back(req);
+        bdev.qdata.publish_avail(
+            bdev.qdata.build_descriptor_chain(req->iovecs));
+    }
+
+    /* what the backend is expected to get */
+    std::vector<uint8_t> merged(3 * bs);
+    bdev.requests.push(bdev_request::make_io(
+        iodir::req_write, 0, std::vector<std::vector<uint8_t> *>{&merged}));
+    bdev.requests.push(reqs[3]);
+    bdev.requests.push(reqs[4]);
+
+    CU_ASSERT(virtio_blk_dispatch_requests(&bdev.vdev, &bdev.vq) == 0);
+    CU_ASSERT(bdev.requests.empty());
+    CU_ASSERT(bdev.completed_requests.size() == 3);
+    CU_ASSERT(bdev.qdata.collect_used().size() == 5);
+
+    for (unsigned i = 0; i < 5; i++) {
+        CU_ASSERT(reqs[i]->status == VIRTIO_BLK_S_OK);
+        validate_buffer(bdev.get_block(blocks[i]), bs / 512, 0x10 + i);
+    }
+}
+
+/*
+ * Requests spanning split boundaries reach the backend in parts
+ */
+static void split_requests_test(void)
+{
+    test_bdev bdev;
+    const size_t bs = bdev.block_size();
+
+    bdev.bdev.split_boundary_sectors = bdev.blocks_to_sectors(2);
+
+    std::vector<uint8_t> buf1(2 * bs, 0x55), buf2(2 * bs, 0x66);
+    auto req = bdev_request::make_io(
+        iodir::req_write, bdev.blocks_to_sectors(1),
+        std::vector<std::vector<uint8_t> *>{&buf1, &buf2});
+    bdev.qdata.publish_avail(bdev.qdata.build_descriptor_chain(req->iovecs));
+
+    /* blocks 1, 2-3 and 4 */
+    std::vector<uint8_t> part1(bs), part2(2 * bs), part3(bs);
+    bdev.requests.push(bdev_request::make_io(
+        iodir::req_write, bdev.blocks_to_sectors(1),
+        std::vector<std::vector<uint8_t> *>{&part1}));
+    bdev.requests.push(bdev_request::make_io(
+        iodir::req_write, bdev.blocks_to_sectors(2),
+        std::vector<std::vector<uint8_t> *>{&part2}));
+    bdev.requests.push(bdev_request::make_io(
+        iodir::req_write, bdev.blocks_to_sectors(4),
+        std::vector<std::vector<uint8_t> *>{&part3}));
+
+    CU_ASSERT(virtio_blk_dispatch_requests(&bdev.vdev, &bdev.vq) == 0);
+    CU_ASSERT(bdev.requests.empty());
+    CU_ASSERT(bdev.completed_requests.size() == 3);
+    CU_ASSERT(bdev.last_nbuffers == 1);
+    CU_ASSERT(bdev.qdata.collect_used().size() == 1);
+    CU_ASSERT(req->status == VIRTIO_BLK_S_OK);
+
+    validate_buffer(bdev.get_block(1), 2 * bs / 512, 0x55);
+    validate_buffer(bdev.get_block(3), 2 * bs / 512, 0x66);
+}
+
+/*
+ * The track hook sees a read before it's split, and the readahead hint it
+ * gives goes with the part ending where the read does
+ */
+static void split_readahead_test(void)
+{
+    test_bdev bdev;
+    const size_t bs = bdev.block_size();
+
+    bdev.bdev.split_boundary_sectors = bdev.blocks_to_sectors(2);
+    bdev.vdev.track = test_bdev::track_io;
+
+    std::vector<uint8_t> buf(4 * bs);
+    auto req = bdev_request::make_io(
+        iodir::req_read, bdev.blocks_to_sectors(1),
+        std::vector<std::vector<uint8_t> *>{&buf});
+    bdev.qdata.publish_avail(bdev.qdata.build_descriptor_chain(req->iovecs));
+
+    /* blocks 1, 2-3 and 4 */
+    std::vector<uint8_t> part1(bs), part2(2 * bs), part3(bs);
+    bdev.requests.push(bdev_request::make_io(
+        iodir::req_read, bdev.blocks_to_sectors(1),
+        std::vector<std::vector<uint8_t> *>{&part1}));
+    bdev.requests.push(bdev_request::make_io(
+        iodir::req_read, bdev.blocks_to_sectors(2),
+        std::vector<std::vector<uint8_t> *>{&part2}));
+    bdev.requests.push(bdev_request::make_io(
+        iodir::req_read, bdev.blocks_to_sectors(4),
+        std::vector<std::vector<uint8_t> *>{&part3}));
+
+    CU_ASSERT(virtio_blk_dispatch_requests(&bdev.vdev, &bdev.vq) == 0);
+    CU_ASSERT(bdev.requests.empty());
+    CU_ASSERT(bdev.qdata.collect_used().size() == 1);
+    CU_ASSERT(req->status == VIRTIO_BLK_S_OK);
+
+    CU_ASSERT_FATAL(bdev.tracked.size() == 1);
+    CU_ASSERT(bdev.tracked[0].first == bdev.blocks_to_sectors(1));
+    CU_ASSERT(bdev.tracked[0].second == bdev.blocks_to_sectors(4));
+    const uint32_t hint = bdev.blocks_to_sectors(4);
+    CU_ASSERT(bdev.readahead_hints == std::vector<uint32_t>({0, 0, hint}));
+}
+
+/*
+ * Reads through any device of an image are completed from the shared cache
+ * once cached, until the blocks are written
+ */
+static void read_cache_test(void)
+{
+    uint8_t status;
+    test_bdev bdev1, bdev2;
+    const size_t bs = bdev1.block_size();
+    vhd_bdev_cache_stat stat;
+
+    vhd_bdev_cache *cache = vhd_bdev_cache_new(1024 * 1024);
+    CU_ASSERT_FATAL(cache != NULL);
+    for (test_bdev *bdev : {&bdev1, &bdev2}) {
+        bdev->bdev.cache = cache;
+        bdev->bdev.cache_image_id = 42;
+    }
+
+    for (uint64_t block = 0; block < bdev1.total_blocks(); ++block) {
+        bdev1.set_block(block, 0x11);
+        bdev2.set_block(block, 0x22);
+    }
+
+    std::vector<uint8_t> buf(4 * bs, 0);
+    auto req = bdev_request::make_io(iodir::req_read, 0,
+                                     std::vector<std::vector<uint8_t> *>{&buf});
+
+    status = bdev1.execute_request(req);
+    CU_ASSERT(status == VIRTIO_BLK_S_OK);
+    validate_buffer(buf.data(), 4 * bs / 512, 0x11);
+
+    /* the backend isn't reached, including for partial blocks */
+    std::fill(buf.begin(), buf.end(), 0);
+    status = bdev2.execute_request_nocb(req);
+    CU_ASSERT(status == VIRTIO_BLK_S_OK);
+    CU_ASSERT(bdev2.completed_requests.empty());
+    validate_buffer(buf.data(), 4 * bs / 512, 0x11);
+
+    std::vector<uint8_t> part(1024, 0);
+    auto part_req = bdev_request::make_io(
+        iodir::req_read, 3, std::vector<std::vector<uint8_t> *>{&part});
+    status = bdev2.execute_request_nocb(part_req);
+    CU_ASSERT(status == VIRTIO_BLK_S_OK);
+    validate_buffer(part.data(), 2, 0x11);
+
+    /* written blocks are dropped for all devices of the image */
+    std::vector<uint8_t> wbuf(bs, 0x33);
+    auto wreq = bdev_request::make_io(
+        iodir::req_write, bdev1.blocks_to_sectors(1),
+        std::vector<std::vector<uint8_t> *>{&wbuf});
+    status = bdev1.execute_request(wreq);
+    CU_ASSERT(status == VIRTIO_BLK_S_OK);
+
+    status = bdev2.execute_request(req);
+    CU_ASSERT(status == VIRTIO_BLK_S_OK);
+    validate_buffer(buf.data(), 4 * bs / 512, 0x22);
+
+    vhd_bdev_cache_get_stat(cache, &stat);
+    CU_ASSERT(stat.hits == 2);
+    CU_ASSERT(stat.misses == 2);
+    CU_ASSERT(stat.bytes == 4 * bs);
+
+    vhd_bdev_cache_free(cache);
+}
+
+/*
+ * Misaligned data buffers reach the backend bounced through aligned ones,
+ * aligned ones as is
+ */
+static void bounce_test(void)
+{
+    uint8_t status;
+    test_bdev bdev;
+    const size_t bs = bdev.block_size();
+    vhd_bounce_pool_stat stat;
+
+    vhd_bounce_pool *pool = vhd_bounce_pool_new(bs, bs, 1);
+    CU_ASSERT_FATAL(pool != NULL);
+    bdev.bdev.bounce_pool = pool;
+
+    /* two halves of a block at odd addresses, then an aligned block */
+    uint8_t *area = (uint8_t *)aligned_alloc(bs, 4 * bs);
+    std::vector<std::vector<uint8_t> *> buffers;
+    for (size_t len : {bs / 2, bs / 2, bs}) {
+        buffers.push_back(new std::vector<uint8_t>(len));
+    }
+    auto req = bdev_request::make_io(iodir::req_write,
+                                     bdev.blocks_to_sectors(1), buffers);
+    req->iovecs[1].addr = area + 1;
+    req->iovecs[2].addr = area + bs + 3;
+    req->iovecs[3].addr = area + 3 * bs;
+    memset(area + 1, 0x12, bs / 2);
+    memset(area + bs + 3, 0x12, bs / 2);
+    memset(area + 3 * bs, 0x34, bs);
+
+    status = bdev.execute_request(req);
+    CU_ASSERT(status == VIRTIO_BLK_S_OK);
+    CU_ASSERT(bdev.last_nbuffers == 2);
+    validate_buffer(bdev.get_block(1), bs / 512, 0x12);
+    validate_buffer(bdev.get_block(2), bs / 512, 0x34);
+
+    /* the data read is copied back; a run too big falls back to the heap */
+    bdev.set_block(1, 0x56);
+    bdev.set_block(2, 0x78);
+    std::vector<std::vector<uint8_t> *> rbuffers;
+    for (size_t len : {bs / 2, bs / 2 + 512, bs - 512}) {
+        rbuffers.push_back(new std::vector<uint8_t>(len));
+    }
+    auto rreq = bdev_request::make_io(iodir::req_read,
+                                      bdev.blocks_to_sectors(1), rbuffers);
+    rreq->iovecs[1].addr = area + 1;
+    rreq->iovecs[2].addr = area + bs + 3;
+    rreq->iovecs[3].addr = area + 3 * bs + 5;
+
+    status = bdev.execute_request(rreq);
+    CU_ASSERT(status == VIRTIO_BLK_S_OK);
+    CU_ASSERT(bdev.last_nbuffers == 1);
+    CU_ASSERT(area[1] == 0x56 && area[bs / 2] == 0x56);
+    CU_ASSERT(area[bs + 3] == 0x56 && area[bs + 3 + bs / 2 - 1] == 0x56);
+    CU_ASSERT(area[bs + 3 + bs / 2] == 0x78 && area[3 * bs + 5] == 0x78);
+    CU_ASSERT(area[4 * bs - 508] == 0x78);
+
+    vhd_bounce_pool_get_stat(pool, &stat);
+    CU_ASSERT(stat.bounced == 2);
+    CU_ASSERT(stat.allocated == 1);
+    CU_ASSERT(stat.bufs_in_use == 0);
+
+    for (std::vector<uint8_t> *buf : buffers) {
+        delete buf;
+    }
+    for (std::vector<uint8_t> *buf : rbuffers) {
+        delete buf;
+    }
+    free(area);
+    vhd_bounce_pool_free(pool);
+}
+
 static void empty_request_test(void)
 {
     uint8_t status;
@@ -754,6 +1181,207 @@ static void getid_test(void)
     }
 }
 
+static void flush_discard_write_zeroes_test(void)
+{
+    uint8_t status;
+    test_bdev bdev;
+
+    uint64_t features = virtio_blk_get_features(&bdev.vdev);
+    CU_ASSERT(features & (1ull << VIRTIO_BLK_F_FLUSH));
+    CU_ASSERT(features & (1ull << VIRTIO_BLK_F_DISCARD));
+    CU_ASSERT(features & (1ull << VIRTIO_BLK_F_WRITE_ZEROES));
+    CU_ASSERT(!(features & (1ull << VIRTIO_BLK_F_RO)));
+
+    for (uint64_t block = 0; block < bdev.total_blocks(); ++block) {
+        bdev.set_block(block, 0xAF);
+    }
+
+    // Flush
+    {
+        auto req = bdev_request::make_flush();
+        status = bdev.execute_request(req);
+        CU_ASSERT(status == VIRTIO_BLK_S_OK);
+        CU_ASSERT(bdev.num_flushes == 1);
+    }
+
+    // Discard two ranges and write zeroes to a third one
+    {
+        auto req = bdev_request::make_discard_write_zeroes(
+                VIRTIO_BLK_T_DISCARD, {{0, 8, 0}, {32, 8, 0}});
+        status = bdev.execute_request(req);
+        CU_ASSERT(status == VIRTIO_BLK_S_OK);
+
+        req = bdev_request::make_discard_write_zeroes(
+                VIRTIO_BLK_T_WRITE_ZEROES, {{64, 64, VIRTIO_BLK_WZ_F_UNMAP}});
+        status = bdev.execute_request(req);
+        CU_ASSERT(status == VIRTIO_BLK_S_OK);
+    }
+
+    // Read entire disk and validate
+    {
+        std::vector<uint8_t> buf(bdev.total_blocks() * bdev.block_size(), 0);
+        auto req = bdev_request::make_io(
+                iodir::req_read,
+                0,
+                std::vector<std::vector<uint8_t> *>{&buf});
+
+        status = bdev.execute_request(req);
+        CU_ASSERT(status == VIRTIO_BLK_S_OK);
+
+        uint8_t *pdata = buf.data();
+        validate_buffer(pdata, 8, 0);
+        validate_buffer(pdata + 8 * 512, 24, 0xAF);
+        validate_buffer(pdata + 32 * 512, 8, 0);
+        validate_buffer(pdata + 40 * 512, 24, 0xAF);
+        validate_buffer(pdata + 64 * 512, 64, 0);
+        validate_buffer(pdata + 128 * 512, bdev.total_sectors() - 128, 0xAF);
+    }
+
+    // Too many segments
+    {
+        auto req = bdev_request::make_discard_write_zeroes(
+                VIRTIO_BLK_T_DISCARD, {{0, 8, 0}, {16, 8, 0}, {32, 8, 0}});
+        status = bdev.execute_request(req);
+        CU_ASSERT(status == VIRTIO_BLK_S_IOERR);
+    }
+
+    // Range exceeds max sectors
+    {
+        auto req = bdev_request::make_discard_write_zeroes(
+                VIRTIO_BLK_T_WRITE_ZEROES, {{0, 65, 0}});
+        status = bdev.execute_request(req);
+        CU_ASSERT(status == VIRTIO_BLK_S_IOERR);
+    }
+
+    // Range out of device bounds
+    {
+        auto req = bdev_request::make_discard_write_zeroes(
+                VIRTIO_BLK_T_WRITE_ZEROES,
+                {{0, 8, 0}, {bdev.total_sectors() - 4, 8, 0}});
+        status = bdev.execute_request(req);
+        CU_ASSERT(status == VIRTIO_BLK_S_IOERR);
+    }
+
+    // Discard must not have the unmap flag set
+    {
+        auto req = bdev_request::make_discard_write_zeroes(
+                VIRTIO_BLK_T_DISCARD, {{0, 8, VIRTIO_BLK_WZ_F_UNMAP}});
+        status = bdev.execute_request(req);
+        CU_ASSERT(status == VIRTIO_BLK_S_UNSUPP);
+    }
+
+    // Backend without write cache, discard and write zeroes support
+    bdev.bdev.writeback_cache = false;
+    bdev.bdev.max_discard_sectors = 0;
+    bdev.bdev.max_write_zeroes_sectors = 0;
+    CU_ASSERT_FATAL(virtio_blk_init_dev(&bdev.vdev, &bdev.bdev,
+                                        test_bdev::dispatch_io) == 0);
+
+    features = virtio_blk_get_features(&bdev.vdev);
+    CU_ASSERT(!(features & (1ull << VIRTIO_BLK_F_FLUSH)));
+    CU_ASSERT(!(features & (1ull << VIRTIO_BLK_F_DISCARD)));
+    CU_ASSERT(!(features & (1ull << VIRTIO_BLK_F_WRITE_ZEROES)));
+
+    {
+        auto req = bdev_request::make_flush();
+        status = bdev.execute_request(req);
+        CU_ASSERT(status == VIRTIO_BLK_S_UNSUPP);
+
+        req = bdev_request::make_discard_write_zeroes(
+                VIRTIO_BLK_T_DISCARD, {{0, 8, 0}});
+        status = bdev.execute_request(req);
+        CU_ASSERT(status == VIRTIO_BLK_S_UNSUPP);
+
+        req = bdev_request::make_discard_write_zeroes(
+                VIRTIO_BLK_T_WRITE_ZEROES, {{0, 8, 0}});
+        status = bdev.execute_request(req);
+        CU_ASSERT(status == VIRTIO_BLK_S_UNSUPP);
+    }
+    CU_ASSERT(bdev.num_flushes == 1);
+}
+
+/*
+ * Writes of all zeroes are turned into write zeroes requests if enabled
+ */
+static void detect_zeroes_test(void)
+{
+    uint8_t status;
+    test_bdev bdev;
+    const size_t bs = bdev.block_size();
+
+    bdev.bdev.detect_zeroes = true;
+    bdev.bdev.detect_zeroes_unmap = true;
+
+    std::vector<uint8_t> zero1(2 * bs, 0), zero2(bs, 0);
+    auto req = bdev_request::make_io(
+        iodir::req_write, bdev.blocks_to_sectors(1),
+        std::vector<std::vector<uint8_t> *>{&zero1, &zero2});
+    bdev.qdata.publish_avail(bdev.qdata.build_descriptor_chain(req->iovecs));
+    bdev.requests.push(bdev_request::make_discard_write_zeroes(
+        VIRTIO_BLK_T_WRITE_ZEROES,
+        {{bdev.blocks_to_sectors(1),
+          (uint32_t)bdev.blocks_to_sectors(3), VIRTIO_BLK_WZ_F_UNMAP}}));
+
+    CU_ASSERT(virtio_blk_dispatch_requests(&bdev.vdev, &bdev.vq) == 0);
+    CU_ASSERT(bdev.requests.empty());
+    CU_ASSERT(bdev.completed_requests.size() == 1);
+    CU_ASSERT(bdev.qdata.collect_used().size() == 1);
+    CU_ASSERT(req->status == VIRTIO_BLK_S_OK);
+    validate_buffer(bdev.get_block(1), 3 * bs / 512, 0);
+    validate_buffer(bdev.get_block(4), bs / 512, 0xAA);
+    bdev.completed_requests.pop();
+
+    /* a single non-zero byte, even at the end, keeps it a write */
+    std::vector<uint8_t> data(2 * bs, 0);
+    data.back() = 0x77;
+    req = bdev_request::make_io(iodir::req_write, bdev.blocks_to_sectors(4),
+                                std::vector<std::vector<uint8_t> *>{&data});
+    status = bdev.execute_request(req);
+    CU_ASSERT(status == VIRTIO_BLK_S_OK);
+    CU_ASSERT(bdev.get_block(5)[bs - 1] == 0x77);
+
+    /* as do the ones the backend can't zero at once */
+    std::vector<uint8_t> big(bdev.bdev.max_write_zeroes_sectors * 512 + bs, 0);
+    req = bdev_request::make_io(iodir::req_write, 0,
+                                std::vector<std::vector<uint8_t> *>{&big});
+    status = bdev.execute_request(req);
+    CU_ASSERT(status == VIRTIO_BLK_S_OK);
+    CU_ASSERT(bdev.last_nbuffers == 1);
+}
+
+static void config_test(void)
+{
+    test_bdev bdev(4096, default_block_count, default_disk_id);
+    const virtio_blk_config &config = bdev.vdev.config;
+
+    // Defaults
+    CU_ASSERT(config.capacity == bdev.total_sectors());
+    CU_ASSERT(config.size_max == 0);
+    CU_ASSERT(config.seg_max == 126);
+    CU_ASSERT(config.topology.physical_block_exp == 3);
+    CU_ASSERT(config.topology.alignment_offset == 0);
+    CU_ASSERT(config.topology.min_io_size == 1);
+    CU_ASSERT(config.topology.opt_io_size == 0);
+    CU_ASSERT(!(virtio_blk_get_features(&bdev.vdev) &
+                (1ull << VIRTIO_BLK_F_SIZE_MAX)));
+
+    bdev.bdev.max_segment_size = 64 * 1024;
+    bdev.bdev.max_segments = 2;
+    bdev.bdev.min_io_size = 4096;
+    bdev.bdev.opt_io_size = 128 * 1024;
+    bdev.bdev.alignment_offset = 1024;
+    CU_ASSERT_FATAL(virtio_blk_init_dev(&bdev.vdev, &bdev.bdev,
+                                        test_bdev::dispatch_io) == 0);
+
+    CU_ASSERT(config.size_max == 64 * 1024);
+    CU_ASSERT(config.seg_max == 2);
+    CU_ASSERT(config.topology.alignment_offset == 2);
+    CU_ASSERT(config.topology.min_io_size == 8);
+    CU_ASSERT(config.topology.opt_io_size == 256);
+    CU_ASSERT(virtio_blk_get_features(&bdev.vdev) &
+              (1ull << VIRTIO_BLK_F_SIZE_MAX));
+}
+
 int main(void)
 {
     int res = 0;
@@ -773,11 +1401,20 @@ int main(void)
 
     CU_ADD_TEST(suite, io_requests_test);
     CU_ADD_TEST(suite, multibuffer_io_test);
+    CU_ADD_TEST(suite, merge_buffers_test);
+    CU_ADD_TEST(suite, merge_requests_test);
+    CU_ADD_TEST(suite, split_requests_test);
+    CU_ADD_TEST(suite, split_readahead_test);
+    CU_ADD_TEST(suite, read_cache_test);
+    CU_ADD_TEST(suite, bounce_test);
     CU_ADD_TEST(suite, empty_request_test);
     CU_ADD_TEST(suite, oob_request_test);
     CU_ADD_TEST(suite, bad_request_layout_test);
     CU_ADD_TEST(suite, bad_iodir_test);
     CU_ADD_TEST(suite, getid_test);
+    CU_ADD_TEST(suite, flush_discard_write_zeroes_test);
+    CU_ADD_TEST(suite, detect_zeroes_test);
+    CU_ADD_TEST(suite, config_test);
 
     CU_basic_set_mode(CU_BRM_VERBOSE);
     CU_basic_run_tests();
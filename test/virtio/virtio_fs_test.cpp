@@ -0,0 +1,372 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <vector>
+#include <functional>
+
+#include <CUnit/Basic.h>
+
+#include "vhost/fs.h"
+#include "bio.h"
+
+#include "virtio/virtio_fs.h"
+#include "virtio/virtio_fs_spec.h"
+
+#include "qdata.h"
+
+#include "memmap.h"
+#include "logging.h"
+#include "../test_utils.h"
+
+using namespace virtio_test;
+
+// virtio memory mapper mock
+extern "C" {
+void *gpa_range_to_ptr(struct vhd_memory_map *mm, uint64_t gpa, size_t len,
+                       unsigned *hint)
+{
+    return (void *)gpa;
+}
+
+void *gpa_to_ptr_partial(struct vhd_memory_map *mm, uint64_t gpa, size_t *len,
+                         unsigned *hint, uint32_t *region_id,
+                         uint64_t *region_offset)
+{
+    *region_id = 0;
+    *region_offset = gpa;
+    return (void *)gpa;
+}
+
+void vhd_memmap_ref(struct vhd_memory_map *mm)
+{
+}
+
+void vhd_memmap_unref(struct vhd_memory_map *mm)
+{
+}
+}
+
+struct test_fsdev {
+    virtio_fs_dev vdev;
+    vhd_fsdev_info fsdev = {};
+
+    queue_data qdata;
+    virtio_virtq vq;
+
+    /*
+     * called for every dispatched request, completes it unless it returns
+     * false; a pointer to keep the struct standard-layout for containerof
+     */
+    const std::function<bool(vhd_fs_io *)> *handler = nullptr;
+    unsigned num_dispatched = 0;
+    vhd_sglist last_sglist = {};
+
+    explicit test_fsdev(const std::vector<vhd_fs_inline_op> &inline_ops = {})
+    {
+        qdata.attach_virtq(&vq);
+
+        fsdev.tag = "test";
+        fsdev.num_queues = 1;
+        fsdev.inline_ops = inline_ops.data();
+        fsdev.num_inline_ops = inline_ops.size();
+
+        CU_ASSERT_FATAL(virtio_fs_init_dev(&vdev, &fsdev, dispatch_io) == 0);
+    }
+
+    ~test_fsdev()
+    {
+        virtio_virtq_release(&vq);
+    }
+
+    static int dispatch_io(struct virtio_virtq *vq, struct vhd_bio *bio)
+    {
+        test_fsdev *self = containerof(vq, test_fsdev, vq);
+        vhd_fs_io *fs_io = vhd_get_fs_io(&bio->bdev_io);
+
+        self->num_dispatched++;
+        self->last_sglist = bio->bdev_io.sglist;
+        if ((*self->handler)(fs_io)) {
+            bio->status = VHD_BDEV_SUCCESS;
+            bio->completion_handler(bio);
+        }
+        return 0;
+    }
+
+    /* returns the length of the used element */
+    uint32_t execute_request(const std::vector<q_iovec> &iovecs)
+    {
+        uint16_t head = qdata.build_descriptor_chain(iovecs);
+        qdata.publish_avail(head);
+
+        CU_ASSERT(virtio_fs_dispatch_requests(&vdev, &vq) == 0);
+
+        auto used = qdata.collect_used();
+        CU_ASSERT_FATAL(used.size() == 1);
+        CU_ASSERT(used.front().id == head);
+        return used.front().len;
+    }
+};
+
+static void reply(vhd_fs_io *fs_io, uint32_t len, int32_t error)
+{
+    virtio_fs_out_header *out = (virtio_fs_out_header *)fs_io->out_hdr;
+
+    out->len = len;
+    out->error = error;
+    out->unique = fs_io->unique;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void read_split_test(void)
+{
+    test_fsdev dev;
+    virtio_fs_in_header in = {};
+    uint8_t read_in[40] = {};
+    virtio_fs_out_header out = {};
+    std::vector<uint8_t> data0(4096), data1(8192);
+
+    in.len = sizeof(in) + sizeof(read_in);
+    in.opcode = VIRTIO_FS_OP_READ;
+    in.unique = 42;
+    in.nodeid = 7;
+
+    std::function<bool(vhd_fs_io *)> handler = [&](vhd_fs_io *fs_io) {
+        CU_ASSERT(fs_io->opcode == VIRTIO_FS_OP_READ);
+        CU_ASSERT(fs_io->unique == 42);
+        CU_ASSERT(fs_io->nodeid == 7);
+        CU_ASSERT(fs_io->in_hdr == &in);
+        CU_ASSERT(fs_io->out_hdr == &out);
+
+        CU_ASSERT_FATAL(fs_io->in_args.nbuffers == 1);
+        CU_ASSERT(fs_io->in_args.buffers[0].base == read_in);
+        CU_ASSERT(fs_io->in_args.buffers[0].len == sizeof(read_in));
+
+        CU_ASSERT_FATAL(fs_io->out_args.nbuffers == 2);
+        CU_ASSERT(fs_io->out_args.buffers[0].base == data0.data());
+        CU_ASSERT(fs_io->out_args.buffers[1].base == data1.data());
+        CU_ASSERT(fs_io->data.buffers == fs_io->out_args.buffers);
+        CU_ASSERT(fs_io->data.nbuffers == 2);
+
+        memset(fs_io->data.buffers[0].base, 0x5a, fs_io->data.buffers[0].len);
+        reply(fs_io, sizeof(out) + data0.size(), 0);
+        return true;
+    };
+    dev.handler = &handler;
+
+    uint32_t len = dev.execute_request({
+        {&in, sizeof(in), iodir::device_read},
+        {read_in, sizeof(read_in), iodir::device_read},
+        {&out, sizeof(out), iodir::device_write},
+        {data0.data(), data0.size(), iodir::device_write},
+        {data1.data(), data1.size(), iodir::device_write},
+    });
+
+    CU_ASSERT(dev.num_dispatched == 1);
+    CU_ASSERT(len == sizeof(out) + data0.size());
+    CU_ASSERT(out.unique == 42);
+    CU_ASSERT(data0[0] == 0x5a && data0[4095] == 0x5a);
+}
+
+static void write_split_test(void)
+{
+    test_fsdev dev;
+    /* headers and the start of the data in a single buffer */
+    uint8_t req[sizeof(virtio_fs_in_header) + sizeof(virtio_fs_write_in) + 512];
+    std::vector<uint8_t> data1(4096);
+    virtio_fs_out_header out = {};
+    virtio_fs_in_header *in = (virtio_fs_in_header *)req;
+
+    memset(req, 0, sizeof(req));
+    in->len = sizeof(req) + data1.size();
+    in->opcode = VIRTIO_FS_OP_WRITE;
+    in->unique = 43;
+
+    std::function<bool(vhd_fs_io *)> handler = [&](vhd_fs_io *fs_io) {
+        CU_ASSERT(fs_io->opcode == VIRTIO_FS_OP_WRITE);
+        CU_ASSERT(fs_io->in_hdr == req);
+
+        CU_ASSERT_FATAL(fs_io->in_args.nbuffers == 2);
+        CU_ASSERT(fs_io->in_args.buffers[0].base ==
+                  req + sizeof(virtio_fs_in_header));
+        CU_ASSERT(fs_io->in_args.buffers[0].len ==
+                  sizeof(req) - sizeof(virtio_fs_in_header));
+
+        CU_ASSERT_FATAL(fs_io->data.nbuffers == 2);
+        CU_ASSERT(fs_io->data.buffers[0].base ==
+                  req + sizeof(virtio_fs_in_header) +
+                  sizeof(virtio_fs_write_in));
+        CU_ASSERT(fs_io->data.buffers[0].len == 512);
+        CU_ASSERT(fs_io->data.buffers[1].base == data1.data());
+        CU_ASSERT(fs_io->data.buffers[1].len == data1.size());
+
+        CU_ASSERT(fs_io->out_args.nbuffers == 0);
+
+        /* the raw sglist is left intact */
+        CU_ASSERT_FATAL(dev.last_sglist.nbuffers == 3);
+        CU_ASSERT(dev.last_sglist.buffers[0].base == req);
+        CU_ASSERT(dev.last_sglist.buffers[0].len == sizeof(req));
+
+        reply(fs_io, sizeof(out), 0);
+        return true;
+    };
+    dev.handler = &handler;
+
+    uint32_t len = dev.execute_request({
+        {req, sizeof(req), iodir::device_read},
+        {data1.data(), data1.size(), iodir::device_read},
+        {&out, sizeof(out), iodir::device_write},
+    });
+
+    CU_ASSERT(dev.num_dispatched == 1);
+    CU_ASSERT(len == sizeof(out));
+}
+
+static void bad_write_test(void)
+{
+    test_fsdev dev;
+    virtio_fs_in_header in = {};
+    uint8_t write_in[sizeof(virtio_fs_write_in) - 8] = {};
+    virtio_fs_out_header out = {};
+
+    in.opcode = VIRTIO_FS_OP_WRITE;
+    in.unique = 44;
+
+    std::function<bool(vhd_fs_io *)> handler = [&](vhd_fs_io *fs_io) {
+        CU_ASSERT(false);
+        return true;
+    };
+    dev.handler = &handler;
+
+    uint32_t len = dev.execute_request({
+        {&in, sizeof(in), iodir::device_read},
+        {write_in, sizeof(write_in), iodir::device_read},
+        {&out, sizeof(out), iodir::device_write},
+    });
+
+    CU_ASSERT(dev.num_dispatched == 0);
+    CU_ASSERT(len == sizeof(out));
+    CU_ASSERT(out.len == sizeof(out));
+    CU_ASSERT((int32_t)out.error == -EINVAL);
+    CU_ASSERT(out.unique == 44);
+}
+
+static void oneway_test(void)
+{
+    test_fsdev dev;
+    uint8_t req[sizeof(virtio_fs_in_header) + 16] = {};
+    virtio_fs_in_header *in = (virtio_fs_in_header *)req;
+
+    in->opcode = VIRTIO_FS_OP_FORGET;
+
+    std::function<bool(vhd_fs_io *)> handler = [&](vhd_fs_io *fs_io) {
+        CU_ASSERT(fs_io->out_hdr == NULL);
+        CU_ASSERT(fs_io->out_args.nbuffers == 0);
+        CU_ASSERT(fs_io->data.nbuffers == 0);
+        CU_ASSERT_FATAL(fs_io->in_args.nbuffers == 1);
+        CU_ASSERT(fs_io->in_args.buffers[0].len == 16);
+        return true;
+    };
+    dev.handler = &handler;
+
+    CU_ASSERT(dev.execute_request({{req, sizeof(req), iodir::device_read}}) ==
+              0);
+    CU_ASSERT(dev.num_dispatched == 1);
+}
+
+static void inline_op(vhd_fs_io *fs_io, void *opaque)
+{
+    unsigned *count = (unsigned *)opaque;
+
+    (*count)++;
+    if (fs_io->out_hdr) {
+        reply(fs_io, sizeof(virtio_fs_out_header), -ENOENT);
+    }
+}
+
+static void inline_ops_test(void)
+{
+    unsigned num_inline = 0;
+    test_fsdev dev({
+        {VIRTIO_FS_OP_FORGET, inline_op, &num_inline},
+        {VIRTIO_FS_OP_BATCH_FORGET, inline_op, &num_inline},
+        {1 /* FUSE_LOOKUP */, inline_op, &num_inline},
+    });
+    std::function<bool(vhd_fs_io *)> handler = [&](vhd_fs_io *fs_io) {
+        reply(fs_io, sizeof(virtio_fs_out_header), 0);
+        return true;
+    };
+    dev.handler = &handler;
+
+    /* one-way */
+    uint8_t forget[sizeof(virtio_fs_in_header) + 8] = {};
+    ((virtio_fs_in_header *)forget)->opcode = VIRTIO_FS_OP_FORGET;
+    CU_ASSERT(dev.execute_request({
+        {forget, sizeof(forget), iodir::device_read},
+    }) == 0);
+    CU_ASSERT(num_inline == 1);
+    CU_ASSERT(dev.num_dispatched == 0);
+
+    /* with a reply */
+    virtio_fs_in_header in = {};
+    virtio_fs_out_header out = {};
+    in.opcode = 1;
+    in.unique = 45;
+    CU_ASSERT(dev.execute_request({
+        {&in, sizeof(in), iodir::device_read},
+        {&out, sizeof(out), iodir::device_write},
+    }) == sizeof(out));
+    CU_ASSERT(num_inline == 2);
+    CU_ASSERT(dev.num_dispatched == 0);
+    CU_ASSERT((int32_t)out.error == -ENOENT);
+    CU_ASSERT(out.unique == 45);
+
+    /* the rest still go to the backend */
+    in.opcode = 3; /* FUSE_GETATTR */
+    CU_ASSERT(dev.execute_request({
+        {&in, sizeof(in), iodir::device_read},
+        {&out, sizeof(out), iodir::device_write},
+    }) == sizeof(out));
+    CU_ASSERT(num_inline == 2);
+    CU_ASSERT(dev.num_dispatched == 1);
+    CU_ASSERT(out.error == 0);
+
+    /* out of range opcodes are refused */
+    vhd_fs_inline_op bad_op = {VHD_FS_MAX_INLINE_OPCODE, inline_op, NULL};
+    virtio_fs_dev vdev;
+    vhd_fsdev_info fsdev = {};
+    fsdev.inline_ops = &bad_op;
+    fsdev.num_inline_ops = 1;
+    CU_ASSERT(virtio_fs_init_dev(&vdev, &fsdev, test_fsdev::dispatch_io) ==
+              -EINVAL);
+}
+
+int main(void)
+{
+    int res;
+    CU_pSuite suite = NULL;
+
+    if (CUE_SUCCESS != CU_initialize_registry()) {
+        return CU_get_error();
+    }
+
+    suite = CU_add_suite("virtio_fs_test", NULL, NULL);
+    if (NULL == suite) {
+        CU_cleanup_registry();
+        return CU_get_error();
+    }
+
+    CU_ADD_TEST(suite, read_split_test);
+    CU_ADD_TEST(suite, write_split_test);
+    CU_ADD_TEST(suite, bad_write_test);
+    CU_ADD_TEST(suite, oneway_test);
+    CU_ADD_TEST(suite, inline_ops_test);
+
+    CU_basic_set_mode(CU_BRM_VERBOSE);
+    CU_basic_run_tests();
+
+    res = CU_get_error() || CU_get_number_of_tests_failed();
+    CU_cleanup_registry();
+    return res;
+}
@@ -0,0 +1,629 @@
+/*
+ * Virtqueue dataplane micro-benchmark
+ *
+ * Plays the driver side of a split virtqueue in guest memory mapped through a
+ * real memory map, and measures the cost of each dataplane stage on batches
+ * of read requests:
+ *
+ * - virtq: virtq_dequeue_many() and virtq_push() (in a batch, as the
+ *   request queue completes), without any device emulation;
+ * - blk: virtio-blk request parsing and the request queue round trip, i.e.
+ *   virtio_blk_dispatch_requests() into vhd_enqueue_block_request(),
+ *   vhd_dequeue_requests() as a backend would, and vhd_complete_bio(), which
+ *   completes the requests inline as it's called in the request queue
+ *   thread, with the batch committed by vhd_run_queue().
+ *
+ * Everything runs in the calling thread; the backend completes requests
+ * instantly without touching the data.  Data buffers of a request are laid
+ * out apart from each other, the way guest pages usually are.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+
+#include "vhost/blockdev.h"
+#include "vhost/server.h"
+
+#include "virtio/virt_queue.h"
+#include "virtio/virtio_blk.h"
+#include "virtio/virtio_blk_spec.h"
+
+#include "bio.h"
+#include "logging.h"
+#include "memmap.h"
+#include "platform.h"
+#include "server_internal.h"
+#include "vdev.h"
+#include "../test_utils.h"
+
+#define DIE(fmt, ...)                              \
+do {                                               \
+    vhd_log_stderr(LOG_ERROR, fmt, ##__VA_ARGS__); \
+    exit(EXIT_FAILURE);                            \
+} while (0)
+
+struct bench_config {
+    unsigned depth;
+    unsigned chain_len;
+    unsigned seg_size;
+    unsigned iterations;
+    bool indirect;
+    bool event_idx;
+    bool inflight;
+};
+
+struct bench {
+    struct bench_config conf;
+
+    /* guest memory, as seen by the driver, and its memory map */
+    void *mem;
+    size_t mem_size;
+    int mem_fd;
+    struct vhd_memory_map *mm;
+
+    /* driver side of the ring */
+    uint16_t qsz;
+    struct virtq_desc *desc;
+    struct virtq_avail *avail;
+    struct virtq_used *used;
+    uint64_t desc_gpa;
+    uint64_t avail_gpa;
+    uint64_t used_gpa;
+    uint16_t *heads;
+    uint16_t avail_idx;
+    uint16_t used_idx;
+    struct inflight_split_region *inflight_region;
+    int call_fd;
+
+    /* always readable, so that vhd_run_queue() never blocks */
+    int wake_fd;
+    struct vhd_io_handler *wake_handler;
+
+    /* device side */
+    struct vhd_request_queue *rq;
+    struct vhd_vdev *vdev;
+    struct vhd_vring *vring;
+    struct vhd_bdev_info bdev;
+    struct virtio_blk_dev vblk;
+
+    struct virtio_iov **iovs;
+    unsigned num_iovs;
+    struct vhd_request *reqs;
+};
+
+/* nanoseconds spent in each stage over the whole run */
+struct bench_stages {
+    const char *names[4];
+    uint64_t ns[4];
+    unsigned num;
+};
+
+static uint64_t clock_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static size_t align_up(size_t x, size_t align)
+{
+    return (x + align - 1) & ~(align - 1);
+}
+
+static uint16_t ring_size(const struct bench_config *conf)
+{
+    unsigned descs = conf->indirect ? 1 : conf->chain_len + 2;
+    unsigned qsz = 256;
+
+    while (qsz < conf->depth * descs) {
+        qsz <<= 1;
+    }
+    if (qsz > 32768) {
+        DIE("%u requests of %u descriptors don't fit in a virtqueue",
+            conf->depth, descs);
+    }
+    return qsz;
+}
+
+static void *gpa_ptr(struct bench *b, uint64_t gpa)
+{
+    return (char *)b->mem + gpa;
+}
+
+/*
+ * Lay out the rings, the indirect tables, and the request headers, status
+ * bytes and data buffers in guest memory, and build the descriptor chains.
+ */
+static void build_guest(struct bench *b)
+{
+    const struct bench_config *conf = &b->conf;
+    unsigned nsegs = conf->chain_len + 2;
+    uint64_t table_gpa, hdr_gpa, status_gpa, data_gpa;
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t off;
+    unsigned r, i;
+
+    b->qsz = ring_size(conf);
+
+    off = 0;
+    b->desc_gpa = off;
+    off += sizeof(struct virtq_desc) * b->qsz;
+    b->avail_gpa = off;
+    off += sizeof(struct virtq_avail) + sizeof(uint16_t) * (b->qsz + 1);
+    off = align_up(off, 4);
+    b->used_gpa = off;
+    off += sizeof(struct virtq_used) +
+        sizeof(struct virtq_used_elem) * b->qsz + sizeof(uint16_t);
+    off = align_up(off, 16);
+    table_gpa = off;
+    if (conf->indirect) {
+        off += sizeof(struct virtq_desc) * nsegs * conf->depth;
+    }
+    hdr_gpa = off;
+    off += sizeof(struct virtio_blk_req_hdr) * conf->depth;
+    status_gpa = off;
+    off += conf->depth;
+    off = align_up(off, page);
+    data_gpa = off;
+    off += (size_t)conf->seg_size * conf->chain_len * conf->depth;
+    b->mem_size = align_up(off, page);
+
+    b->mem_fd = memfd_create("virtq_bench", 0);
+    if (b->mem_fd < 0 || ftruncate(b->mem_fd, b->mem_size) < 0) {
+        DIE("can't create guest memory: %s", strerror(errno));
+    }
+    b->mem = mmap(NULL, b->mem_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                  b->mem_fd, 0);
+    if (b->mem == MAP_FAILED) {
+        DIE("can't map guest memory: %s", strerror(errno));
+    }
+
+    b->mm = vhd_memmap_new(NULL, NULL, NULL, NULL);
+    if (vhd_memmap_add_slot(b->mm, 0, (uintptr_t)b->mem, b->mem_size,
+                            b->mem_fd, 0) < 0) {
+        DIE("can't add guest memory to the memory map");
+    }
+
+    b->desc = gpa_ptr(b, b->desc_gpa);
+    b->avail = gpa_ptr(b, b->avail_gpa);
+    b->used = gpa_ptr(b, b->used_gpa);
+    b->heads = vhd_calloc(conf->depth, sizeof(b->heads[0]));
+
+    for (r = 0; r < conf->depth; r++) {
+        struct virtio_blk_req_hdr *hdr =
+            gpa_ptr(b, hdr_gpa + sizeof(*hdr) * r);
+        struct virtq_desc *chain;
+        uint64_t chain_gpa;
+
+        *hdr = (struct virtio_blk_req_hdr) {
+            .type = VIRTIO_BLK_T_IN,
+            .sector = 0,
+        };
+
+        if (conf->indirect) {
+            chain_gpa = table_gpa + sizeof(struct virtq_desc) * nsegs * r;
+            chain = gpa_ptr(b, chain_gpa);
+            b->heads[r] = r;
+            b->desc[r] = (struct virtq_desc) {
+                .addr = chain_gpa,
+                .len = sizeof(struct virtq_desc) * nsegs,
+                .flags = VIRTQ_DESC_F_INDIRECT,
+            };
+        } else {
+            chain = b->desc + nsegs * r;
+            b->heads[r] = nsegs * r;
+        }
+
+        for (i = 0; i < nsegs; i++) {
+            uint16_t next = (conf->indirect ? 0 : b->heads[r]) + i + 1;
+
+            if (i == 0) {
+                chain[i].addr = hdr_gpa + sizeof(*hdr) * r;
+                chain[i].len = sizeof(*hdr);
+                chain[i].flags = 0;
+            } else if (i == nsegs - 1) {
+                chain[i].addr = status_gpa + r;
+                chain[i].len = 1;
+                chain[i].flags = VIRTQ_DESC_F_WRITE;
+            } else {
+                /* segments of a request are depth buffers apart */
+                chain[i].addr = data_gpa + (uint64_t)conf->seg_size *
+                    ((i - 1) * conf->depth + r);
+                chain[i].len = conf->seg_size;
+                chain[i].flags = VIRTQ_DESC_F_WRITE;
+            }
+
+            if (i != nsegs - 1) {
+                chain[i].flags |= VIRTQ_DESC_F_NEXT;
+                chain[i].next = next;
+            }
+        }
+    }
+}
+
+/* Start the ring anew, as on device start */
+static void attach_vq(struct bench *b)
+{
+    struct virtio_virtq *vq = &b->vring->vq;
+    size_t inflight_size = sizeof(struct inflight_split_region) +
+        sizeof(struct inflight_split_desc) * b->qsz;
+
+    b->avail->flags = 0;
+    b->avail->idx = 0;
+    b->used->flags = 0;
+    b->used->idx = 0;
+    b->avail_idx = 0;
+    b->used_idx = 0;
+
+    if (b->conf.inflight) {
+        memset(b->inflight_region, 0, inflight_size);
+        b->inflight_region->version = 0x1;
+        b->inflight_region->desc_num = b->qsz;
+    }
+
+    *vq = (struct virtio_virtq) {
+        .log_tag = "bench_vq",
+        .desc = b->desc,
+        .avail = b->avail,
+        .used = b->used,
+        .used_gpa_base = b->used_gpa,
+        .qsz = b->qsz,
+        .has_event_idx = b->conf.event_idx,
+        .notify_fd = b->call_fd,
+        .inflight_region = b->inflight_region,
+        .mm = b->mm,
+    };
+    virtio_virtq_init(vq);
+}
+
+static void detach_vq(struct bench *b)
+{
+    virtio_virtq_release(&b->vring->vq);
+}
+
+/* Make all the requests available, asking to be notified once they're done */
+static void driver_publish(struct bench *b)
+{
+    unsigned r;
+
+    for (r = 0; r < b->conf.depth; r++) {
+        b->avail->ring[b->avail_idx++ % b->qsz] = b->heads[r];
+    }
+    if (b->conf.event_idx) {
+        /* used_event follows the avail ring */
+        b->avail->ring[b->qsz] = b->avail_idx - 1;
+    }
+    __atomic_store_n(&b->avail->idx, b->avail_idx, __ATOMIC_RELEASE);
+}
+
+static void driver_reap(struct bench *b)
+{
+    eventfd_t cnt;
+
+    b->used_idx += b->conf.depth;
+    if (__atomic_load_n(&b->used->idx, __ATOMIC_ACQUIRE) != b->used_idx) {
+        DIE("used ring at %u, expected %u", b->used->idx, b->used_idx);
+    }
+    eventfd_read(b->call_fd, &cnt);
+}
+
+static void collect_iov(void *arg, struct virtio_virtq *vq,
+                        struct virtio_iov *iov)
+{
+    struct bench *b = arg;
+
+    b->iovs[b->num_iovs++] = iov;
+}
+
+static void run_virtq(struct bench *b, struct bench_stages *st)
+{
+    unsigned it, i;
+
+    *st = (struct bench_stages) {
+        .names = { "virtq_dequeue_many", "virtq_push" },
+        .num = 2,
+    };
+
+    attach_vq(b);
+
+    for (it = 0; it < b->conf.iterations; it++) {
+        uint64_t t0, t1, t2;
+
+        driver_publish(b);
+
+        t0 = clock_ns();
+        b->num_iovs = 0;
+        virtq_dequeue_many(&b->vring->vq, collect_iov, b);
+        t1 = clock_ns();
+        virtq_begin_batch(&b->vring->vq);
+        for (i = 0; i < b->num_iovs; i++) {
+            virtq_push(&b->vring->vq, b->iovs[i], 0);
+            virtio_free_iov(b->iovs[i]);
+        }
+        virtq_commit_batch(&b->vring->vq);
+        t2 = clock_ns();
+
+        if (b->num_iovs != b->conf.depth) {
+            DIE("dequeued %u requests, expected %u", b->num_iovs,
+                b->conf.depth);
+        }
+        driver_reap(b);
+
+        st->ns[0] += t1 - t0;
+        st->ns[1] += t2 - t1;
+    }
+
+    detach_vq(b);
+}
+
+static int bench_blk_dispatch(struct virtio_virtq *vq, struct vhd_bio *bio)
+{
+    bio->vring = containerof(vq, struct vhd_vring, vq);
+    return vhd_enqueue_block_request(bio->vring->rq, bio);
+}
+
+static void run_blk(struct bench *b, struct bench_stages *st)
+{
+    unsigned it, i;
+
+    *st = (struct bench_stages) {
+        .names = { "virtio_blk_dispatch", "vhd_dequeue_requests",
+                   "vhd_complete_bio", "completion commit" },
+        .num = 4,
+    };
+
+    attach_vq(b);
+
+    for (it = 0; it < b->conf.iterations; it++) {
+        uint64_t t0, t1, t2, t3, t4;
+        unsigned n = 0;
+
+        driver_publish(b);
+
+        t0 = clock_ns();
+        virtio_blk_dispatch_requests(&b->vblk, &b->vring->vq);
+        t1 = clock_ns();
+        while (n < b->conf.depth) {
+            unsigned got = vhd_dequeue_requests(b->rq, b->reqs + n,
+                                                b->conf.depth - n, NULL);
+            if (!got) {
+                DIE("dequeued %u requests, expected %u", n, b->conf.depth);
+            }
+            n += got;
+        }
+        t2 = clock_ns();
+        for (i = 0; i < n; i++) {
+            vhd_complete_bio(b->reqs[i].bio, VHD_BDEV_SUCCESS);
+        }
+        t3 = clock_ns();
+        while (b->vring->num_in_flight) {
+            vhd_run_queue(b->rq);
+        }
+        t4 = clock_ns();
+
+        driver_reap(b);
+
+        st->ns[0] += t1 - t0;
+        st->ns[1] += t2 - t1;
+        st->ns[2] += t3 - t2;
+        st->ns[3] += t4 - t3;
+    }
+
+    detach_vq(b);
+}
+
+static void report(struct bench *b, const char *name,
+                   const struct bench_stages *st)
+{
+    uint64_t nreqs = (uint64_t)b->conf.iterations * b->conf.depth;
+    uint64_t total = 0;
+    unsigned i;
+
+    for (i = 0; i < st->num; i++) {
+        total += st->ns[i];
+        printf("  %-24s %8.1f ns/req\n", st->names[i],
+               (double)st->ns[i] / nreqs);
+    }
+    printf("  %-24s %8.1f ns/req %12.0f req/s\n", name,
+           (double)total / nreqs, total ? nreqs * 1e9 / total : 0.);
+}
+
+static void bench_nop(void *opaque)
+{
+}
+
+static int bench_wake(void *opaque)
+{
+    return 0;
+}
+
+static void bench_init(struct bench *b)
+{
+    const struct bench_config *conf = &b->conf;
+
+    build_guest(b);
+
+    b->call_fd = eventfd(0, EFD_NONBLOCK);
+    if (b->call_fd < 0) {
+        DIE("can't create eventfd: %s", strerror(errno));
+    }
+    if (conf->inflight) {
+        b->inflight_region = vhd_zalloc(sizeof(struct inflight_split_region) +
+            sizeof(struct inflight_split_desc) * b->qsz);
+    }
+
+    b->rq = vhd_create_request_queue();
+    if (!b->rq) {
+        DIE("vhd_create_request_queue failed");
+    }
+
+    /* make this the request queue thread */
+    vhd_run_in_rq(b->rq, bench_nop, NULL);
+    vhd_run_queue(b->rq);
+
+    b->wake_fd = eventfd(1, EFD_NONBLOCK);
+    if (b->wake_fd < 0) {
+        DIE("can't create eventfd: %s", strerror(errno));
+    }
+    b->wake_handler = vhd_add_rq_io_handler(b->rq, b->wake_fd, bench_wake,
+                                            NULL);
+
+    /*
+     * A bare vring on a bare device: only what the request queue looks
+     * at is set up
+     */
+    b->vdev = vhd_zalloc(sizeof(*b->vdev));
+    b->vring = vhd_zalloc(sizeof(*b->vring));
+    b->vring->vdev = b->vdev;
+    b->vring->rq = b->rq;
+    b->vring->log_tag = "bench_vring";
+    b->vring->started_in_rq = true;
+    TAILQ_INIT(&b->vring->submission);
+
+    b->bdev = (struct vhd_bdev_info) {
+        .serial = "virtq_bench",
+        .block_size = 4096,
+        .total_blocks = 1ull << 30,
+        .num_queues = 1,
+    };
+    if (virtio_blk_init_dev(&b->vblk, &b->bdev, bench_blk_dispatch)) {
+        DIE("virtio_blk_init_dev failed");
+    }
+
+    b->iovs = vhd_calloc(conf->depth, sizeof(b->iovs[0]));
+    b->reqs = vhd_calloc(conf->depth, sizeof(b->reqs[0]));
+}
+
+static void bench_fini(struct bench *b)
+{
+    vhd_free(b->reqs);
+    vhd_free(b->iovs);
+    vhd_free(b->vring);
+    vhd_free(b->vdev);
+    vhd_del_rq_io_handler(b->wake_handler);
+    close(b->wake_fd);
+    vhd_stop_queue(b->rq);
+    while (vhd_run_queue(b->rq) == -EAGAIN) {
+        ;
+    }
+    vhd_release_request_queue(b->rq);
+    vhd_free(b->inflight_region);
+    close(b->call_fd);
+    vhd_memmap_unref(b->mm);
+    munmap(b->mem, b->mem_size);
+    close(b->mem_fd);
+    vhd_free(b->heads);
+}
+
+static void usage(const char *cmd)
+{
+    printf("Usage: %s [OPTION]...\n", cmd);
+    printf("Measure the virtqueue dataplane cost per request.\n");
+    printf("\n");
+    printf("  -q, --depth=N        requests per batch (default 128)\n");
+    printf("  -c, --chain-len=N    data buffers per request (default 1)\n");
+    printf("  -s, --seg-size=N     data buffer size in bytes (default 4096)\n");
+    printf("  -n, --iterations=N   batches to run (default 10000)\n");
+    printf("  -i, --indirect       use indirect descriptors\n");
+    printf("  -e, --event-idx      use VIRTIO_F_RING_EVENT_IDX\n");
+    printf("  -I, --inflight       track requests in the inflight region\n");
+}
+
+static void parse_opts(int argc, char **argv, struct bench_config *conf)
+{
+    int opt;
+    do {
+        static struct option long_options[] = {
+            {"depth",          1, NULL, 'q'},
+            {"chain-len",      1, NULL, 'c'},
+            {"seg-size",       1, NULL, 's'},
+            {"iterations",     1, NULL, 'n'},
+            {"indirect",       0, NULL, 'i'},
+            {"event-idx",      0, NULL, 'e'},
+            {"inflight",       0, NULL, 'I'},
+            {"help",           0, NULL, 'h'},
+            {0, 0, 0, 0}
+        };
+
+        opt = getopt_long(argc, argv, "q:c:s:n:ieIh", long_options, NULL);
+
+        switch (opt) {
+        case -1:
+            break;
+        case 'q':
+            conf->depth = atoi(optarg);
+            break;
+        case 'c':
+            conf->chain_len = atoi(optarg);
+            break;
+        case 's':
+            conf->seg_size = atoi(optarg);
+            break;
+        case 'n':
+            conf->iterations = atoi(optarg);
+            break;
+        case 'i':
+            conf->indirect = true;
+            break;
+        case 'e':
+            conf->event_idx = true;
+            break;
+        case 'I':
+            conf->inflight = true;
+            break;
+        case 'h':
+            usage(argv[0]);
+            exit(0);
+        default:
+            usage(argv[0]);
+            exit(2);
+        }
+    } while (opt != -1);
+
+    if (!conf->depth || !conf->chain_len || !conf->iterations ||
+        !conf->seg_size || conf->seg_size % VIRTIO_BLK_SECTOR_SIZE) {
+        usage(argv[0]);
+        DIE("Invalid command line options");
+    }
+}
+
+int main(int argc, char **argv)
+{
+    struct bench b = {
+        .conf = {
+            .depth = 128,
+            .chain_len = 1,
+            .seg_size = 4096,
+            .iterations = 10000,
+        },
+    };
+    struct bench_stages st;
+
+    parse_opts(argc, argv, &b.conf);
+    g_log_fn = vhd_log_stderr;
+
+    bench_init(&b);
+
+    printf("depth %u, chain %u x %u bytes%s%s%s, %u iterations\n",
+           b.conf.depth, b.conf.chain_len, b.conf.seg_size,
+           b.conf.indirect ? ", indirect" : "",
+           b.conf.event_idx ? ", event idx" : "",
+           b.conf.inflight ? ", inflight" : "",
+           b.conf.iterations);
+
+    run_virtq(&b, &st);
+    report(&b, "virtq", &st);
+    run_blk(&b, &st);
+    report(&b, "blk", &st);
+
+    bench_fini(&b);
+    return 0;
+}
@@ -1,8 +1,12 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
 
 #include <vector>
 #include <deque>
+#include <map>
 #include <memory>
 #include <algorithm>
 
@@ -18,19 +22,42 @@
 
 using namespace virtio_test;
 
-// virtio memory mapper mock
+// virtio memory mapper mock: identity mapping, optionally split into
+// g_region_size-aligned regions
+static uint64_t g_region_size;
+// references taken on the (fake) memory maps
+static std::map<struct vhd_memory_map *, int> g_memmap_refs;
+
 extern "C" {
-void *gpa_range_to_ptr(struct vhd_memory_map *mm, uint64_t gpa, size_t len)
+void *gpa_range_to_ptr(struct vhd_memory_map *mm, uint64_t gpa, size_t len,
+                       unsigned *hint)
 {
     return (void *)gpa;
 }
 
+void *gpa_to_ptr_partial(struct vhd_memory_map *mm, uint64_t gpa, size_t *len,
+                         unsigned *hint, uint32_t *region_id,
+                         uint64_t *region_offset)
+{
+    *region_id = 0;
+    *region_offset = gpa;
+    if (g_region_size) {
+        *len = std::min<uint64_t>(*len, g_region_size - gpa % g_region_size);
+        *region_id = gpa / g_region_size;
+        *region_offset = gpa % g_region_size;
+    }
+    return (void *)gpa;
+}
+
 void vhd_memmap_ref(struct vhd_memory_map *mm)
 {
+    g_memmap_refs[mm]++;
 }
 
 void vhd_memmap_unref(struct vhd_memory_map *mm)
 {
+    CU_ASSERT(g_memmap_refs[mm] > 0);
+    g_memmap_refs[mm]--;
 }
 }
 
@@ -837,6 +864,947 @@ static void inflight_recover_test(void)
     return;
 }
 
+/*
+ * Requests found in flight on reconnect are resubmitted VIRTQ_RESUBMIT_BATCH
+ * at a time, oldest first, ahead of the new ones, and the virtq is reported
+ * as having requests available until all of them are.
+ */
+static void inflight_resubmit_batch_test(void)
+{
+    int res;
+    queue_data qdata;
+    std::vector<virtio_iov *> iovs;
+    const unsigned num_req = VIRTQ_RESUBMIT_BATCH * 2 + 5;
+
+    virtio_virtq vq;
+    qdata.attach_virtq(&vq);
+
+    desc_chain chain = desc_chain::with_buffers({
+        {0x00001000, 0x1000},
+    });
+    for (unsigned i = 0; i < num_req; i++) {
+        qdata.publish_avail(qdata.build_descriptor_chain(chain.buffers));
+    }
+    res = qdata.kick_virtq(&vq,
+        [&](virtio_iov *iov)
+        {
+            iovs.push_back(iov);
+        }
+    );
+    CU_ASSERT(res == 0);
+    CU_ASSERT_FATAL(iovs.size() == num_req);
+
+    /* "crash" */
+    virtio_virtq_release(&vq);
+    for (auto &iov : iovs) {
+        virtio_free_iov(iov);
+    }
+    iovs.clear();
+
+    /* make the heads fetched last the oldest ones */
+    for (unsigned i = 0; i < num_req; i++) {
+        qdata.get_inflight_desc(i)->counter = num_req - i;
+    }
+
+    qdata.attach_virtq(&vq);
+    CU_ASSERT(virtq_has_avail(&vq));
+
+    uint16_t new_head = qdata.build_descriptor_chain(chain.buffers);
+    qdata.publish_avail(new_head);
+
+    uint64_t last_counter = 0;
+    unsigned num_kicks = 0;
+    while (virtq_has_avail(&vq)) {
+        std::vector<uint16_t> heads;
+
+        res = qdata.kick_virtq(&vq,
+            [&](virtio_iov *iov)
+            {
+                heads.push_back(virtio_iov_get_head(iov));
+                iovs.push_back(iov);
+            }
+        );
+        CU_ASSERT(res == 0);
+
+        if (num_kicks == 0) {
+            /* the new request follows the first batch */
+            CU_ASSERT_FATAL(heads.size() == VIRTQ_RESUBMIT_BATCH + 1);
+            CU_ASSERT(heads.back() == new_head);
+            heads.pop_back();
+        } else {
+            CU_ASSERT(heads.size() <= VIRTQ_RESUBMIT_BATCH);
+        }
+
+        for (uint16_t head : heads) {
+            uint64_t counter = qdata.get_inflight_desc(head)->counter;
+            CU_ASSERT(counter > last_counter);
+            last_counter = counter;
+        }
+
+        CU_ASSERT_FATAL(++num_kicks <= 3);
+    }
+    CU_ASSERT(num_kicks == 3);
+    CU_ASSERT(iovs.size() == num_req + 1);
+    CU_ASSERT(!vq.resubmit_map);
+
+    for (auto &iov : iovs) {
+        qdata.commit_buffers(&vq, iov, 0);
+    }
+    for (unsigned i = 0; i <= num_req; i++) {
+        CU_ASSERT(!qdata.get_inflight_desc(i)->inflight);
+    }
+
+    virtio_virtq_release(&vq);
+}
+
+/*
+ * Completions pushed within a batch are published with a single used->idx
+ * update, and the driver is notified once iff used_event falls within the
+ * published range.
+ */
+static void batched_completion_test(void)
+{
+    int res;
+    queue_data qdata;
+    std::vector<virtio_iov *> iovs;
+    eventfd_t notified;
+    const unsigned num_req = 8;
+
+    virtio_virtq vq;
+    qdata.attach_virtq(&vq);
+    vq.has_event_idx = true;
+    vq.notify_fd = eventfd(0, EFD_NONBLOCK);
+    CU_ASSERT_FATAL(vq.notify_fd >= 0);
+
+    for (unsigned i = 0; i < num_req; i++) {
+        uint16_t head = qdata.build_descriptor_chain({
+            {0x00001000, 0x1000},
+        });
+        qdata.publish_avail(head);
+    }
+
+    res = qdata.kick_virtq(&vq,
+        [&](virtio_iov *iov)
+        {
+            iovs.push_back(iov);
+        }
+    );
+    CU_ASSERT(res == 0);
+    CU_ASSERT(iovs.size() == num_req);
+
+    /* driver wants to be notified once the 3rd element is used */
+    uint16_t *used_event = (uint16_t *)&qdata.avail_ring->ring[qdata.qsz];
+    *used_event = 2;
+
+    virtq_begin_batch(&vq);
+    for (unsigned i = 0; i < num_req / 2; i++) {
+        qdata.commit_buffers(&vq, iovs[i], 0);
+    }
+    /* nothing is visible to the driver until the batch is committed */
+    CU_ASSERT(qdata.collect_used().size() == 0);
+    CU_ASSERT(eventfd_read(vq.notify_fd, &notified) < 0);
+    virtq_commit_batch(&vq);
+
+    CU_ASSERT(qdata.collect_used().size() == num_req / 2);
+    CU_ASSERT(eventfd_read(vq.notify_fd, &notified) == 0);
+    CU_ASSERT(notified == 1);
+    CU_ASSERT(vq.stat.metrics.notifies == 1);
+
+    /* used_event is behind the published range: no notification */
+    virtq_begin_batch(&vq);
+    for (unsigned i = num_req / 2; i < num_req; i++) {
+        qdata.commit_buffers(&vq, iovs[i], 0);
+    }
+    virtq_commit_batch(&vq);
+
+    CU_ASSERT(qdata.collect_used().size() == num_req / 2);
+    CU_ASSERT(eventfd_read(vq.notify_fd, &notified) < 0);
+    CU_ASSERT(vq.stat.metrics.notifies == 1);
+
+    close(vq.notify_fd);
+    virtio_virtq_release(&vq);
+}
+
+/*
+ * Coalesced notifications are sent once enough buffers are used, or when
+ * flushed by the deadline
+ */
+static void notify_coalescing_test(void)
+{
+    int res;
+    queue_data qdata;
+    std::vector<virtio_iov *> iovs;
+    eventfd_t notified;
+    const unsigned num_req = 6;
+
+    virtio_virtq vq;
+    qdata.attach_virtq(&vq);
+    vq.notify_fd = eventfd(0, EFD_NONBLOCK);
+    CU_ASSERT_FATAL(vq.notify_fd >= 0);
+    vq.coalesce_max = 4;
+    vq.coalesce_ns = 3600 * 1000000000ull;
+
+    for (unsigned i = 0; i < num_req; i++) {
+        uint16_t head = qdata.build_descriptor_chain({
+            {0x00001000, 0x1000},
+        });
+        qdata.publish_avail(head);
+    }
+
+    res = qdata.kick_virtq(&vq,
+        [&](virtio_iov *iov)
+        {
+            iovs.push_back(iov);
+        }
+    );
+    CU_ASSERT(res == 0);
+    CU_ASSERT(iovs.size() == num_req);
+
+    /* the used buffers are visible right away, the notification isn't */
+    for (unsigned i = 0; i < 3; i++) {
+        qdata.commit_buffers(&vq, iovs[i], 0);
+    }
+    CU_ASSERT(qdata.collect_used().size() == 3);
+    CU_ASSERT(eventfd_read(vq.notify_fd, &notified) < 0);
+    CU_ASSERT(vq.notify_pending);
+
+    qdata.commit_buffers(&vq, iovs[3], 0);
+    CU_ASSERT(eventfd_read(vq.notify_fd, &notified) == 0);
+    CU_ASSERT(!vq.notify_pending);
+
+    for (unsigned i = 4; i < num_req; i++) {
+        qdata.commit_buffers(&vq, iovs[i], 0);
+    }
+    CU_ASSERT(eventfd_read(vq.notify_fd, &notified) < 0);
+    CU_ASSERT(vq.notify_pending);
+
+    virtq_flush_notify(&vq);
+    CU_ASSERT(eventfd_read(vq.notify_fd, &notified) == 0);
+    CU_ASSERT(!vq.notify_pending);
+    CU_ASSERT(vq.stat.metrics.notifies == 2);
+
+    close(vq.notify_fd);
+    virtio_virtq_release(&vq);
+}
+
+/*
+ * Notification suppression used for polling: the driver is asked not to kick
+ * while notifications are disabled, and new buffers are still detected.
+ */
+static void notification_suppression_test(void)
+{
+    int res;
+    queue_data qdata;
+    unsigned num_handled = 0;
+
+    virtio_virtq vq;
+    qdata.attach_virtq(&vq);
+
+    virtq_set_notification(&vq, false);
+    CU_ASSERT(qdata.used_ring->flags & VIRTQ_USED_F_NO_NOTIFY);
+    CU_ASSERT(!virtq_has_avail(&vq));
+
+    uint16_t head = qdata.build_descriptor_chain({
+        {0x00001000, 0x1000},
+    });
+    qdata.publish_avail(head);
+    CU_ASSERT(virtq_has_avail(&vq));
+
+    res = qdata.kick_virtq(&vq,
+        [&](virtio_iov *iov)
+        {
+            num_handled++;
+            qdata.commit_buffers(&vq, iov, 0);
+        }
+    );
+    CU_ASSERT(res == 0);
+    CU_ASSERT(num_handled == 1);
+    CU_ASSERT(!virtq_has_avail(&vq));
+
+    virtq_set_notification(&vq, true);
+    CU_ASSERT(!(qdata.used_ring->flags & VIRTQ_USED_F_NO_NOTIFY));
+
+    /* with event idx, avail_event is left behind while polling */
+    uint16_t *avail_event = (uint16_t *)&qdata.used_ring->ring[qdata.qsz];
+    vq.has_event_idx = true;
+    virtq_set_notification(&vq, false);
+    head = qdata.build_descriptor_chain({
+        {0x00002000, 0x1000},
+    });
+    qdata.publish_avail(head);
+    res = qdata.kick_virtq(&vq,
+        [&](virtio_iov *iov)
+        {
+            num_handled++;
+            qdata.commit_buffers(&vq, iov, 0);
+        }
+    );
+    CU_ASSERT(res == 0);
+    CU_ASSERT(num_handled == 2);
+    CU_ASSERT(*avail_event != qdata.avail_ring->idx);
+
+    virtq_set_notification(&vq, true);
+    CU_ASSERT(*avail_event == qdata.avail_ring->idx);
+
+    virtio_virtq_release(&vq);
+}
+
+/*
+ * Request objects are recycled and may outlive the virtq they came from.
+ */
+static void iov_pool_test(void)
+{
+    int res;
+    queue_data qdata;
+    std::vector<virtio_iov *> iovs;
+
+    virtio_virtq vq;
+    qdata.attach_virtq(&vq);
+
+    auto dispatch = [&](const std::vector<q_iovec> &chain)
+    {
+        uint16_t head = qdata.build_descriptor_chain(chain);
+        qdata.publish_avail(head);
+        res = qdata.kick_virtq(&vq,
+            [&](virtio_iov *iov)
+            {
+                validate_buffers(chain, iov);
+                CU_ASSERT(((uintptr_t)virtio_iov_get_priv(iov) %
+                           alignof(max_align_t)) == 0);
+                iovs.push_back(iov);
+            }
+        );
+        CU_ASSERT(res == 0);
+    };
+
+    dispatch({{0x00001000, 0x1000}, {0x00002000, 0x1000}});
+    CU_ASSERT_FATAL(iovs.size() == 1);
+    virtio_iov *first = iovs.back();
+    qdata.commit_buffers(&vq, first, 0);
+
+    dispatch({{0x00003000, 0x1000}});
+    CU_ASSERT_FATAL(iovs.size() == 2);
+    CU_ASSERT(iovs.back() == first);
+
+    /* a chain too long to be pooled */
+    std::vector<q_iovec> long_chain;
+    for (unsigned i = 0; i < 64; i++) {
+        long_chain.push_back({0x00100000 + i * 0x1000, 0x1000});
+    }
+    dispatch(long_chain);
+    CU_ASSERT_FATAL(iovs.size() == 3);
+
+    /* release the virtq with requests still in use */
+    virtio_virtq_release(&vq);
+    virtio_free_iov(iovs[1]);
+    virtio_free_iov(iovs[2]);
+}
+
+static void region_crossing_test(void)
+{
+    int res;
+    queue_data qdata;
+
+    virtio_virtq vq;
+    qdata.attach_virtq(&vq);
+
+    g_region_size = 0x10000;
+
+    auto dispatch = [&](const std::vector<q_iovec> &chain,
+                        const std::vector<q_iovec> &expected)
+    {
+        uint16_t head = qdata.build_descriptor_chain(chain);
+        qdata.publish_avail(head);
+        res = qdata.kick_virtq(&vq,
+            [&](virtio_iov *iov)
+            {
+                validate_buffers(expected, iov);
+                qdata.commit_buffers(&vq, iov, 0);
+            }
+        );
+        CU_ASSERT(res == 0);
+        CU_ASSERT(!virtq_is_broken(&vq));
+        CU_ASSERT(qdata.collect_used().size() == 1);
+    };
+
+    dispatch({{0x00001000, 0x1000}, {0x0000f000, 0x3000}},
+             {{0x00001000, 0x1000}, {0x0000f000, 0x1000},
+              {0x00010000, 0x2000}});
+
+    dispatch({{0x0001f800, 0x21000}},
+             {{0x0001f800, 0x800}, {0x00020000, 0x10000},
+              {0x00030000, 0x10000}, {0x00040000, 0x800}});
+
+    /* more buffers than preallocated for a chain */
+    std::vector<q_iovec> expected;
+    for (unsigned i = 0; i < 1024; i++) {
+        expected.push_back({0x00100000 + i * 0x1000ull, 0x1000});
+    }
+    g_region_size = 0x1000;
+    dispatch({{0x00100000, 0x200000}, {0x00300000, 0x200000}}, expected);
+
+    g_region_size = 0;
+    virtio_virtq_release(&vq);
+}
+
+/*
+ * Packed ring: chains with direct and indirect descriptors over several ring
+ * laps, out-of-order completion, vring base and notifications.
+ */
+static void packed_ring_test(void)
+{
+    int res;
+    packed_queue_data qdata(8);
+    std::vector<virtio_iov *> iovs;
+    std::vector<pvirtq_desc> indir_table;
+    eventfd_t notified;
+
+    virtio_virtq vq;
+    qdata.attach_virtq(&vq);
+    vq.notify_fd = eventfd(0, EFD_NONBLOCK);
+
+    const std::vector<std::vector<q_iovec>> chains = {
+        {{0x00001000, 0x1000}},
+        {{0x00002000, 0x200}, {0x00003000, 0x1000, iodir::device_write}},
+        {{0x00004000, 0x200}, {0x00005000, 0x1000},
+         {0x00006000, 0x1, iodir::device_write}},
+    };
+
+    /* 4 ring descriptors per round, so the ring wraps every other round */
+    for (unsigned round = 0; round < 5; round++) {
+        std::vector<uint16_t> ids = {
+            qdata.publish_chain(chains[0]),
+            qdata.publish_chain(chains[1]),
+            qdata.publish_indirect_chain(chains[2], indir_table),
+        };
+        CU_ASSERT(virtq_has_avail(&vq));
+
+        iovs.clear();
+        res = qdata.kick_virtq(&vq,
+            [&](virtio_iov *iov)
+            {
+                iovs.push_back(iov);
+            }
+        );
+        CU_ASSERT(res == 0);
+        CU_ASSERT(!virtq_has_avail(&vq));
+        CU_ASSERT_FATAL(iovs.size() == chains.size());
+        for (size_t i = 0; i < chains.size(); i++) {
+            validate_buffers(chains[i], iovs[i]);
+        }
+
+        /* complete in reverse order, in a batch */
+        virtq_begin_batch(&vq);
+        for (size_t i = iovs.size(); i-- > 0; ) {
+            qdata.commit_buffers(&vq, iovs[i], i + 1);
+        }
+        /* nothing is visible to the driver until the batch is committed */
+        CU_ASSERT(qdata.collect_used().size() == 0);
+        virtq_commit_batch(&vq);
+
+        std::vector<pvirtq_desc> used = qdata.collect_used();
+        CU_ASSERT_FATAL(used.size() == ids.size());
+        for (size_t i = 0; i < used.size(); i++) {
+            CU_ASSERT(used[i].id == ids[ids.size() - 1 - i]);
+            CU_ASSERT(used[i].len == ids.size() - i);
+        }
+        CU_ASSERT(qdata.used_idx == qdata.avail_idx);
+        CU_ASSERT(qdata.used_wrap_counter == qdata.avail_wrap_counter);
+
+        CU_ASSERT(eventfd_read(vq.notify_fd, &notified) == 0);
+    }
+
+    uint32_t base = qdata.avail_idx | (uint32_t)qdata.avail_wrap_counter << 15;
+    CU_ASSERT(virtq_get_base(&vq) == (base | base << 16));
+
+    /* the used position is restored from the upper half when it's set */
+    virtio_virtq vq_base = {};
+    vq_base.packed = true;
+    virtq_set_base(&vq_base, 0x8003 | 0x0001u << 16);
+    CU_ASSERT(virtq_get_base(&vq_base) == (0x8003 | 0x0001u << 16));
+    virtq_set_base(&vq_base, 0x8003);
+    CU_ASSERT(virtq_get_base(&vq_base) == (0x8003 | 0x8003u << 16));
+
+    auto dispatch = [&]()
+    {
+        qdata.publish_chain(chains[0]);
+        res = qdata.kick_virtq(&vq,
+            [&](virtio_iov *iov)
+            {
+                qdata.commit_buffers(&vq, iov, 0);
+            }
+        );
+        CU_ASSERT(res == 0);
+        CU_ASSERT(qdata.collect_used().size() == 1);
+    };
+
+    /* the driver doesn't want notifications */
+    qdata.driver_event.flags = RING_EVENT_FLAGS_DISABLE;
+    dispatch();
+    CU_ASSERT(eventfd_read(vq.notify_fd, &notified) < 0);
+
+    /* the driver wants to be notified once a specific descriptor is used */
+    vq.has_event_idx = true;
+    qdata.driver_event.flags = RING_EVENT_FLAGS_DESC;
+    qdata.driver_event.off_wrap =
+        (qdata.used_idx + 1) % qdata.qsz |
+        (qdata.used_idx + 1 < qdata.qsz ? qdata.used_wrap_counter :
+                                          !qdata.used_wrap_counter) << 15;
+    dispatch();
+    CU_ASSERT(eventfd_read(vq.notify_fd, &notified) < 0);
+    dispatch();
+    CU_ASSERT(eventfd_read(vq.notify_fd, &notified) == 0);
+
+    /* notification suppression is reflected in the device event area */
+    virtq_set_notification(&vq, false);
+    CU_ASSERT(qdata.device_event.flags == RING_EVENT_FLAGS_DISABLE);
+    virtq_set_notification(&vq, true);
+    CU_ASSERT(qdata.device_event.flags == RING_EVENT_FLAGS_ENABLE);
+
+    close(vq.notify_fd);
+    virtio_virtq_release(&vq);
+}
+
+/*
+ * Packed ring inflight tracking: the requests in flight when the backend dies
+ * are resubmitted in order once it's restarted, and the ring positions are
+ * restored from the inflight region even though the master doesn't know them.
+ */
+static void packed_inflight_recover_test(void)
+{
+    int res;
+    packed_queue_data qdata(16);
+    std::vector<virtio_iov *> iovs;
+    std::vector<std::vector<q_iovec>> chains;
+    std::vector<uint16_t> ids;
+
+    /* what the master sends on restart after the backend dies */
+    uint32_t base = qdata.avail_idx | (uint32_t)qdata.avail_wrap_counter << 15;
+
+    virtio_virtq vq;
+    qdata.attach_virtq(&vq);
+
+    for (unsigned i = 0; i < 12; i++) {
+        std::vector<q_iovec> chain = {{0x00010000 + i * 0x1000ull, 0x200}};
+        if (i % 3 == 0) {
+            chain.push_back({0x00100000 + i * 0x1000ull, 0x1000,
+                             iodir::device_write});
+        }
+        chains.push_back(chain);
+        ids.push_back(qdata.publish_chain(chain));
+    }
+
+    res = qdata.kick_virtq(&vq,
+        [&](virtio_iov *iov)
+        {
+            iovs.push_back(iov);
+        }
+    );
+    CU_ASSERT(res == 0);
+    CU_ASSERT_FATAL(iovs.size() == chains.size());
+
+    /* complete every other request */
+    for (size_t i = 0; i < iovs.size(); i += 2) {
+        qdata.commit_buffers(&vq, iovs[i], 0);
+    }
+    CU_ASSERT(qdata.collect_used().size() == iovs.size() / 2);
+
+    /* the backend dies with the rest still in flight */
+    virtio_virtq_release(&vq);
+    for (size_t i = 1; i < iovs.size(); i += 2) {
+        virtio_free_iov(iovs[i]);
+    }
+
+    qdata.attach_virtq(&vq, base);
+
+    iovs.clear();
+    res = qdata.kick_virtq(&vq,
+        [&](virtio_iov *iov)
+        {
+            iovs.push_back(iov);
+        }
+    );
+    CU_ASSERT(res == 0);
+    CU_ASSERT_FATAL(iovs.size() == chains.size() / 2);
+    for (size_t i = 0; i < iovs.size(); i++) {
+        validate_buffers(chains[2 * i + 1], iovs[i]);
+        qdata.commit_buffers(&vq, iovs[i], 0);
+    }
+
+    std::vector<pvirtq_desc> used = qdata.collect_used();
+    CU_ASSERT_FATAL(used.size() == chains.size() / 2);
+    for (size_t i = 0; i < used.size(); i++) {
+        CU_ASSERT(used[i].id == ids[2 * i + 1]);
+    }
+    CU_ASSERT(qdata.used_idx == qdata.avail_idx);
+    CU_ASSERT(qdata.used_wrap_counter == qdata.avail_wrap_counter);
+
+    /* new requests continue from where the previous incarnation stopped */
+    std::vector<q_iovec> chain = {{0x00020000, 0x200}};
+    uint16_t id = qdata.publish_chain(chain);
+    res = qdata.kick_virtq(&vq,
+        [&](virtio_iov *iov)
+        {
+            validate_buffers(chain, iov);
+            qdata.commit_buffers(&vq, iov, 0);
+        }
+    );
+    CU_ASSERT(res == 0);
+    used = qdata.collect_used();
+    CU_ASSERT_FATAL(used.size() == 1);
+    CU_ASSERT(used[0].id == id);
+
+    for (uint16_t i = 0; i < qdata.qsz; i++) {
+        CU_ASSERT(!qdata.inflight_region->desc[i].inflight);
+    }
+
+    virtio_virtq_release(&vq);
+}
+
+/*
+ * Dequeue limit used for in-flight backpressure: the buffers over the limit
+ * are left in the avail ring and picked up by the next dispatch.
+ */
+static void dequeue_limit_test(void)
+{
+    int res;
+    std::vector<virtio_iov *> iovs;
+    auto collect = [&](virtio_iov *iov)
+    {
+        iovs.push_back(iov);
+    };
+
+    {
+        queue_data qdata;
+        virtio_virtq vq;
+        qdata.attach_virtq(&vq);
+
+        for (unsigned i = 0; i < 5; i++) {
+            qdata.publish_avail(qdata.build_descriptor_chain({
+                {0x00001000 + i * 0x1000, 0x1000},
+            }));
+        }
+
+        vq.max_dequeue = 3;
+        res = qdata.kick_virtq(&vq, collect);
+        CU_ASSERT(res == 0);
+        CU_ASSERT(iovs.size() == 3);
+        CU_ASSERT(virtq_has_avail(&vq));
+
+        vq.max_dequeue = 0;
+        res = qdata.kick_virtq(&vq, collect);
+        CU_ASSERT(res == 0);
+        CU_ASSERT(iovs.size() == 5);
+        CU_ASSERT(!virtq_has_avail(&vq));
+
+        for (auto iov : iovs) {
+            qdata.commit_buffers(&vq, iov, 0);
+        }
+        iovs.clear();
+        virtio_virtq_release(&vq);
+    }
+
+    {
+        packed_queue_data qdata(8);
+        virtio_virtq vq;
+        qdata.attach_virtq(&vq);
+
+        for (unsigned i = 0; i < 5; i++) {
+            qdata.publish_chain({{0x00001000 + i * 0x1000, 0x1000}});
+        }
+
+        vq.max_dequeue = 2;
+        res = qdata.kick_virtq(&vq, collect);
+        CU_ASSERT(res == 0);
+        CU_ASSERT(iovs.size() == 2);
+        CU_ASSERT(virtq_has_avail(&vq));
+
+        vq.max_dequeue = 0;
+        res = qdata.kick_virtq(&vq, collect);
+        CU_ASSERT(res == 0);
+        CU_ASSERT(iovs.size() == 5);
+        CU_ASSERT(!virtq_has_avail(&vq));
+
+        for (auto iov : iovs) {
+            qdata.commit_buffers(&vq, iov, 0);
+        }
+        virtio_virtq_release(&vq);
+    }
+}
+
+/*
+ * virtq_dequeue_burst() takes the same buffers off the ring as
+ * virtq_dequeue_many(), in ring order
+ */
+static void burst_dequeue_test(void)
+{
+    int res;
+    std::vector<uint16_t> heads;
+    struct virtq_burst burst;
+    virtio_iov *iov;
+
+    queue_data qdata;
+    virtio_virtq vq;
+    qdata.attach_virtq(&vq);
+
+    for (unsigned i = 0; i < 4; i++) {
+        uint16_t head = qdata.build_descriptor_chain({
+            {0x00001000 + i * 0x1000, 0x1000},
+        });
+        heads.push_back(head);
+        qdata.publish_avail(head);
+    }
+
+    res = virtq_dequeue_burst(&vq, &burst);
+    CU_ASSERT(res == 0);
+    CU_ASSERT(!virtq_has_avail(&vq));
+
+    for (unsigned i = 0; i < heads.size(); i++) {
+        iov = virtq_burst_next(&burst);
+        CU_ASSERT_FATAL(iov != NULL);
+        CU_ASSERT(virtio_iov_get_head(iov) == heads[i]);
+        CU_ASSERT(iov->nvecs == 1);
+        CU_ASSERT(iov->buffers[0].len == 0x1000);
+        qdata.commit_buffers(&vq, iov, 0);
+    }
+    CU_ASSERT(virtq_burst_next(&burst) == NULL);
+
+    /* nothing left */
+    res = virtq_dequeue_burst(&vq, &burst);
+    CU_ASSERT(res == 0);
+    CU_ASSERT(virtq_burst_next(&burst) == NULL);
+
+    virtio_virtq_release(&vq);
+}
+
+/*
+ * A fenced virtq reports the base rewound by the buffers in flight and drops
+ * their completions, leaving them in flight for the next user to resubmit
+ */
+static void fence_test(void)
+{
+    int res;
+    queue_data qdata;
+    std::vector<virtio_iov *> iovs;
+    std::vector<uint16_t> heads;
+    const unsigned num_req = 6;
+
+    virtio_virtq vq;
+    qdata.attach_virtq(&vq);
+
+    for (unsigned i = 0; i < num_req; i++) {
+        uint16_t head = qdata.build_descriptor_chain({
+            {0x00001000 + i * 0x1000, 0x1000},
+        });
+        heads.push_back(head);
+        qdata.publish_avail(head);
+    }
+    res = qdata.kick_virtq(&vq, [&](virtio_iov *iov) { iovs.push_back(iov); });
+    CU_ASSERT(res == 0);
+    CU_ASSERT_FATAL(iovs.size() == num_req);
+
+    /* complete a couple out of order before fencing */
+    qdata.commit_buffers(&vq, iovs[3], 0);
+    qdata.commit_buffers(&vq, iovs[1], 0);
+
+    CU_ASSERT(virtq_fence(&vq) == 2);
+
+    /* completions after the fence change neither the rings nor inflight */
+    qdata.commit_buffers(&vq, iovs[0], 0);
+    CU_ASSERT(qdata.used_ring->idx == 2);
+    CU_ASSERT(qdata.get_inflight_desc(heads[0])->inflight == 1);
+    validate_inflight_region(qdata, 2);
+
+    for (unsigned i = 0; i < num_req; i++) {
+        if (i != 0 && i != 1 && i != 3) {
+            virtio_free_iov(iovs[i]);
+        }
+    }
+    virtio_virtq_release(&vq);
+
+    /* the next user resubmits all but the ones completed before the fence */
+    iovs.clear();
+    qdata.attach_virtq(&vq);
+    res = qdata.kick_virtq(&vq, [&](virtio_iov *iov) { iovs.push_back(iov); });
+    CU_ASSERT(res == 0);
+    CU_ASSERT_FATAL(iovs.size() == num_req - 2);
+    CU_ASSERT(virtio_iov_get_head(iovs[0]) == heads[0]);
+    CU_ASSERT(virtio_iov_get_head(iovs[1]) == heads[2]);
+    for (auto iov : iovs) {
+        qdata.commit_buffers(&vq, iov, 0);
+    }
+    validate_inflight_region(qdata, num_req);
+
+    virtio_virtq_release(&vq);
+}
+
+/*
+ * The virtq holds one reference per memory map it has requests in use with,
+ * dropping the old one once the last request using it is released
+ */
+static void memmap_gen_test(void)
+{
+    int res;
+    queue_data qdata;
+    std::vector<virtio_iov *> iovs;
+    struct vhd_memory_map *mm1 = (struct vhd_memory_map *)0x1000;
+    struct vhd_memory_map *mm2 = (struct vhd_memory_map *)0x2000;
+
+    virtio_virtq vq;
+    qdata.attach_virtq(&vq);
+    vq.mm = mm1;
+
+    for (unsigned i = 0; i < 6; i++) {
+        if (i == 3) {
+            vq.mm = mm2;
+        }
+        uint16_t head = qdata.build_descriptor_chain({
+            {0x00001000 + i * 0x1000, 0x1000},
+        });
+        qdata.publish_avail(head);
+        res = qdata.kick_virtq(&vq,
+                               [&](virtio_iov *iov) { iovs.push_back(iov); });
+        CU_ASSERT(res == 0);
+    }
+    CU_ASSERT_FATAL(iovs.size() == 6);
+    CU_ASSERT(g_memmap_refs[mm1] == 1);
+    CU_ASSERT(g_memmap_refs[mm2] == 1);
+
+    /* the old map goes with its last request, regardless of the order */
+    qdata.commit_buffers(&vq, iovs[1], 0);
+    qdata.commit_buffers(&vq, iovs[4], 0);
+    qdata.commit_buffers(&vq, iovs[0], 0);
+    CU_ASSERT(g_memmap_refs[mm1] == 1);
+    qdata.commit_buffers(&vq, iovs[2], 0);
+    CU_ASSERT(g_memmap_refs[mm1] == 0);
+    CU_ASSERT(g_memmap_refs[mm2] == 1);
+
+    /* the current one stays after the virtq is released until unused */
+    virtio_virtq_release(&vq);
+    CU_ASSERT(g_memmap_refs[mm2] == 1);
+    virtio_free_iov(iovs[3]);
+    virtio_free_iov(iovs[5]);
+    CU_ASSERT(g_memmap_refs[mm2] == 0);
+}
+
+/*
+ * Runs of contiguous descriptors in indirect tables are translated at once,
+ * but still split at region boundaries and into one buffer per descriptor,
+ * each tagged with its region and offset in it
+ */
+static void indirect_run_test(void)
+{
+    int res;
+    queue_data qdata;
+    std::vector<virtq_desc> table;
+
+    virtio_virtq vq;
+    qdata.attach_virtq(&vq);
+
+    g_region_size = 0x10000;
+
+    std::vector<q_iovec> chain = {
+        {0x0000e000, 0x1000},
+        {0x0000f000, 0x800, iodir::device_write},
+        {0x0000f800, 0x1000, iodir::device_write},
+        {0x00010800, 0x800, iodir::device_write},
+        {0x00011000, 0x1000},
+    };
+    std::vector<q_iovec> expected = {
+        {0x0000e000, 0x1000},
+        {0x0000f000, 0x800, iodir::device_write},
+        {0x0000f800, 0x800, iodir::device_write},
+        {0x00010000, 0x800, iodir::device_write},
+        {0x00010800, 0x800, iodir::device_write},
+        {0x00011000, 0x1000},
+    };
+
+    qdata.publish_avail(qdata.build_indirect_descriptor_chain(chain, table));
+    res = qdata.kick_virtq(&vq,
+        [&](virtio_iov *iov)
+        {
+            validate_buffers(expected, iov);
+            for (uint16_t i = 0; i < iov->nvecs; i++) {
+                CU_ASSERT(iov->buffers[i].write_only ==
+                          (expected[i].dir == iodir::device_write));
+                CU_ASSERT(iov->buffers[i].region_id ==
+                          (uintptr_t)expected[i].addr / g_region_size);
+                CU_ASSERT(iov->buffers[i].region_offset ==
+                          (uintptr_t)expected[i].addr % g_region_size);
+            }
+            qdata.commit_buffers(&vq, iov, 0);
+        }
+    );
+    CU_ASSERT(res == 0);
+    CU_ASSERT(!virtq_is_broken(&vq));
+    CU_ASSERT(qdata.collect_used().size() == 1);
+
+    g_region_size = 0;
+    virtio_virtq_release(&vq);
+}
+
+/*
+ * Dirty pages of the buffers completed in a batch are logged on commit, using
+ * the guest physical addresses carried in the iovs
+ */
+static void dirty_log_test(void)
+{
+    int res;
+    const size_t log_size = 0x1000;
+    std::vector<virtio_iov *> iovs;
+
+    int fd = memfd_create("dirty_log", 0);
+    CU_ASSERT_FATAL(fd >= 0);
+    CU_ASSERT_FATAL(ftruncate(fd, log_size) == 0);
+    struct vhd_memory_log *log = vhd_memlog_new(log_size, fd, 0);
+    CU_ASSERT_FATAL(log != NULL);
+    const uint64_t *bitmap = (const uint64_t *)mmap(NULL, log_size, PROT_READ,
+                                                    MAP_SHARED, fd, 0);
+    CU_ASSERT_FATAL(bitmap != MAP_FAILED);
+
+    queue_data qdata;
+    virtio_virtq vq;
+    qdata.attach_virtq(&vq);
+    vq.log = log;
+
+    qdata.publish_avail(qdata.build_descriptor_chain({
+        {0x00001000, 0x200},
+        {0x0003f000, 0x3000, iodir::device_write},
+    }));
+    qdata.publish_avail(qdata.build_descriptor_chain({
+        {0x00002000, 0x200},
+        {0x00042000, 0x1000, iodir::device_write},
+        {0x00100800, 0x10, iodir::device_write},
+    }));
+
+    res = qdata.kick_virtq(&vq,
+        [&](virtio_iov *iov)
+        {
+            iovs.push_back(iov);
+        }
+    );
+    CU_ASSERT(res == 0);
+    CU_ASSERT_FATAL(iovs.size() == 2);
+
+    virtq_begin_batch(&vq);
+    for (auto iov : iovs) {
+        qdata.commit_buffers(&vq, iov, 0);
+    }
+    CU_ASSERT(bitmap[0] == 0 && bitmap[1] == 0 && bitmap[4] == 0);
+    virtq_commit_batch(&vq);
+
+    CU_ASSERT(bitmap[0] == 1ull << 63);
+    CU_ASSERT(bitmap[1] == 0x7);
+    CU_ASSERT(bitmap[2] == 0 && bitmap[3] == 0);
+    CU_ASSERT(bitmap[4] == 0x1);
+    CU_ASSERT(qdata.collect_used().size() == 2);
+
+    virtio_virtq_release(&vq);
+    vhd_memlog_free(log);
+    munmap((void *)bitmap, log_size);
+    close(fd);
+}
+
 int main(void)
 {
     int res = 0;
@@ -867,6 +1835,20 @@ int main(void)
     CU_ADD_TEST(suite, broken_queue_test);
     CU_ADD_TEST(suite, inflight_base_test);
     CU_ADD_TEST(suite, inflight_recover_test);
+    CU_ADD_TEST(suite, inflight_resubmit_batch_test);
+    CU_ADD_TEST(suite, batched_completion_test);
+    CU_ADD_TEST(suite, notify_coalescing_test);
+    CU_ADD_TEST(suite, notification_suppression_test);
+    CU_ADD_TEST(suite, iov_pool_test);
+    CU_ADD_TEST(suite, region_crossing_test);
+    CU_ADD_TEST(suite, packed_ring_test);
+    CU_ADD_TEST(suite, packed_inflight_recover_test);
+    CU_ADD_TEST(suite, dequeue_limit_test);
+    CU_ADD_TEST(suite, burst_dequeue_test);
+    CU_ADD_TEST(suite, fence_test);
+    CU_ADD_TEST(suite, memmap_gen_test);
+    CU_ADD_TEST(suite, indirect_run_test);
+    CU_ADD_TEST(suite, dirty_log_test);
 
     CU_basic_set_mode(CU_BRM_VERBOSE);
     CU_basic_run_tests();
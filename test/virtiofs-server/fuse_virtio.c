@@ -109,32 +109,34 @@ static void iov_copy_to_iov(
     }
 }
 
+static void sglist_to_iov(
+    struct iovec* iov,
+    size_t* count,
+    const struct vhd_sglist* sglist)
+{
+    for (uint32_t i = 0; i < sglist->nbuffers; ++i) {
+        iov[*count].iov_base = sglist->buffers[i].base;
+        iov[*count].iov_len = sglist->buffers[i].len;
+        ++*count;
+    }
+}
+
 static void split_request_buffers(
     struct fuse_virtio_request* req,
-    struct vhd_sglist* sglist)
+    struct vhd_fs_io* fs_io)
 {
-    size_t i = 0;
-
     req->in.iov = req->iov;
-    for (; i < sglist->nbuffers; ++i) {
-        struct vhd_buffer* buf = &sglist->buffers[i];
-        if (buf->write_only) {
-            break;
-        }
-        struct iovec* iov = &req->in.iov[req->in.count++];
-        iov->iov_base = buf->base;
-        iov->iov_len = buf->len;
-    }
-
-    req->out.iov = &req->iov[i];
-    for (; i < sglist->nbuffers; ++i) {
-        struct vhd_buffer* buf = &sglist->buffers[i];
-        if (!buf->write_only) {
-            break;
-        }
-        struct iovec* iov = &req->out.iov[req->out.count++];
-        iov->iov_base = buf->base;
-        iov->iov_len = buf->len;
+    req->in.iov[0].iov_base = (void*) fs_io->in_hdr;
+    req->in.iov[0].iov_len = sizeof(struct fuse_in_header);
+    req->in.count = 1;
+    sglist_to_iov(req->in.iov, &req->in.count, &fs_io->in_args);
+
+    req->out.iov = &req->iov[req->in.count];
+    if (fs_io->out_hdr) {
+        req->out.iov[0].iov_base = fs_io->out_hdr;
+        req->out.iov[0].iov_len = sizeof(struct fuse_out_header);
+        req->out.count = 1;
+        sglist_to_iov(req->out.iov, &req->out.count, &fs_io->out_args);
     }
 }
 
@@ -161,7 +163,8 @@ static bool is_oneway_request(struct fuse_in_header* in)
 
 static int process_write_request(
     struct fuse_session* se,
-    struct fuse_virtio_request* req)
+    struct fuse_virtio_request* req,
+    struct vhd_fs_io* fs_io)
 {
     size_t len = iov_size(req->in.iov, req->in.count);
     if (len > se->bufsize) {
@@ -176,64 +179,28 @@ static int process_write_request(
      */
     static const size_t buf0len =
         sizeof(struct fuse_in_header) + sizeof(struct fuse_write_in);
-    if (len <= buf0len) {
+    if (len <= buf0len || !fs_io->data.nbuffers) {
         return -EINVAL;
     }
 
-    size_t count, hdr_buf, iov_idx, iov_off;
-    if (req->in.count == 1 || req->in.iov[0].iov_len == buf0len) {
-        /* original framing matches expected, pass through */
-        count = req->in.count;
-        hdr_buf = 0;
-        iov_idx = 0;
-        iov_off = 0;
-    } else if (req->in.iov[0].iov_len > buf0len) {
-        /* first segment contains headers and data; split the two apart */
-        count = req->in.count + 1;
-        hdr_buf = 1;
-        iov_idx = 0;
-        iov_off = buf0len;
-    } else {
-        /* need intermediate buffer for headers */
-        size_t left;
-        void *ptr;
-        req->buffer = vhd_alloc(len);
-        for (ptr = req->buffer, iov_idx = 0, left = buf0len; ; iov_idx++) {
-            iov_off = MIN(left, req->in.iov[iov_idx].iov_len);
-            memcpy(ptr, req->in.iov[iov_idx].iov_base, iov_off);
-            ptr += iov_off;
-            left -= iov_off;
-            /* break *before* iov_idx increment */
-            if (left == 0) {
-                break;
-            }
-        }
-        if (iov_off == req->in.iov[iov_idx].iov_len) {
-            /* full segment -- skip to next one */
-            iov_idx++;
-            iov_off = 0;
-        }
-        count = req->in.count - iov_idx + 1;
-        hdr_buf = 1;
-    }
+    /* copy the headers to a safe place, but pass the data through as is */
+    req->buffer = vhd_alloc(buf0len);
+    struct iovec hdr_iov = { .iov_base = req->buffer, .iov_len = buf0len };
+    iov_copy_to_iov(&hdr_iov, 1, req->in.iov, req->in.count, buf0len);
 
+    size_t count = 1 + fs_io->data.nbuffers;
     struct fuse_bufvec* bufv = vhd_zalloc(
         sizeof(struct fuse_bufvec) +
         sizeof(struct fuse_buf) * (count - 1));
 
     bufv->count = count;
+    bufv->buf[0].mem = req->buffer;
+    bufv->buf[0].size = buf0len;
+    bufv->buf[0].fd = -1;
 
-    if (hdr_buf) {
-        bufv->buf[0].mem = req->buffer ? req->buffer : req->in.iov[0].iov_base;
-        bufv->buf[0].size = buf0len;
-        bufv->buf[0].fd = -1;
-    }
-
-    size_t idx;
-    for (idx = hdr_buf; idx < count; idx++, iov_idx++) {
-        bufv->buf[idx].mem = req->in.iov[iov_idx].iov_base + iov_off;
-        bufv->buf[idx].size = req->in.iov[iov_idx].iov_len - iov_off;
-        iov_off = 0;
+    for (size_t idx = 1; idx < count; idx++) {
+        bufv->buf[idx].mem = fs_io->data.buffers[idx - 1].base;
+        bufv->buf[idx].size = fs_io->data.buffers[idx - 1].len;
         bufv->buf[idx].fd = -1;
     }
 
@@ -267,29 +234,28 @@ static int process_request(struct fuse_session* se, struct vhd_bdev_io* bio)
 {
     VHD_ASSERT(bio->sglist.nbuffers > 0);
 
+    struct vhd_fs_io* fs_io = vhd_get_fs_io(bio);
+
+    /* the headers may share buffers with the arguments */
     struct fuse_virtio_request* req = vhd_zalloc(
         sizeof(struct fuse_virtio_request) +
-        sizeof(struct iovec) * (bio->sglist.nbuffers - 1));
+        sizeof(struct iovec) * (bio->sglist.nbuffers + 1));
 
     req->bio = bio;
 
-    split_request_buffers(req, &bio->sglist);
-    VHD_ASSERT(req->in.count + req->out.count == bio->sglist.nbuffers);
+    split_request_buffers(req, fs_io);
 
     VHD_LOG_DEBUG("request with %zu IN desc of length %zu "
                   "and %zu OUT desc of length %zu\n",
         req->in.count, iov_size(req->in.iov, req->in.count),
         req->out.count, iov_size(req->out.iov, req->out.count));
 
-    VHD_ASSERT(req->in.count >= 1);
-    VHD_ASSERT(req->in.iov[0].iov_len >= sizeof(struct fuse_in_header));
-
-    struct fuse_in_header* in = (struct fuse_in_header*) req->in.iov[0].iov_base;
+    struct fuse_in_header* in = (struct fuse_in_header*) fs_io->in_hdr;
 
     // We could not trust client so we will copy request to a safe place.
     // But for WRITE request we do not want to copy payload - just headers!
     int res = is_write_request(in)
-        ? process_write_request(se, req)
+        ? process_write_request(se, req, fs_io)
         : process_generic_request(se, req);
 
     // For now there is no way to notify one-way requests completion
@@ -0,0 +1,230 @@
+#include <pthread.h>
+#include <string.h>
+#include <sys/syscall.h>
+
+#include "logging.h"
+#include "queue.h"
+#include "trace.h"
+
+#ifdef VHD_TRACE
+
+#define VHD_TRACE_DUMP_VERSION 1
+
+struct trace_thread {
+    struct vhd_trace_ring ring;
+    uint32_t tid;
+    SLIST_ENTRY(trace_thread) link;
+};
+
+struct trace_vq {
+    uint32_t id;
+    char *name;
+    SLIST_ENTRY(trace_vq) link;
+};
+
+/*
+ * Dump layout, in host byte order:
+ * - struct trace_dump_header;
+ * - @num_vqs times: struct trace_dump_vq followed by @name_len bytes of name;
+ * - @num_threads times: struct trace_dump_thread followed by @num_events
+ *   struct vhd_trace_event, oldest first.
+ */
+struct trace_dump_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t event_size;
+    uint32_t num_vqs;
+    uint32_t num_threads;
+};
+
+struct trace_dump_vq {
+    uint32_t id;
+    uint32_t name_len;
+};
+
+struct trace_dump_thread {
+    uint32_t tid;
+    uint32_t reserved;
+    uint64_t num_events;
+};
+
+bool vhd_trace_enabled;
+__thread struct vhd_trace_ring *vhd_trace_ring;
+
+/* protects the lists and the counters below */
+static pthread_mutex_t g_trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static SLIST_HEAD(, trace_thread) g_trace_threads =
+    SLIST_HEAD_INITIALIZER(g_trace_threads);
+static SLIST_HEAD(, trace_vq) g_trace_vqs = SLIST_HEAD_INITIALIZER(g_trace_vqs);
+static uint32_t g_num_trace_threads;
+static uint32_t g_num_trace_vqs;
+
+/*
+ * The rings of the threads that have exited are kept too: they may have the
+ * events of interest, and the threads serving requests are long-lived anyway
+ */
+struct vhd_trace_ring *vhd_trace_ring_new(void)
+{
+    struct trace_thread *thread = vhd_zalloc(sizeof(*thread));
+
+    thread->tid = syscall(SYS_gettid);
+
+    pthread_mutex_lock(&g_trace_lock);
+    SLIST_INSERT_HEAD(&g_trace_threads, thread, link);
+    g_num_trace_threads++;
+    pthread_mutex_unlock(&g_trace_lock);
+
+    vhd_trace_ring = &thread->ring;
+    return vhd_trace_ring;
+}
+
+/*
+ * The ids are never freed, as the events recorded with them may still be in
+ * the rings; a virtqueue registered again under the same name, as on the
+ * device re-registration, gets its old id back instead
+ */
+uint32_t vhd_trace_vq_id(const char *name)
+{
+    struct trace_vq *vq;
+    uint32_t id;
+
+    pthread_mutex_lock(&g_trace_lock);
+    SLIST_FOREACH(vq, &g_trace_vqs, link) {
+        if (!strcmp(vq->name, name)) {
+            break;
+        }
+    }
+    if (!vq) {
+        vq = vhd_alloc(sizeof(*vq));
+        vq->name = vhd_strdup(name);
+        /* 0 is never allocated, for the events not tied to a virtqueue */
+        vq->id = ++g_num_trace_vqs;
+        SLIST_INSERT_HEAD(&g_trace_vqs, vq, link);
+    }
+    id = vq->id;
+    pthread_mutex_unlock(&g_trace_lock);
+
+    return id;
+}
+
+int vhd_trace_set_enabled(bool enabled)
+{
+    atomic_set(&vhd_trace_enabled, enabled);
+    return 0;
+}
+
+static int write_full(int fd, const void *buf, size_t len)
+{
+    const char *p = buf;
+
+    while (len) {
+        ssize_t ret = write(fd, p, len);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -errno;
+        }
+        p += ret;
+        len -= ret;
+    }
+
+    return 0;
+}
+
+static int dump_ring(int fd, struct trace_thread *thread)
+{
+    struct vhd_trace_ring *ring = &thread->ring;
+    unsigned long pos = atomic_load_acquire(&ring->pos);
+    struct trace_dump_thread hdr = {
+        .tid = thread->tid,
+        .num_events = MIN(pos, VHD_TRACE_RING_ENTRIES),
+    };
+    size_t split;
+    int ret;
+
+    ret = write_full(fd, &hdr, sizeof(hdr));
+    if (ret < 0) {
+        return ret;
+    }
+
+    if (pos <= VHD_TRACE_RING_ENTRIES) {
+        return write_full(fd, ring->events, pos * sizeof(ring->events[0]));
+    }
+
+    /* wrapped: the oldest event is the one to be overwritten next */
+    split = pos % VHD_TRACE_RING_ENTRIES;
+    ret = write_full(fd, &ring->events[split],
+                     (VHD_TRACE_RING_ENTRIES - split) *
+                     sizeof(ring->events[0]));
+    if (ret < 0) {
+        return ret;
+    }
+
+    return write_full(fd, ring->events, split * sizeof(ring->events[0]));
+}
+
+int vhd_trace_dump(int fd)
+{
+    struct trace_dump_header hdr = {
+        .magic = "VHDTRACE",
+        .version = VHD_TRACE_DUMP_VERSION,
+        .event_size = sizeof(struct vhd_trace_event),
+    };
+    struct trace_thread *thread;
+    struct trace_vq *vq;
+    int ret;
+
+    pthread_mutex_lock(&g_trace_lock);
+
+    hdr.num_vqs = g_num_trace_vqs;
+    hdr.num_threads = g_num_trace_threads;
+    ret = write_full(fd, &hdr, sizeof(hdr));
+    if (ret < 0) {
+        goto out;
+    }
+
+    SLIST_FOREACH(vq, &g_trace_vqs, link) {
+        struct trace_dump_vq vq_hdr = {
+            .id = vq->id,
+            .name_len = strlen(vq->name),
+        };
+
+        ret = write_full(fd, &vq_hdr, sizeof(vq_hdr));
+        if (ret < 0) {
+            goto out;
+        }
+        ret = write_full(fd, vq->name, vq_hdr.name_len);
+        if (ret < 0) {
+            goto out;
+        }
+    }
+
+    SLIST_FOREACH(thread, &g_trace_threads, link) {
+        ret = dump_ring(fd, thread);
+        if (ret < 0) {
+            goto out;
+        }
+    }
+
+out:
+    pthread_mutex_unlock(&g_trace_lock);
+    if (ret < 0) {
+        VHD_LOG_ERROR("failed to dump trace: %s", strerror(-ret));
+    }
+    return ret;
+}
+
+#else
+
+int vhd_trace_set_enabled(bool enabled)
+{
+    return -ENOTSUP;
+}
+
+int vhd_trace_dump(int fd)
+{
+    return -ENOTSUP;
+}
+
+#endif
@@ -0,0 +1,96 @@
+/*
+ * Per-thread ring buffers of request trace events, see vhost/trace.h.
+ * Compiled out unless VHD_TRACE is defined.
+ */
+
+#pragma once
+
+#include <time.h>
+
+#include "catomic.h"
+#include "platform.h"
+#include "vhost/trace.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct vhd_trace_event {
+    uint64_t ts_ns;
+    uint32_t vq_id;
+    uint16_t head;
+    uint8_t point;
+    uint8_t reserved;
+};
+
+VHD_STATIC_ASSERT(sizeof(struct vhd_trace_event) == 16);
+
+#ifdef VHD_TRACE
+
+/*
+ * Only written by the owner thread; @pos is the number of events ever
+ * recorded, read by the dumping thread to tell where the ring starts
+ */
+struct vhd_trace_ring {
+    unsigned long pos;
+    struct vhd_trace_event events[VHD_TRACE_RING_ENTRIES];
+};
+
+extern bool vhd_trace_enabled;
+extern __thread struct vhd_trace_ring *vhd_trace_ring;
+
+struct vhd_trace_ring *vhd_trace_ring_new(void);
+
+static inline void vhd_trace(enum vhd_trace_point point, uint32_t vq_id,
+                             uint16_t head)
+{
+    struct vhd_trace_ring *ring = vhd_trace_ring;
+    struct vhd_trace_event *ev;
+    struct timespec ts;
+    unsigned long pos;
+
+    if (likely(!atomic_read(&vhd_trace_enabled))) {
+        return;
+    }
+
+    if (unlikely(!ring)) {
+        ring = vhd_trace_ring_new();
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    pos = ring->pos;
+    ev = &ring->events[pos % VHD_TRACE_RING_ENTRIES];
+    *ev = (struct vhd_trace_event) {
+        .ts_ns = ts.tv_sec * 1000000000ull + ts.tv_nsec,
+        .vq_id = vq_id,
+        .head = head,
+        .point = point,
+    };
+    atomic_store_release(&ring->pos, pos + 1);
+}
+
+/*
+ * Get the id of virtqueue @name to record its events with, allocated on the
+ * first call for the name; the names are kept for the dumps for as long as
+ * the process lives
+ */
+uint32_t vhd_trace_vq_id(const char *name);
+
+#else
+
+static inline void vhd_trace(enum vhd_trace_point point, uint32_t vq_id,
+                             uint16_t head)
+{
+}
+
+static inline uint32_t vhd_trace_vq_id(const char *name)
+{
+    return 0;
+}
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,529 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <liburing.h>
+
+#include "vhost/uring.h"
+#include "vhost/server.h"
+#include "vhost/blockdev.h"
+
+#include "platform.h"
+#include "catomic.h"
+#include "logging.h"
+#include "event.h"
+
+/*
+ * Fixed buffer table size.  Guest memory regions are registered in chunks of
+ * at most URING_FIXED_BUF_LEN_MAX bytes (kernel limit), so this has to allow
+ * for several chunks per region.
+ */
+#define URING_FIXED_BUFS_MAX    256
+#define URING_FIXED_BUF_LEN_MAX (1ul << 30)
+
+struct uring_fixed_buf {
+    void *addr;
+    size_t len;
+};
+
+struct vhd_uring {
+    struct io_uring ring;
+
+    /* eventfd signaled by the kernel on completions */
+    int efd;
+    struct vhd_io_handler *handler;
+
+    /* SQEs prepared but not yet submitted to the kernel */
+    unsigned num_queued;
+    /* requests submitted but not yet completed */
+    unsigned num_in_flight;
+
+    /* whether the kernel supports sparse fixed buffer tables */
+    bool has_fixed_bufs;
+    /*
+     * (un)registration is done in the vhost control thread and serialized by
+     * bufs_lock; the dataplane looks the table up without taking it, retrying
+     * if bufs_seq has changed meanwhile (it's odd while an update is ongoing)
+     */
+    pthread_mutex_t bufs_lock;
+    unsigned bufs_seq;
+    struct uring_fixed_buf bufs[URING_FIXED_BUFS_MAX];
+};
+
+struct uring_request {
+    struct vhd_bdev_io *bio;
+    bool bounce_buf;
+    struct iovec iov[]; /* bio->sglist.nbuffers */
+};
+
+static unsigned bufs_read_begin(struct vhd_uring *ur)
+{
+    unsigned seq;
+
+    while ((seq = atomic_load_acquire(&ur->bufs_seq)) & 1) {
+        ;
+    }
+    return seq;
+}
+
+static bool bufs_read_retry(struct vhd_uring *ur, unsigned seq)
+{
+    smp_rmb();
+    return atomic_read(&ur->bufs_seq) != seq;
+}
+
+/* Whether [@addr, @addr + @len) is within the fixed buffer in slot @idx */
+static bool fixed_buf_contains(struct vhd_uring *ur, int idx, void *addr,
+                               size_t len)
+{
+    char *buf_addr = atomic_read(&ur->bufs[idx].addr);
+    size_t buf_len = atomic_read(&ur->bufs[idx].len);
+
+    return buf_len && (char *)addr >= buf_addr &&
+        (size_t)((char *)addr - buf_addr) + len <= buf_len;
+}
+
+static int find_fixed_buf(struct vhd_uring *ur, void *addr, size_t len)
+{
+    unsigned seq;
+    int i;
+
+    if (!ur->has_fixed_bufs) {
+        return -1;
+    }
+
+    do {
+        seq = bufs_read_begin(ur);
+        for (i = 0; i < URING_FIXED_BUFS_MAX; i++) {
+            if (fixed_buf_contains(ur, i, addr, len)) {
+                break;
+            }
+        }
+    } while (bufs_read_retry(ur, seq));
+
+    return i < URING_FIXED_BUFS_MAX ? i : -1;
+}
+
+static int update_fixed_buf(struct vhd_uring *ur, int idx, void *addr,
+                            size_t len)
+{
+    struct iovec iov = {
+        .iov_base = addr,
+        .iov_len = len,
+    };
+    int ret = io_uring_register_buffers_update_tag(&ur->ring, idx, &iov,
+                                                   NULL, 1);
+    if (ret < 0) {
+        return ret;
+    }
+
+    atomic_set(&ur->bufs_seq, ur->bufs_seq + 1);
+    smp_wmb();
+    atomic_set(&ur->bufs[idx].addr, addr);
+    atomic_set(&ur->bufs[idx].len, len);
+    atomic_store_release(&ur->bufs_seq, ur->bufs_seq + 1);
+    return 0;
+}
+
+/*
+ * Fixed buffer the data buffer is in, found by the id of its guest memory
+ * region as returned by vhd_uring_register_buffer(): the region is registered
+ * in consecutive chunks starting at slot id - 1.  The slot is checked to
+ * match still, in case map_cb tagged the region with an id of its own.
+ */
+static int region_fixed_buf(struct vhd_uring *ur, const struct vhd_buffer *buf)
+{
+    unsigned seq;
+    uint64_t idx;
+    bool match;
+
+    if (!buf->region_id || !ur->has_fixed_bufs) {
+        return -1;
+    }
+
+    idx = buf->region_id - 1 + buf->region_offset / URING_FIXED_BUF_LEN_MAX;
+    if (idx >= URING_FIXED_BUFS_MAX) {
+        return -1;
+    }
+
+    do {
+        seq = bufs_read_begin(ur);
+        match = fixed_buf_contains(ur, idx, buf->base, buf->len);
+    } while (bufs_read_retry(ur, seq));
+
+    return match ? (int)idx : -1;
+}
+
+int vhd_uring_register_buffer(struct vhd_uring *ur, void *addr, size_t len)
+{
+    int i = 0, first = -1;
+    bool consecutive = true;
+
+    if (!ur->has_fixed_bufs) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&ur->bufs_lock);
+    while (len) {
+        size_t chunk = MIN(len, URING_FIXED_BUF_LEN_MAX);
+        int ret;
+
+        for (; i < URING_FIXED_BUFS_MAX && ur->bufs[i].len; i++) {
+            ;
+        }
+        if (i == URING_FIXED_BUFS_MAX) {
+            VHD_LOG_WARN("no free fixed buffer slots for %p-%p",
+                         addr, addr + len);
+            break;
+        }
+
+        ret = update_fixed_buf(ur, i, addr, chunk);
+        if (ret < 0) {
+            VHD_LOG_WARN("failed to register fixed buffer %p-%p: %s",
+                         addr, addr + chunk, strerror(-ret));
+            break;
+        }
+
+        if (first < 0) {
+            first = i;
+        } else if (i != first + (int)((addr - ur->bufs[first].addr) /
+                                      URING_FIXED_BUF_LEN_MAX)) {
+            consecutive = false;
+        }
+
+        addr += chunk;
+        len -= chunk;
+    }
+    pthread_mutex_unlock(&ur->bufs_lock);
+
+    /* an id for region_fixed_buf() only if all of the region is registered */
+    return !len && consecutive && first >= 0 ? first + 1 : 0;
+}
+
+int vhd_uring_unregister_buffer(struct vhd_uring *ur, void *addr, size_t len)
+{
+    int i;
+
+    if (!ur->has_fixed_bufs) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&ur->bufs_lock);
+    for (i = 0; i < URING_FIXED_BUFS_MAX; i++) {
+        struct uring_fixed_buf *buf = &ur->bufs[i];
+        if (buf->len && buf->addr >= addr &&
+            (size_t)(buf->addr - addr) + buf->len <= len) {
+            int ret = update_fixed_buf(ur, i, NULL, 0);
+            if (ret < 0) {
+                VHD_LOG_WARN("failed to unregister fixed buffer %p-%p: %s",
+                             buf->addr, buf->addr + buf->len, strerror(-ret));
+            }
+        }
+    }
+    pthread_mutex_unlock(&ur->bufs_lock);
+
+    return 0;
+}
+
+static bool bio_has_data(const struct vhd_bdev_io *bio)
+{
+    return bio->type == VHD_BDEV_READ || bio->type == VHD_BDEV_WRITE;
+}
+
+static void complete_request(struct uring_request *req, int res)
+{
+    struct vhd_bdev_io *bio = req->bio;
+    enum vhd_bdev_io_result status = VHD_BDEV_SUCCESS;
+    uint64_t expected = bio_has_data(bio) ?
+        bio->total_sectors * VHD_SECTOR_SIZE : 0;
+
+    if (res < 0 || (uint64_t)res != expected) {
+        VHD_LOG_ERROR("I/O request failed: %s",
+                      res < 0 ? strerror(-res) : "short read/write");
+        status = VHD_BDEV_IOERR;
+    }
+
+    if (req->bounce_buf) {
+        if (bio->type == VHD_BDEV_READ && status == VHD_BDEV_SUCCESS) {
+            struct vhd_buffer *buffers = bio->sglist.buffers;
+            void *ptr = req->iov[0].iov_base;
+            uint32_t i;
+            for (i = 0; i < bio->sglist.nbuffers; i++) {
+                memcpy(buffers[i].base, ptr, buffers[i].len);
+                ptr += buffers[i].len;
+            }
+        }
+        vhd_free(req->iov[0].iov_base);
+    }
+
+    vhd_complete_bio(bio, status);
+    vhd_free(req);
+}
+
+static int uring_complete(void *opaque)
+{
+    struct vhd_uring *ur = opaque;
+    struct io_uring_cqe *cqe;
+    unsigned head, n = 0;
+
+    vhd_clear_eventfd(ur->efd);
+
+    io_uring_for_each_cqe(&ur->ring, head, cqe) {
+        complete_request(io_uring_cqe_get_data(cqe), cqe->res);
+        n++;
+    }
+    io_uring_cq_advance(&ur->ring, n);
+    ur->num_in_flight -= n;
+
+    return 0;
+}
+
+/*
+ * Linux requires O_DIRECT i/o buffers to be aligned to the logical block size
+ * of the underlying storage, while guests (notably Windows) may not respect
+ * that.  Assume the logical block size to equal the sector size as BIOS
+ * requires sector-granular i/o anyway.
+ */
+static bool buffers_aligned(const struct vhd_sglist *sglist)
+{
+    uint32_t i;
+
+    for (i = 0; i < sglist->nbuffers; i++) {
+        if (!VHD_IS_ALIGNED((uintptr_t)sglist->buffers[i].base,
+                            VHD_SECTOR_SIZE) ||
+            !VHD_IS_ALIGNED(sglist->buffers[i].len, VHD_SECTOR_SIZE)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static struct uring_request *prepare_request(struct vhd_bdev_io *bio)
+{
+    const struct vhd_sglist *sglist = &bio->sglist;
+    struct uring_request *req;
+    uint32_t i;
+
+    if (buffers_aligned(sglist)) {
+        req = vhd_alloc(sizeof(*req) + sizeof(req->iov[0]) * sglist->nbuffers);
+        *req = (struct uring_request) { .bio = bio };
+        for (i = 0; i < sglist->nbuffers; i++) {
+            req->iov[i] = (struct iovec) {
+                .iov_base = sglist->buffers[i].base,
+                .iov_len = sglist->buffers[i].len,
+            };
+        }
+        return req;
+    }
+
+    req = vhd_alloc(sizeof(*req) + sizeof(req->iov[0]));
+    *req = (struct uring_request) {
+        .bio = bio,
+        .bounce_buf = true,
+    };
+    req->iov[0].iov_len = bio->total_sectors * VHD_SECTOR_SIZE;
+    req->iov[0].iov_base = vhd_aligned_alloc(VHD_SECTOR_SIZE,
+                                             req->iov[0].iov_len);
+
+    if (bio->type == VHD_BDEV_WRITE) {
+        void *ptr = req->iov[0].iov_base;
+        for (i = 0; i < sglist->nbuffers; i++) {
+            memcpy(ptr, sglist->buffers[i].base, sglist->buffers[i].len);
+            ptr += sglist->buffers[i].len;
+        }
+    }
+
+    return req;
+}
+
+static struct io_uring_sqe *get_sqe(struct vhd_uring *ur)
+{
+    struct io_uring_sqe *sqe = io_uring_get_sqe(&ur->ring);
+    if (!sqe) {
+        /* submission ring is full, flush it and retry */
+        vhd_uring_submit(ur);
+        sqe = io_uring_get_sqe(&ur->ring);
+    }
+    return sqe;
+}
+
+/*
+ * Requests without data buffers.  Discard and write zeroes map onto
+ * fallocate(2), which takes a single range, so only single-range requests are
+ * supported; devices served by this backend must not advertise more segments.
+ */
+static void prep_nodata(struct io_uring_sqe *sqe, int fd,
+                        const struct vhd_bdev_io *bio)
+{
+    uint64_t offset = bio->first_sector * VHD_SECTOR_SIZE;
+    uint64_t len = bio->total_sectors * VHD_SECTOR_SIZE;
+    int mode;
+
+    switch (bio->type) {
+    case VHD_BDEV_FLUSH:
+        io_uring_prep_fsync(sqe, fd, IORING_FSYNC_DATASYNC);
+        return;
+    case VHD_BDEV_DISCARD:
+        mode = FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE;
+        break;
+    default:
+        VHD_VERIFY(bio->type == VHD_BDEV_WRITE_ZEROES);
+        mode = (bio->ranges[0].unmap ? FALLOC_FL_PUNCH_HOLE :
+                FALLOC_FL_ZERO_RANGE) | FALLOC_FL_KEEP_SIZE;
+        break;
+    }
+
+    io_uring_prep_fallocate(sqe, fd, mode, offset, len);
+}
+
+void vhd_uring_queue_bio(struct vhd_uring *ur, int fd, struct vhd_bdev_io *bio)
+{
+    struct uring_request *req;
+    struct io_uring_sqe *sqe;
+    uint64_t offset = bio->first_sector * VHD_SECTOR_SIZE;
+    unsigned nvecs;
+    int buf_idx;
+
+    if (!bio_has_data(bio) && bio->type != VHD_BDEV_FLUSH &&
+        bio->nranges != 1) {
+        VHD_LOG_ERROR("multi-range requests are not supported");
+        vhd_complete_bio(bio, VHD_BDEV_IOERR);
+        return;
+    }
+
+    sqe = get_sqe(ur);
+    if (!sqe) {
+        VHD_LOG_ERROR("no room in submission ring");
+        vhd_complete_bio(bio, VHD_BDEV_IOERR);
+        return;
+    }
+
+    if (!bio_has_data(bio)) {
+        req = vhd_alloc(sizeof(*req));
+        *req = (struct uring_request) { .bio = bio };
+        prep_nodata(sqe, fd, bio);
+        goto queued;
+    }
+
+    req = prepare_request(bio);
+    nvecs = req->bounce_buf ? 1 : bio->sglist.nbuffers;
+
+    buf_idx = -1;
+    if (nvecs == 1) {
+        buf_idx = req->bounce_buf ? -1 :
+            region_fixed_buf(ur, &bio->sglist.buffers[0]);
+        if (buf_idx < 0) {
+            buf_idx = find_fixed_buf(ur, req->iov[0].iov_base,
+                                     req->iov[0].iov_len);
+        }
+    }
+
+    if (buf_idx >= 0) {
+        if (bio->type == VHD_BDEV_READ) {
+            io_uring_prep_read_fixed(sqe, fd, req->iov[0].iov_base,
+                                     req->iov[0].iov_len, offset, buf_idx);
+        } else {
+            io_uring_prep_write_fixed(sqe, fd, req->iov[0].iov_base,
+                                      req->iov[0].iov_len, offset, buf_idx);
+        }
+    } else {
+        if (bio->type == VHD_BDEV_READ) {
+            io_uring_prep_readv(sqe, fd, req->iov, nvecs, offset);
+        } else {
+            io_uring_prep_writev(sqe, fd, req->iov, nvecs, offset);
+        }
+    }
+
+queued:
+    io_uring_sqe_set_data(sqe, req);
+    ur->num_queued++;
+}
+
+void vhd_uring_submit(struct vhd_uring *ur)
+{
+    int ret;
+
+    if (!ur->num_queued) {
+        return;
+    }
+
+    do {
+        ret = io_uring_submit(&ur->ring);
+    } while (ret == -EINTR);
+
+    if (ret < 0) {
+        /* unsubmitted SQEs stay in the ring and get retried next time */
+        VHD_LOG_ERROR("io_uring_submit: %s", strerror(-ret));
+        return;
+    }
+
+    ur->num_queued -= MIN((unsigned)ret, ur->num_queued);
+    ur->num_in_flight += ret;
+}
+
+struct vhd_uring *vhd_uring_new(struct vhd_request_queue *rq,
+                                unsigned entries)
+{
+    int ret;
+    struct vhd_uring *ur = vhd_zalloc(sizeof(*ur));
+
+    ret = io_uring_queue_init(entries, &ur->ring, 0);
+    if (ret < 0) {
+        VHD_LOG_ERROR("io_uring_queue_init: %s", strerror(-ret));
+        goto free_ur;
+    }
+
+    ur->efd = eventfd(0, EFD_NONBLOCK);
+    if (ur->efd < 0) {
+        VHD_LOG_ERROR("eventfd() failed: %s", strerror(errno));
+        goto exit_ring;
+    }
+
+    ret = io_uring_register_eventfd(&ur->ring, ur->efd);
+    if (ret < 0) {
+        VHD_LOG_ERROR("io_uring_register_eventfd: %s", strerror(-ret));
+        goto close_efd;
+    }
+
+    pthread_mutex_init(&ur->bufs_lock, NULL);
+    ret = io_uring_register_buffers_sparse(&ur->ring, URING_FIXED_BUFS_MAX);
+    if (ret < 0) {
+        VHD_LOG_INFO("fixed buffers not supported, not using them: %s",
+                     strerror(-ret));
+    } else {
+        ur->has_fixed_bufs = true;
+    }
+
+    ur->handler = vhd_add_rq_io_handler(rq, ur->efd, uring_complete, ur);
+    if (!ur->handler) {
+        VHD_LOG_ERROR("failed to attach io_uring eventfd to request queue");
+        goto destroy_lock;
+    }
+
+    return ur;
+
+destroy_lock:
+    pthread_mutex_destroy(&ur->bufs_lock);
+close_efd:
+    close(ur->efd);
+exit_ring:
+    io_uring_queue_exit(&ur->ring);
+free_ur:
+    vhd_free(ur);
+    return NULL;
+}
+
+void vhd_uring_free(struct vhd_uring *ur)
+{
+    VHD_VERIFY(!ur->num_in_flight);
+
+    vhd_del_rq_io_handler(ur->handler);
+    close(ur->efd);
+    io_uring_queue_exit(&ur->ring);
+    pthread_mutex_destroy(&ur->bufs_lock);
+    vhd_free(ur);
+}
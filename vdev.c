@@ -17,6 +17,7 @@
 #include "logging.h"
 #include "memmap.h"
 #include "memlog.h"
+#include "trace.h"
 
 #define VHOST_REQ(req) [VHOST_USER_ ## req] = #req
 static const char *const vhost_req_names[] = {
@@ -52,6 +53,12 @@ static const char *const vhost_req_names[] = {
     VHOST_REQ(POSTCOPY_END),
     VHOST_REQ(GET_INFLIGHT_FD),
     VHOST_REQ(SET_INFLIGHT_FD),
+    VHOST_REQ(GPU_SET_SOCKET),
+    VHOST_REQ(RESET_DEVICE),
+    VHOST_REQ(VRING_KICK),
+    VHOST_REQ(GET_MAX_MEM_SLOTS),
+    VHOST_REQ(ADD_MEM_REG),
+    VHOST_REQ(REM_MEM_REG),
 };
 #undef VHOST_REQ
 
@@ -64,7 +71,9 @@ static const char *vhost_req_name(uint32_t req)
     return vhost_req_names[req];
 }
 
+/* devices are released in their control event loops, so this needs a lock */
 static LIST_HEAD(, vhd_vdev) g_vdevs = LIST_HEAD_INITIALIZER(g_vdevs);
+static pthread_mutex_t g_vdevs_lock = PTHREAD_MUTEX_INITIALIZER;
 
 static uint16_t vring_idx(struct vhd_vring *vring)
 {
@@ -79,27 +88,28 @@ static void replace_fd(int *fd, int newfd)
     *fd = newfd;
 }
 
-/* Return size of per queue inflight buffer. */
-static size_t vring_inflight_buf_size(uint16_t num)
-{
-    return sizeof(struct inflight_split_region) +
-        num * sizeof(struct inflight_split_desc);
-}
+__thread uint64_t vhd_cpu_section_cycles;
 
-static int vring_kick(void *opaque)
+static void vring_dispatch(struct vhd_vring *vring)
 {
     int ret;
-    struct vhd_vring *vring = opaque;
     struct vhd_vdev *vdev = vring->vdev;
+    uint32_t budget = vhd_rq_vring_budget(vring->rq, vring);
 
     /*
-     * Clear vring event now, before processing virtq.
-     * Otherwise we might lose events if guest has managed to
-     * signal eventfd again while we were processing
+     * Leave the requests over the in-flight limits in the avail ring; the
+     * vring is dispatched again once completions free up slots
      */
-    vhd_clear_eventfd(vring->kickfd);
+    if (!budget) {
+        vhd_rq_set_vring_throttled(vring->rq, vring, true);
+        return;
+    }
+    vring->vq.max_dequeue = budget < vring->vq.qsz ? budget : 0;
+    vring->vq.coalesce_max = atomic_read(&vdev->notify_coalesce_max);
+    vring->vq.coalesce_ns =
+        atomic_read(&vdev->notify_coalesce_us) * 1000ull;
 
-    ret = vdev->type->dispatch_requests(vdev, vring, vdev->rq);
+    ret = vdev->type->dispatch_requests(vdev, vring, vring->rq);
     if (ret < 0) {
         /*
          * seems like full-fledged vring stop may surprize the client, so just
@@ -108,11 +118,71 @@ static int vring_kick(void *opaque)
         VHD_OBJ_ERROR(vring, "dispatch_requests: %s, suspending vring",
                       strerror(-ret));
         vhd_detach_io_handler(vring->kick_handler);
+        vhd_rq_detach_vring(vring->rq, vring);
+        return;
+    }
+
+    vhd_rq_set_vring_throttled(vring->rq, vring,
+                               vring->vq.max_dequeue &&
+                               virtq_has_avail(&vring->vq));
+    /*
+     * Requests found in flight on start are resubmitted a batch per pass;
+     * come back for the rest in the next one without waiting for a kick
+     */
+    if (vring->vq.num_resubmit) {
+        vhd_rq_vring_kicked(vring->rq, vring);
+    }
+    /* requests completed synchronously may have had notification held back */
+    vhd_rq_vring_notify_pending(vring->rq, vring);
+}
+
+static int vring_kick(void *opaque)
+{
+    struct vhd_vring *vring = opaque;
+    struct vhd_cpu_section cpu;
+
+    vhd_cpu_section_start(&cpu);
+
+    /*
+     * Clear vring event now, before processing virtq.
+     * Otherwise we might lose events if guest has managed to
+     * signal eventfd again while we were processing.
+     * Edge-triggered kick handlers are called on every signal regardless of
+     * the eventfd counter, so save the syscall.
+     */
+    if (!vring->kick_edge) {
+        vhd_clear_eventfd(vring->kickfd);
+        vring->vq.stat.metrics.kick_reads++;
+    }
+
+    vhd_trace(VHD_TRACE_KICK, vring->vq.trace_id, vring->vq.last_avail);
+    vring->vq.stat.metrics.kicks++;
+
+    vring_dispatch(vring);
+
+    if (vring->kick_edge) {
+        vhd_rq_vring_kicked(vring->rq, vring);
     }
 
+    vring->vq.stat.dispatch_cycles += vhd_cpu_section_end(&cpu);
     return 0;
 }
 
+bool vhd_vring_poll(struct vhd_vring *vring)
+{
+    struct vhd_cpu_section cpu;
+
+    /* will be dispatched on completions */
+    if (vring->throttled || !virtq_has_avail(&vring->vq)) {
+        return false;
+    }
+
+    vhd_cpu_section_start(&cpu);
+    vring_dispatch(vring);
+    vring->vq.stat.dispatch_cycles += vhd_cpu_section_end(&cpu);
+    return true;
+}
+
 /*
  * Resolve (and thus validate) the addresses used by the virtq, and record them
  * in the shadow structure, in the control event loop, to be later propagated
@@ -147,7 +217,7 @@ static void vring_sync_to_virtq(struct vhd_vring *vring)
     vring->vq.desc = vring->shadow_vq.desc;
     vring->vq.used = vring->shadow_vq.used;
     vring->vq.avail = vring->shadow_vq.avail;
-    vring->vq.mm = vring->shadow_vq.mm;
+    virtq_set_mm(&vring->vq, vring->shadow_vq.mm);
     vring->vq.log = vring->shadow_vq.log;
     virtq_set_notify_fd(&vring->vq, vring->callfd);
 }
@@ -183,7 +253,7 @@ static void vring_handle_msg(struct vhd_vring *vring,
 
     vdev->num_vrings_handling_msg++;
 
-    vhd_run_in_rq(vdev->rq, handler_bh, vring);
+    vhd_run_in_rq(vring->rq, handler_bh, vring);
 }
 
 static void vdev_disconnect(struct vhd_vdev *vdev);
@@ -238,12 +308,33 @@ static void vdev_maybe_drained(struct vhd_vdev *vdev)
     }
 }
 
+/*
+ * Called once the vring stopped without draining, whichever of
+ * vring_mark_stopped() and vring_mark_drained() comes first
+ */
+static void vring_undrained_stop_done(struct vhd_vring *vring)
+{
+    int ret;
+
+    if (!vring->on_stop_cb) {
+        return;
+    }
+
+    ret = vring->on_stop_cb(vring);
+    vring->on_stop_cb = NULL;
+    if (ret < 0) {
+        vdev_disconnect(vring->vdev);
+    }
+}
+
 static void vring_mark_stopped(struct vhd_vring *vring)
 {
     struct vhd_vdev *vdev = vring->vdev;
 
     VHD_OBJ_INFO(vring, "stopped vring with %u in-flight requests",
                  vring->num_in_flight_at_stop);
+    vring_undrained_stop_done(vring);
+
     VHD_ASSERT(vdev->num_vrings_started);
     vdev->num_vrings_started--;
     vdev_maybe_vrings_stopped(vdev);
@@ -273,6 +364,8 @@ static void vring_reset(struct vhd_vring *vring)
     vring->num_in_flight_at_stop = 0;
 
     vring->disconnecting = false;
+    vring->stop_undrained = false;
+    atomic_set(&vring->fenced, false);
 }
 
 static void vring_mark_drained(struct vhd_vring *vring)
@@ -282,6 +375,8 @@ static void vring_mark_drained(struct vhd_vring *vring)
     VHD_ASSERT(vring->started_in_ctl);
     vring->started_in_ctl = false;
 
+    vring_undrained_stop_done(vring);
+
     if (vring->on_drain_cb) {
         int ret = vring->on_drain_cb(vring);
         vring->on_drain_cb = NULL;
@@ -309,11 +404,12 @@ void vhd_vring_inc_in_flight(struct vhd_vring *vring)
     vring->num_in_flight++;
 }
 
-void vhd_vring_dec_in_flight(struct vhd_vring *vring)
+void vhd_vring_dec_in_flight(struct vhd_vring *vring, uint16_t count)
 {
-    vring->num_in_flight--;
+    VHD_ASSERT(vring->num_in_flight >= count);
+    vring->num_in_flight -= count;
     if (!vring->num_in_flight && !vring->started_in_rq) {
-        vhd_run_in_ctl(vring_mark_drained_bh, vring);
+        vhd_run_in_ctl(vring->vdev, vring_mark_drained_bh, vring);
     }
 }
 
@@ -327,16 +423,41 @@ static void vring_stop_bh(void *opaque)
 
     vhd_del_io_handler(vring->kick_handler);
     vring->kick_handler = NULL;
+
+    /*
+     * When stopping without draining, the requests in flight are left to be
+     * resubmitted by the next user of the inflight region, so their
+     * completions must not show up in the rings any more.  The ones still
+     * queued are canceled right away; the backend has yet to complete the
+     * others, possibly after the vring base is reported.
+     */
+    if (vring->stop_undrained) {
+        vring->undrained_base = virtq_fence(&vring->vq);
+        atomic_store_release(&vring->fenced, true);
+    }
+
+    /*
+     * Cancel while still started so that the completions of the canceled
+     * requests don't mark the vring drained ahead of (and in addition to)
+     * the check below.  Only the requests of this vring are visited.
+     */
+    if (vring->disconnecting || vring->stop_undrained) {
+        vhd_cancel_queued_requests(vring->rq, vring);
+    }
+
+    vhd_rq_detach_vring(vring->rq, vring);
     vring->started_in_rq = false;
 
-    if (vring->disconnecting) {
-        vhd_cancel_queued_requests(vring->vdev->rq, vring);
+    /* what's left in flight is in the backend, for it to fence off */
+    if (vring->stop_undrained && vring->vdev->fence_cb) {
+        vring->vdev->fence_cb(vring->vdev, vring - vring->vdev->vrings,
+                              vring->vdev->fence_opaque);
     }
 
     vring->num_in_flight_at_stop = vring->num_in_flight;
-    vhd_run_in_ctl(vring_mark_stopped_bh, vring);
+    vhd_run_in_ctl(vring->vdev, vring_mark_stopped_bh, vring);
     if (!vring->num_in_flight) {
-        vhd_run_in_ctl(vring_mark_drained_bh, vring);
+        vhd_run_in_ctl(vring->vdev, vring_mark_drained_bh, vring);
     }
 }
 
@@ -349,7 +470,7 @@ static void vring_disconnect(struct vhd_vring *vring)
          */
         vring->disconnecting = true;
 
-        vhd_run_in_rq(vring->vdev->rq, vring_stop_bh, vring);
+        vhd_run_in_rq(vring->rq, vring_stop_bh, vring);
     } else {
         vring_reset(vring);
     }
@@ -523,13 +644,35 @@ static const uint64_t g_default_protocol_features =
     (1UL << VHOST_USER_PROTOCOL_F_LOG_SHMFD) |
     (1UL << VHOST_USER_PROTOCOL_F_REPLY_ACK) |
     (1UL << VHOST_USER_PROTOCOL_F_CONFIG) |
-    (1UL << VHOST_USER_PROTOCOL_F_INFLIGHT_SHMFD);
+    (1UL << VHOST_USER_PROTOCOL_F_INFLIGHT_SHMFD) |
+    (1UL << VHOST_USER_PROTOCOL_F_CONFIGURE_MEM_SLOTS);
 
 static inline bool has_feature(uint64_t features_qword, size_t feature_bit)
 {
     return features_qword & (1ull << feature_bit);
 }
 
+static bool vdev_is_packed(struct vhd_vdev *vdev)
+{
+    return has_feature(vdev->negotiated_features, VIRTIO_F_RING_PACKED);
+}
+
+/*
+ * Return size of per queue inflight buffer.  Its layout depends on the ring
+ * layout, so the features must be negotiated by the time the inflight buffer
+ * is set up.
+ */
+static size_t vring_inflight_buf_size(struct vhd_vdev *vdev, uint16_t num)
+{
+    if (vdev_is_packed(vdev)) {
+        return sizeof(struct inflight_packed_region) +
+            num * sizeof(struct inflight_packed_desc);
+    }
+
+    return sizeof(struct inflight_split_region) +
+        num * sizeof(struct inflight_split_desc);
+}
+
 #define NSEC_PER_SEC 1000000000
 #define NSEC_PER_MSEC 1000000
 
@@ -643,9 +786,21 @@ static int vhost_send_vring_base(struct vhd_vring *vring)
 {
     struct vhost_user_vring_state vrstate = {
         .index = vring_idx(vring),
-        .num = vring->vq.last_avail,
+        .num = virtq_get_base(&vring->vq),
+    };
+
+    return vhost_reply(vring->vdev, &vrstate, sizeof(vrstate));
+}
+
+static int vhost_send_undrained_vring_base(struct vhd_vring *vring)
+{
+    struct vhost_user_vring_state vrstate = {
+        .index = vring_idx(vring),
+        .num = vring->undrained_base,
     };
 
+    VHD_OBJ_INFO(vring, "reporting vring base %u with %u requests in flight",
+                 vring->undrained_base, vring->num_in_flight_at_stop);
     return vhost_reply(vring->vdev, &vrstate, sizeof(vrstate));
 }
 
@@ -736,7 +891,7 @@ static void vring_sync_to_virtq_bh(void *opaque)
 {
     struct vhd_vring *vring = opaque;
     vring_sync_to_virtq(vring);
-    vhd_run_in_ctl(vring_mark_msg_handled_bh, vring);
+    vhd_run_in_ctl(vring->vdev, vring_mark_msg_handled_bh, vring);
 }
 
 static int set_features_complete(struct vhd_vdev *vdev)
@@ -750,6 +905,7 @@ static int vhost_set_features(struct vhd_vdev *vdev, const void *payload,
     uint16_t i;
     const uint64_t *features = payload;
     bool has_event_idx = has_feature(*features, VIRTIO_F_RING_EVENT_IDX);
+    bool packed = has_feature(*features, VIRTIO_F_RING_PACKED);
 
     /*
      * VHOST_USER_F_PROTOCOL_FEATURES normally doesn't need negotiation: it's just
@@ -784,6 +940,7 @@ static int vhost_set_features(struct vhd_vdev *vdev, const void *payload,
         vdev->negotiated_features = *features;
         for (i = 0; i < vdev->num_queues; i++) {
             vdev->vrings[i].vq.has_event_idx = has_event_idx;
+            vdev->vrings[i].vq.packed = packed;
         }
         return set_features_complete(vdev);
     }
@@ -821,6 +978,90 @@ static int vhost_set_owner(struct vhd_vdev *vdev, const void *payload,
     return vhost_ack(vdev, 0);
 }
 
+static struct vhd_memory_map *vdev_memmap_new(struct vhd_vdev *vdev)
+{
+    return vhd_memmap_new(vdev->map_cb, vdev->unmap_cb, vdev->priv,
+                          &vdev->mem_policy);
+}
+
+/*
+ * Register the guest memory mapped into @mm with the postcopy userfaultfd
+ * while listening, or stop doing so
+ */
+static int vdev_memmap_postcopy(struct vhd_vdev *vdev,
+                                struct vhd_memory_map *mm)
+{
+    return vhd_memmap_set_uffd(mm, vdev->postcopy_listening ?
+                               vdev->postcopy_ufd : -1);
+}
+
+/*
+ * In postcopy the master needs the addresses the guest memory is mapped at
+ * here to make sense of the faults reported, so the memory table, or the
+ * region added, is sent back with them in place of the master's ones.  The
+ * master then confirms it's ready to handle the faults, see
+ * postcopy_mem_acked().
+ */
+static int postcopy_reply_mem(struct vhd_vdev *vdev)
+{
+    struct vhd_memory_map *mm = vdev->memmap;
+    struct vhost_user_mem_desc desc = {};
+    unsigned i;
+
+    vdev->postcopy_ack_pending = true;
+    vdev->postcopy_reply_ack = vdev->ack_pending;
+
+    if (vdev->req == VHOST_USER_ADD_MEM_REG) {
+        struct vhost_user_mem_reg mem_reg = {
+            .region = vdev->postcopy_region,
+        };
+
+        mem_reg.region.user_addr = (uintptr_t)gpa_range_to_ptr(
+            mm, mem_reg.region.guest_addr, mem_reg.region.size, NULL);
+        return vhost_reply(vdev, &mem_reg, sizeof(mem_reg));
+    }
+
+    desc.nregions = vhd_memmap_num_slots(mm);
+    for (i = 0; i < desc.nregions; i++) {
+        struct vhost_user_mem_region *region = &desc.regions[i];
+        uint64_t uva;
+        size_t size;
+        off_t offset;
+        int fd;
+
+        vhd_memmap_get_slot(mm, i, &region->guest_addr, &uva, &size, &fd,
+                            &offset);
+        region->size = size;
+        region->mmap_offset = offset;
+        region->user_addr = (uintptr_t)gpa_range_to_ptr(
+            mm, region->guest_addr, size, NULL);
+    }
+
+    return vhost_reply(vdev, &desc,
+                       offsetof(struct vhost_user_mem_desc, regions) +
+                       sizeof(desc.regions[0]) * desc.nregions);
+}
+
+/*
+ * The master has taken the memory table sent back by postcopy_reply_mem().
+ * Only VHOST_USER_SET_MEM_TABLE expects this acknowledged in turn, with the
+ * ACK the table message asked for, the confirmation itself not asking for one;
+ * after VHOST_USER_ADD_MEM_REG or VHOST_USER_REM_MEM_REG the master doesn't
+ * wait.
+ */
+static int postcopy_mem_acked(struct vhd_vdev *vdev)
+{
+    VHD_OBJ_INFO(vdev, "master is ready to handle postcopy faults");
+    vdev->postcopy_ack_pending = false;
+
+    if (vdev->req != VHOST_USER_SET_MEM_TABLE) {
+        vdev->ack_pending = false;
+    } else if (vdev->postcopy_reply_ack) {
+        vdev->ack_pending = true;
+    }
+    return vhost_ack(vdev, 0);
+}
+
 static int set_mem_table_complete(struct vhd_vdev *vdev)
 {
     if (vdev->old_memmap) {
@@ -828,9 +1069,47 @@ static int set_mem_table_complete(struct vhd_vdev *vdev)
         vdev->old_memmap = NULL;
     }
 
+    if (vdev->postcopy_listening && vdev->req != VHOST_USER_REM_MEM_REG) {
+        return postcopy_reply_mem(vdev);
+    }
+
     return vhost_ack(vdev, 0);
 }
 
+/*
+ * Switch the device over to memory map @mm, which is consumed.  The previous
+ * memory map is dropped once all vrings have stopped using it.
+ */
+static int vdev_set_memmap(struct vhd_vdev *vdev, struct vhd_memory_map *mm)
+{
+    int ret;
+    uint16_t i;
+
+    for (i = 0; i < vdev->num_queues; i++) {
+        if (!vdev->vrings[i].started_in_ctl) {
+            continue;
+        }
+        ret = vring_update_shadow_vq_addrs(&vdev->vrings[i], mm);
+        if (ret < 0) {
+            vhd_memmap_unref(mm);
+            return ret;
+        }
+    }
+
+    vdev->old_memmap = vdev->memmap;
+    vdev->memmap = mm;
+
+    if (!vdev->num_vrings_in_flight) {
+        return set_mem_table_complete(vdev);
+    }
+
+    vdev->handle_complete = set_mem_table_complete;
+    for (i = 0; i < vdev->num_queues; i++) {
+        vring_handle_msg(&vdev->vrings[i], vring_sync_to_virtq_bh);
+    }
+    return 0;
+}
+
 static int vhost_set_mem_table(struct vhd_vdev *vdev, const void *payload,
                                size_t size, const int *fds, size_t num_fds)
 {
@@ -841,6 +1120,11 @@ static int vhost_set_mem_table(struct vhd_vdev *vdev, const void *payload,
     struct vhd_memory_map *mm;
     uint16_t i;
 
+    /* the master's confirmation of the table sent back in postcopy */
+    if (vdev->postcopy_ack_pending && size == sizeof(uint64_t) && !num_fds) {
+        return postcopy_mem_acked(vdev);
+    }
+
     if (size < exp_size) {
         VHD_OBJ_ERROR(vdev, "malformed message: size %zu expected %zu", size,
                       exp_size);
@@ -856,116 +1140,276 @@ static int vhost_set_mem_table(struct vhd_vdev *vdev, const void *payload,
         return -EINVAL;
     }
 
-    mm = vhd_memmap_new(vdev->map_cb, vdev->unmap_cb, vdev->priv);
+    mm = vdev_memmap_new(vdev);
+    ret = vdev_memmap_postcopy(vdev, mm);
+    if (ret < 0) {
+        vhd_memmap_unref(mm);
+        return ret;
+    }
 
     for (i = 0; i < desc->nregions; i++) {
         const struct vhost_user_mem_region *region = &desc->regions[i];
         ret = vhd_memmap_add_slot(mm, region->guest_addr, region->user_addr,
                                   region->size, fds[i], region->mmap_offset);
         if (ret < 0) {
-            goto fail;
+            vhd_memmap_unref(mm);
+            return ret;
         }
     }
 
-    for (i = 0; i < vdev->num_queues; i++) {
-        if (!vdev->vrings[i].started_in_ctl) {
-            continue;
-        }
-        ret = vring_update_shadow_vq_addrs(&vdev->vrings[i], mm);
-        if (ret < 0) {
-            goto fail;
-        }
+    return vdev_set_memmap(vdev, mm);
+}
+
+static int vhost_get_max_mem_slots(struct vhd_vdev *vdev, const void *payload,
+                                   size_t size, const int *fds, size_t num_fds)
+{
+    if (num_fds) {
+        VHD_OBJ_ERROR(vdev, "malformed message num_fds=%zu", num_fds);
+        return -EINVAL;
     }
 
-    vdev->old_memmap = vdev->memmap;
-    vdev->memmap = mm;
+    return vhost_reply_u64(vdev, VHD_RAM_SLOTS_MAX);
+}
 
-    if (!vdev->num_vrings_in_flight) {
-        return set_mem_table_complete(vdev);
+/*
+ * VHOST_USER_ADD_MEM_REG and VHOST_USER_REM_MEM_REG update a copy of the
+ * current memory map which shares the mappings of the regions with it, so
+ * only the region being added or removed is (un)mapped.
+ */
+static int vhost_add_mem_reg(struct vhd_vdev *vdev, const void *payload,
+                             size_t size, const int *fds, size_t num_fds)
+{
+    int ret;
+    const struct vhost_user_mem_reg *mem_reg = payload;
+    const struct vhost_user_mem_region *region = &mem_reg->region;
+    struct vhd_memory_map *mm;
+
+    /* the master's confirmation of the regions sent back in postcopy */
+    if (vdev->postcopy_listening && size == sizeof(uint64_t) && !num_fds) {
+        return postcopy_mem_acked(vdev);
     }
 
-    vdev->handle_complete = set_mem_table_complete;
-    for (i = 0; i < vdev->num_queues; i++) {
-        vring_handle_msg(&vdev->vrings[i], vring_sync_to_virtq_bh);
+    if (num_fds != 1 || size < sizeof(*mem_reg)) {
+        VHD_OBJ_ERROR(vdev, "malformed message size=%zu #fds=%zu", size,
+                      num_fds);
+        return -EINVAL;
     }
-    return 0;
 
-fail:
-    vhd_memmap_unref(mm);
-    return ret;
+    mm = vdev->memmap ? vhd_memmap_dup(vdev->memmap) :
+        vdev_memmap_new(vdev);
+    ret = vdev_memmap_postcopy(vdev, mm);
+    if (ret < 0) {
+        vhd_memmap_unref(mm);
+        return ret;
+    }
+    vdev->postcopy_region = *region;
+
+    ret = vhd_memmap_add_slot(mm, region->guest_addr, region->user_addr,
+                              region->size, fds[0], region->mmap_offset);
+    if (ret < 0) {
+        vhd_memmap_unref(mm);
+        return ret;
+    }
+
+    return vdev_set_memmap(vdev, mm);
 }
 
-static int vhost_get_config(struct vhd_vdev *vdev, const void *payload,
-                            size_t size, const int *fds, size_t num_fds)
+static int vhost_rem_mem_reg(struct vhd_vdev *vdev, const void *payload,
+                             size_t size, const int *fds, size_t num_fds)
 {
-    const struct vhost_user_config_space *config = payload;
-    struct vhost_user_config_space reply = {};
+    int ret;
+    const struct vhost_user_mem_reg *mem_reg = payload;
+    const struct vhost_user_mem_region *region = &mem_reg->region;
+    struct vhd_memory_map *mm;
 
-    if (num_fds || size < VHOST_CONFIG_HDR_SIZE || size > sizeof(*config)) {
+    if (vdev->postcopy_listening && size == sizeof(uint64_t) && !num_fds) {
+        return postcopy_mem_acked(vdev);
+    }
+
+    /* some masters pass the fd of the region being removed; it's not needed */
+    if (num_fds > 1 || size < sizeof(*mem_reg)) {
         VHD_OBJ_ERROR(vdev, "malformed message size=%zu #fds=%zu", size,
                       num_fds);
         return -EINVAL;
     }
 
-    if (config->size > size - VHOST_CONFIG_HDR_SIZE) {
-        VHD_OBJ_WARN(vdev, "Message size is not enough for requested data");
-        reply.size = size - VHOST_CONFIG_HDR_SIZE;
-    } else {
-        reply.size = config->size;
+    if (!vdev->memmap) {
+        VHD_OBJ_ERROR(vdev, "no memory table to remove region from");
+        return -ENXIO;
     }
-    reply.offset = config->offset;
 
-    reply.size = vdev->type->get_config(vdev, &reply.payload, reply.size,
-                                        reply.offset);
+    mm = vhd_memmap_dup(vdev->memmap);
+    ret = vdev_memmap_postcopy(vdev, mm);
+    if (ret < 0) {
+        vhd_memmap_unref(mm);
+        return ret;
+    }
 
-    return vhost_reply(vdev, &reply, size);
+    ret = vhd_memmap_del_slot(mm, region->guest_addr, region->user_addr,
+                              region->size);
+    if (ret < 0) {
+        vhd_memmap_unref(mm);
+        return ret;
+    }
+
+    return vdev_set_memmap(vdev, mm);
 }
 
-static int vhost_get_queue_num(struct vhd_vdev *vdev, const void *payload,
-                               size_t size, const int *fds, size_t num_fds)
+/*
+ * Postcopy migration: the master gets a userfaultfd on
+ * VHOST_USER_POSTCOPY_ADVISE; from VHOST_USER_POSTCOPY_LISTEN on the guest
+ * memory is registered with it, so that the dataplane threads touching the
+ * pages not migrated yet block until the master gets them over, until
+ * VHOST_USER_POSTCOPY_END.  The master always expects replies to all three.
+ */
+static int vhost_postcopy_advise(struct vhd_vdev *vdev, const void *payload,
+                                 size_t size, const int *fds, size_t num_fds)
 {
+    int ufd;
+
     if (num_fds) {
         VHD_OBJ_ERROR(vdev, "malformed message num_fds=%zu", num_fds);
         return -EINVAL;
     }
 
-    return vhost_reply_u64(vdev, vdev->num_queues);
-}
+    /* the master fails the migration on a reply with no fd */
+    if (!has_feature(vdev->negotiated_protocol_features,
+                     VHOST_USER_PROTOCOL_F_PAGEFAULT)) {
+        VHD_OBJ_ERROR(vdev, "postcopy not negotiated");
+        return vhost_reply(vdev, NULL, 0);
+    }
 
-static struct vhd_vring *get_vring(struct vhd_vdev *vdev, uint16_t index)
-{
-    if (index >= vdev->num_queues) {
-        VHD_OBJ_ERROR(vdev, "vring %u doesn't exist (max %u)", index,
-                      vdev->num_queues - 1);
-        return NULL;
+    if (vdev->postcopy_ufd < 0) {
+        ufd = vhd_memmap_uffd_open();
+        if (ufd < 0) {
+            VHD_OBJ_ERROR(vdev, "can't set up postcopy: %s", strerror(-ufd));
+            return vhost_reply(vdev, NULL, 0);
+        }
+        vdev->postcopy_ufd = ufd;
     }
 
-    return &vdev->vrings[index];
+    return vhost_reply_fds(vdev, NULL, 0, &vdev->postcopy_ufd, 1);
 }
 
-static struct vhd_vring *msg_u64_get_vring(struct vhd_vdev *vdev,
-                                           const void *payload,
-                                           size_t size, size_t num_fds)
+static int vhost_postcopy_listen(struct vhd_vdev *vdev, const void *payload,
+                                 size_t size, const int *fds, size_t num_fds)
 {
-    const uint64_t *u64 = payload;
-    uint8_t vring_idx;
-    bool has_fd;
+    int ret;
 
-    if (size < sizeof(*u64)) {
-        VHD_OBJ_ERROR(vdev, "malformed message size=%zu", size);
-        return NULL;
+    if (num_fds) {
+        VHD_OBJ_ERROR(vdev, "malformed message num_fds=%zu", num_fds);
+        return -EINVAL;
     }
 
-    has_fd = !(*u64 & VHOST_VRING_INVALID_FD);
-    vring_idx = *u64 & VHOST_VRING_IDX_MASK;
-
-    if (num_fds != has_fd) {
-        VHD_OBJ_ERROR(vdev, "unexpected #fds: %zu (expected %u)", num_fds,
-                      has_fd);
-        return NULL;
+    if (vdev->postcopy_ufd < 0) {
+        VHD_OBJ_ERROR(vdev, "postcopy not advised");
+        return vhost_reply_u64(vdev, -EINVAL);
     }
 
-    return get_vring(vdev, vring_idx);
+    if (vdev->memmap) {
+        ret = vhd_memmap_set_uffd(vdev->memmap, vdev->postcopy_ufd);
+        if (ret < 0) {
+            return vhost_reply_u64(vdev, ret);
+        }
+    }
+
+    vdev->postcopy_listening = true;
+    return vhost_reply_u64(vdev, 0);
+}
+
+static int vhost_postcopy_end(struct vhd_vdev *vdev, const void *payload,
+                              size_t size, const int *fds, size_t num_fds)
+{
+    if (num_fds) {
+        VHD_OBJ_ERROR(vdev, "malformed message num_fds=%zu", num_fds);
+        return -EINVAL;
+    }
+
+    /*
+     * nothing is missing by now, but the registration would outlive our fd
+     * as long as the master keeps its copy open
+     */
+    if (vdev->memmap) {
+        vhd_memmap_set_uffd(vdev->memmap, -1);
+    }
+    replace_fd(&vdev->postcopy_ufd, -1);
+    vdev->postcopy_listening = false;
+    vdev->postcopy_ack_pending = false;
+
+    return vhost_reply_u64(vdev, 0);
+}
+
+static int vhost_get_config(struct vhd_vdev *vdev, const void *payload,
+                            size_t size, const int *fds, size_t num_fds)
+{
+    const struct vhost_user_config_space *config = payload;
+    struct vhost_user_config_space reply = {};
+
+    if (num_fds || size < VHOST_CONFIG_HDR_SIZE || size > sizeof(*config)) {
+        VHD_OBJ_ERROR(vdev, "malformed message size=%zu #fds=%zu", size,
+                      num_fds);
+        return -EINVAL;
+    }
+
+    if (config->size > size - VHOST_CONFIG_HDR_SIZE) {
+        VHD_OBJ_WARN(vdev, "Message size is not enough for requested data");
+        reply.size = size - VHOST_CONFIG_HDR_SIZE;
+    } else {
+        reply.size = config->size;
+    }
+    reply.offset = config->offset;
+
+    reply.size = vdev->type->get_config(vdev, &reply.payload, reply.size,
+                                        reply.offset);
+
+    return vhost_reply(vdev, &reply, size);
+}
+
+static int vhost_get_queue_num(struct vhd_vdev *vdev, const void *payload,
+                               size_t size, const int *fds, size_t num_fds)
+{
+    if (num_fds) {
+        VHD_OBJ_ERROR(vdev, "malformed message num_fds=%zu", num_fds);
+        return -EINVAL;
+    }
+
+    return vhost_reply_u64(vdev, vdev->num_queues);
+}
+
+static struct vhd_vring *get_vring(struct vhd_vdev *vdev, uint16_t index)
+{
+    if (index >= vdev->num_queues) {
+        VHD_OBJ_ERROR(vdev, "vring %u doesn't exist (max %u)", index,
+                      vdev->num_queues - 1);
+        return NULL;
+    }
+
+    return &vdev->vrings[index];
+}
+
+static struct vhd_vring *msg_u64_get_vring(struct vhd_vdev *vdev,
+                                           const void *payload,
+                                           size_t size, size_t num_fds)
+{
+    const uint64_t *u64 = payload;
+    uint8_t vring_idx;
+    bool has_fd;
+
+    if (size < sizeof(*u64)) {
+        VHD_OBJ_ERROR(vdev, "malformed message size=%zu", size);
+        return NULL;
+    }
+
+    has_fd = !(*u64 & VHOST_VRING_INVALID_FD);
+    vring_idx = *u64 & VHOST_VRING_IDX_MASK;
+
+    if (num_fds != has_fd) {
+        VHD_OBJ_ERROR(vdev, "unexpected #fds: %zu (expected %u)", num_fds,
+                      has_fd);
+        return NULL;
+    }
+
+    return get_vring(vdev, vring_idx);
 }
 
 static int set_vring_call_complete(struct vhd_vdev *vdev)
@@ -1030,7 +1474,13 @@ static void vring_start_failed_bh(void *opaque)
     struct vhd_vring *vring = opaque;
     struct vhd_vdev *vdev = vring->vdev;
 
-    vdev->handle_complete = set_vring_kick_fail_complete;
+    /*
+     * NAK VHOST_USER_SET_VRING_KICK; vrings resumed after a handover are just
+     * left stopped
+     */
+    if (vdev->handle_complete == set_vring_kick_complete) {
+        vdev->handle_complete = set_vring_kick_fail_complete;
+    }
 
     vring_mark_msg_handled(vring);
     vring_mark_stopped(vring);
@@ -1040,7 +1490,6 @@ static void vring_start_failed_bh(void *opaque)
 static void vring_start_bh(void *opaque)
 {
     struct vhd_vring *vring = opaque;
-    struct vhd_vdev *vdev = vring->vdev;
 
     VHD_ASSERT(!vring->started_in_rq);
 
@@ -1052,8 +1501,8 @@ static void vring_start_bh(void *opaque)
         goto fail;
     }
 
-    vring->kick_handler = vhd_add_rq_io_handler(vdev->rq, vring->kickfd,
-                                                vring_kick, vring);
+    vring->kick_handler = vhd_rq_add_kick_handler(vring->rq, vring,
+                                                  vring_kick);
     if (!vring->kick_handler) {
         VHD_OBJ_ERROR(vring, "Could not attach kick handler");
         goto fail;
@@ -1061,11 +1510,38 @@ static void vring_start_bh(void *opaque)
 
     vring_sync_to_virtq(vring);
     vring->started_in_rq = true;
-    vhd_run_in_ctl(vring_mark_msg_handled_bh, vring);
+    vhd_rq_attach_vring(vring->rq, vring);
+    vhd_run_in_ctl(vring->vdev, vring_mark_msg_handled_bh, vring);
     return;
 
 fail:
-    vhd_run_in_ctl(vring_start_failed_bh, vring);
+    vhd_run_in_ctl(vring->vdev, vring_start_failed_bh, vring);
+}
+
+/*
+ * Set up the virtqueue of the vring with the kickfd assigned and have the
+ * rq start serving it
+ */
+static void vring_start(struct vhd_vring *vring)
+{
+    struct vhd_vdev *vdev = vring->vdev;
+
+    if (!vring->io_stat) {
+        /* published before the vring is visible to the rq */
+        atomic_store_release(&vring->io_stat,
+                             vhd_zalloc(sizeof(*vring->io_stat)));
+    }
+
+    vring_sync_to_virtq(vring);
+    vring->vq.log_tag = vring->log_tag;
+    vring->vq.trace_id = vring->trace_id;
+    virtio_virtq_init(&vring->vq);
+
+    vring->started_in_ctl = true;
+    vdev->num_vrings_started++;
+    vdev->num_vrings_in_flight++;
+
+    vring_handle_msg(vring, vring_start_bh);
 }
 
 static int vhost_set_vring_kick(struct vhd_vdev *vdev, const void *payload,
@@ -1102,16 +1578,8 @@ static int vhost_set_vring_kick(struct vhd_vdev *vdev, const void *payload,
     VHD_ASSERT(vring->kickfd < 0);
     vring->kickfd = kickfd;
 
-    vring_sync_to_virtq(vring);
-    vring->vq.log_tag = vring->log_tag;
-    virtio_virtq_init(&vring->vq);
-
-    vring->started_in_ctl = true;
-    vdev->num_vrings_started++;
-    vdev->num_vrings_in_flight++;
-
     vdev->handle_complete = set_vring_kick_complete;
-    vring_handle_msg(vring, vring_start_bh);
+    vring_start(vring);
     return 0;
 }
 
@@ -1210,7 +1678,7 @@ static int vhost_set_vring_base(struct vhd_vdev *vdev, const void *payload,
         return -EISCONN;
     }
 
-    vring->vq.last_avail = vrstate->num;
+    virtq_set_base(&vring->vq, vrstate->num);
     return vhost_ack(vdev, 0);
 }
 
@@ -1235,13 +1703,32 @@ static int vhost_get_vring_base(struct vhd_vdev *vdev, const void *payload,
         return vhost_send_vring_base(vring);
     }
 
+    /* already stopped without draining, with requests still in flight */
+    if (vring->stop_undrained) {
+        return vhost_send_undrained_vring_base(vring);
+    }
+
+    /*
+     * The requests in flight can be left to the next user of the vring only
+     * if they are recorded in the inflight region; packed rings restore their
+     * position from the inflight region anyway, but aren't covered yet.
+     */
+    if (atomic_load_acquire(&vdev->stop_undrained) &&
+        vring->vq.inflight_region &&
+        !vring->vq.packed) {
+        vring->stop_undrained = true;
+        vring->on_stop_cb = vhost_send_undrained_vring_base;
+        vhd_run_in_rq(vring->rq, vring_stop_bh, vring);
+        return 0;
+    }
+
     /*
      * This command is special as it needs to wait for drain, not just until
      * the message is handled in rq.  Mark this in the vring and submit
      * vring_stop_bh() instead of going through vring_handle_msg().
      */
     vring->on_drain_cb = vhost_send_vring_base;
-    vhd_run_in_rq(vring->vdev->rq, vring_stop_bh, vring);
+    vhd_run_in_rq(vring->rq, vring_stop_bh, vring);
     return 0;
 }
 
@@ -1337,16 +1824,30 @@ static int vhost_set_log_base(struct vhd_vdev *vdev, const void *payload,
     return 0;
 }
 
-static void inflight_mem_init(void *buf, size_t queue_region_size,
+static void inflight_mem_init(struct vhd_vdev *vdev, void *buf,
+                              size_t queue_region_size,
                               uint16_t num_queues, uint16_t queue_size)
 {
-    uint16_t i;
+    uint16_t i, j;
 
     memset(buf, 0,  num_queues * queue_region_size);
     for (i = 0; i < num_queues; i++) {
-        struct inflight_split_region *region = buf + i * queue_region_size;
-        region->version = 1;
-        region->desc_num = queue_size;
+        if (vdev_is_packed(vdev)) {
+            struct inflight_packed_region *region =
+                buf + i * queue_region_size;
+            region->version = 1;
+            region->desc_num = queue_size;
+            region->used_wrap_counter = 1;
+            region->old_used_wrap_counter = 1;
+            /* all entries are on the free list initially */
+            for (j = 0; j < queue_size; j++) {
+                region->desc[j].next = j + 1;
+            }
+        } else {
+            struct inflight_split_region *region = buf + i * queue_region_size;
+            region->version = 1;
+            region->desc_num = queue_size;
+        }
     }
 }
 
@@ -1358,6 +1859,7 @@ static void inflight_mem_cleanup(struct vhd_vdev *vdev)
 
     munmap(vdev->inflight_mem, vdev->inflight_size);
     vdev->inflight_mem = NULL;
+    replace_fd(&vdev->inflight_fd, -1);
 }
 
 static int inflight_mmap_region(struct vhd_vdev *vdev, int fd,
@@ -1370,11 +1872,19 @@ static int inflight_mmap_region(struct vhd_vdev *vdev, int fd,
 
     inflight_mem_cleanup(vdev);
 
+    fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    if (fd < 0) {
+        ret = -errno;
+        VHD_OBJ_ERROR(vdev, "fcntl(F_DUPFD_CLOEXEC): %s", strerror(-ret));
+        return ret;
+    }
+
     buf = mmap(NULL, mmap_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
     if (buf == MAP_FAILED) {
         ret = -errno;
         VHD_OBJ_ERROR(vdev, "mmap(%d, %zu): %s", fd, mmap_size,
                       strerror(-ret));
+        close(fd);
         return ret;
     }
 
@@ -1383,11 +1893,16 @@ static int inflight_mmap_region(struct vhd_vdev *vdev, int fd,
     }
 
     for (i = 0; i < num_queues; i++) {
-        vdev->vrings[i].vq.inflight_region = buf + i * queue_region_size;
+        if (vdev_is_packed(vdev)) {
+            vdev->vrings[i].vq.inflight_packed = buf + i * queue_region_size;
+        } else {
+            vdev->vrings[i].vq.inflight_region = buf + i * queue_region_size;
+        }
     }
 
     vdev->inflight_mem = buf;
     vdev->inflight_size = mmap_size;
+    vdev->inflight_fd = fd;
 
     return 0;
 }
@@ -1407,7 +1922,8 @@ static int vhost_get_inflight_fd(struct vhd_vdev *vdev, const void *payload,
 {
     const struct vhost_user_inflight_desc *idesc = payload;
     struct vhost_user_inflight_desc reply = {};
-    size_t queue_region_size = vring_inflight_buf_size(idesc->queue_size);
+    size_t queue_region_size = vring_inflight_buf_size(vdev,
+                                                       idesc->queue_size);
     size_t mmap_size = queue_region_size * idesc->num_queues;
     int fd;
     int ret;
@@ -1441,8 +1957,8 @@ static int vhost_get_inflight_fd(struct vhd_vdev *vdev, const void *payload,
         goto out;
     }
 
-    inflight_mem_init(vdev->inflight_mem, queue_region_size, idesc->num_queues,
-                      idesc->queue_size);
+    inflight_mem_init(vdev, vdev->inflight_mem, queue_region_size,
+                      idesc->num_queues, idesc->queue_size);
 
     /* Prepare reply to the master side. */
     reply.mmap_size = vdev->inflight_size;
@@ -1457,7 +1973,8 @@ static int vhost_set_inflight_fd(struct vhd_vdev *vdev, const void *payload,
                                  size_t size, const int *fds, size_t num_fds)
 {
     const struct vhost_user_inflight_desc *idesc = payload;
-    size_t queue_region_size = vring_inflight_buf_size(idesc->queue_size);
+    size_t queue_region_size = vring_inflight_buf_size(vdev,
+                                                       idesc->queue_size);
     int ret;
 
     if (num_fds != 1 || size < sizeof(*idesc)) {
@@ -1493,6 +2010,113 @@ static int vhost_set_inflight_fd(struct vhd_vdev *vdev, const void *payload,
     return vhost_ack(vdev, 0);
 }
 
+/* the only writer is the control event loop, so reading needs no lock */
+static void vdev_set_slave_fd(struct vhd_vdev *vdev, int fd)
+{
+    pthread_mutex_lock(&vdev->slave_lock);
+    replace_fd(&vdev->slave_fd, fd);
+    pthread_mutex_unlock(&vdev->slave_lock);
+}
+
+/*
+ * The client won't answer on the channel being replaced or dropped, so kick
+ * the threads waiting for replies there, if any, before taking the lock they
+ * hold rather than have the control event loop wait for them
+ */
+static void vdev_reset_slave_fd(struct vhd_vdev *vdev, int fd)
+{
+    if (vdev->slave_fd >= 0) {
+        shutdown(vdev->slave_fd, SHUT_RDWR);
+    }
+    vdev_set_slave_fd(vdev, fd);
+}
+
+static int vhost_set_slave_req_fd(struct vhd_vdev *vdev, const void *payload,
+                                  size_t size, const int *fds, size_t num_fds)
+{
+    int fd;
+
+    if (num_fds != 1) {
+        VHD_OBJ_ERROR(vdev, "malformed message #fds=%zu", num_fds);
+        return -EINVAL;
+    }
+
+    if (!has_feature(vdev->negotiated_protocol_features,
+                     VHOST_USER_PROTOCOL_F_SLAVE_REQ)) {
+        VHD_OBJ_ERROR(vdev, "slave requests not negotiated");
+        return -ENOTSUP;
+    }
+
+    fd = fcntl(fds[0], F_DUPFD_CLOEXEC, 0);
+    if (fd < 0) {
+        int ret = -errno;
+        VHD_OBJ_ERROR(vdev, "fcntl(F_DUPFD_CLOEXEC): %s", strerror(-ret));
+        return ret;
+    }
+
+    vdev_reset_slave_fd(vdev, fd);
+
+    return vhost_ack(vdev, 0);
+}
+
+int vhd_vdev_slave_request(struct vhd_vdev *vdev, uint32_t req,
+                           const void *payload, uint32_t size,
+                           int *fds, size_t num_fds)
+{
+    struct vhost_user_msg_hdr hdr = {
+        .req = req,
+        .size = size,
+        .flags = VHOST_USER_MSG_VERSION,
+    };
+    struct vhost_user_msg_hdr reply_hdr;
+    uint64_t reply;
+    int reply_fds[VHOST_USER_MAX_FDS];
+    size_t num_reply_fds = 0;
+    bool need_reply = has_feature(vdev->negotiated_protocol_features,
+                                  VHOST_USER_PROTOCOL_F_REPLY_ACK);
+    ssize_t ret;
+
+    if (need_reply) {
+        hdr.flags |= VHOST_USER_MSG_FLAGS_REPLY_ACK;
+    }
+
+    pthread_mutex_lock(&vdev->slave_lock);
+
+    if (vdev->slave_fd < 0) {
+        ret = -ENOTCONN;
+        goto out;
+    }
+
+    ret = net_send_msg(vdev->slave_fd, &hdr, payload, fds, num_fds);
+    if (ret < 0 || !need_reply) {
+        goto out;
+    }
+
+    ret = net_recv_msg(vdev->slave_fd, &reply_hdr, &reply, sizeof(reply),
+                       reply_fds, &num_reply_fds);
+    if (ret <= 0) {
+        ret = ret < 0 ? ret : -ECONNRESET;
+        goto out;
+    }
+
+    if (reply_hdr.req != req || reply_hdr.size != sizeof(reply) ||
+        !(reply_hdr.flags & VHOST_USER_MSG_FLAGS_REPLY)) {
+        VHD_OBJ_ERROR(vdev, "unexpected reply %u size %u flags 0x%x to "
+                      "slave request %u", reply_hdr.req, reply_hdr.size,
+                      reply_hdr.flags, req);
+        ret = -EPROTO;
+        goto out;
+    }
+
+    ret = reply ? -EIO : 0;
+out:
+    pthread_mutex_unlock(&vdev->slave_lock);
+    if (ret < 0 && ret != -EIO) {
+        VHD_OBJ_ERROR(vdev, "slave request %u: %s", req, strerror(-ret));
+    }
+    return ret < 0 ? ret : 0;
+}
+
 static int (*vhost_msg_handlers[])(struct vhd_vdev *vdev,
                                    const void *payload, size_t size,
                                    const int *fds, size_t num_fds) = {
@@ -1514,6 +2138,13 @@ static int (*vhost_msg_handlers[])(struct vhd_vdev *vdev,
     [VHOST_USER_SET_VRING_ADDR]         = vhost_set_vring_addr,
     [VHOST_USER_GET_INFLIGHT_FD]        = vhost_get_inflight_fd,
     [VHOST_USER_SET_INFLIGHT_FD]        = vhost_set_inflight_fd,
+    [VHOST_USER_SET_SLAVE_REQ_FD]       = vhost_set_slave_req_fd,
+    [VHOST_USER_POSTCOPY_ADVISE]        = vhost_postcopy_advise,
+    [VHOST_USER_POSTCOPY_LISTEN]        = vhost_postcopy_listen,
+    [VHOST_USER_POSTCOPY_END]           = vhost_postcopy_end,
+    [VHOST_USER_GET_MAX_MEM_SLOTS]      = vhost_get_max_mem_slots,
+    [VHOST_USER_ADD_MEM_REG]            = vhost_add_mem_reg,
+    [VHOST_USER_REM_MEM_REG]            = vhost_rem_mem_reg,
 };
 
 static int vhost_handle_msg(struct vhd_vdev *vdev, uint32_t req,
@@ -1566,7 +2197,7 @@ static int vdev_submit_work_and_wait(struct vhd_vdev *vdev,
         .opaque = opaque,
     };
 
-    return vhd_submit_ctl_work_and_wait(vdev_work_fn, &vd_work);
+    return vhd_submit_ctl_work_and_wait(vdev, vdev_work_fn, &vd_work);
 }
 
 static void vdev_cleanup(struct vhd_vdev *vdev)
@@ -1579,6 +2210,12 @@ static void vdev_cleanup(struct vhd_vdev *vdev)
 
     inflight_mem_cleanup(vdev);
 
+    vdev_reset_slave_fd(vdev, -1);
+
+    replace_fd(&vdev->postcopy_ufd, -1);
+    vdev->postcopy_listening = false;
+    vdev->postcopy_ack_pending = false;
+
     if (vdev->memmap) {
         vhd_memmap_unref(vdev->memmap);
         vdev->memmap = NULL;
@@ -1607,10 +2244,13 @@ static void vhd_vdev_release(struct vhd_vdev *vdev)
 {
     uint16_t i;
 
+    pthread_mutex_lock(&g_vdevs_lock);
     LIST_REMOVE(vdev, vdev_list);
+    pthread_mutex_unlock(&g_vdevs_lock);
 
     for (i = 0; i < vdev->num_queues; i++) {
         vhd_free(vdev->vrings[i].log_tag);
+        vhd_free(vdev->vrings[i].io_stat);
     }
     vhd_free(vdev->vrings);
 
@@ -1619,6 +2259,7 @@ static void vhd_vdev_release(struct vhd_vdev *vdev)
     }
 
     vhd_free(vdev->log_tag);
+    pthread_mutex_destroy(&vdev->slave_lock);
     vdev->type->free(vdev);
 }
 
@@ -1710,36 +2351,31 @@ static int timer_read(void *opaque)
 }
 
 /*
- * Accept a client connection and suspend accepting further connections until
- * the current client is disconnected.
+ * Start serving the client connected via @connfd; the listening is suspended
+ * until the client is disconnected.
  */
-static int server_read(void *opaque)
+static int vdev_connect(struct vhd_vdev *vdev, int connfd)
 {
-    struct vhd_vdev *vdev = opaque;
-    int connfd, timerfd;
+    int ret, timerfd;
     struct vhd_io_handler *conn_handler, *timer_handler;
 
     VHD_ASSERT(vdev->connfd < 0);
 
-    connfd = accept4(vdev->listenfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
-    if (connfd == -1) {
-        VHD_OBJ_ERROR(vdev, "accept: %s", strerror(errno));
-        return 0;
-    }
-
-    conn_handler = vhd_add_vhost_io_handler(connfd, conn_read, vdev);
+    conn_handler = vhd_add_vhost_io_handler(vdev, connfd, conn_read, vdev);
     if (!conn_handler) {
-        goto close_client;
+        return -EIO;
     }
 
     timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
     if (timerfd == -1) {
-        VHD_OBJ_ERROR(vdev, "timerfd_create: %s", strerror(errno));
+        ret = -errno;
+        VHD_OBJ_ERROR(vdev, "timerfd_create: %s", strerror(-ret));
         goto del_conn_handler;
     }
 
-    timer_handler = vhd_add_vhost_io_handler(timerfd, timer_read, vdev);
+    timer_handler = vhd_add_vhost_io_handler(vdev, timerfd, timer_read, vdev);
     if (!timer_handler) {
+        ret = -EIO;
         goto close_timer;
     }
     /* it only needs to be attached during message handling */
@@ -1753,21 +2389,42 @@ static int server_read(void *opaque)
     vdev->timer_handler = timer_handler;
     vdev->negotiated_features = 0;
     vdev->negotiated_protocol_features = 0;
-    VHD_OBJ_INFO(vdev, "Connection established, sock = %d", connfd);
     return 0;
 
 close_timer:
     close(timerfd);
 del_conn_handler:
     vhd_del_io_handler(conn_handler);
-close_client:
-    close(connfd);
+    return ret;
+}
+
+/*
+ * Accept a client connection and suspend accepting further connections until
+ * the current client is disconnected.
+ */
+static int server_read(void *opaque)
+{
+    struct vhd_vdev *vdev = opaque;
+    int connfd;
+
+    connfd = accept4(vdev->listenfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (connfd == -1) {
+        VHD_OBJ_ERROR(vdev, "accept: %s", strerror(errno));
+        return 0;
+    }
+
+    if (vdev_connect(vdev, connfd) < 0) {
+        close(connfd);
+        return 0;
+    }
+
+    VHD_OBJ_INFO(vdev, "Connection established, sock = %d", connfd);
     return 0;
 }
 
 static int vdev_start_listening(struct vhd_vdev *vdev)
 {
-    vdev->listen_handler = vhd_add_vhost_io_handler(vdev->listenfd,
+    vdev->listen_handler = vhd_add_vhost_io_handler(vdev, vdev->listenfd,
                                                     server_read, vdev);
     if (!vdev->listen_handler) {
         return -EIO;
@@ -1864,27 +2521,9 @@ close_fd:
     return ret;
 }
 
-static void vdev_start(struct vhd_vdev *vdev, void *opaque)
-{
-    int ret;
-
-    ret = vdev_start_listening(vdev);
-
-    vdev_complete_work(vdev, ret);
-}
-
-int vhd_vdev_init_server(
-    struct vhd_vdev *vdev,
-    const char *socket_path,
-    const struct vhd_vdev_type *type,
-    int max_queues,
-    struct vhd_request_queue *rq,
-    void *priv,
-    int (*map_cb)(void *addr, size_t len, void *priv),
-    int (*unmap_cb)(void *addr, size_t len, void *priv))
+static int vdev_check_params(const char *socket_path, int max_queues,
+                             struct vhd_request_queue **rqs, int num_rqs)
 {
-    int ret;
-    int listenfd;
     uint16_t i;
 
     /*
@@ -1898,24 +2537,57 @@ int vhd_vdev_init_server(
         return -1;
     }
 
-    listenfd = sock_create_server(socket_path);
-    if (listenfd < 0) {
+    if (num_rqs < 1) {
+        VHD_LOG_ERROR("%s: no request queues to attach to", socket_path);
         return -1;
     }
 
-    *vdev = (struct vhd_vdev) {
-        .priv = priv,
-        .type = type,
-        .listenfd = listenfd,
-        .connfd = -1,
-        .req = VHOST_USER_NONE,
-        .rq = rq,
-        .map_cb = map_cb,
-        .unmap_cb = unmap_cb,
-        .supported_protocol_features = g_default_protocol_features,
-        .num_queues = max_queues,
+    for (i = 0; i < num_rqs; i++) {
+        if (!rqs[i]) {
+            VHD_LOG_ERROR("%s: request queue %u is NULL", socket_path, i);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static void vdev_init(
+    struct vhd_vdev *vdev,
+    const char *socket_path,
+    const struct vhd_vdev_type *type,
+    int max_queues,
+    struct vhd_request_queue **rqs,
+    int num_rqs,
+    void *priv,
+    int (*map_cb)(void *addr, size_t len, void *priv),
+    int (*unmap_cb)(void *addr, size_t len, void *priv),
+    const struct vhd_mem_policy *mem_policy,
+    int listenfd)
+{
+    uint16_t i;
+
+    *vdev = (struct vhd_vdev) {
+        .ctl_evloop = vhd_pick_ctl_evloop(socket_path),
+        .priv = priv,
+        .type = type,
+        .listenfd = listenfd,
+        .connfd = -1,
+        .req = VHOST_USER_NONE,
+        .map_cb = map_cb,
+        .unmap_cb = unmap_cb,
+        .supported_protocol_features = g_default_protocol_features |
+            type->protocol_features,
+        .num_queues = max_queues,
         .keep_fd = -1,
+        .slave_fd = -1,
+        .inflight_fd = -1,
+        .postcopy_ufd = -1,
     };
+    pthread_mutex_init(&vdev->slave_lock, NULL);
+    if (mem_policy) {
+        vdev->mem_policy = *mem_policy;
+    }
 
     vdev->log_tag = vhd_strdup(socket_path);
 
@@ -1923,20 +2595,145 @@ int vhd_vdev_init_server(
     for (i = 0; i < vdev->num_queues; i++) {
         vdev->vrings[i] = (struct vhd_vring) {
             .vdev = vdev,
+            .rq = rqs[i % num_rqs],
             .log_tag = vhd_strdup_printf("%s[%u]", socket_path, i),
             .callfd = -1,
             .kickfd = -1,
             .errfd = -1,
+            .sched_priority = i < 64 && (type->priority_vrings & (1ull << i)),
         };
+        vdev->vrings[i].trace_id = vhd_trace_vq_id(vdev->vrings[i].log_tag);
+        TAILQ_INIT(&vdev->vrings[i].submission);
     }
 
+    pthread_mutex_lock(&g_vdevs_lock);
     LIST_INSERT_HEAD(&g_vdevs, vdev, vdev_list);
+    pthread_mutex_unlock(&g_vdevs_lock);
+}
 
-    ret = vdev_submit_work_and_wait(vdev, vdev_start, NULL);
-    if (ret != 0) {
-        vhd_vdev_release(vdev);
+int vhd_vdev_prepare_server(
+    struct vhd_vdev *vdev,
+    const char *socket_path,
+    const struct vhd_vdev_type *type,
+    int max_queues,
+    struct vhd_request_queue **rqs,
+    int num_rqs,
+    void *priv,
+    int (*map_cb)(void *addr, size_t len, void *priv),
+    int (*unmap_cb)(void *addr, size_t len, void *priv),
+    const struct vhd_mem_policy *mem_policy)
+{
+    int listenfd;
+
+    if (vdev_check_params(socket_path, max_queues, rqs, num_rqs) < 0) {
+        return -1;
+    }
+
+    listenfd = sock_create_server(socket_path);
+    if (listenfd < 0) {
+        return -1;
+    }
+
+    vdev_init(vdev, socket_path, type, max_queues, rqs, num_rqs, priv,
+              map_cb, unmap_cb, mem_policy, listenfd);
+    return 0;
+}
+
+void vhd_vdev_enable_postcopy(struct vhd_vdev *vdev)
+{
+    vdev->supported_protocol_features |=
+        1ull << VHOST_USER_PROTOCOL_F_PAGEFAULT;
+}
+
+/* The devices of a vhd_vdev_start_servers() call served by @evloop */
+struct vdev_start_batch {
+    struct vhd_event_loop *evloop;
+    struct vhd_vdev **vdevs;
+    int *results;
+    int num;
+};
+
+static void vdev_start_batch_work(struct vhd_work *work, void *opaque)
+{
+    struct vdev_start_batch *batch = opaque;
+    int i;
+
+    for (i = 0; i < batch->num; i++) {
+        if (batch->vdevs[i]->ctl_evloop == batch->evloop) {
+            batch->results[i] = vdev_start_listening(batch->vdevs[i]);
+        }
+    }
+
+    vhd_complete_work(work, 0);
+}
+
+int vhd_vdev_start_servers(struct vhd_vdev **vdevs, int *results, int num)
+{
+    int num_started = 0;
+    int i, j;
+
+    /* one work item per control thread, with all of its devices */
+    for (i = 0; i < num; i++) {
+        struct vdev_start_batch batch = {
+            .evloop = vdevs[i]->ctl_evloop,
+            .vdevs = vdevs,
+            .results = results,
+            .num = num,
+        };
+        int ret;
+
+        for (j = 0; j < i && vdevs[j]->ctl_evloop != batch.evloop; j++) {
+            ;
+        }
+        if (j < i) {
+            continue;
+        }
+
+        ret = vhd_submit_ctl_work_and_wait(vdevs[i], vdev_start_batch_work,
+                                           &batch);
+        if (ret < 0) {
+            for (j = i; j < num; j++) {
+                if (vdevs[j]->ctl_evloop == batch.evloop) {
+                    results[j] = ret;
+                }
+            }
+        }
+    }
+
+    for (i = 0; i < num; i++) {
+        if (results[i] == 0) {
+            num_started++;
+            continue;
+        }
+        VHD_OBJ_ERROR(vdevs[i], "failed to start: %s", strerror(-results[i]));
+        replace_fd(&vdevs[i]->listenfd, -1);
+        vhd_vdev_release(vdevs[i]);
+    }
+
+    return num_started;
+}
+
+int vhd_vdev_init_server(
+    struct vhd_vdev *vdev,
+    const char *socket_path,
+    const struct vhd_vdev_type *type,
+    int max_queues,
+    struct vhd_request_queue **rqs,
+    int num_rqs,
+    void *priv,
+    int (*map_cb)(void *addr, size_t len, void *priv),
+    int (*unmap_cb)(void *addr, size_t len, void *priv),
+    const struct vhd_mem_policy *mem_policy)
+{
+    int ret;
+
+    ret = vhd_vdev_prepare_server(vdev, socket_path, type, max_queues, rqs,
+                                  num_rqs, priv, map_cb, unmap_cb, mem_policy);
+    if (ret < 0) {
+        return ret;
     }
 
+    vhd_vdev_start_servers(&vdev, &ret, 1);
     return ret;
 }
 
@@ -1985,23 +2782,993 @@ int vhd_vdev_stop_server(struct vhd_vdev *vdev,
     return ret;
 }
 
-void *vhd_vdev_get_priv(struct vhd_vdev *vdev)
+/*
+ * Live handover
+ *
+ * The state of a connected device is sent over a unix socket to another
+ * process, along with all the file descriptors: the listening and the client
+ * sockets, the guest memory and inflight region files, and the vring
+ * eventfds.  The client talks to the new process from then on without
+ * noticing, so there's no reconnect with the full renegotiation and
+ * remapping of guest memory.
+ *
+ * The state is sent as a sequence of vhost-user-like messages, with ->req
+ * indicating the message type and ->flags the format version: the device
+ * state, then one message per guest memory region, then one message per
+ * vring.
+ */
+
+#define VHD_HANDOVER_VERSION            2
+
+enum {
+    VHD_HANDOVER_VDEV = 1,
+    VHD_HANDOVER_MEM_REGION,
+    VHD_HANDOVER_VRING,
+};
+
+struct handover_vdev_state {
+    uint64_t supported_features;
+    uint64_t negotiated_features;
+    uint64_t supported_protocol_features;
+    uint64_t negotiated_protocol_features;
+    /* inflight region layout; 0 queues if there's none */
+    uint64_t inflight_queue_region_size;
+    uint32_t inflight_num_queues;
+    uint32_t num_queues;
+    uint32_t num_regions;
+    /* whether the slave channel fd follows the inflight one */
+    uint32_t has_slave_fd;
+};
+
+struct handover_mem_region {
+    uint64_t gpa;
+    uint64_t uva;
+    uint64_t size;
+    uint64_t offset;
+};
+
+/* the fds sent with the vring state, in this order; kickfd iff started */
+#define VHD_HANDOVER_VRING_KICKFD       (1u << 0)
+#define VHD_HANDOVER_VRING_CALLFD       (1u << 1)
+#define VHD_HANDOVER_VRING_ERRFD        (1u << 2)
+
+struct handover_vring_state {
+    uint32_t fds;
+    uint32_t num;
+    uint32_t base;
+    uint32_t flags;
+    uint64_t desc;
+    uint64_t used;
+    uint64_t avail;
+    uint64_t used_gpa_base;
+};
+
+struct vdev_handover_vring {
+    struct handover_vring_state st;
+    int kickfd;
+    int callfd;
+    int errfd;
+    /* the state was captured when the vring was drained */
+    bool stopped;
+};
+
+struct vdev_handover {
+    struct handover_vdev_state st;
+    int listenfd;
+    int connfd;
+    int inflight_fd;
+    int slave_fd;
+
+    struct handover_mem_region *regions;
+    int *region_fds;
+
+    struct vdev_handover_vring *vrings;
+
+    /*
+     * the device has started stopping the vrings to hand them over, #vrings
+     * not yet drained, and the first error capturing their state
+     */
+    bool stopping;
+    uint16_t num_vrings_stopping;
+    int vrings_ret;
+};
+
+static struct vdev_handover *vdev_handover_new(uint32_t num_queues)
 {
-    return vdev->priv;
+    struct vdev_handover *ho = vhd_zalloc(sizeof(*ho));
+    uint32_t i;
+
+    ho->listenfd = ho->connfd = ho->inflight_fd = ho->slave_fd = -1;
+
+    ho->vrings = vhd_calloc(num_queues, sizeof(ho->vrings[0]));
+    for (i = 0; i < num_queues; i++) {
+        ho->vrings[i].kickfd = ho->vrings[i].callfd = ho->vrings[i].errfd = -1;
+    }
+
+    ho->st.num_queues = num_queues;
+    return ho;
 }
 
-/**
- * metrics - output parameter.
- * Returns 0 on success, -errno on failure
+static void vdev_handover_alloc_regions(struct vdev_handover *ho,
+                                        uint32_t num_regions)
+{
+    uint32_t i;
+
+    ho->regions = vhd_calloc(num_regions, sizeof(ho->regions[0]));
+    ho->region_fds = vhd_calloc(num_regions, sizeof(ho->region_fds[0]));
+    for (i = 0; i < num_regions; i++) {
+        ho->region_fds[i] = -1;
+    }
+
+    ho->st.num_regions = num_regions;
+}
+
+static void vdev_handover_free(struct vdev_handover *ho)
+{
+    uint32_t i;
+
+    replace_fd(&ho->listenfd, -1);
+    replace_fd(&ho->connfd, -1);
+    replace_fd(&ho->inflight_fd, -1);
+    replace_fd(&ho->slave_fd, -1);
+
+    for (i = 0; i < ho->st.num_regions; i++) {
+        replace_fd(&ho->region_fds[i], -1);
+    }
+    for (i = 0; i < ho->st.num_queues; i++) {
+        replace_fd(&ho->vrings[i].kickfd, -1);
+        replace_fd(&ho->vrings[i].callfd, -1);
+        replace_fd(&ho->vrings[i].errfd, -1);
+    }
+
+    vhd_free(ho->regions);
+    vhd_free(ho->region_fds);
+    vhd_free(ho->vrings);
+    vhd_free(ho);
+}
+
+static int handover_dup_fd(int fd, int *out)
+{
+    if (fd < 0) {
+        *out = -1;
+        return 0;
+    }
+
+    *out = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    if (*out < 0) {
+        int ret = -errno;
+        VHD_LOG_ERROR("fcntl(F_DUPFD_CLOEXEC): %s", strerror(-ret));
+        return ret;
+    }
+
+    return 0;
+}
+
+static int handover_send(int sock, uint32_t type, const void *payload,
+                         uint32_t size, int *fds, size_t num_fds)
+{
+    struct vhost_user_msg_hdr hdr = {
+        .req = type,
+        .flags = VHD_HANDOVER_VERSION,
+        .size = size,
+    };
+    int ret = net_send_msg(sock, &hdr, payload, fds, num_fds);
+
+    return ret < 0 ? ret : 0;
+}
+
+/*
+ * Receive a message of @type with exactly @size bytes of payload and up to
+ * *@num_fds fds; *@num_fds is set to the number of fds received.
  */
-int vhd_vdev_get_queue_stat(struct vhd_vdev *vdev, uint32_t queue_num,
-                            struct vhd_vq_metrics *metrics)
+static int handover_recv(int sock, uint32_t type, void *payload,
+                         uint32_t size, int *fds, size_t *num_fds)
 {
-    if (queue_num >= vdev->num_queues) {
-        return -EINVAL;
+    struct vhost_user_msg_hdr hdr;
+    ssize_t ret;
+
+    ret = net_recv_msg(sock, &hdr, payload, size, fds, num_fds);
+    if (ret <= 0) {
+        return ret < 0 ? ret : -ECONNRESET;
     }
 
-    virtio_virtq_get_stat(&vdev->vrings[queue_num].vq, metrics);
+    if (hdr.req != type || hdr.flags != VHD_HANDOVER_VERSION ||
+        hdr.size != size) {
+        VHD_LOG_ERROR("unexpected handover message type %u version %u "
+                      "size %u (expected %u %u %u)", hdr.req, hdr.flags,
+                      hdr.size, type, VHD_HANDOVER_VERSION, size);
+        while (*num_fds) {
+            replace_fd(&fds[--*num_fds], -1);
+        }
+        return -EPROTO;
+    }
+
+    return 0;
+}
+
+static int vdev_handover_send(int sock, struct vdev_handover *ho)
+{
+    int fds[4];
+    size_t num_fds = 0;
+    uint32_t i;
+    int ret;
+
+    fds[num_fds++] = ho->listenfd;
+    fds[num_fds++] = ho->connfd;
+    if (ho->inflight_fd >= 0) {
+        fds[num_fds++] = ho->inflight_fd;
+    }
+    if (ho->slave_fd >= 0) {
+        fds[num_fds++] = ho->slave_fd;
+    }
+
+    ret = handover_send(sock, VHD_HANDOVER_VDEV, &ho->st, sizeof(ho->st),
+                        fds, num_fds);
+    if (ret < 0) {
+        return ret;
+    }
+
+    for (i = 0; i < ho->st.num_regions; i++) {
+        ret = handover_send(sock, VHD_HANDOVER_MEM_REGION, &ho->regions[i],
+                            sizeof(ho->regions[i]), &ho->region_fds[i], 1);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    for (i = 0; i < ho->st.num_queues; i++) {
+        struct vdev_handover_vring *hv = &ho->vrings[i];
+
+        num_fds = 0;
+        if (hv->st.fds & VHD_HANDOVER_VRING_KICKFD) {
+            fds[num_fds++] = hv->kickfd;
+        }
+        if (hv->st.fds & VHD_HANDOVER_VRING_CALLFD) {
+            fds[num_fds++] = hv->callfd;
+        }
+        if (hv->st.fds & VHD_HANDOVER_VRING_ERRFD) {
+            fds[num_fds++] = hv->errfd;
+        }
+
+        ret = handover_send(sock, VHD_HANDOVER_VRING, &hv->st, sizeof(hv->st),
+                            fds, num_fds);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    return 0;
+}
+
+static int vdev_handover_recv(int sock, uint16_t num_queues,
+                              struct vdev_handover **pho)
+{
+    struct handover_vdev_state st;
+    struct vdev_handover *ho;
+    int fds[4];
+    size_t num_fds = 4;
+    uint32_t i;
+    int ret;
+
+    ret = handover_recv(sock, VHD_HANDOVER_VDEV, &st, sizeof(st),
+                        fds, &num_fds);
+    if (ret < 0) {
+        return ret;
+    }
+
+    if (num_fds != 2u + !!st.inflight_num_queues + !!st.has_slave_fd ||
+        st.num_queues != num_queues || st.num_regions > UINT8_MAX) {
+        VHD_LOG_ERROR("bad handover device state: %zu fds, %u queues "
+                      "(expected %u), %u memory regions", num_fds,
+                      st.num_queues, num_queues, st.num_regions);
+        while (num_fds) {
+            close(fds[--num_fds]);
+        }
+        return -EPROTO;
+    }
+
+    ho = vdev_handover_new(st.num_queues);
+    vdev_handover_alloc_regions(ho, st.num_regions);
+    ho->st = st;
+    ho->listenfd = fds[0];
+    ho->connfd = fds[1];
+    num_fds = 2;
+    if (st.inflight_num_queues) {
+        ho->inflight_fd = fds[num_fds++];
+    }
+    if (st.has_slave_fd) {
+        ho->slave_fd = fds[num_fds++];
+    }
+
+    for (i = 0; i < st.num_regions; i++) {
+        num_fds = 1;
+        ret = handover_recv(sock, VHD_HANDOVER_MEM_REGION, &ho->regions[i],
+                            sizeof(ho->regions[i]), &ho->region_fds[i],
+                            &num_fds);
+        if (ret < 0) {
+            goto fail;
+        }
+        if (num_fds != 1) {
+            VHD_LOG_ERROR("no fd for handed over memory region %u", i);
+            ret = -EPROTO;
+            goto fail;
+        }
+    }
+
+    for (i = 0; i < st.num_queues; i++) {
+        struct vdev_handover_vring *hv = &ho->vrings[i];
+        size_t num_expected;
+
+        num_fds = 3;
+        ret = handover_recv(sock, VHD_HANDOVER_VRING, &hv->st, sizeof(hv->st),
+                            fds, &num_fds);
+        if (ret < 0) {
+            goto fail;
+        }
 
+        num_expected = !!(hv->st.fds & VHD_HANDOVER_VRING_KICKFD) +
+            !!(hv->st.fds & VHD_HANDOVER_VRING_CALLFD) +
+            !!(hv->st.fds & VHD_HANDOVER_VRING_ERRFD);
+        if (num_fds != num_expected) {
+            VHD_LOG_ERROR("handed over vring %u: %zu fds (expected %zu)", i,
+                          num_fds, num_expected);
+            while (num_fds) {
+                close(fds[--num_fds]);
+            }
+            ret = -EPROTO;
+            goto fail;
+        }
+
+        num_fds = 0;
+        if (hv->st.fds & VHD_HANDOVER_VRING_KICKFD) {
+            hv->kickfd = fds[num_fds++];
+        }
+        if (hv->st.fds & VHD_HANDOVER_VRING_CALLFD) {
+            hv->callfd = fds[num_fds++];
+        }
+        if (hv->st.fds & VHD_HANDOVER_VRING_ERRFD) {
+            hv->errfd = fds[num_fds++];
+        }
+    }
+
+    *pho = ho;
+    return 0;
+
+fail:
+    vdev_handover_free(ho);
+    return ret;
+}
+
+/*
+ * Capture the vring state; for a started vring this is done once it's
+ * drained, so the avail and used positions are the same
+ */
+static int vring_handover_capture(struct vhd_vring *vring,
+                                  struct vdev_handover_vring *hv)
+{
+    int ret;
+
+    hv->st = (struct handover_vring_state) {
+        .num = vring->vq.qsz,
+        .base = virtq_get_base(&vring->vq),
+        .flags = vring->shadow_vq.flags,
+        .desc = vring->addr_cache.desc,
+        .used = vring->addr_cache.used,
+        .avail = vring->addr_cache.avail,
+        .used_gpa_base = vring->vq.used_gpa_base,
+    };
+
+    ret = handover_dup_fd(vring->kickfd, &hv->kickfd);
+    if (ret < 0) {
+        return ret;
+    }
+    ret = handover_dup_fd(vring->callfd, &hv->callfd);
+    if (ret < 0) {
+        return ret;
+    }
+    ret = handover_dup_fd(vring->errfd, &hv->errfd);
+    if (ret < 0) {
+        return ret;
+    }
+
+    hv->st.fds = (hv->kickfd >= 0 ? VHD_HANDOVER_VRING_KICKFD : 0) |
+        (hv->callfd >= 0 ? VHD_HANDOVER_VRING_CALLFD : 0) |
+        (hv->errfd >= 0 ? VHD_HANDOVER_VRING_ERRFD : 0);
     return 0;
 }
+
+static int vdev_handover_capture(struct vhd_vdev *vdev,
+                                 struct vdev_handover *ho)
+{
+    uint32_t i;
+    int ret;
+
+    ho->st.supported_features = vdev->supported_features;
+    ho->st.negotiated_features = vdev->negotiated_features;
+    ho->st.supported_protocol_features = vdev->supported_protocol_features;
+    ho->st.negotiated_protocol_features = vdev->negotiated_protocol_features;
+
+    if (vdev->inflight_mem) {
+        /* the split and packed region headers agree on desc_num */
+        size_t queue_region_size =
+            vring_inflight_buf_size(vdev, vdev->inflight_mem->desc_num);
+
+        ho->st.inflight_queue_region_size = queue_region_size;
+        ho->st.inflight_num_queues = vdev->inflight_size / queue_region_size;
+        ret = handover_dup_fd(vdev->inflight_fd, &ho->inflight_fd);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    ret = handover_dup_fd(vdev->slave_fd, &ho->slave_fd);
+    if (ret < 0) {
+        return ret;
+    }
+    ho->st.has_slave_fd = ho->slave_fd >= 0;
+
+    ret = handover_dup_fd(vdev->listenfd, &ho->listenfd);
+    if (ret < 0) {
+        return ret;
+    }
+    ret = handover_dup_fd(vdev->connfd, &ho->connfd);
+    if (ret < 0) {
+        return ret;
+    }
+
+    for (i = 0; i < ho->st.num_regions; i++) {
+        struct handover_mem_region *reg = &ho->regions[i];
+        size_t size;
+        off_t offset;
+        int fd;
+
+        vhd_memmap_get_slot(vdev->memmap, i, &reg->gpa, &reg->uva, &size,
+                            &fd, &offset);
+        reg->size = size;
+        reg->offset = offset;
+        ret = handover_dup_fd(fd, &ho->region_fds[i]);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    for (i = 0; i < ho->st.num_queues; i++) {
+        if (ho->vrings[i].stopped) {
+            continue;
+        }
+        ret = vring_handover_capture(&vdev->vrings[i], &ho->vrings[i]);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    return 0;
+}
+
+static int vring_handover_drained(struct vhd_vring *vring)
+{
+    struct vhd_vdev *vdev = vring->vdev;
+    struct vdev_handover *ho = vdev->handover;
+    struct vdev_handover_vring *hv = &ho->vrings[vring_idx(vring)];
+    int ret;
+
+    /* a failure is reported once all vrings are drained */
+    ret = vring_handover_capture(vring, hv);
+    if (ret < 0 && !ho->vrings_ret) {
+        ho->vrings_ret = ret;
+    }
+    hv->stopped = true;
+
+    VHD_ASSERT(ho->num_vrings_stopping);
+    if (!--ho->num_vrings_stopping) {
+        vdev->handover = NULL;
+        ret = ho->vrings_ret;
+        if (!ret) {
+            ret = vdev_handover_capture(vdev, ho);
+        }
+        vdev_complete_work(vdev, ret);
+    }
+
+    return 0;
+}
+
+static void vdev_handover_prepare(struct vhd_vdev *vdev, void *opaque)
+{
+    struct vdev_handover *ho = opaque;
+    uint16_t i;
+
+    if (!vdev->conn_handler) {
+        vdev_complete_work(vdev, -ENOTCONN);
+        return;
+    }
+
+    /* the client must not be waiting for a reply */
+    if (vdev->req != VHOST_USER_NONE) {
+        vdev_complete_work(vdev, -EBUSY);
+        return;
+    }
+
+    /* the dirty log isn't handed over */
+    if (vdev->memlog) {
+        VHD_OBJ_ERROR(vdev, "can't hand over the device while logging");
+        vdev_complete_work(vdev, -EBUSY);
+        return;
+    }
+
+    /*
+     * Neither is the userfaultfd registration, so the pages yet to migrate
+     * would read as zeroes in the receiving process
+     */
+    if (vdev->postcopy_ufd >= 0 || vdev->postcopy_listening) {
+        VHD_OBJ_ERROR(vdev, "can't hand over the device during postcopy");
+        vdev_complete_work(vdev, -EBUSY);
+        return;
+    }
+
+    vdev_handover_alloc_regions(ho, vdev->memmap ?
+                                vhd_memmap_num_slots(vdev->memmap) : 0);
+
+    /* stop accepting messages and wait for all requests to complete */
+    vhd_detach_io_handler(vdev->conn_handler);
+    ho->stopping = true;
+
+    for (i = 0; i < vdev->num_queues; i++) {
+        struct vhd_vring *vring = &vdev->vrings[i];
+
+        if (!vring->started_in_ctl) {
+            continue;
+        }
+
+        vring->on_drain_cb = vring_handover_drained;
+        ho->num_vrings_stopping++;
+        vhd_run_in_rq(vring->rq, vring_stop_bh, vring);
+    }
+
+    if (!ho->num_vrings_stopping) {
+        vdev_complete_work(vdev, vdev_handover_capture(vdev, ho));
+        return;
+    }
+
+    vdev->handover = ho;
+}
+
+/*
+ * The other process has the slave channel now, so just close it here rather
+ * than shut it down along with the device
+ */
+static void vdev_handover_sent(struct vhd_vdev *vdev, void *opaque)
+{
+    vdev_set_slave_fd(vdev, -1);
+    vdev_complete_work(vdev, 0);
+}
+
+static void vdev_handover_abort(struct vhd_vdev *vdev, void *opaque)
+{
+    VHD_OBJ_WARN(vdev, "handover failed, disconnecting the client");
+
+    vdev_disconnect(vdev);
+    vdev_complete_work(vdev, 0);
+}
+
+int vhd_vdev_handover(struct vhd_vdev *vdev, int sock,
+                      void (*release_cb)(void *), void *release_arg)
+{
+    struct vdev_handover *ho = vdev_handover_new(vdev->num_queues);
+    int ret;
+
+    ret = vdev_submit_work_and_wait(vdev, vdev_handover_prepare, ho);
+    if (ret < 0 && !ho->stopping) {
+        goto out;
+    }
+
+    if (ret == 0) {
+        ret = vdev_handover_send(sock, ho);
+    }
+    if (ret < 0) {
+        VHD_OBJ_ERROR(vdev, "handover: %s", strerror(-ret));
+        vdev_submit_work_and_wait(vdev, vdev_handover_abort, NULL);
+        goto out;
+    }
+
+    VHD_OBJ_INFO(vdev, "handed over to another process");
+    vdev_submit_work_and_wait(vdev, vdev_handover_sent, NULL);
+
+    /*
+     * The client connection and the guest memory remain open in the other
+     * process, so the device can go away as if the client disconnected
+     */
+    ret = vhd_vdev_stop_server(vdev, release_cb, release_arg);
+
+out:
+    vdev_handover_free(ho);
+    return ret;
+}
+
+static int vdev_handover_restore(struct vhd_vdev *vdev,
+                                 struct vdev_handover *ho)
+{
+    bool has_event_idx = has_feature(ho->st.negotiated_features,
+                                     VIRTIO_F_RING_EVENT_IDX);
+    bool packed = has_feature(ho->st.negotiated_features,
+                              VIRTIO_F_RING_PACKED);
+    uint16_t i;
+    int ret;
+
+    vdev->supported_features = ho->st.supported_features;
+    vdev->negotiated_features = ho->st.negotiated_features;
+    vdev->supported_protocol_features = ho->st.supported_protocol_features;
+    vdev->negotiated_protocol_features = ho->st.negotiated_protocol_features;
+
+    if (ho->st.num_regions) {
+        vdev->memmap = vdev_memmap_new(vdev);
+    }
+    for (i = 0; i < ho->st.num_regions; i++) {
+        const struct handover_mem_region *reg = &ho->regions[i];
+        ret = vhd_memmap_add_slot(vdev->memmap, reg->gpa, reg->uva, reg->size,
+                                  ho->region_fds[i], reg->offset);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    vdev_set_slave_fd(vdev, ho->slave_fd);
+    ho->slave_fd = -1;
+
+    if (ho->st.inflight_num_queues) {
+        ret = inflight_mmap_region(vdev, ho->inflight_fd,
+                                   ho->st.inflight_queue_region_size,
+                                   ho->st.inflight_num_queues);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    for (i = 0; i < vdev->num_queues; i++) {
+        struct vhd_vring *vring = &vdev->vrings[i];
+        struct vdev_handover_vring *hv = &ho->vrings[i];
+
+        vring->vq.has_event_idx = has_event_idx;
+        vring->vq.packed = packed;
+        vring->vq.qsz = hv->st.num;
+        virtq_set_base(&vring->vq, hv->st.base);
+        vring->addr_cache.desc = hv->st.desc;
+        vring->addr_cache.used = hv->st.used;
+        vring->addr_cache.avail = hv->st.avail;
+        vring->shadow_vq.flags = hv->st.flags;
+        vring->vq.used_gpa_base = hv->st.used_gpa_base;
+
+        replace_fd(&vring->callfd, hv->callfd);
+        hv->callfd = -1;
+        replace_fd(&vring->errfd, hv->errfd);
+        hv->errfd = -1;
+
+        if (hv->kickfd < 0) {
+            continue;
+        }
+
+        ret = vdev->memmap ?
+            vring_update_shadow_vq_addrs(vring, vdev->memmap) : -EINVAL;
+        if (ret < 0) {
+            return ret;
+        }
+        replace_fd(&vring->kickfd, hv->kickfd);
+        hv->kickfd = -1;
+    }
+
+    return 0;
+}
+
+static int vdev_handover_resume_complete(struct vhd_vdev *vdev)
+{
+    VHD_OBJ_INFO(vdev, "resumed after handover");
+
+    vhd_attach_io_handler(vdev->conn_handler);
+    vdev_complete_work(vdev, 0);
+    return 0;
+}
+
+static void vdev_handover_resume(struct vhd_vdev *vdev, void *opaque)
+{
+    struct vdev_handover *ho = opaque;
+    uint16_t i;
+    int ret;
+
+    ret = vdev_start_listening(vdev);
+    if (ret < 0) {
+        vdev_complete_work(vdev, ret);
+        return;
+    }
+
+    /*
+     * From now on failures are not fatal: the client is disconnected and
+     * reconnects to the listening socket as if the process was restarted
+     */
+    ret = vdev_connect(vdev, ho->connfd);
+    if (ret < 0) {
+        VHD_OBJ_ERROR(vdev, "failed to resume the handed over connection");
+        vdev_complete_work(vdev, 0);
+        return;
+    }
+    ho->connfd = -1;
+    vhd_detach_io_handler(vdev->conn_handler);
+
+    ret = vdev_handover_restore(vdev, ho);
+    if (ret < 0) {
+        VHD_OBJ_ERROR(vdev, "failed to restore handed over state: %s",
+                      strerror(-ret));
+        vdev_disconnect(vdev);
+        vdev_complete_work(vdev, 0);
+        return;
+    }
+
+    vdev->handle_complete = vdev_handover_resume_complete;
+    for (i = 0; i < vdev->num_queues; i++) {
+        struct vhd_vring *vring = &vdev->vrings[i];
+
+        if (vring->kickfd < 0) {
+            continue;
+        }
+
+        vring_start(vring);
+    }
+
+    if (!vdev->num_vrings_handling_msg) {
+        vdev->handle_complete = NULL;
+        vdev_handover_resume_complete(vdev);
+    }
+}
+
+int vhd_vdev_init_handover(
+    struct vhd_vdev *vdev,
+    const char *socket_path,
+    const struct vhd_vdev_type *type,
+    int max_queues,
+    struct vhd_request_queue **rqs,
+    int num_rqs,
+    void *priv,
+    int (*map_cb)(void *addr, size_t len, void *priv),
+    int (*unmap_cb)(void *addr, size_t len, void *priv),
+    const struct vhd_mem_policy *mem_policy,
+    int sock)
+{
+    struct vdev_handover *ho;
+    int ret;
+
+    if (vdev_check_params(socket_path, max_queues, rqs, num_rqs) < 0) {
+        return -1;
+    }
+
+    ret = vdev_handover_recv(sock, max_queues, &ho);
+    if (ret < 0) {
+        VHD_LOG_ERROR("%s: failed to receive handover: %s", socket_path,
+                      strerror(-ret));
+        return -1;
+    }
+
+    vdev_init(vdev, socket_path, type, max_queues, rqs, num_rqs, priv,
+              map_cb, unmap_cb, mem_policy, ho->listenfd);
+    ho->listenfd = -1;
+
+    ret = vdev_submit_work_and_wait(vdev, vdev_handover_resume, ho);
+    if (ret != 0) {
+        replace_fd(&vdev->listenfd, -1);
+        vhd_vdev_release(vdev);
+    }
+
+    vdev_handover_free(ho);
+    return ret;
+}
+
+void *vhd_vdev_get_priv(struct vhd_vdev *vdev)
+{
+    return vdev->priv;
+}
+
+struct vdev_mem_regions_work {
+    struct vhd_vdev *vdev;
+    struct vhd_mem_region_info *regions;
+    unsigned max;
+};
+
+static void vdev_get_mem_regions(struct vhd_work *work, void *opaque)
+{
+    struct vdev_mem_regions_work *mr_work = opaque;
+    struct vhd_memory_map *mm = mr_work->vdev->memmap;
+    unsigned i, num = mm ? vhd_memmap_num_slots(mm) : 0;
+
+    for (i = 0; i < MIN(num, mr_work->max); i++) {
+        struct vhd_mem_region_info *info = &mr_work->regions[i];
+        uint64_t uva;
+        size_t size;
+        int fd;
+        off_t offset;
+        int node;
+
+        vhd_memmap_get_slot(mm, i, &info->gpa, &uva, &size, &fd, &offset);
+        info->size = size;
+        node = vhd_memmap_get_numa_node(mm, i);
+        info->numa_node = node < 0 ? -1 : node;
+    }
+
+    vhd_complete_work(work, num);
+}
+
+int vhd_vdev_get_mem_regions(struct vhd_vdev *vdev,
+                             struct vhd_mem_region_info *regions,
+                             unsigned max)
+{
+    struct vdev_mem_regions_work mr_work = {
+        .vdev = vdev,
+        .regions = regions,
+        .max = max,
+    };
+
+    return vhd_submit_ctl_work_and_wait(vdev, vdev_get_mem_regions, &mr_work);
+}
+
+struct vdev_queue_placement_work {
+    struct vhd_vring *vring;
+    struct vhd_vq_placement *placement;
+};
+
+static int vring_numa_node(struct vhd_vring *vring)
+{
+    struct vhd_memory_map *mm = vring->vdev->memmap;
+    unsigned i, num = mm ? vhd_memmap_num_slots(mm) : 0;
+
+    for (i = 0; i < num; i++) {
+        uint64_t gpa, uva;
+        size_t size;
+        int fd;
+        off_t offset;
+
+        vhd_memmap_get_slot(mm, i, &gpa, &uva, &size, &fd, &offset);
+        if (vring->addr_cache.desc >= uva &&
+            vring->addr_cache.desc - uva < size) {
+            int node = vhd_memmap_get_numa_node(mm, i);
+            return node < 0 ? -1 : node;
+        }
+    }
+
+    return -1;
+}
+
+static void vdev_get_queue_placement(struct vhd_work *work, void *opaque)
+{
+    struct vdev_queue_placement_work *qp_work = opaque;
+    struct vhd_vring *vring = qp_work->vring;
+
+    *qp_work->placement = (struct vhd_vq_placement) {
+        .started = vring->started_in_ctl,
+        .kickfd = vring->kickfd,
+        .callfd = vring->callfd,
+        .numa_node = vring->started_in_ctl ? vring_numa_node(vring) : -1,
+    };
+
+    vhd_complete_work(work, 0);
+}
+
+int vhd_vdev_get_queue_placement(struct vhd_vdev *vdev, uint32_t queue_num,
+                                 struct vhd_vq_placement *placement)
+{
+    struct vdev_queue_placement_work qp_work = {
+        .placement = placement,
+    };
+
+    if (queue_num >= vdev->num_queues) {
+        return -EINVAL;
+    }
+
+    qp_work.vring = &vdev->vrings[queue_num];
+    return vhd_submit_ctl_work_and_wait(vdev, vdev_get_queue_placement,
+                                        &qp_work);
+}
+
+/**
+ * metrics - output parameter.
+ * Returns 0 on success, -errno on failure
+ */
+int vhd_vdev_get_queue_stat(struct vhd_vdev *vdev, uint32_t queue_num,
+                            struct vhd_vq_metrics *metrics)
+{
+    if (queue_num >= vdev->num_queues) {
+        return -EINVAL;
+    }
+
+    virtio_virtq_get_stat(&vdev->vrings[queue_num].vq, metrics);
+
+    return 0;
+}
+
+int vhd_vdev_get_queue_io_stat(struct vhd_vdev *vdev, uint32_t queue_num,
+                               struct vhd_vq_io_stat *stat)
+{
+    if (queue_num >= vdev->num_queues) {
+        return -EINVAL;
+    }
+
+    vhd_io_stat_get(atomic_load_acquire(&vdev->vrings[queue_num].io_stat),
+                    stat);
+
+    return 0;
+}
+
+int vhd_get_vdevs_stat(vhd_vdev_stat_cb cb, void *opaque)
+{
+    struct vhd_vq_snapshot *vqs = NULL;
+    uint16_t max_queues = 0;
+    struct vhd_vdev *vdev;
+    int num_vdevs = 0;
+    uint16_t i;
+
+    /* devices are removed from the list before being freed */
+    pthread_mutex_lock(&g_vdevs_lock);
+
+    LIST_FOREACH(vdev, &g_vdevs, vdev_list) {
+        if (vdev->num_queues > max_queues) {
+            max_queues = vdev->num_queues;
+            vqs = vhd_realloc(vqs, max_queues * sizeof(vqs[0]));
+        }
+
+        for (i = 0; i < vdev->num_queues; i++) {
+            struct vhd_vring *vring = &vdev->vrings[i];
+
+            vqs[i].started = atomic_read(&vring->started_in_ctl);
+            vqs[i].num_in_flight = atomic_read(&vring->num_in_flight);
+            virtio_virtq_get_stat(&vring->vq, &vqs[i].metrics);
+            vhd_io_stat_get(atomic_load_acquire(&vring->io_stat),
+                            &vqs[i].io_stat);
+        }
+
+        cb(vdev, vqs, vdev->num_queues, opaque);
+        num_vdevs++;
+    }
+
+    pthread_mutex_unlock(&g_vdevs_lock);
+
+    vhd_free(vqs);
+    return num_vdevs;
+}
+
+int vhd_vdev_set_qos(struct vhd_vdev *vdev, const struct vhd_vdev_qos *qos)
+{
+    if ((qos->iops_burst && !qos->iops_limit) ||
+        (qos->bps_burst && !qos->bps_limit)) {
+        return -EINVAL;
+    }
+
+    atomic_set(&vdev->qos_weight, qos->weight);
+    vhd_rate_limit_set(&vdev->iops_limit, qos->iops_limit, qos->iops_burst);
+    vhd_rate_limit_set(&vdev->bps_limit, qos->bps_limit, qos->bps_burst);
+
+    return 0;
+}
+
+int vhd_vdev_set_notify_coalescing(struct vhd_vdev *vdev,
+                                   uint32_t max_completions,
+                                   uint32_t max_delay_us)
+{
+    if (max_completions && !max_delay_us) {
+        return -EINVAL;
+    }
+
+    atomic_set(&vdev->notify_coalesce_max, max_completions);
+    atomic_set(&vdev->notify_coalesce_us, max_delay_us);
+
+    return 0;
+}
+
+void vhd_vdev_set_stop_undrained(struct vhd_vdev *vdev, bool enable)
+{
+    /* publishes the fence callback set before */
+    atomic_store_release(&vdev->stop_undrained, enable);
+}
+
+void vhd_vdev_set_fence_cb(struct vhd_vdev *vdev,
+                           void (*fence_cb)(struct vhd_vdev *vdev,
+                                            uint32_t queue_num, void *opaque),
+                           void *opaque)
+{
+    vdev->fence_cb = fence_cb;
+    vdev->fence_opaque = opaque;
+}
@@ -1,9 +1,12 @@
 #pragma once
 
+#include <pthread.h>
 #include <time.h>
 
 #include "event.h"
+#include "io_stat.h"
 #include "queue.h"
+#include "rate_limit.h"
 
 #include "virtio/virt_queue.h"
 
@@ -22,6 +25,16 @@ struct vhd_vdev_type {
     /* Human-readable description */
     const char *desc;
 
+    /* Vhost protocol features supported on top of the common ones */
+    uint64_t protocol_features;
+
+    /*
+     * Mask of the vrings (by index, up to 64) whose requests are dequeued
+     * ahead of those of the other vrings in their rq, up to a scheduling
+     * quantum at a time, e.g. the virtio-fs hiprio queue
+     */
+    uint64_t priority_vrings;
+
     /* Polymorphic type ops */
     uint64_t (*get_features)(struct vhd_vdev *vdev);
     int (*set_features)(struct vhd_vdev *vdev, uint64_t features);
@@ -44,6 +57,9 @@ struct vhd_work;
 struct vhd_vdev {
     char *log_tag;
 
+    /* Control event loop serving the device */
+    struct vhd_event_loop *ctl_evloop;
+
     /* Accosiated client private data */
     void *priv;
 
@@ -66,9 +82,6 @@ struct vhd_vdev {
     int timerfd;
     struct vhd_io_handler *timer_handler;
 
-    /* Attached request queue */
-    struct vhd_request_queue *rq;
-
     /*
      * Vhost protocol features which can be supported for this vdev and
      * those which have been actually enabled during negotiation.
@@ -80,7 +93,14 @@ struct vhd_vdev {
 
     /* Maximum amount of request queues this device can support */
     uint16_t num_queues;
-    struct vhd_vring *vrings; /* Total num_queues elements */
+    /*
+     * Total num_queues elements, allocated along with the device and kept
+     * until it's released: the queue statistics are read off them from any
+     * thread without locking.  The bulk of the per-vring state, the request
+     * pool of the virtq and the I/O statistics, is only allocated once the
+     * vring is started.
+     */
+    struct vhd_vring *vrings;
 
     /* Gets called after mapping guest memory region */
     int (*map_cb)(void *addr, size_t len, void *priv);
@@ -88,6 +108,8 @@ struct vhd_vdev {
     /* Gets called before unmapping guest memory region */
     int (*unmap_cb)(void *addr, size_t len, void *priv);
 
+    struct vhd_mem_policy mem_policy;
+
     struct vhd_memory_map *memmap;
     struct vhd_memory_map *old_memmap;
     struct vhd_memory_log *memlog;
@@ -99,6 +121,8 @@ struct vhd_vdev {
      */
     struct inflight_split_region *inflight_mem;
     uint64_t inflight_size;
+    /* file backing inflight_mem, kept to hand it over to another process */
+    int inflight_fd;
 
     /* #vrings which may have requests in flight */
     uint16_t num_vrings_in_flight;
@@ -123,7 +147,64 @@ struct vhd_vdev {
     /* fd to keep open until handle_complete and to close there */
     int keep_fd;
 
+    /*
+     * Postcopy migration: the userfaultfd created on
+     * VHOST_USER_POSTCOPY_ADVISE for the master to resolve the faults on the
+     * guest pages not migrated yet (-1 if none), and whether the guest memory
+     * is registered with it, from VHOST_USER_POSTCOPY_LISTEN to
+     * VHOST_USER_POSTCOPY_END
+     */
+    int postcopy_ufd;
+    bool postcopy_listening;
+    /*
+     * the memory table with the addresses it's mapped at here has been sent
+     * back and the master is to confirm it's ready to handle the faults, and
+     * whether the message it's sent back for asked for an ACK, which is then
+     * due after the confirmation
+     */
+    bool postcopy_ack_pending;
+    bool postcopy_reply_ack;
+    /* region being added by VHOST_USER_ADD_MEM_REG, to send back */
+    struct vhost_user_mem_region postcopy_region;
+
+    /*
+     * Slave request channel set up by VHOST_USER_SET_SLAVE_REQ_FD; only
+     * replaced in the control event loop, but used by
+     * vhd_vdev_slave_request() from arbitrary threads under the lock
+     */
+    pthread_mutex_t slave_lock;
+    int slave_fd;
+
     struct vhd_work *work;
+
+    /* handover the vrings are being drained for */
+    struct vdev_handover *handover;
+
+    /*
+     * Scheduling parameters shared by all vrings of the device, updated by
+     * vhd_vdev_set_qos() from any thread: the weight of each vring in the
+     * round robin of its rq, and the limits on the requests dequeued from all
+     * the vrings together.
+     */
+    atomic_uint qos_weight;
+    struct vhd_rate_limit iops_limit;
+    struct vhd_rate_limit bps_limit;
+
+    /*
+     * Guest notification coalescing thresholds of all vrings, updated by
+     * vhd_vdev_set_notify_coalescing() from any thread
+     */
+    atomic_uint notify_coalesce_max;
+    atomic_uint notify_coalesce_us;
+
+    /*
+     * Reply to VHOST_USER_GET_VRING_BASE without waiting for the requests in
+     * flight, see vhd_vdev_set_stop_undrained(), notifying @fence_cb of the
+     * vrings fenced so, see vhd_vdev_set_fence_cb()
+     */
+    atomic_bool stop_undrained;
+    void (*fence_cb)(struct vhd_vdev *vdev, uint32_t queue_num, void *opaque);
+    void *fence_opaque;
 };
 
 /**
@@ -132,20 +213,90 @@ struct vhd_vdev {
  * @type            Device type description
  * @vdev            vdev instance to initialize
  * @max_queues      Maximum number of queues this device can support
- * @rq              Associated request queue
+ * @rqs             Request queues to attach vrings to; vring i is served by
+ *                  @rqs[i % @num_rqs]
+ * @num_rqs         Number of elements in @rqs
  * @priv            User private data
  * @map_cb          User function to call after mapping guest memory
  * @unmap_cb        User function to call before unmapping guest memory
+ * @mem_policy      How to map guest memory, may be NULL
  */
 int vhd_vdev_init_server(
     struct vhd_vdev *vdev,
     const char *socket_path,
     const struct vhd_vdev_type *type,
     int max_queues,
-    struct vhd_request_queue *rq,
+    struct vhd_request_queue **rqs,
+    int num_rqs,
+    void *priv,
+    int (*map_cb)(void *addr, size_t len, void *priv),
+    int (*unmap_cb)(void *addr, size_t len, void *priv),
+    const struct vhd_mem_policy *mem_policy);
+
+/**
+ * Same as vhd_vdev_init_server(), but leave the device to be started with
+ * vhd_vdev_start_servers(), along with other devices
+ */
+int vhd_vdev_prepare_server(
+    struct vhd_vdev *vdev,
+    const char *socket_path,
+    const struct vhd_vdev_type *type,
+    int max_queues,
+    struct vhd_request_queue **rqs,
+    int num_rqs,
     void *priv,
     int (*map_cb)(void *addr, size_t len, void *priv),
-    int (*unmap_cb)(void *addr, size_t len, void *priv));
+    int (*unmap_cb)(void *addr, size_t len, void *priv),
+    const struct vhd_mem_policy *mem_policy);
+
+/**
+ * Offer the master postcopy migration (VHOST_USER_PROTOCOL_F_PAGEFAULT) on
+ * top of the device type's protocol features.  Only for a device prepared with
+ * vhd_vdev_prepare_server() and not started yet; a device handed over keeps
+ * what it offered in the previous process.
+ */
+void vhd_vdev_enable_postcopy(struct vhd_vdev *vdev);
+
+/**
+ * Start listening on the sockets of @num devices prepared with
+ * vhd_vdev_prepare_server(), with a single round trip to each of the control
+ * threads serving them.  @results[i] is set to 0 if @vdevs[i] is started, or
+ * to negative error code, in which case the device is released.
+ * Returns the number of devices started.
+ */
+int vhd_vdev_start_servers(struct vhd_vdev **vdevs, int *results, int num);
+
+/**
+ * Init vhost device handed over by another process via vhd_vdev_handover();
+ * the parameters are the same as for vhd_vdev_init_server(), except that
+ * the device state, including the listening socket, is received from the
+ * unix socket @sock.  If the state can't be resumed the client is
+ * disconnected, so that it reconnects to the device from scratch.
+ */
+int vhd_vdev_init_handover(
+    struct vhd_vdev *vdev,
+    const char *socket_path,
+    const struct vhd_vdev_type *type,
+    int max_queues,
+    struct vhd_request_queue **rqs,
+    int num_rqs,
+    void *priv,
+    int (*map_cb)(void *addr, size_t len, void *priv),
+    int (*unmap_cb)(void *addr, size_t len, void *priv),
+    const struct vhd_mem_policy *mem_policy,
+    int sock);
+
+/**
+ * Hand the connected device over to another process via unix socket @sock:
+ * wait for all requests in flight, send the device state, and stop the
+ * device in this process without disconnecting the client, with
+ * @release_cb(@release_arg) called as for vhd_vdev_stop_server().
+ * Returns -EBUSY without side effects if the device is handling a message or
+ * logging dirty memory; if the state can't be sent, the client is
+ * disconnected and the device stays in this process.
+ */
+int vhd_vdev_handover(struct vhd_vdev *vdev, int sock,
+                      void (*release_cb)(void *), void *release_arg);
 
 /**
  * Stop vhost device.  Once this returns no more new requests will reach the
@@ -155,12 +306,27 @@ int vhd_vdev_init_server(
 int vhd_vdev_stop_server(struct vhd_vdev *vdev,
                          void (*release_cb)(void *), void *release_arg);
 
+/**
+ * Send a slave request @req to the client and, if VHOST_USER_PROTOCOL_F_REPLY_ACK
+ * is negotiated, wait for it to be handled.  Can be called from any thread;
+ * blocks until the client replies, and must not be called in the control
+ * event loop.  Returns -ENOTCONN if the client hasn't set up the slave
+ * channel, -EIO if it failed the request.
+ */
+int vhd_vdev_slave_request(struct vhd_vdev *vdev, uint32_t req,
+                           const void *payload, uint32_t size,
+                           int *fds, size_t num_fds);
+
 /**
  * Device vring instance
  */
 struct vhd_vring {
     struct vhd_vdev *vdev;
     char *log_tag;
+    uint32_t trace_id;
+
+    /* Request queue this vring is permanently attached to */
+    struct vhd_request_queue *rq;
 
     int kickfd;
     int callfd;
@@ -177,6 +343,21 @@ struct vhd_vring {
     /* called in control plane once vring is drained */
     int (*on_drain_cb)(struct vhd_vring *);
 
+    /*
+     * Stop the vring leaving the requests in flight to the next user of the
+     * inflight region: set in control plane along with @on_stop_cb, called
+     * once the vring is stopped, before it may be drained; the vring base to
+     * report is captured on stop in @undrained_base
+     */
+    bool stop_undrained;
+    int (*on_stop_cb)(struct vhd_vring *);
+    uint32_t undrained_base;
+    /*
+     * set in the request queue once stopped undrained, until drained, for the
+     * backend threads to tell the stale requests, see vhd_bdev_io_fenced()
+     */
+    atomic_bool fenced;
+
    /*
     * ring addresses cache
     * used to update actual ring addresses when mapping is changed
@@ -211,10 +392,93 @@ struct vhd_vring {
     uint16_t num_in_flight;
     /* #requests pending completion when the queue is requested to stop */
     uint16_t num_in_flight_at_stop;
+
+    /* started vrings served by the same rq */
+    LIST_ENTRY(vhd_vring) rq_link;
+    bool attached_to_rq;
+
+    /* has requests left in the avail ring due to the rq in-flight limits */
+    bool throttled;
+    TAILQ_ENTRY(vhd_vring) throttled_link;
+
+    /*
+     * the kick handler is edge-triggered and the kick eventfd is never
+     * cleared; kicked in the current rq pass, to be checked again for requests
+     * published meanwhile at the end of it
+     */
+    bool kick_edge;
+    bool kicked;
+    TAILQ_ENTRY(vhd_vring) kicked_link;
+
+    /* has a coalesced guest notification held back until its deadline */
+    bool notify_queued;
+    TAILQ_ENTRY(vhd_vring) notify_link;
+
+    /*
+     * requests waiting for the backend to dequeue them, and the state of the
+     * vring in the rq scheduler: whether it's on one of the rq scheduling
+     * lists, whether that's the one of vrings held back by the device rate
+     * limits, and the deficit round robin deficit in bytes
+     */
+    TAILQ_HEAD(, vhd_bio) submission;
+    TAILQ_ENTRY(vhd_vring) sched_link;
+    bool sched_queued;
+    bool sched_limited;
+    int64_t sched_deficit;
+    /* served ahead of the round robin, see vhd_vdev_type.priority_vrings */
+    bool sched_priority;
+
+    /*
+     * Updated in dataplane, read by vhd_vdev_get_queue_io_stat().  Allocated
+     * when the vring is first started, as the histograms make up most of the
+     * vring size and devices registered in advance may never be connected;
+     * kept until the device is released for the counters not to go backwards
+     * across reconnects.
+     */
+    struct vhd_io_stat *io_stat;
+
+    /* #requests completed in the current completion batch of the rq */
+    uint16_t num_batched;
+    SLIST_ENTRY(vhd_vring) batch_link;
 };
 
+/*
+ * Dispatch the requests available on the vring without waiting for a kick.
+ * Return true if there were any.  Must be called in the vring's rq.
+ */
+bool vhd_vring_poll(struct vhd_vring *vring);
+
 void vhd_vring_inc_in_flight(struct vhd_vring *vring);
-void vhd_vring_dec_in_flight(struct vhd_vring *vring);
+void vhd_vring_dec_in_flight(struct vhd_vring *vring, uint16_t count);
+
+/*
+ * Dataplane CPU accounting: a section returns the vhd_cycles() elapsed since
+ * it was started minus those taken by the sections nested into it, so that
+ * e.g. the requests completed synchronously while dispatching another
+ * vring are charged to their own vring rather than to both.
+ */
+struct vhd_cpu_section {
+    uint64_t start;
+    uint64_t nested;
+};
+
+/* cycles of the sections ended in the calling thread */
+extern __thread uint64_t vhd_cpu_section_cycles;
+
+static inline void vhd_cpu_section_start(struct vhd_cpu_section *s)
+{
+    s->nested = vhd_cpu_section_cycles;
+    s->start = vhd_cycles();
+}
+
+static inline uint64_t vhd_cpu_section_end(struct vhd_cpu_section *s)
+{
+    uint64_t elapsed = vhd_cycles() - s->start;
+    uint64_t nested = vhd_cpu_section_cycles - s->nested;
+
+    vhd_cpu_section_cycles = s->nested + elapsed;
+    return elapsed > nested ? elapsed - nested : 0;
+}
 
 #ifdef __cplusplus
 }
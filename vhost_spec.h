@@ -38,6 +38,7 @@ extern "C" {
 #define VHOST_USER_PROTOCOL_F_PAGEFAULT      8
 #define VHOST_USER_PROTOCOL_F_CONFIG         9
 #define VHOST_USER_PROTOCOL_F_INFLIGHT_SHMFD 12
+#define VHOST_USER_PROTOCOL_F_CONFIGURE_MEM_SLOTS 15
 
 /* Vhost user features (GET_FEATURES and SET_FEATURES commands). */
 #define VHOST_F_LOG_ALL                     26
@@ -45,6 +46,7 @@ extern "C" {
 #define VIRTIO_F_RING_INDIRECT_DESC         28
 #define VIRTIO_F_RING_EVENT_IDX             29
 #define VIRTIO_F_VERSION_1                  32
+#define VIRTIO_F_RING_PACKED                34
 
 /*
  * Invalid FD bit for the VHOST_USER_SET_VRING_KICK and
@@ -101,6 +103,27 @@ enum {
     VHOST_USER_POSTCOPY_END = 30,
     VHOST_USER_GET_INFLIGHT_FD = 31,
     VHOST_USER_SET_INFLIGHT_FD = 32,
+    VHOST_USER_GPU_SET_SOCKET = 33,
+    VHOST_USER_RESET_DEVICE = 34,
+    VHOST_USER_VRING_KICK = 35,
+    VHOST_USER_GET_MAX_MEM_SLOTS = 36,
+    VHOST_USER_ADD_MEM_REG = 37,
+    VHOST_USER_REM_MEM_REG = 38,
+};
+
+/*
+ * Define slave request types, sent by the slave over the channel set up with
+ * VHOST_USER_SET_SLAVE_REQ_FD.  The virtio-fs DAX requests follow the
+ * numbering of the virtio-fs QEMU/virtiofsd tree.
+ */
+enum {
+    VHOST_USER_SLAVE_NONE = 0,
+    VHOST_USER_SLAVE_IOTLB_MSG = 1,
+    VHOST_USER_SLAVE_CONFIG_CHANGE_MSG = 2,
+    VHOST_USER_SLAVE_VRING_HOST_NOTIFIER_MSG = 3,
+    VHOST_USER_SLAVE_FS_MAP = 6,
+    VHOST_USER_SLAVE_FS_UNMAP = 7,
+    VHOST_USER_SLAVE_FS_SYNC = 8,
 };
 
 struct vhost_user_mem_region {
@@ -116,6 +139,11 @@ struct vhost_user_mem_desc {
     struct vhost_user_mem_region regions[VHOST_USER_MEM_REGIONS_MAX];
 };
 
+struct vhost_user_mem_reg {
+    uint64_t _padding;
+    struct vhost_user_mem_region region;
+};
+
 struct vhost_user_vring_state {
     uint32_t index;
     uint32_t num;
@@ -162,11 +190,56 @@ struct inflight_split_region {
     struct inflight_split_desc desc[];
 };
 
+struct inflight_packed_desc {
+    uint8_t inflight;
+    uint8_t padding;
+    uint16_t next;
+    uint16_t last;
+    uint16_t num;
+    uint64_t counter;
+    uint16_t id;
+    uint16_t flags;
+    uint32_t len;
+    uint64_t addr;
+};
+
+struct inflight_packed_region {
+    uint64_t features;
+    uint16_t version;
+    uint16_t desc_num;
+    uint16_t free_head;
+    uint16_t old_free_head;
+    uint16_t used_idx;
+    uint16_t old_used_idx;
+    uint8_t used_wrap_counter;
+    uint8_t old_used_wrap_counter;
+    uint8_t padding[7];
+    struct inflight_packed_desc desc[];
+};
+
 struct vhost_user_log {
     uint64_t size;
     uint64_t offset;
 };
 
+/*
+ * Mappings of file extents into the virtio-fs DAX window
+ * (VHOST_USER_SLAVE_FS_MAP with the file fd, VHOST_USER_SLAVE_FS_UNMAP and
+ * VHOST_USER_SLAVE_FS_SYNC without); entries with zero len are ignored.
+ */
+#define VHOST_USER_FS_SLAVE_ENTRIES 8
+#define VHOST_USER_FS_FLAG_MAP_R (1ull << 0)
+#define VHOST_USER_FS_FLAG_MAP_W (1ull << 1)
+
+struct vhost_user_fs_slave_msg {
+    /* offsets in the file */
+    uint64_t fd_offset[VHOST_USER_FS_SLAVE_ENTRIES];
+    /* offsets in the DAX window */
+    uint64_t c_offset[VHOST_USER_FS_SLAVE_ENTRIES];
+    uint64_t len[VHOST_USER_FS_SLAVE_ENTRIES];
+    uint64_t flags[VHOST_USER_FS_SLAVE_ENTRIES];
+};
+
 struct vhost_user_msg_hdr {
     uint32_t req;
     uint32_t flags;
@@ -176,7 +249,7 @@ struct vhost_user_msg_hdr {
 union vhost_user_msg_payload {
     /*
      * VHOST_USER_GET_QUEUE_NUM, VHOST_USER_GET_PROTOCOL_FEATURES,
-     * VHOST_USER_GET_FEATURES,
+     * VHOST_USER_GET_FEATURES, VHOST_USER_GET_MAX_MEM_SLOTS,
      * VHOST_USER_SET_VRING_KICK, VHOST_USER_SET_VRING_CALL
      */
     uint64_t u64;
@@ -184,6 +257,8 @@ union vhost_user_msg_payload {
     struct vhost_user_config_space config;
     /* VHOST_USER_SET_MEM_TABLE */
     struct vhost_user_mem_desc mem_desc;
+    /* VHOST_USER_ADD_MEM_REG, VHOST_USER_REM_MEM_REG */
+    struct vhost_user_mem_reg mem_reg;
     /*
      * VHOST_USER_GET_VRING_BASE, VHOST_USER_SET_VRING_BASE,
      * VHOST_USER_SET_VRING_NUM
@@ -195,6 +270,8 @@ union vhost_user_msg_payload {
     struct vhost_user_inflight_desc inflight_desc;
     /* VHOST_USER_SET_LOG_BASE */
     struct vhost_user_log log;
+    /* VHOST_USER_SLAVE_FS_MAP, VHOST_USER_SLAVE_FS_UNMAP */
+    struct vhost_user_fs_slave_msg fs_slave;
 };
 
 #ifdef __cplusplus
@@ -1,29 +1,232 @@
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
-#include <alloca.h>
 #include <sys/eventfd.h>
-#include <time.h>
 #include <inttypes.h>
 
 #include "catomic.h"
+#include "event.h"
+#include "queue.h"
 #include "virt_queue.h"
 #include "logging.h"
 #include "memmap.h"
-#include "memlog.h"
+#include "trace.h"
 
 /**
  * Holds private virtq data together with iovs we show users
  */
 struct virtq_iov_private {
+    /* Pool the object belongs to, NULL if allocated individually */
+    struct virtq_req_pool *pool;
+    SLIST_ENTRY(virtq_iov_private) free_link;
+    /* in struct virtq_burst while handed out by virtq_dequeue_burst() */
+    STAILQ_ENTRY(virtq_iov_private) burst_link;
+
     /* Private virtq fields */
     uint16_t used_head;
-    struct vhd_memory_map *mm;
+    /* packed ring: #descriptors the buffer took in the ring, inflight entry */
+    uint16_t used_descs;
+    uint16_t inflight_idx;
+    struct virtq_mm_gen *mm_gen;
+    /* room for buffers in @iov, and their guest physical addresses */
+    uint16_t max_buffers;
+    uint64_t *gpas;
+
+    /* Device-specific per-request data */
+    char priv[VIRTIO_IOV_PRIV_SIZE] __attribute__((aligned));
 
     /* Iov we show to caller */
     struct virtio_iov iov;
 };
 
+/*
+ * Per-virtq cache of request objects.
+ *
+ * The number of requests in flight on a virtq is bounded by its size, so up to
+ * qsz objects with room for VIRTQ_REQ_INLINE_BUFFERS buffers are allocated on
+ * demand, in cache-aligned slabs, and recycled afterwards, so that the
+ * dataplane doesn't have to go to malloc in the steady state.  Longer chains
+ * are rare and are allocated individually.
+ *
+ * The pool is only accessed in the dataplane, so no locking is necessary.  It
+ * outlives the virtq until all its objects are returned.
+ */
+#define VIRTQ_REQ_INLINE_BUFFERS    16
+#define VIRTQ_REQ_SLAB_OBJS         32
+
+struct virtq_req_slab {
+    SLIST_ENTRY(virtq_req_slab) link;
+    char objs[] __attribute__((aligned(VHD_CACHELINE_SIZE)));
+};
+
+struct virtq_req_pool {
+    SLIST_HEAD(, virtq_iov_private) free_list;
+    SLIST_HEAD(, virtq_req_slab) slabs;
+
+    /* size of a pooled object, a multiple of cacheline size */
+    size_t obj_size;
+    /* #objects allocated so far and the limit */
+    uint16_t num_objs;
+    uint16_t max_objs;
+    /* #objects currently in use */
+    uint16_t num_in_use;
+
+    /* the virtq is released, free the pool once it's no longer used */
+    bool orphaned;
+};
+
+static struct virtq_req_pool *req_pool_create(uint16_t max_objs)
+{
+    struct virtq_req_pool *pool = vhd_zalloc(sizeof(*pool));
+
+    SLIST_INIT(&pool->free_list);
+    SLIST_INIT(&pool->slabs);
+    pool->obj_size = VHD_ALIGN_UP(sizeof(struct virtq_iov_private) +
+                                  VIRTQ_REQ_INLINE_BUFFERS *
+                                  (sizeof(struct vhd_buffer) +
+                                   sizeof(uint64_t)),
+                                  VHD_CACHELINE_SIZE);
+    pool->max_objs = max_objs;
+    return pool;
+}
+
+static void req_pool_free(struct virtq_req_pool *pool)
+{
+    while (!SLIST_EMPTY(&pool->slabs)) {
+        struct virtq_req_slab *slab = SLIST_FIRST(&pool->slabs);
+        SLIST_REMOVE_HEAD(&pool->slabs, link);
+        vhd_free(slab);
+    }
+
+    vhd_free(pool);
+}
+
+static void req_pool_release(struct virtq_req_pool *pool)
+{
+    if (!pool->num_in_use) {
+        req_pool_free(pool);
+    } else {
+        pool->orphaned = true;
+    }
+}
+
+static bool req_pool_grow(struct virtq_req_pool *pool)
+{
+    uint16_t i, nobjs = MIN(pool->max_objs - pool->num_objs,
+                            VIRTQ_REQ_SLAB_OBJS);
+    struct virtq_req_slab *slab;
+
+    if (!nobjs) {
+        return false;
+    }
+
+    slab = vhd_aligned_alloc(VHD_CACHELINE_SIZE,
+                             sizeof(*slab) + nobjs * pool->obj_size);
+    SLIST_INSERT_HEAD(&pool->slabs, slab, link);
+
+    for (i = 0; i < nobjs; i++) {
+        struct virtq_iov_private *priv =
+            (struct virtq_iov_private *)(slab->objs + i * pool->obj_size);
+        priv->pool = pool;
+        SLIST_INSERT_HEAD(&pool->free_list, priv, free_link);
+    }
+
+    pool->num_objs += nobjs;
+    return true;
+}
+
+static struct virtq_iov_private *req_pool_get(struct virtq_req_pool *pool)
+{
+    struct virtq_iov_private *priv = SLIST_FIRST(&pool->free_list);
+
+    if (unlikely(!priv)) {
+        if (!req_pool_grow(pool)) {
+            return NULL;
+        }
+        priv = SLIST_FIRST(&pool->free_list);
+    }
+
+    SLIST_REMOVE_HEAD(&pool->free_list, free_link);
+    pool->num_in_use++;
+    return priv;
+}
+
+static void req_pool_put(struct virtq_req_pool *pool,
+                         struct virtq_iov_private *priv)
+{
+    VHD_ASSERT(pool->num_in_use);
+    pool->num_in_use--;
+
+    if (unlikely(pool->orphaned)) {
+        if (!pool->num_in_use) {
+            req_pool_free(pool);
+        }
+        return;
+    }
+
+    SLIST_INSERT_HEAD(&pool->free_list, priv, free_link);
+}
+
+/*
+ * Memory map generation of a virtq.
+ *
+ * The guest buffers of a request must stay mapped until it's released, so
+ * the memory map the request is translated with can only go once the
+ * requests handed out with it do.  Rather than referencing the memory map
+ * per request, the virtq takes a single reference per memory map it uses and
+ * counts the requests in use with it; once the virtq moves on to another
+ * memory map, the old generation is dropped along with the reference as soon
+ * as its last request is released.
+ *
+ * Only accessed in the dataplane, where the requests are released too, so no
+ * atomics are necessary.  It outlives the virtq until all its requests are
+ * released.
+ */
+struct virtq_mm_gen {
+    struct vhd_memory_map *mm;
+    /* #requests handed out in this generation and not released yet */
+    uint32_t num_in_use;
+    /* the virtq has moved on to another memory map or is released */
+    bool retired;
+};
+
+static void mm_gen_free(struct virtq_mm_gen *gen)
+{
+    vhd_memmap_unref(gen->mm);
+    vhd_free(gen);
+}
+
+static void mm_gen_retire(struct virtq_mm_gen *gen)
+{
+    if (!gen->num_in_use) {
+        mm_gen_free(gen);
+    } else {
+        gen->retired = true;
+    }
+}
+
+static void mm_gen_put(struct virtq_mm_gen *gen)
+{
+    VHD_ASSERT(gen->num_in_use);
+    if (!--gen->num_in_use && unlikely(gen->retired)) {
+        mm_gen_free(gen);
+    }
+}
+
+/* Start a new generation as the virtq has moved on to another memory map */
+static void virtq_switch_mm_gen(struct virtio_virtq *vq)
+{
+    struct virtq_mm_gen *gen = vhd_zalloc(sizeof(*gen));
+
+    gen->mm = vq->mm;
+    vhd_memmap_ref(gen->mm);
+
+    if (vq->mm_gen) {
+        mm_gen_retire(vq->mm_gen);
+    }
+    vq->mm_gen = gen;
+}
+
 static inline uint16_t virtq_get_used_event(struct virtio_virtq *vq)
 {
     return vq->avail->ring[vq->qsz];
@@ -35,28 +238,143 @@ static inline void virtq_set_avail_event(struct virtio_virtq *vq,
     *(le16 *)&vq->used->ring[vq->qsz] = avail_idx;
 }
 
+/*
+ * Packed ring accessors.  The descriptor ring replaces both the descriptor
+ * table and the avail and used rings of a split virtqueue, so the pointers to
+ * those are reused for the packed ring and the event suppression areas.
+ */
+static inline struct pvirtq_desc *packed_desc(struct virtio_virtq *vq,
+                                              uint16_t idx)
+{
+    return &((struct pvirtq_desc *)vq->desc)[idx];
+}
+
+static inline struct pvirtq_event_suppress *driver_event(
+    struct virtio_virtq *vq)
+{
+    return (struct pvirtq_event_suppress *)vq->avail;
+}
+
+static inline struct pvirtq_event_suppress *device_event(
+    struct virtio_virtq *vq)
+{
+    return (struct pvirtq_event_suppress *)vq->used;
+}
+
+/*
+ * Virtio specification v1.1, 2.7.1: a descriptor is available when its AVAIL
+ * flag matches the wrap counter and its USED flag doesn't, and used when both
+ * match the wrap counter.
+ */
+static inline bool packed_desc_is_avail(struct virtio_virtq *vq, uint16_t idx,
+                                        bool wrap_counter)
+{
+    uint16_t flags = packed_desc(vq, idx)->flags;
+    return !!(flags & VIRTQ_DESC_F_AVAIL) == wrap_counter &&
+        !!(flags & VIRTQ_DESC_F_USED) != wrap_counter;
+}
+
+static inline bool packed_desc_is_used(struct virtio_virtq *vq, uint16_t idx,
+                                       bool wrap_counter)
+{
+    uint16_t flags = packed_desc(vq, idx)->flags;
+    return !!(flags & VIRTQ_DESC_F_AVAIL) == wrap_counter &&
+        !!(flags & VIRTQ_DESC_F_USED) == wrap_counter;
+}
+
+static inline uint16_t packed_used_flags(bool wrap_counter)
+{
+    return wrap_counter ? VIRTQ_DESC_F_AVAIL | VIRTQ_DESC_F_USED : 0;
+}
+
+/* Move position @idx in the packed ring @n <= qsz descriptors forward */
+static inline void packed_advance(struct virtio_virtq *vq, uint16_t *idx,
+                                  bool *wrap_counter, uint16_t n)
+{
+    *idx += n;
+    if (*idx >= vq->qsz) {
+        *idx -= vq->qsz;
+        *wrap_counter = !*wrap_counter;
+    }
+}
+
 static int virtq_dequeue_one(struct virtio_virtq *vq, uint16_t head,
                              virtq_handle_buffers_cb handle_buffers_cb,
                              void *arg, bool resubmit);
+static int dequeue_many_packed(struct virtio_virtq *vq,
+                               virtq_handle_buffers_cb handle_buffers_cb,
+                               void *arg);
+static int dequeue_inflight_packed(struct virtio_virtq *vq, uint16_t head,
+                                   virtq_handle_buffers_cb handle_buffers_cb,
+                                   void *arg);
+static void virtq_inflight_packed_reconnect_update(struct virtio_virtq *vq);
 
-static struct virtq_iov_private *alloc_iov(uint16_t nvecs)
+/* Allocate an empty request object with room for @max_buffers buffers */
+static struct virtq_iov_private *alloc_iov(struct virtio_virtq *vq,
+                                           uint16_t max_buffers)
 {
-    size_t size = sizeof(struct virtq_iov_private)
-                + sizeof(struct vhd_buffer) * nvecs;
+    struct virtq_iov_private *priv = NULL;
 
-    struct virtq_iov_private *priv = vhd_alloc(size);
-    priv->iov.nvecs = nvecs;
+    if (likely(max_buffers <= VIRTQ_REQ_INLINE_BUFFERS)) {
+        priv = req_pool_get(vq->req_pool);
+        max_buffers = VIRTQ_REQ_INLINE_BUFFERS;
+    }
+
+    if (unlikely(!priv)) {
+        size_t size = sizeof(struct virtq_iov_private)
+                    + (sizeof(struct vhd_buffer) + sizeof(uint64_t)) *
+                    max_buffers;
+        priv = vhd_aligned_alloc(VHD_CACHELINE_SIZE, size);
+        priv->pool = NULL;
+    }
+
+    priv->max_buffers = max_buffers;
+    priv->gpas = (uint64_t *)&priv->iov.buffers[max_buffers];
+    priv->iov.nvecs = 0;
     return priv;
 }
 
+static void free_iov(struct virtq_iov_private *priv)
+{
+    if (likely(priv->pool)) {
+        req_pool_put(priv->pool, priv);
+    } else {
+        vhd_free(priv);
+    }
+}
+
 void virtio_free_iov(struct virtio_iov *iov)
 {
     struct virtq_iov_private *priv =
         containerof(iov, struct virtq_iov_private, iov);
 
-    /* matched with ref in virtq_dequeue_one */
-    vhd_memmap_unref(priv->mm);
-    vhd_free(priv);
+    /* matched with take_iov */
+    mm_gen_put(priv->mm_gen);
+    free_iov(priv);
+}
+
+void *virtio_iov_get_priv(struct virtio_iov *iov)
+{
+    struct virtq_iov_private *priv =
+        containerof(iov, struct virtq_iov_private, iov);
+    return priv->priv;
+}
+
+/*
+ * Pass a buffer taken off the ring to the handler, or queue it in the burst
+ * @arg if there's none
+ */
+static inline void hand_iov(struct virtio_virtq *vq,
+                            virtq_handle_buffers_cb handle_buffers_cb,
+                            void *arg, struct virtq_iov_private *priv)
+{
+    if (!handle_buffers_cb) {
+        struct virtq_burst *burst = arg;
+        STAILQ_INSERT_TAIL(&burst->iovs, priv, burst_link);
+        return;
+    }
+
+    handle_buffers_cb(arg, vq, &priv->iov);
 }
 
 uint16_t virtio_iov_get_head(struct virtio_iov *iov)
@@ -66,35 +384,224 @@ uint16_t virtio_iov_get_head(struct virtio_iov *iov)
     return priv->used_head;
 }
 
-static int add_buffer(struct virtio_virtq *vq, void *addr, size_t len,
-                      bool write_only)
+/* Start walking a new descriptor chain into @vq->cur_req */
+static void start_chain(struct virtio_virtq *vq)
 {
-    if (vq->next_buffer == vq->max_chain_len) {
-        VHD_OBJ_ERROR(vq, "descriptor chain exceeds max length %u",
-                      vq->max_chain_len);
-        return -ENOBUFS;
+    vq->next_desc = 0;
+
+    if (likely(!vq->cur_req)) {
+        vq->cur_req = alloc_iov(vq, VIRTQ_REQ_INLINE_BUFFERS);
+    } else {
+        vq->cur_req->iov.nvecs = 0;
+    }
+}
+
+/*
+ * Hand the walked chain over to the caller, which will eventually release it
+ * with virtio_free_iov()
+ */
+static struct virtq_iov_private *take_iov(struct virtio_virtq *vq)
+{
+    struct virtq_iov_private *priv = vq->cur_req;
+
+    vq->cur_req = NULL;
+
+    /*
+     * The memory map is only switched by the control plane between the
+     * requests, so a check per request catches the switch.  The generation
+     * holds a reference to its memory map, so the address can't be reused by
+     * another one while compared against.
+     */
+    if (unlikely(!vq->mm_gen || vq->mm_gen->mm != vq->mm)) {
+        virtq_switch_mm_gen(vq);
+    }
+    /* matched with virtio_free_iov */
+    priv->mm_gen = vq->mm_gen;
+    priv->mm_gen->num_in_use++;
+    return priv;
+}
+
+/*
+ * Move the chain being walked to a request object with room for @max_buffers
+ * buffers
+ */
+static struct virtq_iov_private *grow_iov(struct virtio_virtq *vq,
+                                          uint32_t max_buffers)
+{
+    struct virtq_iov_private *old = vq->cur_req;
+    uint16_t nvecs = old->iov.nvecs;
+    struct virtq_iov_private *priv =
+        alloc_iov(vq, MIN(max_buffers, UINT16_MAX));
+
+    memcpy(priv->iov.buffers, old->iov.buffers,
+           nvecs * sizeof(old->iov.buffers[0]));
+    memcpy(priv->gpas, old->gpas, nvecs * sizeof(old->gpas[0]));
+    priv->iov.nvecs = nvecs;
+
+    free_iov(old);
+    vq->cur_req = priv;
+    return priv;
+}
+
+/*
+ * Make room for @n more buffers in the chain being walked at once, rather
+ * than growing it step by step as they're added
+ */
+static void reserve_iov(struct virtio_virtq *vq, uint32_t n)
+{
+    struct virtq_iov_private *priv = vq->cur_req;
+
+    if (priv->iov.nvecs + n > priv->max_buffers &&
+        priv->max_buffers < UINT16_MAX) {
+        grow_iov(vq, priv->iov.nvecs + n);
+    }
+}
+
+static int add_buffer(struct virtio_virtq *vq, void *addr, uint64_t gpa,
+                      size_t len, bool write_only, uint32_t region_id,
+                      uint64_t region_offset)
+{
+    struct virtq_iov_private *priv = vq->cur_req;
+    uint16_t n = priv->iov.nvecs;
+
+    if (unlikely(n == priv->max_buffers)) {
+        if (n == UINT16_MAX) {
+            VHD_OBJ_ERROR(vq, "descriptor chain takes too many buffers");
+            return -ENOBUFS;
+        }
+
+        priv = grow_iov(vq, 2 * (uint32_t)priv->max_buffers);
     }
 
-    vq->buffers[vq->next_buffer] = (struct vhd_buffer) {
+    priv->iov.buffers[n] = (struct vhd_buffer) {
         .base = addr,
         .len = len,
         .write_only = write_only,
+        .region_id = region_id,
+        .region_offset = region_offset,
     };
+    priv->gpas[n] = gpa;
 
-    vq->next_buffer++;
+    priv->iov.nvecs = n + 1;
     return 0;
 }
 
+/*
+ * Map a descriptor and push it onto @vq->cur_req.  A descriptor crossing guest
+ * memory region boundaries is split into one buffer per region.
+ */
 static int map_buffer(struct virtio_virtq *vq, uint64_t gpa, size_t len,
                       bool write_only)
 {
-    void *addr = gpa_range_to_ptr(vq->mm, gpa, len);
-    if (!addr) {
-        VHD_OBJ_ERROR(vq, "Failed to map GPA 0x%" PRIx64 ", +0x%zx", gpa, len);
-        return -EFAULT;
+    if (vq->next_desc == vq->max_chain_len) {
+        VHD_OBJ_ERROR(vq, "descriptor chain exceeds max length %u",
+                      vq->max_chain_len);
+        return -ENOBUFS;
+    }
+    vq->next_desc++;
+
+    do {
+        size_t chunk = len;
+        uint32_t region_id;
+        uint64_t region_offset;
+        int res;
+
+        void *addr = gpa_to_ptr_partial(vq->mm, gpa, &chunk, &vq->mm_hint,
+                                        &region_id, &region_offset);
+        if (!addr) {
+            VHD_OBJ_ERROR(vq, "Failed to map GPA 0x%" PRIx64 ", +0x%zx",
+                          gpa, len);
+            return -EFAULT;
+        }
+
+        res = add_buffer(vq, addr, gpa, chunk, write_only, region_id,
+                         region_offset);
+        if (res != 0) {
+            return res;
+        }
+
+        gpa += chunk;
+        len -= chunk;
+    } while (len);
+
+    return 0;
+}
+
+/*
+ * Indirect tables are walked in bulk: runs of descriptors following each
+ * other in the table and contiguous in guest physical memory (which is common
+ * with the guest buffers backed by huge pages) are collected and translated
+ * at once.
+ */
+#define DESC_RUN_MAX            32
+/* indirect table bytes prefetched before walking; further ahead is useless */
+#define DESC_PREFETCH_MAX       4096
+
+struct desc_seg {
+    uint64_t addr;
+    uint32_t len;
+};
+
+static void prefetch_table(const void *table, size_t len)
+{
+    size_t off;
+
+    len = MIN(len, DESC_PREFETCH_MAX);
+    for (off = 0; off < len; off += VHD_CACHELINE_SIZE) {
+        __builtin_prefetch((const char *)table + off);
+    }
+}
+
+/* Check if a descriptor at @addr, of the same direction, continues @prev */
+static inline bool desc_run_continues(const struct desc_seg *prev,
+                                      uint64_t addr)
+{
+    return prev->len && addr == prev->addr + prev->len && addr > prev->addr;
+}
+
+/*
+ * Map a run of @n descriptors contiguous in guest physical memory, with a
+ * single translation as long as the run is within one memory region; the
+ * part past the region boundary, if any, is mapped descriptor by descriptor.
+ */
+static int map_desc_run(struct virtio_virtq *vq, const struct desc_seg *run,
+                        uint16_t n, bool write_only)
+{
+    uint64_t gpa = run[0].addr;
+    size_t len = run[n - 1].addr + run[n - 1].len - gpa;
+    uint32_t region_id;
+    uint64_t region_offset;
+    void *ptr = gpa_to_ptr_partial(vq->mm, gpa, &len, &vq->mm_hint,
+                                   &region_id, &region_offset);
+    uint16_t i;
+    int res;
+
+    for (i = 0; i < n; i++) {
+        size_t off = run[i].addr - gpa;
+
+        if (unlikely(!ptr || off + run[i].len > len)) {
+            res = map_buffer(vq, run[i].addr, run[i].len, write_only);
+            if (res != 0) {
+                return res;
+            }
+            continue;
+        }
+
+        if (vq->next_desc == vq->max_chain_len) {
+            VHD_OBJ_ERROR(vq, "descriptor chain exceeds max length %u",
+                          vq->max_chain_len);
+            return -ENOBUFS;
+        }
+        vq->next_desc++;
+
+        res = add_buffer(vq, ptr + off, run[i].addr, run[i].len, write_only,
+                         region_id, region_offset + off);
+        if (res != 0) {
+            return res;
+        }
     }
 
-    return add_buffer(vq, addr, len, write_only);
+    return 0;
 }
 
 /* Modify inflight descriptor after dequeue request from the available ring. */
@@ -140,18 +647,26 @@ static void virtq_inflight_used_update(struct virtio_virtq *vq, uint16_t head)
 }
 
 /* Post commit inflight descriptor handling. */
-static void virtq_inflight_used_commit(struct virtio_virtq *vq, uint16_t head)
+static void virtq_inflight_used_commit(struct virtio_virtq *vq,
+                                       uint16_t old_idx, uint16_t new_idx)
 {
+    uint16_t i;
+
     if (!vq->inflight_region) {
         return;
     }
 
-    if (vq->inflight_region->desc[head].inflight != 1) {
-        VHD_OBJ_WARN(vq, "inflight[%u]=%u (expected 1)", head,
-                     vq->inflight_region->desc[head].inflight);
+    for (i = old_idx; i != new_idx; i++) {
+        uint16_t head = vq->used->ring[i % vq->qsz].id;
+
+        if (vq->inflight_region->desc[head].inflight != 1) {
+            VHD_OBJ_WARN(vq, "inflight[%u]=%u (expected 1)", head,
+                         vq->inflight_region->desc[head].inflight);
+        }
+
+        vq->inflight_region->desc[head].inflight = 0;
     }
 
-    vq->inflight_region->desc[head].inflight = 0;
     /*
      * Make sure used_idx is stored after the desc content, so that the next
      * incarnation of the vhost backend sees consistent values regardless of
@@ -159,7 +674,7 @@ static void virtq_inflight_used_commit(struct virtio_virtq *vq, uint16_t head)
      * inflight region so only a compiler barrier is necessary.
      */
     barrier();
-    vq->inflight_region->used_idx = vq->used->idx;
+    vq->inflight_region->used_idx = new_idx;
 }
 
 /*
@@ -195,9 +710,7 @@ static void virtq_inflight_reconnect_update(struct virtio_virtq *vq)
         goto out;
     }
 
-    /* we don't do batching for now */
-    VHD_ASSERT(batch_size == 1);
-
+    /* the last batch is linked via ->next starting from last_batch_head */
     idx = vq->inflight_region->last_batch_head;
     while (batch_size) {
         vq->inflight_region->desc[idx].inflight = 0;
@@ -210,6 +723,64 @@ out:
     vq->inflight_region->used_idx = vq->used->idx;
 }
 
+#define RESUBMIT_MAP_WORDS(desc_num) (((desc_num) + 63u) / 64)
+
+static uint16_t inflight_desc_num(struct virtio_virtq *vq)
+{
+    if (vq->packed) {
+        return vq->inflight_packed ? vq->inflight_packed->desc_num : 0;
+    }
+    return vq->inflight_region ? vq->inflight_region->desc_num : 0;
+}
+
+static bool inflight_desc_inflight(struct virtio_virtq *vq, uint16_t idx)
+{
+    return vq->packed ? vq->inflight_packed->desc[idx].inflight :
+        vq->inflight_region->desc[idx].inflight;
+}
+
+static uint64_t inflight_counter(struct virtio_virtq *vq, uint16_t idx)
+{
+    return vq->packed ? vq->inflight_packed->desc[idx].counter :
+        vq->inflight_region->desc[idx].counter;
+}
+
+/* Record the requests left in flight by the previous user of the virtq */
+static void virtq_inflight_collect(struct virtio_virtq *vq)
+{
+    uint16_t desc_num = inflight_desc_num(vq);
+    uint16_t idx;
+
+    for (idx = 0; idx < desc_num; idx++) {
+        if (!inflight_desc_inflight(vq, idx)) {
+            continue;
+        }
+
+        if (!vq->resubmit_map) {
+            vq->resubmit_map = vhd_calloc(RESUBMIT_MAP_WORDS(desc_num),
+                                          sizeof(vq->resubmit_map[0]));
+        }
+        vq->resubmit_map[idx / 64] |= 1ull << (idx % 64);
+        vq->num_resubmit++;
+    }
+
+    if (!vq->num_resubmit) {
+        return;
+    }
+
+    VHD_OBJ_DEBUG(vq, "%u inflight requests to resubmit", vq->num_resubmit);
+
+    /*
+     * The avail ring position comes at the used one, skip the entries still
+     * in flight for the new requests to be fetched along with the resubmitted
+     * ones (the packed ring position is restored from the inflight region
+     * already)
+     */
+    if (!vq->packed) {
+        vq->last_avail += vq->num_resubmit;
+    }
+}
+
 static void virtio_virtq_reset_stat(struct virtio_virtq *vq)
 {
     memset(&vq->stat, 0, sizeof(vq->stat));
@@ -223,88 +794,110 @@ static void virtio_virtq_reset_stat(struct virtio_virtq *vq)
 
 void virtio_virtq_init(struct virtio_virtq *vq)
 {
-    VHD_ASSERT(!vq->buffers);
+    VHD_ASSERT(!vq->req_pool);
 
     vq->max_chain_len = MAX(vq->qsz, WINDOWS_CHAIN_LEN_MAX);
 
-    vq->buffers = vhd_calloc(vq->max_chain_len, sizeof(vq->buffers[0]));
+    vq->req_pool = req_pool_create(vq->qsz);
 
-    /* Make check on the first virtq dequeue. */
-    vq->inflight_check = true;
-    virtq_inflight_reconnect_update(vq);
+    if (vq->packed) {
+        virtq_inflight_packed_reconnect_update(vq);
+    } else {
+        virtq_inflight_reconnect_update(vq);
+    }
+    virtq_inflight_collect(vq);
 
     virtio_virtq_reset_stat(vq);
 }
 
 void virtio_virtq_release(struct virtio_virtq *vq)
 {
-    VHD_ASSERT(vq->buffers);
-    vhd_free(vq->buffers);
+    VHD_ASSERT(vq->req_pool);
+    if (vq->cur_req) {
+        free_iov(vq->cur_req);
+    }
+    req_pool_release(vq->req_pool);
+    if (vq->mm_gen) {
+        mm_gen_retire(vq->mm_gen);
+    }
+    vhd_free(vq->resubmit_map);
     *vq = (struct virtio_virtq) {};
 }
 
-struct inflight_resubmit {
-    uint64_t counter;
-    uint16_t head;
-};
-
-static int inflight_resubmit_compare(const void *first, const void *second)
+/*
+ * Resubmit the oldest VIRTQ_RESUBMIT_BATCH requests of those found in flight
+ * on start: the set bits of the map are walked once, keeping the entries with
+ * the lowest counters sorted by insertion, as they have to be resubmitted in
+ * the order they were fetched from the ring.
+ */
+static int virtq_inflight_resubmit(struct virtio_virtq *vq,
+                                   virtq_handle_buffers_cb handle_buffers_cb,
+                                   void *arg)
 {
-    struct inflight_resubmit *left = (struct inflight_resubmit *)first;
-    struct inflight_resubmit *right = (struct inflight_resubmit *)second;
+    uint16_t heads[VIRTQ_RESUBMIT_BATCH];
+    uint64_t counters[VIRTQ_RESUBMIT_BATCH];
+    uint16_t desc_num = inflight_desc_num(vq);
+    unsigned num = 0;
+    unsigned i, w;
+    int res = 0;
+
+    for (w = 0; w < RESUBMIT_MAP_WORDS(desc_num); w++) {
+        uint64_t bits = vq->resubmit_map[w];
+
+        while (bits) {
+            uint16_t idx = w * 64 + vhd_find_first_bit64(bits);
+            uint64_t counter = inflight_counter(vq, idx);
+            unsigned pos;
+
+            bits &= bits - 1;
+
+            if (num == VIRTQ_RESUBMIT_BATCH) {
+                if (counter > counters[num - 1]) {
+                    continue;
+                }
+                /* the newest one picked so far gets pushed out */
+                pos = num - 1;
+            } else {
+                pos = num++;
+            }
 
-    if (left->counter < right->counter) {
-        return -1;
+            for (; pos && counters[pos - 1] > counter; pos--) {
+                counters[pos] = counters[pos - 1];
+                heads[pos] = heads[pos - 1];
+            }
+            counters[pos] = counter;
+            heads[pos] = idx;
+        }
     }
-    /* Can't return 0, since counter values are always different. */
-
-    return 1;
-}
 
-/* Resubmit inflight requests on the virtqueue start. */
-static int virtq_inflight_resubmit(struct virtio_virtq *vq,
-                                   virtq_handle_buffers_cb handle_buffers_cb,
-                                   void *arg)
-{
-    uint16_t desc_num;
-    uint16_t cnt;
-    struct inflight_resubmit *resubmit_array;
-    uint16_t i;
-    int res;
+    VHD_OBJ_DEBUG(vq, "resubmitting %u of %u inflight requests", num,
+                  vq->num_resubmit);
 
-    if (!vq->inflight_region) {
-        return 0;
-    }
+    for (i = 0; i < num; i++) {
+        uint16_t head = heads[i];
 
-    desc_num = vq->inflight_region->desc_num;
-    cnt = 0;
-    resubmit_array = alloca(sizeof(*resubmit_array) * desc_num);
-    for (i = 0; i < desc_num; i++) {
-        if (vq->inflight_region->desc[i].inflight) {
-            resubmit_array[cnt].counter = vq->inflight_region->desc[i].counter;
-            resubmit_array[cnt].head = i;
-            cnt++;
-        }
-    }
-    qsort(resubmit_array, cnt, sizeof(*resubmit_array),
-            inflight_resubmit_compare);
+        vq->resubmit_map[head / 64] &= ~(1ull << (head % 64));
+        vq->num_resubmit--;
 
-    res = 0;
-    VHD_OBJ_DEBUG(vq, "cnt = %d inflight requests should be resubmitted", cnt);
-    for (i = 0; i < cnt; i++) {
-        uint16_t head = resubmit_array[i].head;
-        if (head >= vq->qsz) {
+        if (vq->packed) {
+            res = dequeue_inflight_packed(vq, head, handle_buffers_cb, arg);
+        } else if (head >= vq->qsz) {
             VHD_OBJ_ERROR(vq, "resubmit desc %u: head %u past queue size %u",
                           i, head, vq->qsz);
-            return -ERANGE;
+            res = -ERANGE;
+        } else {
+            res = virtq_dequeue_one(vq, head, handle_buffers_cb, arg, true);
         }
-
-        res = virtq_dequeue_one(vq, head, handle_buffers_cb, arg, true);
         if (res) {
             break;
         }
     }
 
+    if (!vq->num_resubmit) {
+        vhd_free(vq->resubmit_map);
+        vq->resubmit_map = NULL;
+    }
+
     return res;
 }
 
@@ -338,7 +931,8 @@ static int walk_indirect_table(struct virtio_virtq *vq,
         return -EINVAL;
     }
 
-    desc_table = gpa_range_to_ptr(vq->mm, table_desc->addr, table_desc->len);
+    desc_table = gpa_range_to_ptr(vq->mm, table_desc->addr, table_desc->len,
+                                  &vq->mm_hint);
     if (!desc_table) {
         VHD_OBJ_ERROR(vq, "Failed to map indirect descriptor table "
                       "GPA 0x%" PRIx64 ", +0x%x",
@@ -346,19 +940,48 @@ static int walk_indirect_table(struct virtio_virtq *vq,
         return -EFAULT;
     }
 
+    prefetch_table(desc_table, table_desc->len);
+    /* each descriptor takes at least one buffer, up to the chain limit */
+    reserve_iov(vq, MIN(table_len, vq->max_chain_len - vq->next_desc));
+
     for (idx = 0; ; idx = desc.next) {
+        struct desc_seg run[DESC_RUN_MAX];
+        uint16_t n = 0;
+        bool write_only;
+
         desc = desc_table[idx];
 
         if (desc.flags & VIRTQ_DESC_F_INDIRECT) {
             DESCRIPTOR_ERROR(vq, idx, &desc, "nested indirect descriptor");
             return -EMLINK;
         }
+        write_only = desc.flags & VIRTQ_DESC_F_WRITE;
 
-        res = map_buffer(vq, desc.addr, desc.len,
-                         desc.flags & VIRTQ_DESC_F_WRITE);
+        /* collect the run of the descriptors continuing this one */
+        while (true) {
+            struct virtq_desc next;
+
+            run[n++] = (struct desc_seg) { desc.addr, desc.len };
+            if (n == DESC_RUN_MAX || !(desc.flags & VIRTQ_DESC_F_NEXT) ||
+                desc.next != idx + 1 || desc.next >= table_len) {
+                break;
+            }
+
+            next = desc_table[desc.next];
+            if ((next.flags & VIRTQ_DESC_F_INDIRECT) ||
+                !!(next.flags & VIRTQ_DESC_F_WRITE) != write_only ||
+                !desc_run_continues(&run[n - 1], next.addr)) {
+                break;
+            }
+
+            idx = desc.next;
+            desc = next;
+        }
+
+        res = map_desc_run(vq, run, n, write_only);
         if (res != 0) {
             DESCRIPTOR_ERROR(vq, idx, &desc,
-                             "failed to map descriptor in indirect table");
+                             "failed to map descriptors in indirect table");
             return res;
         }
 
@@ -379,7 +1002,7 @@ static int walk_indirect_table(struct virtio_virtq *vq,
 
 /*
  * Traverse a descriptor chain starting at @head, mapping the descriptors found
- * and pushing them onto @vq->buffers.
+ * and pushing them onto @vq->cur_req.
  * Return the number of descriptors consumed, or -errno.
  */
 static int walk_chain(struct virtio_virtq *vq, uint16_t head)
@@ -389,7 +1012,7 @@ static int walk_chain(struct virtio_virtq *vq, uint16_t head)
     struct virtq_desc desc;
     int res;
 
-    vq->next_buffer = 0;
+    start_chain(vq);
 
     for (idx = head, chain_len = 1; ; idx = desc.next, chain_len++) {
         desc = vq->desc[idx];
@@ -432,42 +1055,43 @@ static int walk_chain(struct virtio_virtq *vq, uint16_t head)
     return chain_len;
 }
 
-int virtq_dequeue_many(struct virtio_virtq *vq,
-                       virtq_handle_buffers_cb handle_buffers_cb,
-                       void *arg)
+static int dequeue_many(struct virtio_virtq *vq,
+                        virtq_handle_buffers_cb handle_buffers_cb,
+                        void *arg)
 {
     int res;
     uint16_t i;
     uint16_t num_avail;
     uint16_t avail, avail2;
-    time_t now;
+    uint64_t now;
 
     if (virtq_is_broken(vq)) {
         VHD_OBJ_ERROR(vq, "virtqueue is broken, cannot process");
         return -ENODEV;
     }
 
-    if (vq->inflight_check) {
-        /* Check for the inflight requests once at the start. */
-        VHD_OBJ_DEBUG(vq, "resubmit inflight requests, if any");
+    if (vq->num_resubmit) {
         res = virtq_inflight_resubmit(vq, handle_buffers_cb, arg);
         if (res) {
             goto queue_broken;
         }
-        vq->inflight_check = false;
     }
 
-    now = time(NULL);
+    now = vhd_time_ns();
 
-    if (now - vq->stat.period_start_ts > 60) {
+    if (now - vq->stat.period_start_ts > VIRTQ_STAT_PERIOD_NS) {
         vq->stat.period_start_ts = now;
         vq->stat.metrics.queue_len_max_60s = 0;
     }
 
     vq->stat.metrics.dispatch_total++;
 
+    if (vq->packed) {
+        return dequeue_many_packed(vq, handle_buffers_cb, arg);
+    }
+
     avail = vq->avail->idx;
-    if (vq->has_event_idx) {
+    if (vq->has_event_idx && !vq->notification_disabled) {
         smp_mb(); /* avail->idx read followed by avail_event write */
         while (true) {
             virtq_set_avail_event(vq, avail);
@@ -488,6 +1112,10 @@ int virtq_dequeue_many(struct virtio_virtq *vq,
         return -EOVERFLOW;
     }
 
+    if (vq->max_dequeue) {
+        num_avail = MIN(num_avail, vq->max_dequeue);
+    }
+
     if (!num_avail) {
         vq->stat.metrics.dispatch_empty++;
         return 0;
@@ -528,86 +1156,674 @@ queue_broken:
     return res;
 }
 
+int virtq_dequeue_many(struct virtio_virtq *vq,
+                       virtq_handle_buffers_cb handle_buffers_cb,
+                       void *arg)
+{
+    int res;
+
+    /*
+     * Requests completed synchronously by the handler are published and
+     * notified about once per dispatch pass
+     */
+    virtq_begin_batch(vq);
+    res = dequeue_many(vq, handle_buffers_cb, arg);
+    virtq_commit_batch(vq);
+
+    return res;
+}
+
+int virtq_dequeue_burst(struct virtio_virtq *vq, struct virtq_burst *burst)
+{
+    STAILQ_INIT(&burst->iovs);
+    return dequeue_many(vq, NULL, burst);
+}
+
+struct virtio_iov *virtq_burst_next(struct virtq_burst *burst)
+{
+    struct virtq_iov_private *priv = STAILQ_FIRST(&burst->iovs);
+
+    if (!priv) {
+        return NULL;
+    }
+
+    STAILQ_REMOVE_HEAD(&burst->iovs, burst_link);
+    return &priv->iov;
+}
+
 static int virtq_dequeue_one(struct virtio_virtq *vq, uint16_t head,
                              virtq_handle_buffers_cb handle_buffers_cb,
                              void *arg, bool resubmit)
 {
     int ret;
 
+    struct virtq_iov_private *priv;
+
     ret = walk_chain(vq, head);
     if (ret < 0) {
         return ret;
     }
 
-    /* Create iov copy from stored buffer for client handling */
-    struct virtq_iov_private *priv = alloc_iov(vq->next_buffer);
-    memcpy(priv->iov.buffers, vq->buffers,
-           priv->iov.nvecs * sizeof(vq->buffers[0]));
+    priv = take_iov(vq);
     priv->used_head = head;
-    priv->mm = vq->mm;
-    /* matched with unref in virtio_free_iov */
-    vhd_memmap_ref(priv->mm);
 
     if (!resubmit) {
         virtq_inflight_avail_update(vq, head);
     }
 
+    vhd_trace(VHD_TRACE_VQ_DEQUEUE, vq->trace_id, priv->used_head);
+
     /* Send this over to handler */
-    handle_buffers_cb(arg, vq, &priv->iov);
+    hand_iov(vq, handle_buffers_cb, arg, priv);
 
-    vq->last_avail++;
+    /* resubmitted requests are accounted for on start */
+    if (!resubmit) {
+        vq->last_avail++;
+    }
 
     return 0;
 }
 
-static void vhd_log_buffers(struct vhd_memory_log *log,
-                            struct vhd_memory_map *mm,
-                            struct virtio_iov *iov)
+/*
+ * Packed virtqueue
+ *
+ * Inflight tracking follows the algorithm in the "Inflight I/O tracking"
+ * section of docs/vhost-user.rst: the ring descriptors of every chain are
+ * copied into entries taken off a free list threaded through the inflight
+ * region, and returned to it once the chain is used.  Unlike there, the
+ * entries of the buffers pushed in a batch are only returned to the free list
+ * on commit, so that they can't be reused for new chains before the used
+ * descriptors are exposed to the driver.
+ */
+
+/*
+ * Record ring descriptor @desc of the chain being dequeued in the inflight
+ * region; @head is set for the first descriptor of the chain.
+ */
+static int virtq_inflight_packed_avail_update(struct virtio_virtq *vq,
+                                              const struct pvirtq_desc *desc,
+                                              bool head)
 {
-    uint16_t nvecs = iov->nvecs;
-    uint16_t i;
-    for (i = 0; i < nvecs; ++i) {
-        if (iov->buffers[i].write_only) {
-            vhd_mark_range_dirty(log, mm, iov->buffers[i].base,
-                                 iov->buffers[i].len);
+    struct inflight_packed_region *ireg = vq->inflight_packed;
+    struct inflight_packed_desc *ihead;
+    uint16_t free_head;
+
+    if (!ireg) {
+        return 0;
+    }
+
+    free_head = ireg->free_head;
+    if (free_head >= ireg->desc_num) {
+        VHD_OBJ_ERROR(vq, "no free inflight entries");
+        return -ENOBUFS;
+    }
+
+    ihead = &ireg->desc[ireg->old_free_head];
+    if (head) {
+        if (ihead->inflight) {
+            VHD_OBJ_WARN(vq, "inflight[%u]=%u (expected 0)",
+                         ireg->old_free_head, ihead->inflight);
         }
+        ihead->num = 0;
+        ihead->counter = vq->req_cnt++;
+        ihead->inflight = 1;
+    }
+
+    if (!(desc->flags & VIRTQ_DESC_F_NEXT)) {
+        ihead->last = free_head;
+    }
+    ihead->num++;
+
+    ireg->desc[free_head].addr = desc->addr;
+    ireg->desc[free_head].len = desc->len;
+    ireg->desc[free_head].id = desc->id;
+    ireg->desc[free_head].flags = desc->flags;
+
+    /*
+     * Ensure the inflight region fields are updated in the expected order, so
+     * that the next incarnation of the vhost backend can recover the state
+     * regardless of where the current one dies.  There's no concurrent access
+     * to the inflight region so only a compiler barrier is necessary.
+     */
+    barrier();
+    ireg->free_head = ireg->desc[free_head].next;
+
+    if (!(desc->flags & VIRTQ_DESC_F_NEXT)) {
+        barrier();
+        ireg->old_free_head = ireg->free_head;
+    }
+
+    return 0;
+}
+
+/* Link the inflight entry @head of a pushed buffer into the current batch. */
+static void virtq_inflight_packed_used_update(struct virtio_virtq *vq,
+                                              uint16_t head)
+{
+    struct inflight_packed_region *ireg = vq->inflight_packed;
+    uint16_t last;
+
+    if (!ireg) {
+        return;
+    }
+
+    if (ireg->desc[head].inflight != 1) {
+        VHD_OBJ_WARN(vq, "inflight[%u]=%u (expected 1)", head,
+                     ireg->desc[head].inflight);
     }
+
+    last = ireg->desc[head].last;
+    if (!vq->used_pending) {
+        vq->inflight_batch_tail = last;
+    } else {
+        ireg->desc[last].next = vq->inflight_batch_head;
+    }
+    vq->inflight_batch_head = head;
 }
 
 /*
- * NOTE: this @mm is the one the request was started with, not the current one
- * on @vq
+ * Return the entries of the current batch to the free list and record the new
+ * used position, before the batch is exposed to the driver.
  */
-static void vhd_log_modified(struct virtio_virtq *vq,
-                             struct vhd_memory_map *mm,
-                             struct virtio_iov *iov,
-                             uint16_t used_idx)
+static void virtq_inflight_packed_used_prepare(struct virtio_virtq *vq)
 {
-    /* log modifications of buffers in descr */
-    vhd_log_buffers(vq->log, mm, iov);
-    if (vq->flags & VHOST_VRING_F_LOG) {
-        /* log modification of used->idx */
-        vhd_mark_gpa_range_dirty(vq->log,
-                                 vq->used_gpa_base +
-                                 offsetof(struct virtq_used, idx),
-                                 sizeof(vq->used->idx));
-        /* log modification of used->ring[idx] */
-        vhd_mark_gpa_range_dirty(vq->log,
-                                 vq->used_gpa_base +
-                                 offsetof(struct virtq_used, ring[used_idx]),
-                                 sizeof(vq->used->ring[0]));
+    struct inflight_packed_region *ireg = vq->inflight_packed;
+
+    if (!ireg) {
+        return;
+    }
+
+    ireg->desc[vq->inflight_batch_tail].next = ireg->free_head;
+    /* see comment in virtq_inflight_packed_avail_update */
+    barrier();
+    ireg->free_head = vq->inflight_batch_head;
+    barrier();
+    ireg->used_idx = vq->next_used_idx;
+    ireg->used_wrap_counter = vq->next_used_wrap_counter;
+}
+
+/* Post commit inflight entries handling. */
+static void virtq_inflight_packed_used_commit(struct virtio_virtq *vq)
+{
+    struct inflight_packed_region *ireg = vq->inflight_packed;
+    uint16_t i, idx;
+
+    if (!ireg) {
+        return;
+    }
+
+    /* see comment in virtq_inflight_packed_avail_update */
+    barrier();
+    for (i = 0, idx = vq->inflight_batch_head; i < vq->used_pending; i++) {
+        ireg->desc[idx].inflight = 0;
+        idx = ireg->desc[ireg->desc[idx].last].next;
+    }
+
+    barrier();
+    ireg->old_free_head = ireg->free_head;
+    ireg->old_used_idx = ireg->used_idx;
+    ireg->old_used_wrap_counter = ireg->used_wrap_counter;
+}
+
+/*
+ * Roll back or complete the last batch, depending on whether the backend
+ * managed to expose it to the driver before it died, and restore the ring
+ * positions from the inflight region.
+ */
+static void virtq_inflight_packed_reconnect_update(struct virtio_virtq *vq)
+{
+    struct inflight_packed_region *ireg = vq->inflight_packed;
+    uint32_t num_inflight = 0;
+    uint16_t i, idx;
+
+    vq->req_cnt = 0;
+    if (!ireg) {
+        goto out;
+    }
+
+    /* Initialize the global req counter for the inflight descriptors. */
+    for (idx = 0; idx < ireg->desc_num; idx++) {
+        if (ireg->desc[idx].counter > vq->req_cnt) {
+            vq->req_cnt = ireg->desc[idx].counter;
+        }
+    }
+
+    /* fresh inflight region (not a reconnect) */
+    if (!vq->req_cnt) {
+        ireg->used_idx = ireg->old_used_idx = vq->used_idx;
+        ireg->used_wrap_counter = vq->used_wrap_counter;
+        ireg->old_used_wrap_counter = vq->used_wrap_counter;
+        goto out_cnt;
+    }
+
+    if (ireg->used_idx != ireg->old_used_idx &&
+        ireg->old_used_idx < vq->qsz &&
+        packed_desc_is_used(vq, ireg->old_used_idx,
+                            ireg->old_used_wrap_counter)) {
+        /* the last batch was exposed to the driver, complete the commit */
+        ireg->old_free_head = ireg->free_head;
+        ireg->old_used_idx = ireg->used_idx;
+        ireg->old_used_wrap_counter = ireg->used_wrap_counter;
+    }
+
+    ireg->free_head = ireg->old_free_head;
+    ireg->used_idx = ireg->old_used_idx;
+    ireg->used_wrap_counter = ireg->old_used_wrap_counter;
+
+    /* entries on the free list are not in flight */
+    for (i = 0, idx = ireg->free_head; i < ireg->desc_num &&
+         idx < ireg->desc_num; i++, idx = ireg->desc[idx].next) {
+        ireg->desc[idx].inflight = 0;
+    }
+
+    /*
+     * The master may not know where the ring was when the previous
+     * incarnation died; every descriptor fetched from the ring has either been
+     * used or is still in flight, so the positions can be restored from here
+     */
+    for (idx = 0; idx < ireg->desc_num; idx++) {
+        if (ireg->desc[idx].inflight) {
+            num_inflight += ireg->desc[idx].num;
+        }
+    }
+
+    if (ireg->used_idx >= vq->qsz || num_inflight > vq->qsz) {
+        VHD_OBJ_WARN(vq, "inconsistent inflight region: used_idx %u, "
+                     "%u descriptors in flight", ireg->used_idx, num_inflight);
+        goto out_cnt;
+    }
+
+    vq->used_idx = ireg->used_idx;
+    vq->used_wrap_counter = ireg->used_wrap_counter;
+    vq->last_avail = vq->used_idx;
+    vq->avail_wrap_counter = vq->used_wrap_counter;
+    packed_advance(vq, &vq->last_avail, &vq->avail_wrap_counter, num_inflight);
+
+out_cnt:
+    vq->req_cnt++;
+out:
+    vq->next_used_idx = vq->used_idx;
+    vq->next_used_wrap_counter = vq->used_wrap_counter;
+}
+
+#define PACKED_DESCRIPTOR_ERROR(vq, idx, desc, fmt, ...)                \
+    VHD_OBJ_ERROR(vq, "[%u]{0x%" PRIx64 ", +0x%x, %u, 0x%x}: " fmt,     \
+                  (idx), (desc)->addr, (desc)->len,                     \
+                  (desc)->id, (desc)->flags, ##__VA_ARGS__)
+
+/*
+ * Descriptors in a packed indirect table are used sequentially, the table
+ * length determining the number of descriptors in it.
+ */
+static int walk_indirect_table_packed(struct virtio_virtq *vq,
+                                      const struct pvirtq_desc *table_desc)
+{
+    int res;
+    struct pvirtq_desc desc;
+    struct pvirtq_desc *desc_table;
+    uint16_t table_len = table_desc->len / sizeof(desc);
+    uint16_t idx;
+
+    if (table_desc->len == 0 || table_desc->len % sizeof(desc)) {
+        VHD_OBJ_ERROR(vq, "Bad indirect descriptor table length %u",
+                      table_desc->len);
+        return -EINVAL;
+    }
+
+    desc_table = gpa_range_to_ptr(vq->mm, table_desc->addr, table_desc->len,
+                                  &vq->mm_hint);
+    if (!desc_table) {
+        VHD_OBJ_ERROR(vq, "Failed to map indirect descriptor table "
+                      "GPA 0x%" PRIx64 ", +0x%x",
+                      table_desc->addr, table_desc->len);
+        return -EFAULT;
+    }
+
+    prefetch_table(desc_table, table_desc->len);
+    /* each descriptor takes at least one buffer, up to the chain limit */
+    reserve_iov(vq, MIN(table_len, vq->max_chain_len - vq->next_desc));
+
+    for (idx = 0; idx < table_len; idx++) {
+        struct desc_seg run[DESC_RUN_MAX];
+        uint16_t n = 0;
+        bool write_only;
+
+        desc = desc_table[idx];
+
+        if (desc.flags & VIRTQ_DESC_F_INDIRECT) {
+            PACKED_DESCRIPTOR_ERROR(vq, idx, &desc,
+                                    "nested indirect descriptor");
+            return -EMLINK;
+        }
+        write_only = desc.flags & VIRTQ_DESC_F_WRITE;
+
+        /* collect the run of the descriptors continuing this one */
+        while (true) {
+            struct pvirtq_desc next;
+
+            run[n++] = (struct desc_seg) { desc.addr, desc.len };
+            if (n == DESC_RUN_MAX || idx + 1 == table_len) {
+                break;
+            }
+
+            next = desc_table[idx + 1];
+            if ((next.flags & VIRTQ_DESC_F_INDIRECT) ||
+                !!(next.flags & VIRTQ_DESC_F_WRITE) != write_only ||
+                !desc_run_continues(&run[n - 1], next.addr)) {
+                break;
+            }
+
+            idx++;
+            desc = next;
+        }
+
+        res = map_desc_run(vq, run, n, write_only);
+        if (res != 0) {
+            PACKED_DESCRIPTOR_ERROR(vq, idx, &desc,
+                                    "failed to map descriptors in indirect "
+                                    "table");
+            return res;
+        }
+    }
+
+    return 0;
+}
+
+/* Map a ring descriptor and push it onto @vq->cur_req. */
+static int map_packed_desc(struct virtio_virtq *vq, uint16_t idx,
+                           const struct pvirtq_desc *desc)
+{
+    int res;
+
+    if (desc->flags & VIRTQ_DESC_F_INDIRECT) {
+        if (desc->flags & VIRTQ_DESC_F_NEXT) {
+            PACKED_DESCRIPTOR_ERROR(vq, idx, desc,
+                                    "indirect descriptor must have no next");
+            return -EINVAL;
+        }
+
+        res = walk_indirect_table_packed(vq, desc);
+        if (res != 0) {
+            PACKED_DESCRIPTOR_ERROR(vq, idx, desc,
+                                    "failed to walk indirect descriptor "
+                                    "table");
+        }
+        return res;
+    }
+
+    res = map_buffer(vq, desc->addr, desc->len,
+                     desc->flags & VIRTQ_DESC_F_WRITE);
+    if (res != 0) {
+        PACKED_DESCRIPTOR_ERROR(vq, idx, desc, "failed to map");
+    }
+    return res;
+}
+
+/*
+ * Traverse the descriptor chain starting at @vq->last_avail, mapping the
+ * descriptors found and pushing them onto @vq->cur_req, and recording them in
+ * the inflight region.  The buffer id is taken from the last descriptor.
+ * Return the number of ring descriptors consumed, or -errno.
+ */
+static int walk_chain_packed(struct virtio_virtq *vq, uint16_t *id)
+{
+    uint16_t idx = vq->last_avail;
+    uint16_t chain_len;
+    struct pvirtq_desc desc;
+    int res;
+
+    start_chain(vq);
+
+    for (chain_len = 1; ; chain_len++) {
+        desc = *packed_desc(vq, idx);
+
+        res = virtq_inflight_packed_avail_update(vq, &desc, chain_len == 1);
+        if (res != 0) {
+            return res;
+        }
+
+        res = map_packed_desc(vq, idx, &desc);
+        if (res != 0) {
+            return res;
+        }
+
+        if (!(desc.flags & VIRTQ_DESC_F_NEXT)) {
+            break;
+        }
+
+        if (chain_len == vq->qsz) {
+            PACKED_DESCRIPTOR_ERROR(vq, idx, &desc,
+                                    "chain exceeds queue size %u", vq->qsz);
+            return -ERANGE;
+        }
+
+        if (++idx == vq->qsz) {
+            idx = 0;
+        }
+    }
+
+    *id = desc.id;
+    return chain_len;
+}
+
+static int virtq_dequeue_one_packed(struct virtio_virtq *vq,
+                                    virtq_handle_buffers_cb handle_buffers_cb,
+                                    void *arg)
+{
+    struct virtq_iov_private *priv;
+    uint16_t inflight_idx = 0;
+    uint16_t id = 0;
+    int ret;
+
+    if (vq->inflight_packed) {
+        /* the chain will be recorded starting from this entry */
+        inflight_idx = vq->inflight_packed->old_free_head;
+    }
+
+    ret = walk_chain_packed(vq, &id);
+    if (ret < 0) {
+        return ret;
+    }
+
+    priv = take_iov(vq);
+    priv->used_head = id;
+    priv->used_descs = ret;
+    priv->inflight_idx = inflight_idx;
+
+    packed_advance(vq, &vq->last_avail, &vq->avail_wrap_counter, ret);
+
+    vhd_trace(VHD_TRACE_VQ_DEQUEUE, vq->trace_id, priv->used_head);
+
+    /* Send this over to handler */
+    hand_iov(vq, handle_buffers_cb, arg, priv);
+
+    return 0;
+}
+
+/* Resubmit the chain recorded in inflight entry @head */
+static int dequeue_inflight_packed(struct virtio_virtq *vq, uint16_t head,
+                                   virtq_handle_buffers_cb handle_buffers_cb,
+                                   void *arg)
+{
+    struct inflight_packed_region *ireg = vq->inflight_packed;
+    struct virtq_iov_private *priv;
+    uint16_t i, idx, num = ireg->desc[head].num;
+    int res;
+
+    if (!num || num > vq->qsz || ireg->desc[head].last >= ireg->desc_num) {
+        VHD_OBJ_ERROR(vq, "resubmit inflight[%u]: bad chain num %u last %u",
+                      head, num, ireg->desc[head].last);
+        return -ERANGE;
+    }
+
+    start_chain(vq);
+
+    for (i = 0, idx = head; i < num; i++, idx = ireg->desc[idx].next) {
+        struct pvirtq_desc desc;
+
+        if (idx >= ireg->desc_num) {
+            VHD_OBJ_ERROR(vq, "resubmit inflight[%u]: entry %u past %u",
+                          head, idx, ireg->desc_num);
+            return -ERANGE;
+        }
+
+        desc = (struct pvirtq_desc) {
+            .addr = ireg->desc[idx].addr,
+            .len = ireg->desc[idx].len,
+            .id = ireg->desc[idx].id,
+            .flags = ireg->desc[idx].flags,
+        };
+
+        res = map_packed_desc(vq, idx, &desc);
+        if (res != 0) {
+            return res;
+        }
+    }
+
+    priv = take_iov(vq);
+    priv->used_head = ireg->desc[ireg->desc[head].last].id;
+    priv->used_descs = num;
+    priv->inflight_idx = head;
+
+    vhd_trace(VHD_TRACE_VQ_DEQUEUE, vq->trace_id, priv->used_head);
+
+    /* Send this over to handler */
+    hand_iov(vq, handle_buffers_cb, arg, priv);
+
+    return 0;
+}
+
+static int dequeue_many_packed(struct virtio_virtq *vq,
+                               virtq_handle_buffers_cb handle_buffers_cb,
+                               void *arg)
+{
+    uint16_t num_avail, max_avail;
+    int res;
+
+    /* a driver can't make more than qsz chains available at a time */
+    max_avail = vq->max_dequeue ? MIN(vq->max_dequeue, vq->qsz) : vq->qsz;
+
+    for (num_avail = 0; num_avail < max_avail; num_avail++) {
+        if (!packed_desc_is_avail(vq, vq->last_avail,
+                                  vq->avail_wrap_counter)) {
+            break;
+        }
+
+        /* Make sure that further desc reads do not pass the flags read. */
+        smp_rmb();
+
+        res = virtq_dequeue_one_packed(vq, handle_buffers_cb, arg);
+        if (res) {
+            mark_broken(vq);
+            return res;
+        }
+
+        vq->stat.metrics.request_total++;
+    }
+
+    if (!num_avail) {
+        vq->stat.metrics.dispatch_empty++;
+        return 0;
+    }
+
+    vq->stat.metrics.queue_len_last = num_avail;
+    if (vq->stat.metrics.queue_len_last > vq->stat.metrics.queue_len_max_60s) {
+        vq->stat.metrics.queue_len_max_60s = vq->stat.metrics.queue_len_last;
+    }
+
+    return 0;
+}
+
+/* Dirty logging of the buffers and ring elements pushed in a batch */
+static void virtq_log_dirty(struct virtio_virtq *vq, uint64_t gpa, size_t len)
+{
+    vhd_dirty_cache_add(&vq->dirty, vq->log, gpa, len);
+}
+
+static void virtq_log_dirty_ptr(struct virtio_virtq *vq, void *ptr, size_t len)
+{
+    uint64_t gpa = ptr_to_gpa(vq->mm, ptr, &vq->mm_hint);
+    if (gpa != TRANSLATION_FAILED) {
+        virtq_log_dirty(vq, gpa, len);
+    }
+}
+
+static void virtq_log_buffers(struct virtio_virtq *vq,
+                              struct virtq_iov_private *priv)
+{
+    struct virtio_iov *iov = &priv->iov;
+    uint16_t i;
+
+    for (i = 0; i < iov->nvecs; ++i) {
+        if (iov->buffers[i].write_only) {
+            virtq_log_dirty(vq, priv->gpas[i], iov->buffers[i].len);
+        }
+    }
+}
+
+static void virtq_flush_log(struct virtio_virtq *vq)
+{
+    if (vq->log) {
+        vhd_dirty_cache_flush(&vq->dirty, vq->log);
     }
 }
 
 static void virtq_do_notify(struct virtio_virtq *vq)
 {
+    vq->notify_pending = false;
+
     if (vq->notify_fd != -1) {
+        vhd_trace(VHD_TRACE_NOTIFY, vq->trace_id,
+                  vq->packed ? vq->used_idx : vq->used->idx);
+        vq->stat.metrics.notifies++;
         eventfd_write(vq->notify_fd, 1);
     }
 }
 
-static bool virtq_need_notify(struct virtio_virtq *vq)
+/*
+ * Check if the driver needs to be notified after the used position in the
+ * packed ring has moved from @old_idx to @new_idx, the latter with the current
+ * used wrap counter.
+ */
+static bool virtq_need_notify_packed(struct virtio_virtq *vq,
+                                     uint16_t old_idx, uint16_t new_idx)
+{
+    struct pvirtq_event_suppress *event = driver_event(vq);
+    uint16_t flags = event->flags;
+    uint16_t off_wrap, off;
+
+    if (!vq->has_event_idx || flags != RING_EVENT_FLAGS_DESC) {
+        return flags != RING_EVENT_FLAGS_DISABLE;
+    }
+
+    /*
+     * Virtio specification v1.1, 2.7.10: the driver asks to be notified when
+     * the device uses the descriptor at off_wrap.  Unwrap the positions so
+     * that the same check as with a split ring applies.
+     */
+    off_wrap = event->off_wrap;
+    off = off_wrap & ~(1u << 15);
+    if (new_idx <= old_idx) {
+        old_idx -= vq->qsz;
+    }
+    if (vq->used_wrap_counter != (off_wrap >> 15)) {
+        off -= vq->qsz;
+    }
+
+    return (uint16_t)(new_idx - off - 1) < (uint16_t)(new_idx - old_idx);
+}
+
+/*
+ * Check if the driver needs to be notified after used->idx has moved from
+ * @old_idx to @new_idx.
+ */
+static bool virtq_need_notify(struct virtio_virtq *vq,
+                              uint16_t old_idx, uint16_t new_idx)
 {
+    if (vq->packed) {
+        return virtq_need_notify_packed(vq, old_idx, new_idx);
+    }
+
     if (!vq->has_event_idx) {
         /*
          * Virtio specification v1.0, 5.1.6.2.3:
@@ -626,19 +1842,148 @@ static bool virtq_need_notify(struct virtio_virtq *vq)
      * If the idx field in the used ring was
      * equal to used_event, the device MUST send an interrupt.
      * --------------------------------------------------------
-     * Note: code below assumes that virtq_notify is always called
-     * per one completion, and never per batch.
+     * When a batch of elements is published at once, used->idx has passed
+     * used_event iff old_idx <= used_event < new_idx (modulo 2^16).
      */
-    return virtq_get_used_event(vq) == (uint16_t)(vq->used->idx - 1);
+    return (uint16_t)(new_idx - virtq_get_used_event(vq) - 1) <
+        (uint16_t)(new_idx - old_idx);
 }
 
-static void virtq_notify(struct virtio_virtq *vq)
+static void virtq_notify(struct virtio_virtq *vq,
+                         uint16_t old_idx, uint16_t new_idx)
 {
     /* expose used ring entries before checking used event */
     smp_mb();
 
-    if (virtq_need_notify(vq)) {
-        virtq_do_notify(vq);
+    /*
+     * The used event the driver asked for may be behind the published range
+     * by the time a held back notification is sent, so remember it's due
+     */
+    if (!vq->notify_pending && !virtq_need_notify(vq, old_idx, new_idx)) {
+        return;
+    }
+
+    if (vq->coalesce_ns) {
+        uint64_t now = vhd_time_ns();
+
+        if (!vq->notify_pending) {
+            vq->notify_pending = true;
+            vq->notify_coalesced = 0;
+            vq->notify_deadline_ns = now + vq->coalesce_ns;
+        }
+        vq->notify_coalesced += (uint16_t)(new_idx - old_idx);
+
+        if ((!vq->coalesce_max || vq->notify_coalesced < vq->coalesce_max) &&
+            now < vq->notify_deadline_ns) {
+            return;
+        }
+    }
+
+    virtq_do_notify(vq);
+}
+
+/*
+ * The used descriptors following the first one in a batch are exposed to the
+ * driver as they are filled; the driver doesn't look past the first one until
+ * it's exposed, which makes the batch visible at once.
+ */
+static void virtq_flush_used_packed(struct virtio_virtq *vq)
+{
+    uint16_t old_idx = vq->used_idx;
+    uint16_t new_idx = vq->next_used_idx;
+    struct pvirtq_desc *desc = packed_desc(vq, old_idx);
+
+    virtq_inflight_packed_used_prepare(vq);
+
+    smp_wmb();                  /* id and len before flags */
+    desc->flags = packed_used_flags(vq->used_wrap_counter);
+
+    virtq_inflight_packed_used_commit(vq);
+
+    if (vq->log && (vq->flags & VHOST_VRING_F_LOG)) {
+        virtq_log_dirty_ptr(vq, desc, sizeof(*desc));
+    }
+    virtq_flush_log(vq);
+
+    vq->used_idx = new_idx;
+    vq->used_wrap_counter = vq->next_used_wrap_counter;
+    vq->used_pending = 0;
+
+    virtq_notify(vq, old_idx, new_idx);
+}
+
+/* Publish the filled used ring elements and notify the driver if needed. */
+static void virtq_flush_used(struct virtio_virtq *vq)
+{
+    uint16_t old_idx = vq->used->idx;
+    uint16_t new_idx = old_idx + vq->used_pending;
+
+    if (!vq->used_pending) {
+        return;
+    }
+
+    if (vq->packed) {
+        virtq_flush_used_packed(vq);
+        return;
+    }
+
+    smp_wmb();                  /* barrier pair [A] */
+    vq->used->idx = new_idx;
+    vq->used_pending = 0;
+
+    virtq_inflight_used_commit(vq, old_idx, new_idx);
+
+    if (vq->log && (vq->flags & VHOST_VRING_F_LOG)) {
+        /* log modification of used->idx */
+        virtq_log_dirty(vq, vq->used_gpa_base +
+                        offsetof(struct virtq_used, idx),
+                        sizeof(vq->used->idx));
+    }
+    virtq_flush_log(vq);
+
+    virtq_notify(vq, old_idx, new_idx);
+}
+
+static void vhd_log_modified(struct virtio_virtq *vq,
+                             struct virtq_iov_private *priv,
+                             uint16_t used_idx)
+{
+    /* log modifications of buffers in descr */
+    virtq_log_buffers(vq, priv);
+    if (vq->flags & VHOST_VRING_F_LOG) {
+        /* log modification of used->ring[idx] */
+        virtq_log_dirty(vq, vq->used_gpa_base +
+                        offsetof(struct virtq_used, ring[used_idx]),
+                        sizeof(vq->used->ring[0]));
+    }
+}
+
+static void virtq_push_packed(struct virtio_virtq *vq,
+                              struct virtq_iov_private *priv, uint32_t len)
+{
+    struct pvirtq_desc *desc = packed_desc(vq, vq->next_used_idx);
+
+    desc->id = priv->used_head;
+    desc->len = len;
+    /* the first descriptor of a batch is exposed in virtq_flush_used_packed */
+    if (vq->used_pending) {
+        smp_wmb();              /* id and len before flags */
+        desc->flags = packed_used_flags(vq->next_used_wrap_counter);
+    }
+
+    virtq_inflight_packed_used_update(vq, priv->inflight_idx);
+    vq->used_pending++;
+    packed_advance(vq, &vq->next_used_idx, &vq->next_used_wrap_counter,
+                   priv->used_descs);
+
+    VHD_OBJ_DEBUG(vq, "id = %d", priv->used_head);
+
+    if (vq->log) {
+        virtq_log_buffers(vq, priv);
+        if (vq->flags & VHOST_VRING_F_LOG) {
+            /* log modification of the used descriptor */
+            virtq_log_dirty_ptr(vq, desc, sizeof(*desc));
+        }
     }
 }
 
@@ -647,25 +1992,73 @@ void virtq_push(struct virtio_virtq *vq, struct virtio_iov *iov, uint32_t len)
     /* Put buffer head index and len into used ring */
     struct virtq_iov_private *priv = containerof(iov, struct virtq_iov_private,
                                                  iov);
-    uint16_t used_idx = vq->used->idx % vq->qsz;
-    struct virtq_used_elem *used = &vq->used->ring[used_idx];
+    uint16_t used_idx;
+    struct virtq_used_elem *used;
+
+    vhd_trace(VHD_TRACE_USED_PUSH, vq->trace_id, priv->used_head);
+
+    if (vq->fenced) {
+        return;
+    }
+
+    if (vq->packed) {
+        virtq_push_packed(vq, priv, len);
+        goto out;
+    }
+
+    used_idx = (uint16_t)(vq->used->idx + vq->used_pending) % vq->qsz;
+    used = &vq->used->ring[used_idx];
     used->id = priv->used_head;
     used->len = len;
 
     virtq_inflight_used_update(vq, used->id);
+    vq->used_pending++;
 
-    smp_wmb();                  /* barrier pair [A] */
-    vq->used->idx++;
-
-    virtq_inflight_used_commit(vq, used->id);
     VHD_OBJ_DEBUG(vq, "head = %d", priv->used_head);
 
-    /* use memmap the request was started with rather than the current one */
     if (vq->log) {
-        vhd_log_modified(vq, priv->mm, &priv->iov, used_idx);
+        vhd_log_modified(vq, priv, used_idx);
+    }
+
+out:
+    if (!vq->batch_depth) {
+        virtq_flush_used(vq);
+    }
+}
+
+void virtq_begin_batch(struct virtio_virtq *vq)
+{
+    vq->batch_depth++;
+}
+
+void virtq_commit_batch(struct virtio_virtq *vq)
+{
+    VHD_ASSERT(vq->batch_depth);
+
+    if (!--vq->batch_depth) {
+        virtq_flush_used(vq);
+    }
+}
+
+void virtq_flush_notify(struct virtio_virtq *vq)
+{
+    if (vq->notify_pending) {
+        virtq_do_notify(vq);
     }
+}
+
+void virtq_set_mm(struct virtio_virtq *vq, struct vhd_memory_map *mm)
+{
+    vq->mm = mm;
 
-    virtq_notify(vq);
+    /*
+     * Retire the generation right away rather than on the next request, or
+     * the regions dropped from the map would stay mapped while @vq is idle
+     */
+    if (vq->mm_gen && vq->mm_gen->mm != mm) {
+        mm_gen_retire(vq->mm_gen);
+        vq->mm_gen = NULL;
+    }
 }
 
 void virtq_set_notify_fd(struct virtio_virtq *vq, int fd)
@@ -682,6 +2075,109 @@ void virtq_set_notify_fd(struct virtio_virtq *vq, int fd)
     virtq_do_notify(vq);
 }
 
+void virtq_set_base(struct virtio_virtq *vq, uint32_t base)
+{
+    if (!vq->packed) {
+        vq->last_avail = base;
+        return;
+    }
+
+    vq->last_avail = base & 0x7fff;
+    vq->avail_wrap_counter = !!(base & 0x8000);
+    /*
+     * The masters only sending the avail position leave the upper half zero;
+     * the used position is then the same, as all the requests are completed
+     * by the time the vring is stopped
+     */
+    if (!(base >> 16)) {
+        base |= base << 16;
+    }
+    vq->used_idx = (base >> 16) & 0x7fff;
+    vq->used_wrap_counter = !!(base & 0x80000000);
+}
+
+uint32_t virtq_get_base(struct virtio_virtq *vq)
+{
+    if (!vq->packed) {
+        return vq->last_avail;
+    }
+
+    return (vq->last_avail | (uint32_t)vq->avail_wrap_counter << 15) |
+        (vq->used_idx | (uint32_t)vq->used_wrap_counter << 15) << 16;
+}
+
+uint32_t virtq_fence(struct virtio_virtq *vq)
+{
+    VHD_ASSERT(!vq->packed);
+    VHD_ASSERT(!vq->used_pending);
+
+    vq->fenced = true;
+    return vq->used->idx;
+}
+
+bool virtq_has_avail(struct virtio_virtq *vq)
+{
+    if (virtq_is_broken(vq)) {
+        return false;
+    }
+
+    /* requests in flight on start not resubmitted yet */
+    if (vq->num_resubmit) {
+        return true;
+    }
+
+    if (vq->packed) {
+        return packed_desc_is_avail(vq, vq->last_avail, vq->avail_wrap_counter);
+    }
+
+    return vq->avail->idx != vq->last_avail;
+}
+
+static void virtq_log_used(struct virtio_virtq *vq, size_t offset, size_t len)
+{
+    if (vq->log && (vq->flags & VHOST_VRING_F_LOG)) {
+        vhd_mark_gpa_range_dirty(vq->log, vq->used_gpa_base + offset, len);
+    }
+}
+
+void virtq_set_notification(struct virtio_virtq *vq, bool enable)
+{
+    vq->notification_disabled = !enable;
+
+    if (vq->packed) {
+        /*
+         * The driver is never asked to notify about a specific descriptor so
+         * there's nothing to update on re-enable with VIRTIO_F_RING_EVENT_IDX
+         */
+        device_event(vq)->flags = enable ? RING_EVENT_FLAGS_ENABLE :
+                                           RING_EVENT_FLAGS_DISABLE;
+        virtq_log_used(vq, offsetof(struct pvirtq_event_suppress, flags),
+                       sizeof(le16));
+    } else if (vq->has_event_idx) {
+        /*
+         * With VIRTIO_F_RING_EVENT_IDX the driver only notifies when avail->idx
+         * moves past avail_event, so it's enough to leave avail_event behind
+         * while polling, and to move it to the current position on re-enable.
+         */
+        if (enable) {
+            virtq_set_avail_event(vq, vq->avail->idx);
+            virtq_log_used(vq, offsetof(struct virtq_used, ring[vq->qsz]),
+                           sizeof(le16));
+        }
+    } else {
+        if (enable) {
+            vq->used->flags &= ~VIRTQ_USED_F_NO_NOTIFY;
+        } else {
+            vq->used->flags |= VIRTQ_USED_F_NO_NOTIFY;
+        }
+        virtq_log_used(vq, offsetof(struct virtq_used, flags),
+                       sizeof(vq->used->flags));
+    }
+
+    /* notification setting write followed by avail->idx read */
+    smp_mb();
+}
+
 void virtio_virtq_get_stat(struct virtio_virtq *vq,
                            struct vhd_vq_metrics *metrics)
 {
@@ -689,5 +2185,16 @@ void virtio_virtq_get_stat(struct virtio_virtq *vq,
     metrics->dispatch_total = vq->stat.metrics.dispatch_total;
     metrics->dispatch_empty = vq->stat.metrics.dispatch_empty;
     metrics->queue_len_last = vq->stat.metrics.queue_len_last;
-    metrics->queue_len_max_60s = vq->stat.metrics.queue_len_max_60s;
+    /*
+     * The period is only restarted on dispatch, so the maximum of a queue
+     * idle for longer than that is stale
+     */
+    metrics->queue_len_max_60s =
+        vhd_time_ns() - vq->stat.period_start_ts > VIRTQ_STAT_PERIOD_NS ?
+        0 : vq->stat.metrics.queue_len_max_60s;
+    metrics->kicks = vq->stat.metrics.kicks;
+    metrics->notifies = vq->stat.metrics.notifies;
+    metrics->kick_reads = vq->stat.metrics.kick_reads;
+    metrics->dispatch_ns = vhd_cycles_to_ns(vq->stat.dispatch_cycles);
+    metrics->completion_ns = vhd_cycles_to_ns(vq->stat.completion_cycles);
 }
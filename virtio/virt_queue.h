@@ -6,6 +6,8 @@
 #include "vhost_spec.h"
 
 #include "virtio_spec.h"
+#include "memlog.h"
+#include "queue.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -19,11 +21,22 @@ struct virtio_iov {
     struct vhd_buffer buffers[/*nvecs*/];
 };
 
+/*
+ * Size of the area for device-specific per-request data which is allocated
+ * together with every iov, see virtio_iov_get_priv()
+ */
+#define VIRTIO_IOV_PRIV_SIZE    256
+
 struct vhd_memory_map;
 struct vhd_memory_log;
+struct virtq_req_pool;
+struct virtq_mm_gen;
+struct virtq_iov_private;
 
 struct virtio_virtq {
     const char *log_tag;
+    /* id to record trace events with, see trace.h */
+    uint32_t trace_id;
 
     uint32_t flags;
     struct virtq_desc *desc;
@@ -37,17 +50,31 @@ struct virtio_virtq {
     /* Max chain length (for bug compatibility with non-compliant drivers) */
     uint16_t max_chain_len;
 
-    /* Shadow avail ring index */
+    /*
+     * Shadow avail ring index.  In a packed ring, the position of the next
+     * descriptor to be made available by the driver.
+     */
     uint16_t  last_avail;
 
     /*
-     * 2.4.5.3.1: A driver MUST NOT create a descriptor chain longer than
-     * the Queue Size of the device
-     * Thus we can have a known number of preallocated buffers to hold a valid
-     * descriptor chain
+     * Used ring elements filled but not yet exposed to the driver via
+     * used->idx, and the nesting depth of the completion batch they belong to
      */
-    uint16_t next_buffer;           /* Total preallocated buffers used */
-    struct vhd_buffer *buffers;     /* qsz preallocated buffers */
+    uint16_t used_pending;
+    uint16_t batch_depth;
+
+    /*
+     * Request object the descriptor chain being walked is mapped into, and
+     * the number of descriptors in the chain so far.  Chains of up to
+     * VIRTQ_REQ_INLINE_BUFFERS buffers fit in a pooled object; longer ones
+     * are moved to a bigger one as they grow.  The object is kept for the
+     * next chain if the walk fails.
+     */
+    struct virtq_iov_private *cur_req;
+    uint16_t next_desc;
+
+    /* Cache of per-request objects holding iovs */
+    struct virtq_req_pool *req_pool;
 
     /*
      * Virtqueue is broken, probably because there is an invalid descriptor
@@ -56,6 +83,11 @@ struct virtio_virtq {
      */
     bool broken;
 
+    /*
+     * The virtq has been handed over to another user with the requests in
+     * flight, see virtq_fence(): their completions are no longer published.
+     */
+    bool fenced;
 
     /*
      * If set, VIRTIO_F_RING_EVENT_IDX is negotiated for this queue and
@@ -63,16 +95,76 @@ struct virtio_virtq {
      */
     bool has_event_idx;
 
+    /*
+     * If set, VIRTIO_F_RING_PACKED is negotiated for this queue.  @desc then
+     * points to the packed descriptor ring (struct pvirtq_desc), @avail to the
+     * driver event suppression area, and @used (@used_gpa_base) to the device
+     * one (struct pvirtq_event_suppress).
+     */
+    bool packed;
+
+    /*
+     * Packed ring state: wrap counter of @last_avail, position of the next
+     * used descriptor to be exposed to the driver and its wrap counter, and
+     * the same for the next one to be filled.  The latter two advance past
+     * the former ones by the descriptors taken by @used_pending buffers.
+     */
+    bool avail_wrap_counter;
+    bool used_wrap_counter;
+    bool next_used_wrap_counter;
+    uint16_t used_idx;
+    uint16_t next_used_idx;
+
+    /*
+     * If set, the driver is asked not to notify the device about new
+     * available buffers; the device is supposed to poll the avail ring.
+     */
+    bool notification_disabled;
+
+    /*
+     * Max number of available buffers virtq_dequeue_many() may take in one
+     * go, leaving the rest in the avail ring; 0 means no limit.  In-flight
+     * requests resubmitted after reconnect are not limited.
+     */
+    uint16_t max_dequeue;
+
     /*
      * eventfd for used buffers notification.
      * can be reset after virtq is started.
      */
     int notify_fd;
 
+    /*
+     * Notification coalescing: once the driver asks to be notified, the
+     * notification is held back until @coalesce_max more used buffers (if
+     * non-zero) are published, or until @coalesce_ns pass, whichever comes
+     * first; 0 @coalesce_ns notifies right away.  While @notify_pending, the
+     * user of the virtq must call virtq_flush_notify() by @notify_deadline_ns.
+     */
+    uint32_t coalesce_max;
+    uint64_t coalesce_ns;
+    bool notify_pending;
+    uint32_t notify_coalesced;
+    uint64_t notify_deadline_ns;
+
     /* inflight information */
     uint64_t req_cnt;
     struct inflight_split_region *inflight_region;
-    bool inflight_check;
+    struct inflight_packed_region *inflight_packed;
+
+    /*
+     * Inflight entries found in flight on start, left to be resubmitted: one
+     * bit per entry of the inflight region, allocated only if there are any
+     */
+    uint64_t *resubmit_map;
+    uint16_t num_resubmit;
+
+    /*
+     * Inflight entries of the buffers pushed in the current batch, linked
+     * like the free list and returned to it on commit
+     */
+    uint16_t inflight_batch_head;
+    uint16_t inflight_batch_tail;
 
     /*
      * these objects are per-device but storing a link on virtqueue facilitates
@@ -81,17 +173,45 @@ struct virtio_virtq {
     struct vhd_memory_map *mm;
     struct vhd_memory_log *log;
 
+    /*
+     * Generation of @mm the requests are handed out in, holding the virtq's
+     * reference to it; switched when @mm changes
+     */
+    struct virtq_mm_gen *mm_gen;
+
+    /*
+     * Guest memory dirtied by the buffers pushed in the current batch, to be
+     * logged on commit; always empty outside of a batch
+     */
+    struct vhd_dirty_cache dirty;
+
+    /* Index of the memory region the last address translation hit */
+    unsigned mm_hint;
+
     /* Usage statistics */
     struct vq_stat {
         /* Metrics provided to users */
         struct vhd_vq_metrics metrics;
 
         /* Metrics service info fields. Not provided to uses */
-        /* timestamps for periodic metrics */
-        time_t period_start_ts;
+        /* timestamps for periodic metrics, in vhd_time_ns() */
+        uint64_t period_start_ts;
+#define VIRTQ_STAT_PERIOD_NS (60 * 1000000000ull)
+        /* in vhd_cycles(), converted to ns when read */
+        uint64_t dispatch_cycles;
+        uint64_t completion_cycles;
     } stat;
 };
 
+/*
+ * Max number of requests found in flight on start to resubmit per
+ * virtq_dequeue_many() call, ahead of the new ones; the rest are left for the
+ * following calls, as if still available (see virtq_has_avail()), for the
+ * recovery after reconnect not to flood the backend with the whole queue at
+ * once.
+ */
+#define VIRTQ_RESUBMIT_BATCH 32
+
 void virtio_virtq_init(struct virtio_virtq *vq);
 
 void virtio_virtq_release(struct virtio_virtq *vq);
@@ -105,13 +225,95 @@ int virtq_dequeue_many(struct virtio_virtq *vq,
                        virtq_handle_buffers_cb handle_buffers_cb,
                        void *arg);
 
+/*
+ * Buffers taken off the ring by virtq_dequeue_burst(), in ring order
+ */
+struct virtq_burst {
+    STAILQ_HEAD(, virtq_iov_private) iovs;
+};
+
+/*
+ * Callback-free flavor of virtq_dequeue_many() for the device fast paths:
+ * the same buffers are taken off the ring but collected in @burst, for the
+ * caller to hand each one to its own handler as returned by
+ * virtq_burst_next(), so that the per-request call is a direct one the
+ * compiler can inline.  All of them have to be handled, even if an error is
+ * returned for the rest of the ring.  Unlike virtq_dequeue_many(), the
+ * batched completion is up to the caller.
+ */
+int virtq_dequeue_burst(struct virtio_virtq *vq, struct virtq_burst *burst);
+
+/*
+ * Next buffer of @burst, NULL once all of them are handed out
+ */
+struct virtio_iov *virtq_burst_next(struct virtq_burst *burst);
+
 void virtq_push(struct virtio_virtq *vq, struct virtio_iov *iov, uint32_t len);
 
+/*
+ * Batched completion.  Between virtq_begin_batch() and the matching
+ * virtq_commit_batch() virtq_push() only fills used ring elements; used->idx
+ * is published and the driver is notified (if it asked to) once per batch,
+ * in the outermost virtq_commit_batch().  Batches may nest.
+ */
+void virtq_begin_batch(struct virtio_virtq *vq);
+void virtq_commit_batch(struct virtio_virtq *vq);
+
 void virtq_set_notify_fd(struct virtio_virtq *vq, int fd);
 
+/*
+ * Switch @vq over to memory map @mm for the requests to come.  Those already
+ * handed out keep the previous one referenced until they're released.
+ */
+void virtq_set_mm(struct virtio_virtq *vq, struct vhd_memory_map *mm);
+
+/*
+ * Send the driver notification held back by coalescing, if any.
+ */
+void virtq_flush_notify(struct virtio_virtq *vq);
+
+/*
+ * Set and get the vring base as transferred by VHOST_USER_SET_VRING_BASE and
+ * VHOST_USER_GET_VRING_BASE.  For a split ring it's the avail ring index; for
+ * a packed ring it's the position of the next available descriptor and its
+ * wrap counter in bit 15, and the same for the next used descriptor in the
+ * upper 16 bits.
+ */
+void virtq_set_base(struct virtio_virtq *vq, uint32_t base);
+uint32_t virtq_get_base(struct virtio_virtq *vq);
+
+/*
+ * Stop publishing the completions of the buffers in flight, as if the virtq
+ * was abandoned with them: they stay in flight in the inflight region, and
+ * virtq_push() drops them.  Returns the vring base to report for the next
+ * user of the virtq to resubmit them from the inflight region, i.e. with the
+ * avail ring position rewound by the buffers in flight.  Only supported for
+ * split rings.
+ */
+uint32_t virtq_fence(struct virtio_virtq *vq);
+
+/*
+ * Check if the driver has made new buffers available since the last dequeue.
+ */
+bool virtq_has_avail(struct virtio_virtq *vq);
+
+/*
+ * Enable or disable driver notifications about new available buffers.  When
+ * re-enabling, the caller must check virtq_has_avail() afterwards to catch the
+ * buffers made available while notifications were disabled.
+ */
+void virtq_set_notification(struct virtio_virtq *vq, bool enable);
+
 void virtio_free_iov(struct virtio_iov *iov);
 uint16_t virtio_iov_get_head(struct virtio_iov *iov);
 
+/*
+ * Get the VIRTIO_IOV_PRIV_SIZE bytes of memory for device-specific data
+ * associated with @iov.  The contents are undefined on dequeue; the memory is
+ * released together with @iov in virtio_free_iov().
+ */
+void *virtio_iov_get_priv(struct virtio_iov *iov);
+
 void virtio_virtq_get_stat(struct virtio_virtq *vq,
                            struct vhd_vq_metrics *metrics);
 
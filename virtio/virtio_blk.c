@@ -6,17 +6,60 @@
 #include "virtio_blk.h"
 #include "virtio_blk_spec.h"
 
+#include "bdev_cache.h"
+#include "bounce_pool.h"
 #include "bio.h"
 #include "virt_queue.h"
 #include "logging.h"
 
+/*
+ * Discard and write zeroes requests with up to this many ranges don't need
+ * extra allocations
+ */
+#define VIRTIO_BLK_INLINE_RANGES    4
+
+/*
+ * Read and write requests whose data buffers merge into up to this many
+ * don't need extra allocations
+ */
+#define VIRTIO_BLK_INLINE_BUFFERS   2
+
+/*
+ * Data buffers of a request bounced through an aligned buffer: the
+ * scatter-gather list handed to the backend, and the one it replaced
+ */
+struct virtio_blk_bounce {
+    char *data;
+    size_t len;
+    struct vhd_buffer *orig_buffers;
+    size_t orig_nbuffers;
+    struct vhd_buffer buffers[];
+};
+
 /* virtio blk data for bdev io */
 struct virtio_blk_io {
+    struct virtio_blk_dev *dev;
     struct virtio_virtq *vq;
     struct virtio_iov *iov;
     struct vhd_bio bio;
+    /* read cache generation the read was submitted at */
+    uint64_t cache_gen;
+    /* set while the data buffers are bounced, see bounce_io */
+    struct virtio_blk_bounce *bounce;
+    /* next request merged into the same backend request, see merge_flush */
+    struct virtio_blk_io *merge_next;
+    /* split requests only: children not completed yet, and the status */
+    uint32_t split_pending;
+    enum vhd_bdev_io_result split_status;
+    union {
+        struct vhd_bdev_range ranges[VIRTIO_BLK_INLINE_RANGES];
+        struct vhd_buffer buffers[VIRTIO_BLK_INLINE_BUFFERS];
+    };
 };
 
+/* virtio_blk_io is allocated along with the iov */
+VHD_STATIC_ASSERT(sizeof(struct virtio_blk_io) <= VIRTIO_IOV_PRIV_SIZE);
+
 static uint8_t translate_status(enum vhd_bdev_io_result status)
 {
     switch (status) {
@@ -58,17 +101,259 @@ static void complete_req(struct virtio_virtq *vq, struct virtio_iov *iov,
     virtio_free_iov(iov);
 }
 
-static void complete_io(struct vhd_bio *bio)
+static void free_io_data(struct virtio_blk_io *vbio)
 {
-    struct virtio_blk_io *vbio = containerof(bio, struct virtio_blk_io, bio);
+    struct vhd_bdev_io *bdev_io = &vbio->bio.bdev_io;
+
+    if (bdev_io->ranges != vbio->ranges) {
+        vhd_free(bdev_io->ranges);
+    }
+
+    /* merged data buffers, if any; see handle_inout */
+    if (bdev_io->sglist.buffers != vbio->buffers &&
+        bdev_io->sglist.buffers != &vbio->iov->buffers[1]) {
+        vhd_free(bdev_io->sglist.buffers);
+    }
+}
+
+/* Copy @len bytes at @offset in the concatenation of @bufs to @dst */
+static void copy_from_buffers(const struct vhd_buffer *bufs, size_t offset,
+                              void *dst, size_t len)
+{
+    char *p = dst;
+
+    for (; offset >= bufs->len; bufs++) {
+        offset -= bufs->len;
+    }
+
+    while (len) {
+        size_t chunk = MIN(len, bufs->len - offset);
+        memcpy(p, (char *)bufs->base + offset, chunk);
+        p += chunk;
+        len -= chunk;
+        offset = 0;
+        bufs++;
+    }
+}
+
+/* Copy @len bytes from @src to @offset in the concatenation of @bufs */
+static void copy_to_buffers(const struct vhd_buffer *bufs, size_t offset,
+                            const void *src, size_t len)
+{
+    const char *p = src;
+
+    for (; offset >= bufs->len; bufs++) {
+        offset -= bufs->len;
+    }
+
+    while (len) {
+        size_t chunk = MIN(len, bufs->len - offset);
+        memcpy((char *)bufs->base + offset, p, chunk);
+        p += chunk;
+        len -= chunk;
+        offset = 0;
+        bufs++;
+    }
+}
+
+static bool is_aligned_buffer(const struct vhd_buffer *buf, uint32_t align)
+{
+    return VHD_IS_ALIGNED((uintptr_t)buf->base, align) &&
+           VHD_IS_ALIGNED(buf->len, align);
+}
+
+/*
+ * Length of the run of @bufs to bounce starting at *@i, 0 if the buffer
+ * there is aligned; *@i is advanced past the run.  A run starts at a
+ * misaligned buffer and takes the following ones until both its length is
+ * aligned and the next buffer is.
+ */
+static size_t bounce_run(const struct vhd_buffer *bufs, size_t nbufs,
+                         uint32_t align, size_t *i)
+{
+    size_t len = 0;
+
+    if (is_aligned_buffer(&bufs[*i], align)) {
+        (*i)++;
+        return 0;
+    }
+
+    do {
+        len += bufs[(*i)++].len;
+    } while (*i < nbufs && (!VHD_IS_ALIGNED(len, align) ||
+                            !is_aligned_buffer(&bufs[*i], align)));
+
+    return len;
+}
+
+/*
+ * Replace the runs of misaligned data buffers of the read or write request
+ * with parts of an aligned buffer from the bounce pool of the device,
+ * filled with the data to write; requests with aligned buffers only keep
+ * them as is
+ */
+static void bounce_io(struct virtio_blk_dev *dev, struct virtio_blk_io *vbio)
+{
+    struct vhd_bounce_pool *pool = dev->bdev->bounce_pool;
+    uint32_t align = vhd_bounce_pool_align(pool);
+    struct vhd_bdev_io *bdev_io = &vbio->bio.bdev_io;
+    const struct vhd_buffer *bufs = bdev_io->sglist.buffers;
+    size_t nbufs = bdev_io->sglist.nbuffers;
+    struct virtio_blk_bounce *bounce;
+    size_t i, n, len = 0, offset = 0;
+
+    for (i = 0, n = 0; i < nbufs; n++) {
+        len += VHD_ALIGN_UP(bounce_run(bufs, nbufs, align, &i), align);
+    }
+
+    if (!len) {
+        return;
+    }
+
+    bounce = vhd_alloc(sizeof(*bounce) + n * sizeof(bounce->buffers[0]));
+    bounce->data = vhd_bounce_pool_get(pool, len);
+    bounce->len = len;
+    bounce->orig_buffers = bdev_io->sglist.buffers;
+    bounce->orig_nbuffers = nbufs;
+
+    for (i = 0, n = 0; i < nbufs; n++) {
+        size_t first = i;
+        size_t run = bounce_run(bufs, nbufs, align, &i);
+
+        if (!run) {
+            bounce->buffers[n] = bufs[first];
+            continue;
+        }
+
+        bounce->buffers[n] = (struct vhd_buffer) {
+            .base = bounce->data + offset,
+            .len = run,
+            .write_only = bufs[first].write_only,
+        };
+        if (bdev_io->type == VHD_BDEV_WRITE) {
+            copy_from_buffers(&bufs[first], 0, bounce->data + offset, run);
+        }
+        offset += VHD_ALIGN_UP(run, align);
+    }
+
+    bdev_io->sglist.buffers = bounce->buffers;
+    bdev_io->sglist.nbuffers = n;
+    vbio->bounce = bounce;
+}
+
+/*
+ * Put the original data buffers back into the request, with the data read
+ * if @copy_out, and release the bounce buffer
+ */
+static void unbounce_io(struct virtio_blk_io *vbio, bool copy_out)
+{
+    struct virtio_blk_bounce *bounce = vbio->bounce;
+    struct vhd_bdev_io *bdev_io = &vbio->bio.bdev_io;
+    size_t i, offset = 0;
+
+    for (i = 0; copy_out && i < bdev_io->sglist.nbuffers; i++) {
+        const struct vhd_buffer *buf = &bdev_io->sglist.buffers[i];
+        const char *base = buf->base;
+
+        if (base >= bounce->data && base < bounce->data + bounce->len) {
+            copy_to_buffers(bounce->orig_buffers, offset, base, buf->len);
+        }
+        offset += buf->len;
+    }
+
+    bdev_io->sglist.buffers = bounce->orig_buffers;
+    bdev_io->sglist.nbuffers = bounce->orig_nbuffers;
+    vhd_bounce_pool_put(vbio->dev->bdev->bounce_pool, bounce->data);
+    vhd_free(bounce);
+    vbio->bounce = NULL;
+}
+
+static void finish_bounce(struct virtio_blk_io *vbio)
+{
+    if (vbio->bounce) {
+        unbounce_io(vbio, vbio->bio.status == VHD_BDEV_SUCCESS &&
+                    vbio->bio.bdev_io.type == VHD_BDEV_READ);
+    }
+}
 
-    if (likely(bio->status != VHD_BDEV_CANCELED)) {
-        complete_req(vbio->vq, vbio->iov, translate_status(bio->status));
+/*
+ * Keep the read cache coherent with the requests through the device: drop
+ * the blocks being modified, and cache the data read unless invalidated
+ * meanwhile
+ */
+static void cache_update(struct virtio_blk_io *vbio, bool completed)
+{
+    struct vhd_bdev_info *bdev = vbio->dev->bdev;
+    struct vhd_bdev_io *bdev_io = &vbio->bio.bdev_io;
+    uint32_t i;
+
+    switch (bdev_io->type) {
+    case VHD_BDEV_READ:
+        if (completed && vbio->bio.status == VHD_BDEV_SUCCESS) {
+            vhd_bdev_cache_fill(bdev->cache, bdev->cache_image_id, bdev_io,
+                                vbio->cache_gen);
+        }
+        break;
+    case VHD_BDEV_WRITE:
+        vhd_bdev_cache_invalidate(bdev->cache, bdev->cache_image_id,
+                                  bdev_io->first_sector,
+                                  bdev_io->total_sectors);
+        break;
+    case VHD_BDEV_DISCARD:
+    case VHD_BDEV_WRITE_ZEROES:
+        for (i = 0; i < bdev_io->nranges; i++) {
+            vhd_bdev_cache_invalidate(bdev->cache, bdev->cache_image_id,
+                                      bdev_io->ranges[i].first_sector,
+                                      bdev_io->ranges[i].total_sectors);
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+static void finish_io(struct virtio_blk_io *vbio,
+                      enum vhd_bdev_io_result status)
+{
+    free_io_data(vbio);
+
+    if (likely(status != VHD_BDEV_CANCELED)) {
+        complete_req(vbio->vq, vbio->iov, translate_status(status));
     } else {
         virtio_free_iov(vbio->iov);
     }
+}
 
-    vhd_free(vbio);
+static void complete_io(struct vhd_bio *bio)
+{
+    struct virtio_blk_io *vbio = containerof(bio, struct virtio_blk_io, bio);
+
+    finish_bounce(vbio);
+    if (vbio->dev->bdev->cache) {
+        cache_update(vbio, true);
+    }
+
+    finish_io(vbio, bio->status);
+}
+
+/* Complete the requests merged into @bio with its status */
+static void complete_merged(struct vhd_bio *bio)
+{
+    struct virtio_blk_io *mvbio = containerof(bio, struct virtio_blk_io, bio);
+    struct virtio_blk_io *vbio, *next;
+
+    finish_bounce(mvbio);
+    if (mvbio->dev->bdev->cache) {
+        cache_update(mvbio, true);
+    }
+
+    for (vbio = mvbio->merge_next; vbio; vbio = next) {
+        next = vbio->merge_next;
+        finish_io(vbio, bio->status);
+    }
+
+    vhd_free(bio->bdev_io.sglist.buffers);
+    vhd_free(mvbio);
 }
 
 static inline bool vhd_buffer_is_read_only(const struct vhd_buffer *buf)
@@ -129,11 +414,472 @@ static bool is_valid_req(uint64_t sector, size_t len, uint64_t capacity)
     return true;
 }
 
-static void handle_inout(struct virtio_blk_dev *dev,
+static struct virtio_blk_io *init_vbio(struct virtio_blk_dev *dev,
+                                       struct virtio_virtq *vq,
+                                       struct virtio_iov *iov,
+                                       enum vhd_bdev_io_type type)
+{
+    struct virtio_blk_io *vbio = virtio_iov_get_priv(iov);
+    *vbio = (struct virtio_blk_io) {};
+    vbio->dev = dev;
+    vbio->vq = vq;
+    vbio->iov = iov;
+    vbio->bio.head = virtio_iov_get_head(iov);
+    vbio->bio.bdev_io.type = type;
+    vbio->bio.completion_handler = complete_io;
+    return vbio;
+}
+
+/*
+ * Part of a read or write request within a split boundary, with a view of
+ * the data buffers of the request covering it
+ */
+struct virtio_blk_split {
+    struct vhd_bio bio;
+    struct virtio_blk_io *parent;
+    struct vhd_buffer buffers[];
+};
+
+static void split_put(struct virtio_blk_io *vbio)
+{
+    if (--vbio->split_pending) {
+        return;
+    }
+
+    vbio->bio.status = vbio->split_status;
+    vbio->bio.completion_handler(&vbio->bio);
+}
+
+static void complete_split(struct vhd_bio *bio)
+{
+    struct virtio_blk_split *child = containerof(bio, struct virtio_blk_split,
+                                                 bio);
+    struct virtio_blk_io *parent = child->parent;
+
+    /* the first failure wins */
+    if (bio->status != VHD_BDEV_SUCCESS &&
+        parent->split_status == VHD_BDEV_SUCCESS) {
+        parent->split_status = bio->status;
+    }
+
+    vhd_free(child);
+    split_put(parent);
+}
+
+/* Number of buffers covering @len bytes at @buf + @offset */
+static size_t count_buffers(const struct vhd_buffer *buf, size_t offset,
+                            size_t len)
+{
+    size_t n = 0;
+
+    while (len) {
+        len -= MIN(len, buf->len - offset);
+        offset = 0;
+        buf++;
+        n++;
+    }
+
+    return n;
+}
+
+/*
+ * Submit the children of @vbio, one per split boundary it spans; @vbio is
+ * completed once all of them are
+ */
+static void split_io(struct virtio_blk_dev *dev, struct virtio_blk_io *vbio)
+{
+    uint64_t boundary = dev->bdev->split_boundary_sectors;
+    struct vhd_bdev_io *bdev_io = &vbio->bio.bdev_io;
+    const struct vhd_buffer *buf = bdev_io->sglist.buffers;
+    uint64_t sector = bdev_io->first_sector;
+    uint64_t end = sector + bdev_io->total_sectors;
+    size_t offset = 0;
+
+    /* hold a reference for the children completed on submission */
+    vbio->split_pending = 1;
+    vbio->split_status = VHD_BDEV_SUCCESS;
+
+    while (sector < end) {
+        uint64_t child_end = MIN((sector / boundary + 1) * boundary, end);
+        size_t len = (child_end - sector) * VHD_SECTOR_SIZE;
+        size_t nbufs = count_buffers(buf, offset, len);
+        struct virtio_blk_split *child;
+        size_t i;
+
+        child = vhd_zalloc(sizeof(*child) + nbufs * sizeof(child->buffers[0]));
+        child->parent = vbio;
+        child->bio.head = vbio->bio.head;
+        child->bio.completion_handler = complete_split;
+        child->bio.bdev_io = (struct vhd_bdev_io) {
+            .type = bdev_io->type,
+            .first_sector = sector,
+            .total_sectors = child_end - sector,
+            .sglist = {
+                .nbuffers = nbufs,
+                .buffers = child->buffers,
+            },
+            /* the range to read ahead starts where the request ends */
+            .readahead_sectors = child_end == end ?
+                bdev_io->readahead_sectors : 0,
+        };
+
+        for (i = 0; i < nbufs; i++) {
+            size_t chunk = MIN(len, buf->len - offset);
+
+            child->buffers[i] = (struct vhd_buffer) {
+                .base = (char *)buf->base + offset,
+                .len = chunk,
+                .write_only = buf->write_only,
+                .region_id = buf->region_id,
+                .region_offset = buf->region_offset + offset,
+            };
+            len -= chunk;
+            offset += chunk;
+            if (offset == buf->len) {
+                buf++;
+                offset = 0;
+            }
+        }
+
+        vbio->split_pending++;
+        if (dev->dispatch(vbio->vq, &child->bio) != 0) {
+            VHD_LOG_ERROR("bdev request submission failed");
+            child->bio.status = VHD_BDEV_IOERR;
+            complete_split(&child->bio);
+        }
+
+        sector = child_end;
+    }
+
+    split_put(vbio);
+}
+
+/*
+ * Hand the request over to the backend, with the misaligned data buffers
+ * bounced and split at the device split boundaries if it spans several, after
+ * showing it to the track hook whole; the split requests are always accepted
+ */
+static int dispatch_io(struct virtio_blk_dev *dev, struct virtio_blk_io *vbio)
+{
+    uint64_t boundary = dev->bdev->split_boundary_sectors;
+    struct vhd_bdev_io *bdev_io = &vbio->bio.bdev_io;
+    bool rw = bdev_io->type == VHD_BDEV_READ ||
+              bdev_io->type == VHD_BDEV_WRITE;
+    int ret;
+
+    if (dev->bdev->cache) {
+        cache_update(vbio, false);
+    }
+
+    if (dev->bdev->bounce_pool && rw) {
+        bounce_io(dev, vbio);
+    }
+
+    if (dev->track && rw) {
+        dev->track(vbio->vq, bdev_io);
+    }
+
+    if (boundary && rw &&
+        bdev_io->first_sector / boundary !=
+        (bdev_io->first_sector + bdev_io->total_sectors - 1) / boundary) {
+        split_io(dev, vbio);
+        return 0;
+    }
+
+    ret = dev->dispatch(vbio->vq, &vbio->bio);
+    if (ret != 0 && vbio->bounce) {
+        unbounce_io(vbio, false);
+    }
+    return ret;
+}
+
+static void submit_io(struct virtio_blk_dev *dev, struct virtio_blk_io *vbio)
+{
+    int res = dispatch_io(dev, vbio);
+    if (res != 0) {
+        VHD_LOG_ERROR("bdev request submission failed with %d", res);
+        free_io_data(vbio);
+        complete_req(vbio->vq, vbio->iov, VIRTIO_BLK_S_IOERR);
+    }
+
+    /* otherwise request will be completed asynchronously */
+}
+
+/*
+ * Merge the data buffers adjacent in our address space and in the same guest
+ * memory region, keeping the merged ones within @max_len bytes unless 0.
+ * Store them in @merged unless NULL.
+ * Return the number of merged buffers.
+ */
+static size_t merge_buffers(const struct vhd_buffer *bufs, size_t nbufs,
+                            size_t max_len, struct vhd_buffer *merged)
+{
+    struct vhd_buffer cur = bufs[0];
+    size_t n = 0;
+    size_t i;
+
+    for (i = 1; i < nbufs; i++) {
+        if ((char *)cur.base + cur.len == bufs[i].base &&
+            cur.region_id == bufs[i].region_id &&
+            (!max_len || cur.len + bufs[i].len <= max_len)) {
+            cur.len += bufs[i].len;
+            continue;
+        }
+        if (merged) {
+            merged[n] = cur;
+        }
+        n++;
+        cur = bufs[i];
+    }
+    if (merged) {
+        merged[n] = cur;
+    }
+    return n + 1;
+}
+
+/*
+ * Requests of a dispatch pass being merged: a run of VHD_BDEV_READ or
+ * VHD_BDEV_WRITE requests to contiguous sectors, from @first to @last linked
+ * via merge_next, with @nbuffers data buffers in total
+ */
+struct dispatch_ctx {
+    struct virtio_blk_dev *dev;
+    struct virtio_blk_io *first;
+    struct virtio_blk_io *last;
+    uint32_t nbuffers;
+};
+
+/* Submit the run of requests being merged as a single backend request */
+static void merge_flush(struct dispatch_ctx *ctx)
+{
+    struct virtio_blk_dev *dev = ctx->dev;
+    struct virtio_blk_io *first = ctx->first;
+    struct virtio_blk_io *last = ctx->last;
+    struct virtio_blk_io *mvbio, *vbio;
+    struct vhd_buffer *bufs;
+    uint32_t n = 0;
+
+    if (!first) {
+        return;
+    }
+    ctx->first = ctx->last = NULL;
+
+    if (!first->merge_next) {
+        submit_io(dev, first);
+        return;
+    }
+
+    /*
+     * The merged request isn't tied to a descriptor chain of its own; the
+     * data buffers of all the requests are concatenated, and merged further
+     * if they turn out adjacent
+     */
+    bufs = vhd_calloc(ctx->nbuffers, sizeof(bufs[0]));
+    for (vbio = first; vbio; vbio = vbio->merge_next) {
+        size_t nbufs = vbio->iov->nvecs - 2;
+
+        memcpy(&bufs[n], &vbio->iov->buffers[1], nbufs * sizeof(bufs[0]));
+        n += nbufs;
+    }
+    if (dev->bdev->merge_buffers) {
+        n = merge_buffers(bufs, n, dev->bdev->max_segment_size, bufs);
+    }
+
+    mvbio = vhd_zalloc(sizeof(*mvbio));
+    mvbio->dev = dev;
+    mvbio->vq = first->vq;
+    mvbio->cache_gen = first->cache_gen;
+    mvbio->merge_next = first;
+    mvbio->bio.head = first->bio.head;
+    mvbio->bio.completion_handler = complete_merged;
+    mvbio->bio.bdev_io = (struct vhd_bdev_io) {
+        .type = first->bio.bdev_io.type,
+        .first_sector = first->bio.bdev_io.first_sector,
+        .total_sectors = last->bio.bdev_io.first_sector +
+                         last->bio.bdev_io.total_sectors -
+                         first->bio.bdev_io.first_sector,
+        .sglist = {
+            .nbuffers = n,
+            .buffers = bufs,
+        },
+    };
+
+    if (dispatch_io(dev, mvbio) != 0) {
+        VHD_LOG_ERROR("bdev request submission failed");
+        mvbio->bio.status = VHD_BDEV_IOERR;
+        complete_merged(&mvbio->bio);
+    }
+}
+
+/*
+ * Submit the read or write request, merging it into the run of requests
+ * being merged if possible
+ */
+static void merge_submit(struct dispatch_ctx *ctx, struct virtio_blk_io *vbio)
+{
+    struct vhd_bdev_info *bdev = ctx->dev->bdev;
+    struct vhd_bdev_io *bdev_io = &vbio->bio.bdev_io;
+    struct virtio_blk_io *first = ctx->first;
+    uint32_t nbufs = vbio->iov->nvecs - 2;
+
+    if (!bdev->max_merged_sectors) {
+        submit_io(ctx->dev, vbio);
+        return;
+    }
+
+    if (first && bdev_io->type == first->bio.bdev_io.type &&
+        bdev_io->first_sector == ctx->last->bio.bdev_io.first_sector +
+                                 ctx->last->bio.bdev_io.total_sectors &&
+        bdev_io->first_sector + bdev_io->total_sectors -
+        first->bio.bdev_io.first_sector <= bdev->max_merged_sectors &&
+        /* no point merging what is to be split anyway */
+        (!bdev->split_boundary_sectors ||
+         first->bio.bdev_io.first_sector / bdev->split_boundary_sectors ==
+         (bdev_io->first_sector + bdev_io->total_sectors - 1) /
+         bdev->split_boundary_sectors) &&
+        (!bdev->max_segments ||
+         ctx->nbuffers + nbufs <= bdev->max_segments)) {
+        /* the merged request uses the original buffers */
+        free_io_data(vbio);
+        bdev_io->sglist.buffers = &vbio->iov->buffers[1];
+        if (!first->merge_next) {
+            free_io_data(first);
+            first->bio.bdev_io.sglist.buffers = &first->iov->buffers[1];
+        }
+        ctx->last->merge_next = vbio;
+        ctx->last = vbio;
+        ctx->nbuffers += nbufs;
+        return;
+    }
+
+    merge_flush(ctx);
+    ctx->first = ctx->last = vbio;
+    ctx->nbuffers = nbufs;
+}
+
+/*
+ * Hand the data buffers over to the backend in as few scatter-gather entries
+ * as possible.  The merged entries are kept separately, as the original ones
+ * are still needed for completion.
+ */
+static void set_data_buffers(struct virtio_blk_dev *dev,
+                             struct virtio_blk_io *vbio,
+                             struct vhd_buffer *bufs, size_t nbufs)
+{
+    struct vhd_bdev_io *bdev_io = &vbio->bio.bdev_io;
+    struct vhd_buffer *merged;
+    size_t nmerged;
+
+    bdev_io->sglist.nbuffers = nbufs;
+    bdev_io->sglist.buffers = bufs;
+
+    if (!dev->bdev->merge_buffers || nbufs < 2) {
+        return;
+    }
+
+    nmerged = merge_buffers(bufs, nbufs, dev->bdev->max_segment_size, NULL);
+    if (nmerged == nbufs) {
+        return;
+    }
+
+    if (nmerged > VIRTIO_BLK_INLINE_BUFFERS) {
+        merged = vhd_calloc(nmerged, sizeof(merged[0]));
+    } else {
+        merged = vbio->buffers;
+    }
+
+    merge_buffers(bufs, nbufs, dev->bdev->max_segment_size, merged);
+    bdev_io->sglist.nbuffers = nmerged;
+    bdev_io->sglist.buffers = merged;
+}
+
+/*
+ * Vector of the native SIMD width or wider, for the compiler to scan buffers
+ * for zeroes with whatever the target has (SSE2/AVX2, NEON)
+ */
+typedef uint64_t zero_scan_vec __attribute__((vector_size(32)));
+
+static bool is_zero(const char *p, size_t len)
+{
+    uint64_t w;
+
+    /* most of the data that isn't zero is found so by the first word */
+    if (len >= sizeof(w)) {
+        memcpy(&w, p, sizeof(w));
+        if (w) {
+            return false;
+        }
+    }
+
+    while (len >= 4 * sizeof(zero_scan_vec)) {
+        zero_scan_vec v[4];
+
+        memcpy(v, p, sizeof(v));
+        v[0] |= v[1] | v[2] | v[3];
+        if (v[0][0] | v[0][1] | v[0][2] | v[0][3]) {
+            return false;
+        }
+        p += sizeof(v);
+        len -= sizeof(v);
+    }
+
+    for (; len; p++, len--) {
+        if (*p) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/*
+ * Turn the write of all-zero @pdata to @sector into a write zeroes request,
+ * if the device is set up to.  Return true if submitted so.
+ */
+static bool submit_zero_write(struct dispatch_ctx *ctx,
+                              struct virtio_virtq *vq, struct virtio_iov *iov,
+                              uint64_t sector, const struct vhd_buffer *pdata,
+                              size_t ndatabufs, size_t len)
+{
+    struct virtio_blk_dev *dev = ctx->dev;
+    struct virtio_blk_io *vbio;
+    size_t i;
+
+    if (!dev->bdev->detect_zeroes ||
+        len / VIRTIO_BLK_SECTOR_SIZE > dev->config.max_write_zeroes_sectors) {
+        return false;
+    }
+
+    for (i = 0; i < ndatabufs; i++) {
+        if (!is_zero(pdata[i].base, pdata[i].len)) {
+            return false;
+        }
+    }
+
+    /* don't let it overtake the requests being merged */
+    merge_flush(ctx);
+
+    vbio = init_vbio(dev, vq, iov, VHD_BDEV_WRITE_ZEROES);
+    vbio->ranges[0] = (struct vhd_bdev_range) {
+        .first_sector = sector,
+        .total_sectors = len / VIRTIO_BLK_SECTOR_SIZE,
+        .unmap = dev->bdev->detect_zeroes_unmap,
+    };
+    vbio->bio.bdev_io.first_sector = sector;
+    vbio->bio.bdev_io.total_sectors = len / VIRTIO_BLK_SECTOR_SIZE;
+    vbio->bio.bdev_io.nranges = 1;
+    vbio->bio.bdev_io.ranges = vbio->ranges;
+
+    submit_io(dev, vbio);
+    return true;
+}
+
+static void handle_inout(struct dispatch_ctx *ctx,
                          struct virtio_blk_req_hdr *req,
                          struct virtio_virtq *vq,
                          struct virtio_iov *iov)
 {
+    struct virtio_blk_dev *dev = ctx->dev;
     uint8_t status = VIRTIO_BLK_S_IOERR;
     size_t len;
     size_t i;
@@ -176,31 +922,172 @@ static void handle_inout(struct virtio_blk_dev *dev,
         goto complete;
     }
 
-    struct virtio_blk_io *vbio = vhd_zalloc(sizeof(*vbio));
-    vbio->vq = vq;
-    vbio->iov = iov;
-    vbio->bio.bdev_io.type = req->type == VIRTIO_BLK_T_IN ? VHD_BDEV_READ :
-                             VHD_BDEV_WRITE;
+    if (req->type == VIRTIO_BLK_T_OUT &&
+        submit_zero_write(ctx, vq, iov, req->sector, pdata, ndatabufs, len)) {
+        return;
+    }
+
+    struct virtio_blk_io *vbio = init_vbio(dev, vq, iov,
+                                          req->type == VIRTIO_BLK_T_IN ?
+                                          VHD_BDEV_READ : VHD_BDEV_WRITE);
     vbio->bio.bdev_io.first_sector = req->sector;
     vbio->bio.bdev_io.total_sectors = len / VIRTIO_BLK_SECTOR_SIZE;
-    vbio->bio.bdev_io.sglist.nbuffers = ndatabufs;
-    vbio->bio.bdev_io.sglist.buffers = pdata;
-    vbio->bio.completion_handler = complete_io;
+    set_data_buffers(dev, vbio, pdata, ndatabufs);
 
-    int res = dev->dispatch(vbio->vq, &vbio->bio);
-    if (res != 0) {
-        VHD_LOG_ERROR("bdev request submission failed with %d", res);
-        vhd_free(vbio);
+    if (dev->bdev->cache && req->type == VIRTIO_BLK_T_IN) {
+        struct vhd_bdev_info *bdev = dev->bdev;
+
+        vbio->cache_gen = vhd_bdev_cache_gen(bdev->cache,
+                                             bdev->cache_image_id);
+        if (vhd_bdev_cache_read(bdev->cache, bdev->cache_image_id,
+                                &vbio->bio.bdev_io)) {
+            free_io_data(vbio);
+            status = VIRTIO_BLK_S_OK;
+            goto complete;
+        }
+    }
+
+    merge_submit(ctx, vbio);
+    return;
+
+complete:
+    complete_req(vq, iov, status);
+}
+
+static void handle_flush(struct virtio_blk_dev *dev,
+                         struct virtio_virtq *vq,
+                         struct virtio_iov *iov)
+{
+    uint8_t status = VIRTIO_BLK_S_IOERR;
+
+    if (!dev->bdev->writeback_cache) {
+        VHD_LOG_WARN("flush request to device without write cache");
+        status = VIRTIO_BLK_S_UNSUPP;
         goto complete;
     }
 
-    /* request will be completed asynchronously */
+    if (iov->nvecs != 2) {
+        VHD_LOG_ERROR("Bad number of buffers %d in iov", iov->nvecs);
+        goto complete;
+    }
+
+    submit_io(dev, init_vbio(dev, vq, iov, VHD_BDEV_FLUSH));
     return;
 
 complete:
     complete_req(vq, iov, status);
 }
 
+static void handle_discard_write_zeroes(struct virtio_blk_dev *dev,
+                                        struct virtio_blk_req_hdr *req,
+                                        struct virtio_virtq *vq,
+                                        struct virtio_iov *iov)
+{
+    bool discard = req->type == VIRTIO_BLK_T_DISCARD;
+    uint32_t max_sectors = discard ? dev->config.max_discard_sectors :
+                                     dev->config.max_write_zeroes_sectors;
+    uint32_t max_seg = discard ? dev->config.max_discard_seg :
+                                 dev->config.max_write_zeroes_seg;
+    const char *what = discard ? "discard" : "write zeroes";
+    uint8_t status = VIRTIO_BLK_S_IOERR;
+    struct virtio_blk_io *vbio;
+    struct vhd_bdev_range *ranges = NULL;
+    size_t len, nranges;
+    size_t i;
+
+    if (!max_sectors) {
+        VHD_LOG_WARN("%s request to device not supporting it", what);
+        status = VIRTIO_BLK_S_UNSUPP;
+        goto complete;
+    }
+
+    /* See comment about message framing in handle_buffers */
+    if (iov->nvecs < 3) {
+        VHD_LOG_ERROR("Bad number of buffers %d in iov", iov->nvecs);
+        goto complete;
+    }
+
+    struct vhd_buffer *pdata = &iov->buffers[1];
+    size_t ndatabufs = iov->nvecs - 2;
+
+    for (i = 0, len = 0; i < ndatabufs; ++i) {
+        if (!vhd_buffer_is_read_only(pdata + i)) {
+            VHD_LOG_ERROR("Cannot read from data buffer %zu", i);
+            goto complete;
+        }
+
+        len += pdata[i].len;
+    }
+
+    nranges = len / sizeof(struct virtio_blk_discard_write_zeroes);
+    if (!nranges || len % sizeof(struct virtio_blk_discard_write_zeroes)) {
+        VHD_LOG_ERROR("Bad %s request data size %zu", what, len);
+        goto complete;
+    }
+
+    if (nranges > max_seg) {
+        VHD_LOG_ERROR("%s request with %zu segments (max %u)", what, nranges,
+                      max_seg);
+        goto complete;
+    }
+
+    vbio = init_vbio(dev, vq, iov, discard ? VHD_BDEV_DISCARD :
+                                        VHD_BDEV_WRITE_ZEROES);
+    if (nranges > VIRTIO_BLK_INLINE_RANGES) {
+        ranges = vhd_calloc(nranges, sizeof(ranges[0]));
+    } else {
+        ranges = vbio->ranges;
+    }
+    vbio->bio.bdev_io.nranges = nranges;
+    vbio->bio.bdev_io.ranges = ranges;
+
+    for (i = 0; i < nranges; i++) {
+        struct virtio_blk_discard_write_zeroes seg;
+
+        copy_from_buffers(pdata, i * sizeof(seg), &seg, sizeof(seg));
+
+        /*
+         * Virtio specification v1.1, 5.2.6.2: the device MUST set the status
+         * to VIRTIO_BLK_S_UNSUPP for discard commands if the unmap flag is set
+         */
+        if ((seg.flags & ~VIRTIO_BLK_WZ_F_UNMAP) ||
+            (discard && (seg.flags & VIRTIO_BLK_WZ_F_UNMAP))) {
+            VHD_LOG_ERROR("Unsupported %s flags 0x%x", what, seg.flags);
+            status = VIRTIO_BLK_S_UNSUPP;
+            goto out_free;
+        }
+
+        if (seg.num_sectors > max_sectors) {
+            VHD_LOG_ERROR("%s range of %u sectors (max %u)", what,
+                          seg.num_sectors, max_sectors);
+            goto out_free;
+        }
+
+        if (!is_valid_req(seg.sector,
+                          (size_t)seg.num_sectors * VIRTIO_BLK_SECTOR_SIZE,
+                          dev->config.capacity)) {
+            goto out_free;
+        }
+
+        ranges[i] = (struct vhd_bdev_range) {
+            .first_sector = seg.sector,
+            .total_sectors = seg.num_sectors,
+            .unmap = seg.flags & VIRTIO_BLK_WZ_F_UNMAP,
+        };
+    }
+
+    vbio->bio.bdev_io.first_sector = ranges[0].first_sector;
+    vbio->bio.bdev_io.total_sectors = ranges[0].total_sectors;
+
+    submit_io(dev, vbio);
+    return;
+
+out_free:
+    free_io_data(vbio);
+complete:
+    complete_req(vq, iov, status);
+}
+
 static uint8_t handle_getid(struct virtio_blk_dev *dev,
                             struct virtio_iov *iov)
 {
@@ -226,11 +1113,11 @@ static uint8_t handle_getid(struct virtio_blk_dev *dev,
     return VIRTIO_BLK_S_OK;
 }
 
-static void handle_buffers(void *arg, struct virtio_virtq *vq,
+static void handle_buffers(struct dispatch_ctx *ctx, struct virtio_virtq *vq,
                            struct virtio_iov *iov)
 {
     uint8_t status;
-    struct virtio_blk_dev *dev = arg;
+    struct virtio_blk_dev *dev = ctx->dev;
 
     VHD_ASSERT(iov->nvecs >= 1);
     /*
@@ -265,7 +1152,21 @@ static void handle_buffers(void *arg, struct virtio_virtq *vq,
     switch (req->type) {
     case VIRTIO_BLK_T_IN:
     case VIRTIO_BLK_T_OUT:
-        handle_inout(dev, req, vq, iov);
+        handle_inout(ctx, req, vq, iov);
+        return;         /* async completion */
+    default:
+        /* don't let other requests overtake the ones being merged */
+        merge_flush(ctx);
+        break;
+    }
+
+    switch (req->type) {
+    case VIRTIO_BLK_T_FLUSH:
+        handle_flush(dev, vq, iov);
+        return;         /* async completion */
+    case VIRTIO_BLK_T_DISCARD:
+    case VIRTIO_BLK_T_WRITE_ZEROES:
+        handle_discard_write_zeroes(dev, req, vq, iov);
         return;         /* async completion */
     case VIRTIO_BLK_T_GET_ID:
         status = handle_getid(dev, iov);
@@ -284,7 +1185,48 @@ static void handle_buffers(void *arg, struct virtio_virtq *vq,
 int virtio_blk_dispatch_requests(struct virtio_blk_dev *dev,
                                  struct virtio_virtq *vq)
 {
-    return virtq_dequeue_many(vq, handle_buffers, dev);
+    struct dispatch_ctx ctx = { .dev = dev };
+    struct virtq_burst burst;
+    struct virtio_iov *iov;
+    int res;
+
+    /* the requests completed on submission are still notified about at once */
+    virtq_begin_batch(vq);
+    /*
+     * Take the whole burst off the ring first and handle it in a tight loop
+     * with handle_buffers() inlined, rather than calling back per request
+     */
+    res = virtq_dequeue_burst(vq, &burst);
+    while ((iov = virtq_burst_next(&burst))) {
+        handle_buffers(&ctx, vq, iov);
+    }
+    merge_flush(&ctx);
+    virtq_commit_batch(vq);
+
+    return res;
+}
+
+uint64_t virtio_blk_get_features(struct virtio_blk_dev *dev)
+{
+    uint64_t features = VIRTIO_BLK_DEFAULT_FEATURES;
+
+    if (!dev->config.size_max) {
+        features &= ~(1ull << VIRTIO_BLK_F_SIZE_MAX);
+    }
+    if (!dev->bdev->writeback_cache) {
+        features &= ~(1ull << VIRTIO_BLK_F_FLUSH);
+    }
+    if (!dev->config.max_discard_sectors) {
+        features &= ~(1ull << VIRTIO_BLK_F_DISCARD);
+    }
+    if (!dev->config.max_write_zeroes_sectors) {
+        features &= ~(1ull << VIRTIO_BLK_F_WRITE_ZEROES);
+    }
+    if (dev->bdev->readonly) {
+        features |= 1ull << VIRTIO_BLK_F_RO;
+    }
+
+    return features;
 }
 
 int virtio_blk_init_dev(
@@ -307,7 +1249,9 @@ int virtio_blk_init_dev(
     uint8_t phys_block_exp = vhd_find_first_bit32(phys_block_sectors);
 
     dev->dispatch = dispatch;
+    dev->track = NULL;
     dev->bdev = bdev;
+    dev->config = (struct virtio_blk_config) {};
 
     /*
      * Both virtio and block backend use the same sector size of 512.  Don't
@@ -319,13 +1263,16 @@ int virtio_blk_init_dev(
     dev->config.blk_size = VHD_SECTOR_SIZE;
     dev->config.numqueues = bdev->num_queues;
     dev->config.topology.physical_block_exp = phys_block_exp;
-    dev->config.topology.alignment_offset = 0;
-    /* TODO: can get that from bdev info */
-    dev->config.topology.min_io_size = 1;
-    dev->config.topology.opt_io_size = 0;
+    dev->config.topology.alignment_offset =
+        bdev->alignment_offset >> VHD_SECTOR_SHIFT;
+    dev->config.topology.min_io_size =
+        MAX(bdev->min_io_size >> VHD_SECTOR_SHIFT, 1u);
+    dev->config.topology.opt_io_size = bdev->opt_io_size >> VHD_SECTOR_SHIFT;
+
+    dev->config.size_max = bdev->max_segment_size;
 
     /*
-     * Hardcode seg_max to 126. The same way like it's done for virtio-blk in
+     * Default seg_max to 126. The same way like it's done for virtio-blk in
      * qemu 2.12 which is used by blockstor-plugin.
      * Although, this is an error prone approch which leads to the problems
      * when queue size != 128
@@ -333,7 +1280,20 @@ int virtio_blk_init_dev(
      * we have to use it to provide migration compatibility between virtio-blk
      * and vhost-user-blk in both directions.
      */
-    dev->config.seg_max = 128 - 2;
+    dev->config.seg_max = bdev->max_segments ? bdev->max_segments : 128 - 2;
+
+    /* discard and write zeroes make no sense for readonly devices */
+    if (bdev->max_discard_sectors && !bdev->readonly) {
+        dev->config.max_discard_sectors = bdev->max_discard_sectors;
+        dev->config.max_discard_seg = MAX(bdev->max_discard_segments, 1);
+        dev->config.discard_sector_alignment = phys_block_sectors;
+    }
+    if (bdev->max_write_zeroes_sectors && !bdev->readonly) {
+        dev->config.max_write_zeroes_sectors = bdev->max_write_zeroes_sectors;
+        dev->config.max_write_zeroes_seg =
+            MAX(bdev->max_write_zeroes_segments, 1);
+        dev->config.write_zeroes_may_unmap = 1;
+    }
 
     dev->config.geometry.sectors = MIN(dev->config.capacity, max_sectors);
     dev->config.geometry.heads =
@@ -10,18 +10,19 @@ extern "C" {
     (1UL << VIRTIO_F_RING_INDIRECT_DESC) | \
     (1UL << VIRTIO_F_RING_EVENT_IDX) | \
     (1UL << VIRTIO_F_VERSION_1) | \
+    (1UL << VIRTIO_F_RING_PACKED) | \
+    (1UL << VIRTIO_BLK_F_SIZE_MAX) | \
     (1UL << VIRTIO_BLK_F_SEG_MAX) | \
     (1UL << VIRTIO_BLK_F_GEOMETRY) | \
     (1UL << VIRTIO_BLK_F_BLK_SIZE) | \
     (1UL << VIRTIO_BLK_F_TOPOLOGY) | \
-    (1UL << VIRTIO_BLK_F_MQ)))
-
-    /*
-     * TODO: can implement size_max and seg_max to better control request limits
-     * (1UL << VIRTIO_BLK_F_SIZE_MAX) | \
-     */
+    (1UL << VIRTIO_BLK_F_MQ) | \
+    (1UL << VIRTIO_BLK_F_FLUSH) | \
+    (1UL << VIRTIO_BLK_F_DISCARD) | \
+    (1UL << VIRTIO_BLK_F_WRITE_ZEROES)))
 
 struct vhd_bdev_info;
+struct vhd_bdev_io;
 struct vhd_bio;
 
 struct virtio_virtq;
@@ -33,6 +34,15 @@ struct virtio_blk_dev;
 typedef int virtio_blk_io_dispatch(struct virtio_virtq *vq,
                                    struct vhd_bio *bio);
 
+/**
+ * Hook to see the read and write requests as the guest submitted them
+ * (merged with the adjacent ones, if any), before they are split at the
+ * split boundaries.  The readahead hint it sets goes with the part ending
+ * where the request does.
+ */
+typedef void virtio_blk_io_track(struct virtio_virtq *vq,
+                                 struct vhd_bdev_io *bdev_io);
+
 /**
  * Virtio block device context
  */
@@ -44,6 +54,9 @@ struct virtio_blk_dev {
 
     /* Handler to dispatch I/O to underlying block backend */
     virtio_blk_io_dispatch *dispatch;
+
+    /* Optional, set after init */
+    virtio_blk_io_track *track;
 };
 
 /**
@@ -54,6 +67,12 @@ int virtio_blk_init_dev(
     struct vhd_bdev_info *bdev,
     virtio_blk_io_dispatch *dispatch);
 
+/**
+ * Get the features to offer: VIRTIO_BLK_DEFAULT_FEATURES minus the ones the
+ * backend doesn't support, plus VIRTIO_BLK_F_RO for readonly devices
+ */
+uint64_t virtio_blk_get_features(struct virtio_blk_dev *dev);
+
 /**
  * Dispatch requests from device virtq
  */
@@ -29,6 +29,10 @@ extern "C" {
 /* Custom extentions */
 #define VIRTIO_BLK_F_MQ         12  /* Device reports maximum supported queues in numqueues config field */
 
+/* Virtio 1.1 */
+#define VIRTIO_BLK_F_DISCARD        13  /* Device can support discard command. */
+#define VIRTIO_BLK_F_WRITE_ZEROES   14  /* Device can support write zeroes command. */
+
 /* Legacy interface: feature bits */
 #define VIRTIO_BLK_F_BARRIER    0   /* Device supports request barriers. */
 #define VIRTIO_BLK_F_SCSI       7   /* Device supports scsi packet commands. */
@@ -62,6 +66,14 @@ struct VHD_PACKED virtio_blk_config {
     u8 writeback;
     u8 _reserved;
     le16 numqueues;
+    /* Virtio 1.1 */
+    le32 max_discard_sectors;
+    le32 max_discard_seg;
+    le32 discard_sector_alignment;
+    le32 max_write_zeroes_sectors;
+    le32 max_write_zeroes_seg;
+    u8 write_zeroes_may_unmap;
+    u8 _reserved1[3];
 };
 
 /*
@@ -83,6 +95,8 @@ struct virtio_blk_req_hdr {
 #define VIRTIO_BLK_T_OUT        1   /* Device write */
 #define VIRTIO_BLK_T_FLUSH      4   /* Flush */
 #define VIRTIO_BLK_T_GET_ID     8   /* Get device id */
+#define VIRTIO_BLK_T_DISCARD        11  /* Discard */
+#define VIRTIO_BLK_T_WRITE_ZEROES   13  /* Write zeroes */
     le32 type;
     le32 reserved;
     le64 sector;
@@ -90,6 +104,19 @@ struct virtio_blk_req_hdr {
 
 VHD_STATIC_ASSERT(sizeof(struct virtio_blk_req_hdr) == 16);
 
+/*
+ * Data of VIRTIO_BLK_T_DISCARD and VIRTIO_BLK_T_WRITE_ZEROES requests is an
+ * array of these
+ */
+struct virtio_blk_discard_write_zeroes {
+    le64 sector;
+    le32 num_sectors;
+#define VIRTIO_BLK_WZ_F_UNMAP   1
+    le32 flags;
+};
+
+VHD_STATIC_ASSERT(sizeof(struct virtio_blk_discard_write_zeroes) == 16);
+
 #define VIRTIO_BLK_S_OK         0
 #define VIRTIO_BLK_S_IOERR      1
 #define VIRTIO_BLK_S_UNSUPP     2
@@ -1,3 +1,4 @@
+#include <errno.h>
 #include <string.h>
 
 #include "vhost/fs.h"
@@ -18,12 +19,22 @@ struct virtio_fs_io {
     /* TODO: this should be device type-specific */
     struct vhd_bio bio;
 
-    /* FIXME: once OUT/IN buffer split is done properly this won't be needed */
-    struct virtio_fs_out_header *out_hdr;
+    struct vhd_fs_io fs_io;
+
+    /*
+     * copies of the buffer lists for the sglists of @fs_io starting in the
+     * middle of a buffer, allocated on demand; 2 * iov->nvecs entries are
+     * enough for all of them
+     */
+    struct vhd_buffer *split;
+    uint16_t num_split;
 };
 
 #define VIRTIO_VBIO_FROM_BIO(ptr) containerof(ptr, struct virtio_fs_io, bio)
 
+/* virtio_fs_io is allocated along with the iov */
+VHD_STATIC_ASSERT(sizeof(struct virtio_fs_io) <= VIRTIO_IOV_PRIV_SIZE);
+
 /******************************************************************************/
 
 static inline bool vhd_buffer_is_read_only(const struct vhd_buffer *buf)
@@ -45,14 +56,113 @@ static inline void abort_request(struct virtio_virtq *vq, struct virtio_iov *iov
 static void complete_request(struct vhd_bio *bio)
 {
     struct virtio_fs_io *vbio = VIRTIO_VBIO_FROM_BIO(bio);
-    uint32_t len = vbio->out_hdr ? vbio->out_hdr->len : 0;
+    struct virtio_fs_out_header *out = vbio->fs_io.out_hdr;
+    uint32_t len = out ? out->len : 0;
 
     if (likely(bio->status != VHD_BDEV_CANCELED)) {
         virtq_push(vbio->vq, vbio->iov, len);
     }
 
+    vhd_free(vbio->split);
     virtio_free_iov(vbio->iov);
-    vhd_free(vbio);
+}
+
+static void fail_request(struct virtio_fs_io *vbio, int err)
+{
+    struct virtio_fs_out_header *out = vbio->fs_io.out_hdr;
+
+    if (out) {
+        out->len = sizeof(struct virtio_fs_out_header);
+        out->error = err;
+        out->unique = vbio->fs_io.unique;
+    }
+
+    complete_request(&vbio->bio);
+}
+
+/*
+ * Make @sg describe the @nbufs buffers at @bufs past their first @skip bytes;
+ * if that cuts into a buffer the list is copied, to keep the original intact.
+ */
+static int sglist_skip(struct virtio_fs_io *vbio, struct vhd_sglist *sg,
+                       struct vhd_buffer *bufs, uint32_t nbufs, size_t skip)
+{
+    while (nbufs && skip >= bufs->len) {
+        skip -= bufs->len;
+        bufs++;
+        nbufs--;
+    }
+
+    if (skip) {
+        struct vhd_buffer *copy;
+
+        if (!nbufs) {
+            return -EINVAL;
+        }
+
+        if (!vbio->split) {
+            vbio->split = vhd_calloc(2 * vbio->iov->nvecs,
+                                     sizeof(vbio->split[0]));
+        }
+        VHD_ASSERT(vbio->num_split + nbufs <= 2 * vbio->iov->nvecs);
+        copy = vbio->split + vbio->num_split;
+        vbio->num_split += nbufs;
+
+        memcpy(copy, bufs, nbufs * sizeof(bufs[0]));
+        copy[0].base = (char *)copy[0].base + skip;
+        copy[0].region_offset += skip;
+        copy[0].len -= skip;
+        bufs = copy;
+    }
+
+    sg->buffers = bufs;
+    sg->nbuffers = nbufs;
+    return 0;
+}
+
+static int split_request(struct virtio_fs_io *vbio, uint32_t num_in)
+{
+    struct vhd_fs_io *fs_io = &vbio->fs_io;
+    struct vhd_buffer *buffers = vbio->iov->buffers;
+    uint32_t nvecs = vbio->iov->nvecs;
+    int ret;
+
+    ret = sglist_skip(vbio, &fs_io->in_args, buffers, num_in,
+                      sizeof(struct virtio_fs_in_header));
+    if (ret < 0) {
+        return ret;
+    }
+
+    if (fs_io->out_hdr) {
+        ret = sglist_skip(vbio, &fs_io->out_args, buffers + num_in,
+                          nvecs - num_in, sizeof(struct virtio_fs_out_header));
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    switch (fs_io->opcode) {
+    case VIRTIO_FS_OP_READ:
+        fs_io->data = fs_io->out_args;
+        break;
+    case VIRTIO_FS_OP_WRITE:
+        ret = sglist_skip(vbio, &fs_io->data, fs_io->in_args.buffers,
+                          fs_io->in_args.nbuffers,
+                          sizeof(struct virtio_fs_write_in));
+        if (ret < 0) {
+            VHD_LOG_ERROR("FUSE_WRITE arguments too short");
+            return ret;
+        }
+        break;
+    }
+
+    return 0;
+}
+
+struct vhd_fs_io *vhd_get_fs_io(struct vhd_bdev_io *bdev_io)
+{
+    struct vhd_bio *bio = containerof(bdev_io, struct vhd_bio, bdev_io);
+    return &VIRTIO_VBIO_FROM_BIO(bio)->fs_io;
 }
 
 static void handle_buffers(void *arg, struct virtio_virtq *vq, struct virtio_iov *iov)
@@ -73,6 +183,8 @@ static void handle_buffers(void *arg, struct virtio_virtq *vq, struct virtio_iov
 
     struct virtio_fs_in_header *in = NULL;
     struct virtio_fs_out_header *out = NULL;
+    uint32_t num_in;
+    int res;
 
     /* parse IN buffers */
     VHD_ASSERT(buf != buf_end);
@@ -94,6 +206,7 @@ static void handle_buffers(void *arg, struct virtio_virtq *vq, struct virtio_iov
     while (buf != buf_end && vhd_buffer_is_read_only(buf)) {
         ++buf;
     }
+    num_in = buf - iov->buffers;
 
     /* parse OUT buffers */
     if (buf != buf_end) {
@@ -118,27 +231,43 @@ static void handle_buffers(void *arg, struct virtio_virtq *vq, struct virtio_iov
         }
     }
 
-    struct virtio_fs_io *vbio = vhd_zalloc(sizeof(*vbio));
+    struct virtio_fs_io *vbio = virtio_iov_get_priv(iov);
+    *vbio = (struct virtio_fs_io) {};
     vbio->vq = vq;
     vbio->iov = iov;
-    vbio->out_hdr = out;
+    vbio->bio.head = virtio_iov_get_head(iov);
     vbio->bio.bdev_io.sglist.nbuffers = iov->nvecs;
     vbio->bio.bdev_io.sglist.buffers = iov->buffers;
     vbio->bio.completion_handler = complete_request;
+    vbio->fs_io = (struct vhd_fs_io) {
+        .opcode = in->opcode,
+        .unique = in->unique,
+        .nodeid = in->nodeid,
+        .in_hdr = in,
+        .out_hdr = out,
+    };
 
-    int res = dev->dispatch(vbio->vq, &vbio->bio);
+    res = split_request(vbio, num_in);
     if (res != 0) {
-        VHD_LOG_ERROR("request submission failed with %d", res);
+        fail_request(vbio, res);
+        return;
+    }
 
-        if (out) {
-            out->len = sizeof(struct virtio_fs_out_header);
-            out->error = res;
-            out->unique = in->unique;
-        }
+    if (in->opcode < VHD_FS_MAX_INLINE_OPCODE &&
+        dev->inline_ops[in->opcode].handler) {
+        const struct vhd_fs_inline_op *op = &dev->inline_ops[in->opcode];
 
+        op->handler(&vbio->fs_io, op->opaque);
         complete_request(&vbio->bio);
         return;
     }
+
+    res = dev->dispatch(vbio->vq, &vbio->bio);
+    if (res != 0) {
+        VHD_LOG_ERROR("request submission failed with %d", res);
+        fail_request(vbio, res);
+        return;
+    }
 }
 
 /******************************************************************************/
@@ -151,9 +280,22 @@ int virtio_fs_init_dev(
     VHD_VERIFY(dev);
     VHD_VERIFY(fsdev);
 
+    uint32_t i;
+
     dev->dispatch = dispatch;
     dev->fsdev = fsdev;
 
+    memset(dev->inline_ops, 0, sizeof(dev->inline_ops));
+    for (i = 0; i < fsdev->num_inline_ops; i++) {
+        const struct vhd_fs_inline_op *op = &fsdev->inline_ops[i];
+
+        if (op->opcode >= VHD_FS_MAX_INLINE_OPCODE || !op->handler) {
+            VHD_LOG_ERROR("can't handle opcode %u inline", op->opcode);
+            return -EINVAL;
+        }
+        dev->inline_ops[op->opcode] = *op;
+    }
+
     dev->config = (struct virtio_fs_config) {
         .num_request_queues = fsdev->num_queues,
     };
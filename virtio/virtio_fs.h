@@ -1,5 +1,7 @@
 #pragma once
 
+#include "vhost/fs.h"
+
 #include "virtio_fs_spec.h"
 
 #ifdef __cplusplus
@@ -15,7 +17,8 @@ struct vhd_guest_memory_map;
 
 #define VIRTIO_FS_DEFAULT_FEATURES ((uint64_t)( \
     (1UL << VIRTIO_F_RING_INDIRECT_DESC) | \
-    (1UL << VIRTIO_F_VERSION_1)))
+    (1UL << VIRTIO_F_VERSION_1) | \
+    (1UL << VIRTIO_F_RING_PACKED)))
 
 /**
  * Virtio file system I/O dispatch context.
@@ -34,6 +37,9 @@ struct virtio_fs_dev {
 
     /* Handler to dispatch I/O to underlying file system backend */
     virtio_fs_io_dispatch *dispatch;
+
+    /* Opcodes handled inline, indexed by opcode; NULL handler if not */
+    struct vhd_fs_inline_op inline_ops[VHD_FS_MAX_INLINE_OPCODE];
 };
 
 /**
@@ -21,6 +21,17 @@ struct VHD_PACKED virtio_fs_config {
     le32 num_request_queues;
 };
 
+/*
+ * Queue 0 is the hiprio queue (FUSE_INTERRUPT, FUSE_FORGET), followed by the
+ * request queues.
+ */
+#define VIRTIO_FS_HIPRIO_QUEUE 0
+
+/*
+ * Shared memory region ids (VIRTIO_PCI_CAP_SHARED_MEMORY_CFG).
+ */
+#define VIRTIO_FS_SHMCAP_ID_CACHE 0     /* DAX cache window */
+
 /*
  * Generic FUSE request in/out headers.
  * FIXME: these are duplicates of fuse_in_header/fuse_out_header, and should be
@@ -43,6 +54,29 @@ struct virtio_fs_out_header {
     le64 unique;
 };
 
+/*
+ * FUSE opcodes the device handles specially.
+ */
+enum {
+    VIRTIO_FS_OP_FORGET = 2,
+    VIRTIO_FS_OP_READ = 15,
+    VIRTIO_FS_OP_WRITE = 16,
+    VIRTIO_FS_OP_BATCH_FORGET = 42,
+};
+
+/*
+ * FUSE_WRITE arguments, followed by the data (fuse_write_in).
+ */
+struct virtio_fs_write_in {
+    le64 fh;
+    le64 offset;
+    le32 size;
+    le32 write_flags;
+    le64 lock_owner;
+    le32 flags;
+    le32 padding;
+};
+
 /*
  * Device operation request.
  *
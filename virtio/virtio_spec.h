@@ -87,6 +87,44 @@ VHD_STATIC_ASSERT(sizeof(struct virtq_used) == 4);
  * };
 */
 
+/*
+ * Packed virtqueue layout, from virtio spec version 1.1, 2.7.
+ * The descriptor ring is shared by the driver and the device: the driver makes
+ * descriptors available and the device marks them used in place.
+ */
+
+/* This marks a descriptor as available ... */
+#define VIRTQ_DESC_F_AVAIL      (1 << 7)
+/* ... and used, when compared against the wrap counter. */
+#define VIRTQ_DESC_F_USED       (1 << 15)
+
+struct pvirtq_desc {
+    /* Buffer Address. */
+    le64 addr;
+    /* Buffer Length. */
+    le32 len;
+    /* Buffer ID. */
+    le16 id;
+    /* The flags depending on descriptor type. */
+    le16 flags;
+};
+VHD_STATIC_ASSERT(sizeof(struct pvirtq_desc) == 16);
+
+struct pvirtq_event_suppress {
+    /* Descriptor Ring Change Event Offset/Wrap Counter. */
+    le16 off_wrap;
+    /* Descriptor Ring Change Event Flags. */
+#define RING_EVENT_FLAGS_ENABLE     0x0 /* Enable events */
+#define RING_EVENT_FLAGS_DISABLE    0x1 /* Disable events */
+#define RING_EVENT_FLAGS_DESC       0x2 /* Enable events for a specific
+                                           descriptor (as specified by
+                                           off_wrap). Only valid if
+                                           VIRTIO_F_RING_EVENT_IDX has been
+                                           negotiated. */
+    le16 flags;
+};
+VHD_STATIC_ASSERT(sizeof(struct pvirtq_event_suppress) == 4);
+
 static inline unsigned virtq_size(unsigned int qsz)
 {
     return VIRTQ_ALIGN(sizeof(struct virtq_desc) * qsz +